@@ -16,6 +16,9 @@ void save_fpu(void *address)
 void restore_fpu(void *address)
 {
 }
+void fpu_flush_current(void)
+{
+}
 void fpu_ptrace_getfpregs(void *fpregs, struct user_fpregs_struct *regs)
 {
 }
@@ -12,6 +12,7 @@
 #include <onyx/arm64/mmu.h>
 #include <onyx/cpu.h>
 #include <onyx/intrinsics.h>
+#include <onyx/mm/tlb.h>
 #include <onyx/page.h>
 #include <onyx/paging.h>
 #include <onyx/panic.h>
@@ -757,9 +758,15 @@ struct tlb_invalidation_tracker
     unsigned long virt_start{};
     unsigned long virt_end{};
     bool is_started{}, is_flushed{};
+    /* If set, invalidations are added to this batch instead of being done right away */
+    struct tlb_batch *tlb{};
 
     explicit tlb_invalidation_tracker() = default;
 
+    explicit tlb_invalidation_tracker(struct tlb_batch *tlb) : tlb{tlb}
+    {
+    }
+
     void invalidate_tracker()
     {
         virt_start = 0xDEADDAD;
@@ -773,7 +780,10 @@ struct tlb_invalidation_tracker
         if (!is_started)
             return;
 
-        vm_invalidate_range(virt_start, (virt_end - virt_start) >> PAGE_SHIFT);
+        if (tlb)
+            tlb_batch_add_range(tlb, virt_start, virt_end);
+        else
+            vm_invalidate_range(virt_start, (virt_end - virt_start) >> PAGE_SHIFT);
         invalidate_tracker();
     }
 
@@ -841,14 +851,17 @@ constexpr unsigned int addr_get_index(unsigned long virt, unsigned int pt_level)
 #define MMU_UNMAP_CAN_FREE_PML 1
 #define MMU_UNMAP_OK           0
 
-static int arm64_mmu_unmap(PML *table, unsigned int pt_level, page_table_iterator &it)
+/* Unmap a range. Without a TLB batch, nothing is flushed, and page tables aren't freed (as we
+ * can't know when other CPUs stop walking them). */
+static int arm64_mmu_unmap(PML *table, unsigned int pt_level, page_table_iterator &it,
+                           struct tlb_batch *tlb)
 {
     unsigned int index = addr_get_index(it.curr_addr(), pt_level);
 
     /* Get the size that each entry represents here */
     auto entry_size = level_to_entry_size(pt_level);
 
-    tlb_invalidation_tracker invd_tracker;
+    tlb_invalidation_tracker invd_tracker{tlb};
     unsigned int i;
 
 #ifdef CONFIG_PT_ITERATOR_HAVE_DEBUG
@@ -899,7 +912,7 @@ static int arm64_mmu_unmap(PML *table, unsigned int pt_level, page_table_iterato
             unsigned long val = 0;
             __atomic_exchange(&pt_entry, &val, &val, __ATOMIC_RELEASE);
 
-            if (val & ARM64_MMU_AF)
+            if (val & ARM64_MMU_AF && tlb)
             {
                 invd_tracker.add_page(it.curr_addr(), entry_size);
             }
@@ -911,9 +924,9 @@ static int arm64_mmu_unmap(PML *table, unsigned int pt_level, page_table_iterato
         {
             assert((pt_entry & ARM64_MMU_VALID) != 0);
             PML *next_table = (PML *) PHYS_TO_VIRT(PML_EXTRACT_ADDRESS(pt_entry));
-            int st = arm64_mmu_unmap(next_table, pt_level - 1, it);
+            int st = arm64_mmu_unmap(next_table, pt_level - 1, it, tlb);
 
-            if (st == MMU_UNMAP_CAN_FREE_PML)
+            if (st == MMU_UNMAP_CAN_FREE_PML && tlb)
             {
                 auto page = phys_to_page(PML_EXTRACT_ADDRESS(pt_entry));
 
@@ -921,7 +934,8 @@ static int arm64_mmu_unmap(PML *table, unsigned int pt_level, page_table_iterato
 
                 COMPILER_BARRIER();
 
-                free_page(page);
+                /* Other CPUs may still be walking it, free it after the shootdown */
+                tlb_batch_free_table(tlb, page);
                 __atomic_sub_fetch(&allocated_page_tables, 1, __ATOMIC_RELAXED);
                 decrement_vm_stat(it.as_, page_tables_size, PAGE_SIZE);
             }
@@ -946,19 +960,51 @@ static int arm64_mmu_unmap(PML *table, unsigned int pt_level, page_table_iterato
     return MMU_UNMAP_OK;
 }
 
-int vm_mmu_unmap(struct mm_address_space *as, void *addr, size_t pages, struct vm_area_struct *vma)
+/**
+ * @brief Unmap a range, adding the TLB invalidations to a batch
+ *
+ * @param tlb TLB batch (for the address space being unmapped)
+ * @param addr Start of the range
+ * @param pages Number of pages
+ * @param vma VMA being unmapped, if any
+ * @return 0
+ */
+int vm_mmu_unmap_batch(struct tlb_batch *tlb, void *addr, size_t pages,
+                       struct vm_area_struct *vma)
 {
-    unsigned long virt = (unsigned long) addr;
-    size_t size = pages << PAGE_SHIFT;
-
-    page_table_iterator it{virt, size, as};
-
+    struct mm_address_space *as = tlb->mm;
+    page_table_iterator it{(unsigned long) addr, pages << PAGE_SHIFT, as};
     PML *first_level = (PML *) PHYS_TO_VIRT(as->arch_mmu.top_pt);
 
-    arm64_mmu_unmap(first_level, arm64_paging_levels - 1, it);
+    arm64_mmu_unmap(first_level, arm64_paging_levels - 1, it, tlb);
+    assert(it.length() == 0);
+    return 0;
+}
+
+/**
+ * @brief Unmap a kernel range without flushing the TLB (or freeing page tables). The caller
+ * must flush it before reusing the range.
+ *
+ * @param addr Start of the range
+ * @param pages Number of pages
+ * @return 0
+ */
+int vm_mmu_unmap_noflush(void *addr, size_t pages)
+{
+    page_table_iterator it{(unsigned long) addr, pages << PAGE_SHIFT, &kernel_address_space};
+    PML *first_level = (PML *) PHYS_TO_VIRT(kernel_address_space.arch_mmu.top_pt);
 
+    arm64_mmu_unmap(first_level, arm64_paging_levels - 1, it, nullptr);
     assert(it.length() == 0);
+    return 0;
+}
 
+int vm_mmu_unmap(struct mm_address_space *as, void *addr, size_t pages, struct vm_area_struct *vma)
+{
+    struct tlb_batch tlb;
+    tlb_batch_init(&tlb, as);
+    vm_mmu_unmap_batch(&tlb, addr, pages, vma);
+    tlb_batch_finish(&tlb);
     return 0;
 }
 
@@ -972,44 +1018,57 @@ PER_CPU_VAR(unsigned long nr_tlb_shootdowns) = 0;
 
 struct mm_shootdown_info
 {
-    unsigned long addr;
-    size_t pages;
+    const struct tlb_range *ranges;
+    unsigned int nr_ranges;
+    unsigned int flags;
     mm_address_space *mm;
 };
 
+static void arm64_invalidate_ranges(const mm_shootdown_info *info)
+{
+    for (unsigned int i = 0; i < info->nr_ranges; i++)
+    {
+        const struct tlb_range *range = &info->ranges[i];
+        paging_invalidate((void *) range->start, (range->end - range->start) >> PAGE_SHIFT);
+    }
+}
+
 void arm64_invalidate_tlb(void *context)
 {
     auto info = (mm_shootdown_info *) context;
-    auto addr = info->addr;
-    auto pages = info->pages;
-    auto addr_space = info->mm;
-
     auto curr_thread = get_current_thread();
 
-    if (is_higher_half(addr) ||
-        (curr_thread->owner && curr_thread->owner->get_aspace() == addr_space))
-    {
-        paging_invalidate((void *) addr, pages);
-        add_per_cpu(tlb_nr_invals, 1);
-    }
+    if (!is_higher_half(info->ranges[0].start) &&
+        (!curr_thread->owner || curr_thread->owner->get_aspace() != info->mm))
+        return;
+
+    /* No ASIDs yet, so a full flush takes out everything (kernel entries included) */
+    if (info->flags & TLB_BATCH_FLUSH_ALL)
+        __native_tlb_invalidate_all();
+    else
+        arm64_invalidate_ranges(info);
+
+    add_per_cpu(tlb_nr_invals, 1);
 }
 
 /**
- * @brief Invalidates a memory range.
+ * @brief Invalidate a set of ranges in a single shootdown
  *
- * @param addr The start of the memory range.
- * @param pages The size of the memory range, in pages.
- * @param mm The target address space.
+ * @param mm Address space
+ * @param ranges Ranges to invalidate
+ * @param nr_ranges Number of ranges
+ * @param flags TLB_BATCH_* flags
  */
-void mmu_invalidate_range(unsigned long addr, size_t pages, mm_address_space *mm)
+void mmu_invalidate_ranges(mm_address_space *mm, const struct tlb_range *ranges,
+                           unsigned int nr_ranges, unsigned int flags)
 {
     add_per_cpu(nr_tlb_shootdowns, 1);
-    mm_shootdown_info info{addr, pages, mm};
+    mm_shootdown_info info{ranges, nr_ranges, flags, mm};
 
     auto our_cpu = get_cpu_nr();
     cpumask mask;
 
-    if (addr >= VM_HIGHER_HALF)
+    if (is_higher_half(ranges[0].start))
     {
         mask = cpumask::all_but_one(our_cpu);
     }
@@ -1022,6 +1081,19 @@ void mmu_invalidate_range(unsigned long addr, size_t pages, mm_address_space *mm
     smp::sync_call_with_local(arm64_invalidate_tlb, &info, mask, arm64_invalidate_tlb, &info);
 }
 
+/**
+ * @brief Invalidates a memory range.
+ *
+ * @param addr The start of the memory range.
+ * @param pages The size of the memory range, in pages.
+ * @param mm The target address space.
+ */
+void mmu_invalidate_range(unsigned long addr, size_t pages, mm_address_space *mm)
+{
+    const struct tlb_range range = {addr, addr + (pages << PAGE_SHIFT)};
+    mmu_invalidate_ranges(mm, &range, 1, 0);
+}
+
 struct mmu_acct
 {
     size_t page_table_size;
@@ -10,6 +10,7 @@
 #include <onyx/mm/slab.h>
 #include <onyx/riscv/features.h>
 #include <onyx/riscv/intrinsics.h>
+#include <onyx/scheduler.h>
 
 #include <onyx/utility.hpp>
 
@@ -57,6 +58,17 @@ void restore_fpu(void *address)
     }
 }
 
+/**
+ * @brief Write the current thread's live FPU registers (if any) back to its fpu_area
+ *
+ */
+void fpu_flush_current(void)
+{
+    struct thread *curr = get_current_thread();
+    if (curr->fpu_area)
+        save_fpu(curr->fpu_area);
+}
+
 void fpu_ptrace_getfpregs(void *fpregs, struct user_fpregs_struct *regs)
 {
 }
@@ -10,6 +10,8 @@
 #include <stdio.h>
 
 #include <onyx/cpu.h>
+#include <onyx/mm/asid.h>
+#include <onyx/mm/tlb.h>
 #include <onyx/page.h>
 #include <onyx/paging.h>
 #include <onyx/panic.h>
@@ -20,6 +22,10 @@
 #include <onyx/vm.h>
 
 #define RISCV_SATP_4LEVEL_MMU (9UL << 60)
+#define RISCV_SATP_ASID_SHIFT 44
+#define RISCV_SATP_ASID_MASK  (0xffffUL << RISCV_SATP_ASID_SHIFT)
+
+static bool riscv_has_asids;
 
 static const unsigned int riscv_paging_levels = 4;
 static const unsigned int riscv_max_paging_levels = 5;
@@ -59,6 +65,18 @@ static inline void __native_tlb_invalidate_page(void *addr)
     __asm__ __volatile__("sfence.vma %0, zero" ::"r"(addr));
 }
 
+/**
+ * @brief Flush the current ASID's (non-global) TLB entries
+ *
+ */
+static void riscv_flush_current_asid()
+{
+    if (riscv_has_asids)
+        __asm__ __volatile__("sfence.vma zero, %0" ::"r"((unsigned long) asid_current()) : "memory");
+    else
+        __asm__ __volatile__("sfence.vma zero, zero" ::: "memory");
+}
+
 bool pte_empty(uint64_t pte)
 {
     return pte == 0;
@@ -235,6 +253,7 @@ int paging_clone_as(mm_address_space *addr_space, mm_address_space *original)
     memcpy(&p->entries[256], &curr->entries[256], 256 * sizeof(uint64_t));
 
     addr_space->arch_mmu.top_pt = new_pml;
+    mm_tlb_ctx_init(&addr_space->arch_mmu.tlb);
     return 0;
 }
 
@@ -245,6 +264,25 @@ void paging_load_top_pt(PML *pml)
     __asm__ __volatile__("sfence.vma zero, %0" ::"r"(0));
 }
 
+/**
+ * @brief Probe the number of ASID bits and set up the ASID allocator
+ * ASIDLEN is found by writing all ones to satp.ASID and reading it back.
+ */
+static void riscv_asid_init()
+{
+    unsigned long satp = riscv_read_csr(RISCV_SATP);
+    riscv_write_csr(RISCV_SATP, satp | RISCV_SATP_ASID_MASK);
+    unsigned long asids = (riscv_read_csr(RISCV_SATP) & RISCV_SATP_ASID_MASK) >> RISCV_SATP_ASID_SHIFT;
+    riscv_write_csr(RISCV_SATP, satp);
+    __asm__ __volatile__("sfence.vma zero, zero" ::: "memory");
+
+    /* ASID 0 is reserved for the kernel */
+    riscv_has_asids = asids > 0;
+    asid_init(asids);
+    if (riscv_has_asids)
+        pr_info("riscv: Using ASIDs (%lu available)\n", asids);
+}
+
 static void dump_pt(PML *pt)
 {
     for (const auto &entry : pt->entries)
@@ -303,6 +341,7 @@ void paging_protect_kernel(void)
     percpu_map_master_copy();
 
     paging_load_top_pt(pml);
+    riscv_asid_init();
 }
 
 unsigned long total_shootdowns = 0;
@@ -387,7 +426,24 @@ void vm_free_arch_mmu(struct arch_mm_address_space *mm)
  */
 void vm_load_arch_mmu(struct arch_mm_address_space *mm)
 {
-    paging_load_top_pt((PML *) mm->top_pt);
+    bool flush;
+    const auto flags = irq_save_and_disable();
+    unsigned long asid = asid_switch(&mm->tlb, &flush);
+    unsigned long satp = RISCV_SATP_4LEVEL_MMU | (asid << RISCV_SATP_ASID_SHIFT) |
+                         (unsigned long) mm->top_pt >> PAGE_SHIFT;
+
+    if (riscv_read_csr(RISCV_SATP) != satp)
+    {
+        riscv_write_csr(RISCV_SATP, satp);
+        /* Without ASIDs, every address space shares the TLB, so always flush */
+        if (!riscv_has_asids)
+            flush = true;
+    }
+
+    if (flush)
+        riscv_flush_current_asid();
+
+    irq_restore(flags);
 }
 
 /**
@@ -440,58 +496,126 @@ PER_CPU_VAR(unsigned long nr_tlb_shootdowns) = 0;
 
 struct mm_shootdown_info
 {
-    unsigned long addr;
-    size_t pages;
+    const struct tlb_range *ranges;
+    unsigned int nr_ranges;
+    unsigned int flags;
     mm_address_space *mm;
+    unsigned long tlb_gen;
 };
 
+static void riscv_invalidate_ranges(const mm_shootdown_info *info)
+{
+    for (unsigned int i = 0; i < info->nr_ranges; i++)
+    {
+        const struct tlb_range *range = &info->ranges[i];
+        paging_invalidate((void *) range->start, (range->end - range->start) >> PAGE_SHIFT);
+    }
+}
+
 void riscv_invalidate_tlb(void *context)
 {
     auto info = (mm_shootdown_info *) context;
-    auto addr = info->addr;
-    auto pages = info->pages;
-    auto addr_space = info->mm;
-    struct mm_address_space *mm = NULL;
 
-    auto curr_thread = get_current_thread();
-    if (curr_thread)
-        mm = curr_thread->active_mm ?: curr_thread->aspace;
-
-    if (is_higher_half(addr) || mm == addr_space)
+    if (is_higher_half(info->ranges[0].start))
     {
-        paging_invalidate((void *) addr, pages);
+        /* sfence.vma addr, zero flushes the address in every ASID */
+        if (info->flags & TLB_BATCH_FLUSH_ALL)
+            __asm__ __volatile__("sfence.vma zero, zero" ::: "memory");
+        else
+            riscv_invalidate_ranges(info);
         add_per_cpu(tlb_nr_invals, 1);
+        return;
     }
+
+    const auto flags = irq_save_and_disable();
+    switch (asid_flush_loaded(&info->mm->arch_mmu.tlb, info->tlb_gen))
+    {
+        case ASID_FLUSH_RANGE:
+            if (!(info->flags & TLB_BATCH_FLUSH_ALL))
+            {
+                riscv_invalidate_ranges(info);
+                add_per_cpu(tlb_nr_invals, 1);
+                break;
+            }
+            [[fallthrough]];
+        case ASID_FLUSH_ALL:
+            riscv_flush_current_asid();
+            add_per_cpu(tlb_nr_invals, 1);
+            break;
+        case ASID_FLUSH_NONE:
+            break;
+    }
+
+    irq_restore(flags);
+}
+
+static cpumask riscv_shootdown_mask(mm_address_space *mm, unsigned int flags,
+                                    unsigned int our_cpu)
+{
+    cpumask mask = mm->active_mask;
+    mask.remove_cpu(our_cpu);
+
+    /* Lazy CPUs will flush when they switch back to the mm and see the new generation. But they
+     * can still walk the page tables speculatively, so they must hear about freed page tables. */
+    if (!(flags & TLB_BATCH_FREED_TABLES))
+    {
+        cpumask active = mask;
+        active.for_every_cpu([&](unsigned long cpu) -> bool {
+            if (asid_cpu_is_lazy(cpu))
+                mask.remove_cpu(cpu);
+            return true;
+        });
+    }
+
+    return mask;
 }
 
 /**
- * @brief Invalidates a memory range.
+ * @brief Invalidate a set of ranges in a single shootdown
  *
- * @param addr The start of the memory range.
- * @param pages The size of the memory range, in pages.
- * @param mm The target address space.
+ * @param mm Address space
+ * @param ranges Ranges to invalidate
+ * @param nr_ranges Number of ranges
+ * @param flags TLB_BATCH_* flags
  */
-void mmu_invalidate_range(unsigned long addr, size_t pages, mm_address_space *mm)
+void mmu_invalidate_ranges(mm_address_space *mm, const struct tlb_range *ranges,
+                           unsigned int nr_ranges, unsigned int flags)
 {
     add_per_cpu(nr_tlb_shootdowns, 1);
-    mm_shootdown_info info{addr, pages, mm};
+    mm_shootdown_info info{ranges, nr_ranges, flags, mm, 0};
 
     auto our_cpu = get_cpu_nr();
     cpumask mask;
 
-    if (addr >= VM_HIGHER_HALF)
+    if (is_higher_half(ranges[0].start))
     {
         mask = cpumask::all_but_one(our_cpu);
     }
     else
     {
-        mask = mm->active_mask;
-        mask.remove_cpu(our_cpu);
+        /* CPUs that have the mm cached in an ASID, but aren't running it, see the new generation
+         * when they switch back to it and flush then. A whole batch only needs one generation. */
+        info.tlb_gen = mm_tlb_gen_bump(&mm->arch_mmu.tlb);
+        mask = riscv_shootdown_mask(mm, flags, our_cpu);
     }
 
     smp::sync_call_with_local(riscv_invalidate_tlb, &info, mask, riscv_invalidate_tlb, &info);
 }
 
+/**
+ * @brief Invalidates a memory range.
+ *
+ * @param addr The start of the memory range.
+ * @param pages The size of the memory range, in pages.
+ * @param mm The target address space.
+ */
+void mmu_invalidate_range(unsigned long addr, size_t pages, mm_address_space *mm)
+{
+    const struct tlb_range range = {addr, addr + (pages << PAGE_SHIFT)};
+    /* We don't know what the caller did to the page tables, so don't skip lazy CPUs */
+    mmu_invalidate_ranges(mm, &range, 1, TLB_BATCH_FREED_TABLES);
+}
+
 struct mmu_acct
 {
     size_t page_table_size;
@@ -8,6 +8,7 @@
 /* Define the kernel def so we get the extra defs */
 #define __is_onyx_kernel
 
+#include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <sys/time.h>
@@ -18,6 +19,9 @@
 #include <onyx/vdso.h>
 #undef __is_onyx_kernel
 
+#include <uapi/mman.h>
+#include <uapi/random.h>
+
 #include <fixed_point/fixed_point.h>
 
 struct vdso_info
@@ -45,6 +49,23 @@ uint64_t clock_delta_calc(uint64_t start, uint64_t end)
 volatile struct vdso_clock_time clock_realtime = {0};
 volatile struct vdso_clock_time clock_monotonic = {0};
 volatile struct vdso_time __time;
+volatile struct vdso_coarse_time __coarse_time;
+volatile struct vdso_rng_data __rng_data;
+
+/* The compiler is free to emit calls to these, and we don't have a libc to link against */
+__attribute__((visibility("hidden"))) void *memcpy(void *dst, const void *src, size_t n)
+{
+    void *ret = dst;
+    __asm__ __volatile__("rep movsb" : "+D"(dst), "+S"(src), "+c"(n)::"memory");
+    return ret;
+}
+
+__attribute__((visibility("hidden"))) void *memset(void *dst, int c, size_t n)
+{
+    void *ret = dst;
+    __asm__ __volatile__("rep stosb" : "+D"(dst), "+c"(n) : "a"(c) : "memory");
+    return ret;
+}
 
 unsigned long tsc_elapsed_ns(uint64_t start, uint64_t end)
 {
@@ -53,9 +74,46 @@ unsigned long tsc_elapsed_ns(uint64_t start, uint64_t end)
 }
 
 #define SyS_clock_gettime 42
+#define SyS_getrandom     69
+#define SyS_madvise       160
+#define SyS_getcpu        176
+
+#define barrier() __asm__ __volatile__("" ::: "memory")
+
+static int vdso_clock_gettime_coarse(clockid_t clk_id, struct timespec *tp)
+{
+    unsigned int seq;
+
+    /* x86 doesn't reorder loads with other loads, so compiler barriers are enough here */
+    do
+    {
+        while ((seq = __coarse_time.seq) & 1)
+            __builtin_ia32_pause();
+        barrier();
+
+        if (clk_id == CLOCK_REALTIME_COARSE)
+        {
+            tp->tv_sec = __coarse_time.realtime.tv_sec;
+            tp->tv_nsec = __coarse_time.realtime.tv_nsec;
+        }
+        else
+        {
+            tp->tv_sec = __coarse_time.monotonic.tv_sec;
+            tp->tv_nsec = __coarse_time.monotonic.tv_nsec;
+        }
+
+        barrier();
+    } while (__coarse_time.seq != seq);
+
+    return 0;
+}
 
 int __vdso_clock_gettime(clockid_t clk_id, struct timespec *tp)
 {
+    /* The coarse clocks are updated every tick, and don't need the TSC */
+    if (clk_id == CLOCK_REALTIME_COARSE || clk_id == CLOCK_MONOTONIC_COARSE)
+        return vdso_clock_gettime_coarse(clk_id, tp);
+
     if (!__time.using_tsc)
     {
         /* If we're not using the tsc, just do the system call */
@@ -112,3 +170,152 @@ int __vdso_sys_gettimeofday(struct timeval *tv, struct timezone *tz)
     }
     return 0;
 }
+
+int __vdso_getcpu(unsigned int *cpu, unsigned int *node, void *tcache)
+{
+    unsigned int aux;
+
+    /* The kernel keeps TSC_AUX loaded with this CPU's number (and node) */
+    switch (__time.getcpu_mode)
+    {
+        case VDSO_GETCPU_RDPID:
+            /* rdpid %eax, spelled out for older assemblers */
+            __asm__ __volatile__(".byte 0xf3, 0x0f, 0xc7, 0xf8" : "=a"(aux));
+            break;
+        case VDSO_GETCPU_RDTSCP: {
+            unsigned int lo, hi;
+            __asm__ __volatile__("rdtscp" : "=a"(lo), "=d"(hi), "=c"(aux));
+            break;
+        }
+        default:
+            return __vdso_syscall(SyS_getcpu, cpu, node, tcache);
+    }
+
+    if (cpu)
+        *cpu = aux & VDSO_GETCPU_CPU_MASK;
+    if (node)
+        *node = aux >> VDSO_GETCPU_NODE_SHIFT;
+    return 0;
+}
+
+#define VGETRANDOM_SUPPORTED_FLAGS (GRND_NONBLOCK | GRND_RANDOM | GRND_INSECURE)
+
+static ssize_t vgetrandom_syscall(void *buffer, size_t len, unsigned int flags)
+{
+    return __vdso_syscall(SyS_getrandom, buffer, len, flags);
+}
+
+/**
+ * @brief Refill the state's batch, using fast key erasure
+ * The first CHACHA20_KEY_SIZE bytes of keystream replace the key, the rest become the batch.
+ * Previous outputs can't be recovered from the state after this.
+ *
+ * @param state vgetrandom state
+ */
+static void vgetrandom_refill(struct vgetrandom_state *state)
+{
+    uint32_t chacha[CHACHA20_STATE_WORDS];
+    unsigned char buf[sizeof(state->batch) + CHACHA20_KEY_SIZE];
+
+    chacha20_init(chacha, state->key, 0);
+    for (size_t i = 0; i < sizeof(buf); i += CHACHA20_BLOCK_SIZE)
+        chacha20_block(chacha, buf + i);
+
+    memcpy(state->key, buf, CHACHA20_KEY_SIZE);
+    memcpy(state->batch, buf + CHACHA20_KEY_SIZE, sizeof(state->batch));
+    state->pos = 0;
+
+    memset(chacha, 0, sizeof(chacha));
+    memset(buf, 0, sizeof(buf));
+    barrier();
+}
+
+/**
+ * @brief Fetch a fresh key from the kernel
+ * Also marks the state as wipe-on-fork the first time we see it, so a child never replays the
+ * parent's stream: after fork, the child's state reads back as zero and rekeys.
+ *
+ * @param state vgetrandom state
+ * @param generation Current kernel CRNG generation
+ * @return 0 on success, -1 if we should fall back to the system call
+ */
+static int vgetrandom_rekey(struct vgetrandom_state *state, unsigned long generation)
+{
+    if (state->generation == 0)
+    {
+        unsigned long start = (unsigned long) state & -PAGE_SIZE;
+        unsigned long end = ((unsigned long) (state + 1) + PAGE_SIZE - 1) & -PAGE_SIZE;
+        if (__vdso_syscall(SyS_madvise, start, end - start, MADV_WIPEONFORK) < 0)
+            return -1;
+    }
+
+    if (vgetrandom_syscall(state->key, CHACHA20_KEY_SIZE, 0) != CHACHA20_KEY_SIZE)
+        return -1;
+
+    state->generation = generation;
+    /* Throw away the batch, it was generated from the old key */
+    state->pos = sizeof(state->batch);
+    return 0;
+}
+
+ssize_t __vdso_getrandom(void *buffer, size_t len, unsigned int flags, void *opaque_state,
+                         size_t opaque_len)
+{
+    struct vgetrandom_state *state = opaque_state;
+    unsigned char *out = buffer;
+    size_t remaining = len;
+
+    if (!buffer && !len && !flags && opaque_len == ~0UL)
+    {
+        /* Tell userspace how to allocate states */
+        struct vgetrandom_opaque_params *params = opaque_state;
+        memset(params, 0, sizeof(*params));
+        params->size_of_opaque_state = sizeof(struct vgetrandom_state);
+        params->mmap_prot = PROT_READ | PROT_WRITE;
+        params->mmap_flags = MAP_PRIVATE | MAP_ANONYMOUS;
+        return 0;
+    }
+
+    if (!state || opaque_len != sizeof(*state) || flags & ~VGETRANDOM_SUPPORTED_FLAGS ||
+        (unsigned long) state & (_Alignof(struct vgetrandom_state) - 1))
+        return vgetrandom_syscall(buffer, len, flags);
+
+    /* Before the CRNG is up, or if we were interrupted by a signal handler that's also using this
+     * state, just ask the kernel. */
+    if (!__rng_data.is_ready || state->in_use)
+        return vgetrandom_syscall(buffer, len, flags);
+
+    if (len == 0)
+        return 0;
+
+    state->in_use = true;
+    barrier();
+
+    unsigned long generation = __rng_data.generation;
+    if (state->generation != generation && vgetrandom_rekey(state, generation) < 0)
+    {
+        barrier();
+        state->in_use = false;
+        return vgetrandom_syscall(buffer, len, flags);
+    }
+
+    while (remaining)
+    {
+        if (state->pos == sizeof(state->batch))
+            vgetrandom_refill(state);
+
+        size_t avail = sizeof(state->batch) - state->pos;
+        size_t to_copy = remaining < avail ? remaining : avail;
+
+        memcpy(out, state->batch + state->pos, to_copy);
+        /* Don't leave handed out bytes lying around in the state */
+        memset(state->batch + state->pos, 0, to_copy);
+        state->pos += to_copy;
+        out += to_copy;
+        remaining -= to_copy;
+    }
+
+    barrier();
+    state->in_use = false;
+    return len;
+}
@@ -15,6 +15,7 @@
 #include <onyx/cpu.h>
 #include <onyx/irq.h>
 #include <onyx/log.h>
+#include <onyx/mm/numa.h>
 #include <onyx/panic.h>
 #include <onyx/percpu.h>
 #include <onyx/process.h>
@@ -352,6 +353,9 @@ static void parse_lapics()
 
     x86_fixup_lapic_list(x86_get_current_lapic_id());
 
+    for (unsigned int cpu = 0; cpu < lapic_ids.size(); cpu++)
+        numa_set_cpu_node(cpu, acpi_numa_apic_to_node(lapic_ids[cpu]));
+
     // Take this time to do brief init of some SMP stuff that needed the number of CPUs
 
     smp::set_number_of_cpus(nr_cpus);
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2017 - 2023 Pedro Falcato
+ * Copyright (c) 2017 - 2025 Pedro Falcato
  * This file is part of Onyx, and is released under the terms of the GPLv2 License
  * check LICENSE at the root directory for more information
  *
@@ -11,9 +11,10 @@
 
 #include <onyx/cpu.h>
 #include <onyx/fpu.h>
-#include <onyx/static_key.h>
 #include <onyx/x86/avx.h>
 #include <onyx/x86/control_regs.h>
+#include <onyx/x86/fpu.h>
+#include <onyx/x86/msr.h>
 
 static inline void xsetbv(unsigned long r, unsigned long xcr0)
 {
@@ -27,36 +28,41 @@ static inline unsigned long xgetbv(unsigned long r)
     return ret;
 }
 
-extern size_t fpu_area_size;
-extern size_t fpu_area_alignment;
-extern struct static_key avx_supported;
-
 void avx_init()
 {
-    if (x86_has_cap(X86_FEATURE_XSAVE))
+    if (!x86_has_cap(X86_FEATURE_XSAVE))
     {
-        x86_write_cr4(x86_read_cr4() | CR4_OSXSAVE);
+        fpu_init_cache();
+        return;
     }
 
-    if (x86_has_cap(X86_FEATURE_AVX) && x86_has_cap(X86_FEATURE_XSAVE))
+    x86_write_cr4(x86_read_cr4() | CR4_OSXSAVE);
+
+    uint32_t eax, ebx, ecx, edx;
+    ecx = 0;
+    if (!__get_cpuid_count(CPUID_XSTATE, 0, &eax, &ebx, &ecx, &edx))
     {
-        /* If it's supported, set the proper xcr0 bits */
-        int64_t xcr0 = 0;
+        fpu_init_cache();
+        return;
+    }
 
-        xcr0 |= AVX_XCR0_AVX | AVX_XCR0_FPU | AVX_XCR0_SSE;
+    /* Enable every user state component we know how to handle, and that the CPU supports */
+    const uint64_t supported = eax | ((uint64_t) edx << 32);
+    uint64_t xcr0 = AVX_XCR0_FPU | AVX_XCR0_SSE;
 
-        xsetbv(0, xcr0);
+    if (x86_has_cap(X86_FEATURE_AVX))
+        xcr0 |= AVX_XCR0_AVX;
+    /* AVX-512 state can only be enabled together with AVX */
+    if (xcr0 & AVX_XCR0_AVX && x86_has_cap(X86_FEATURE_AVX512f) &&
+        (supported & AVX_XCR0_AVX512) == AVX_XCR0_AVX512)
+        xcr0 |= AVX_XCR0_AVX512;
 
-        uint32_t eax, ebx, ecx, edx;
+    xsetbv(0, xcr0);
 
-        ecx = 0;
-        if (__get_cpuid_count(CPUID_XSTATE, 0, &eax, &ebx, &ecx, &edx))
-        {
-            fpu_area_size = ebx;
-            fpu_area_alignment = AVX_SAVE_ALIGNMENT;
-            static_branch_enable(&avx_supported);
-        }
-    }
+    /* We don't use any supervisor state components */
+    if (x86_has_cap(X86_FEATURE_XSAVES))
+        wrmsr(IA32_XSS, 0);
 
+    fpu_init_xstate(xcr0);
     fpu_init_cache();
 }
@@ -24,11 +24,15 @@
 #include <onyx/internal_abi.h>
 #include <onyx/irq.h>
 #include <onyx/log.h>
+#include <onyx/mm/asid.h>
+#include <onyx/mm/numa.h>
 #include <onyx/panic.h>
 #include <onyx/percpu.h>
 #include <onyx/registers.h>
 #include <onyx/serial.h>
 #include <onyx/spinlock.h>
+#include <onyx/vdso.h>
+#include <onyx/vm.h>
 #include <onyx/x86/alternatives.h>
 #include <onyx/x86/apic.h>
 #include <onyx/x86/avx.h>
@@ -154,6 +158,10 @@ static void __cpu_identify(void)
         bootcpu_info.caps[3] = ecx;
     }
 
+    /* XSAVE extensions (XSAVEOPT, XSAVEC, XSAVES) */
+    if (__get_cpuid_count(CPUID_XSTATE, 1, &eax, &ebx, &ecx, &edx))
+        bootcpu_info.caps[3] |= ((uint64_t) eax) << 32;
+
     if (__get_cpuid(CPUID_ADVANCED_PM, &eax, &ebx, &ecx, &edx))
         bootcpu_info.invariant_tsc = (bool) (edx & (1 << 8));
 
@@ -322,6 +330,10 @@ void x86_setup_standard_control_registers(void)
         cr4 |= CR4_LA57;
     }
 
+    /* We're running on PCID 0 (cr3[11:0] = 0), so PCIDE can be safely set */
+    if (x86_pcid_usable())
+        cr4 |= CR4_PCIDE;
+
     /* Note that CR4_PGE could only be set at this point in time since Intel
      * strongly recommends for it to be set after enabling paging
      */
@@ -370,6 +382,15 @@ void x86_init_percpu(void)
         x86_init_percpu_intel();
     }
 
+    /* The vDSO's getcpu reads the cpu and node numbers back using RDTSCP or RDPID. We run after
+     * parse_lapics (on the BSP) or during AP bringup, so the cpu -> node map is already set up. */
+    if (x86_has_cap(X86_FEATURE_RDTSCP) || x86_has_cap(X86_FEATURE_RDPID))
+    {
+        unsigned int cpu = get_cpu_nr();
+        wrmsr(IA32_TSC_AUX, (cpu & VDSO_GETCPU_CPU_MASK) |
+                                ((unsigned long) cpu_to_node(cpu) << VDSO_GETCPU_NODE_SHIFT));
+    }
+
     pr_info("cpu%u tsc: %lu\n", get_cpu_nr(), rdtsc());
 }
 
@@ -400,6 +421,10 @@ void cpu_init_late(void)
 
     x86_init_percpu();
 
+    asid_init(x86_pcid_usable() ? ASID_NR_SLOTS : 0);
+    if (x86_pcid_usable())
+        pr_info("x86: PCID enabled%s\n", x86_has_cap(X86_FEATURE_INVPCID) ? " (with INVPCID)" : "");
+
     /* Setup the x86 platform defaults */
     x86_platform.has_legacy_devices = true;
     x86_platform.i8042 = I8042_EXPECTED_PRESENT;
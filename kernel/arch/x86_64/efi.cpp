@@ -107,10 +107,11 @@ static void efi_enumerate_memory_map()
 
 void efi_boot_init(EFI_SYSTEM_TABLE *systable)
 {
-    efi_enumerate_memory_map();
-
+    /* page_init needs the RSDP to find the NUMA topology */
     if (efi_state.acpi_table)
         acpi_set_rsdp((uintptr_t) efi_state.acpi_table);
+
+    efi_enumerate_memory_map();
     smbios_set_tables((unsigned long) efi_state.smbios_table,
                       (unsigned long) efi_state.smbios30_table);
 }
@@ -1,82 +1,210 @@
 /*
- * Copyright (c) 2016 - 2023 Pedro Falcato
+ * Copyright (c) 2016 - 2025 Pedro Falcato
  * This file is part of Onyx, and is released under the terms of the GPLv2 License
  * check LICENSE at the root directory for more information
  *
  * SPDX-License-Identifier: GPL-2.0-only
  */
+#include <cpuid.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
+#include <onyx/assert.h>
+#include <onyx/code_patch.h>
+#include <onyx/cpu.h>
 #include <onyx/fpu.h>
+#include <onyx/irq.h>
 #include <onyx/mm/slab.h>
-#include <onyx/static_key.h>
+#include <onyx/percpu.h>
+#include <onyx/vm.h>
+#include <onyx/x86/alternatives.h>
 #include <onyx/x86/avx.h>
 #include <onyx/x86/control_regs.h>
+#include <onyx/x86/fpu.h>
 
 #include <uapi/user.h>
 
-DEFINE_STATIC_KEY_FALSE(avx_supported);
+void do_ldmxcsr(unsigned int a)
+{
+    __asm__ __volatile__("ldmxcsr %0" ::"m"(a));
+}
 
-#define EDX_EAX(var) "d"((uint32_t) (var >> 32)), "a"((uint32_t) var)
+#define FXSAVE_AREA_SIZE      512
+#define FXSAVE_AREA_ALIGNMENT 16
 
-void do_xsave(void *address, long xcr0)
+/* We're using these values by default. However, they may be overwritten by xsave code. */
+size_t fpu_area_size = FXSAVE_AREA_SIZE;
+size_t fpu_area_alignment = FXSAVE_AREA_ALIGNMENT;
+
+size_t fpu_get_save_size(void)
 {
-    __asm__ __volatile__("xsave %0" : "+m"(*(unsigned long *) address) : EDX_EAX(xcr0) : "memory");
+    return fpu_area_size;
 }
 
-void do_fxsave(void *address)
+size_t fpu_get_save_alignment(void)
 {
-    __asm__ __volatile__("fxsave %0" : "=m"(*(unsigned long *) address)::"memory");
+    return fpu_area_alignment;
 }
 
-void do_xrstor(void *address, long xcr0)
+enum fpu_save_mode
 {
-    __asm__ __volatile__("xrstor %0" ::"m"(*(unsigned long *) address), EDX_EAX(xcr0) : "memory");
-}
+    FPU_MODE_FXSAVE = 0,
+    FPU_MODE_XSAVE,
+    FPU_MODE_XSAVEOPT,
+    FPU_MODE_XSAVEC,
+    FPU_MODE_XSAVES,
+};
 
-void do_fxrstor(void *address)
+#define XSAVE_LEGACY_SIZE     512
+#define XSAVE_HEADER_OFFSET   512
+#define XSAVE_EXTENDED_OFFSET 576
+#define XCOMP_BV_COMPACTED    (1ULL << 63)
+#define XFEATURE_MAX          8
+
+struct xsave_header
 {
-    __asm__ __volatile__("fxrstor %0" ::"m"(*(unsigned long *) address) : "memory");
-}
+    uint64_t xstate_bv;
+    uint64_t xcomp_bv;
+    uint64_t reserved[6];
+};
 
-void do_ldmxcsr(unsigned int a)
+static unsigned int fpu_mode = FPU_MODE_FXSAVE;
+static uint64_t fpu_xfeatures = AVX_XCR0_FPU | AVX_XCR0_SSE;
+/* Size of the state in the standard format, as seen by userspace */
+static size_t fpu_user_size = FXSAVE_AREA_SIZE;
+static uint32_t fpu_mxcsr_mask = 0xffbf;
+static bool fpu_compacted;
+
+static unsigned int xstate_sizes[XFEATURE_MAX];
+static unsigned int xstate_offsets[XFEATURE_MAX];
+static unsigned int xstate_comp_offsets[XFEATURE_MAX];
+
+static unsigned int fpu_pick_mode()
 {
-    __asm__ __volatile__("ldmxcsr %0" ::"m"(a));
+    if (!x86_has_cap(X86_FEATURE_XSAVE))
+        return FPU_MODE_FXSAVE;
+    if (x86_has_cap(X86_FEATURE_XSAVES))
+        return FPU_MODE_XSAVES;
+    if (x86_has_cap(X86_FEATURE_XSAVEC))
+        return FPU_MODE_XSAVEC;
+    if (x86_has_cap(X86_FEATURE_XSAVEOPT))
+        return FPU_MODE_XSAVEOPT;
+    return FPU_MODE_XSAVE;
 }
 
-#define FXSAVE_AREA_SIZE      512
-#define FXSAVE_AREA_ALIGNMENT 16
+/* All of these are REX.W encoded, operate on (%rdi) and are 4 bytes long */
+#define FPU_INSN_SIZE 4
 
-/* We're using these values by default. However, they may be overwritten by xsave code. */
-size_t fpu_area_size = FXSAVE_AREA_SIZE;
-size_t fpu_area_alignment = FXSAVE_AREA_ALIGNMENT;
+static const uint8_t fpu_save_insns[][FPU_INSN_SIZE] = {
+    [FPU_MODE_FXSAVE] = {0x48, 0x0f, 0xae, 0x07},   /* fxsave64 (%rdi) */
+    [FPU_MODE_XSAVE] = {0x48, 0x0f, 0xae, 0x27},    /* xsave64 (%rdi) */
+    [FPU_MODE_XSAVEOPT] = {0x48, 0x0f, 0xae, 0x37}, /* xsaveopt64 (%rdi) */
+    [FPU_MODE_XSAVEC] = {0x48, 0x0f, 0xc7, 0x27},   /* xsavec64 (%rdi) */
+    [FPU_MODE_XSAVES] = {0x48, 0x0f, 0xc7, 0x2f},   /* xsaves64 (%rdi) */
+};
 
-size_t fpu_get_save_size(void)
+static const uint8_t fpu_restore_insns[][FPU_INSN_SIZE] = {
+    [FPU_MODE_FXSAVE] = {0x48, 0x0f, 0xae, 0x0f},   /* fxrstor64 (%rdi) */
+    [FPU_MODE_XSAVE] = {0x48, 0x0f, 0xae, 0x2f},    /* xrstor64 (%rdi) */
+    [FPU_MODE_XSAVEOPT] = {0x48, 0x0f, 0xae, 0x2f}, /* xrstor64 (%rdi) */
+    [FPU_MODE_XSAVEC] = {0x48, 0x0f, 0xae, 0x2f},   /* xrstor64 (%rdi) */
+    [FPU_MODE_XSAVES] = {0x48, 0x0f, 0xc7, 0x1f},   /* xrstors64 (%rdi) */
+};
+
+static void fpu_save_patch(code_patch_location *loc)
 {
-    return fpu_area_size;
+    fpu_mode = fpu_pick_mode();
+    code_patch::replace_instructions(loc->address, fpu_save_insns[fpu_mode], FPU_INSN_SIZE,
+                                     loc->size);
 }
 
-size_t fpu_get_save_alignment(void)
+static void fpu_restore_patch(code_patch_location *loc)
 {
-    return fpu_area_alignment;
+    fpu_mode = fpu_pick_mode();
+    code_patch::replace_instructions(loc->address, fpu_restore_insns[fpu_mode], FPU_INSN_SIZE,
+                                     loc->size);
 }
 
+// clang-format off
+#define FPU_ALTERNATIVE                       \
+    "4096: .fill " stringify(FPU_INSN_SIZE) ", 1, 0xcc\n\t" \
+    ".pushsection .code_patch\n\t"            \
+    ".quad 4096b\n\t"                         \
+    ".quad " stringify(FPU_INSN_SIZE) "\n\t"  \
+    ".quad %c[patch]\n\t"                     \
+    ".quad 0\n\t"                             \
+    ".quad 0\n\t"                             \
+    ".popsection\n\t"
+// clang-format on
+
 void save_fpu(void *address)
 {
-    if (static_branch_likely(&avx_supported))
-        do_xsave(address, AVX_XCR0_FPU | AVX_XCR0_SSE | AVX_XCR0_AVX);
-    else
-        do_fxsave(address);
+    /* Patched at boot with the best save instruction we have (see fpu_pick_mode). The requested
+     * feature bitmap in edx:eax is ignored by fxsave. */
+    __asm__ __volatile__(FPU_ALTERNATIVE ::[patch] "i"(fpu_save_patch), "D"(address),
+                         "a"((uint32_t) fpu_xfeatures), "d"((uint32_t) (fpu_xfeatures >> 32))
+                         : "memory");
 }
 
 void restore_fpu(void *address)
 {
-    if (static_branch_likely(&avx_supported))
-        do_xrstor(address, AVX_XCR0_FPU | AVX_XCR0_SSE | AVX_XCR0_AVX);
-    else
-        do_fxrstor(address);
+    __asm__ __volatile__(FPU_ALTERNATIVE ::[patch] "i"(fpu_restore_patch), "D"(address),
+                         "a"((uint32_t) fpu_xfeatures), "d"((uint32_t) (fpu_xfeatures >> 32))
+                         : "memory");
+}
+
+/**
+ * @brief Set up the XSAVE area layout for the enabled state components
+ * Called by avx_init, after XCR0 is set up.
+ *
+ * @param xcr0 Enabled state components
+ */
+void fpu_init_xstate(uint64_t xcr0)
+{
+    static bool xstate_initialized = false;
+    uint32_t eax = 0, ebx = 0, ecx = 0, edx = 0;
+
+    if (xstate_initialized)
+        return;
+    xstate_initialized = true;
+
+    fpu_mode = fpu_pick_mode();
+    fpu_xfeatures = xcr0;
+    fpu_compacted = fpu_mode == FPU_MODE_XSAVEC || fpu_mode == FPU_MODE_XSAVES;
+
+    /* EBX reports the size required by the features currently enabled in XCR0 */
+    __get_cpuid_count(CPUID_XSTATE, 0, &eax, &ebx, &ecx, &edx);
+    fpu_user_size = ebx;
+
+    unsigned int comp_offset = XSAVE_EXTENDED_OFFSET;
+    for (unsigned int i = 2; i < XFEATURE_MAX; i++)
+    {
+        if (!(xcr0 & (1ULL << i)))
+            continue;
+        __get_cpuid_count(CPUID_XSTATE, i, &eax, &ebx, &ecx, &edx);
+        xstate_sizes[i] = eax;
+        xstate_offsets[i] = ebx;
+
+        /* ECX[1] tells us if the component is 64-byte aligned in the compacted format */
+        if (ecx & (1 << 1))
+            comp_offset = ALIGN_TO(comp_offset, 64);
+        xstate_comp_offsets[i] = comp_offset;
+        comp_offset += eax;
+    }
+
+    fpu_area_size = fpu_user_size;
+    if (fpu_compacted && comp_offset > fpu_area_size)
+        fpu_area_size = comp_offset;
+    fpu_area_alignment = AVX_SAVE_ALIGNMENT;
+
+    printf("fpu: Using %s, %zu byte state (xfeatures %lx)\n",
+           fpu_mode == FPU_MODE_XSAVES     ? "xsaves"
+           : fpu_mode == FPU_MODE_XSAVEC   ? "xsavec"
+           : fpu_mode == FPU_MODE_XSAVEOPT ? "xsaveopt"
+                                           : "xsave",
+           fpu_area_size, fpu_xfeatures);
 }
 
 struct fpu_area
@@ -86,11 +214,8 @@ struct fpu_area
     uint8_t ftw;
     uint8_t res0;
     uint16_t fop;
-    uint32_t fpu_ip;
-    uint32_t fpu_cs;
-    uint32_t fpu_dp;
-    uint16_t ds;
-    uint16_t res1;
+    uint64_t fpu_ip;
+    uint64_t fpu_dp;
     uint32_t mxcsr;
     uint32_t mxcsr_mask;
     uint8_t registers[0];
@@ -100,6 +225,13 @@ void setup_fpu_area(unsigned char *address)
 {
     struct fpu_area *area = (struct fpu_area *) address;
     area->mxcsr = 0x1F80;
+
+    if (fpu_compacted)
+    {
+        /* xrstor(s) of a compacted area requires XCOMP_BV to describe the format */
+        struct xsave_header *hdr = (struct xsave_header *) (address + XSAVE_HEADER_OFFSET);
+        hdr->xcomp_bv = XCOMP_BV_COMPACTED | fpu_xfeatures;
+    }
 }
 
 void fpu_ptrace_getfpregs(void *__fpregs, struct user_fpregs_struct *regs)
@@ -116,6 +248,204 @@ void fpu_ptrace_getfpregs(void *__fpregs, struct user_fpregs_struct *regs)
     memcpy(regs->st_space, &fpregs->registers, sizeof(regs->st_space) + sizeof(regs->xmm_space));
 }
 
+/* The thread whose registers were last loaded into (or saved from) this CPU's FPU */
+static PER_CPU_VAR(struct thread *fpu_owner) = nullptr;
+
+/**
+ * @brief Save the thread's FPU registers (if live) when switching it out
+ *
+ * @param thread Thread being switched out
+ */
+void fpu_switch_out(struct thread *thread)
+{
+    if (fpu_needs_load(thread))
+        return;
+
+    save_fpu(thread->fpu_area);
+    write_per_cpu(fpu_owner, thread);
+    thread->fpu_cpu = get_cpu_nr();
+    thread_set_flag(thread, THREAD_NEED_FPU_LOAD);
+}
+
+/**
+ * @brief Load the current thread's FPU state into the registers, if needed
+ * Must be called with irqs disabled, right before returning to userspace.
+ */
+void fpu_load_current(void)
+{
+    struct thread *curr = get_current_thread();
+    unsigned int cpu = get_cpu_nr();
+
+    DCHECK(irq_is_disabled());
+
+    if (!fpu_needs_load(curr))
+        return;
+
+    /* If no one touched the FPU since we were switched out (on this CPU), the registers are
+     * still ours. */
+    if (get_per_cpu(fpu_owner) != curr || curr->fpu_cpu != cpu)
+    {
+        restore_fpu(curr->fpu_area);
+        write_per_cpu(fpu_owner, curr);
+        curr->fpu_cpu = cpu;
+    }
+
+    __atomic_and_fetch(&curr->flags, ~THREAD_NEED_FPU_LOAD, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Mark the current thread's FPU registers as stale
+ * Used before writing to fpu_area, so a context switch doesn't overwrite our changes and the new
+ * state is loaded on the way back to userspace.
+ */
+void fpu_invalidate_current(void)
+{
+    struct thread *curr = get_current_thread();
+    unsigned long flags = irq_save_and_disable();
+    thread_set_flag(curr, THREAD_NEED_FPU_LOAD);
+    curr->fpu_cpu = -1U;
+    irq_restore(flags);
+}
+
+/**
+ * @brief Write the current thread's live FPU registers (if any) back to its fpu_area
+ *
+ */
+void fpu_flush_current(void)
+{
+    struct thread *curr = get_current_thread();
+
+    if (curr->flags & THREAD_KERNEL)
+        return;
+
+    unsigned long flags = irq_save_and_disable();
+    if (!fpu_needs_load(curr))
+        save_fpu(curr->fpu_area);
+    irq_restore(flags);
+}
+
+static const void *xstate_component(const void *buf, unsigned int feature)
+{
+    return (const uint8_t *) buf +
+           (fpu_compacted ? xstate_comp_offsets[feature] : xstate_offsets[feature]);
+}
+
+/**
+ * @brief Copy an FPU state to a user buffer, in the standard (non-compacted) XSAVE format
+ *
+ * @param ubuf User buffer, fpu_get_save_size() bytes
+ * @param kbuf FPU state
+ * @return 0 on success, negative error codes
+ */
+int fpu_copy_to_user(void *ubuf, const void *kbuf)
+{
+    uint8_t *dst = (uint8_t *) ubuf;
+
+    if (fpu_mode == FPU_MODE_FXSAVE)
+        return copy_to_user(ubuf, kbuf, FXSAVE_AREA_SIZE) < 0 ? -EFAULT : 0;
+
+    struct xsave_header hdr;
+    memcpy(&hdr, (const uint8_t *) kbuf + XSAVE_HEADER_OFFSET, sizeof(hdr));
+    const uint64_t xstate_bv = hdr.xstate_bv & fpu_xfeatures;
+
+    /* Components in their init state aren't written by xsaveopt/xsavec/xsaves, so what's in the
+     * buffer for them may be stale. Give userspace the init values instead. */
+    uint8_t legacy[XSAVE_LEGACY_SIZE];
+    memcpy(legacy, kbuf, sizeof(legacy));
+    struct fpu_area *area = (struct fpu_area *) legacy;
+
+    if (!(xstate_bv & AVX_XCR0_FPU))
+    {
+        area->fcw = 0x37f;
+        area->fsw = area->ftw = area->fop = 0;
+        area->fpu_ip = area->fpu_dp = 0;
+        memset(area->registers, 0, 8 * 16);
+    }
+
+    if (!(xstate_bv & AVX_XCR0_SSE))
+        memset(area->registers + 8 * 16, 0, 16 * 16);
+
+    if (copy_to_user(dst, legacy, sizeof(legacy)) < 0)
+        return -EFAULT;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.xstate_bv = xstate_bv;
+    if (copy_to_user(dst + XSAVE_HEADER_OFFSET, &hdr, sizeof(hdr)) < 0)
+        return -EFAULT;
+
+    for (unsigned int i = 2; i < XFEATURE_MAX; i++)
+    {
+        if (!(fpu_xfeatures & (1ULL << i)))
+            continue;
+
+        /* Every component we support has an all-zeroes init state */
+        ssize_t st = xstate_bv & (1ULL << i)
+                         ? copy_to_user(dst + xstate_offsets[i], xstate_component(kbuf, i),
+                                        xstate_sizes[i])
+                         : user_memset(dst + xstate_offsets[i], 0, xstate_sizes[i]);
+        if (st < 0)
+            return -EFAULT;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Copy (and validate) an FPU state from a user buffer, in the standard XSAVE format
+ * Validation makes sure restoring the state can't fault.
+ *
+ * @param kbuf FPU state
+ * @param ubuf User buffer, fpu_get_save_size() bytes
+ * @return 0 on success, -EFAULT or -EINVAL
+ */
+int fpu_copy_from_user(void *kbuf, const void *ubuf)
+{
+    const uint8_t *src = (const uint8_t *) ubuf;
+    uint8_t *dst = (uint8_t *) kbuf;
+    const struct fpu_area *area = (const struct fpu_area *) kbuf;
+
+    if (fpu_mode == FPU_MODE_FXSAVE)
+    {
+        if (copy_from_user(kbuf, ubuf, FXSAVE_AREA_SIZE) < 0)
+            return -EFAULT;
+        return area->mxcsr & ~fpu_mxcsr_mask ? -EINVAL : 0;
+    }
+
+    if (copy_from_user(kbuf, ubuf, XSAVE_EXTENDED_OFFSET) < 0)
+        return -EFAULT;
+
+    struct xsave_header *hdr = (struct xsave_header *) (dst + XSAVE_HEADER_OFFSET);
+
+    /* Userspace only gets to use the standard format, and can't enable features we don't
+     * support. */
+    if (hdr->xstate_bv & ~fpu_xfeatures || hdr->xcomp_bv)
+        return -EINVAL;
+
+    for (uint64_t reserved : hdr->reserved)
+    {
+        if (reserved)
+            return -EINVAL;
+    }
+
+    if (area->mxcsr & ~fpu_mxcsr_mask)
+        return -EINVAL;
+
+    for (unsigned int i = 2; i < XFEATURE_MAX; i++)
+    {
+        if (!(hdr->xstate_bv & (1ULL << i)))
+            continue;
+
+        if (copy_from_user((void *) xstate_component(kbuf, i), src + xstate_offsets[i],
+                           xstate_sizes[i]) < 0)
+            return -EFAULT;
+    }
+
+    if (fpu_compacted)
+        hdr->xcomp_bv = XCOMP_BV_COMPACTED | fpu_xfeatures;
+
+    return 0;
+}
+
 static slab_cache *fpu_cache = nullptr;
 
 /**
@@ -168,4 +498,11 @@ void fpu_init()
 
     x86_write_cr4(cr4);
     do_ldmxcsr(0x1F80);
+
+    /* Find out which MXCSR bits we can let userspace set. A zero mask means the default. */
+    alignas(FXSAVE_AREA_ALIGNMENT) uint8_t buf[FXSAVE_AREA_SIZE];
+    __asm__ __volatile__("fxsave %0" : "=m"(buf));
+    uint32_t mask = ((struct fpu_area *) buf)->mxcsr_mask;
+    if (mask)
+        fpu_mxcsr_mask = mask;
 }
@@ -10,7 +10,10 @@
 #include <stdbool.h>
 #include <stdio.h>
 
+#include <onyx/cmdline.h>
 #include <onyx/cpu.h>
+#include <onyx/mm/asid.h>
+#include <onyx/mm/tlb.h>
 #include <onyx/page.h>
 #include <onyx/paging.h>
 #include <onyx/panic.h>
@@ -89,6 +92,50 @@ static inline void __native_tlb_invalidate_page(void *addr)
     __asm__ __volatile__("invlpg (%0)" : : "b"(addr) : "memory");
 }
 
+#define CR3_NOFLUSH (1UL << 63)
+
+#define INVPCID_ADDRESS               0
+#define INVPCID_SINGLE_CONTEXT        1
+#define INVPCID_ALL_CONTEXTS_GLOBAL   2
+#define INVPCID_ALL_CONTEXTS_NOGLOBAL 3
+
+static bool pcid_disabled = false;
+
+static int nopcid_param(const char *s)
+{
+    pcid_disabled = true;
+    return 1;
+}
+kernel_param("nopcid", nopcid_param);
+
+bool x86_pcid_usable()
+{
+    return !pcid_disabled && x86_has_cap(X86_FEATURE_PCID);
+}
+
+static inline void __invpcid(unsigned long type, unsigned long pcid, unsigned long addr)
+{
+    struct
+    {
+        u64 pcid;
+        u64 addr;
+    } desc = {pcid, addr};
+
+    __asm__ __volatile__("invpcid %0, %1" ::"m"(desc), "r"(type) : "memory");
+}
+
+/**
+ * @brief Flush the current ASID's (non-global) TLB entries
+ *
+ */
+static void x86_flush_current_asid()
+{
+    if (x86_pcid_usable() && x86_has_cap(X86_FEATURE_INVPCID))
+        __invpcid(INVPCID_SINGLE_CONTEXT, asid_current(), 0);
+    else
+        __native_tlb_invalidate_all();
+}
+
 bool x86_pte_empty(uint64_t pte)
 {
     return pte == 0;
@@ -212,6 +259,7 @@ unsigned long placement_mappings_start = 0xffffffffffc00000;
 
 void __native_tlb_invalidate_all(void)
 {
+    /* Note: with PCIDs, this only flushes the current PCID, as cr3 never reads back bit 63 */
     __asm__ __volatile__("mov %%cr3, %%rax\nmov %%rax, %%cr3" ::: "rax", "memory");
 }
 
@@ -437,20 +485,10 @@ int paging_clone_as(mm_address_space *addr_space, mm_address_space *original)
     memcpy(&p->entries[256], &curr->entries[256], 256 * sizeof(uint64_t));
 
     addr_space->arch_mmu.cr3 = new_pml;
+    mm_tlb_ctx_init(&addr_space->arch_mmu.tlb);
     return 0;
 }
 
-void paging_load_cr3(PML *pml)
-{
-    assert(pml != NULL);
-    PML *oldpml;
-
-    __asm__ __volatile__("movq %%cr3, %0" : "=r"(oldpml));
-    if (oldpml == pml)
-        return;
-    __asm__ __volatile__("movq %0, %%cr3" ::"r"(pml));
-}
-
 int is_invalid_arch_range(void *address, size_t pages)
 {
     unsigned long addr = (unsigned long) address;
@@ -514,8 +552,14 @@ unsigned long total_shootdowns = 0;
 
 static void __native_tlb_invalidate_global()
 {
+    if (x86_pcid_usable() && x86_has_cap(X86_FEATURE_INVPCID))
+    {
+        __invpcid(INVPCID_ALL_CONTEXTS_GLOBAL, 0, 0);
+        return;
+    }
+
     // Disable IRQs, toggle CR4, enable IRQs is the sequence
-    // we need to safely flush all global mappings
+    // we need to safely flush all global mappings (and every PCID)
     const auto flags = irq_save_and_disable();
 
     auto old = x86_read_cr4();
@@ -614,7 +658,21 @@ void vm_free_arch_mmu(struct arch_mm_address_space *mm)
  */
 void vm_load_arch_mmu(struct arch_mm_address_space *mm)
 {
-    paging_load_cr3((PML *) mm->cr3);
+    bool flush;
+    const auto flags = irq_save_and_disable();
+    unsigned long cr3 = (unsigned long) mm->cr3 | asid_switch(&mm->tlb, &flush);
+
+    if (x86_read_cr3() != cr3)
+    {
+        /* Without PCIDs, writing cr3 always flushes (and bit 63 is reserved) */
+        if (!flush && x86_pcid_usable())
+            cr3 |= CR3_NOFLUSH;
+        x86_write_cr3(cr3);
+    }
+    else if (flush)
+        x86_flush_current_asid();
+
+    irq_restore(flags);
 }
 
 /**
@@ -668,28 +726,57 @@ PER_CPU_VAR(unsigned long nr_tlb_shootdowns) = 0;
 
 struct mm_shootdown_info
 {
-    unsigned long addr;
-    size_t pages;
+    const struct tlb_range *ranges;
+    unsigned int nr_ranges;
+    unsigned int flags;
     mm_address_space *mm;
+    unsigned long tlb_gen;
 };
 
+static void x86_invalidate_ranges(const mm_shootdown_info *info)
+{
+    for (unsigned int i = 0; i < info->nr_ranges; i++)
+    {
+        const struct tlb_range *range = &info->ranges[i];
+        paging_invalidate((void *) range->start, (range->end - range->start) >> PAGE_SHIFT);
+    }
+}
+
 void x86_invalidate_tlb(void *context)
 {
     auto info = (mm_shootdown_info *) context;
-    auto addr = info->addr;
-    auto pages = info->pages;
-    auto addr_space = info->mm;
-    struct mm_address_space *mm = NULL;
-    auto curr_thread = get_current_thread();
 
-    if (curr_thread)
-        mm = curr_thread->active_mm ?: curr_thread->aspace;
-
-    if (is_higher_half(addr) || mm == addr_space)
+    if (is_higher_half(info->ranges[0].start))
     {
-        paging_invalidate((void *) addr, pages);
+        /* Kernel mappings are global, invlpg gets rid of them in every PCID */
+        if (info->flags & TLB_BATCH_FLUSH_ALL)
+            __native_tlb_invalidate_global();
+        else
+            x86_invalidate_ranges(info);
         add_per_cpu(tlb_nr_invals, 1);
+        return;
+    }
+
+    const auto flags = irq_save_and_disable();
+    switch (asid_flush_loaded(&info->mm->arch_mmu.tlb, info->tlb_gen))
+    {
+        case ASID_FLUSH_RANGE:
+            if (!(info->flags & TLB_BATCH_FLUSH_ALL))
+            {
+                x86_invalidate_ranges(info);
+                add_per_cpu(tlb_nr_invals, 1);
+                break;
+            }
+            [[fallthrough]];
+        case ASID_FLUSH_ALL:
+            x86_flush_current_asid();
+            add_per_cpu(tlb_nr_invals, 1);
+            break;
+        case ASID_FLUSH_NONE:
+            break;
     }
+
+    irq_restore(flags);
 }
 
 /**
@@ -718,34 +805,72 @@ void tlbi_handle_spurious_fault_pte(struct mm_address_space *mm, unsigned long v
     add_per_cpu(tlb_nr_invals, 1);
 }
 
+static cpumask x86_shootdown_mask(mm_address_space *mm, unsigned int flags, unsigned int our_cpu)
+{
+    cpumask mask = mm->active_mask;
+    mask.remove_cpu(our_cpu);
+
+    /* Lazy CPUs will flush when they switch back to the mm and see the new generation. But they
+     * can still walk the page tables speculatively, so they must hear about freed page tables. */
+    if (!(flags & TLB_BATCH_FREED_TABLES))
+    {
+        cpumask active = mask;
+        active.for_every_cpu([&](unsigned long cpu) -> bool {
+            if (asid_cpu_is_lazy(cpu))
+                mask.remove_cpu(cpu);
+            return true;
+        });
+    }
+
+    return mask;
+}
+
 /**
- * @brief Invalidates a memory range.
+ * @brief Invalidate a set of ranges in a single shootdown
  *
- * @param addr The start of the memory range.
- * @param pages The size of the memory range, in pages.
- * @param mm The target address space.
+ * @param mm Address space
+ * @param ranges Ranges to invalidate
+ * @param nr_ranges Number of ranges
+ * @param flags TLB_BATCH_* flags
  */
-void mmu_invalidate_range(unsigned long addr, size_t pages, mm_address_space *mm)
+void mmu_invalidate_ranges(mm_address_space *mm, const struct tlb_range *ranges,
+                           unsigned int nr_ranges, unsigned int flags)
 {
     add_per_cpu(nr_tlb_shootdowns, 1);
-    mm_shootdown_info info{addr, pages, mm};
+    mm_shootdown_info info{ranges, nr_ranges, flags, mm, 0};
 
     auto our_cpu = get_cpu_nr();
     cpumask mask;
 
-    if (addr >= VM_HIGHER_HALF)
+    if (is_higher_half(ranges[0].start))
     {
         mask = cpumask::all_but_one(our_cpu);
     }
     else
     {
-        mask = mm->active_mask;
-        mask.remove_cpu(our_cpu);
+        /* CPUs that have the mm cached in a PCID, but aren't running it, see the new generation
+         * when they switch back to it and flush then. A whole batch only needs one generation. */
+        info.tlb_gen = mm_tlb_gen_bump(&mm->arch_mmu.tlb);
+        mask = x86_shootdown_mask(mm, flags, our_cpu);
     }
 
     smp::sync_call_with_local(x86_invalidate_tlb, &info, mask, x86_invalidate_tlb, &info);
 }
 
+/**
+ * @brief Invalidates a memory range.
+ *
+ * @param addr The start of the memory range.
+ * @param pages The size of the memory range, in pages.
+ * @param mm The target address space.
+ */
+void mmu_invalidate_range(unsigned long addr, size_t pages, mm_address_space *mm)
+{
+    const struct tlb_range range = {addr, addr + (pages << PAGE_SHIFT)};
+    /* We don't know what the caller did to the page tables, so don't skip lazy CPUs */
+    mmu_invalidate_ranges(mm, &range, 1, TLB_BATCH_FREED_TABLES);
+}
+
 struct mmu_acct
 {
     size_t page_table_size;
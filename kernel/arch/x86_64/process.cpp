@@ -6,10 +6,14 @@
  * SPDX-License-Identifier: GPL-2.0-only
  */
 #include <errno.h>
+#include <string.h>
 
 #include <onyx/elf.h>
 #include <onyx/err.h>
+#include <onyx/fpu.h>
+#include <onyx/irq.h>
 #include <onyx/process.h>
+#include <onyx/rseq.h>
 #include <onyx/scheduler.h>
 #include <onyx/thread.h>
 
@@ -21,6 +25,7 @@ void thread_setup_stack(thread *thread, bool is_user, registers_t *regs);
 }
 
 extern "C" void ret_from_fork_asm(void);
+extern "C" void x86_exit_to_user_work(struct registers *regs);
 
 extern "C" void ret_from_fork(void)
 {
@@ -29,6 +34,11 @@ extern "C" void ret_from_fork(void)
     struct process *current = get_current_process();
     if (current->set_tid)
         copy_to_user(current->set_tid, &current->pid_, sizeof(pid_t));
+
+    /* We return to userspace through x86_scheduler_exit, so do the exit work (rseq's cpu_id,
+     * loading the FPU state) ourselves */
+    irq_disable();
+    x86_exit_to_user_work((struct registers *) task_curr_syscall_frame());
 }
 
 struct thread *process_fork_thread(thread_t *src, struct process *dest, unsigned int flags,
@@ -71,10 +81,13 @@ struct thread *process_fork_thread(thread_t *src, struct process *dest, unsigned
     if (flags & CLONE_SETTLS)
         thread->fs = (void *) tls;
 
+    rseq_fork(thread, src, flags);
+
     regs.rip = (unsigned long) &ret_from_fork_asm;
     x86::internal::thread_setup_stack(thread, false, &regs);
 
-    save_fpu(thread->fpu_area);
+    fpu_flush_current();
+    memcpy(thread->fpu_area, src->fpu_area, fpu_get_save_size());
 
     thread->owner = dest;
     thread->set_aspace(dest->get_aspace());
@@ -9,6 +9,7 @@
 #include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <onyx/cpu.h>
 #include <onyx/panic.h>
@@ -18,6 +19,7 @@
 #include <onyx/user.h>
 #include <onyx/vm.h>
 #include <onyx/x86/eflags.h>
+#include <onyx/x86/fpu.h>
 #include <onyx/x86/segments.h>
 #include <onyx/x86/signal.h>
 
@@ -134,9 +136,9 @@ static int signal_setup_context(int sig, siginfo_t *info, struct k_sigaction *k_
     if (copy_to_user(&sframe->uc.uc_sigmask, mask, sizeof(sigset_t)) < 0)
         return -EFAULT;
 
-    save_fpu(curr->fpu_area);
+    fpu_flush_current();
 
-    if (copy_to_user(&sframe->fpregs, curr->fpu_area, fpu_size) < 0)
+    if (fpu_copy_to_user(&sframe->fpregs, curr->fpu_area) < 0)
         return -EFAULT;
 
     void *fpregs = &sframe->fpregs;
@@ -163,62 +165,24 @@ static int signal_setup_context(int sig, siginfo_t *info, struct k_sigaction *k_
     return 0;
 }
 
-static int fault_in_range(u8 *start, size_t len)
-{
-    u8 *end = page_align_up(start + len);
-    unsigned long addr = (unsigned long) start;
-    u8 *ptr;
-    unsigned int dummy;
-    int err;
-
-    /* Page align our buffer */
-    if (addr & (PAGE_SIZE - 1))
-    {
-        err = get_user32((unsigned int *) (addr & -4), &dummy);
-        if (err < 0)
-            return err;
-        start = page_align_up(start);
-    }
-
-    for (ptr = start; ptr < end; ptr += PAGE_SIZE)
-    {
-        err = get_user32((unsigned int *) ptr, &dummy);
-        if (err < 0)
-            return err;
-    }
-
-    return err;
-}
-
 static int restore_fpu_sigframe(void *fpregs)
 {
     struct thread *curr = get_current_thread();
-    size_t fpu_size = fpu_get_save_size();
     int err;
 
-    /* We need to disable interrupts (and faulting) here to avoid corruption of the fpu state */
-    for (;;)
+    /* Stop a context switch from saving the live registers over our new state. The new state
+     * gets loaded on the way back to userspace. */
+    fpu_invalidate_current();
+
+    err = fpu_copy_from_user(curr->fpu_area, fpregs);
+    if (err < 0)
     {
-        irq_disable();
-        pagefault_disable();
-        if (copy_from_user(curr->fpu_area, fpregs, fpu_size) < 0)
-        {
-            /* Copying failed. Enable faulting again and try to copy it in. It's okay that fpu_area
-             * has bad FPU state, we'll never load from it anyway. */
-            pagefault_enable();
-            irq_enable();
-            err = fault_in_range(fpregs, fpu_size);
-            if (err < 0)
-                return err;
-        }
-        else
-            break;
+        /* Don't leave a partial (or bogus) state behind, restoring it could fault */
+        memset(curr->fpu_area, 0, fpu_get_save_size());
+        setup_fpu_area(curr->fpu_area);
     }
 
-    restore_fpu(curr->fpu_area);
-    pagefault_enable();
-    irq_enable();
-    return 0;
+    return err;
 }
 
 unsigned long sys_sigreturn(struct syscall_frame *sysframe)
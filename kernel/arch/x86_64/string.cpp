@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <cpuid.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <onyx/code_patch.h>
+#include <onyx/cpu.h>
+#include <onyx/x86/alternatives.h>
+#include <onyx/x86/string_alternatives.h>
+
+/* Short copies are (only) cheap with rep movsb if we have FSRM */
+#define REP_MOVSB_THRESHOLD_FSRM 128
+#define REP_MOVSB_THRESHOLD      512
+
+#define CPUID_CACHE_PARAMS     4
+#define CPUID_AMD_CACHE_PARAMS 0x8000001d
+#define CPUID_AMD_L2_CACHE     0x80000006
+
+/**
+ * @brief Get the size of the largest cache level, using the deterministic cache parameters leaf
+ *
+ * @param leaf CPUID leaf (4 on Intel, 0x8000001d on AMD)
+ * @return Size of the largest cache, in bytes, or 0
+ */
+static unsigned long x86_cache_params_llc(uint32_t leaf)
+{
+    unsigned long llc = 0;
+    uint32_t eax, ebx, ecx, edx;
+
+    for (uint32_t i = 0;; i++)
+    {
+        if (!__get_cpuid_count(leaf, i, &eax, &ebx, &ecx, &edx))
+            break;
+
+        /* Cache type 0 = no more caches */
+        if ((eax & 0x1f) == 0)
+            break;
+
+        /* Skip instruction caches */
+        if ((eax & 0x1f) == 2)
+            continue;
+
+        unsigned long ways = ((ebx >> 22) & 0x3ff) + 1;
+        unsigned long partitions = ((ebx >> 12) & 0x3ff) + 1;
+        unsigned long line_size = (ebx & 0xfff) + 1;
+        unsigned long sets = (unsigned long) ecx + 1;
+        unsigned long size = ways * partitions * line_size * sets;
+        if (size > llc)
+            llc = size;
+    }
+
+    return llc;
+}
+
+/**
+ * @brief Get the size of the last level cache
+ *
+ * @return Size of the LLC, in bytes, or 0 if we don't know
+ */
+static unsigned long x86_get_llc_size()
+{
+    static unsigned long llc_size = -1UL;
+    uint32_t eax, ebx, ecx, edx;
+
+    if (llc_size != -1UL)
+        return llc_size;
+
+    llc_size = 0;
+    if (x86_has_cap(X86_FEATURE_TOPOEXT))
+        llc_size = x86_cache_params_llc(CPUID_AMD_CACHE_PARAMS);
+    else if (__get_cpuid_max(0, nullptr) >= CPUID_CACHE_PARAMS)
+        llc_size = x86_cache_params_llc(CPUID_CACHE_PARAMS);
+
+    /* Old AMD CPUs only tell us about the L2 */
+    if (!llc_size && __get_cpuid(CPUID_AMD_L2_CACHE, &eax, &ebx, &ecx, &edx))
+        llc_size = (unsigned long) (ecx >> 16) * 1024;
+
+    return llc_size;
+}
+
+static uint32_t x86_string_threshold(unsigned long which)
+{
+    if (which == STRING_THRESHOLD_REP)
+    {
+        return x86_has_cap(X86_FEATURE_FSRM) ? REP_MOVSB_THRESHOLD_FSRM : REP_MOVSB_THRESHOLD;
+    }
+
+    /* Non-temporal copies pay off once we'd blow through the whole LLC anyway */
+    unsigned long llc = x86_get_llc_size();
+    if (!llc || llc >= STRING_NT_DISABLED)
+        return STRING_NT_DISABLED;
+    return llc;
+}
+
+extern "C" void x86_string_threshold_patch(code_patch_location *loc)
+{
+    /* Patch the imm32 of the cmp $imm32, %rdx */
+    uint32_t threshold = x86_string_threshold((unsigned long) loc->priv[0]);
+    code_patch::replace_instructions((uint8_t *) loc->address + 3, &threshold, sizeof(threshold),
+                                     sizeof(threshold));
+}
+
+extern "C" void x86_string_large_patch(code_patch_location *loc)
+{
+    uint8_t *target = (uint8_t *) (x86_has_cap(X86_FEATURE_ERMS) ? loc->priv[0] : loc->priv[1]);
+    int32_t rel = target - ((uint8_t *) loc->address + 5);
+    uint8_t jmp[5] = {0xe9};
+
+    memcpy(&jmp[1], &rel, sizeof(rel));
+    code_patch::replace_instructions(loc->address, jmp, sizeof(jmp), loc->size);
+}
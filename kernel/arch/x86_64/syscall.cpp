@@ -14,6 +14,8 @@
 #include <onyx/cpu.h>
 #include <onyx/gen/syscall.h>
 #include <onyx/proc_event.h>
+#include <onyx/rseq.h>
+#include <onyx/x86/fpu.h>
 
 #include <platform/syscall.h>
 
@@ -24,6 +26,60 @@ extern syscall_callback_t syscall_table_64[];
 
 extern "C" void handle_signal(struct registers *regs);
 
+extern "C" bool x86_exit_to_user_pending(void)
+{
+    struct thread *curr = get_current_thread();
+    if (!curr)
+        return false;
+    return signal_is_pending() || rseq_notify_pending(curr) || fpu_needs_load(curr);
+}
+
+/**
+ * @brief Do the pending work before returning to userspace (rseq, signals and FPU state)
+ * Called with interrupts disabled, from both the interrupt return and syscall paths. Returns with
+ * interrupts disabled, so the FPU state we load stays ours until we get to userspace.
+ *
+ * @param regs Registers we're returning with
+ */
+extern "C" void x86_exit_to_user_work(struct registers *regs)
+{
+    struct thread *curr = get_current_thread();
+    const bool sigpending = signal_is_pending();
+
+    /* Nothing to do if we're not going back to userspace */
+    if (in_kernel_space_regs(regs))
+        return;
+
+    if (sigpending || rseq_notify_pending(curr))
+    {
+        /* We're about to touch user memory, which can fault */
+        irq_enable();
+
+        /* rseq needs to run before the signal frame gets set up, so the handler returns to the
+         * abort IP instead of the middle of the critical section. */
+        if (sigpending)
+            rseq_set_notify_resume(curr);
+
+        if (rseq_notify_pending(curr))
+            rseq_handle_notify_resume(regs);
+
+        if (sigpending)
+            handle_signal(regs);
+
+        irq_disable();
+
+        /* Setting up the signal frame may have gotten us preempted */
+        while (rseq_notify_pending(curr))
+        {
+            irq_enable();
+            rseq_handle_notify_resume(regs);
+            irq_disable();
+        }
+    }
+
+    fpu_load_current();
+}
+
 __always_inline bool should_sysret(struct registers *regs)
 {
     /* We can't use sysret on a number of occasions. Most of these would be triggered by ptrace or
@@ -86,7 +142,8 @@ extern "C" long do_syscall64(struct syscall_frame *frame)
     }
 
     frame->rax = ret;
-    if (signal_is_pending())
-        handle_signal((struct registers *) frame);
+    irq_disable();
+    if (x86_exit_to_user_pending())
+        x86_exit_to_user_work((struct registers *) frame);
     return likely(should_sysret((struct registers *) frame));
 }
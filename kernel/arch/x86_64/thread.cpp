@@ -27,6 +27,7 @@
 #include <onyx/worker.h>
 #include <onyx/x86/apic.h>
 #include <onyx/x86/eflags.h>
+#include <onyx/x86/fpu.h>
 #include <onyx/x86/msr.h>
 #include <onyx/x86/segments.h>
 
@@ -192,6 +193,8 @@ thread *sched_spawn_thread(registers_t *regs, unsigned int flags, void *fs)
         memset(new_thread->fpu_area, 0, fpu_get_save_size());
 
         setup_fpu_area(new_thread->fpu_area);
+        /* The registers get loaded on the first return to userspace */
+        new_thread->flags |= THREAD_NEED_FPU_LOAD;
 
         new_thread->addr_limit = VM_USER_ADDR_LIMIT;
 
@@ -287,7 +290,7 @@ void arch_save_thread(thread *thread, void *stack)
     assert(thread->canary == THREAD_STRUCT_CANARY);
     /* No need to save the fpu context if we're a kernel thread! */
     if (!(thread->flags & THREAD_KERNEL))
-        save_fpu(thread->fpu_area);
+        fpu_switch_out(thread);
 }
 
 void arch_load_thread(struct thread *thread, unsigned int cpu)
@@ -300,8 +303,7 @@ void arch_load_thread(struct thread *thread, unsigned int cpu)
 
     if (!(thread->flags & THREAD_KERNEL))
     {
-        restore_fpu(thread->fpu_area);
-
+        /* The FPU state is loaded lazily, on the way back to userspace */
         wrmsr(FS_BASE_MSR, (uint64_t) thread->fs);
         wrmsr(KERNEL_GS_BASE, (uint64_t) thread->gs);
     }
@@ -338,6 +340,7 @@ int arch_transform_into_user_thread(thread *thread)
     memset(thread->fpu_area, 0, fpu_get_save_size());
 
     setup_fpu_area(thread->fpu_area);
+    thread_set_flag(thread, THREAD_NEED_FPU_LOAD);
 
     /* Note that we don't adjust the addr limit because the thread might be us */
     return 0;
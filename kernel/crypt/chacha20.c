@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/* Based on:
+ * chacha-merged.c version 20080118
+ * D. J. Bernstein
+ * Public domain.
+ */
+
+#include <endian.h>
+#include <string.h>
+
+#include <onyx/crypt/chacha20.h>
+
+static inline uint32_t chacha_read_le32(const uint8_t *buf)
+{
+    return (uint32_t) buf[0] << 0 | (uint32_t) buf[1] << 8 | (uint32_t) buf[2] << 16 |
+           (uint32_t) buf[3] << 24;
+}
+
+static inline uint32_t chacha_rotate(uint32_t v, uint32_t n)
+{
+    return (v << n) | (v >> (32 - n));
+}
+
+#define QUARTER_ROUND(a, b, c, d)       \
+    do                                  \
+    {                                   \
+        a += b;                         \
+        d = chacha_rotate(d ^ a, 16);   \
+        c += d;                         \
+        b = chacha_rotate(b ^ c, 12);   \
+        a += b;                         \
+        d = chacha_rotate(d ^ a, 8);    \
+        c += d;                         \
+        b = chacha_rotate(b ^ c, 7);    \
+    } while (0)
+
+void chacha20_init(uint32_t state[CHACHA20_STATE_WORDS], const uint8_t *key, uint64_t nonce)
+{
+    /* "expand 32-byte k" */
+    state[0] = 0x61707865;
+    state[1] = 0x3320646e;
+    state[2] = 0x79622d32;
+    state[3] = 0x6b206574;
+
+    for (int i = 0; i < 8; i++)
+        state[4 + i] = chacha_read_le32(key + i * sizeof(uint32_t));
+
+    state[12] = 0;
+    state[13] = 0;
+    state[14] = (uint32_t) nonce;
+    state[15] = (uint32_t) (nonce >> 32);
+}
+
+void chacha20_block(uint32_t state[CHACHA20_STATE_WORDS], uint8_t *out)
+{
+    uint32_t x[CHACHA20_STATE_WORDS];
+
+    memcpy(x, state, sizeof(x));
+
+    /* 20 rounds, done as 10 double (column + diagonal) rounds */
+    for (int i = 0; i < 10; i++)
+    {
+        QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+        QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+        QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+        QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+        QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+        QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+        QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+        QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+    }
+
+    for (int i = 0; i < CHACHA20_STATE_WORDS; i++)
+        x[i] = htole32(x[i] + state[i]);
+
+    /* 64-bit block counter */
+    if (++state[12] == 0)
+        state[13]++;
+
+    memcpy(out, x, sizeof(x));
+    memset(x, 0, sizeof(x));
+    __asm__ __volatile__("" ::: "memory");
+}
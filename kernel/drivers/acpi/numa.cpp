@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <onyx/acpi.h>
+#include <onyx/mm/numa.h>
+#include <onyx/vm.h>
+
+/* The SRAT is parsed straight out of physical memory (through the direct map), because we need it
+ * to set up the page allocator, way before ACPICA's table manager can run. */
+
+#define ACPI_NUMA_MAX_CPUS 1024
+
+static u32 pxm_to_node_map[MAX_NUMNODES];
+static unsigned int nr_pxms;
+
+static struct
+{
+    u32 apic_id;
+    int nid;
+} acpi_numa_cpus[ACPI_NUMA_MAX_CPUS];
+static unsigned int nr_acpi_numa_cpus;
+
+static bool acpi_table_valid(const acpi_table_header *table)
+{
+    const u8 *ptr = (const u8 *) table;
+    u8 sum = 0;
+
+    if (table->length < sizeof(acpi_table_header))
+        return false;
+    for (u32 i = 0; i < table->length; i++)
+        sum += ptr[i];
+    return sum == 0;
+}
+
+static acpi_table_header *acpi_early_find_table(const char *sig)
+{
+    unsigned long rsdp_phys = acpi_get_rsdp();
+    acpi_table_rsdp *rsdp;
+    acpi_table_header *root;
+    bool xsdt;
+    u32 nr_entries;
+
+    if (!rsdp_phys)
+        return nullptr;
+
+    rsdp = (acpi_table_rsdp *) PHYS_TO_VIRT(rsdp_phys);
+    xsdt = rsdp->revision >= 2 && rsdp->xsdt_physical_address;
+    root = (acpi_table_header *) PHYS_TO_VIRT(xsdt ? rsdp->xsdt_physical_address
+                                                   : (u64) rsdp->rsdt_physical_address);
+    if (!acpi_table_valid(root))
+        return nullptr;
+
+    nr_entries = (root->length - sizeof(acpi_table_header)) /
+                 (xsdt ? ACPI_XSDT_ENTRY_SIZE : ACPI_RSDT_ENTRY_SIZE);
+
+    for (u32 i = 0; i < nr_entries; i++)
+    {
+        u64 phys;
+        acpi_table_header *table;
+
+        if (xsdt)
+            memcpy(&phys, ((acpi_table_xsdt *) root)->table_offset_entry + i, sizeof(u64));
+        else
+            phys = ((acpi_table_rsdt *) root)->table_offset_entry[i];
+
+        table = (acpi_table_header *) PHYS_TO_VIRT(phys);
+        if (!memcmp(table->signature, sig, ACPI_NAMESEG_SIZE) && acpi_table_valid(table))
+            return table;
+    }
+
+    return nullptr;
+}
+
+static int acpi_pxm_to_node(u32 pxm, bool create)
+{
+    unsigned int i;
+
+    for (i = 0; i < nr_pxms; i++)
+    {
+        if (pxm_to_node_map[i] == pxm)
+            return i;
+    }
+
+    if (!create)
+        return NUMA_NO_NODE;
+
+    if (nr_pxms == MAX_NUMNODES)
+    {
+        pr_warn("acpi/numa: Too many proximity domains (max %u), ignoring PXM %u\n", MAX_NUMNODES,
+                pxm);
+        return NUMA_NO_NODE;
+    }
+
+    pxm_to_node_map[nr_pxms] = pxm;
+    numa_set_node_online(nr_pxms);
+    return nr_pxms++;
+}
+
+static void acpi_numa_add_cpu(u32 apic_id, u32 pxm)
+{
+    int nid = acpi_pxm_to_node(pxm, true);
+    if (nid == NUMA_NO_NODE)
+        return;
+
+    if (nr_acpi_numa_cpus == ACPI_NUMA_MAX_CPUS)
+    {
+        pr_warn("acpi/numa: Too many CPUs in the SRAT, ignoring APIC id %u\n", apic_id);
+        return;
+    }
+
+    acpi_numa_cpus[nr_acpi_numa_cpus].apic_id = apic_id;
+    acpi_numa_cpus[nr_acpi_numa_cpus].nid = nid;
+    nr_acpi_numa_cpus++;
+}
+
+static int acpi_numa_parse_srat(acpi_table_srat *srat)
+{
+    acpi_subtable_header *first = (acpi_subtable_header *) (srat + 1);
+    acpi_subtable_header *end = (acpi_subtable_header *) ((char *) srat + srat->header.length);
+    int nr_memblks = 0;
+
+    for (acpi_subtable_header *i = first; i < end;
+         i = (acpi_subtable_header *) ((char *) i + i->length))
+    {
+        if (i->length == 0)
+        {
+            pr_err("acpi/numa: Malformed SRAT (zero-length subtable)\n");
+            return -EINVAL;
+        }
+
+        switch (i->type)
+        {
+            case ACPI_SRAT_TYPE_CPU_AFFINITY: {
+                acpi_srat_cpu_affinity *cpu = (acpi_srat_cpu_affinity *) i;
+                u32 pxm = cpu->proximity_domain_lo;
+                if (!(cpu->flags & ACPI_SRAT_CPU_USE_AFFINITY))
+                    break;
+                /* SRAT revision 1 only had 8-bit proximity domains for CPUs */
+                if (srat->header.revision >= 2)
+                {
+                    pxm |= (u32) cpu->proximity_domain_hi[0] << 8 |
+                           (u32) cpu->proximity_domain_hi[1] << 16 |
+                           (u32) cpu->proximity_domain_hi[2] << 24;
+                }
+
+                acpi_numa_add_cpu(cpu->apic_id, pxm);
+                break;
+            }
+
+            case ACPI_SRAT_TYPE_X2APIC_CPU_AFFINITY: {
+                acpi_srat_x2apic_cpu_affinity *cpu = (acpi_srat_x2apic_cpu_affinity *) i;
+                if (!(cpu->flags & ACPI_SRAT_CPU_ENABLED))
+                    break;
+                acpi_numa_add_cpu(cpu->apic_id, cpu->proximity_domain);
+                break;
+            }
+
+            case ACPI_SRAT_TYPE_MEMORY_AFFINITY: {
+                acpi_srat_mem_affinity *mem = (acpi_srat_mem_affinity *) i;
+                u32 pxm = mem->proximity_domain;
+                int nid;
+
+                if (!(mem->flags & ACPI_SRAT_MEM_ENABLED) || !mem->length)
+                    break;
+                if (srat->header.revision < 2)
+                    pxm &= 0xff;
+
+                nid = acpi_pxm_to_node(pxm, true);
+                if (nid == NUMA_NO_NODE)
+                    break;
+
+                if (numa_add_memblk(nid, mem->base_address, mem->base_address + mem->length) < 0)
+                    return -EINVAL;
+                nr_memblks++;
+                break;
+            }
+        }
+    }
+
+    return nr_memblks ? 0 : -ENOENT;
+}
+
+static void acpi_numa_parse_slit(acpi_table_slit *slit)
+{
+    u64 count = slit->locality_count;
+
+    if (sizeof(acpi_table_slit) - 1 + count * count > slit->header.length)
+    {
+        pr_err("acpi/numa: Malformed SLIT, ignoring\n");
+        return;
+    }
+
+    for (u64 i = 0; i < count; i++)
+    {
+        int from = acpi_pxm_to_node(i, false);
+        if (from == NUMA_NO_NODE)
+            continue;
+
+        for (u64 j = 0; j < count; j++)
+        {
+            int to = acpi_pxm_to_node(j, false);
+            if (to == NUMA_NO_NODE)
+                continue;
+            numa_set_distance(from, to, slit->entry[i * count + j]);
+        }
+    }
+}
+
+int acpi_numa_init()
+{
+    acpi_table_srat *srat = (acpi_table_srat *) acpi_early_find_table(ACPI_SIG_SRAT);
+    acpi_table_slit *slit;
+    int err;
+
+    if (!srat)
+        return -ENOENT;
+
+    err = acpi_numa_parse_srat(srat);
+    if (err < 0)
+        return err;
+
+    slit = (acpi_table_slit *) acpi_early_find_table(ACPI_SIG_SLIT);
+    if (slit)
+        acpi_numa_parse_slit(slit);
+    return 0;
+}
+
+int acpi_numa_apic_to_node(u32 apic_id)
+{
+    for (unsigned int i = 0; i < nr_acpi_numa_cpus; i++)
+    {
+        if (acpi_numa_cpus[i].apic_id == apic_id)
+            return acpi_numa_cpus[i].nid;
+    }
+
+    return NUMA_NO_NODE;
+}
@@ -26,11 +26,12 @@ struct block_buf
 {
     /* This block's refcount */
     unsigned long refc;
-    /* The page it's stored on */
+    /* The page it's stored on (the subpage, for large folios) */
     struct page *this_page;
-    /* This represents the next block_buf within the page */
+    /* This represents the next block_buf within the page. Large folios keep the list of all
+     * their buffers on the head. */
     struct block_buf *next;
-    /* The offset within the page */
+    /* The offset within this_page */
     unsigned int page_off;
     /* Various flags - see below */
     unsigned int flags;
@@ -113,6 +114,13 @@ static inline void *block_buf_data(struct block_buf *b)
     return (void *) (((unsigned long) PAGE_TO_VIRT(b->this_page)) + b->page_off);
 }
 
+/* Offset of the buffer within its (possibly large) folio */
+static inline unsigned long block_buf_offset(struct block_buf *b)
+{
+    return ((unsigned long) (b->this_page - compound_head(b->this_page)) << PAGE_SHIFT) +
+           b->page_off;
+}
+
 /**
  * @brief Associate a block_buf with a vm_object
  * This is used for e.g indirect blocks that want to be written back
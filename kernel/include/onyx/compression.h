@@ -40,6 +40,39 @@ public:
     virtual ~decompression_stream() = default;
 };
 
+/**
+ * @brief Compression context
+ * Contexts preallocate all the state they need to (de)compress buffers up to a given size, so they
+ * can be used where we can't allocate memory (e.g page reclaim). They are not thread-safe.
+ */
+class context
+{
+public:
+    virtual ~context() = default;
+
+    /**
+     * @brief Compress a buffer onto dst
+     *
+     * @param dst Pointer to destination
+     * @param dst_capacity Capacity of the destination buffer
+     * @param src Slice for the source data
+     * @return Number of bytes compressed, or unexpected (-ENOSPC if it doesn't fit in dst)
+     */
+    virtual expected<size_t, int> compress(void *dst, size_t dst_capacity,
+                                           cul::slice<unsigned char> src) = 0;
+
+    /**
+     * @brief Decompress a buffer compressed by this context onto dst
+     *
+     * @param dst Pointer to destination
+     * @param dst_capacity Capacity of the destination buffer
+     * @param src Slice for the source data
+     * @return Number of bytes decompressed, or unexpected
+     */
+    virtual expected<size_t, int> decompress(void *dst, size_t dst_capacity,
+                                             cul::slice<unsigned char> src) = 0;
+};
+
 class module
 {
 private:
@@ -53,6 +86,11 @@ public:
 
     virtual ~module() = default;
 
+    const char *name() const
+    {
+        return name_;
+    }
+
     /**
      * @brief Checks if the given compressed blob is supported by this module
      *
@@ -73,8 +111,24 @@ public:
                                              cul::slice<unsigned char> src) = 0;
     virtual expected<unique_ptr<decompression_stream>, int> create_decompression_stream(
         cul::slice<unsigned char> src_hint) = 0;
+
+    /**
+     * @brief Create a compression context
+     *
+     * @param max_src_size Maximum size of the buffers that will be compressed
+     * @return The context, or unexpected (-ENOTSUP if the module can't compress)
+     */
+    virtual expected<unique_ptr<context>, int> create_context(size_t max_src_size);
 };
 
+/**
+ * @brief Find a compression module by name
+ *
+ * @param name Name of the module
+ * @return The module, or nullptr if not found
+ */
+module *find_module(const char *name);
+
 /**
  * @brief Decompress a buffer onto dst
  *
@@ -233,6 +233,10 @@ __BEGIN_CDECLS
 #define X86_FEATURE_DBX                  (218)
 #define X86_FEATURE_PERFTSC              (219)
 #define X86_FEATURE_PCX_L2I              (220)
+#define X86_FEATURE_XSAVEOPT             (224)
+#define X86_FEATURE_XSAVEC               (225)
+#define X86_FEATURE_XGETBV_ECX1          (226)
+#define X86_FEATURE_XSAVES               (227)
 
 #define X86_MESSAGE_VECTOR   (130)
 #define X86_RESCHED_VECTOR   (131)
@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#ifndef _ONYX_CRYPT_CHACHA20_H
+#define _ONYX_CRYPT_CHACHA20_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <onyx/compiler.h>
+
+#define CHACHA20_KEY_SIZE    32
+#define CHACHA20_BLOCK_SIZE  64
+#define CHACHA20_STATE_WORDS 16
+
+__BEGIN_CDECLS
+
+/**
+ * @brief Set up a ChaCha20 state with a 256-bit key, a 64-bit nonce and a zero block counter
+ *
+ * @param state State to initialize
+ * @param key CHACHA20_KEY_SIZE bytes of key
+ * @param nonce Nonce
+ */
+void chacha20_init(uint32_t state[CHACHA20_STATE_WORDS], const uint8_t *key, uint64_t nonce);
+
+/**
+ * @brief Generate a single block of keystream, and advance the block counter
+ *
+ * @param state ChaCha20 state
+ * @param out CHACHA20_BLOCK_SIZE bytes of output
+ */
+void chacha20_block(uint32_t state[CHACHA20_STATE_WORDS], uint8_t *out);
+
+__END_CDECLS
+
+#endif
@@ -9,6 +9,10 @@
 
 #include <stdint.h>
 
+#include <onyx/compiler.h>
+
+#define SHA256_DIGEST_SIZE 32
+
 struct sha256_state
 {
     uint64_t length;
@@ -16,8 +20,12 @@ struct sha256_state
     uint8_t buf[64];
 };
 
+__BEGIN_CDECLS
+
 void sha256_init(struct sha256_state *md);
 int sha256_process(struct sha256_state *md, const unsigned char *in, unsigned long inlen);
 int sha256_done(struct sha256_state *md, unsigned char *out);
 
+__END_CDECLS
+
 #endif
@@ -78,16 +78,27 @@ int filemap_writepages(struct inode *inode, struct writepages_info *wpinfo);
 
 int filemap_fdatasync(struct inode *inode, unsigned long start, unsigned long end);
 
+/* Max number of pages handed to ->readpages at once */
+#define READPAGES_BATCH 32
+/* Largest folio readahead allocates, for VMO_FLAG_LARGE_FOLIOS objects */
+#define READAHEAD_MAX_ORDER 5
+
 struct readpages_state
 {
     struct inode *ino;
+    /* Page index of the next page, and number of pages (not folios) left */
     unsigned long pgoff;
     unsigned long nr_pages;
+    /* Locked and referenced pages (large folios by their head), in order. Consumed from the
+     * front. */
+    unsigned int next;
+    struct page *pages[READPAGES_BATCH];
 };
 
 /**
  * @brief Get the next page out of the readpages state
- * The page will be returned locked.
+ * The page will be returned locked. Large folios are returned by their head, and take
+ * compound_nr(page) pages off the state.
  *
  * @param state Readpages state
  * @return Locked page, or NULL (if we can out of pages)
@@ -96,6 +107,11 @@ struct page *readpages_next_page(struct readpages_state *state);
 
 void filemap_clear_dirty(struct page *page) REQUIRES(page);
 
+/* /sys/vm/fault_around_bytes and /sys/vm/fault_around_mapped */
+ssize_t fault_around_bytes_sysfs_read(void *buffer, size_t size, off_t off);
+ssize_t fault_around_bytes_sysfs_write(void *buffer, size_t size, off_t off);
+ssize_t fault_around_mapped_sysfs_read(void *buffer, size_t size, off_t off);
+
 __END_CDECLS
 
 #endif
@@ -26,6 +26,12 @@ void fpu_init(void);
 size_t fpu_get_save_size(void);
 size_t fpu_get_save_alignment(void);
 
+/**
+ * @brief Write the current thread's live FPU registers (if any) back to its fpu_area
+ * Needed before reading fpu_area, as the registers may be newer than the saved state.
+ */
+void fpu_flush_current(void);
+
 /**
  * @brief Initialize the FPU state slab cache
  *
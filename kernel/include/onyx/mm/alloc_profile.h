@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#ifndef _ONYX_MM_ALLOC_PROFILE_H
+#define _ONYX_MM_ALLOC_PROFILE_H
+
+#include <stddef.h>
+
+#include <onyx/compiler.h>
+#include <onyx/types.h>
+
+/*
+ * Allocation profiling keeps, for every call site of the kernel's allocators, the number of live
+ * bytes and objects it has allocated, and the number of calls it made. Call sites are keyed by
+ * return address and allocator, and interned in a fixed size table. Allocations are tagged with
+ * their site's index (in struct page, in the slab, or in the vmalloc region) so frees can find
+ * it again. Counters are per-cpu, and only summed when someone reads /proc/allocinfo.
+ *
+ * The slab and vmalloc get their memory from the page allocator, so those pages also show up
+ * under the slab's and vmalloc's own call sites, as page allocations. Allocations made before
+ * profiling is initialized are not accounted anywhere.
+ */
+
+/* Allocator a call site belongs to */
+#define ALLOC_PROF_PAGES   0
+#define ALLOC_PROF_SLAB    1
+#define ALLOC_PROF_KMALLOC 2
+#define ALLOC_PROF_VMALLOC 3
+#define ALLOC_PROF_NR_TYPES 4
+
+/* Index of a call site in the site table. 0 means the allocation isn't accounted anywhere. */
+typedef u16 alloc_tag_t;
+
+#define ALLOC_TAG_NONE 0
+
+#define _RET_IP_ ((unsigned long) __builtin_return_address(0))
+
+__BEGIN_CDECLS
+
+#ifdef CONFIG_ALLOC_PROFILING
+
+/**
+ * @brief Account an allocation to a call site
+ *
+ * @param type ALLOC_PROF_* allocator
+ * @param ip Return address of the allocator's caller
+ * @param bytes Size of the allocation
+ * @param objects Number of objects (pages, for ALLOC_PROF_PAGES) it consists of
+ * @return Tag to store with the allocation, to be passed to alloc_prof_unaccount when freeing
+ */
+alloc_tag_t alloc_prof_account(unsigned int type, unsigned long ip, size_t bytes,
+                               unsigned long objects);
+
+/**
+ * @brief Unaccount a freed allocation
+ *
+ * @param tag Tag returned by alloc_prof_account (ALLOC_TAG_NONE is ignored)
+ * @param bytes Size of the freed memory
+ * @param objects Number of objects freed
+ */
+void alloc_prof_unaccount(alloc_tag_t tag, size_t bytes, unsigned long objects);
+
+#else
+
+static inline alloc_tag_t alloc_prof_account(unsigned int type, unsigned long ip, size_t bytes,
+                                             unsigned long objects)
+{
+    return ALLOC_TAG_NONE;
+}
+
+static inline void alloc_prof_unaccount(alloc_tag_t tag, size_t bytes, unsigned long objects)
+{
+}
+
+#endif
+
+__END_CDECLS
+
+#endif
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#ifndef _ONYX_MM_ASID_H
+#define _ONYX_MM_ASID_H
+
+#include <stdbool.h>
+
+#include <onyx/compiler.h>
+
+/*
+ * ASIDs (PCIDs on x86) let the TLB keep entries for more than one address space around, so
+ * switching mms doesn't have to flush the whole TLB.
+ *
+ * Each page table root gets a unique 64-bit context id, and a TLB generation that is bumped on
+ * every user shootdown. Every CPU keeps a tiny cache of the last ASID_NR_SLOTS contexts it ran,
+ * each slot using its own hardware ASID and remembering the generation its TLB entries are up to
+ * date with. Shootdowns only IPI the CPUs where the mm is active; every other CPU catches up lazily
+ * (with a full ASID flush) the next time it switches to the mm and notices its generation is stale.
+ * Slots are recycled round-robin, and a recycled slot is always flushed on switch.
+ *
+ * CPUs running kernel threads keep the last mm loaded (lazy TLB). They don't touch user memory,
+ * so they can be skipped by shootdowns that don't free page tables, and catch up on the way out.
+ *
+ * Context id 0 is reserved for the kernel's address space, which always runs on ASID 0 and never
+ * needs flushing (kernel mappings are global and get flushed as such).
+ */
+
+#define ASID_NR_SLOTS 6
+
+struct mm_tlb_ctx
+{
+    unsigned long ctx_id;
+    unsigned long tlb_gen;
+};
+
+enum asid_flush
+{
+    ASID_FLUSH_NONE = 0,
+    ASID_FLUSH_RANGE,
+    ASID_FLUSH_ALL
+};
+
+__BEGIN_CDECLS
+
+/**
+ * @brief Set up the ASID allocator
+ * Called once by the architecture, before any user address space runs.
+ *
+ * @param nr_asids Number of usable hardware ASIDs (not counting ASID 0). 0 if unsupported.
+ */
+void asid_init(unsigned int nr_asids);
+
+/**
+ * @brief Initialize a new context (for a new page table root)
+ *
+ * @param ctx Context
+ */
+void mm_tlb_ctx_init(struct mm_tlb_ctx *ctx);
+
+/**
+ * @brief Pick an ASID for a context on this CPU
+ * Must be called with IRQs disabled, after the CPU is visible in the mm's active_mask.
+ *
+ * @param ctx Context being switched to
+ * @param flush Set to true if the ASID must be flushed before use
+ * @return ASID to use
+ */
+unsigned int asid_switch(struct mm_tlb_ctx *ctx, bool *flush);
+
+/**
+ * @brief Bump a context's TLB generation (before shooting down user mappings)
+ *
+ * @param ctx Context
+ * @return The new generation
+ */
+static inline unsigned long mm_tlb_gen_bump(struct mm_tlb_ctx *ctx)
+{
+    /* Full barrier: the generation must be visible before we look at the active_mask */
+    return __atomic_add_fetch(&ctx->tlb_gen, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief Work out how to flush a shootdown for the currently loaded context
+ * Must be called with IRQs disabled.
+ *
+ * @param ctx Context being flushed
+ * @param gen Generation of the shootdown
+ * @return ASID_FLUSH_NONE if the flush isn't needed (the context isn't loaded, or we already
+ * flushed everything), ASID_FLUSH_RANGE to flush only the range, ASID_FLUSH_ALL to flush the whole
+ * ASID (we missed generations).
+ */
+enum asid_flush asid_flush_loaded(struct mm_tlb_ctx *ctx, unsigned long gen);
+
+/**
+ * @brief Get the ASID currently loaded on this CPU
+ *
+ * @return ASID
+ */
+unsigned int asid_current(void);
+
+/**
+ * @brief Mark this CPU as lazily running on top of its current mm (i.e running a kernel thread)
+ * User shootdowns that don't free page tables skip lazy CPUs. Must be called with IRQs disabled.
+ */
+void asid_enter_lazy(void);
+
+/**
+ * @brief Leave lazy mode
+ * Must be followed by a full barrier before looking at any mm's TLB generation.
+ */
+void asid_leave_lazy(void);
+
+/**
+ * @brief Check if a CPU is in lazy mode
+ *
+ * @param cpu CPU
+ * @return True if lazy
+ */
+bool asid_cpu_is_lazy(unsigned int cpu);
+
+__END_CDECLS
+
+#endif
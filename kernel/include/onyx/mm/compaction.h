@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#ifndef _ONYX_MM_COMPACTION_H
+#define _ONYX_MM_COMPACTION_H
+
+#include <stddef.h>
+
+#include <onyx/compiler.h>
+#include <onyx/mm/numa.h>
+
+#include <uapi/posix-types.h>
+
+/*
+ * Memory compaction defragments physical memory by migrating movable (LRU) pages from the bottom
+ * of a zone to free pages at the top of it. Two scanners walk the zone towards each other: the
+ * migrate scanner isolates in-use pages going up, the free scanner isolates free pages going down,
+ * and compaction is done once they meet. This merges free memory into large buddy blocks, for
+ * higher-order allocations (THP, hugetlb, etc).
+ *
+ * Compaction runs directly from the page allocator's slow path (for high-order allocations that
+ * may sleep), from kcompactd when woken up by allocations that can't, and proactively from
+ * kcompactd, when a zone's free memory is too fragmented (see /sys/vm/compaction_proactiveness).
+ */
+
+__BEGIN_CDECLS
+
+/**
+ * @brief Compact memory until an allocation of a given order can succeed
+ *
+ * @param order Order of the allocation
+ * @param gfp GFP flags of the allocation
+ * @param nid Preferred node
+ * @param allowed Nodes the allocation may be satisfied from
+ * @return True if a zone can now satisfy the allocation, else false
+ */
+bool compact_for_order(unsigned int order, unsigned long gfp, int nid, nodemask_t allowed);
+
+/**
+ * @brief Fully compact every zone
+ */
+void compact_memory(void);
+
+/**
+ * @brief Wake up kcompactd, to compact memory for a given order in the background
+ *
+ * @param order Order that failed to allocate
+ */
+void kcompactd_wake(unsigned int order);
+
+/* /sys/vm/compact_memory, /sys/vm/compact_stat and /sys/vm/compaction_proactiveness */
+ssize_t compact_memory_sysfs_write(void *buffer, size_t size, off_t off);
+ssize_t compact_stat_sysfs_read(void *buffer, size_t size, off_t off);
+ssize_t compaction_proactiveness_sysfs_read(void *buffer, size_t size, off_t off);
+ssize_t compaction_proactiveness_sysfs_write(void *buffer, size_t size, off_t off);
+
+__END_CDECLS
+
+#endif
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#ifndef _ONYX_MM_HUGETLB_H
+#define _ONYX_MM_HUGETLB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <onyx/compiler.h>
+
+#include <uapi/posix-types.h>
+
+/*
+ * hugetlb pages are PMD sized compound pages that come out of a pool reserved at boot (hugepages=)
+ * or through /sys/vm/nr_hugepages. They never get reclaimed, split, or freed back to the page
+ * allocator when unmapped; the last reference returns them to the pool.
+ *
+ * They're mapped through hugetlbfs files (MAP_HUGETLB mappings get an unlinked one), where the
+ * page cache holds the shared pages (one entry per huge page, at the huge page's first index).
+ * Private mappings map the page cache page read-only, and CoW into private pool pages.
+ */
+
+#define HUGETLB_ORDER (PMD_SHIFT - PAGE_SHIFT)
+#define HUGETLB_SIZE  PMD_SIZE
+
+struct file;
+struct inode;
+struct page;
+struct vm_area_struct;
+struct vm_operations;
+struct vm_pf_context;
+
+__BEGIN_CDECLS
+
+extern const struct vm_operations hugetlb_vmops;
+
+/**
+ * @brief Allocate a zeroed huge page from the pool
+ *
+ * @return Referenced huge page, or NULL if the pool is empty
+ */
+struct page *hugetlb_alloc_page(void);
+
+/**
+ * @brief Return a huge page to the pool (called by free_page once the refcount hits 0)
+ *
+ * @param page Huge page
+ */
+void hugetlb_free_page(struct page *page);
+
+/**
+ * @brief Get the page a hugetlb fault should map
+ *
+ * @param vma hugetlb VMA
+ * @param haddr Huge page aligned address
+ * @param write True if this is a write fault
+ * @param vm_flags VM flags to map the page with. VM_WRITE is cleared if the page must be mapped
+ * read-only.
+ * @return Referenced page, or an ERR_PTR
+ */
+struct page *hugetlb_fault_page(struct vm_area_struct *vma, unsigned long haddr, bool write,
+                                int *vm_flags);
+
+/**
+ * @brief Handle a page fault on a hugetlb VMA
+ *
+ * @param ctx Page fault context
+ * @return 0 on success, negative error codes
+ */
+int do_hugetlb_fault(struct vm_pf_context *ctx);
+
+/**
+ * @brief Check if a split of a VMA is allowed (hugetlb VMAs can only be split at huge page
+ * boundaries)
+ *
+ * @param vma VMA
+ * @param start Start of the range being modified
+ * @param end End of the range being modified
+ * @return True if ok
+ */
+bool hugetlb_range_ok(struct vm_area_struct *vma, unsigned long start, unsigned long end);
+
+/**
+ * @brief Set up a new hugetlb mapping
+ * Extends the file if needed.
+ *
+ * @param vma VMA
+ * @return 0 on success, negative error codes
+ */
+int hugetlb_setup_vma(struct vm_area_struct *vma);
+
+/**
+ * @brief Check if an inode belongs to hugetlbfs
+ *
+ * @param ino Inode
+ * @return True if hugetlbfs
+ */
+bool inode_is_hugetlbfs(struct inode *ino);
+
+/**
+ * @brief Create an unlinked hugetlbfs file (for MAP_HUGETLB)
+ *
+ * @param len Length, in bytes
+ * @return Opened struct file, or NULL
+ */
+struct file *hugetlb_anon_file(size_t len);
+
+unsigned long hugetlb_nr_pages(void);
+unsigned long hugetlb_nr_free_pages(void);
+
+/* /sys/vm/nr_hugepages and /sys/vm/free_hugepages */
+ssize_t hugetlb_nr_sysfs_read(void *buffer, size_t size, off_t off);
+ssize_t hugetlb_nr_sysfs_write(void *buffer, size_t size, off_t off);
+ssize_t hugetlb_free_sysfs_read(void *buffer, size_t size, off_t off);
+
+__END_CDECLS
+
+#endif
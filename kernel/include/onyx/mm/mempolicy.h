@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#ifndef _ONYX_MM_MEMPOLICY_H
+#define _ONYX_MM_MEMPOLICY_H
+
+#include <onyx/compiler.h>
+#include <onyx/mm/numa.h>
+
+#include <uapi/mempolicy.h>
+
+/*
+ * NUMA memory policies. Threads have a policy (set_mempolicy) that applies to every allocation
+ * they make, and VMAs may have one (mbind) that applies to the pages faulted into them, which
+ * takes precedence. Policies are small, so they're embedded by value (and copied on fork and VMA
+ * splits) instead of being refcounted.
+ *
+ * MPOL_DEFAULT and MPOL_LOCAL allocate from the local node, MPOL_PREFERRED from the given node,
+ * all of them falling back to other nodes if needed. MPOL_BIND only allocates from the given
+ * nodes, and MPOL_INTERLEAVE spreads pages between the given nodes (round-robin for thread
+ * policies, by page offset for VMAs).
+ */
+
+struct mempolicy
+{
+    unsigned short mode;
+    /* Last node we interleaved to (thread policies only) */
+    short il_prev;
+    nodemask_t nodes;
+};
+
+struct vm_area_struct;
+struct page;
+
+__BEGIN_CDECLS
+
+static inline bool mempolicy_is_default(const struct mempolicy *pol)
+{
+    return pol->mode == MPOL_DEFAULT;
+}
+
+static inline bool mempolicy_equal(const struct mempolicy *a, const struct mempolicy *b)
+{
+    return a->mode == b->mode && a->nodes == b->nodes;
+}
+
+/**
+ * @brief Allocate pages following the current thread's memory policy
+ * Called by alloc_pages on NUMA machines.
+ *
+ * @param order Order of the allocation
+ * @param gfp GFP flags
+ * @param ip Call site, for allocation profiling
+ * @return Pages, or NULL
+ */
+struct page *alloc_pages_current(unsigned int order, unsigned long gfp, unsigned long ip);
+
+/**
+ * @brief Allocate pages for a user mapping, following the VMA's (or the thread's) memory policy
+ *
+ * @param order Order of the allocation
+ * @param gfp GFP flags
+ * @param vma VMA the pages are going to be mapped in
+ * @param addr Address the pages are going to be mapped at
+ * @return Pages, or NULL
+ */
+struct page *alloc_pages_vma(unsigned int order, unsigned long gfp, struct vm_area_struct *vma,
+                             unsigned long addr);
+
+static inline struct page *alloc_page_vma(unsigned long gfp, struct vm_area_struct *vma,
+                                          unsigned long addr)
+{
+    return alloc_pages_vma(0, gfp, vma, addr);
+}
+
+__END_CDECLS
+
+#endif
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#ifndef _ONYX_MM_MIGRATE_H
+#define _ONYX_MM_MIGRATE_H
+
+#include <onyx/list.h>
+
+/*
+ * Page migration moves a page's contents (and identity) to a different physical page, under the
+ * feet of whoever is using it. Every pte that maps the page is replaced by a migration entry (see
+ * onyx/swap.h), the page cache slot (if any) is switched over to the new page, and the migration
+ * entries are then replaced by ptes to the new page. The old page is locked for the whole
+ * operation, and faults on migration entries wait for it to be unlocked.
+ */
+
+struct page;
+struct vm_pf_context;
+
+__BEGIN_CDECLS
+
+/**
+ * @brief Callback that allocates a page to migrate to
+ *
+ * @param page Page being migrated
+ * @param ctx Caller's context
+ * @return The new page, or NULL (which stops migration)
+ */
+typedef struct page *(*migrate_new_page_t)(struct page *page, void *ctx);
+
+/**
+ * @brief Callback that takes back a page that migrate_pages ended up not using
+ *
+ * @param page Page returned by the migrate_new_page_t callback
+ * @param ctx Caller's context
+ */
+typedef void (*migrate_free_page_t)(struct page *page, void *ctx);
+
+/**
+ * @brief Migrate a list of pages isolated from the LRU (see page_isolate_lru)
+ * Pages that were migrated are taken off the list and released. Pages that could not be migrated
+ * (because they're busy or unsupported) are left on the list, for the caller to put back.
+ *
+ * @param pages List of isolated pages, linked by lru_node
+ * @param get_new Allocation callback
+ * @param put_new Release callback, for pages get_new returned but that were not used
+ * @param ctx Context for the callbacks
+ * @return Number of pages migrated
+ */
+unsigned long migrate_pages(struct list_head *pages, migrate_new_page_t get_new,
+                            migrate_free_page_t put_new, void *ctx);
+
+/**
+ * @brief Put every page in a list back on the LRU, and drop the isolation references
+ *
+ * @param pages List of isolated pages, linked by lru_node
+ */
+void putback_lru_pages(struct list_head *pages);
+
+/**
+ * @brief Wait for a page under migration (fault handler for migration entries)
+ *
+ * @param context Fault context
+ * @return 0 (the fault is retried)
+ */
+int migration_entry_wait(struct vm_pf_context *context);
+
+__END_CDECLS
+
+#endif
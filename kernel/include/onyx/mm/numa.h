@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#ifndef _ONYX_MM_NUMA_H
+#define _ONYX_MM_NUMA_H
+
+#include <stdbool.h>
+
+#include <onyx/compiler.h>
+#include <onyx/smp.h>
+#include <onyx/types.h>
+
+/*
+ * NUMA topology. The firmware (ACPI's SRAT and SLIT, on x86) tells us which physical memory
+ * ranges and CPUs belong to which node, and how far apart nodes are. Nodes are numbered densely
+ * from 0 to nr_numa_nodes - 1, whatever the firmware's proximity domains look like. Without NUMA
+ * information, everything lives on node 0.
+ *
+ * The page allocator keeps one page_node per NUMA node, allocates from the local node (or from
+ * the node the memory policy asks for), and falls back to the other nodes in distance order.
+ */
+
+#ifndef CONFIG_NR_NUMA_NODES
+#define CONFIG_NR_NUMA_NODES 8
+#endif
+
+#define MAX_NUMNODES     CONFIG_NR_NUMA_NODES
+#define NUMA_NO_NODE     (-1)
+#define MAX_NUMA_MEMBLKS 64
+
+/* Same as the ACPI SLIT defaults */
+#define LOCAL_DISTANCE  10
+#define REMOTE_DISTANCE 20
+
+#if MAX_NUMNODES > 64
+#error "nodemask_t only fits 64 nodes"
+#endif
+
+typedef unsigned long nodemask_t;
+
+#define NODE_MASK(nid) (1UL << (nid))
+
+__BEGIN_CDECLS
+
+extern unsigned int nr_numa_nodes;
+extern nodemask_t numa_nodes_online;
+extern int numa_cpu_node[CONFIG_SMP_NR_CPUS];
+
+static inline bool numa_single_node(void)
+{
+    return nr_numa_nodes == 1;
+}
+
+static inline bool node_online(int nid)
+{
+    return nid >= 0 && nid < MAX_NUMNODES && (numa_nodes_online & NODE_MASK(nid));
+}
+
+/* Nodes are numbered densely, so the online nodes are 0 to nr_numa_nodes - 1 */
+#define for_each_online_node(nid) \
+    for (nid = 0; nid < (int) nr_numa_nodes; nid++)
+
+/**
+ * @brief Get the node a CPU belongs to
+ *
+ * @param cpu CPU number
+ * @return Node id
+ */
+static inline int cpu_to_node(unsigned int cpu)
+{
+    return numa_cpu_node[cpu];
+}
+
+/**
+ * @brief Get the current CPU's node
+ * The result may be stale by the time it's used, unless preemption is disabled.
+ *
+ * @return Node id
+ */
+static inline int numa_node_id(void)
+{
+    return numa_cpu_node[get_cpu_nr()];
+}
+
+/**
+ * @brief Set up the NUMA topology (from the firmware's tables)
+ * Called by page_init, before any memory is handed to the page allocator.
+ */
+void numa_init(void);
+
+/**
+ * @brief Register a physical memory range as belonging to a node
+ * Used by firmware parsing code, before numa_init returns.
+ *
+ * @param nid Node id
+ * @param start Start of the range
+ * @param end End of the range (exclusive)
+ * @return 0 on success, negative error codes
+ */
+int numa_add_memblk(int nid, unsigned long start, unsigned long end);
+
+/**
+ * @brief Set the distance between two nodes
+ *
+ * @param from Node id
+ * @param to Node id
+ * @param distance Relative distance (LOCAL_DISTANCE is the distance from a node to itself)
+ */
+void numa_set_distance(int from, int to, unsigned int distance);
+
+/**
+ * @brief Get the distance between two nodes
+ *
+ * @param from Node id
+ * @param to Node id
+ * @return Relative distance
+ */
+unsigned int node_distance(int from, int to);
+
+/**
+ * @brief Mark a node as online
+ *
+ * @param nid Node id
+ */
+void numa_set_node_online(int nid);
+
+/**
+ * @brief Set the node a CPU belongs to
+ *
+ * @param cpu CPU number
+ * @param nid Node id (NUMA_NO_NODE is ignored)
+ */
+void numa_set_cpu_node(unsigned int cpu, int nid);
+
+/**
+ * @brief Get the node a physical address belongs to
+ *
+ * @param phys Physical address
+ * @return Node id (0 if the firmware didn't describe the address)
+ */
+int phys_to_nid(unsigned long phys);
+
+/**
+ * @brief Find the end of the node range that contains phys
+ *
+ * @param phys Physical address
+ * @return End of phys's node range (exclusive), or ~0UL if it's not in any range
+ */
+unsigned long numa_memblk_end(unsigned long phys);
+
+#ifdef CONFIG_ACPI
+/**
+ * @brief Parse the ACPI SRAT and SLIT tables
+ * Runs before ACPICA is up, so it maps the tables itself.
+ *
+ * @return 0 if we found NUMA information, negative error codes
+ */
+int acpi_numa_init(void);
+
+/**
+ * @brief Get the node of a local APIC id, as described by the SRAT
+ *
+ * @param apic_id APIC id
+ * @return Node id, or NUMA_NO_NODE
+ */
+int acpi_numa_apic_to_node(u32 apic_id);
+#endif
+
+__END_CDECLS
+
+#endif
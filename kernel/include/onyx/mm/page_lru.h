@@ -12,7 +12,10 @@
 #include <onyx/list.h>
 #include <onyx/spinlock.h>
 
+#include <uapi/posix-types.h>
+
 struct page;
+struct mm_address_space;
 
 #define LRU_ANON_OFF 2
 enum lru_state
@@ -26,10 +29,42 @@ enum lru_state
     NR_LRU_LISTS
 };
 
+/*
+ * The multi-gen LRU keeps pages in generations instead of the active and inactive lists.
+ * Generations are numbered by a sequence number: max_seq is the youngest generation, and
+ * min_seq[type] the oldest one of each type (file or anon). Aging creates a new youngest
+ * generation, then walks the page tables of every address space and moves the pages that were
+ * accessed since the last walk to it. Eviction only takes pages from the oldest generation, and
+ * moves min_seq forward once it is empty. Eviction never touches the LRU_GEN_MIN youngest
+ * generations, and there are never more than LRU_GEN_NR of them (the oldest two get folded
+ * together, if need be).
+ *
+ * Pages in generations are accounted as NR_INACTIVE_*, and never have PAGE_FLAG_ACTIVE set.
+ */
+#define LRU_GEN_NR    4
+#define LRU_GEN_MIN   2
+#define LRU_GEN_FILE  0
+#define LRU_GEN_ANON  1
+#define LRU_GEN_TYPES 2
+
+struct lru_gen
+{
+    unsigned long max_seq;
+    unsigned long min_seq[LRU_GEN_TYPES];
+    /* Generation seq lives in lists[seq % LRU_GEN_NR], oldest pages first */
+    struct list_head lists[LRU_GEN_NR][LRU_GEN_TYPES];
+    unsigned long nr_pages[LRU_GEN_NR][LRU_GEN_TYPES];
+};
+
 struct page_lru
 {
     /* LRU lists for the LRU-2Q + CLOCK algorithm */
     struct list_head lru_lists[NR_LRU_LISTS];
+    /* Generations for the multi-gen LRU, if gen_enabled */
+    struct lru_gen gen;
+    bool gen_enabled;
+    /* Evictions and activations so far, to measure refault distances (see workingset.h) */
+    unsigned long nonresident_age;
     struct spinlock lock;
 };
 
@@ -37,15 +72,131 @@ CONSTEXPR static inline void page_lru_init(struct page_lru *lru)
 {
     for (int i = 0; i < NR_LRU_LISTS; i++)
         INIT_LIST_HEAD(&lru->lru_lists[i]);
+    for (int gen = 0; gen < LRU_GEN_NR; gen++)
+    {
+        for (int type = 0; type < LRU_GEN_TYPES; type++)
+        {
+            INIT_LIST_HEAD(&lru->gen.lists[gen][type]);
+            lru->gen.nr_pages[gen][type] = 0;
+        }
+    }
+
+    lru->gen.max_seq = LRU_GEN_MIN - 1;
+    for (int type = 0; type < LRU_GEN_TYPES; type++)
+        lru->gen.min_seq[type] = 0;
+    lru->gen_enabled = false;
+    lru->nonresident_age = 0;
     spinlock_init(&lru->lock);
 }
 
 __BEGIN_CDECLS
 
 void page_add_lru(struct page *page);
+/* Same as page_add_lru for every non-NULL page, taking each LRU's lock once per run of pages */
+void page_add_lru_batch(struct page **pages, unsigned int nr);
 void page_remove_lru(struct page *page);
 void page_lru_demote_reclaim(struct page *page);
 
+/**
+ * @brief Take a page off the LRU, and get a reference to it
+ * Fails if the page isn't on the LRU (e.g reclaim already isolated it) or is being freed.
+ *
+ * @param page Page
+ * @return True if isolated, false if not
+ */
+bool page_isolate_lru(struct page *page);
+
+/**
+ * @brief Put an isolated page back on the LRU (the active or inactive list, depending on the page)
+ * The isolation reference is not dropped.
+ *
+ * @param page Page
+ */
+void page_putback_lru(struct page *page);
+
+/**
+ * @brief Give a page's replacement the same multi-gen LRU generation (by age, if it belongs to
+ * another LRU), so it isn't put back as the oldest one. Must be called before newpage is on the
+ * LRU, and after its ANON flag is set.
+ *
+ * @param page Isolated page
+ * @param newpage Page replacing it
+ */
+void page_lru_copy_gen(struct page *page, struct page *newpage);
+
+/**
+ * @brief Put a page isolated by reclaim back on the LRU
+ * Called with the lru lock held. Rotated pages go back to the inactive list (or the oldest
+ * generation), activated ones to the active list (or the youngest generation).
+ *
+ * @param lru The page's page_lru
+ * @param page Page
+ * @param activate True to activate the page, false to rotate it
+ */
+void __page_lru_putback(struct page_lru *lru, struct page *page, bool activate);
+
+/**
+ * @brief Isolate pages from the oldest generation of a multi-gen LRU
+ * Called with the lru lock held. Isolated pages get a reference, and PAGE_FLAG_LRU cleared.
+ *
+ * @param lru LRU (in multi-gen mode)
+ * @param type LRU_GEN_FILE or LRU_GEN_ANON
+ * @param page_list List to add the isolated pages to
+ * @param nr Number of pages to isolate
+ * @return Number of pages scanned
+ */
+unsigned long lru_gen_isolate(struct page_lru *lru, int type, struct list_head *page_list,
+                              unsigned long nr);
+
+/**
+ * @brief Check if a multi-gen LRU needs aging before pages of a given type can be evicted
+ *
+ * @param lru LRU
+ * @param type LRU_GEN_FILE or LRU_GEN_ANON
+ * @return True if eviction has run out of generations to evict
+ */
+bool lru_gen_needs_aging(struct page_lru *lru, int type);
+
+/**
+ * @brief Age the multi-gen LRUs, if @a lru still needs it
+ * Creates a new generation on every LRU, then walks every address space's page tables, and
+ * moves the pages that were accessed since the last walk to it.
+ *
+ * @param lru LRU that ran out of generations to evict
+ * @param anon True if anon pages are being evicted as well
+ * @return Number of pages moved to the youngest generation
+ */
+unsigned long lru_gen_age(struct page_lru *lru, bool anon);
+
+/**
+ * @brief Switch every LRU to or from multi-gen mode
+ * Pages on the inactive lists go to the oldest generation, pages on the active lists to the
+ * youngest one, and vice versa.
+ *
+ * @param enabled True to enable the multi-gen LRU
+ */
+void lru_gen_set_enabled(bool enabled);
+
+/**
+ * @brief Clear the accessed bits in a range, and gather the pages that had them set
+ * Every page returned holds a reference, that the caller must drop.
+ *
+ * @param mm Address space
+ * @param start Start of the range
+ * @param end End of the range
+ * @param pages Array of pages to fill
+ * @param nr Pointer to the number of pages found (filled in)
+ * @param max Size of the pages array
+ * @return Address to resume the walk at, or @a end if the whole range was walked
+ */
+unsigned long vm_gather_young_pages(struct mm_address_space *mm, unsigned long start,
+                                    unsigned long end, struct page **pages, unsigned int *nr,
+                                    unsigned int max);
+
+/* /sys/vm/lru_gen_enabled */
+ssize_t lru_gen_enabled_sysfs_read(void *buffer, size_t size, off_t off);
+ssize_t lru_gen_enabled_sysfs_write(void *buffer, size_t size, off_t off);
+
 __END_CDECLS
 
 #endif
@@ -10,6 +10,7 @@
 #define _ONYX_MM_PAGE_NODE_H
 
 #include <onyx/list.h>
+#include <onyx/mm/numa.h>
 #include <onyx/mm/page_zone.h>
 #include <onyx/spinlock.h>
 
@@ -17,29 +18,36 @@ struct page_node
 {
     struct spinlock node_lock;
     struct list_head cpu_list_node;
+    int nid;
     unsigned long used_pages;
     unsigned long total_pages;
+    /* Nodes we fall back to when we're out of memory, sorted by distance (starting with us) */
+    int fallback[MAX_NUMNODES];
+    unsigned int nr_fallback;
     struct page_zone zones[NR_ZONES];
 
 #ifdef __cplusplus
     struct page_zone *pick_zone(unsigned long page);
 
-    constexpr page_node() : node_lock{}, cpu_list_node{}, used_pages{}, total_pages{}
+    constexpr page_node()
+        : node_lock{}, cpu_list_node{}, nid{}, used_pages{}, total_pages{}, fallback{}, nr_fallback{}
     {
         spinlock_init(&node_lock);
         page_zone_init(&zones[0], "DMA32", 0, UINT32_MAX);
         page_zone_init(&zones[1], "Normal", (u64) UINT32_MAX + 1, UINT64_MAX);
     }
 
-    void init()
+    void init(int node_id)
     {
         INIT_LIST_HEAD(&cpu_list_node);
+        nid = node_id;
+        for (auto &zone : zones)
+            zone.node = node_id;
     }
 
-    void add_region(unsigned long base, size_t size);
+    void build_fallback();
+    void add_region(unsigned long base, size_t size, bool verbose = true);
     struct page *alloc_order(unsigned int order, unsigned long flags);
-    struct page *allocate_pages(unsigned long nr_pages, unsigned long flags);
-    struct page *alloc_page(unsigned long flags);
     void free_page(struct page *p);
 
     template <typename Callable>
@@ -56,10 +64,13 @@ struct page_node
 #endif
 };
 
-/* ugh */
-
 __BEGIN_CDECLS
-extern struct page_node main_node;
+extern struct page_node page_nodes[MAX_NUMNODES];
+
+static inline struct page_node *page_node_of(int nid)
+{
+    return &page_nodes[nid];
+}
 
 #define for_zones_in_node(node, zone) \
     for (zone = node->zones; zone < node->zones + NR_ZONES; zone++)
@@ -72,6 +72,8 @@ struct page_pcpu_data
 struct page_zone
 {
     const char *name;
+    /* NUMA node we belong to */
+    int node;
     unsigned long start;
     unsigned long end;
     unsigned long min_watermark;
@@ -92,6 +94,7 @@ constexpr void page_zone_init(page_zone *zone, const char *name, unsigned long s
                               unsigned long end)
 {
     zone->name = name;
+    zone->node = 0;
     zone->start = start;
     zone->end = end;
     zone->high_watermark = zone->min_watermark = zone->low_watermark = 0;
@@ -106,6 +109,49 @@ constexpr void page_zone_init(page_zone *zone, const char *name, unsigned long s
     zone->merges = zone->splits = 0;
     page_lru_init(&zone->zone_lru);
 }
+
+/**
+ * @brief Check if an allocation of a given order would succeed, right now
+ *
+ * @param zone Zone
+ * @param gfp GFP flags of the allocation
+ * @param order Order
+ * @return True if it would, else false
+ */
+bool page_zone_may_alloc(struct page_zone *zone, gfp_t gfp, unsigned int order);
+
+/**
+ * @brief Take free blocks smaller than max_order in [start_pfn, end_pfn) out of the buddy allocator
+ * Pages are returned as allocated order-0 pages (linked by lru_node), and should be freed with
+ * free_page. Used by compaction, as migration targets.
+ *
+ * @param zone Zone the range belongs to
+ * @param start_pfn First pfn
+ * @param end_pfn End pfn (exclusive)
+ * @param max_order Blocks of this order (or larger) are left alone
+ * @param list List to add the pages to
+ * @param nr Number of pages to take (may be overshot by a block)
+ * @return Number of pages isolated
+ */
+unsigned long page_zone_isolate_free(struct page_zone *zone, unsigned long start_pfn,
+                                     unsigned long end_pfn, unsigned int max_order,
+                                     struct list_head *list, unsigned long nr);
+
+/**
+ * @brief Count the free pages in blocks of a given order (or larger)
+ *
+ * @param zone Zone
+ * @param order Minimum order
+ * @return Number of pages
+ */
+unsigned long page_zone_free_pages_order(struct page_zone *zone, unsigned int order);
+
+/**
+ * @brief Drain this CPU's pcpu cache for a zone, back to the buddy allocator
+ *
+ * @param zone Zone
+ */
+void page_zone_drain_pcpu(struct page_zone *zone);
 #endif
 
 #endif
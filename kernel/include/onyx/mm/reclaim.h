@@ -10,9 +10,13 @@
 
 #include <onyx/compiler.h>
 
+#include <uapi/posix-types.h>
+
 #define RECLAIM_MODE_DIRECT     0
 #define RECLAIM_MODE_PAGEDAEMON 1
 
+struct page_node;
+
 struct reclaim_data
 {
     int failed_order;
@@ -20,6 +24,8 @@ struct reclaim_data
     unsigned long nr_reclaimed;
     unsigned int mode;
     unsigned int gfp_flags;
+    /* NUMA node to reclaim from, or NULL for every node */
+    struct page_node *node;
 };
 
 __BEGIN_CDECLS
@@ -33,6 +39,9 @@ __BEGIN_CDECLS
  */
 int page_do_reclaim(struct reclaim_data *data);
 
+/* /sys/vm/reclaim_stat */
+ssize_t reclaim_stat_sysfs_read(void *buffer, size_t size, off_t off);
+
 __END_CDECLS
 
 #endif
@@ -50,6 +50,8 @@ struct slab_cache
     unsigned int bufctl_off;
     struct spinlock lock;
     int mag_limit;
+    /* Number of kmem_cache_create callers that got this cache (see cache merging) */
+    unsigned int refcount;
     void (*ctor)(void *);
     // TODO: This is horrible. We need a way to allocate percpu memory,
     // and then either trim it or grow it when CPUs come online.
@@ -70,11 +72,16 @@ __BEGIN_CDECLS
  * objects before kmem_cache_alloc. */
 #define KMEM_CACHE_TYPESAFE_BY_RCU (1 << 4)
 
+/* Never merge this cache with other compatible caches (see kmem_cache_create) */
+#define KMEM_CACHE_NOMERGE         (1 << 5)
+
 #define SLAB_PANIC           KMEM_CACHE_PANIC
 #define SLAB_TYPESAFE_BY_RCU KMEM_CACHE_TYPESAFE_BY_RCU
 
 /**
  * @brief Create a slab cache
+ * Caches without a ctor (and without TYPESAFE_BY_RCU or NOMERGE) may be merged with an existing
+ * cache with the same object layout and flags. In that case, the existing cache is returned.
  *
  * @param name Name of the slab cache
  * @param size Size of each object
@@ -107,6 +114,14 @@ void kmem_cache_free(struct slab_cache *cache, void *ptr);
 
 void *kmalloc(size_t size, int flags) __malloc;
 
+/**
+ * @brief Get the size kmalloc would actually allocate for a request
+ *
+ * @param size Requested size
+ * @return Object size of the kmalloc class @a size falls in, or 0 if it's too large for kmalloc
+ */
+size_t kmalloc_size_roundup(size_t size);
+
 /**
  * @brief Free a pointer to an object in a slab
  * This function panics on bad pointers. If NULL is given, it's a no-op.
@@ -133,7 +148,8 @@ void kmem_cache_purge(struct slab_cache *cache);
 /**
  * @brief Destroy a slab cache
  * This function destroys a slab cache, frees everything and removes it from the list
- * of slabs. If given a slab with active objects, it will panic.
+ * of slabs. If given a slab with active objects, it will panic. Merged caches are only destroyed
+ * once every user destroyed them.
  *
  * @param cache Slab cache
  */
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#ifndef _ONYX_MM_THP_H
+#define _ONYX_MM_THP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <onyx/compiler.h>
+
+#include <uapi/posix-types.h>
+
+/*
+ * Transparent huge pages (for private anonymous memory). A THP is an order-9 buddy allocation,
+ * mapped by a single huge pmd. Its subpages are ordinary pages: each one is refcounted, mapcounted,
+ * anon-rmapped and LRU'd on its own, and a huge pmd mapping counts as one map of every subpage.
+ * This means a huge pmd can be split into a PTE table at any time (partial munmap/mprotect, CoW
+ * without memory, reclaim) without touching the pages themselves. Once split, the subpages are
+ * freed back to the buddy allocator one by one.
+ */
+
+#define THP_ORDER    (PMD_SHIFT - PAGE_SHIFT)
+#define THP_NR_PAGES (1UL << THP_ORDER)
+
+enum thp_policy
+{
+    THP_NEVER = 0,
+    THP_MADVISE,
+    THP_ALWAYS
+};
+
+struct vm_area_struct;
+struct vm_pf_context;
+struct anon_vma;
+struct page;
+
+__BEGIN_CDECLS
+
+/**
+ * @brief Check if we can fault in a THP for this address
+ *
+ * @param vma VMA
+ * @param addr Faulting address
+ * @return True if the policy allows it and the whole huge page fits in the vma
+ */
+bool thp_vma_allowed(struct vm_area_struct *vma, unsigned long addr);
+
+/**
+ * @brief Allocate and set up a zeroed THP for anonymous memory
+ * Each subpage comes with a reference that the caller must drop (with thp_put_pages) once mapped.
+ *
+ * @param vma VMA the THP will be mapped in (for its memory policy)
+ * @param anon anon_vma of the mapping
+ * @param haddr Huge page aligned address the THP will be mapped at
+ * @return The first subpage, or NULL
+ */
+struct page *thp_alloc_anon(struct vm_area_struct *vma, struct anon_vma *anon,
+                            unsigned long haddr);
+
+/**
+ * @brief Drop a reference to every subpage of a THP
+ *
+ * @param page First subpage
+ */
+void thp_put_pages(struct page *page);
+
+/**
+ * @brief Handle a page fault on a (possibly) huge pmd
+ *
+ * @param ctx Page fault context
+ * @return 0 or negative error codes if handled, VM_FAULT_FALLBACK if the fault needs to be handled
+ * at the PTE level.
+ */
+int do_huge_pmd_fault(struct vm_pf_context *ctx);
+
+/**
+ * @brief Get a reference to the subpage mapped by a huge pmd (for get_phys_pages)
+ *
+ * @param vma VMA
+ * @param addr Address
+ * @param flags GPP_* flags
+ * @return Referenced page, or NULL if there's no (suitable) huge pmd mapped there
+ */
+struct page *follow_huge_pmd(struct vm_area_struct *vma, unsigned long addr, unsigned int flags);
+
+/* /sys/vm/transparent_hugepage */
+ssize_t thp_sysfs_read(void *buffer, size_t size, off_t off);
+ssize_t thp_sysfs_write(void *buffer, size_t size, off_t off);
+
+__END_CDECLS
+
+#endif
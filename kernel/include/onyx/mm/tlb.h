@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#ifndef _ONYX_MM_TLB_H
+#define _ONYX_MM_TLB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <onyx/compiler.h>
+#include <onyx/limits.h>
+
+/*
+ * TLB flush batching. Page table changes that need a shootdown (unmaps, protection changes)
+ * record the affected ranges in a tlb_batch, and pages that can't be freed until the TLB no longer
+ * references them (unmapped pages, freed page tables) are deferred in it. Flushing the batch
+ * issues a single shootdown for every range (and a single TLB generation bump), and only then
+ * drops the deferred pages. Once the batch covers more than TLB_BATCH_FULL_FLUSH_PAGES pages (or
+ * more than TLB_BATCH_NR_RANGES disjoint ranges), flushing the whole ASID is cheaper than
+ * invalidating page by page, so the batch degrades to a full flush.
+ *
+ * CPUs that are running a kernel thread on top of the mm (lazy TLB) are skipped by user
+ * shootdowns, unless page tables were freed: they catch up when they switch back to the mm and
+ * notice its TLB generation moved.
+ */
+
+#define TLB_BATCH_NR_RANGES        8
+#define TLB_BATCH_NR_PAGES         32
+/* Same as the default linux tlb_single_page_flush_ceiling */
+#define TLB_BATCH_FULL_FLUSH_PAGES 33
+
+/* Flush the whole ASID instead of the ranges */
+#define TLB_BATCH_FLUSH_ALL      (1 << 0)
+/* Page tables were freed, every CPU with the mm loaded must flush (even lazy ones) */
+#define TLB_BATCH_FREED_TABLES   (1 << 1)
+/* The batch holds a reference to the mm (see tlb_batch_switch_mm) */
+#define TLB_BATCH_OWNS_MM        (1 << 2)
+
+struct mm_address_space;
+struct page;
+
+struct tlb_range
+{
+    unsigned long start;
+    unsigned long end;
+};
+
+struct tlb_batch
+{
+    struct mm_address_space *mm;
+    unsigned int flags;
+    unsigned int nr_ranges;
+    /* Number of pages added to the batch since the last flush */
+    unsigned long nr_pages;
+    struct tlb_range ranges[TLB_BATCH_NR_RANGES];
+    /* Deferred pages. Points to local_pages, or to an overflow page if we managed to get one. */
+    struct page **pages;
+    unsigned int nr_deferred;
+    unsigned int max_deferred;
+    struct page *overflow;
+    struct page *local_pages[TLB_BATCH_NR_PAGES];
+};
+
+__BEGIN_CDECLS
+
+/**
+ * @brief Initialize a TLB batch
+ *
+ * @param batch Batch
+ * @param mm Address space the batch flushes (may be NULL, see tlb_batch_switch_mm)
+ */
+void tlb_batch_init(struct tlb_batch *batch, struct mm_address_space *mm);
+
+/**
+ * @brief Flush the batch and release its resources
+ *
+ * @param batch Batch
+ */
+void tlb_batch_finish(struct tlb_batch *batch);
+
+/**
+ * @brief Flush the pending invalidations, and free the deferred pages
+ *
+ * @param batch Batch
+ */
+void tlb_batch_flush(struct tlb_batch *batch);
+
+/**
+ * @brief Point the batch to a different address space
+ * Flushes the pending invalidations for the old one. The batch holds a reference to mm until it's
+ * switched again or finished, so it's safe to use without holding any mm locks (e.g in reclaim).
+ *
+ * @param batch Batch
+ * @param mm New address space
+ */
+void tlb_batch_switch_mm(struct tlb_batch *batch, struct mm_address_space *mm);
+
+/**
+ * @brief Add a range to be invalidated
+ *
+ * @param batch Batch
+ * @param start Start of the range
+ * @param end End of the range (exclusive)
+ */
+void tlb_batch_add_range(struct tlb_batch *batch, unsigned long start, unsigned long end);
+
+/**
+ * @brief Check if the batch will invalidate (part of) a range
+ *
+ * @param batch Batch
+ * @param start Start of the range
+ * @param end End of the range
+ * @return True if it overlaps with the pending invalidations
+ */
+bool tlb_batch_covers(struct tlb_batch *batch, unsigned long start, unsigned long end);
+
+/**
+ * @brief Defer dropping a page reference until after the flush
+ * The range that maps the page must have already been added to the batch. May flush.
+ *
+ * @param batch Batch
+ * @param page Page
+ */
+void tlb_batch_defer_free(struct tlb_batch *batch, struct page *page);
+
+/**
+ * @brief Invalidate a page, and optionally defer freeing the page that was mapped there
+ *
+ * @param batch Batch
+ * @param addr Virtual address
+ * @param page Page to unref after the flush, or NULL
+ */
+static inline void tlb_batch_remove_page(struct tlb_batch *batch, unsigned long addr,
+                                         struct page *page)
+{
+    tlb_batch_add_range(batch, addr, addr + PAGE_SIZE);
+    if (page)
+        tlb_batch_defer_free(batch, page);
+}
+
+/**
+ * @brief Defer freeing a page table until after the flush
+ * At least one address translated by the page table must be in the batch.
+ *
+ * @param batch Batch
+ * @param page Page table's page
+ */
+static inline void tlb_batch_free_table(struct tlb_batch *batch, struct page *page)
+{
+    batch->flags |= TLB_BATCH_FREED_TABLES;
+    tlb_batch_defer_free(batch, page);
+}
+
+static inline bool tlb_batch_pending(struct tlb_batch *batch)
+{
+    return batch->nr_pages > 0 || batch->nr_deferred > 0;
+}
+
+/**
+ * @brief Invalidate a set of ranges in a single shootdown (implemented by every architecture)
+ *
+ * @param mm Address space
+ * @param ranges Ranges to invalidate
+ * @param nr_ranges Number of ranges
+ * @param flags TLB_BATCH_* flags
+ */
+void mmu_invalidate_ranges(struct mm_address_space *mm, const struct tlb_range *ranges,
+                           unsigned int nr_ranges, unsigned int flags);
+
+__END_CDECLS
+
+#endif
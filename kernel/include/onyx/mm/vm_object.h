@@ -66,10 +66,21 @@ struct vm_object_ops
     ssize_t (*readpage)(struct page *page, size_t offset, struct inode *ino);
     int (*prepare_write)(struct inode *ino, struct page *page, size_t page_off, size_t offset,
                          size_t len);
+    /* Optional: replaces the generic page cache truncation (see vmo_truncate) */
+    int (*truncate)(struct vm_object *vm_obj, unsigned long size);
 };
 
 #define VMO_FLAG_LOCK_FUTURE_PAGES (1 << 0)
 #define VMO_FLAG_DEVICE_MAPPING    (1 << 1)
+/*
+ * The page cache may hold large folios (compound pages) for this object. A folio of order N
+ * sits at an N-aligned index, and every index it covers points at its respective subpage (so
+ * lookups keep returning the page for the given index). The folio is locked, dirtied, read,
+ * written back and reclaimed as a whole, through its head: the backer's readpage, writepage and
+ * prepare_write get handed the head page (or a subpage, for prepare_write) and must deal with
+ * compound_nr(head) pages at once.
+ */
+#define VMO_FLAG_LARGE_FOLIOS      (1 << 2)
 
 /**
  * @brief Represents a generic VM object, that may have backing or may just be anonymous.
@@ -93,6 +104,13 @@ struct vm_object
     } __dummy_vm_pages;
 #endif
 
+    /* Shadow entries of evicted pages, by page index (see workingset.h). Under the page_lock. */
+#ifdef __cplusplus
+    radix_tree vm_shadows;
+#else
+    struct __dummy_radix __dummy_vm_shadows;
+#endif
+
     /* Points to (or is) private data that may be needed by the backer of this VM */
     void *priv;
 
@@ -124,6 +142,14 @@ struct vm_object
      */
     void unmap_page(size_t offset);
 
+    /**
+     * @brief Unmaps a range of pages from every mapping
+     *
+     * @param offset Offset of the first page
+     * @param nr Number of pages
+     */
+    void unmap_pages(size_t offset, unsigned long nr);
+
     template <typename Callable>
     bool for_every_mapping(Callable c)
     {
@@ -144,9 +170,11 @@ struct vm_object
      *
      * @param off Offset into the vmo, in bytes
      * @param page struct page to insert
+     * @param shadow If not NULL, filled with the shadow entry the page replaced (or 0)
      * @return 0 on success, negative error codes (ENOMEM)
      */
-    struct page *insert_page_unlocked(unsigned long off, struct page *page);
+    struct page *insert_page_unlocked(unsigned long off, struct page *page,
+                                      unsigned long *shadow = nullptr);
 
     template <typename Callable>
     bool for_every_page(Callable c)
@@ -294,11 +322,65 @@ bool vmo_is_shared(struct vm_object *vmo);
  */
 struct page *vmo_add_page_safe(size_t off, struct page *p, struct vm_object *vmo);
 
+/**
+ * @brief Maps a page into the VMO, and fetch the shadow entry it replaced
+ * Same as vmo_add_page_safe. If @a p was inserted, the shadow entry left behind by the previous
+ * page at @a off (if it was evicted) is removed and returned in @a shadow, for workingset_refault.
+ *
+ * @param off Offset of the page inside the VMO.
+ * @param p Page to be mapped on the vmo.
+ * @param vmo The VMO.
+ * @param shadow Pointer to the shadow entry (filled in, 0 if none)
+ * @return The page in the VMO at @a off (@a p if it was inserted), or NULL if out of memory.
+ */
+struct page *vmo_add_page_shadow(size_t off, struct page *p, struct vm_object *vmo,
+                                 unsigned long *shadow);
+
+/**
+ * @brief Insert a batch of new pages into the VMO, under a single lock round-trip
+ * @a pages[i] goes in at page index @a pgoff + i. NULL entries and slots that are already occupied
+ * are skipped. The VMO takes over the caller's reference to each page it inserts. A large folio
+ * in @a pages[i] covers indices i to i + compound_nr - 1 (whose entries must be NULL), and is only
+ * inserted if all of them are free.
+ *
+ * @param vmo The VMO.
+ * @param pgoff Page index of pages[0]
+ * @param pages Pages to insert
+ * @param nr Number of pages (at most the number of bits in an unsigned long)
+ * @param shadows Shadow entries replaced by the inserted pages (see vmo_add_page_shadow), by index
+ * @return Bitmask of the pages that were inserted (the first index, for large folios)
+ */
+unsigned long vmo_add_pages_shadow(struct vm_object *vmo, unsigned long pgoff,
+                                   struct page **pages, unsigned int nr, unsigned long *shadows);
+
+/**
+ * @brief Look up a range of pages in the VMO
+ *
+ * @param vmo The VMO.
+ * @param pgoff Page index of the first page
+ * @param nr Number of pages to look up
+ * @param pages Filled with referenced pages, pages[i] being at @a pgoff + i (NULL if not present)
+ * @return Number of pages found
+ */
+unsigned int vmo_get_range(struct vm_object *vmo, unsigned long pgoff, unsigned int nr,
+                           struct page **pages);
+
 void vm_obj_clean_page(struct vm_object *obj, struct page *page);
 
 void vm_obj_reassign_mapping(struct vm_object *vm_obj, struct vm_area_struct *vma);
 
-bool vm_obj_remove_page(struct vm_object *obj, struct page *page);
+/**
+ * @brief Remove a page from its vm object
+ * Fails if anyone but the caller, the vm object and the page's mappings holds a reference.
+ *
+ * @param obj The page's vm object
+ * @param page Page to remove (locked)
+ * @param evict True if reclaim is evicting the page, to leave a shadow entry behind
+ * @return True if removed, false if not
+ */
+bool vm_obj_remove_page(struct vm_object *obj, struct page *page, bool evict);
+
+bool vm_obj_replace_page(struct vm_object *obj, struct page *page, struct page *newpage);
 
 long vm_obj_get_page_references(struct vm_object *obj, struct page *page, unsigned int *vm_flags);
 
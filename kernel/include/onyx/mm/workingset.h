@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#ifndef _ONYX_MM_WORKINGSET_H
+#define _ONYX_MM_WORKINGSET_H
+
+#include <onyx/compiler.h>
+
+#include <uapi/posix-types.h>
+
+/*
+ * Working set detection, by refault distance. When reclaim evicts a page cache (or swap cache)
+ * page, it leaves a shadow entry behind in the page's vm_object, that records the LRU the page
+ * was on and that LRU's nonresident_age (the number of evictions and activations it has seen).
+ * When the page is read back in, the difference between the LRU's current age and the one in the
+ * shadow entry (the refault distance) is roughly the number of pages the inactive list (or the
+ * oldest generation) went through while the page was out. If the page would have fit in memory
+ * had the working set (the active lists, or every generation but the oldest) given up that many
+ * pages, the page is part of the working set, and gets activated right away instead of having to
+ * go through the inactive list again.
+ */
+
+struct page;
+
+__BEGIN_CDECLS
+
+/**
+ * @brief Make a shadow entry for a page that's being evicted
+ * Called with the page's vm_object's page_lock held.
+ *
+ * @param page Page being evicted
+ * @return Shadow entry to store in the page's slot (never 0)
+ */
+unsigned long workingset_eviction(struct page *page);
+
+/**
+ * @brief Look at a page's shadow entry when it gets read back in
+ * Activates the page if its refault distance says it's part of the working set. Must be called
+ * before the page is added to the LRU.
+ *
+ * @param page New page
+ * @param shadow Shadow entry the page replaced (0 if none)
+ */
+void workingset_refault(struct page *page, unsigned long shadow);
+
+/* /sys/vm/workingset_stat */
+ssize_t workingset_stat_sysfs_read(void *buffer, size_t size, off_t off);
+
+__END_CDECLS
+
+#endif
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#ifndef _ONYX_MM_ZERO_POOL_H
+#define _ONYX_MM_ZERO_POOL_H
+
+#include <stddef.h>
+
+#include <onyx/compiler.h>
+
+#include <uapi/posix-types.h>
+
+/*
+ * The zero pool is a small cache of order-0 pages that were zeroed ahead of time by a very low
+ * priority kernel thread (using non-temporal stores, so we don't trash the cache). Order-0
+ * allocations that want zeroed memory (anon faults, page tables, etc) get served from it first,
+ * which takes the 4KiB memset out of the fault path. There's a pool per NUMA node, filled with pages
+from that node, so allocations only get pages from the node they asked for. Pool pages are allocated pages as far as the
+ * buddy allocator is concerned, so the pool is drained back whenever an allocation fails.
+ */
+
+struct page;
+
+struct zero_pool_stats
+{
+    unsigned long nr_pages;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long zeroed;
+    unsigned long drained;
+};
+
+__BEGIN_CDECLS
+
+/**
+ * @brief Grab a pre-zeroed page from a node's pool
+ *
+ * @param nid Node id
+ * @return Page (with the allocator's state left as is), or NULL if the pool is empty
+ */
+struct page *zero_pool_alloc(int nid);
+
+/**
+ * @brief Give every pool page (on every node) back to the page allocator
+ *
+ * @return Number of pages freed
+ */
+unsigned long zero_pool_drain(void);
+
+/**
+ * @brief Synchronously top up a node's pool
+ *
+ * @param nid Node id
+ * @param nr Maximum number of pages to add
+ * @return Number of pages added
+ */
+unsigned long zero_pool_fill(int nid, unsigned long nr);
+
+/**
+ * @brief Get a node's pool stats
+ *
+ * @param nid Node id
+ * @param st Pointer to the stats
+ */
+void zero_pool_get_stats(int nid, struct zero_pool_stats *st);
+
+/**
+ * @brief Look at the page the next allocation from a node's pool would get (for testing)
+ * The page stays in the pool, and may be taken by someone else at any time.
+ *
+ * @param nid Node id
+ * @return Page, or NULL if the pool is empty
+ */
+struct page *zero_pool_peek(int nid);
+
+/* /sys/vm/zero_pool_high and /sys/vm/zero_pool_stat */
+ssize_t zero_pool_high_sysfs_read(void *buffer, size_t size, off_t off);
+ssize_t zero_pool_high_sysfs_write(void *buffer, size_t size, off_t off);
+ssize_t zero_pool_stat_sysfs_read(void *buffer, size_t size, off_t off);
+
+__END_CDECLS
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#ifndef _ONYX_MM_ZSWAP_H
+#define _ONYX_MM_ZSWAP_H
+
+#include <errno.h>
+#include <stdbool.h>
+
+#include <onyx/compiler.h>
+#include <onyx/page.h>
+#include <onyx/pgtable.h>
+
+#include <uapi/posix-types.h>
+
+/*
+ * zswap is a compressed cache that sits in front of the swap areas. Pages that are being written
+ * to swap get compressed into a pool of size-classed slab caches instead, and swap-in faults get
+ * served from the pool, without any IO. Pages filled with a single repeated word don't use pool
+ * memory at all. Pages only reach the swap device itself if the pool is full, or if they don't
+ * compress well. Compressed copies are keyed by swap slot, and dropped when the slot is freed.
+ */
+
+struct page;
+
+__BEGIN_CDECLS
+
+#ifdef CONFIG_ZSWAP
+
+/**
+ * @brief Store a swap cache page in zswap
+ *
+ * @param page Page to store (locked, in the swap cache)
+ * @return 0 on success (the page need not be written out), negative error codes
+ */
+int zswap_store(struct page *page);
+
+/**
+ * @brief Load a page from zswap
+ *
+ * @param page Page to fill (locked)
+ * @param swp Swap entry to load
+ * @return 0 if the page was filled in, -ENOENT if zswap doesn't have it, negative error codes
+ */
+int zswap_load(struct page *page, swp_entry_t swp);
+
+/**
+ * @brief Drop a swap slot's compressed copy
+ * Called when the slot is freed. Does not sleep.
+ *
+ * @param swp Swap entry
+ */
+void zswap_invalidate(swp_entry_t swp);
+
+/**
+ * @brief Set up zswap for a new swap area
+ *
+ * @param type Swap area index
+ * @param nr_slots Number of slots (including the header) in the swap area
+ */
+void zswap_swapon(unsigned int type, unsigned long nr_slots);
+
+/**
+ * @brief Tear down zswap for a swap area that is going away
+ * Called once every slot in the area has been freed, and no one can look at the area anymore.
+ *
+ * @param type Swap area index
+ */
+void zswap_swapoff(unsigned int type);
+
+/* /sys/vm/zswap_max_pool_percent and /sys/vm/zswap_stat */
+ssize_t zswap_max_pool_percent_sysfs_read(void *buffer, size_t size, off_t off);
+ssize_t zswap_max_pool_percent_sysfs_write(void *buffer, size_t size, off_t off);
+ssize_t zswap_stat_sysfs_read(void *buffer, size_t size, off_t off);
+
+#else
+
+static inline int zswap_store(struct page *page)
+{
+    return -ENOSYS;
+}
+
+static inline int zswap_load(struct page *page, swp_entry_t swp)
+{
+    return -ENOENT;
+}
+
+static inline void zswap_invalidate(swp_entry_t swp)
+{
+}
+
+static inline void zswap_swapon(unsigned int type, unsigned long nr_slots)
+{
+}
+
+static inline void zswap_swapoff(unsigned int type)
+{
+}
+
+#endif
+
+__END_CDECLS
+
+#endif
@@ -11,6 +11,7 @@
 #include <lib/binary_search_tree.h>
 
 #include <onyx/cpumask.h>
+#include <onyx/list.h>
 #include <onyx/maple_tree.h>
 #include <onyx/ref.h>
 #include <onyx/rwlock.h>
@@ -42,6 +43,9 @@ struct mm_address_space
     unsigned long start;
     unsigned long end;
     struct rwlock vm_lock;
+    /* Bumped every time vm_lock is released for writing. VMAs whose vm_lock_seq matches are
+     * write-locked. See vma_start_write. */
+    unsigned long mm_lock_seq;
 
     /* mmap(2) base */
     void *mmap_base;
@@ -69,6 +73,12 @@ struct mm_address_space
 
     struct spinlock page_table_lock;
 
+    /* MEMBARRIER_STATE_* flags. Inherited on fork, cleared on exec (new mm). */
+    unsigned int membarrier_state;
+
+    /* Node in the list of every user address space (see mm_list_next) */
+    struct list_head mm_list_node;
+
 #ifdef __cplusplus
     mm_address_space &operator=(mm_address_space &&as)
     {
@@ -88,6 +98,8 @@ struct mm_address_space
 #endif
 };
 
+#define MEMBARRIER_STATE_PRIVATE_EXPEDITED (1U << 0)
+
 #define increment_vm_stat(as, name, amount) __sync_add_and_fetch(&as->name, amount)
 #define decrement_vm_stat(as, name, amount) __sync_sub_and_fetch(&as->name, amount)
 
@@ -109,6 +121,16 @@ static inline void mmgrab(struct mm_address_space *mm)
 void __mmdrop(struct mm_address_space *mm);
 void __mmput(struct mm_address_space *mm);
 
+/**
+ * @brief Iterate over every user address space
+ * Used by code that needs to look at every page table in the system (e.g swapoff).
+ *
+ * @param prev Previous address space (with a mm_users reference, which gets dropped), or NULL to
+ * start at the beginning
+ * @return The next address space (with a mm_users reference), or NULL at the end
+ */
+struct mm_address_space *mm_list_next(struct mm_address_space *prev);
+
 static inline void mmdrop(struct mm_address_space *mm)
 {
     if (refcount_dec_and_test(&mm->mm_count))
@@ -121,6 +143,23 @@ static inline void mmput(struct mm_address_space *mm)
         __mmput(mm);
 }
 
+static inline void mmap_write_lock(struct mm_address_space *mm)
+{
+    rw_lock_write(&mm->vm_lock);
+}
+
+/**
+ * @brief Unlock the address space for writing
+ * This also unlocks every VMA that was write-locked (with vma_start_write) in the meanwhile.
+ *
+ * @param mm Address space
+ */
+static inline void mmap_write_unlock(struct mm_address_space *mm)
+{
+    __atomic_store_n(&mm->mm_lock_seq, mm->mm_lock_seq + 1, __ATOMIC_RELEASE);
+    rw_unlock_write(&mm->vm_lock);
+}
+
 __END_CDECLS
 
 #endif
@@ -76,14 +76,24 @@ __BEGIN_CDECLS
 #define PAGE_FLAG_ACTIVE      (1 << 13)
 #define PAGE_FLAG_SWAP        (1 << 14)
 #define PAGE_FLAG_RECLAIM     (1 << 15)
+/* Compound pages (see __GFP_COMP) */
+#define PAGE_FLAG_HEAD        (1 << 16)
+#define PAGE_FLAG_TAIL        (1 << 17)
+/* Head of a hugetlb pool page, goes back to the pool when freed */
+#define PAGE_FLAG_HUGETLB     (1 << 18)
+/* Multi-gen LRU generation of the page, plus one (0 = not in a generation). See page_lru.h. */
+#define PAGE_FLAG_GEN_SHIFT   19
+#define PAGE_FLAG_GEN_MASK    (7UL << PAGE_FLAG_GEN_SHIFT)
 
 #define PAGEFLAG_OPS(lowercase, uppercase)                                          \
     static inline void page_clear_##lowercase(struct page *page)                    \
     {                                                                               \
+        page = compound_head(page);                                                 \
         __atomic_and_fetch(&page->flags, ~PAGE_FLAG_##uppercase, __ATOMIC_RELEASE); \
     }                                                                               \
     static inline void page_set_##lowercase(struct page *page)                      \
     {                                                                               \
+        page = compound_head(page);                                                 \
         __atomic_or_fetch(&page->flags, PAGE_FLAG_##uppercase, __ATOMIC_RELEASE);   \
     }                                                                               \
     static inline bool page_test_set_##lowercase(struct page *page)                 \
@@ -131,12 +141,25 @@ struct CAPABILITY("page") page
         };
 
         struct list_head lru_node;
+
+        struct
+        {
+            /* Tail pages point to their head. page[1] also holds the order of the compound page.
+             */
+            struct page *head;
+            unsigned long order;
+        } compound;
     };
 
     unsigned long priv;
 #ifdef CONFIG_PAGE_OWNER
     u32 last_owner, last_lock, last_unlock, last_free;
 #endif
+#ifdef CONFIG_ALLOC_PROFILING
+    /* Call site that allocated the page (see onyx/mm/alloc_profile.h). Only set on the head of
+     * compound pages. */
+    u16 alloc_tag;
+#endif
 };
 
 struct memstat;
@@ -196,6 +219,9 @@ struct page *page_add_page_late(void *paddr);
 #define __GFP_NO_INSTRUMENT   (1 << 13)
 #define __GFP_NOWARN          (1 << 14)
 #define __GFP_NOWAIT          (1 << 15)
+#define __GFP_COMP            (1 << 16)
+/* Don't fall back to other NUMA nodes */
+#define __GFP_THISNODE        (1 << 17)
 #define __GFP_MAY_RECLAIM     (__GFP_DIRECT_RECLAIM | __GFP_WAKE_PAGEDAEMON)
 #define GFP_KERNEL            (__GFP_MAY_RECLAIM | __GFP_IO | __GFP_FS)
 #define GFP_ATOMIC            (__GFP_ATOMIC | __GFP_WAKE_PAGEDAEMON)
@@ -222,6 +248,55 @@ static inline struct page *alloc_page(unsigned long flags)
     return alloc_pages(0, flags);
 }
 
+/**
+ * @brief Allocate pages from a set of NUMA nodes
+ * Ignores the current memory policy.
+ *
+ * @param order Order of the allocation
+ * @param flags GFP flags
+ * @param nid Preferred node (NUMA_NO_NODE for the local node)
+ * @param allowed Mask of nodes we may allocate from (or fall back to)
+ * @return Pages, or NULL
+ */
+struct page *__alloc_pages_nodemask(unsigned int order, unsigned long flags, int nid,
+                                    unsigned long allowed);
+
+/**
+ * @brief Allocate pages from a set of NUMA nodes, on behalf of a caller
+ * Same as __alloc_pages_nodemask, but the allocation is profiled as coming from ip.
+ *
+ * @param order Order of the allocation
+ * @param flags GFP flags
+ * @param nid Preferred node (NUMA_NO_NODE for the local node)
+ * @param allowed Mask of nodes we may allocate from (or fall back to)
+ * @param ip Call site, for allocation profiling
+ * @return Pages, or NULL
+ */
+struct page *__alloc_pages_caller(unsigned int order, unsigned long flags, int nid,
+                                  unsigned long allowed, unsigned long ip);
+
+/**
+ * @brief Allocate pages from a specific NUMA node, falling back to the closest ones
+ * Pass __GFP_THISNODE to forbid the fallback.
+ *
+ * @param nid Node (NUMA_NO_NODE for the local node)
+ * @param order Order of the allocation
+ * @param flags GFP flags
+ * @return Pages, or NULL
+ */
+static inline struct page *alloc_pages_node(int nid, unsigned int order, unsigned long flags)
+{
+    return __alloc_pages_nodemask(order, flags, nid, ~0UL);
+}
+
+/**
+ * @brief Get the NUMA node a page belongs to
+ *
+ * @param page Page
+ * @return Node id
+ */
+int page_to_nid(struct page *page);
+
 __always_inline unsigned int pages2order(unsigned long pages)
 {
     if (pages == 1)
@@ -260,8 +335,41 @@ struct used_pages
 
 void page_add_used_pages(struct used_pages *pages);
 
+/*
+ * Compound pages are higher-order allocations (made with __GFP_COMP) that get refcounted as a
+ * single unit. The head page holds the refcount, the flags and the LRU linkage: getting or dropping
+ * a reference, locking, and testing or changing a flag on a tail page all redirect to the head, and
+ * the whole allocation is freed when the head's refcount hits 0. The mapcount, and the page cache
+ * owner and pageoff, stay per-subpage. Raw flags accesses (page->flags) don't redirect, and are
+ * what tells heads and tails apart.
+ */
+static inline bool page_compound(const struct page *page)
+{
+    return READ_ONCE(page->flags) & (PAGE_FLAG_HEAD | PAGE_FLAG_TAIL);
+}
+
+static inline struct page *compound_head(struct page *page)
+{
+    if (unlikely(READ_ONCE(page->flags) & PAGE_FLAG_TAIL))
+        return page->compound.head;
+    return page;
+}
+
+static inline unsigned int compound_order(struct page *page)
+{
+    if (!(READ_ONCE(page->flags) & PAGE_FLAG_HEAD))
+        return 0;
+    return page[1].compound.order;
+}
+
+static inline unsigned long compound_nr(struct page *page)
+{
+    return 1UL << compound_order(page);
+}
+
 static inline unsigned long page_ref(struct page *p)
 {
+    p = compound_head(p);
     unsigned long newrefs = __atomic_add_fetch(&p->ref, 1, __ATOMIC_ACQUIRE);
     DCHECK(newrefs > 1);
     return newrefs;
@@ -269,11 +377,33 @@ static inline unsigned long page_ref(struct page *p)
 
 static inline unsigned long page_ref_many(struct page *p, unsigned long c)
 {
+    p = compound_head(p);
     return __atomic_add_fetch(&p->ref, c, __ATOMIC_ACQUIRE);
 }
 
+/**
+ * @brief Get a reference to a page, unless it's being freed
+ * Useful when looking at pages we don't hold a reference to (e.g by pfn).
+ *
+ * @param p Page
+ * @return True if we got a reference, false if the refcount was 0
+ */
+static inline bool page_try_get(struct page *p)
+{
+    p = compound_head(p);
+    unsigned int refs = __atomic_load_n(&p->ref, __ATOMIC_RELAXED);
+    do
+    {
+        if (refs == 0)
+            return false;
+    } while (!__atomic_compare_exchange_n(&p->ref, &refs, refs + 1, false, __ATOMIC_ACQUIRE,
+                                          __ATOMIC_RELAXED));
+    return true;
+}
+
 static inline unsigned long __page_unref(struct page *p)
 {
+    p = compound_head(p);
     return __atomic_sub_fetch(&p->ref, 1, __ATOMIC_RELEASE);
 }
 
@@ -281,6 +411,7 @@ static inline unsigned long __page_unref(struct page *p)
 
 static inline unsigned long page_unref_many(struct page *p, unsigned long c)
 {
+    p = compound_head(p);
     return __atomic_sub_fetch(&p->ref, c, __ATOMIC_RELEASE);
 }
 
@@ -296,11 +427,13 @@ static inline void page_unpin(struct page *p)
 
 __always_inline void page_set_waiters(struct page *p)
 {
+    p = compound_head(p);
     __atomic_fetch_or(&p->flags, PAGE_FLAG_WAITERS, __ATOMIC_ACQUIRE);
 }
 
 __always_inline void page_clear_waiters(struct page *p)
 {
+    p = compound_head(p);
     __atomic_fetch_and(&p->flags, ~PAGE_FLAG_WAITERS, __ATOMIC_RELEASE);
 }
 
@@ -311,6 +444,7 @@ void page_owner_unlocked(struct page *p);
 
 __always_inline bool try_lock_page(struct page *p) TRY_ACQUIRE(true, p)
 {
+    p = compound_head(p);
     unsigned long flags = __atomic_fetch_or(&p->flags, PAGE_FLAG_LOCKED, __ATOMIC_ACQUIRE);
 #ifdef CONFIG_PAGE_OWNER
     if (!(flags & PAGE_FLAG_LOCKED))
@@ -332,6 +466,7 @@ void page_wake_bit(struct page *p, unsigned int bit);
 
 __always_inline void unlock_page(struct page *p) RELEASE(p) NO_THREAD_SAFETY_ANALYSIS
 {
+    p = compound_head(p);
 #ifdef CONFIG_PAGE_OWNER
     page_owner_unlocked(p);
 #endif
@@ -343,6 +478,7 @@ __always_inline void unlock_page(struct page *p) RELEASE(p) NO_THREAD_SAFETY_ANA
 __always_inline bool page_test_set_flag(struct page *p, unsigned long flag)
 {
     unsigned long word;
+    p = compound_head(p);
     do
     {
         word = __atomic_load_n(&p->flags, __ATOMIC_ACQUIRE);
@@ -356,6 +492,7 @@ __always_inline bool page_test_set_flag(struct page *p, unsigned long flag)
 __always_inline bool page_test_clear_flag(struct page *p, unsigned long flag)
 {
     unsigned long word;
+    p = compound_head(p);
     do
     {
         word = __atomic_load_n(&p->flags, __ATOMIC_ACQUIRE);
@@ -368,6 +505,8 @@ __always_inline bool page_test_clear_flag(struct page *p, unsigned long flag)
 
 __always_inline bool page_flag_set(const struct page *p, unsigned long flag)
 {
+    if (unlikely(READ_ONCE(p->flags) & PAGE_FLAG_TAIL))
+        p = p->compound.head;
     return READ_ONCE(p->flags) & flag;
 }
 
@@ -378,11 +517,13 @@ __always_inline bool page_locked(const struct page *p)
 
 __always_inline void page_set_writeback(struct page *p)
 {
+    p = compound_head(p);
     __atomic_fetch_or(&p->flags, PAGE_FLAG_WRITEBACK, __ATOMIC_RELEASE);
 }
 
 __always_inline void page_clear_writeback(struct page *p)
 {
+    p = compound_head(p);
     unsigned long flags = __atomic_and_fetch(&p->flags, ~PAGE_FLAG_WRITEBACK, __ATOMIC_RELEASE);
     if (unlikely(flags & PAGE_FLAG_WAITERS))
         page_wake_bit(p, PAGE_FLAG_WRITEBACK);
@@ -396,6 +537,7 @@ __always_inline void page_wait_writeback(struct page *p)
 
 __always_inline void page_set_flag(struct page *p, unsigned long flag)
 {
+    p = compound_head(p);
     __atomic_fetch_or(&p->flags, flag, __ATOMIC_RELEASE);
 }
 
@@ -534,14 +676,17 @@ static inline uint64_t get_kernel_phys_offset()
  */
 unsigned long pages_under_high_watermark();
 
+struct page_node;
+
 /**
  * @brief Calculate a free page target (for reclaim)
  *
+ * @param node Node we're reclaiming from, or NULL for every node
  * @param gfp GFP used for the failed allocation/reclaim
  * @param order Order allocation that failed
  * @return Free page target. If 0, probably shouldn't reclaim.
  */
-unsigned long page_reclaim_target(gfp_t gfp, unsigned int order);
+unsigned long page_reclaim_target(struct page_node *node, gfp_t gfp, unsigned int order);
 
 /**
  * @brief Drain pages from all zones' pcpu caches
@@ -598,6 +743,24 @@ static inline void page_sub_mapcount(struct page *page)
         page_unref(page);
 }
 
+/**
+ * @brief Check if any subpage of a (possibly compound) page is mapped
+ *
+ * @param page Page, or the head of a compound page
+ * @return True if mapped anywhere
+ */
+static inline bool page_mapped(struct page *page)
+{
+    unsigned long nr = compound_nr(page);
+    for (unsigned long i = 0; i < nr; i++)
+    {
+        if (page_mapcount(page + i))
+            return true;
+    }
+
+    return false;
+}
+
 void bug_on_page(struct page *page, const char *expr, const char *file, unsigned int line,
                  const char *func);
 
@@ -68,6 +68,7 @@ typedef struct
 struct mm_address_space;
 struct process;
 struct vm_area_struct;
+struct tlb_batch;
 
 void paging_init(void);
 void paging_map_all_phys(void);
@@ -90,6 +91,10 @@ void paging_protect_kernel(void);
 void paging_free_page_tables(struct mm_address_space *mm);
 bool paging_write_protect(void *addr, struct mm_address_space *mm);
 int vm_mmu_unmap(struct mm_address_space *as, void *addr, size_t pages, struct vm_area_struct *vma);
+int vm_mmu_unmap_batch(struct tlb_batch *tlb, void *addr, size_t pages,
+                       struct vm_area_struct *vma);
+int vm_mmu_unmap_noflush(void *addr, size_t pages);
+int vm_map_huge_pmd_kernel(unsigned long virt, unsigned long phys, int prot);
 
 /**
  * @brief Directly maps a page into the paging tables.
@@ -137,7 +142,12 @@ unsigned long __get_mapping_info(void *addr, struct mm_address_space *as);
 struct vm_pf_context;
 struct page;
 unsigned int mmu_get_clear_referenced(struct mm_address_space *mm, void *addr, struct page *page);
-int try_to_unmap_one(struct page *page, struct vm_area_struct *vma, unsigned long addr);
+int try_to_unmap_one(struct page *page, struct vm_area_struct *vma, unsigned long addr,
+                     struct tlb_batch *tlb);
+int try_to_migrate_one(struct page *page, struct vm_area_struct *vma, unsigned long addr,
+                       struct tlb_batch *tlb);
+int remove_migration_pte(struct page *old, struct page *newpage, struct vm_area_struct *vma,
+                         unsigned long addr);
 int do_wp_page(struct vm_pf_context *context);
 
 __END_CDECLS
@@ -69,6 +69,12 @@ static inline bool pte_cmpxchg(pte_t *pte, pte_t *expected, pte_t desired)
                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED);
 }
 
+static inline bool pmd_cmpxchg(pmd_t *pmd, pmd_t *expected, pmd_t desired)
+{
+    return __atomic_compare_exchange_n(&pmd->pmd, &expected->pmd, desired.pmd, false,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
 /* Dummy fallbacks for architectures that don't support certain huge page levels */
 
 #ifndef ARCH_HUGE_P4D_SUPPORT
@@ -40,6 +40,8 @@ extern "C" {
 #endif
 
 void get_entropy(char *buf, size_t s);
+void get_random_bytes(void *buf, size_t len);
+unsigned long crng_get_generation(void);
 uint32_t arc4random(void);
 void arc4random_buf(void *buffer_ptr, size_t size);
 uint32_t arc4random_uniform(uint32_t upper_bound);
@@ -48,6 +48,16 @@ static inline bool in_kernel_space_regs(struct registers *regs)
     return regs->cs == KERNEL_CS;
 }
 
+static inline unsigned long instruction_pointer(struct registers *regs)
+{
+    return regs->rip;
+}
+
+static inline void instruction_pointer_set(struct registers *regs, unsigned long ip)
+{
+    regs->rip = ip;
+}
+
 #endif
 
 #define REGISTER_OFF_DS           0
@@ -136,6 +146,16 @@ static inline bool in_kernel_space_regs(struct registers *regs)
     return regs->status & RISCV_SSTATUS_SPP;
 }
 
+static inline unsigned long instruction_pointer(struct registers *regs)
+{
+    return regs->epc;
+}
+
+static inline void instruction_pointer_set(struct registers *regs, unsigned long ip)
+{
+    regs->epc = ip;
+}
+
 #elif defined(__aarch64__)
 
 typedef struct registers
@@ -151,6 +171,16 @@ static inline bool in_kernel_space_regs(struct registers *regs)
     return true;
 }
 
+static inline unsigned long instruction_pointer(struct registers *regs)
+{
+    return regs->pc;
+}
+
+static inline void instruction_pointer_set(struct registers *regs, unsigned long ip)
+{
+    regs->pc = ip;
+}
+
 #endif
 
 #endif
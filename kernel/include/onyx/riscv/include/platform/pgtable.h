@@ -396,6 +396,38 @@ static inline bool pte_protnone(pte_t pte)
     return (pte_val(pte) & (_PAGE_PRESENT | _PAGE_PROTNONE)) == _PAGE_PROTNONE;
 }
 
+/* Note: We don't do THP on riscv yet (ARCH_HAS_THP), as PROT_NONE leaf pmds would look like page
+ * table pointers. These only exist so the generic code builds. */
+static inline pmd_t pmd_mkhuge(u64 phys, pgprot_t prot)
+{
+    return pmd_mkpmd(phys, prot);
+}
+
+static inline pgprot_t pmd_huge_pgprot(pmd_t pmd)
+{
+    return __pgprot(pmd_val(pmd) & ((1UL << 10) - 1));
+}
+
+static inline pmd_t pmd_wrprotect(pmd_t pmd)
+{
+    return __pmd(pmd_val(pmd) & ~_PAGE_WRITE);
+}
+
+static inline pmd_t pmd_mkwrite(pmd_t pmd)
+{
+    return __pmd(pmd_val(pmd) | _PAGE_WRITE);
+}
+
+static inline pmd_t pmd_mkyoung(pmd_t pmd)
+{
+    return __pmd(pmd_val(pmd) & ~_PAGE_ACCESSED);
+}
+
+static inline bool pmd_protnone(pmd_t pmd)
+{
+    return (pmd_val(pmd) & (_PAGE_PRESENT | _PAGE_PROTNONE)) == _PAGE_PROTNONE;
+}
+
 #define ARCH_SWAP_NR_TYPES  16
 #define ARCH_SWP_TYPE_SHIFT 60
 #define ARCH_SWP_OFF_SHIFT  6
@@ -10,10 +10,13 @@
 #define _ONYX_RISCV_PLATFORM_VM_H
 
 #include <onyx/compiler.h>
+#include <onyx/mm/asid.h>
 #include <onyx/types.h>
 struct arch_mm_address_space
 {
     void *top_pt;
+    /* ASID bookkeeping, see onyx/mm/asid.h */
+    struct mm_tlb_ctx tlb;
 };
 
 #define vm_get_pgd(arch_mmu)          (arch_mmu)->top_pt
@@ -12,6 +12,7 @@
 #include <onyx/spinlock.h>
 
 struct vm_area_struct;
+struct tlb_batch;
 
 struct anon_vma
 {
@@ -29,7 +30,36 @@ struct anon_vma *anon_vma_prepare(struct vm_area_struct *vma);
 
 long rmap_get_page_references(struct page *page, unsigned int *vm_flags);
 
-int rmap_try_to_unmap(struct page *page);
+/**
+ * @brief Unmap a page from every address space that maps it
+ * The TLB invalidations are added to the batch, which must be flushed before the page is written
+ * back or freed.
+ *
+ * @param page Page to unmap
+ * @param tlb TLB batch
+ * @return 0 on success, negative error codes
+ */
+int rmap_try_to_unmap(struct page *page, struct tlb_batch *tlb);
+
+/**
+ * @brief Replace every pte that maps a page with a migration entry
+ * The TLB invalidations are added to the batch, which must be flushed before the page's contents
+ * are copied.
+ *
+ * @param page Locked page to unmap
+ * @param tlb TLB batch
+ * @return Number of migration entries installed
+ */
+unsigned int rmap_try_to_migrate(struct page *page, struct tlb_batch *tlb);
+
+/**
+ * @brief Replace the migration entries of a page with ptes that map its replacement
+ *
+ * @param old Page that was unmapped by rmap_try_to_migrate
+ * @param newpage Page to map instead (or old, if migration failed)
+ * @return Number of ptes restored
+ */
+unsigned int rmap_remove_migration_ptes(struct page *old, struct page *newpage);
 
 __END_CDECLS
 #endif
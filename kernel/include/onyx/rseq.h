@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#ifndef _ONYX_RSEQ_H
+#define _ONYX_RSEQ_H
+
+#include <stdbool.h>
+
+#include <onyx/compiler.h>
+#include <onyx/scheduler.h>
+
+struct registers;
+
+__BEGIN_CDECLS
+
+/**
+ * @brief Mark the thread's rseq area as needing an update on the next return to userspace
+ * Called when the thread is switched in (after preemption or migration) and on signal delivery.
+ *
+ * @param thread Thread to notify
+ */
+static inline void rseq_set_notify_resume(struct thread *thread)
+{
+    if (thread->rseq)
+        thread_set_flag(thread, THREAD_RSEQ_NOTIFY);
+}
+
+static inline bool rseq_notify_pending(struct thread *thread)
+{
+    return READ_ONCE(thread->flags) & THREAD_RSEQ_NOTIFY;
+}
+
+/**
+ * @brief Handle a pending rseq notification on the way out to userspace
+ * Aborts the current critical section (by moving the IP to the abort handler), if we're inside
+ * one, and updates cpu_id and cpu_id_start. Must be called before signal delivery, so the signal
+ * frame saves the fixed up IP. Does nothing if we're returning to kernel space.
+ *
+ * @param regs Registers we're returning to userspace with
+ */
+void rseq_handle_notify_resume(struct registers *regs);
+
+/**
+ * @brief Inherit (or not) the parent's rseq registration on fork/clone
+ * Threads that share the address space must register their own area.
+ *
+ * @param child New thread
+ * @param parent Parent thread
+ * @param clone_flags Clone flags
+ */
+void rseq_fork(struct thread *child, struct thread *parent, unsigned long clone_flags);
+
+/**
+ * @brief Drop the rseq registration on execve
+ *
+ * @param thread Current thread
+ */
+void rseq_execve(struct thread *thread);
+
+__END_CDECLS
+
+#endif
@@ -18,6 +18,7 @@
 #include <onyx/cputime.h>
 #include <onyx/kcsan.h>
 #include <onyx/list.h>
+#include <onyx/mm/mempolicy.h>
 #include <onyx/percpu.h>
 #include <onyx/preempt.h>
 #include <onyx/rcupdate.h>
@@ -42,6 +43,7 @@ struct mm_address_space;
 struct kcov_data;
 struct blk_plug;
 struct registers;
+struct rseq;
 
 #define THREAD_STRUCT_CANARY 0xcacacacafdfddead
 #define THREAD_DEAD_CANARY   0xdeadbeefbeefdead
@@ -84,6 +86,14 @@ typedef struct thread
     struct registers *regs;
     unsigned int pagefault_disabled;
 
+    /* Registered restartable sequence area (see rseq.h), if any */
+    struct rseq *rseq;
+    uint32_t rseq_len;
+    uint32_t rseq_sig;
+
+    /* NUMA memory policy (see set_mempolicy) */
+    struct mempolicy mempolicy;
+
 #ifdef CONFIG_KCOV
     struct kcov_data *kcov_data;
 #endif
@@ -95,6 +105,8 @@ typedef struct thread
 #ifdef __x86_64__
     void *fs;
     void *gs;
+    /* CPU whose registers last held our FPU state (see onyx/x86/fpu.h) */
+    unsigned int fpu_cpu;
 #elif defined(__riscv)
     void *tp;
 #endif
@@ -103,10 +115,11 @@ typedef struct thread
     thread()
         : refcount{}, canary{}, kernel_stack{}, kernel_stack_top{}, owner{}, entry{}, flags{}, id{},
           status{}, priority{}, cpu{}, next{}, prev_prio{}, next_prio{}, fpu_area{}, sem_prev{},
-          sem_next{}, lock{}, errno_val{}, addr_limit{}, ctid{}, cputime_info{}, aspace{}, plug{}
+          sem_next{}, lock{}, errno_val{}, addr_limit{}, ctid{}, cputime_info{}, aspace{}, plug{},
+          rseq{}, rseq_len{}, rseq_sig{}, mempolicy{}
 #ifdef __x86_64__
           ,
-          fs{}, gs{}
+          fs{}, gs{}, fpu_cpu{-1U}
 #endif
     {
 #ifdef CONFIG_KCSAN
@@ -146,6 +159,8 @@ typedef struct thread
 #define THREAD_SHOULD_DIE    (1 << 3)
 #define THREAD_ACTIVE        (1 << 4)
 #define THREAD_RUNNING       (1 << 5)
+#define THREAD_RSEQ_NOTIFY   (1 << 6)
+#define THREAD_NEED_FPU_LOAD (1 << 7)
 
 int sched_init(void);
 
@@ -11,9 +11,39 @@
 #include <stdbool.h>
 
 #include <onyx/compiler.h>
+#include <onyx/page.h>
 #include <onyx/pgtable.h>
 
+#include <uapi/posix-types.h>
+
+/* The last two swap types don't refer to swap areas. They're migration entries, which replace the
+ * ptes of a page that is being migrated, and hold its pfn as the offset. */
+#define SWP_MIGRATION_READ  (ARCH_SWAP_NR_TYPES - 2)
+#define SWP_MIGRATION_WRITE (ARCH_SWAP_NR_TYPES - 1)
+#define MAX_SWAP_AREAS      SWP_MIGRATION_READ
+
 __BEGIN_CDECLS
+
+static inline bool swp_is_migration(swp_entry_t entry)
+{
+    return SWP_TYPE(entry) >= SWP_MIGRATION_READ;
+}
+
+static inline bool swp_migration_write(swp_entry_t entry)
+{
+    return SWP_TYPE(entry) == SWP_MIGRATION_WRITE;
+}
+
+static inline swp_entry_t make_migration_entry(struct page *page, bool write)
+{
+    return SWP_ENTRY((unsigned long) (write ? SWP_MIGRATION_WRITE : SWP_MIGRATION_READ),
+                     page_to_pfn(page));
+}
+
+static inline struct page *migration_entry_to_page(swp_entry_t entry)
+{
+    return phys_to_page(pfn_to_paddr(SWP_OFFSET(entry)));
+}
 /**
  * @brief Check if indeed we have some swap space available
  * This function is not precise and may return false negatives/positives.
@@ -38,11 +68,42 @@ extern struct vm_object *swap_spaces[];
 struct vm_pf_context;
 int do_swap_page(struct vm_pf_context *context);
 
+struct swap_pte
+{
+    unsigned long addr;
+    pte_t pte;
+};
+
+struct mm_address_space;
+
+/**
+ * @brief Gather the swap ptes (of a given swap area) in a range
+ *
+ * @param mm Address space
+ * @param start Start of the range
+ * @param end End of the range
+ * @param type Swap area index
+ * @param ptes Array of swap ptes to fill
+ * @param nr Pointer to the number of ptes found (filled in)
+ * @param max Size of the ptes array
+ * @return Address to resume the walk at, or @a end if the whole range was walked
+ */
+unsigned long vm_gather_swap_ptes(struct mm_address_space *mm, unsigned long start,
+                                  unsigned long end, unsigned int type, struct swap_pte *ptes,
+                                  unsigned int *nr, unsigned int max);
+
 void __swap_inc_map(swp_entry_t swp);
 void swap_inc_map(struct page *page);
 void swap_unset_swapcache(swp_entry_t swp);
 bool swap_put(swp_entry_t entry);
 
+/* /sys/vm/page_cluster, /sys/vm/swap_vma_readahead and /sys/vm/swap_ra_stat */
+ssize_t page_cluster_sysfs_read(void *buffer, size_t size, off_t off);
+ssize_t page_cluster_sysfs_write(void *buffer, size_t size, off_t off);
+ssize_t swap_vma_readahead_sysfs_read(void *buffer, size_t size, off_t off);
+ssize_t swap_vma_readahead_sysfs_write(void *buffer, size_t size, off_t off);
+ssize_t swap_ra_stat_sysfs_read(void *buffer, size_t size, off_t off);
+
 __END_CDECLS
 
 #endif
@@ -47,6 +47,51 @@ void sysfs_add(struct sysfs_object *obj, struct sysfs_object *parent);
 int sysfs_init_and_add(const char *name, struct sysfs_object *obj, struct sysfs_object *parent);
 void sysfs_mount(void);
 
+/**
+ * @brief Copy (part of) a sysfs file's contents to userspace, for read callbacks
+ *
+ * @param buf Contents of the file
+ * @param len Length of the contents
+ * @param ubuf User buffer
+ * @param size Size of the user buffer
+ * @param off Offset into the file
+ * @return Number of bytes copied, or negative error code
+ */
+ssize_t sysfs_read_buf(const char *buf, size_t len, void *ubuf, size_t size, off_t off);
+
+/**
+ * @brief Read callback helper for a sysfs file holding a single number
+ *
+ * @param val Value of the file, printed as "%lu\n"
+ * @param ubuf User buffer
+ * @param size Size of the user buffer
+ * @param off Offset into the file
+ * @return Number of bytes copied, or negative error code
+ */
+ssize_t sysfs_read_ulong(unsigned long val, void *ubuf, size_t size, off_t off);
+
+/**
+ * @brief Copy a write to a sysfs file into a NUL-terminated string, without the trailing newline
+ * Writes that don't fit are truncated.
+ *
+ * @param buf Destination buffer
+ * @param buflen Size of the destination buffer
+ * @param ubuf User buffer
+ * @param size Size of the user buffer
+ * @return Length of the string, or negative error code
+ */
+ssize_t sysfs_copy_str(char *buf, size_t buflen, const void *ubuf, size_t size);
+
+/**
+ * @brief Parse a write to a sysfs file as a single number (in any base strtoul accepts)
+ *
+ * @param ubuf User buffer
+ * @param size Size of the user buffer
+ * @param val Pointer to where the value is stored
+ * @return 0 on success, -EFAULT or -EINVAL
+ */
+int sysfs_parse_ulong(const void *ubuf, size_t size, unsigned long *val);
+
 __END_CDECLS
 
 #endif
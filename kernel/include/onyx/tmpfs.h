@@ -37,11 +37,13 @@ public:
     dev_t fs_minor;
 
     const file_ops *tmpfs_ops_;
+    const vm_object_ops *tmpfs_vmops_;
     atomic<size_t> nblocks;
     atomic<size_t> ino_nr;
 
     tmpfs_superblock()
-        : superblock{}, curr_inode{}, fs_minor{++curr_minor_number}, tmpfs_ops_{&tmpfs_fops}
+        : superblock{}, curr_inode{}, fs_minor{++curr_minor_number}, tmpfs_ops_{&tmpfs_fops},
+          tmpfs_vmops_{nullptr}
     {
         superblock_init(this);
         s_block_size = PAGE_SIZE;
@@ -71,6 +73,16 @@ public:
     {
         tmpfs_ops_ = ops;
     }
+
+    /**
+     * @brief Set the vm_object_ops for the page cache of all the inodes of this filesystem
+     *
+     * @param ops Pointer to vm_object_ops
+     */
+    void override_vmobj_ops(const vm_object_ops *ops)
+    {
+        tmpfs_vmops_ = ops;
+    }
 };
 
 /**
@@ -11,6 +11,7 @@
 #include <time.h>
 
 #include <onyx/clock.h>
+#include <onyx/crypt/chacha20.h>
 
 #include <fixed_point/fixed_point.h>
 
@@ -19,17 +20,56 @@ struct vdso_time
     struct fp_32_64 ticks_per_ns;
 #ifdef __x86_64__
     bool using_tsc;
+    /* One of VDSO_GETCPU_* */
+    unsigned int getcpu_mode;
 #endif
 };
 
+#define VDSO_GETCPU_SYSCALL 0
+#define VDSO_GETCPU_RDTSCP  1
+#define VDSO_GETCPU_RDPID   2
+
+/* Layout of TSC_AUX (as read by RDTSCP/RDPID): the cpu number in the low bits, node above */
+#define VDSO_GETCPU_CPU_MASK   0xfff
+#define VDSO_GETCPU_NODE_SHIFT 12
+
 struct vdso_clock_time
 {
     struct timespec time;
     hrtime_t tick;
 };
 
+/* CLOCK_{REALTIME, MONOTONIC}_COARSE, updated every tick under seq. Readers never touch the TSC. */
+struct vdso_coarse_time
+{
+    unsigned int seq;
+    struct timespec realtime;
+    struct timespec monotonic;
+};
+
+struct vdso_rng_data
+{
+    /* Mirrors the CRNG's base generation. vgetrandom states rekey when this changes. */
+    unsigned long generation;
+    bool is_ready;
+};
+
+/* Opaque (to userspace) per-thread vgetrandom state, allocated by userspace as instructed by
+ * __vdso_getrandom's vgetrandom_opaque_params. Must be zero-filled, private anonymous memory. */
+struct vgetrandom_state
+{
+    /* Leftover keystream, batch[pos..] hasn't been handed out yet */
+    unsigned char batch[CHACHA20_BLOCK_SIZE * 4 - CHACHA20_KEY_SIZE];
+    unsigned char key[CHACHA20_KEY_SIZE];
+    unsigned long generation;
+    unsigned int pos;
+    bool in_use;
+};
+
 void vdso_init(void);
 void *vdso_map(void);
 int vdso_update_time(clockid_t id, struct clock_time *time);
+void vdso_update_coarse_time(const struct timespec *realtime, const struct timespec *monotonic);
+void vdso_update_rng_generation(unsigned long generation);
 
 #endif
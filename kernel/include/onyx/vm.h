@@ -16,9 +16,12 @@
 
 #include <onyx/interval_tree.h>
 #include <onyx/list.h>
+#include <onyx/mm/mempolicy.h>
 #include <onyx/mm_address_space.h>
 #include <onyx/mutex.h>
 #include <onyx/paging.h>
+#include <onyx/rcupdate.h>
+#include <onyx/rwlock.h>
 #include <onyx/scheduler.h>
 #include <onyx/spinlock.h>
 #include <onyx/types.h>
@@ -60,6 +63,10 @@ __BEGIN_CDECLS
 #define VM_SHARED        (1 << 10)
 #define VM_PFNMAP        (1 << 11)
 #define VM_DONTDUMP      (1 << 12)
+#define VM_WIPEONFORK    (1 << 13)
+#define VM_HUGEPAGE      (1 << 14)
+#define VM_NOHUGEPAGE    (1 << 15)
+#define VM_HUGETLB       (1 << 16)
 
 /* Internal flags used by the mm code */
 #define __VM_CACHE_TYPE_REGULAR     0
@@ -97,7 +104,9 @@ struct vm_operations
     int (*fault)(struct vm_pf_context *ctx);
 };
 
-#define VM_FAULT_MAJOR (1 << 0)
+#define VM_FAULT_MAJOR    (1 << 0)
+/* Internal: The huge page fault path couldn't handle this, go down to the PTE level */
+#define VM_FAULT_FALLBACK (1 << 1)
 
 extern const struct vm_operations anon_vmops;
 extern const struct vm_operations file_vmops;
@@ -117,10 +126,17 @@ struct vm_area_struct
     unsigned long vm_end;
 
     union {
-        /* TODO: Can we union this with something else? */
         struct list_head vm_detached_node;
+        /* VMAs are freed after a grace period, so page faults can look them up under RCU */
+        struct rcu_head vm_rcu;
     };
 
+    /* Per-VMA lock. Page faults take it for reading (without the mm's vm_lock), while anyone
+     * changing the VMA (or taking it out of the tree) takes it for writing. */
+    struct rwlock vm_lock;
+    unsigned long vm_lock_seq;
+    bool vm_detached;
+
     int vm_flags;
     struct mm_address_space *vm_mm;
     const struct vm_operations *vm_ops;
@@ -130,6 +146,8 @@ struct vm_area_struct
     struct interval_tree_node vm_objhead;
     struct anon_vma *anon_vma;
     struct list_head anon_vma_node;
+    /* NUMA memory policy (see mbind) */
+    struct mempolicy vm_policy;
 };
 
 static inline unsigned long vma_pages(const struct vm_area_struct *vma)
@@ -147,6 +165,82 @@ static inline bool vma_private(const struct vm_area_struct *vma)
     return !vma_shared(vma);
 }
 
+static inline bool vma_is_hugetlb(const struct vm_area_struct *vma)
+{
+    return vma->vm_flags & VM_HUGETLB;
+}
+
+/* No mm_lock_seq ever gets here, so a VMA with this seq is not write-locked */
+#define VMA_LOCK_SEQ_UNLOCKED (-1UL)
+
+static inline void vma_init_lock(struct vm_area_struct *vma)
+{
+    rwlock_init(&vma->vm_lock);
+    vma->vm_lock_seq = VMA_LOCK_SEQ_UNLOCKED;
+    vma->vm_detached = false;
+}
+
+/**
+ * @brief Write-lock a VMA
+ * The VMA stays locked until the mm's vm_lock is released (see mmap_write_unlock). Must be called
+ * with the mm's vm_lock held for writing, before modifying the VMA or removing it from the tree.
+ *
+ * @param vma VMA
+ */
+static inline void vma_start_write(struct vm_area_struct *vma)
+{
+    struct mm_address_space *mm = vma->vm_mm;
+
+    if (vma->vm_lock_seq == mm->mm_lock_seq)
+        return;
+
+    /* Wait for page faults to get out of the VMA */
+    rw_lock_write(&vma->vm_lock);
+    WRITE_ONCE(vma->vm_lock_seq, mm->mm_lock_seq);
+    rw_unlock_write(&vma->vm_lock);
+}
+
+/**
+ * @brief Try to read-lock a VMA
+ *
+ * @param mm Address space
+ * @param vma VMA
+ * @return True if locked, false if the VMA is being modified (or contended)
+ */
+static inline bool vma_start_read(struct mm_address_space *mm, struct vm_area_struct *vma)
+{
+    if (READ_ONCE(vma->vm_lock_seq) == __atomic_load_n(&mm->mm_lock_seq, __ATOMIC_ACQUIRE))
+        return false;
+
+    if (rw_lock_tryread(&vma->vm_lock) < 0)
+        return false;
+
+    /* Recheck now that we hold the lock. If vma_start_write got here first, we see its seq. */
+    if (READ_ONCE(vma->vm_lock_seq) == __atomic_load_n(&mm->mm_lock_seq, __ATOMIC_ACQUIRE))
+    {
+        rw_unlock_read(&vma->vm_lock);
+        return false;
+    }
+
+    return true;
+}
+
+static inline void vma_end_read(struct vm_area_struct *vma)
+{
+    rw_unlock_read(&vma->vm_lock);
+}
+
+/**
+ * @brief Mark a (write-locked) VMA as no longer being in the tree
+ *
+ * @param vma VMA
+ * @param detached True if detached
+ */
+static inline void vma_mark_detached(struct vm_area_struct *vma, bool detached)
+{
+    WRITE_ONCE(vma->vm_detached, detached);
+}
+
 #define VM_OK      0x0
 #define VM_SIGBUS  SIGBUS
 #define VM_SIGSEGV SIGSEGV
@@ -241,12 +335,26 @@ void *vm_get_fallback_pgd();
  *
  * @param pages The number of pages.
  * @param type The type of allocation.
- * @param perms The permissions on the allocation.
+ * @param perms The permissions on the allocation. VM_HUGEPAGE asks for huge pages, VM_NOHUGEPAGE
+ * disables them (large allocations get them by default).
  * @param gfp_flags GFP flags
  * @return A pointer to the new allocation, or NULL with errno set on failure.
  */
 void *vmalloc(size_t pages, int type, int perms, unsigned int gfp_flags);
 
+/**
+ * @brief Allocates a range of virtual memory for kernel purposes, on behalf of a caller
+ * Same as vmalloc, but the allocation is profiled as coming from ip.
+ *
+ * @param pages The number of pages.
+ * @param type The type of allocation.
+ * @param perms The permissions on the allocation.
+ * @param gfp_flags GFP flags
+ * @param ip Call site, for allocation profiling
+ * @return A pointer to the new allocation, or NULL with errno set on failure.
+ */
+void *__vmalloc(size_t pages, int type, int perms, unsigned int gfp_flags, unsigned long ip);
+
 /**
  * @brief Frees a region of memory previously allocated by vmalloc.
  *
@@ -776,6 +884,9 @@ static inline bool vma_is_pfnmap(struct vm_area_struct *vma)
 
 void vm_do_mmu_mprotect(struct mm_address_space *as, void *address, size_t nr_pgs, int old_prots,
                         int new_prots);
+struct tlb_batch;
+void vm_do_mmu_mprotect_batch(struct tlb_batch *tlb, void *address, size_t nr_pgs, int old_prots,
+                              int new_prots);
 
 __END_CDECLS
 
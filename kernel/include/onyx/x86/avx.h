@@ -11,6 +11,11 @@
 #define AVX_XCR0_FPU (1 << 0)
 #define AVX_XCR0_SSE (1 << 1)
 #define AVX_XCR0_AVX (1 << 2)
+/* AVX-512 state: opmask registers, upper halves of zmm0-15, and zmm16-31 */
+#define AVX_XCR0_OPMASK    (1 << 5)
+#define AVX_XCR0_ZMM_HI256 (1 << 6)
+#define AVX_XCR0_HI16_ZMM  (1 << 7)
+#define AVX_XCR0_AVX512    (AVX_XCR0_OPMASK | AVX_XCR0_ZMM_HI256 | AVX_XCR0_HI16_ZMM)
 
 #define AVX_SAVE_ALIGNMENT 64
 
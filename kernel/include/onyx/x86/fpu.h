@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#ifndef _ONYX_X86_FPU_H
+#define _ONYX_X86_FPU_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <onyx/compiler.h>
+#include <onyx/scheduler.h>
+
+__BEGIN_CDECLS
+
+/**
+ * @brief Set up the XSAVE area layout for the enabled state components
+ * Called by avx_init, after XCR0 is set up.
+ *
+ * @param xcr0 Enabled state components
+ */
+void fpu_init_xstate(uint64_t xcr0);
+
+/*
+ * User FPU state is switched lazily. Switching out a thread saves its registers (if they're live)
+ * and sets THREAD_NEED_FPU_LOAD. The registers are only reloaded on the way back to userspace, and
+ * only if some other thread used this CPU's FPU in the meanwhile. So switching to kernel threads
+ * and back, or going idle, doesn't touch the FPU at all.
+ */
+
+static inline bool fpu_needs_load(struct thread *thread)
+{
+    return READ_ONCE(thread->flags) & THREAD_NEED_FPU_LOAD;
+}
+
+/**
+ * @brief Save the thread's FPU registers (if live) when switching it out
+ *
+ * @param thread Thread being switched out
+ */
+void fpu_switch_out(struct thread *thread);
+
+/**
+ * @brief Load the current thread's FPU state into the registers, if needed
+ * Must be called with irqs disabled, right before returning to userspace.
+ */
+void fpu_load_current(void);
+
+/**
+ * @brief Mark the current thread's FPU registers as stale
+ * Used before writing to fpu_area, so a context switch doesn't overwrite our changes and the new
+ * state is loaded on the way back to userspace.
+ */
+void fpu_invalidate_current(void);
+
+/**
+ * @brief Copy an FPU state to a user buffer, in the standard (non-compacted) XSAVE format
+ *
+ * @param ubuf User buffer, fpu_get_save_size() bytes
+ * @param kbuf FPU state
+ * @return 0 on success, negative error codes
+ */
+int fpu_copy_to_user(void *ubuf, const void *kbuf);
+
+/**
+ * @brief Copy (and validate) an FPU state from a user buffer, in the standard XSAVE format
+ * Validation makes sure restoring the state can't fault.
+ *
+ * @param kbuf FPU state
+ * @param ubuf User buffer, fpu_get_save_size() bytes
+ * @return 0 on success, -EFAULT or -EINVAL
+ */
+int fpu_copy_from_user(void *kbuf, const void *ubuf);
+
+__END_CDECLS
+
+#endif
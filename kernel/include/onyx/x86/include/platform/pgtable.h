@@ -436,6 +436,41 @@ static inline bool pte_protnone(pte_t pte)
     return (pte_val(pte) & (_PAGE_PRESENT | _PAGE_PROTNONE)) == _PAGE_PROTNONE;
 }
 
+/* Anonymous memory can be mapped with transparent huge pages, at the PMD level */
+#define ARCH_HAS_THP 1
+
+static inline pmd_t pmd_mkhuge(u64 phys, pgprot_t prot)
+{
+    /* The PAT bit moves to bit 12 in large pages. THPs are always WB, so just don't bother. */
+    return __pmd(phys | (pgprot_val(prot) & ~_PAGE_PAT) | _PAGE_HUGE);
+}
+
+static inline pgprot_t pmd_huge_pgprot(pmd_t pmd)
+{
+    /* Get the pgprot for the PTEs of a (to be) split huge pmd. A and D are kept. */
+    return __pgprot(pmd_val(pmd) & ~(X86_ADDR_MASK | _PAGE_HUGE));
+}
+
+static inline pmd_t pmd_wrprotect(pmd_t pmd)
+{
+    return __pmd(pmd_val(pmd) & ~_PAGE_WRITE);
+}
+
+static inline pmd_t pmd_mkwrite(pmd_t pmd)
+{
+    return __pmd(pmd_val(pmd) | _PAGE_WRITE);
+}
+
+static inline pmd_t pmd_mkyoung(pmd_t pmd)
+{
+    return __pmd(pmd_val(pmd) & ~_PAGE_ACCESSED);
+}
+
+static inline bool pmd_protnone(pmd_t pmd)
+{
+    return (pmd_val(pmd) & (_PAGE_PRESENT | _PAGE_PROTNONE)) == _PAGE_PROTNONE;
+}
+
 #define ARCH_SWAP_NR_TYPES  16
 #define ARCH_SWP_TYPE_SHIFT 60
 #define ARCH_SWP_OFF_SHIFT  9
@@ -10,13 +10,16 @@
 #define _ONYX_X86_VM_H
 
 #include <onyx/compiler.h>
+#include <onyx/mm/asid.h>
 #include <onyx/types.h>
 
 struct arch_mm_address_space
 {
     void *cr3;
+    /* PCID bookkeeping, see onyx/mm/asid.h */
+    struct mm_tlb_ctx tlb;
 #ifdef __cplusplus
-    constexpr arch_mm_address_space() : cr3{nullptr}
+    constexpr arch_mm_address_space() : cr3{nullptr}, tlb{}
     {
     }
 #endif
@@ -29,6 +32,13 @@ void __native_tlb_invalidate_all();
 
 void x86_remap_top_pgd_to_top_pgd(unsigned long source, unsigned long dest);
 
+/**
+ * @brief Check if we're using PCIDs (they're supported, and not disabled with nopcid)
+ *
+ * @return True if so
+ */
+bool x86_pcid_usable();
+
 __BEGIN_CDECLS
 
 /**
@@ -14,6 +14,7 @@
 #define FS_BASE_MSR       0xC0000100
 #define GS_BASE_MSR       0xC0000101
 #define KERNEL_GS_BASE    0xC0000102
+#define IA32_TSC_AUX      0xC0000103
 #define IA32_MSR_STAR     0xC0000081
 #define IA32_MSR_LSTAR    0xC0000082
 #define IA32_MSR_CSTAR    0xC0000083
@@ -23,6 +24,7 @@
 #define IA32_TSC_DEADLINE 0x000006e0
 #define IA32_MISC_ENABLE  0x000001a0
 #define IA32_X2APIC_BASE  0x00000800
+#define IA32_XSS          0x00000da0
 
 #define IA32_MISC_ENABLE_FAST_STRINGS_ENABLE      (1 << 0)
 #define IA32_MISC_ENABLE_AUTO_TCC_ENABLE          (1 << 3)
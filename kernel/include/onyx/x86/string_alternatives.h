@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#ifndef _ONYX_X86_STRING_ALTERNATIVES_H
+#define _ONYX_X86_STRING_ALTERNATIVES_H
+
+/*
+ * Patch sites for memcpy/memset (and copy_{to,from}_user, which share memcpy's body). Unlike
+ * __ASM_ALTERNATIVE_INSTRUCTION, the default instructions here are valid, since we run memcpy long
+ * before alternatives are applied. The patching functions live in arch/x86_64/string.cpp.
+ * Outside the kernel (i.e the host tests), we just keep the defaults.
+ */
+
+#ifdef __is_onyx_kernel
+// clang-format off
+#define __STRING_PATCH_SITE(patch_func, size, priv1, priv2) \
+    .pushsection .code_patch;                               \
+    .quad 4096b;                                            \
+    .quad size;                                             \
+    .quad patch_func;                                       \
+    .quad priv1;                                            \
+    .quad priv2;                                            \
+    .popsection;
+// clang-format on
+#else
+#define __STRING_PATCH_SITE(patch_func, size, priv1, priv2)
+#endif
+
+#define STRING_THRESHOLD_REP 0
+#define STRING_THRESHOLD_NT  1
+
+/* cmp $imm32, %rdx. The immediate gets patched with the threshold the CPU wants. */
+#define STRING_CMP_THRESHOLD(threshold, default)      \
+    4096 :.byte 0x48, 0x81, 0xfa;                     \
+    .long default;                                    \
+    __STRING_PATCH_SITE(x86_string_threshold_patch, 7, threshold, 0)
+
+/* Large copies/sets: jmp to rep_target if the CPU has ERMS, else to loop_target */
+#define STRING_JMP_LARGE(rep_target, loop_target) \
+    4096 :.byte 0xe9;                             \
+    .long rep_target - (. + 4);                   \
+    __STRING_PATCH_SITE(x86_string_large_patch, 5, rep_target, loop_target)
+
+/* Disables non-temporal copies until patched */
+#define STRING_NT_DISABLED 0x7fffffff
+
+#endif
@@ -0,0 +1,16 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _UAPI_MEMBARRIER_H
+#define _UAPI_MEMBARRIER_H
+
+/* Command values are the same as Linux's, so libraries that probe for membarrier work as-is */
+#define MEMBARRIER_CMD_QUERY                      0
+#define MEMBARRIER_CMD_PRIVATE_EXPEDITED          (1 << 3)
+#define MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED (1 << 4)
+
+#endif
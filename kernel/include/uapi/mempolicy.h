@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _UAPI_MEMPOLICY_H
+#define _UAPI_MEMPOLICY_H
+
+/* Values are the same as Linux's, so libnuma and numactl work as-is */
+
+/* Memory policy modes, for set_mempolicy(2) and mbind(2) */
+#define MPOL_DEFAULT    0
+#define MPOL_PREFERRED  1
+#define MPOL_BIND       2
+#define MPOL_INTERLEAVE 3
+#define MPOL_LOCAL      4
+
+/* get_mempolicy(2) flags */
+#define MPOL_F_NODE         (1 << 0)
+#define MPOL_F_ADDR         (1 << 1)
+#define MPOL_F_MEMS_ALLOWED (1 << 2)
+
+/* mbind(2) flags */
+#define MPOL_MF_STRICT   (1 << 0)
+#define MPOL_MF_MOVE     (1 << 1)
+#define MPOL_MF_MOVE_ALL (1 << 2)
+
+#endif
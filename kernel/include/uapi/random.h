@@ -15,4 +15,16 @@
 #define GRND_RANDOM   2
 #define GRND_INSECURE 4
 
+#include <onyx/types.h>
+
+/* Returned by __vdso_getrandom(NULL, 0, 0, &params, ~0UL). Userspace allocates per-thread states
+ * of size_of_opaque_state bytes using mmap with mmap_prot and mmap_flags. */
+struct vgetrandom_opaque_params
+{
+    __u32 size_of_opaque_state;
+    __u32 mmap_prot;
+    __u32 mmap_flags;
+    __u32 reserved[13];
+};
+
 #endif
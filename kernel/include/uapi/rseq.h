@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _UAPI_RSEQ_H
+#define _UAPI_RSEQ_H
+
+#include <onyx/types.h>
+
+/* Layouts and values match Linux's, so existing rseq users (glibc, tcmalloc, librseq) work. */
+
+#define RSEQ_CPU_ID_UNINITIALIZED       -1
+#define RSEQ_CPU_ID_REGISTRATION_FAILED -2
+
+#define RSEQ_FLAG_UNREGISTER (1 << 0)
+
+/* Size of the original struct rseq. Registrations must be at least this big. */
+#define RSEQ_ORIG_SIZE 32
+
+struct rseq_cs
+{
+    __u32 version;
+    __u32 flags;
+    __u64 start_ip;
+    /* Offset from start_ip */
+    __u64 post_commit_offset;
+    __u64 abort_ip;
+} __attribute__((aligned(4 * sizeof(__u64))));
+
+struct rseq
+{
+    /* Updated by the kernel on every return to userspace after a migration or preemption.
+     * cpu_id_start is always a valid CPU number, cpu_id may be RSEQ_CPU_ID_*. */
+    __u32 cpu_id_start;
+    __u32 cpu_id;
+    /* Pointer to the struct rseq_cs of the critical section currently being executed, or 0 */
+    __u64 rseq_cs;
+    __u32 flags;
+} __attribute__((aligned(4 * sizeof(__u64))));
+
+#endif
@@ -34,4 +34,11 @@ struct swap_super
 
 #define MIN_SWAP_SIZE_PAGES (SWP_RESERVED_BADBLOCKS_PAGES + 1)
 
+/* swapon(2) flags. Areas with higher priorities are used first, and areas with the same priority
+ * are used round-robin. Without SWAP_FLAG_PREFER, the kernel picks a (negative) priority lower than
+ * every other area's. */
+#define SWAP_FLAG_PREFER     0x8000
+#define SWAP_FLAG_PRIO_MASK  0x7fff
+#define SWAP_FLAG_PRIO_SHIFT 0
+
 #endif
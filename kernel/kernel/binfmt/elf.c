@@ -507,7 +507,7 @@ static void core_fill_fpregs(struct elf_core_thread *thr, struct process *task)
 
     /* Save the FPU if we haven't yet. suspended threads will already have done that. */
     if (task == current)
-        save_fpu(task->thr->fpu_area);
+        fpu_flush_current();
 
     /* Copy the fpu area and zero the rest if required */
     memcpy(&thr->fpregs, task->thr->fpu_area, copy);
@@ -18,6 +18,7 @@
 #include <onyx/mm/slab.h>
 #include <onyx/process.h>
 #include <onyx/random.h>
+#include <onyx/rseq.h>
 #include <onyx/signal.h>
 #include <onyx/user.h>
 #include <onyx/vdso.h>
@@ -315,6 +316,8 @@ int flush_old_exec(struct exec_state *state)
     /* And reset the signal disposition */
     signal_do_execve(curr);
 
+    rseq_execve(get_current_thread());
+
     return st;
 }
 
@@ -6,6 +6,7 @@
  * SPDX-License-Identifier: GPL-2.0-only
  */
 #include <errno.h>
+#include <string.h>
 
 #include <onyx/compression.h>
 #include <onyx/vector.h>
@@ -27,6 +28,28 @@ void register_module(module *mod)
     assert(modules.push_back(mod) == true);
 }
 
+/**
+ * @brief Find a compression module by name
+ *
+ * @param name Name of the module
+ * @return The module, or nullptr if not found
+ */
+module *find_module(const char *name)
+{
+    for (auto mod : modules)
+    {
+        if (!strcmp(mod->name(), name))
+            return mod;
+    }
+
+    return nullptr;
+}
+
+expected<unique_ptr<context>, int> module::create_context(size_t max_src_size)
+{
+    return unexpected<int>{-ENOTSUP};
+}
+
 /**
  * @brief Decompress a buffer onto dst
  *
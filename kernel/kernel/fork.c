@@ -272,6 +272,7 @@ static pid_t kernel_clone(struct clone_args *args)
         process_fork_thread(to_be_forked, child, flags, args->stack, args->tls);
     if (!new_thread)
         goto err_put_mm;
+    new_thread->mempolicy = to_be_forked->mempolicy;
 
     child->ctid = child->set_tid = NULL;
     if (flags & CLONE_CHILD_CLEARTID)
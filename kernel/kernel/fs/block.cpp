@@ -959,3 +959,8 @@ unsigned int bdev_sector_size(struct blockdev *bdev)
 {
     return bdev->sector_size;
 }
+
+unsigned long bdev_max_sgls(struct blockdev *bdev)
+{
+    return bdev->bdev_queue_properties.max_sgls_per_request;
+}
@@ -108,12 +108,12 @@ ssize_t buffer_writepage(struct vm_object *obj, struct page *page, size_t offset
 
 block_buf *block_buf_from_page(struct page *p)
 {
-    return reinterpret_cast<block_buf *>(p->priv);
+    return reinterpret_cast<block_buf *>(compound_head(p)->priv);
 }
 
 bool page_has_dirty_bufs(struct page *p)
 {
-    auto buf = reinterpret_cast<block_buf *>(p->priv);
+    auto buf = block_buf_from_page(p);
     bool has_dirty_buf = false;
 
     while (buf)
@@ -132,7 +132,7 @@ bool page_has_dirty_bufs(struct page *p)
 
 bool page_has_writeback_bufs(struct page *p)
 {
-    auto buf = reinterpret_cast<block_buf *>(p->priv);
+    auto buf = block_buf_from_page(p);
     bool has_wb_buf = false;
 
     while (buf)
@@ -149,10 +149,12 @@ bool page_has_writeback_bufs(struct page *p)
     return has_wb_buf;
 }
 
+/* For large folios, @a page is the head and @a page_off the offset within the whole folio */
 struct block_buf *page_add_blockbuf(struct page *page, unsigned int page_off)
 {
-    assert(page->flags & PAGE_FLAG_BUFFER);
+    assert(page_flag_set(page, PAGE_FLAG_BUFFER));
     CHECK_PAGE(page_locked(page), page);
+    DCHECK_PAGE(compound_head(page) == page, page);
 
     auto buf = (struct block_buf *) kmem_cache_alloc(buffer_cache, GFP_KERNEL);
     if (!buf)
@@ -160,8 +162,8 @@ struct block_buf *page_add_blockbuf(struct page *page, unsigned int page_off)
         return nullptr;
     }
 
-    buf->page_off = page_off;
-    buf->this_page = page;
+    buf->page_off = page_off & (PAGE_SIZE - 1);
+    buf->this_page = page + (page_off >> PAGE_SHIFT);
     buf->next = nullptr;
     buf->refc = 1;
     buf->flags = 0;
@@ -182,7 +184,7 @@ struct block_buf *page_add_blockbuf(struct page *page, unsigned int page_off)
 
 void block_buf_remove(struct block_buf *buf)
 {
-    struct page *page = buf->this_page;
+    struct page *page = compound_head(buf->this_page);
 
     block_buf **pp = reinterpret_cast<block_buf **>(&page->priv);
 
@@ -202,7 +204,7 @@ void block_buf_remove(struct block_buf *buf)
 void block_buf_sync(struct block_buf *buf)
 {
     /* TODO: Only write *this* buffer, instead of the whole page */
-    struct page *page = buf->this_page;
+    struct page *page = compound_head(buf->this_page);
     lock_page(page);
     buffer_writepage(page->owner, page, page->pageoff << PAGE_SHIFT);
     page_wait_writeback(page);
@@ -236,7 +238,7 @@ void block_buf_free(struct block_buf *buf)
 void page_destroy_block_bufs(struct page *page)
 {
     DCHECK(page_flag_set(page, PAGE_FLAG_BUFFER));
-    auto b = reinterpret_cast<block_buf *>(page->priv);
+    auto b = block_buf_from_page(page);
 
     block_buf *next = nullptr;
 
@@ -701,11 +703,15 @@ void block_buf_dirty(block_buf *buf)
 
 void page_remove_block_buf(struct page *page, size_t offset, size_t end)
 {
-    block_buf **pp = (block_buf **) &page->priv;
+    /* The offsets are relative to @a page, which may be a subpage of a large folio */
+    struct page *head = compound_head(page);
+    offset += (page - head) << PAGE_SHIFT;
+    end += (page - head) << PAGE_SHIFT;
+    block_buf **pp = (block_buf **) &head->priv;
 
     while (*pp != nullptr)
     {
-        if ((*pp)->page_off >= offset && (*pp)->page_off < end)
+        if (block_buf_offset(*pp) >= offset && block_buf_offset(*pp) < end)
         {
             auto bbuf = *pp;
             *pp = (*pp)->next;
@@ -802,7 +808,7 @@ static void bforget(struct block_buf *buf)
     spin_lock(&buf->pagestate_lock);
     bb_clear_flag(buf, BLOCKBUF_FLAG_DIRTY);
     bool isdirty = false;
-    for (struct block_buf *b = (struct block_buf *) page->priv; b; b = b->next)
+    for (struct block_buf *b = block_buf_from_page(page); b; b = b->next)
     {
         if (bb_test_flag(b, BLOCKBUF_FLAG_DIRTY))
             isdirty = true;
@@ -111,7 +111,7 @@ static void ext2_writepage_endio(struct bio_req *req)
 {
     struct page *page = req->vec[0].page;
     struct block_buf *buf = (struct block_buf *) req->b_private;
-    struct block_buf *head = (struct block_buf *) page->priv;
+    struct block_buf *head = block_buf_from_page(page);
     DCHECK(head != nullptr);
 
     spin_lock(&head->pagestate_lock);
@@ -137,7 +137,7 @@ static ssize_t ext2_writepage(struct vm_object *obj, page *page, size_t off) REQ
         page_iov v[1];
         v->length = buf->block_size;
         v->page = buf->this_page;
-        DCHECK(buf->this_page == page);
+        DCHECK(compound_head(buf->this_page) == page);
         v->page_off = buf->page_off;
         if (buf->block_nr == EXT2_FILE_HOLE_BLOCK)
         {
@@ -168,14 +168,14 @@ static ssize_t ext2_writepage(struct vm_object *obj, page *page, size_t off) REQ
     CHECK_PAGE(nr_ios > 0, page);
     unlock_page(page);
 
-    return PAGE_SIZE;
+    return compound_nr(page) << PAGE_SHIFT;
 }
 
 int ext2_map_page(struct page *page, size_t off, struct inode *ino)
 {
     auto raw_inode = ext2_get_inode_from_node(ino);
     auto sb = ext2_superblock_from_inode(ino);
-    auto nr_blocks = PAGE_SIZE / sb->block_size;
+    auto nr_blocks = (compound_nr(page) << PAGE_SHIFT) / sb->block_size;
     auto base_block_index = off / sb->block_size;
     int curr_off = 0;
     bool all_holes = true;
@@ -205,7 +205,7 @@ int ext2_map_page(struct page *page, size_t off, struct inode *ino)
         if (block == EXT2_ERR_INV_BLOCK)
         {
             // Zero the block, since it's a hole
-            page_zero_range(page, b->page_off, sb->block_size);
+            page_zero_range(b->this_page, b->page_off, sb->block_size);
             bb_test_and_set(b, BLOCKBUF_FLAG_UPTODATE);
         }
         else
@@ -227,12 +227,11 @@ int ext2_map_page(struct page *page, size_t off, struct inode *ino)
 ssize_t ext2_readpage(struct page *page, size_t off, struct inode *ino)
 {
     auto sb = ext2_superblock_from_inode(ino);
-    auto curr_off = 0;
 
     if (int st = ext2_map_page(page, off, ino); st < 0)
         return st;
 
-    for (struct block_buf *b = (struct block_buf *) page->priv; b != nullptr; b = b->next)
+    for (struct block_buf *b = block_buf_from_page(page); b != nullptr; b = b->next)
     {
         sector_t block = b->block_nr;
         if (bb_test_flag(b, BLOCKBUF_FLAG_UPTODATE))
@@ -242,57 +241,90 @@ ssize_t ext2_readpage(struct page *page, size_t off, struct inode *ino)
         {
             /* TODO: Coalesce reads */
             page_iov v[1];
-            v->page = page;
+            v->page = b->this_page;
             v->length = sb->block_size;
-            v->page_off = curr_off;
+            v->page_off = b->page_off;
 
             if (sb_read_bio(sb, v, 1, block) < 0)
                 return -EIO;
         }
 
         bb_test_and_set(b, BLOCKBUF_FLAG_UPTODATE);
-        curr_off += sb->block_size;
     }
 
     page_test_set_flag(page, PAGE_FLAG_UPTODATE);
-    return min(PAGE_SIZE, ino->i_size - off);
+    return min(compound_nr(page) << PAGE_SHIFT, ino->i_size - off);
 }
 
 void ext2_readpages_endio(struct bio_req *bio) NO_THREAD_SAFETY_ANALYSIS
 {
+    const bool ok = (bio->flags & BIO_STATUS_MASK) == BIO_REQ_DONE;
+
     for (size_t i = 0; i < bio->nr_vecs; i++)
     {
         struct page_iov *iov = &bio->vec[i];
         DCHECK(page_locked(iov->page));
-        struct block_buf *head = (struct block_buf *) iov->page->priv;
+        /* Buffers of a large folio all hang off the head, and the last read unlocks it */
+        struct block_buf *head = block_buf_from_page(iov->page);
 
         spin_lock(&head->pagestate_lock);
+        bool done = true;
         bool uptodate = true;
 
         for (struct block_buf *b = head; b != nullptr; b = b->next)
         {
-            if (b->page_off == iov->page_off)
+            if (b->this_page == iov->page && b->page_off == iov->page_off)
             {
                 bb_clear_flag(b, BLOCKBUF_FLAG_AREAD);
-                CHECK(bb_test_and_set(b, BLOCKBUF_FLAG_UPTODATE));
-                continue;
+                if (ok)
+                    CHECK(bb_test_and_set(b, BLOCKBUF_FLAG_UPTODATE));
             }
 
             if (bb_test_flag(b, BLOCKBUF_FLAG_AREAD))
+                done = false;
+            if (!bb_test_flag(b, BLOCKBUF_FLAG_UPTODATE))
                 uptodate = false;
         }
 
         spin_unlock(&head->pagestate_lock);
 
-        if (uptodate)
+        if (done)
         {
-            if ((bio->flags & BIO_STATUS_MASK) == BIO_REQ_DONE)
+            if (uptodate)
                 page_test_set_flag(iov->page, PAGE_FLAG_UPTODATE);
             unlock_page(iov->page);
         }
     }
 }
 
+/**
+ * @brief Stop reading a page after failing to submit a block
+ * Clears AREAD from @a failed and every block after it (none of which were submitted), and unlocks
+ * the page if no reads are in flight.
+ *
+ * @param page Page (the head, for large folios)
+ * @param failed First block that was not submitted
+ */
+static void ext2_readpages_abort(struct page *page, struct block_buf *failed)
+    NO_THREAD_SAFETY_ANALYSIS
+{
+    struct block_buf *head = block_buf_from_page(page);
+    bool in_flight = false;
+
+    spin_lock(&head->pagestate_lock);
+    for (struct block_buf *b = failed; b != nullptr; b = b->next)
+        bb_clear_flag(b, BLOCKBUF_FLAG_AREAD);
+    for (struct block_buf *b = head; b != nullptr; b = b->next)
+    {
+        if (bb_test_flag(b, BLOCKBUF_FLAG_AREAD))
+            in_flight = true;
+    }
+    spin_unlock(&head->pagestate_lock);
+
+    if (!in_flight)
+        unlock_page(page);
+}
+
 static int ext2_readpages(struct readpages_state *state,
                           struct inode *ino) NO_THREAD_SAFETY_ANALYSIS
 {
@@ -306,27 +338,35 @@ static int ext2_readpages(struct readpages_state *state,
         const unsigned long pgoff = page->pageoff;
 
         if (st = ext2_map_page(page, pgoff << PAGE_SHIFT, ino); st < 0)
+        {
+            unlock_page(page);
             goto out_err;
+        }
 
         DCHECK(page->priv != 0);
         nr_ios = 0;
 
-        for (struct block_buf *b = (struct block_buf *) page->priv; b != nullptr; b = b->next)
+        /* Mark every block we're going to read first, so the endio of the first one can't unlock
+         * the page (possibly a large folio) while we're still submitting the rest. */
+        for (struct block_buf *b = block_buf_from_page(page); b != nullptr; b = b->next)
         {
-            sector_t block = b->block_nr;
-            if (block == 0)
-                continue;
-            if (bb_test_flag(b, BLOCKBUF_FLAG_UPTODATE))
+            if (b->block_nr == 0 || bb_test_flag(b, BLOCKBUF_FLAG_UPTODATE))
                 continue;
-            if (!bb_test_and_set(b, BLOCKBUF_FLAG_AREAD))
+            bb_test_and_set(b, BLOCKBUF_FLAG_AREAD);
+        }
+
+        for (struct block_buf *b = block_buf_from_page(page); b != nullptr; b = b->next)
+        {
+            sector_t block = b->block_nr;
+            if (!bb_test_flag(b, BLOCKBUF_FLAG_AREAD))
                 continue;
             DCHECK(!bb_test_flag(b, BLOCKBUF_FLAG_UPTODATE));
 
             struct bio_req *bio = bio_alloc(GFP_NOFS, 1);
             if (!bio)
             {
-                bb_clear_flag(b, BLOCKBUF_FLAG_AREAD);
                 st = -ENOMEM;
+                ext2_readpages_abort(page, b);
                 goto out_err;
             }
 
@@ -335,13 +375,13 @@ static int ext2_readpages(struct readpages_state *state,
             bio->sector_number = block * (sb->s_block_size / sb->s_bdev->sector_size);
             bio->flags = BIO_REQ_READ_OP;
             bio->b_end_io = ext2_readpages_endio;
-            bio_push_pages(bio, page, b->page_off, b->block_size);
+            bio_push_pages(bio, b->this_page, b->page_off, b->block_size);
             st = bio_submit_request(sb->s_bdev, bio);
             bio_put(bio);
 
             if (st < 0)
             {
-                bb_clear_flag(b, BLOCKBUF_FLAG_AREAD);
+                ext2_readpages_abort(page, b);
                 goto out_err;
             }
 
@@ -355,10 +395,8 @@ static int ext2_readpages(struct readpages_state *state,
 
     return 0;
 out_err:
-    /* On error, release the page we're holding. We do not unlock it if we submitted any IOs for the
-     * page, the endio page will do it for us. */
-    if (nr_ios == 0)
-        unlock_page(page);
+    /* On error, release the page we're holding. It was already unlocked, unless we submitted IOs
+     * for it (the endio will do it for us). */
     page_unref(page);
     return st;
 }
@@ -472,6 +510,9 @@ struct inode *ext2_fs_ino_to_vfs_ino(struct ext2_inode *inode, uint32_t inumber,
     {
         ino->i_pages->size = ino->i_size;
         ino->i_pages->ops = &ext2_vm_obj_ops;
+        /* Regular files get large folios from readahead, since their buffers handle them */
+        if (S_ISREG(inode->i_mode))
+            ino->i_pages->flags |= VMO_FLAG_LARGE_FOLIOS;
     }
 
     ino->i_uid = inode->i_uid;
@@ -987,10 +1028,10 @@ static int ext2_do_bmap_from_page_cache(struct file *file, unsigned int logical_
     }
 
     unsigned int block_off = (unsigned long) logical_block * sb->block_size - pgoff * PAGE_SIZE;
-    for (struct block_buf *b = (struct block_buf *) page->priv; b != nullptr; b = b->next)
+    for (struct block_buf *b = block_buf_from_page(page); b != nullptr; b = b->next)
     {
         sector_t block = b->block_nr;
-        if (b->page_off == block_off)
+        if (b->this_page == page && b->page_off == block_off)
         {
             *ret = block;
             unlock_page(page);
@@ -1056,9 +1097,10 @@ void ext2_truncate_partial(struct vm_object *vmobj, struct page *page, size_t of
     if (!page_flag_set(page, PAGE_FLAG_BUFFER))
         return;
 
-    for (struct block_buf *b = (struct block_buf *) page->priv; b != nullptr; b = b->next)
+    /* For large folios, @a page is the head and @a offset is relative to the whole folio */
+    for (struct block_buf *b = block_buf_from_page(page); b != nullptr; b = b->next)
     {
-        if (b->page_off >= start_block_off && b->page_off < end_block_off)
+        if (block_buf_offset(b) >= start_block_off && block_buf_offset(b) < end_block_off)
         {
             /* "Unmap" the block. This is now a hole */
             b->block_nr = 0;
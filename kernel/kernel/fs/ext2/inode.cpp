@@ -213,25 +213,31 @@ int ext2_map_page(struct page *page, size_t off, struct inode *ino);
 
 int ext2_prepare_write(inode *ino, struct page *page, size_t page_off, size_t offset, size_t len)
 {
+    /* Large folios are mapped whole, so work with offsets relative to the head */
+    struct page *head = compound_head(page);
+    const unsigned long folio_off = (unsigned long) (page - head) << PAGE_SHIFT;
+    page_off -= folio_off;
+    offset += folio_off;
+
     unsigned long end = offset + len;
     ext2_superblock *sb = ext2_superblock_from_inode(ino);
-    block_buf *bufs = block_buf_from_page(page);
     unsigned long base_block = page_off / sb->block_size;
     int allocated = 0;
     offset &= -sb->block_size;
 
     /* Handle pages that haven't been mapped yet */
-    if (!page_flag_set(page, PAGE_FLAG_BUFFER))
+    if (!page_flag_set(head, PAGE_FLAG_BUFFER))
     {
-        if (int st = ext2_map_page(page, page_off, ino); st < 0)
+        if (int st = ext2_map_page(head, page_off, ino); st < 0)
             return st;
     }
 
+    block_buf *bufs = block_buf_from_page(head);
     while (bufs)
     {
-        if (bufs->page_off >= offset && bufs->page_off < end)
+        if (block_buf_offset(bufs) >= offset && block_buf_offset(bufs) < end)
         {
-            unsigned int relative_block = bufs->page_off / sb->block_size;
+            unsigned int relative_block = block_buf_offset(bufs) / sb->block_size;
             sector_t block_number = bufs->block_nr;
             if (block_number == EXT2_FILE_HOLE_BLOCK)
             {
@@ -6,19 +6,28 @@
  * SPDX-License-Identifier: GPL-2.0-only
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+
 #include <onyx/block.h>
 #include <onyx/block/blk_plug.h>
 #include <onyx/filemap.h>
 #include <onyx/gen/trace_filemap.h>
 #include <onyx/mm/page_lru.h>
+#include <onyx/mm/workingset.h>
 #include <onyx/page.h>
 #include <onyx/pagecache.h>
+#include <onyx/pgtable.h>
 #include <onyx/readahead.h>
 #include <onyx/rmap.h>
+#include <onyx/sysfs.h>
+#include <onyx/user.h>
 #include <onyx/vfs.h>
 #include <onyx/vm.h>
 #include <onyx/vm_fault.h>
 
+#include <onyx/utility.hpp>
+
 #include <uapi/fcntl.h>
 
 int filemap_find_page(struct inode *ino, size_t pgoff, unsigned int flags, struct page **outp,
@@ -56,7 +65,8 @@ retry:
         p->owner = ino->i_pages;
         p->pageoff = pgoff;
         /* Add it in... */
-        struct page *p2 = vmo_add_page_safe(pgoff << PAGE_SHIFT, p, ino->i_pages);
+        unsigned long shadow;
+        struct page *p2 = vmo_add_page_shadow(pgoff << PAGE_SHIFT, p, ino->i_pages, &shadow);
         if (!p2)
         {
             page_unref(p);
@@ -67,6 +77,8 @@ retry:
         {
             inc_page_stat(p, NR_FILE);
             page_ref(p);
+            /* Refaulting pages that belong to the working set skip the inactive list */
+            workingset_refault(p, shadow);
             page_add_lru(p);
         }
 
@@ -85,11 +97,13 @@ retry:
     if (!(flags & (FIND_PAGE_NO_READPAGE | FIND_PAGE_NO_RA)) && ra_state)
     {
         rw_lock_read(&ino->i_pages->truncate_lock);
-        /* If we found PAGE_FLAG_READAHEAD, kick off more IO */
-        if (page_flag_set(p, PAGE_FLAG_READAHEAD))
+        /* If we found PAGE_FLAG_READAHEAD, kick off more IO. Large folios carry the flag (and
+         * the readahead mark) by their head. */
+        struct page *head = compound_head(p);
+        if (page_flag_set(head, PAGE_FLAG_READAHEAD))
         {
-            if (filemap_do_readahead_async(ino, ra_state, pgoff) != 1)
-                __atomic_and_fetch(&p->flags, ~PAGE_FLAG_READAHEAD, __ATOMIC_RELAXED);
+            if (filemap_do_readahead_async(ino, ra_state, head->pageoff) != 1)
+                __atomic_and_fetch(&head->flags, ~PAGE_FLAG_READAHEAD, __ATOMIC_RELAXED);
         }
         else if (!page_flag_set(p, PAGE_FLAG_UPTODATE))
         {
@@ -121,8 +135,10 @@ retry:
 
         if (!page_flag_set(p, PAGE_FLAG_UPTODATE))
         {
+            /* Large folios are read whole */
+            struct page *head = compound_head(p);
             st = (flags & FIND_PAGE_FAULT ? FIND_PAGE_FAULT : 0);
-            ssize_t st2 = ino->i_pages->ops->readpage(p, pgoff << PAGE_SHIFT, ino);
+            ssize_t st2 = ino->i_pages->ops->readpage(head, head->pageoff << PAGE_SHIFT, ino);
 
             /* In case of errors, propagate... */
             if (st2 < 0)
@@ -257,10 +273,12 @@ ssize_t filemap_read_iter(struct file *filp, size_t off, iovec_iter *iter, unsig
 
         if (st2 < 0)
             return st ?: st2;
-        void *buffer = PAGE_TO_VIRT(page);
 
-        auto cache_off = off % PAGE_SIZE;
-        auto rest = PAGE_SIZE - cache_off;
+        /* Copy up to the end of the folio */
+        struct page *head = compound_head(page);
+        void *buffer = PAGE_TO_VIRT(head);
+        size_t cache_off = off - (head->pageoff << PAGE_SHIFT);
+        size_t rest = (compound_nr(head) << PAGE_SHIFT) - cache_off;
 
         /* Do not read more than i_size */
         if (off + rest > size)
@@ -295,6 +313,8 @@ ssize_t filemap_read_iter(struct file *filp, size_t off, iovec_iter *iter, unsig
 void filemap_mark_dirty(struct page *page, size_t pgoff) REQUIRES(page)
 {
     DCHECK(page_locked(page));
+    /* Large folios are dirtied (and written back) as a whole, marked by their head */
+    page = compound_head(page);
     struct vm_object *object = page_vmobj(page);
     struct inode *ino = object->ino;
 
@@ -308,7 +328,7 @@ void filemap_mark_dirty(struct page *page, size_t pgoff) REQUIRES(page)
     /* Set the DIRTY mark, for writeback */
     {
         scoped_lock g{object->page_lock};
-        object->vm_pages.set_mark(pgoff, FILEMAP_MARK_DIRTY);
+        object->vm_pages.set_mark(page->pageoff, FILEMAP_MARK_DIRTY);
     }
 
     if (page_test_reclaim(page))
@@ -520,6 +540,7 @@ static int filemap_get_tagged_pages(struct inode *inode, unsigned int mark, unsi
 
 void page_start_writeback(struct page *page) EXCLUDES(inode->i_pages->page_lock) REQUIRES(page)
 {
+    page = compound_head(page);
     struct vm_object *obj = page_vmobj(page);
     scoped_lock g{obj->page_lock};
     obj->vm_pages.set_mark(page->pageoff, FILEMAP_MARK_WRITEBACK);
@@ -530,6 +551,8 @@ void page_start_writeback(struct page *page) EXCLUDES(inode->i_pages->page_lock)
 
 void page_end_writeback(struct page *page) EXCLUDES(inode->i_pages->page_lock)
 {
+    /* IO completion might hand us any subpage of a large folio */
+    page = compound_head(page);
     struct vm_object *obj = page_vmobj(page);
     spin_lock(&obj->page_lock);
     obj->vm_pages.clear_mark(page->pageoff, FILEMAP_MARK_WRITEBACK);
@@ -549,6 +572,7 @@ void page_end_writeback(struct page *page) EXCLUDES(inode->i_pages->page_lock)
 void filemap_clear_dirty(struct page *page) REQUIRES(page)
 {
     /* Clear the dirty flag for IO */
+    page = compound_head(page);
     struct vm_object *obj = page_vmobj(page);
     if (!page_test_clear_dirty(page))
         return;
@@ -572,8 +596,8 @@ static void filemap_wait_writeback(struct inode *inode, unsigned long start, uns
            0)
     {
         const unsigned long pageoff = page->pageoff;
-        /* Start the next iteration from the following page */
-        start = pageoff + 1;
+        /* Start the next iteration from the following page (or folio) */
+        start = pageoff + compound_nr(page);
         page_wait_writeback(page);
         page_unref(page);
         page = nullptr;
@@ -608,8 +632,8 @@ int filemap_writepages(struct inode *inode,
             continue;
         }
 
-        /* Start the next iteration from the following page */
-        start = pageoff + 1;
+        /* Start the next iteration from the following page (or folio). Marks are on the head. */
+        start = pageoff + compound_nr(page);
 
         if (page_flag_set(page, PAGE_FLAG_WRITEBACK) || !page_flag_set(page, PAGE_FLAG_DIRTY))
         {
@@ -724,6 +748,172 @@ static int filemap_mkwrite_shared(struct vm_pf_context *ctx,
     return vm_prepare_write(vma->vm_file->f_ino, page);
 }
 
+/* Fault-around: on read faults, map the cached pages around the faulting address, saving us from
+ * taking a fault for each one of them. */
+#define FAULT_AROUND_MAX_PAGES 32
+
+static unsigned long fault_around_bytes = 16 * PAGE_SIZE;
+/* Pages mapped by fault-around, i.e. page faults we didn't need to take */
+static unsigned long fault_around_mapped;
+
+struct fault_around
+{
+    /* Virtual address of pages[0] */
+    unsigned long start;
+    unsigned int nr;
+    /* Pages whose (folio's) lock we took. Subpages of a folio we already hold locked just get a
+     * reference. */
+    unsigned long locked;
+    struct page *pages[FAULT_AROUND_MAX_PAGES];
+};
+
+/**
+ * @brief Grab the uptodate pages around the faulting address
+ * Never blocks: pages that are not uptodate, or that we can't lock, are skipped.
+ *
+ * @param ctx Fault context
+ * @param fa Fault-around state
+ * @param fault_page The faulting page (locked)
+ */
+static void filemap_fault_around_gather(struct vm_pf_context *ctx, struct fault_around *fa,
+                                        struct page *fault_page) NO_THREAD_SAFETY_ANALYSIS
+{
+    struct vm_area_struct *vma = ctx->entry;
+    struct vm_object *vmo = vma->vm_file->f_ino->i_pages;
+    unsigned long window = READ_ONCE(fault_around_bytes);
+    size_t i_size = READ_ONCE(vma->vm_file->f_ino->i_size);
+    unsigned long start, end, pgoff_start, pgoff_end;
+    struct page *fault_head = compound_head(fault_page), *locked_head = nullptr;
+
+    fa->nr = 0;
+    fa->locked = 0;
+    if (window <= PAGE_SIZE || i_size == 0)
+        return;
+
+    /* Stay inside the VMA and the page table the faulting pte lives in */
+    start = cul::max(ctx->vpage & -window, cul::max(vma->vm_start, ctx->vpage & -PMD_SIZE));
+    end = cul::min((ctx->vpage & -window) + window,
+                   cul::min(vma->vm_end, (ctx->vpage & -PMD_SIZE) + PMD_SIZE));
+
+    pgoff_start = (vma->vm_offset >> PAGE_SHIFT) + ((start - vma->vm_start) >> PAGE_SHIFT);
+    pgoff_end = pgoff_start + ((end - start) >> PAGE_SHIFT) - 1;
+    pgoff_end = cul::min(pgoff_end, (i_size - 1) >> PAGE_SHIFT);
+    if (pgoff_start > pgoff_end)
+        return;
+
+    fa->start = start;
+    fa->nr = pgoff_end - pgoff_start + 1;
+    memset(fa->pages, 0, fa->nr * sizeof(struct page *));
+
+    scoped_lock g{vmo->page_lock};
+    auto cursor = radix_tree::cursor::from_range(&vmo->vm_pages, pgoff_start, pgoff_end);
+    while (!cursor.is_end())
+    {
+        struct page *page = (struct page *) cursor.get();
+        unsigned long idx = cursor.current_idx() - pgoff_start;
+        cursor.advance();
+
+        if (fa->start + (idx << PAGE_SHIFT) == ctx->vpage)
+            continue;
+
+        /* Pages marked for readahead need to fault, so we kick off more IO */
+        if (!page_flag_set(page, PAGE_FLAG_UPTODATE) || page_flag_set(page, PAGE_FLAG_READAHEAD))
+            continue;
+
+        /* The page lock keeps truncation away while we map it */
+        if (compound_head(page) != fault_head && compound_head(page) != locked_head)
+        {
+            if (!try_lock_page(page))
+                continue;
+            locked_head = compound_head(page);
+            fa->locked |= 1UL << idx;
+        }
+
+        page_ref(page);
+        fa->pages[idx] = page;
+    }
+}
+
+/**
+ * @brief Map the pages gathered by filemap_fault_around_gather
+ *
+ * @param ctx Fault context
+ * @param fa Fault-around state
+ * @param ptep The (locked) pte of the faulting address
+ */
+static void filemap_map_around(struct vm_pf_context *ctx, struct fault_around *fa, pte_t *ptep)
+{
+    struct mm_address_space *mm = ctx->entry->vm_mm;
+    unsigned long mapped = 0;
+
+    for (unsigned int i = 0; i < fa->nr; i++)
+    {
+        struct page *page = fa->pages[i];
+        if (!page)
+            continue;
+
+        long delta = (long) (fa->start + (i << PAGE_SHIFT) - ctx->vpage) >> PAGE_SHIFT;
+        pte_t *pte = ptep + delta;
+        if (!pte_none(*pte))
+            continue;
+
+        /* Read-only, like the faulting page. Writes fault and go through mkwrite. */
+        page_add_mapcount(page);
+        set_pte(pte, pte_mkpte((u64) page_to_phys(page),
+                               calc_pgprot((u64) page_to_phys(page), ctx->page_rwx)));
+        mapped++;
+    }
+
+    if (mapped)
+    {
+        increment_vm_stat(mm, resident_set_size, mapped << PAGE_SHIFT);
+        __atomic_add_fetch(&fault_around_mapped, mapped, __ATOMIC_RELAXED);
+    }
+}
+
+static void filemap_fault_around_release(struct fault_around *fa) NO_THREAD_SAFETY_ANALYSIS
+{
+    for (unsigned int i = 0; i < fa->nr; i++)
+    {
+        if (!fa->pages[i])
+            continue;
+        if (fa->locked & (1UL << i))
+            unlock_page(fa->pages[i]);
+        page_unref(fa->pages[i]);
+    }
+
+    fa->nr = 0;
+}
+
+ssize_t fault_around_bytes_sysfs_read(void *buffer, size_t size, off_t off)
+{
+    return sysfs_read_ulong(READ_ONCE(fault_around_bytes), buffer, size, off);
+}
+
+ssize_t fault_around_bytes_sysfs_write(void *buffer, size_t size, off_t off)
+{
+    unsigned long val;
+    int err = sysfs_parse_ulong(buffer, size, &val);
+    if (err < 0)
+        return err;
+
+    /* Round down to a power of two (the window is naturally aligned). PAGE_SIZE (or less)
+     * disables fault-around. */
+    if (val > FAULT_AROUND_MAX_PAGES * PAGE_SIZE)
+        val = FAULT_AROUND_MAX_PAGES * PAGE_SIZE;
+    if (val < PAGE_SIZE)
+        val = PAGE_SIZE;
+    val = 1UL << ilog2(val);
+
+    WRITE_ONCE(fault_around_bytes, val);
+    return size;
+}
+
+ssize_t fault_around_mapped_sysfs_read(void *buffer, size_t size, off_t off)
+{
+    return sysfs_read_ulong(READ_ONCE(fault_around_mapped), buffer, size, off);
+}
+
 static int filemap_fault(struct vm_pf_context *ctx) NO_THREAD_SAFETY_ANALYSIS
 {
     struct vm_area_struct *vma = ctx->entry;
@@ -736,6 +926,9 @@ static int filemap_fault(struct vm_pf_context *ctx) NO_THREAD_SAFETY_ANALYSIS
     pte_t *ptep;
     pte_t oldpte = ctx->oldpte;
     struct spinlock *lock;
+    struct fault_around fa;
+
+    fa.nr = 0;
 
     /* We need to lock the page in case we're mapping it (that is, it's either a read-fault on
      * a private region, or any fault on a MAP_SHARED). */
@@ -773,6 +966,8 @@ static int filemap_fault(struct vm_pf_context *ctx) NO_THREAD_SAFETY_ANALYSIS
     {
         /* Write-protect the page */
         ctx->page_rwx &= ~VM_WRITE;
+        if (pte_none(oldpte))
+            filemap_fault_around_gather(ctx, &fa, page);
     }
     else
     {
@@ -825,6 +1020,8 @@ static int filemap_fault(struct vm_pf_context *ctx) NO_THREAD_SAFETY_ANALYSIS
         page_add_mapcount(page);
         set_pte(ptep, pte_mkpte((u64) page_to_phys(page),
                                 calc_pgprot((u64) page_to_phys(page), ctx->page_rwx)));
+        if (fa.nr)
+            filemap_map_around(ctx, &fa, ptep);
 
         if (unlikely(pte_present(oldpte) && !pte_special(oldpte)))
             oldp = phys_to_page(pte_addr(oldpte));
@@ -845,6 +1042,7 @@ static int filemap_fault(struct vm_pf_context *ctx) NO_THREAD_SAFETY_ANALYSIS
 out_unlock_pte:
     spin_unlock(lock);
 out:
+    filemap_fault_around_release(&fa);
     if (locked)
         unlock_page(page);
     page_unref(page);
@@ -852,6 +1050,7 @@ out:
 enomem:
     st = -ENOMEM;
 err:
+    filemap_fault_around_release(&fa);
     info->error_info = VM_SIGSEGV;
     if (locked && page)
         unlock_page(page);
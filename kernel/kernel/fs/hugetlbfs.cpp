@@ -0,0 +1,326 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <onyx/dentry.h>
+#include <onyx/dev.h>
+#include <onyx/fs_mount.h>
+#include <onyx/log.h>
+#include <onyx/mm/hugetlb.h>
+#include <onyx/mm/vm_object.h>
+#include <onyx/page.h>
+#include <onyx/pgtable.h>
+#include <onyx/tmpfs.h>
+#include <onyx/vfs.h>
+#include <onyx/vm.h>
+
+#include <onyx/utility.hpp>
+
+/*
+ * hugetlbfs is a tmpfs whose page cache is made out of hugetlb pages. Each huge page sits in the
+ * page cache at the index of its first 4KiB page. There's no read(2)/write(2) support, the files
+ * can only be mmap'd (and ftruncate'd).
+ */
+
+#define HUGETLBFS_MAGIC 0x958458f6
+
+#define HUGETLBFS_TRUNCATE_BATCH 16
+
+static tmpfs_superblock *hugetlbfs_internal_sb;
+static file_ops hugetlbfs_fops;
+
+static int hugetlbfs_truncate(struct vm_object *vmo, unsigned long size)
+{
+    unsigned long start = ALIGN_TO(size, HUGETLB_SIZE) >> PAGE_SHIFT;
+    struct page *batch[HUGETLBFS_TRUNCATE_BATCH];
+    struct vm_area_struct *vma;
+    int nr;
+
+    /* Faults map pages under the read lock, after checking i_size. Once we hold the write lock and
+     * set the new size, no one can map anything past it. */
+    rw_lock_write(&vmo->truncate_lock);
+    if (vmo->ino)
+        vmo->ino->i_size = size;
+
+    /* Unmap everything past the new EOF, including private copies */
+    spin_lock(&vmo->mapping_lock);
+    for_intervals_in_range(&vmo->mappings, vma, struct vm_area_struct, vm_objhead, start, -1UL)
+    {
+        unsigned long pgoff = vma->vm_offset >> PAGE_SHIFT;
+        unsigned long addr = vma->vm_start + ((cul::max(start, pgoff) - pgoff) << PAGE_SHIFT);
+        vm_mmu_unmap(vma->vm_mm, (void *) addr, (vma->vm_end - addr) >> PAGE_SHIFT, vma);
+    }
+    spin_unlock(&vmo->mapping_lock);
+
+    do
+    {
+        nr = 0;
+        spin_lock(&vmo->page_lock);
+        radix_tree::cursor cursor = radix_tree::cursor::from_range(&vmo->vm_pages, start);
+        while (!cursor.is_end() && nr < HUGETLBFS_TRUNCATE_BATCH)
+        {
+            batch[nr++] = (struct page *) cursor.get();
+            cursor.advance();
+        }
+
+        for (int i = 0; i < nr; i++)
+        {
+            CHECK(vmo->vm_pages.store(batch[i]->pageoff, 0) == 0);
+            WRITE_ONCE(batch[i]->owner, nullptr);
+        }
+        spin_unlock(&vmo->page_lock);
+
+        /* Drop the page cache's reference. Pages go back to the pool once unmapped everywhere. */
+        for (int i = 0; i < nr; i++)
+            page_unref(batch[i]);
+    } while (nr > 0);
+
+    vmo->size = size;
+    rw_unlock_write(&vmo->truncate_lock);
+    return 0;
+}
+
+const static vm_object_ops hugetlbfs_vmops = {
+    .truncate = hugetlbfs_truncate,
+};
+
+bool inode_is_hugetlbfs(struct inode *ino)
+{
+    return ino->i_pages && ino->i_pages->ops == &hugetlbfs_vmops;
+}
+
+static struct page *hugetlbfs_find_page(struct vm_object *vmo, unsigned long pgoff)
+{
+    struct page *page = nullptr;
+    scoped_lock g{vmo->page_lock};
+
+    auto ex = vmo->vm_pages.get(pgoff);
+    if (ex.has_value())
+        page = (struct page *) ex.value();
+    if (page)
+        page_ref(page);
+    return page;
+}
+
+/**
+ * @brief Find or create the page cache's huge page at pgoff
+ *
+ * @param vmo VM object
+ * @param pgoff Page offset (huge page aligned)
+ * @return Referenced page, or NULL if out of huge pages
+ */
+static struct page *hugetlbfs_get_page(struct vm_object *vmo, unsigned long pgoff)
+{
+    struct page *page = hugetlbfs_find_page(vmo, pgoff);
+    struct page *newp;
+    if (page)
+        return page;
+
+    newp = hugetlb_alloc_page();
+    if (!newp)
+        return nullptr;
+
+    scoped_lock g{vmo->page_lock};
+    page = vmo->insert_page_unlocked(pgoff << PAGE_SHIFT, newp);
+    if (page == newp)
+    {
+        /* Inserted, the allocation's reference now belongs to the page cache */
+        page->owner = vmo;
+        page->pageoff = pgoff;
+        page_ref(page);
+    }
+    else if (!page)
+        page_unref(newp);
+
+    return page;
+}
+
+struct page *hugetlb_fault_page(struct vm_area_struct *vma, unsigned long haddr, bool write,
+                                int *vm_flags)
+{
+    struct inode *ino = vma->vm_file->f_ino;
+    struct vm_object *vmo = ino->i_pages;
+    unsigned long off = haddr - vma->vm_start + vma->vm_offset;
+    struct page *page, *newp;
+
+    /* SIGBUS! */
+    if (off >= (unsigned long) ino->i_size)
+        return (struct page *) ERR_PTR(-ENOENT);
+
+    if (vma_shared(vma))
+    {
+        page = hugetlbfs_get_page(vmo, off >> PAGE_SHIFT);
+        return page ?: (struct page *) ERR_PTR(-ENOMEM);
+    }
+
+    /* MAP_PRIVATE: map the page cache's page read-only, or CoW it on write. If there's nothing in
+     * the page cache, start with a private zeroed page. */
+    page = hugetlbfs_find_page(vmo, off >> PAGE_SHIFT);
+    if (page && !write)
+    {
+        *vm_flags &= ~VM_WRITE;
+        return page;
+    }
+
+    newp = hugetlb_alloc_page();
+    if (page)
+    {
+        if (newp)
+            memcpy(PAGE_TO_VIRT(newp), PAGE_TO_VIRT(page), HUGETLB_SIZE);
+        page_unref(page);
+    }
+
+    return newp ?: (struct page *) ERR_PTR(-ENOMEM);
+}
+
+int hugetlb_setup_vma(struct vm_area_struct *vma)
+{
+    unsigned long end = vma->vm_offset + (vma->vm_end - vma->vm_start);
+    struct inode *ino;
+
+    if (!vma->vm_file)
+    {
+        /* MAP_HUGETLB */
+        vma->vm_file = hugetlb_anon_file(vma->vm_end - vma->vm_start);
+        if (!vma->vm_file)
+            return -ENOMEM;
+    }
+
+    ino = vma->vm_file->f_ino;
+    DCHECK(inode_is_hugetlbfs(ino));
+
+    /* Mapping a hugetlbfs file extends it (like Linux) */
+    rw_lock_write(&ino->i_pages->truncate_lock);
+    if ((unsigned long) ino->i_size < end)
+        ino->i_size = end;
+    rw_unlock_write(&ino->i_pages->truncate_lock);
+
+    vmo_ref(ino->i_pages);
+    vmo_assign_mapping(ino->i_pages, vma);
+    vma->vm_obj = ino->i_pages;
+    vma->vm_ops = &hugetlb_vmops;
+    return 0;
+}
+
+/**
+ * @brief Create an unlinked hugetlbfs file (for MAP_HUGETLB)
+ *
+ * @param len Length, in bytes
+ * @return Opened struct file, or NULL
+ */
+struct file *hugetlb_anon_file(size_t len)
+{
+    struct dentry *dentry = nullptr;
+    struct file *f;
+    tmpfs_inode *ino = hugetlbfs_internal_sb->alloc_inode(0777 | S_IFREG, 0);
+    if (!ino)
+        return nullptr;
+    ino->i_size = ALIGN_TO(len, HUGETLB_SIZE);
+
+    dentry = dentry_create("[anon_hugetlb]", ino, nullptr);
+    if (!dentry)
+        goto err;
+    dget(dentry);
+
+    f = inode_to_file(ino);
+    if (!f)
+        goto err;
+
+    f->f_dentry = dentry;
+    return f;
+err:
+    if (dentry)
+        dput(dentry);
+    if (ino)
+        inode_unref(ino);
+    return nullptr;
+}
+
+static int hugetlbfs_statfs(struct statfs *buf, struct superblock *sb)
+{
+    tmpfs_superblock *s = (tmpfs_superblock *) sb;
+    buf->f_type = HUGETLBFS_MAGIC;
+    buf->f_bsize = HUGETLB_SIZE;
+    buf->f_blocks = hugetlb_nr_pages();
+    buf->f_bfree = buf->f_bavail = hugetlb_nr_free_pages();
+    buf->f_files = s->ino_nr;
+    memset(&buf->f_fsid, 0, sizeof(buf->f_fsid));
+    buf->f_ffree = 0xffffffff;
+    buf->f_namelen = NAME_MAX;
+    buf->f_flags = 0;
+    return 0;
+}
+
+static int hugetlbfs_umount(struct mount *mnt)
+{
+    dentry_unref_subtree(mnt->mnt_root);
+    return 0;
+}
+
+static tmpfs_superblock *hugetlbfs_create_sb()
+{
+    tmpfs_superblock *sb = new tmpfs_superblock{};
+    if (!sb)
+        return nullptr;
+    sb->override_file_ops(&hugetlbfs_fops);
+    sb->override_vmobj_ops(&hugetlbfs_vmops);
+    sb->s_block_size = HUGETLB_SIZE;
+    sb->statfs = hugetlbfs_statfs;
+    sb->umount = hugetlbfs_umount;
+    return sb;
+}
+
+static struct superblock *hugetlbfs_mount(struct vfs_mount_info *info)
+{
+    auto sb = hugetlbfs_create_sb();
+    if (!sb)
+        return (struct superblock *) ERR_PTR(-ENOMEM);
+
+    char name[NAME_MAX + 1];
+    snprintf(name, NAME_MAX, "hugetlbfs-%lu", sb->fs_minor);
+
+    auto ex = dev_register_blockdevs(0, 1, 0, nullptr, name);
+    if (ex.has_error())
+    {
+        delete sb;
+        return (struct superblock *) ERR_PTR(ex.error());
+    }
+
+    auto blockdev = ex.value();
+    sb->s_devnr = blockdev->dev();
+
+    auto node = sb->create_inode(S_IFDIR | 1777);
+    if (!node)
+    {
+        dev_unregister_dev(blockdev, true);
+        delete sb;
+        return (struct superblock *) ERR_PTR(-ENOMEM);
+    }
+
+    node->i_nlink = 2;
+    d_positiveize(info->root_dir, node);
+    dget(info->root_dir);
+    return sb;
+}
+
+__init void hugetlbfs_init()
+{
+    /* Same as tmpfs, minus read(2)/write(2) */
+    hugetlbfs_fops = tmpfs_fops;
+    hugetlbfs_fops.read_iter = nullptr;
+    hugetlbfs_fops.write_iter = nullptr;
+    hugetlbfs_fops.fsyncdata = nullptr;
+
+    hugetlbfs_internal_sb = hugetlbfs_create_sb();
+    CHECK(hugetlbfs_internal_sb);
+
+    if (auto st = fs_mount_add(hugetlbfs_mount, FS_MOUNT_PSEUDO_FS, "hugetlbfs"); st < 0)
+        ERROR("hugetlbfs", "Failed to register hugetlbfs - error %d", st);
+}
@@ -11,6 +11,9 @@
 
 #include <onyx/block/blk_plug.h>
 #include <onyx/filemap.h>
+#include <onyx/mm/page_lru.h>
+#include <onyx/mm/workingset.h>
+#include <onyx/utils.h>
 #include <onyx/vfs.h>
 
 /* We implement a very simple readahead scheme. We maintain a readahead window (min 64KiB). When
@@ -18,11 +21,20 @@
  * readahead window, completely async. We set a marker (PAGE_FLAG_READAHEAD) in the middle of the RA
  * window. If (and when) we hit the marker, we double the RA window (up to 512KiB).
  *
+ * Pages are grabbed (and locked) in batches of READPAGES_BATCH and handed to ->readpages directly,
+ * so the filesystem doesn't need to look each one of them up again. Each batch is looked up,
+ * inserted into the page cache and added to the LRU with a single lock round-trip each. Objects
+ * with VMO_FLAG_LARGE_FOLIOS get large folios (up to READAHEAD_MAX_ORDER) where the run allows it,
+ * falling back to single pages if memory is fragmented.
+ *
  * Known limitations: We have no "random access" penalty, we only have readahead state in the struct
  * file (multiple mmaps of the same file will share RA state), block devices can't do readahead.
  * */
 #define RA_MIN_WINDOW (0x10000 / PAGE_SIZE)
 
+_Static_assert((1 << READAHEAD_MAX_ORDER) <= READPAGES_BATCH,
+               "readahead folios must fit in a readpages batch");
+
 /**
  * @brief Get the next page out of the readpages state
  * The page will be returned locked.
@@ -32,21 +44,16 @@
  */
 struct page *readpages_next_page(struct readpages_state *state)
 {
-    struct page *page = NULL;
+    struct page *page;
     if (state->nr_pages == 0)
         return NULL;
 
-    /* TODO: This is inefficient */
-    int st = filemap_find_page(state->ino, state->pgoff,
-                               FIND_PAGE_NO_READPAGE | FIND_PAGE_NO_RA | FIND_PAGE_NO_CREATE, &page,
-                               NULL);
-    /* Note: We already hold the page locks, no need to re-acquire them */
-    if (st < 0)
-        DCHECK(st == 0);
-
+    /* The reference we grabbed in filemap_do_readahead gets passed on to the caller */
+    page = state->pages[state->next++];
     DCHECK(page != NULL && page_locked(page));
-    state->nr_pages--;
-    state->pgoff++;
+    DCHECK(page->pageoff == state->pgoff);
+    state->nr_pages -= compound_nr(page);
+    state->pgoff += compound_nr(page);
     return page;
 }
 
@@ -70,6 +77,207 @@ static void readpages_finish(struct readpages_state *state) NO_THREAD_SAFETY_ANA
 
 u64 bdev_get_size(struct blockdev *bdev);
 
+/**
+ * @brief Allocate a folio for index @a i of a run
+ * Large folios must be naturally aligned, fit in the run and not cover any cached page. They are
+ * opportunistic: we don't reclaim or compact for them, and fall back to a single page.
+ *
+ * @param pages Cached pages of the run (by index)
+ * @param pgoff Page index of the start of the run
+ * @param i Index of the folio in the run
+ * @param nr Length of the run
+ * @param large True if the page cache takes large folios
+ * @return Folio (or page), or NULL if out of memory
+ */
+static struct page *readahead_alloc_folio(struct page **pages, unsigned long pgoff, unsigned int i,
+                                          unsigned int nr, bool large)
+{
+    for (unsigned int order = large ? READAHEAD_MAX_ORDER : 0; order > 0; order--)
+    {
+        unsigned int folio_nr = 1U << order, j;
+        if ((pgoff + i) & (folio_nr - 1) || i + folio_nr > nr)
+            continue;
+
+        for (j = 0; j < folio_nr; j++)
+        {
+            if (pages[i + j])
+                break;
+        }
+
+        if (j != folio_nr)
+            continue;
+
+        struct page *page = alloc_pages(order, (GFP_KERNEL & ~__GFP_DIRECT_RECLAIM) | __GFP_NOWARN |
+                                                   __GFP_COMP | PAGE_ALLOC_NO_ZERO);
+        if (page)
+            return page;
+    }
+
+    return alloc_page(PAGE_ALLOC_NO_ZERO | GFP_KERNEL);
+}
+
+/**
+ * @brief Grab a run of pages to read, starting at @a pgoff
+ * Missing pages are allocated and inserted into the page cache. The run ends at the first cached
+ * page we can't read into (uptodate, locked by someone else, or part of a large folio that doesn't
+ * start or fit in the run).
+ *
+ * @param inode Inode
+ * @param pgoff Page index of the start of the run
+ * @param nr Max number of pages to grab (at most READPAGES_BATCH)
+ * @param state Readpages state, filled in with the run's locked and referenced pages
+ * @return Number of page indices consumed (including the folio that ended the run), or -ENOMEM
+ */
+static int readahead_grab_pages(struct inode *inode, unsigned long pgoff, unsigned int nr,
+                                struct readpages_state *state) NO_THREAD_SAFETY_ANALYSIS
+{
+    struct vm_object *vmo = inode->i_pages;
+    struct page *pages[READPAGES_BATCH];
+    struct page *newpages[READPAGES_BATCH];
+    unsigned long shadows[READPAGES_BATCH];
+    unsigned long inserted = 0;
+    unsigned int i, j, run, grabbed, stop_nr = 0;
+    bool large = vmo->flags & VMO_FLAG_LARGE_FOLIOS;
+
+    state->ino = inode;
+    state->pgoff = pgoff;
+    state->nr_pages = 0;
+    state->next = 0;
+
+    vmo_get_range(vmo, pgoff, nr, pages);
+
+    for (i = 0; i < nr;)
+    {
+        struct page *page = pages[i];
+        unsigned int folio_nr;
+        newpages[i] = NULL;
+
+        if (page)
+        {
+            /* Cached pages only get read if no one else is on them already. Large folios are read
+             * whole, so they must start and end inside the run. */
+            struct page *head = compound_head(page);
+            folio_nr = compound_nr(head);
+            if (head == page && i + folio_nr <= nr && try_lock_page(page))
+            {
+                if (page->owner == vmo && !page_flag_set(page, PAGE_FLAG_UPTODATE))
+                {
+                    /* The folio's other indices come along with the head */
+                    for (j = 1; j < folio_nr; j++)
+                    {
+                        newpages[i + j] = NULL;
+                        if (pages[i + j])
+                            page_unref(pages[i + j]);
+                        pages[i + j] = NULL;
+                    }
+
+                    i += folio_nr;
+                    continue;
+                }
+
+                unlock_page(page);
+            }
+
+            stop_nr = folio_nr - (page - head);
+            break;
+        }
+
+        page = readahead_alloc_folio(pages, pgoff, i, nr, large);
+        if (!page)
+            break;
+        folio_nr = compound_nr(page);
+        for (j = 0; j < folio_nr; j++)
+        {
+            page[j].owner = vmo;
+            page[j].pageoff = pgoff + i + j;
+        }
+
+        /* No one else can see the page yet, so this can't fail */
+        bool locked = try_lock_page(page);
+        CHECK(locked);
+        pages[i] = newpages[i] = page;
+        for (j = 1; j < folio_nr; j++)
+            pages[i + j] = newpages[i + j] = NULL;
+        i += folio_nr;
+    }
+
+    grabbed = run = i;
+    /* Drop the references to the cached pages past the end of the run */
+    for (i = grabbed; i < nr; i++)
+    {
+        if (pages[i])
+            page_unref(pages[i]);
+    }
+
+    if (grabbed > 0)
+        inserted = vmo_add_pages_shadow(vmo, pgoff, newpages, grabbed, shadows);
+
+    for (i = 0; i < grabbed; i++)
+    {
+        if (!newpages[i])
+            continue;
+
+        if (!(inserted & (1UL << i)))
+        {
+            /* Someone beat us to it. End the run here, and throw our page away. */
+            unlock_page(newpages[i]);
+            page_unref(newpages[i]);
+            pages[i] = newpages[i] = NULL;
+            if (i < run)
+            {
+                run = i;
+                stop_nr = 1;
+            }
+
+            continue;
+        }
+
+        /* The page cache took our allocation reference, grab one for ourselves */
+        inc_page_stat(newpages[i], NR_FILE);
+        page_ref(newpages[i]);
+        workingset_refault(newpages[i], shadows[i]);
+    }
+
+    page_add_lru_batch(newpages, grabbed);
+
+    /* Pages past the end of the run are released. The ones we inserted stay in the cache, !UPTODATE,
+     * and get read in by ->readpage whenever someone needs them. */
+    for (i = run; i < grabbed; i++)
+    {
+        if (!pages[i])
+            continue;
+        unlock_page(pages[i]);
+        page_unref(pages[i]);
+    }
+
+    /* Hand out the folios by their head */
+    for (i = 0, j = 0; i < run; i++)
+    {
+        if (pages[i])
+            state->pages[j++] = pages[i];
+    }
+
+    state->nr_pages = run;
+
+    if (grabbed == 0 && !stop_nr)
+        return -ENOMEM;
+    return run + stop_nr;
+}
+
+/* Set PAGE_FLAG_READAHEAD on the folio that holds @a mark, and return the folio's index */
+static unsigned long readahead_set_mark(struct readpages_state *state, unsigned long mark)
+{
+    for (unsigned int i = 0;; i++)
+    {
+        struct page *page = state->pages[i];
+        if (mark < page->pageoff + compound_nr(page))
+        {
+            page->flags |= PAGE_FLAG_READAHEAD;
+            return page->pageoff;
+        }
+    }
+}
+
 static int filemap_do_readahead(struct inode *inode, struct readahead_state *ra_state,
                                 unsigned long pgoff) NO_THREAD_SAFETY_ANALYSIS
 {
@@ -106,49 +314,40 @@ static int filemap_do_readahead(struct inode *inode, struct readahead_state *ra_
 
     mark = pgoff + window / 2;
 
-    /* For all pages after (including) pgoff, allocate pages (if required!) and later kick off IO */
-    for (unsigned long i = 0; i < window; i++)
+    blk_start_plug(&plug);
+
+    /* For all pages after (including) pgoff, allocate pages (if required!) and kick off IO, one
+     * batch at a time. */
+    for (unsigned long i = 0; i < window;)
     {
-        struct page *page = NULL;
-        /* TODO: Using filemap_find_page here is inefficient */
-        st = filemap_find_page(inode, pgoff + i,
-                               FIND_PAGE_LOCK | FIND_PAGE_NO_READPAGE | FIND_PAGE_NO_RA, &page,
-                               NULL);
+        struct readpages_state state;
+        unsigned long batch = min(window - i, (unsigned long) READPAGES_BATCH);
+
+        st = readahead_grab_pages(inode, pgoff + i, batch, &state);
         if (st < 0)
+            goto out;
+
+        if (mark >= pgoff + i && mark < pgoff + i + state.nr_pages)
+            mark = readahead_set_mark(&state, mark);
+
+        if (state.nr_pages > 0)
         {
-            /* Oh no, lets backtrack */
-            for (unsigned long j = 0; j < i; j++)
+            int st2 = inode->i_pages->ops->readpages(&state, inode);
+            readpages_finish(&state);
+            if (st2 < 0)
             {
-                int st2 = filemap_find_page(
-                    inode, pgoff + j, FIND_PAGE_NO_CREATE | FIND_PAGE_NO_READPAGE | FIND_PAGE_NO_RA,
-                    &page, NULL);
-                CHECK(st2 == 0);
-                /* Unlock the page and unref */
-                DCHECK(page_locked(page));
-                unlock_page(page);
-                page_unref(page);
+                st = st2;
+                goto out;
             }
-
-            goto out;
         }
 
-        if (pgoff + i == mark)
-            page->flags |= PAGE_FLAG_READAHEAD;
-        DCHECK(page_locked(page));
-
-        page_unref(page);
+        i += st;
+        st = 0;
     }
 
-    blk_start_plug(&plug);
-    struct readpages_state state = {inode, pgoff, window};
-    st = inode->i_pages->ops->readpages(&state, inode);
-    readpages_finish(&state);
-    if (likely(st == 0))
-    {
-        WRITE_ONCE(ra_state->ra_start, start);
-        WRITE_ONCE(ra_state->ra_window, window);
-        WRITE_ONCE(ra_state->ra_mark, mark);
-    }
+    WRITE_ONCE(ra_state->ra_start, start);
+    WRITE_ONCE(ra_state->ra_window, window);
+    WRITE_ONCE(ra_state->ra_mark, mark);
 
 out:
     blk_end_plug(&plug);
@@ -279,3 +279,49 @@ int sysfs_init_and_add(const char *name, struct sysfs_object *obj, struct sysfs_
 
     return 0;
 }
+
+ssize_t sysfs_read_buf(const char *buf, size_t len, void *ubuf, size_t size, off_t off)
+{
+    if ((size_t) off >= len)
+        return 0;
+    len -= off;
+    if (len > size)
+        len = size;
+
+    if (copy_to_user(ubuf, buf + off, len) < 0)
+        return -EFAULT;
+    return len;
+}
+
+ssize_t sysfs_read_ulong(unsigned long val, void *ubuf, size_t size, off_t off)
+{
+    char buf[32];
+    size_t len = snprintf(buf, sizeof(buf), "%lu\n", val);
+    return sysfs_read_buf(buf, len, ubuf, size, off);
+}
+
+ssize_t sysfs_copy_str(char *buf, size_t buflen, const void *ubuf, size_t size)
+{
+    size_t len = size < buflen - 1 ? size : buflen - 1;
+
+    if (copy_from_user(buf, ubuf, len) < 0)
+        return -EFAULT;
+    buf[len] = '\0';
+    if (len && buf[len - 1] == '\n')
+        buf[--len] = '\0';
+    return len;
+}
+
+int sysfs_parse_ulong(const void *ubuf, size_t size, unsigned long *val)
+{
+    char buf[32];
+    char *end;
+    ssize_t st = sysfs_copy_str(buf, sizeof(buf), ubuf, size);
+    if (st < 0)
+        return st;
+
+    *val = strtoul(buf, &end, 0);
+    if (end == buf || *end != '\0')
+        return -EINVAL;
+    return 0;
+}
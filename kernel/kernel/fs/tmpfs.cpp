@@ -339,7 +339,7 @@ tmpfs_inode *tmpfs_superblock::alloc_inode(mode_t mode, dev_t rdev)
 
     ino->i_nlink = 0;
     if (ino->i_pages)
-        ino->i_pages->ops = &tmpfs_vmops;
+        ino->i_pages->ops = tmpfs_vmops_ ?: &tmpfs_vmops;
 
     /* We're currently holding two refs: one for the user, and another for the simple fact
      * that we need this inode to remain in memory.
@@ -118,6 +118,159 @@ void page_alloc_perf(void)
 
 #endif
 
+#ifdef CONFIG_KTEST_MEMCPY_PERF
+
+#include <string.h>
+
+#include <onyx/clock.h>
+#include <onyx/vm.h>
+
+/* Microbenchmark for the boot-time selected memcpy/memset/copy_user strategies. Kernel threads
+ * have a kernel addr_limit, so we can point copy_{to,from}_user at kernel buffers. */
+#define MEMCPY_PERF_BUF_SIZE (16UL * 1024 * 1024)
+
+static void memcpy_perf_run(const char *name, void *dst, void *src, size_t size,
+                            void (*op)(void *dst, void *src, size_t size))
+{
+    struct clocksource *c = get_main_clock();
+    /* Roughly the same amount of bytes for every size */
+    unsigned long iters = (256UL * 1024 * 1024) / size;
+    if (iters > 100000)
+        iters = 100000;
+
+    hrtime_t t0 = c->get_ns();
+    for (unsigned long i = 0; i < iters; i++)
+        op(dst, src, size);
+    hrtime_t t1 = c->get_ns();
+
+    hrtime_t per_op = (t1 - t0) / iters;
+    unsigned long mbps = ((size * iters) * NS_PER_SEC / (t1 - t0 ?: 1)) >> 20;
+    printk("%s: %zu bytes - %lu ns per op, %lu MiB/s\n", name, size, per_op, mbps);
+}
+
+static void memcpy_perf_memcpy(void *dst, void *src, size_t size)
+{
+    memcpy(dst, src, size);
+}
+
+static void memcpy_perf_memset(void *dst, void *src, size_t size)
+{
+    memset(dst, 0xaa, size);
+}
+
+static void memcpy_perf_copy_to_user(void *dst, void *src, size_t size)
+{
+    copy_to_user(dst, src, size);
+}
+
+static void memcpy_perf_copy_from_user(void *dst, void *src, size_t size)
+{
+    copy_from_user(dst, src, size);
+}
+
+void memcpy_perf(void)
+{
+    static const size_t sizes[] = {16, 64, 128, 256, 512, 1024, 4096, 65536, 1024 * 1024,
+                                   MEMCPY_PERF_BUF_SIZE};
+    void *src = vmalloc(vm_size_to_pages(MEMCPY_PERF_BUF_SIZE), VM_TYPE_REGULAR,
+                        VM_READ | VM_WRITE, GFP_KERNEL);
+    void *dst = vmalloc(vm_size_to_pages(MEMCPY_PERF_BUF_SIZE), VM_TYPE_REGULAR,
+                        VM_READ | VM_WRITE, GFP_KERNEL);
+    assert(src != nullptr && dst != nullptr);
+
+    memset(src, 0x55, MEMCPY_PERF_BUF_SIZE);
+    memset(dst, 0, MEMCPY_PERF_BUF_SIZE);
+
+    for (size_t size : sizes)
+    {
+        memcpy_perf_run("memcpy", dst, src, size, memcpy_perf_memcpy);
+        memcpy_perf_run("memset", dst, src, size, memcpy_perf_memset);
+        memcpy_perf_run("copy_to_user", dst, src, size, memcpy_perf_copy_to_user);
+        memcpy_perf_run("copy_from_user", dst, src, size, memcpy_perf_copy_from_user);
+    }
+
+    vfree(src);
+    vfree(dst);
+}
+
+#endif
+
+#ifdef CONFIG_KTEST_VMALLOC_STRESS
+
+#include <onyx/clock.h>
+#include <onyx/random.h>
+#include <onyx/vm.h>
+
+/* Hammers vmalloc/vfree from every CPU, mixing small (vmap block) allocations, stacks and larger
+ * (tree) allocations, and checks nobody sees anyone else's memory. */
+#define VMALLOC_STRESS_ITERS 100000
+#define VMALLOC_STRESS_SLOTS 64
+
+static unsigned long vmalloc_stress_done;
+
+static void vmalloc_stress_thread(void *arg)
+{
+    void *ptrs[VMALLOC_STRESS_SLOTS] = {};
+    size_t sizes[VMALLOC_STRESS_SLOTS];
+    unsigned long tag = (unsigned long) arg;
+
+    for (unsigned long i = 0; i < VMALLOC_STRESS_ITERS; i++)
+    {
+        unsigned int slot = get_random_int() % VMALLOC_STRESS_SLOTS;
+        if (ptrs[slot])
+        {
+            unsigned long *p = (unsigned long *) ptrs[slot];
+            for (size_t j = 0; j < sizes[slot]; j++)
+                assert(p[j * (PAGE_SIZE / sizeof(unsigned long))] == (tag ^ slot));
+            vfree(ptrs[slot]);
+            ptrs[slot] = nullptr;
+            continue;
+        }
+
+        unsigned int r = get_random_int();
+        size_t pages = r % 8 == 0 ? 17 + r % 48 : 1 + r % 8;
+        int type = r % 3 == 0 ? VM_TYPE_STACK : VM_TYPE_REGULAR;
+        unsigned long *p = (unsigned long *) vmalloc(pages, type, VM_READ | VM_WRITE, GFP_KERNEL);
+        assert(p != nullptr);
+        for (size_t j = 0; j < pages; j++)
+            p[j * (PAGE_SIZE / sizeof(unsigned long))] = tag ^ slot;
+        ptrs[slot] = p;
+        sizes[slot] = pages;
+    }
+
+    for (unsigned int i = 0; i < VMALLOC_STRESS_SLOTS; i++)
+    {
+        if (ptrs[i])
+            vfree(ptrs[i]);
+    }
+
+    __atomic_add_fetch(&vmalloc_stress_done, 1, __ATOMIC_RELEASE);
+}
+
+void vmalloc_stress(void)
+{
+    struct clocksource *c = get_main_clock();
+    unsigned int nr_cpus = get_nr_cpus();
+
+    hrtime_t t0 = c->get_ns();
+    for (unsigned int i = 0; i < nr_cpus; i++)
+    {
+        struct thread *t =
+            sched_create_thread(vmalloc_stress_thread, THREAD_KERNEL, (void *) ((i + 1UL) << 32));
+        assert(t != nullptr);
+        sched_start_thread(t);
+    }
+
+    while (__atomic_load_n(&vmalloc_stress_done, __ATOMIC_ACQUIRE) != nr_cpus)
+        sched_sleep_ms(10);
+    hrtime_t t1 = c->get_ns();
+
+    printk("vmalloc stress: %u threads x %u iterations in %lu ms\n", nr_cpus,
+           VMALLOC_STRESS_ITERS, (t1 - t0) / NS_PER_MS);
+}
+
+#endif
+
 static void (*tests[])(void) = {
 #ifdef CONFIG_KTEST_PAGE_ALLOC
     test_page_alloc,
@@ -134,6 +287,12 @@ static void (*tests[])(void) = {
 #ifdef CONFIG_KTEST_ALLOC_PAGE_PERF
     page_alloc_perf,
 #endif
+#ifdef CONFIG_KTEST_MEMCPY_PERF
+    memcpy_perf,
+#endif
+#ifdef CONFIG_KTEST_VMALLOC_STRESS
+    vmalloc_stress,
+#endif
 };
 
 void do_ktests_old(void)
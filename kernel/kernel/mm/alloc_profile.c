@@ -0,0 +1,319 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <stdlib.h>
+
+#include <onyx/cmdline.h>
+#include <onyx/cpu.h>
+#include <onyx/init.h>
+#include <onyx/mm/alloc_profile.h>
+#include <onyx/mm/slab.h>
+#include <onyx/page.h>
+#include <onyx/percpu.h>
+#include <onyx/proc.h>
+#include <onyx/seq_file.h>
+#include <onyx/spinlock.h>
+#include <onyx/vfs.h>
+
+#include <platform/irq.h>
+
+#define ALLOC_PROF_SITE_BITS 11
+#define ALLOC_PROF_NR_SITES  (1U << ALLOC_PROF_SITE_BITS)
+/* Allocations from sites that didn't fit in the table (or whose probe sequence was too long) */
+#define ALLOC_TAG_OVERFLOW   1
+#define ALLOC_TAG_FIRST      2
+/* Sites we look at before giving up, keeps lookups bounded once the table fills up */
+#define ALLOC_PROF_MAX_PROBE 32
+
+struct alloc_site
+{
+    /* 0 if the slot is free. Written last, with release semantics. */
+    unsigned long ip;
+    unsigned int type;
+};
+
+struct alloc_prof_counters
+{
+    /* Per-cpu bytes and objects can go negative (allocated on one CPU, freed on another) */
+    long bytes;
+    long objects;
+    unsigned long calls;
+};
+
+static struct alloc_site alloc_sites[ALLOC_PROF_NR_SITES];
+static struct spinlock alloc_sites_lock;
+static PER_CPU_VAR(struct alloc_prof_counters alloc_prof_counters[ALLOC_PROF_NR_SITES]);
+static bool alloc_prof_enabled;
+static bool alloc_prof_disabled_param;
+
+static const char *alloc_prof_type_names[ALLOC_PROF_NR_TYPES] = {
+    [ALLOC_PROF_PAGES] = "pages",
+    [ALLOC_PROF_SLAB] = "slab",
+    [ALLOC_PROF_KMALLOC] = "kmalloc",
+    [ALLOC_PROF_VMALLOC] = "vmalloc",
+};
+
+static int noallocprof_param(const char *s)
+{
+    alloc_prof_disabled_param = true;
+    return 1;
+}
+kernel_param("noallocprof", noallocprof_param);
+
+static inline unsigned int alloc_site_hash(unsigned long ip, unsigned int type)
+{
+    return ((ip ^ type) * 0x9e3779b97f4a7c15UL) >> (64 - ALLOC_PROF_SITE_BITS);
+}
+
+static inline unsigned int alloc_site_slot(unsigned int hash, unsigned int i)
+{
+    /* Probe [ALLOC_TAG_FIRST, ALLOC_PROF_NR_SITES) */
+    return ALLOC_TAG_FIRST + (hash + i) % (ALLOC_PROF_NR_SITES - ALLOC_TAG_FIRST);
+}
+
+static alloc_tag_t alloc_site_insert(unsigned long ip, unsigned int type)
+{
+    unsigned int hash = alloc_site_hash(ip, type);
+    alloc_tag_t tag = ALLOC_TAG_OVERFLOW;
+    unsigned long flags;
+
+    flags = spin_lock_irqsave(&alloc_sites_lock);
+    /* Someone might've inserted it while we weren't looking, so look again */
+    for (unsigned int i = 0; i < ALLOC_PROF_MAX_PROBE; i++)
+    {
+        unsigned int slot = alloc_site_slot(hash, i);
+        struct alloc_site *site = &alloc_sites[slot];
+
+        if (site->ip == ip && site->type == type)
+        {
+            tag = slot;
+            break;
+        }
+
+        if (!site->ip)
+        {
+            site->type = type;
+            __atomic_store_n(&site->ip, ip, __ATOMIC_RELEASE);
+            tag = slot;
+            break;
+        }
+    }
+
+    spin_unlock_irqrestore(&alloc_sites_lock, flags);
+    return tag;
+}
+
+static alloc_tag_t alloc_site_lookup(unsigned long ip, unsigned int type)
+{
+    unsigned int hash = alloc_site_hash(ip, type);
+
+    /* Sites are never removed, so the first free slot ends the probe sequence */
+    for (unsigned int i = 0; i < ALLOC_PROF_MAX_PROBE; i++)
+    {
+        unsigned int slot = alloc_site_slot(hash, i);
+        struct alloc_site *site = &alloc_sites[slot];
+        unsigned long site_ip = __atomic_load_n(&site->ip, __ATOMIC_ACQUIRE);
+
+        if (site_ip == ip && site->type == type)
+            return slot;
+        if (!site_ip)
+            return alloc_site_insert(ip, type);
+    }
+
+    return ALLOC_TAG_OVERFLOW;
+}
+
+static inline void alloc_prof_add(alloc_tag_t tag, long bytes, long objects, unsigned long calls)
+{
+    /* Allocations happen in irq context too, don't race with them */
+    unsigned long flags = irq_save_and_disable();
+    struct alloc_prof_counters *c = get_per_cpu_ptr(alloc_prof_counters[tag]);
+    c->bytes += bytes;
+    c->objects += objects;
+    c->calls += calls;
+    irq_restore(flags);
+}
+
+alloc_tag_t alloc_prof_account(unsigned int type, unsigned long ip, size_t bytes,
+                               unsigned long objects)
+{
+    alloc_tag_t tag;
+
+    if (unlikely(!READ_ONCE(alloc_prof_enabled)))
+        return ALLOC_TAG_NONE;
+
+    tag = alloc_site_lookup(ip, type);
+    alloc_prof_add(tag, bytes, objects, 1);
+    return tag;
+}
+
+void alloc_prof_unaccount(alloc_tag_t tag, size_t bytes, unsigned long objects)
+{
+    if (tag == ALLOC_TAG_NONE)
+        return;
+    alloc_prof_add(tag, -(long) bytes, -(long) objects, 0);
+}
+
+static void alloc_prof_init(void)
+{
+    spinlock_init(&alloc_sites_lock);
+    if (!alloc_prof_disabled_param)
+        WRITE_ONCE(alloc_prof_enabled, true);
+}
+
+INIT_LEVEL_EARLY_CORE_KERNEL_ENTRY(alloc_prof_init);
+
+struct alloc_prof_entry
+{
+    unsigned long ip;
+    unsigned int type;
+    long bytes;
+    long objects;
+    unsigned long calls;
+};
+
+struct alloc_prof_snapshot
+{
+    unsigned int nr;
+    struct alloc_prof_entry entries[ALLOC_PROF_NR_SITES];
+};
+
+static void alloc_prof_sum(struct alloc_prof_entry *entry, alloc_tag_t tag)
+{
+    entry->bytes = entry->objects = entry->calls = 0;
+    for (unsigned int cpu = 0; cpu < get_nr_cpus(); cpu++)
+    {
+        struct alloc_prof_counters *c = other_cpu_get_ptr(alloc_prof_counters[tag], cpu);
+        entry->bytes += READ_ONCE(c->bytes);
+        entry->objects += READ_ONCE(c->objects);
+        entry->calls += READ_ONCE(c->calls);
+    }
+}
+
+static int alloc_prof_entry_cmp(const void *a, const void *b)
+{
+    const struct alloc_prof_entry *e0 = a;
+    const struct alloc_prof_entry *e1 = b;
+
+    /* Biggest users first */
+    if (e0->bytes != e1->bytes)
+        return e0->bytes < e1->bytes ? 1 : -1;
+    if (e0->calls != e1->calls)
+        return e0->calls < e1->calls ? 1 : -1;
+    return 0;
+}
+
+static void alloc_prof_take_snapshot(struct alloc_prof_snapshot *snap)
+{
+    snap->nr = 0;
+    for (alloc_tag_t tag = ALLOC_TAG_OVERFLOW; tag < ALLOC_PROF_NR_SITES; tag++)
+    {
+        struct alloc_prof_entry *entry = &snap->entries[snap->nr];
+        unsigned long ip = __atomic_load_n(&alloc_sites[tag].ip, __ATOMIC_ACQUIRE);
+
+        if (!ip && tag != ALLOC_TAG_OVERFLOW)
+            continue;
+
+        alloc_prof_sum(entry, tag);
+        if (!entry->calls)
+            continue;
+        entry->ip = ip;
+        entry->type = alloc_sites[tag].type;
+        snap->nr++;
+    }
+
+    qsort(snap->entries, snap->nr, sizeof(struct alloc_prof_entry), alloc_prof_entry_cmp);
+}
+
+static void *allocinfo_start(struct seq_file *m, off_t *pos)
+{
+    struct alloc_prof_snapshot *snap = m->private;
+    if (*pos == 0)
+        return SEQ_START_TOKEN;
+    return *pos <= snap->nr ? &snap->entries[*pos - 1] : NULL;
+}
+
+static void *allocinfo_next(struct seq_file *m, void *v, off_t *pos)
+{
+    struct alloc_prof_snapshot *snap = m->private;
+    (*pos)++;
+    return *pos <= snap->nr ? &snap->entries[*pos - 1] : NULL;
+}
+
+static void allocinfo_stop(struct seq_file *m, void *v)
+{
+}
+
+static int allocinfo_show(struct seq_file *m, void *v)
+{
+    struct alloc_prof_entry *entry = v;
+
+    if (v == SEQ_START_TOKEN)
+    {
+        seq_puts(m, "allocinfo - version: 1.0\n");
+        seq_puts(m, "#      <bytes>    <objects>      <calls> <type>   <call site>\n");
+        return 0;
+    }
+
+    seq_printf(m, "%14ld %12ld %12lu ", entry->bytes, entry->objects, entry->calls);
+    /* The overflow bucket mixes every kind of allocation */
+    if (entry->ip)
+        seq_printf(m, "%-8s %pS\n", alloc_prof_type_names[entry->type], (void *) entry->ip);
+    else
+        seq_puts(m, "-        <other>\n");
+    return 0;
+}
+
+static const struct seq_operations allocinfo_seq_ops = {
+    .start = allocinfo_start,
+    .next = allocinfo_next,
+    .show = allocinfo_show,
+    .stop = allocinfo_stop,
+};
+
+static int allocinfo_open(struct file *filp)
+{
+    struct alloc_prof_snapshot *snap;
+    struct seq_file *m;
+    int err;
+
+    snap = kvmalloc(sizeof(*snap), GFP_KERNEL);
+    if (!snap)
+        return -ENOMEM;
+
+    err = seq_open(filp, &allocinfo_seq_ops);
+    if (err)
+    {
+        kvfree(snap);
+        return err;
+    }
+
+    /* Take the snapshot once, so the table stays sorted (and consistent) across reads */
+    alloc_prof_take_snapshot(snap);
+    m = filp->private_data;
+    m->private = snap;
+    return 0;
+}
+
+static void allocinfo_release(struct file *filp)
+{
+    struct seq_file *m = filp->private_data;
+    kvfree(m->private);
+    seq_release(filp);
+}
+
+static const struct proc_file_ops allocinfo_ops = {
+    .open = allocinfo_open,
+    .release = allocinfo_release,
+    .read_iter = seq_read_iter,
+};
+
+static __init void alloc_prof_init_procfs(void)
+{
+    procfs_add_entry("allocinfo", S_IFREG | 0400, NULL, &allocinfo_ops);
+}
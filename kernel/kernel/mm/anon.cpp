@@ -43,7 +43,7 @@ int vm_anon_fault(struct vm_pf_context *ctx)
             return -ENOMEM;
 
         /* Allocate a brand-new, zero-filled page */
-        page = alloc_page(GFP_KERNEL);
+        page = alloc_page_vma(GFP_KERNEL, vma, ctx->vpage);
         if (!page)
             goto enomem;
         page_set_anon(page);
@@ -57,6 +57,14 @@ int vm_anon_fault(struct vm_pf_context *ctx)
         goto enomem;
 
     ptep = ptep_get_locked(vma->vm_mm, ctx->vpage, &lock);
+    if (!ptep)
+    {
+        /* Raced with a THP fault, retry */
+        if (info->write)
+            page_unref(page);
+        return 0;
+    }
+
     if (ptep->pte != ctx->oldpte.pte)
         goto out;
 
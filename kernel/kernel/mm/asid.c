@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <onyx/atomic.h>
+#include <onyx/compiler.h>
+#include <onyx/mm/asid.h>
+#include <onyx/percpu.h>
+#include <onyx/smp.h>
+
+struct asid_slot
+{
+    unsigned long ctx_id;
+    /* Generation this CPU's TLB entries for ctx_id are up to date with */
+    unsigned long tlb_gen;
+};
+
+struct asid_state
+{
+    /* Slot currently loaded, ASID_NR_SLOTS for the kernel */
+    unsigned int loaded;
+    unsigned int next;
+    /* Running a kernel thread on top of the loaded mm */
+    bool lazy;
+    struct asid_slot slots[ASID_NR_SLOTS];
+};
+
+static PER_CPU_VAR(struct asid_state asid_state) = {.loaded = ASID_NR_SLOTS};
+
+/* Without hardware ASIDs, we keep a single slot (on ASID 0). This still saves us flushes on
+ * architectures that don't flush the TLB when switching page tables. */
+static unsigned int nr_slots = 1;
+static bool has_asids;
+static unsigned long next_ctx_id = 1;
+
+void asid_init(unsigned int nr_asids)
+{
+    has_asids = nr_asids > 0;
+    nr_slots = nr_asids > ASID_NR_SLOTS ? ASID_NR_SLOTS : nr_asids;
+    if (!nr_slots)
+        nr_slots = 1;
+}
+
+void mm_tlb_ctx_init(struct mm_tlb_ctx *ctx)
+{
+    ctx->ctx_id = __atomic_fetch_add(&next_ctx_id, 1, __ATOMIC_RELAXED);
+    ctx->tlb_gen = 0;
+}
+
+static inline unsigned int slot_to_asid(unsigned int slot)
+{
+    return has_asids ? slot + 1 : 0;
+}
+
+unsigned int asid_switch(struct mm_tlb_ctx *ctx, bool *flush)
+{
+    struct asid_state *state = get_per_cpu_ptr(asid_state);
+    unsigned long gen;
+    unsigned int i;
+
+    if (!ctx->ctx_id)
+    {
+        /* Kernel address space */
+        state->loaded = ASID_NR_SLOTS;
+        *flush = false;
+        return 0;
+    }
+
+    /* Pairs with mm_tlb_gen_bump. Our caller already made us visible in the active_mask, so
+     * either we see the new generation here, or the shootdown will IPI us. */
+    gen = __atomic_load_n(&ctx->tlb_gen, __ATOMIC_ACQUIRE);
+
+    for (i = 0; i < nr_slots; i++)
+    {
+        struct asid_slot *slot = &state->slots[i];
+        if (slot->ctx_id != ctx->ctx_id)
+            continue;
+        *flush = slot->tlb_gen < gen;
+        slot->tlb_gen = gen;
+        state->loaded = i;
+        return slot_to_asid(i);
+    }
+
+    /* Not cached, recycle the next slot. Whatever the ASID had in the TLB is stale. */
+    i = state->next;
+    state->next = (i + 1) % nr_slots;
+    state->slots[i].ctx_id = ctx->ctx_id;
+    state->slots[i].tlb_gen = gen;
+    state->loaded = i;
+    *flush = true;
+    return slot_to_asid(i);
+}
+
+enum asid_flush asid_flush_loaded(struct mm_tlb_ctx *ctx, unsigned long gen)
+{
+    struct asid_state *state = get_per_cpu_ptr(asid_state);
+    struct asid_slot *slot;
+    unsigned long local, mm_gen;
+
+    if (state->loaded >= nr_slots)
+        return ASID_FLUSH_NONE;
+    slot = &state->slots[state->loaded];
+    if (slot->ctx_id != ctx->ctx_id)
+        return ASID_FLUSH_NONE;
+
+    local = slot->tlb_gen;
+    mm_gen = __atomic_load_n(&ctx->tlb_gen, __ATOMIC_ACQUIRE);
+    if (local >= gen)
+    {
+        /* A full flush already covered this one */
+        return ASID_FLUSH_NONE;
+    }
+
+    if (gen == local + 1 && gen == mm_gen)
+    {
+        /* We're exactly one generation behind, just flush the range */
+        slot->tlb_gen = gen;
+        return ASID_FLUSH_RANGE;
+    }
+
+    /* We missed (or will get, out of order) other flushes. Catch up with everything at once. */
+    slot->tlb_gen = mm_gen;
+    return ASID_FLUSH_ALL;
+}
+
+unsigned int asid_current(void)
+{
+    struct asid_state *state = get_per_cpu_ptr(asid_state);
+    if (state->loaded >= nr_slots)
+        return 0;
+    return slot_to_asid(state->loaded);
+}
+
+void asid_enter_lazy(void)
+{
+    WRITE_ONCE(get_per_cpu_ptr(asid_state)->lazy, true);
+}
+
+void asid_leave_lazy(void)
+{
+    WRITE_ONCE(get_per_cpu_ptr(asid_state)->lazy, false);
+}
+
+bool asid_cpu_is_lazy(unsigned int cpu)
+{
+    return READ_ONCE(get_per_cpu_ptr_any(asid_state, cpu)->lazy);
+}
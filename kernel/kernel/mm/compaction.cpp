@@ -0,0 +1,557 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <onyx/bootmem.h>
+#include <onyx/clock.h>
+#include <onyx/init.h>
+#include <onyx/mm/compaction.h>
+#include <onyx/mm/migrate.h>
+#include <onyx/mm/page_lru.h>
+#include <onyx/mm/page_node.h>
+#include <onyx/mm/page_zone.h>
+#include <onyx/mutex.h>
+#include <onyx/page.h>
+#include <onyx/scheduler.h>
+#include <onyx/sysfs.h>
+#include <onyx/user.h>
+#include <onyx/wait_queue.h>
+
+#include <onyx/utility.hpp>
+
+/* We compact pageblocks of the PMD size, which is what most high-order users want */
+#define COMPACT_BLOCK_ORDER 9
+#define COMPACT_BLOCK_PAGES (1UL << COMPACT_BLOCK_ORDER)
+#define COMPACT_BATCH       32
+#define COMPACT_MAX_RANGES  32
+/* kcompactd checks for fragmentation this often */
+#define COMPACT_PROACTIVE_INTERVAL_MS 500
+/* A zone that didn't get any better is left alone for this many proactive rounds */
+#define COMPACT_PROACTIVE_BACKOFF     32
+
+/* Physical memory ranges (in pfns) that have struct pages */
+static struct compact_range
+{
+    unsigned long start;
+    unsigned long end;
+} compact_ranges[COMPACT_MAX_RANGES];
+static unsigned int nr_compact_ranges;
+
+static DECLARE_MUTEX(compact_lock);
+static bool compaction_ready;
+static unsigned int compaction_proactiveness = 20;
+
+static struct kcompactd_data
+{
+    struct wait_queue wq;
+    thread_t *thread;
+    /* Largest order someone woke us up for, or 0 */
+    unsigned int wake_order;
+    unsigned int backoff[MAX_NUMNODES][NR_ZONES];
+} kcompactd;
+
+static struct compact_stats
+{
+    unsigned long stall;
+    unsigned long success;
+    unsigned long fail;
+    unsigned long migrate_scanned;
+    unsigned long free_scanned;
+    unsigned long isolated;
+    unsigned long migrated;
+    unsigned long migrate_failed;
+    unsigned long kcompactd_wake;
+    unsigned long proactive;
+} compact_stats;
+
+struct compact_control
+{
+    struct page_zone *zone;
+    /* Target order (and the allocation's gfp flags), or -1 for "as much as possible" */
+    int order;
+    unsigned long gfp;
+    bool proactive;
+    unsigned long migrate_pfn;
+    /* Exclusive end of the range the free scanner has yet to look at */
+    unsigned long free_pfn;
+    struct list_head migratepages;
+    unsigned long nr_migratepages;
+    struct list_head freepages;
+    unsigned long nr_freepages;
+};
+
+static inline struct page *compact_pfn_to_page(unsigned long pfn)
+{
+    return phys_to_page(pfn_to_paddr(pfn));
+}
+
+/**
+ * @brief Call c(start, end) for every part of [start, end) that has struct pages and belongs to
+ * the zone. Iteration stops if c returns false.
+ */
+template <typename Callable>
+static bool compact_for_each_range(struct page_zone *zone, unsigned long start, unsigned long end,
+                                   Callable c)
+{
+    unsigned long zstart = zone->start >> PAGE_SHIFT;
+    unsigned long zend = (zone->end >> PAGE_SHIFT) + 1;
+
+    for (unsigned int i = 0; i < nr_compact_ranges; i++)
+    {
+        unsigned long s = cul::max(cul::max(start, compact_ranges[i].start), zstart);
+        unsigned long e = cul::min(cul::min(end, compact_ranges[i].end), zend);
+        if (s >= e)
+            continue;
+
+        /* Ranges may cross node boundaries. The buddy allocator never merges pages across nodes,
+         * so a chunk this small that doesn't start and end in our node isn't ours. */
+        if (!numa_single_node() && (phys_to_nid(pfn_to_paddr(s)) != zone->node ||
+                                    phys_to_nid(pfn_to_paddr(e - 1)) != zone->node))
+            continue;
+
+        if (!c(s, e))
+            return false;
+    }
+
+    return true;
+}
+
+static bool compact_zone_span(struct page_zone *zone, unsigned long *start, unsigned long *end)
+{
+    unsigned long zstart = zone->start >> PAGE_SHIFT;
+    unsigned long zend = (zone->end >> PAGE_SHIFT) + 1;
+
+    *start = ULONG_MAX;
+    *end = 0;
+    for (unsigned int i = 0; i < nr_compact_ranges; i++)
+    {
+        unsigned long s = cul::max(compact_ranges[i].start, zstart);
+        unsigned long e = cul::min(compact_ranges[i].end, zend);
+        if (s >= e)
+            continue;
+        *start = cul::min(*start, s);
+        *end = cul::max(*end, e);
+    }
+
+    return *start < *end;
+}
+
+/**
+ * @brief Fragmentation score of a zone, from 0 to 100
+ * This is the percentage of free memory that is not in pageblock-sized (or larger) free blocks.
+ */
+static unsigned int compact_fragmentation_score(struct page_zone *zone)
+{
+    unsigned long free = zone->total_pages - READ_ONCE(zone->used_pages);
+    unsigned long large;
+
+    /* A handful of free pages are always fragmented, that's fine */
+    if ((long) free < (long) (2 * COMPACT_BLOCK_PAGES))
+        return 0;
+
+    large = page_zone_free_pages_order(zone, COMPACT_BLOCK_ORDER);
+    if (large >= free)
+        return 0;
+    return 100 - (large * 100) / free;
+}
+
+static unsigned int compact_score_low(void)
+{
+    unsigned int proactiveness = READ_ONCE(compaction_proactiveness);
+    return proactiveness > 95 ? 5 : 100 - proactiveness;
+}
+
+static unsigned int compact_score_high(void)
+{
+    return cul::min(compact_score_low() + 10, 100U);
+}
+
+static bool compact_finished(struct compact_control *cc)
+{
+    if (cc->proactive)
+        return compact_fragmentation_score(cc->zone) <= compact_score_low();
+    if (cc->order >= 0)
+        return page_zone_may_alloc(cc->zone, cc->gfp, cc->order);
+    return false;
+}
+
+/**
+ * @brief Isolate a batch of LRU pages to migrate, going up from migrate_pfn
+ */
+static void isolate_migratepages(struct compact_control *cc)
+{
+    unsigned long end = cul::min(cc->free_pfn, ALIGN_TO(cc->migrate_pfn + 1, COMPACT_BLOCK_PAGES));
+    unsigned long scanned = 0;
+
+    compact_for_each_range(cc->zone, cc->migrate_pfn, end, [&](unsigned long s, unsigned long e) {
+        for (unsigned long pfn = s; pfn < e; pfn++)
+        {
+            struct page *page = compact_pfn_to_page(pfn);
+            unsigned long flags = READ_ONCE(page->flags);
+
+            cc->migrate_pfn = pfn + 1;
+            scanned++;
+
+            if (flags == PAGE_BUDDY)
+            {
+                /* Racy, but we only use it as a hint to skip the free block */
+                unsigned long order = READ_ONCE(page->priv);
+                if (order < COMPACT_BLOCK_ORDER)
+                    pfn += (1UL << order) - 1;
+                continue;
+            }
+
+            if (!(flags & PAGE_FLAG_LRU) || flags & (PAGE_FLAG_HEAD | PAGE_FLAG_TAIL))
+                continue;
+
+            if (!page_isolate_lru(page))
+                continue;
+
+            /* It may have become a THP in the meanwhile */
+            if (page_compound(page))
+            {
+                page_putback_lru(page);
+                page_unref(page);
+                continue;
+            }
+
+            list_add_tail(&page->lru_node, &cc->migratepages);
+            cc->nr_migratepages++;
+            if (cc->nr_migratepages == COMPACT_BATCH)
+                return false;
+        }
+
+        return true;
+    });
+
+    if (cc->nr_migratepages < COMPACT_BATCH)
+        cc->migrate_pfn = end;
+
+    compact_stats.migrate_scanned += scanned;
+    compact_stats.isolated += cc->nr_migratepages;
+}
+
+/**
+ * @brief Isolate free pages to migrate to, going down from free_pfn
+ */
+static void isolate_freepages(struct compact_control *cc)
+{
+    while (cc->nr_freepages < cc->nr_migratepages)
+    {
+        unsigned long start = ALIGN_TO(cc->migrate_pfn, COMPACT_BLOCK_PAGES);
+        unsigned long want = cc->nr_migratepages - cc->nr_freepages;
+        unsigned long got = 0;
+
+        /* Never isolate from the block the migrate scanner is in */
+        start = cul::max(start, (cc->free_pfn - 1) & ~(COMPACT_BLOCK_PAGES - 1));
+        if (cc->free_pfn == 0 || start >= cc->free_pfn)
+            break;
+
+        compact_for_each_range(cc->zone, start, cc->free_pfn,
+                               [&](unsigned long s, unsigned long e) {
+                                   got += page_zone_isolate_free(cc->zone, s, e,
+                                                                 COMPACT_BLOCK_ORDER,
+                                                                 &cc->freepages, want - got);
+                                   compact_stats.free_scanned += e - s;
+                                   return got < want;
+                               });
+
+        cc->nr_freepages += got;
+        /* Keep going in this block next time, if it may have more */
+        if (got < want)
+            cc->free_pfn = start;
+    }
+}
+
+static struct page *compact_get_new(struct page *page, void *ctx)
+{
+    struct compact_control *cc = (struct compact_control *) ctx;
+    struct page *newpage;
+
+    if (list_is_empty(&cc->freepages))
+        return NULL;
+
+    newpage = container_of(list_first_element(&cc->freepages), struct page, lru_node);
+    list_remove(&newpage->lru_node);
+    cc->nr_freepages--;
+    return newpage;
+}
+
+static void compact_put_new(struct page *page, void *ctx)
+{
+    struct compact_control *cc = (struct compact_control *) ctx;
+    list_add(&page->lru_node, &cc->freepages);
+    cc->nr_freepages++;
+}
+
+static void compact_release_freepages(struct compact_control *cc)
+{
+    list_for_every_safe (&cc->freepages)
+    {
+        struct page *page = container_of(l, struct page, lru_node);
+        list_remove(&page->lru_node);
+        free_page(page);
+    }
+
+    cc->nr_freepages = 0;
+}
+
+/**
+ * @brief Compact a zone
+ * compact_lock must be held.
+ *
+ * @param cc Compaction control, with zone, order, gfp and proactive filled in
+ * @return True if the goal was reached
+ */
+static bool compact_zone(struct compact_control *cc)
+{
+    struct page_zone *zone = cc->zone;
+    unsigned long start, end;
+    bool done = false;
+
+    if (!compact_zone_span(zone, &start, &end))
+        return false;
+
+    if (compact_finished(cc))
+        return true;
+
+    cc->migrate_pfn = start;
+    cc->free_pfn = end;
+    INIT_LIST_HEAD(&cc->migratepages);
+    INIT_LIST_HEAD(&cc->freepages);
+    cc->nr_migratepages = cc->nr_freepages = 0;
+
+    while (cc->migrate_pfn < cc->free_pfn)
+    {
+        isolate_migratepages(cc);
+        if (!cc->nr_migratepages)
+            continue;
+
+        isolate_freepages(cc);
+
+        unsigned long migrated = migrate_pages(&cc->migratepages, compact_get_new,
+                                               compact_put_new, cc);
+        compact_stats.migrated += migrated;
+        compact_stats.migrate_failed += cc->nr_migratepages - migrated;
+        putback_lru_pages(&cc->migratepages);
+        cc->nr_migratepages = 0;
+
+        /* The old pages went to our pcpu cache. Give them back to the buddy allocator, so they
+         * can merge. */
+        page_zone_drain_pcpu(zone);
+
+        done = compact_finished(cc);
+        if (done || (!cc->nr_freepages && cc->free_pfn <= cc->migrate_pfn))
+            break;
+        sched_yield();
+    }
+
+    putback_lru_pages(&cc->migratepages);
+    compact_release_freepages(cc);
+    page_zone_drain_pcpu(zone);
+    return done || compact_finished(cc);
+}
+
+bool compact_for_order(unsigned int order, unsigned long gfp, int nid, nodemask_t allowed)
+{
+    struct page_node *node = &page_nodes[nid];
+    bool success = false;
+
+    if (!READ_ONCE(compaction_ready) || order >= PAGEALLOC_NR_ORDERS)
+        return false;
+
+    mutex_lock(&compact_lock);
+    compact_stats.stall++;
+    /* Free pages sitting in pcpu caches can't merge */
+    page_drain_pcpu();
+
+    for (unsigned int i = 0; i < node->nr_fallback && !success; i++)
+    {
+        int fnid = node->fallback[i];
+        if (gfp & __GFP_THISNODE ? fnid != nid : !(allowed & NODE_MASK(fnid)))
+            continue;
+
+        for (int zone = gfp & PAGE_ALLOC_4GB_LIMIT ? ZONE_DMA32 : ZONE_NORMAL; zone >= 0; zone--)
+        {
+            struct compact_control cc;
+            cc.zone = &page_nodes[fnid].zones[zone];
+            cc.order = order;
+            cc.gfp = gfp;
+            cc.proactive = false;
+            if (cc.zone->total_pages && compact_zone(&cc))
+            {
+                success = true;
+                break;
+            }
+        }
+    }
+
+    if (success)
+        compact_stats.success++;
+    else
+        compact_stats.fail++;
+    mutex_unlock(&compact_lock);
+    return success;
+}
+
+static void compact_all_zones(int order, bool proactive)
+{
+    int nid;
+
+    page_drain_pcpu();
+    for_each_online_node(nid)
+    {
+        page_nodes[nid].for_every_zone([&](struct page_zone *zone) -> bool {
+            struct compact_control cc;
+            unsigned int *backoff = &kcompactd.backoff[nid][zone - page_nodes[nid].zones];
+
+            if (!zone->total_pages)
+                return true;
+
+            cc.zone = zone;
+            cc.order = order;
+            cc.gfp = 0;
+            cc.proactive = proactive;
+            if (proactive)
+            {
+                unsigned int score = compact_fragmentation_score(zone);
+                if (*backoff)
+                {
+                    (*backoff)--;
+                    return true;
+                }
+
+                if (score <= compact_score_high())
+                    return true;
+
+                compact_stats.proactive++;
+                /* No progress? Then this zone's memory isn't movable, don't bother for a while */
+                if (!compact_zone(&cc) && compact_fragmentation_score(zone) >= score)
+                    *backoff = COMPACT_PROACTIVE_BACKOFF;
+                return true;
+            }
+
+            compact_zone(&cc);
+            return true;
+        });
+    }
+}
+
+void compact_memory(void)
+{
+    if (!READ_ONCE(compaction_ready))
+        return;
+
+    mutex_lock(&compact_lock);
+    compact_all_zones(-1, false);
+    mutex_unlock(&compact_lock);
+}
+
+void kcompactd_wake(unsigned int order)
+{
+    if (!READ_ONCE(compaction_ready) || order == 0 || order >= PAGEALLOC_NR_ORDERS)
+        return;
+
+    if (READ_ONCE(kcompactd.wake_order) < order)
+    {
+        WRITE_ONCE(kcompactd.wake_order, order);
+        wait_queue_wake_all(&kcompactd.wq);
+    }
+}
+
+static void kcompactd_thread(void *arg)
+{
+    for (;;)
+    {
+        unsigned int order;
+        bool proactive;
+
+        wait_for_event_timeout(&kcompactd.wq, READ_ONCE(kcompactd.wake_order) != 0,
+                               COMPACT_PROACTIVE_INTERVAL_MS * NS_PER_MS);
+
+        order = __atomic_exchange_n(&kcompactd.wake_order, 0, __ATOMIC_RELAXED);
+        proactive = order == 0;
+        if (proactive && !READ_ONCE(compaction_proactiveness))
+            continue;
+
+        mutex_lock(&compact_lock);
+        if (!proactive)
+            compact_stats.kcompactd_wake++;
+        compact_all_zones(proactive ? -1 : (int) order, proactive);
+        mutex_unlock(&compact_lock);
+    }
+}
+
+static void compaction_init(void)
+{
+    /* Runs after page_deferred_init, so every struct page in these ranges is initialized */
+    for_every_phys_region([](unsigned long start, size_t size) {
+        if (nr_compact_ranges == COMPACT_MAX_RANGES)
+            return;
+        compact_ranges[nr_compact_ranges++] = {start >> PAGE_SHIFT, (start + size) >> PAGE_SHIFT};
+    });
+
+    init_wait_queue_head(&kcompactd.wq);
+    kcompactd.thread = sched_create_thread(kcompactd_thread, THREAD_KERNEL, nullptr);
+    CHECK(kcompactd.thread != nullptr);
+    kcompactd.thread->priority = SCHED_PRIO_LOW;
+    sched_start_thread(kcompactd.thread);
+
+    WRITE_ONCE(compaction_ready, true);
+}
+
+INIT_LEVEL_CORE_AFTER_SCHED_ENTRY(compaction_init);
+
+ssize_t compact_memory_sysfs_write(void *buffer, size_t size, off_t off)
+{
+    unsigned long val;
+    int err = sysfs_parse_ulong(buffer, size, &val);
+    if (err < 0)
+        return err;
+
+    compact_memory();
+    return size;
+}
+
+ssize_t compact_stat_sysfs_read(void *buffer, size_t size, off_t off)
+{
+    char buf[384];
+    size_t len = snprintf(
+        buf, sizeof(buf),
+        "compact_stall %lu\ncompact_success %lu\ncompact_fail %lu\ncompact_migrate_scanned %lu\n"
+        "compact_free_scanned %lu\ncompact_isolated %lu\ncompact_migrated %lu\n"
+        "compact_migrate_failed %lu\ncompact_daemon_wake %lu\ncompact_proactive %lu\n",
+        READ_ONCE(compact_stats.stall), READ_ONCE(compact_stats.success),
+        READ_ONCE(compact_stats.fail), READ_ONCE(compact_stats.migrate_scanned),
+        READ_ONCE(compact_stats.free_scanned), READ_ONCE(compact_stats.isolated),
+        READ_ONCE(compact_stats.migrated), READ_ONCE(compact_stats.migrate_failed),
+        READ_ONCE(compact_stats.kcompactd_wake), READ_ONCE(compact_stats.proactive));
+    return sysfs_read_buf(buf, len, buffer, size, off);
+}
+
+ssize_t compaction_proactiveness_sysfs_read(void *buffer, size_t size, off_t off)
+{
+    char buf[32];
+    size_t len = snprintf(buf, sizeof(buf), "%u\n", READ_ONCE(compaction_proactiveness));
+    return sysfs_read_buf(buf, len, buffer, size, off);
+}
+
+ssize_t compaction_proactiveness_sysfs_write(void *buffer, size_t size, off_t off)
+{
+    unsigned long val;
+    int err = sysfs_parse_ulong(buffer, size, &val);
+    if (err < 0)
+        return err;
+    if (val > 100)
+        return -EINVAL;
+
+    WRITE_ONCE(compaction_proactiveness, (unsigned int) val);
+    return size;
+}
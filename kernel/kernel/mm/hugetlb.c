@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onyx/cmdline.h>
+#include <onyx/init.h>
+#include <onyx/list.h>
+#include <onyx/mm/hugetlb.h>
+#include <onyx/page.h>
+#include <onyx/pgtable.h>
+#include <onyx/spinlock.h>
+#include <onyx/sysfs.h>
+#include <onyx/user.h>
+#include <onyx/vm.h>
+#include <onyx/vm_fault.h>
+
+/* The pool is made out of compound page heads, linked through page_allocator_node */
+static struct spinlock hugetlb_lock;
+static struct list_head hugetlb_free_list = LIST_HEAD_INIT(hugetlb_free_list);
+static unsigned long nr_huge_pages;
+static unsigned long free_huge_pages;
+static unsigned long boot_huge_pages;
+
+const struct vm_operations hugetlb_vmops = {.fault = do_hugetlb_fault};
+
+static void hugetlb_enqueue(struct page *page)
+{
+    page->flags = PAGE_FLAG_HEAD | PAGE_FLAG_HUGETLB;
+    page->owner = NULL;
+    page->pageoff = 0;
+    spin_lock(&hugetlb_lock);
+    list_add_tail(&page->page_allocator_node.list_node, &hugetlb_free_list);
+    free_huge_pages++;
+    spin_unlock(&hugetlb_lock);
+}
+
+/**
+ * @brief Grow the pool by one huge page
+ *
+ * @return 0 on success, -ENOMEM
+ */
+static int hugetlb_grow_pool(void)
+{
+    /* Don't go into reclaim just to fill the pool, it's fine to come up short */
+    struct page *page =
+        alloc_pages(HUGETLB_ORDER, __GFP_COMP | __GFP_NOWARN | __GFP_NOWAIT | PAGE_ALLOC_NO_ZERO);
+    if (!page)
+        return -ENOMEM;
+
+    spin_lock(&hugetlb_lock);
+    nr_huge_pages++;
+    spin_unlock(&hugetlb_lock);
+    hugetlb_enqueue(page);
+    return 0;
+}
+
+/**
+ * @brief Shrink the pool by one (free) huge page
+ *
+ * @return 0 on success, -EBUSY if there are no free huge pages
+ */
+static int hugetlb_shrink_pool(void)
+{
+    struct page *page;
+
+    spin_lock(&hugetlb_lock);
+    if (list_is_empty(&hugetlb_free_list))
+    {
+        spin_unlock(&hugetlb_lock);
+        return -EBUSY;
+    }
+
+    page = container_of(list_first_element(&hugetlb_free_list), struct page,
+                        page_allocator_node.list_node);
+    list_remove(&page->page_allocator_node.list_node);
+    free_huge_pages--;
+    nr_huge_pages--;
+    spin_unlock(&hugetlb_lock);
+
+    /* Give it back to the page allocator */
+    page->flags &= ~PAGE_FLAG_HUGETLB;
+    page->ref = 1;
+    free_page(page);
+    return 0;
+}
+
+struct page *hugetlb_alloc_page(void)
+{
+    struct page *page = NULL;
+
+    spin_lock(&hugetlb_lock);
+    if (!list_is_empty(&hugetlb_free_list))
+    {
+        page = container_of(list_first_element(&hugetlb_free_list), struct page,
+                            page_allocator_node.list_node);
+        list_remove(&page->page_allocator_node.list_node);
+        free_huge_pages--;
+    }
+    spin_unlock(&hugetlb_lock);
+
+    if (!page)
+        return NULL;
+
+    page->ref = 1;
+    memset(PAGE_TO_VIRT(page), 0, HUGETLB_SIZE);
+    return page;
+}
+
+void hugetlb_free_page(struct page *page)
+{
+    DCHECK_PAGE(page->flags & PAGE_FLAG_HUGETLB, page);
+    DCHECK_PAGE(page_mapcount(page) == 0, page);
+    hugetlb_enqueue(page);
+}
+
+unsigned long hugetlb_nr_pages(void)
+{
+    return READ_ONCE(nr_huge_pages);
+}
+
+unsigned long hugetlb_nr_free_pages(void)
+{
+    return READ_ONCE(free_huge_pages);
+}
+
+static void hugetlb_resize_pool(unsigned long nr)
+{
+    while (READ_ONCE(nr_huge_pages) < nr)
+    {
+        if (hugetlb_grow_pool() < 0)
+            break;
+    }
+
+    while (READ_ONCE(nr_huge_pages) > nr)
+    {
+        if (hugetlb_shrink_pool() < 0)
+            break;
+    }
+}
+
+static int hugepages_param(const char *s)
+{
+    char *end;
+    unsigned long nr = strtoul(s, &end, 0);
+    if (*end != '\0')
+        return 0;
+    boot_huge_pages = nr;
+    return 1;
+}
+kernel_param("hugepages", hugepages_param);
+
+static void hugetlb_init(void)
+{
+    spinlock_init(&hugetlb_lock);
+    if (!boot_huge_pages)
+        return;
+
+    /* Reserve the pool as early as possible, before memory gets fragmented */
+    hugetlb_resize_pool(boot_huge_pages);
+    if (nr_huge_pages < boot_huge_pages)
+        pr_warn("hugetlb: Only allocated %lu out of %lu huge pages\n", nr_huge_pages,
+                boot_huge_pages);
+}
+
+INIT_LEVEL_VERY_EARLY_CORE_ENTRY(hugetlb_init);
+
+ssize_t hugetlb_nr_sysfs_read(void *buffer, size_t size, off_t off)
+{
+    return sysfs_read_ulong(READ_ONCE(nr_huge_pages), buffer, size, off);
+}
+
+ssize_t hugetlb_free_sysfs_read(void *buffer, size_t size, off_t off)
+{
+    return sysfs_read_ulong(READ_ONCE(free_huge_pages), buffer, size, off);
+}
+
+ssize_t hugetlb_nr_sysfs_write(void *buffer, size_t size, off_t off)
+{
+    unsigned long nr;
+    int err = sysfs_parse_ulong(buffer, size, &nr);
+    if (err < 0)
+        return err;
+
+    /* Pages that are in use can't be taken out of the pool, so this may come up short. Userspace
+     * is expected to read nr_hugepages back. */
+    hugetlb_resize_pool(nr);
+    return size;
+}
+
+bool hugetlb_range_ok(struct vm_area_struct *vma, unsigned long start, unsigned long end)
+{
+    if (start < vma->vm_start)
+        start = vma->vm_start;
+    if (end > vma->vm_end)
+        end = vma->vm_end;
+    return !(start & (HUGETLB_SIZE - 1)) && !(end & (HUGETLB_SIZE - 1));
+}
@@ -8,6 +8,7 @@
 
 #include <stdbool.h>
 
+#include <onyx/mm/hugetlb.h>
 #include <onyx/page.h>
 #include <onyx/pgtable.h>
 #include <onyx/types.h>
@@ -23,6 +24,10 @@ static bool madvise_needs_write(int advice)
     {
         case MADV_DONTDUMP:
         case MADV_DODUMP:
+        case MADV_WIPEONFORK:
+        case MADV_KEEPONFORK:
+        case MADV_HUGEPAGE:
+        case MADV_NOHUGEPAGE:
             return true;
         default:
             return false;
@@ -36,6 +41,10 @@ static bool madvise_valid_advice(int advice)
         case MADV_DONTNEED:
         case MADV_DONTDUMP:
         case MADV_DODUMP:
+        case MADV_WIPEONFORK:
+        case MADV_KEEPONFORK:
+        case MADV_HUGEPAGE:
+        case MADV_NOHUGEPAGE:
             return true;
     }
 
@@ -46,6 +55,11 @@ static int do_madvise_vma(struct vma_iterator *vmi, struct vm_area_struct *vma,
                           unsigned long end, int advice)
 {
     int new_vm_flags = vma->vm_flags;
+
+    /* hugetlb mappings can't be zapped or split in the middle of a huge page */
+    if (vma_is_hugetlb(vma) && !hugetlb_range_ok(vma, start, end))
+        return -EINVAL;
+
     switch (advice)
     {
         case MADV_DONTNEED:
@@ -56,6 +70,24 @@ static int do_madvise_vma(struct vma_iterator *vmi, struct vm_area_struct *vma,
         case MADV_DODUMP:
             new_vm_flags &= ~VM_DONTDUMP;
             break;
+        case MADV_WIPEONFORK:
+            /* Only makes sense for private anonymous memory */
+            if (vma_shared(vma) || vma->vm_file)
+                return -EINVAL;
+            new_vm_flags |= VM_WIPEONFORK;
+            break;
+        case MADV_KEEPONFORK:
+            new_vm_flags &= ~VM_WIPEONFORK;
+            break;
+        case MADV_HUGEPAGE:
+            /* Note: Existing huge pages are left alone by MADV_NOHUGEPAGE */
+            new_vm_flags &= ~VM_NOHUGEPAGE;
+            new_vm_flags |= VM_HUGEPAGE;
+            break;
+        case MADV_NOHUGEPAGE:
+            new_vm_flags &= ~VM_HUGEPAGE;
+            new_vm_flags |= VM_NOHUGEPAGE;
+            break;
         default:
             UNREACHABLE();
     }
@@ -114,14 +146,14 @@ int sys_madvise(void *addr, size_t len, int advice)
         return -EINVAL;
 
     if (madvise_needs_write(advice))
-        rw_lock_write(&mm->vm_lock);
+        mmap_write_lock(mm);
     else
         rw_lock_read(&mm->vm_lock);
 
     ret = do_madvise_walk(mm, start, len, advice);
 
     if (madvise_needs_write(advice))
-        rw_unlock_write(&mm->vm_lock);
+        mmap_write_unlock(mm);
     else
         rw_unlock_read(&mm->vm_lock);
     return ret;
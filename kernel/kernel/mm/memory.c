@@ -5,8 +5,12 @@
  *
  * SPDX-License-Identifier: GPL-2.0-only
  */
+#include <onyx/err.h>
 #include <onyx/filemap.h>
+#include <onyx/mm/hugetlb.h>
 #include <onyx/mm/page_lru.h>
+#include <onyx/mm/thp.h>
+#include <onyx/mm/tlb.h>
 #include <onyx/pgtable.h>
 #include <onyx/process.h>
 #include <onyx/rmap.h>
@@ -198,12 +202,11 @@ oom:
     return NULL;
 }
 
-static pte_t *pte_get_from_addr(struct mm_address_space *mm, unsigned long addr)
+static pmd_t *pmd_get_from_addr(struct mm_address_space *mm, unsigned long addr)
 {
     pgd_t *pgd;
     p4d_t *p4d;
     pud_t *pud;
-    pmd_t *pmd;
     pgd = pgd_offset(mm, addr);
     if (pgd_none(*pgd))
         return NULL;
@@ -217,20 +220,49 @@ static pte_t *pte_get_from_addr(struct mm_address_space *mm, unsigned long addr)
         return NULL;
     DCHECK(!pud_huge(*pud));
 
-    pmd = pmd_offset(pud, addr);
-    if (pmd_none(*pmd))
+    return pmd_offset(pud, addr);
+}
+
+static pte_t *pte_get_from_addr(struct mm_address_space *mm, unsigned long addr)
+{
+    pmd_t *pmd = pmd_get_from_addr(mm, addr);
+    /* Huge pmds have no PTEs. Callers that care look at the pmd themselves. */
+    if (!pmd || pmd_none(*pmd) || pmd_huge(*pmd))
         return NULL;
-    DCHECK(!pmd_huge(*pmd));
 
     return pte_offset(pmd, addr);
 }
 
+static unsigned int pmd_get_clear_referenced(pmd_t *pmd, struct page *page, unsigned long addr)
+{
+    pmd_t old = *pmd;
+    pmd_t new_pmd;
+    do
+    {
+        if (!pmd_accessed(old))
+            return 0;
+        if (pmd_addr(old) + (addr & (PMD_SIZE - 1)) != (unsigned long) page_to_phys(page))
+            return 0;
+        new_pmd = pmd_mkyoung(old);
+    } while (!pmd_cmpxchg(pmd, &old, new_pmd));
+
+    return 1;
+}
+
 unsigned int mmu_get_clear_referenced(struct mm_address_space *mm, void *addr, struct page *page)
 {
     int ret = 0;
     pte_t *ptep;
     spin_lock(&mm->page_table_lock);
 
+    pmd_t *pmd = pmd_get_from_addr(mm, (unsigned long) addr);
+    if (pmd && pmd_huge(*pmd))
+    {
+        /* Note: The accessed bit is shared by the whole THP */
+        ret = pmd_get_clear_referenced(pmd, page, (unsigned long) addr & -PAGE_SIZE);
+        goto out;
+    }
+
     ptep = pte_get_from_addr(mm, (unsigned long) addr);
     if (!ptep)
         goto out;
@@ -343,19 +375,19 @@ unsigned long __get_mapping_info(void *addr, struct mm_address_space *mm)
     if (!p4d_present(*p4d))
         return PAGE_NOT_PRESENT;
     if (p4d_huge(*p4d))
-        return p4d_to_mapping_info(*p4d);
+        return p4d_to_mapping_info(*p4d) + (virt & (P4D_SIZE - 1) & -PAGE_SIZE);
 
     pud = pud_offset(p4d, virt);
     if (!pud_present(*pud))
         return PAGE_NOT_PRESENT;
     if (pud_huge(*pud))
-        return pud_to_mapping_info(*pud);
+        return pud_to_mapping_info(*pud) + (virt & (PUD_SIZE - 1) & -PAGE_SIZE);
 
     pmd = pmd_offset(pud, virt);
     if (!pmd_present(*pmd))
         return PAGE_NOT_PRESENT;
     if (pmd_huge(*pmd))
-        return pmd_to_mapping_info(*pmd);
+        return pmd_to_mapping_info(*pmd) + (virt & (PMD_SIZE - 1) & -PAGE_SIZE);
 
     pte = pte_offset(pmd, virt);
     if (!pte_present(*pte))
@@ -364,27 +396,9 @@ unsigned long __get_mapping_info(void *addr, struct mm_address_space *mm)
     return pte_to_mapping_info(*pte);
 }
 
-#define MAX_PENDING_PAGEN 32
-
-struct tlbi_tracker
-{
-    /* Somewhat primitive, but will do for the time being... */
-    unsigned long start, end;
-    struct page *pending_pages[MAX_PENDING_PAGEN];
-    unsigned int used_pending_pages;
-    bool active;
-};
-
-static void tlbi_tracker_init(struct tlbi_tracker *tlbi)
-{
-    tlbi->start = tlbi->end = 0;
-    tlbi->active = false;
-    tlbi->used_pending_pages = 0;
-}
-
 struct unmap_info
 {
-    struct tlbi_tracker tlbi;
+    struct tlb_batch *tlb;
     struct mm_address_space *mm;
     struct vm_area_struct *vma;
     int kernel : 1, full : 1, freepgtables : 1;
@@ -401,73 +415,10 @@ enum unmap_result
     UNMAP_DONT_FREE = (1 << 1)
 };
 
-static void tlbi_end_batch(struct tlbi_tracker *tlbi)
-{
-    vm_invalidate_range(tlbi->start, (tlbi->end - tlbi->start) >> PAGE_SHIFT);
-    for (unsigned int i = 0; i < tlbi->used_pending_pages; i++)
-        page_unref(tlbi->pending_pages[i]);
-    tlbi->active = false;
-    tlbi->used_pending_pages = 0;
-}
-
-static void tlbi_add_defer_free(struct tlbi_tracker *tlbi, struct page *page)
-{
-    DCHECK(tlbi->used_pending_pages < MAX_PENDING_PAGEN);
-    tlbi->pending_pages[tlbi->used_pending_pages++] = page;
-}
-
-static void tlbi_remove_page(struct tlbi_tracker *tlbi, unsigned long addr, struct page *page)
-{
-retry:
-    if (!tlbi->active)
-    {
-        tlbi->start = addr;
-        tlbi->end = addr + PAGE_SIZE;
-        tlbi->active = true;
-        goto out;
-    }
-
-    /* TODO: Measure this heuristic. We need a solid, realistic benchmark that allows us to measure
-     * the cost of flushing too much TLB */
-    /* If the new page is too far away (say, a PMD of distance), flush this batch and start anew. If
-     * we have a page to queue, and the defer queue is empty, flush the batch and start anew. */
-    if ((long) (tlbi->start - addr) >= (long) PMD_SIZE ||
-        (long) (addr - tlbi->end) >= (long) PMD_SIZE ||
-        (page && tlbi->used_pending_pages == MAX_PENDING_PAGEN))
-    {
-        tlbi_end_batch(tlbi);
-        goto retry;
-    }
-
-    if (addr < tlbi->start)
-        tlbi->start = addr;
-    else if (addr >= tlbi->end)
-        tlbi->end = addr + PAGE_SIZE;
-
-out:
-    if (page)
-        tlbi_add_defer_free(tlbi, page);
-}
-
-static bool tlbi_defer_page_queue_full(struct tlbi_tracker *tlbi)
-{
-    return tlbi->used_pending_pages == MAX_PENDING_PAGEN;
-}
-
-static bool tlbi_covers(struct tlbi_tracker *tlbi, unsigned long start, unsigned long end)
-{
-    return start <= tlbi->end && tlbi->start <= end;
-}
-
-static bool tlbi_active(struct tlbi_tracker *tlbi)
-{
-    return tlbi->active;
-}
-
 /* x86 implementation of PTE removal. Intel SDM says (4.10.4.2 Recommended Invalidation) we must
  * shootdown all mappings with translations under this paging structure. However, if no paging
  * structure existed, we must call invlpg at least once. */
-static void x86_tlbi_remove_entry(struct mm_address_space *mm, struct tlbi_tracker *tlbi,
+static void x86_tlbi_remove_entry(struct mm_address_space *mm, struct tlb_batch *tlb,
                                   unsigned long pgtbl_phys, unsigned long addr, unsigned long end,
                                   unsigned long entry_size)
 {
@@ -476,47 +427,141 @@ static void x86_tlbi_remove_entry(struct mm_address_space *mm, struct tlbi_track
     /* We'll pick the last address in the page table, because we're likely to go forward ("upwards")
      * when doing TLB operations. But only if we don't yet cover this PMD in the existing
      * invalidation. */
-    if (!tlbi_covers(tlbi, addr & -entry_size, end) || tlbi_defer_page_queue_full(tlbi))
-        tlbi_remove_page(tlbi, end - PAGE_SIZE, page);
-    else
-        tlbi_add_defer_free(tlbi, page);
+    if (!tlb_batch_covers(tlb, addr & -entry_size, end))
+        tlb_batch_add_range(tlb, end - PAGE_SIZE, end);
+    tlb_batch_free_table(tlb, page);
     decrement_vm_stat(mm, page_tables_size, PAGE_SIZE);
 }
 
-static void tlbi_remove_pte(struct mm_address_space *mm, struct tlbi_tracker *tlbi, pte_t *pte,
+static void tlbi_remove_pte(struct mm_address_space *mm, struct tlb_batch *tlb, pte_t *pte,
                             unsigned long addr)
 {
-    x86_tlbi_remove_entry(mm, tlbi, (unsigned long) pte - PHYS_BASE, addr, pmd_addr_end(addr),
+    x86_tlbi_remove_entry(mm, tlb, (unsigned long) pte - PHYS_BASE, addr, pmd_addr_end(addr),
                           PMD_SIZE);
 }
 
-static void tlbi_remove_pmd(struct mm_address_space *mm, struct tlbi_tracker *tlbi, pmd_t *pmd,
+static void tlbi_remove_pmd(struct mm_address_space *mm, struct tlb_batch *tlb, pmd_t *pmd,
                             unsigned long addr)
 {
-    x86_tlbi_remove_entry(mm, tlbi, (unsigned long) pmd - PHYS_BASE, addr, pud_addr_end(addr),
+    x86_tlbi_remove_entry(mm, tlb, (unsigned long) pmd - PHYS_BASE, addr, pud_addr_end(addr),
                           PUD_SIZE);
 }
 
-static void tlbi_remove_pud(struct mm_address_space *mm, struct tlbi_tracker *tlbi, pud_t *pud,
+static void tlbi_remove_pud(struct mm_address_space *mm, struct tlb_batch *tlb, pud_t *pud,
                             unsigned long addr)
 {
-    x86_tlbi_remove_entry(mm, tlbi, (unsigned long) pud - PHYS_BASE, addr, p4d_addr_end(addr),
+    x86_tlbi_remove_entry(mm, tlb, (unsigned long) pud - PHYS_BASE, addr, p4d_addr_end(addr),
                           P4D_SIZE);
 }
 
-static void tlbi_remove_p4d(struct mm_address_space *mm, struct tlbi_tracker *tlbi, p4d_t *p4d,
+static void tlbi_remove_p4d(struct mm_address_space *mm, struct tlb_batch *tlb, p4d_t *p4d,
                             unsigned long addr)
 {
-    x86_tlbi_remove_entry(mm, tlbi, (unsigned long) p4d - PHYS_BASE, addr, pgd_addr_end(addr),
+    x86_tlbi_remove_entry(mm, tlb, (unsigned long) p4d - PHYS_BASE, addr, pgd_addr_end(addr),
                           PGD_SIZE);
 }
 
-static void tlbi_update_page_prots(struct tlbi_tracker *tlbi, unsigned long addr, pte_t old,
+static void tlbi_update_page_prots(struct tlb_batch *tlb, unsigned long addr, pte_t old,
                                    pte_t new)
 {
     /* TODO: We can take the spurious faults on permission upgrade, *if* the PFN is the same (if
      * not, we risk exposing stale data to userspace). */
-    tlbi_remove_page(tlbi, addr, NULL);
+    tlb_batch_remove_page(tlb, addr, NULL);
+}
+
+/**
+ * @brief Split a huge pmd into a PTE table
+ * Mapcounts and refs stay the same, as each subpage goes from being mapped by the pmd to being
+ * mapped by a PTE. Must be called with the page table lock held.
+ *
+ * @param mm Address space
+ * @param pmd Huge pmd
+ * @param addr Address inside the huge page
+ * @return 0 on success, -ENOMEM
+ */
+static int __split_huge_pmd(struct mm_address_space *mm, pmd_t *pmd, unsigned long addr)
+{
+    unsigned long haddr = addr & -PMD_SIZE;
+    pmd_t old = *pmd;
+    unsigned long phys = pmd_addr(old);
+    pgprot_t prot = pmd_huge_pgprot(old);
+    pte_t *ptes;
+    pte_t *pte;
+
+    /* hugetlb pages are mapcounted as a whole, and can never be mapped by PTEs */
+    if (page_compound(phys_to_page(phys)))
+        return -EINVAL;
+
+    ptes = __pte_alloc(mm);
+    if (!ptes)
+        return -ENOMEM;
+
+    pte = (pte_t *) __tovirt(ptes);
+    for (unsigned long i = 0; i < PTRS_PER_PTE; i++)
+        set_pte(pte + i, pte_mkpte(phys + (i << PAGE_SHIFT), prot));
+
+    /* Architectural note: x86 gets unhappy if the TLB can end up with both 2MiB and 4KiB
+     * translations for the same address (SDM 4.10.2.3), so we clear the pmd and flush before
+     * installing the page table. Anyone looking at the pmd meanwhile must hold the page table lock,
+     * and one invalidation anywhere inside the huge page gets rid of the whole translation. */
+    set_pmd(pmd, __pmd(0));
+    mmu_invalidate_range(haddr, 1, mm);
+    set_pmd(pmd, pmd_mkpmd((unsigned long) ptes, __pgprot(USER_PGTBL)));
+    return 0;
+}
+
+static bool huge_pmd_covered(unsigned long start, unsigned long end)
+{
+    return !(start & (PMD_SIZE - 1)) && end - start == PMD_SIZE;
+}
+
+/* A huge pmd maps every subpage of a THP, but a hugetlb (compound) page as a single unit */
+static void huge_pmd_add_mapcount(struct page *page)
+{
+    if (page_compound(page))
+    {
+        page_add_mapcount(page);
+        return;
+    }
+
+    for (unsigned long i = 0; i < THP_NR_PAGES; i++)
+        page_add_mapcount(page + i);
+}
+
+static void huge_pmd_sub_mapcount(struct page *page)
+{
+    if (page_compound(page))
+    {
+        page_sub_mapcount(page);
+        return;
+    }
+
+    for (unsigned long i = 0; i < THP_NR_PAGES; i++)
+        page_sub_mapcount(page + i);
+}
+
+static void zap_huge_pmd(struct unmap_info *uinfo, pmd_t *pmd, unsigned long addr)
+{
+    struct page *page = phys_to_page(pmd_addr(*pmd));
+
+    set_pmd(pmd, __pmd(0));
+    decrement_vm_stat(uinfo->mm, resident_set_size, PMD_SIZE);
+
+    /* The batch can't defer the freeing of 512 pages, so flush now and drop the mapcounts
+     * afterwards. */
+    tlb_batch_remove_page(uinfo->tlb, addr, NULL);
+    tlb_batch_flush(uinfo->tlb);
+
+    huge_pmd_sub_mapcount(page);
+}
+
+static void zap_kernel_huge_pmd(struct unmap_info *uinfo, pmd_t *pmd, unsigned long addr)
+{
+    /* The pages belong to whoever mapped them (e.g vmalloc), we don't touch them */
+    set_pmd(pmd, __pmd(0));
+    decrement_vm_stat(uinfo->mm, resident_set_size, PMD_SIZE);
+    if (uinfo->tlb)
+        tlb_batch_add_range(uinfo->tlb, addr, addr + PMD_SIZE);
 }
 
 static enum unmap_result pte_unmap_range(struct unmap_info *uinfo, pte_t *pte, unsigned long start,
@@ -535,7 +580,15 @@ static enum unmap_result pte_unmap_range(struct unmap_info *uinfo, pte_t *pte, u
         if (!pte_present(old))
         {
             swp_entry_t entry = pte_to_swp_entry(old);
-            swap_put(entry);
+            if (swp_is_migration(entry))
+            {
+                /* Migration entries keep the page mapped (and resident), as far as accounting goes
+                 */
+                page_sub_mapcount(migration_entry_to_page(entry));
+                decrement_vm_stat(uinfo->mm, resident_set_size, PAGE_SIZE);
+            }
+            else
+                swap_put(entry);
         }
 
         if (!uinfo->kernel && !pte_special(old) && (pte_present(old) || pte_protnone(old)))
@@ -549,7 +602,8 @@ static enum unmap_result pte_unmap_range(struct unmap_info *uinfo, pte_t *pte, u
         if (pte_present(old) || pte_protnone(old))
             decrement_vm_stat(uinfo->mm, resident_set_size, PAGE_SIZE);
         set_pte(pte, __pte(0));
-        tlbi_remove_page(&uinfo->tlbi, start, page);
+        if (uinfo->tlb)
+            tlb_batch_remove_page(uinfo->tlb, start, page);
     }
 
     /* If we *know* the page table is clear, tell it to the caller so we skip expensive checks */
@@ -573,7 +627,7 @@ static int pmd_free_pte(struct unmap_info *uinfo, pmd_t *pmd, unsigned long addr
     }
 
     set_pmd(pmd, __pmd(0));
-    tlbi_remove_pte(uinfo->mm, &uinfo->tlbi, pte, addr);
+    tlbi_remove_pte(uinfo->mm, uinfo->tlb, pte, addr);
     return 1;
 }
 
@@ -591,7 +645,7 @@ static int pud_free_pmd(struct unmap_info *uinfo, pud_t *pud, unsigned long addr
     }
 
     set_pud(pud, __pud(0));
-    tlbi_remove_pmd(uinfo->mm, &uinfo->tlbi, pmd, addr);
+    tlbi_remove_pmd(uinfo->mm, uinfo->tlb, pmd, addr);
     return 1;
 }
 
@@ -609,7 +663,7 @@ static int p4d_free_pud(struct unmap_info *uinfo, p4d_t *p4d, unsigned long addr
     }
 
     set_p4d(p4d, __p4d(0));
-    tlbi_remove_pud(uinfo->mm, &uinfo->tlbi, pud, addr);
+    tlbi_remove_pud(uinfo->mm, uinfo->tlb, pud, addr);
     return 1;
 }
 
@@ -627,7 +681,7 @@ static int pgd_free_p4d(struct unmap_info *uinfo, pgd_t *pgd, unsigned long addr
     }
 
     set_pgd(pgd, __pgd(0));
-    tlbi_remove_p4d(uinfo->mm, &uinfo->tlbi, p4d, addr);
+    tlbi_remove_p4d(uinfo->mm, uinfo->tlb, p4d, addr);
     return 1;
 }
 
@@ -645,8 +699,32 @@ static enum unmap_result pmd_unmap_range(struct unmap_info *uinfo, pmd_t *pmd, u
             clear++;
             continue;
         }
-        /* TODO: Huge page unmapping and splitting not supported yet... */
-        DCHECK(!pmd_huge(*pmd));
+
+        if (pmd_huge(*pmd))
+        {
+            if (uinfo->kernel)
+            {
+                /* Huge vmalloc mappings. These are only ever unmapped whole. */
+                WARN_ON(!huge_pmd_covered(start, next_start));
+                zap_kernel_huge_pmd(uinfo, pmd, start & -PMD_SIZE);
+                clear++;
+                continue;
+            }
+
+            if (huge_pmd_covered(start, next_start))
+            {
+                zap_huge_pmd(uinfo, pmd, start);
+                clear++;
+                continue;
+            }
+
+            if (WARN_ON(__split_huge_pmd(uinfo->mm, pmd, start) < 0))
+            {
+                ret |= UNMAP_DONT_FREE;
+                continue;
+            }
+        }
+
         enum unmap_result res = pte_unmap_range(uinfo, pte_offset(pmd, start), start, next_start);
         if (uinfo->freepgtables)
         {
@@ -739,8 +817,19 @@ static void pgd_unmap_range(struct unmap_info *uinfo, pgd_t *pgd, unsigned long
     }
 }
 
-int vm_mmu_unmap(struct mm_address_space *mm, void *addr, size_t pages, struct vm_area_struct *vma)
+/**
+ * @brief Unmap a range, adding the TLB invalidations to a batch
+ *
+ * @param tlb TLB batch (for the address space being unmapped)
+ * @param addr Start of the range
+ * @param pages Number of pages
+ * @param vma VMA being unmapped, if any
+ * @return 0
+ */
+int vm_mmu_unmap_batch(struct tlb_batch *tlb, void *addr, size_t pages,
+                       struct vm_area_struct *vma)
 {
+    struct mm_address_space *mm = tlb->mm;
     unsigned long virt = (unsigned long) addr;
     unsigned long end = virt + (pages << PAGE_SHIFT);
     struct unmap_info unmap_info;
@@ -749,14 +838,120 @@ int vm_mmu_unmap(struct mm_address_space *mm, void *addr, size_t pages, struct v
     unmap_info.kernel = mm == &kernel_address_space;
     unmap_info.full = 0;
     unmap_info.freepgtables = 1;
-    tlbi_tracker_init(&unmap_info.tlbi);
+    unmap_info.tlb = tlb;
+
+    spin_lock(&mm->page_table_lock);
+    pgd_unmap_range(&unmap_info, pgd_offset(mm, virt), virt, end);
+    spin_unlock(&mm->page_table_lock);
+    return 0;
+}
+
+/**
+ * @brief Map PMD_SIZE worth of physically contiguous kernel memory with a huge page
+ *
+ * @param virt Virtual address (PMD aligned)
+ * @param phys Physical address (PMD aligned)
+ * @param prot Protection flags
+ * @return 0 on success, -ENOMEM if out of memory, -EEXIST if something is mapped there
+ */
+int vm_map_huge_pmd_kernel(unsigned long virt, unsigned long phys, int prot)
+{
+    struct mm_address_space *mm = &kernel_address_space;
+    struct page *table = NULL;
+    struct tlb_batch tlb;
+    pgd_t *pgd;
+    p4d_t *p4d;
+    pud_t *pud;
+    pmd_t *pmd;
+
+    DCHECK(!(virt & (PMD_SIZE - 1)) && !(phys & (PMD_SIZE - 1)));
+    spin_lock(&mm->page_table_lock);
+
+    pgd = pgd_offset(mm, virt);
+    p4d = p4d_get_or_alloc(pgd, virt, mm);
+    if (unlikely(!p4d))
+        goto oom;
+    pud = pud_get_or_alloc(p4d, virt, mm);
+    if (unlikely(!pud))
+        goto oom;
+    pmd = pmd_get_or_alloc(pud, virt, mm);
+    if (unlikely(!pmd))
+        goto oom;
+
+    if (!pmd_none(*pmd))
+    {
+        pte_t *pte = (pte_t *) __tovirt(pmd_addr(*pmd));
+        if (pmd_huge(*pmd))
+            goto exists;
+
+        /* Kernel unmaps don't always free page tables, so we might find an (hopefully empty)
+         * page table from an older mapping. */
+        for (int i = 0; i < PTRS_PER_PTE; i++)
+        {
+            if (!pte_none(pte[i]))
+                goto exists;
+        }
+
+        table = phys_to_page(pmd_addr(*pmd));
+        decrement_vm_stat(mm, page_tables_size, PAGE_SIZE);
+    }
+
+    set_pmd(pmd, pmd_mkhuge(phys, calc_pgprot(phys, prot)));
+    increment_vm_stat(mm, resident_set_size, PMD_SIZE);
+    spin_unlock(&mm->page_table_lock);
+
+    if (table)
+    {
+        /* Stale paging-structure caches may still point to the old page table */
+        tlb_batch_init(&tlb, mm);
+        tlb_batch_add_range(&tlb, virt, virt + PMD_SIZE);
+        tlb_batch_free_table(&tlb, table);
+        tlb_batch_finish(&tlb);
+    }
+
+    return 0;
+oom:
+    spin_unlock(&mm->page_table_lock);
+    return -ENOMEM;
+exists:
+    spin_unlock(&mm->page_table_lock);
+    return -EEXIST;
+}
+
+/**
+ * @brief Unmap a range of kernel memory without flushing the TLB
+ * Page tables are kept around, as stale paging-structure caches could still point to them. The
+ * caller must flush the range before the virtual addresses are reused.
+ *
+ * @param addr Start of the range
+ * @param pages Number of pages
+ * @return 0
+ */
+int vm_mmu_unmap_noflush(void *addr, size_t pages)
+{
+    struct mm_address_space *mm = &kernel_address_space;
+    unsigned long virt = (unsigned long) addr;
+    unsigned long end = virt + (pages << PAGE_SHIFT);
+    struct unmap_info unmap_info;
+    unmap_info.vma = NULL;
+    unmap_info.mm = mm;
+    unmap_info.kernel = 1;
+    unmap_info.full = 0;
+    unmap_info.freepgtables = 0;
+    unmap_info.tlb = NULL;
 
     spin_lock(&mm->page_table_lock);
     pgd_unmap_range(&unmap_info, pgd_offset(mm, virt), virt, end);
     spin_unlock(&mm->page_table_lock);
+    return 0;
+}
 
-    if (tlbi_active(&unmap_info.tlbi))
-        tlbi_end_batch(&unmap_info.tlbi);
+int vm_mmu_unmap(struct mm_address_space *mm, void *addr, size_t pages, struct vm_area_struct *vma)
+{
+    struct tlb_batch tlb;
+    tlb_batch_init(&tlb, mm);
+    vm_mmu_unmap_batch(&tlb, addr, pages, vma);
+    tlb_batch_finish(&tlb);
     return 0;
 }
 
@@ -764,19 +959,20 @@ int zap_page_range(unsigned long start, unsigned long end, struct vm_area_struct
 {
     struct mm_address_space *mm = vma->vm_mm;
     struct unmap_info unmap_info;
+    struct tlb_batch tlb;
+    tlb_batch_init(&tlb, mm);
     unmap_info.vma = vma;
     unmap_info.mm = mm;
     unmap_info.kernel = 0;
     unmap_info.full = 0;
     unmap_info.freepgtables = 0;
-    tlbi_tracker_init(&unmap_info.tlbi);
+    unmap_info.tlb = &tlb;
 
     spin_lock(&mm->page_table_lock);
     pgd_unmap_range(&unmap_info, pgd_offset(mm, start), start, end);
     spin_unlock(&mm->page_table_lock);
 
-    if (tlbi_active(&unmap_info.tlbi))
-        tlbi_end_batch(&unmap_info.tlbi);
+    tlb_batch_finish(&tlb);
     return 0;
 }
 
@@ -813,7 +1009,7 @@ bool __paging_change_perms(struct mm_address_space *mm, void *addr, int prot)
     return pte != NULL;
 }
 
-static void pte_protect_range(struct tlbi_tracker *tlbi, pte_t *pte, unsigned long start,
+static void pte_protect_range(struct tlb_batch *tlb, pte_t *pte, unsigned long start,
                               unsigned long end, int new_prots)
 {
     unsigned long next_start;
@@ -824,13 +1020,39 @@ static void pte_protect_range(struct tlbi_tracker *tlbi, pte_t *pte, unsigned lo
         if (pte_none(old))
             continue;
 
+        if (!pte_present(old))
+        {
+            /* Swap entries don't have permissions. Migration entries remember if the pte was
+             * writable, so downgrade them if needed. */
+            swp_entry_t entry = pte_to_swp_entry(old);
+            if (swp_migration_write(entry) && !(new_prots & VM_WRITE))
+            {
+                entry = make_migration_entry(migration_entry_to_page(entry), false);
+                set_pte(pte, __pte(entry.swp));
+            }
+
+            continue;
+        }
+
         pte_change_prot(pte, new_prots);
-        tlbi_update_page_prots(tlbi, start, old, *pte);
+        tlbi_update_page_prots(tlb, start, old, *pte);
     }
 }
 
-static void pmd_protect_range(struct tlbi_tracker *tlbi, pmd_t *pmd, unsigned long start,
-                              unsigned long end, int new_prots)
+static void huge_pmd_change_prot(pmd_t *pmdp, int vmflags)
+{
+    /* Note: Preserve the A and D bits */
+    pmd_t pmd = *pmdp;
+    pmd_t newpmd = pmd_mkhuge(pmd_addr(pmd), calc_pgprot(pmd_addr(pmd), vmflags));
+    if (pmd_accessed(pmd))
+        pmd_val(newpmd) |= _PAGE_ACCESSED;
+    if (pmd_dirty(pmd))
+        pmd_val(newpmd) |= _PAGE_DIRTY;
+    set_pmd(pmdp, newpmd);
+}
+
+static void pmd_protect_range(struct mm_address_space *mm, struct tlb_batch *tlb, pmd_t *pmd,
+                              unsigned long start, unsigned long end, int new_prots)
 {
     unsigned long next_start;
     for (; start < end; pmd++, start = next_start)
@@ -839,14 +1061,25 @@ static void pmd_protect_range(struct tlbi_tracker *tlbi, pmd_t *pmd, unsigned lo
         if (pmd_none(*pmd))
             continue;
 
-        /* TODO: Huge page splitting not supported yet... */
-        DCHECK(!pmd_huge(*pmd));
-        pte_protect_range(tlbi, pte_offset(pmd, start), start, next_start, new_prots);
+        if (pmd_huge(*pmd))
+        {
+            if (huge_pmd_covered(start, next_start))
+            {
+                huge_pmd_change_prot(pmd, new_prots);
+                tlb_batch_remove_page(tlb, start, NULL);
+                continue;
+            }
+
+            if (WARN_ON(__split_huge_pmd(mm, pmd, start) < 0))
+                continue;
+        }
+
+        pte_protect_range(tlb, pte_offset(pmd, start), start, next_start, new_prots);
     }
 }
 
-static void pud_protect_range(struct tlbi_tracker *tlbi, pud_t *pud, unsigned long start,
-                              unsigned long end, int new_prots)
+static void pud_protect_range(struct mm_address_space *mm, struct tlb_batch *tlb, pud_t *pud,
+                              unsigned long start, unsigned long end, int new_prots)
 {
     unsigned long next_start;
     for (; start < end; pud++, start = next_start)
@@ -856,12 +1089,12 @@ static void pud_protect_range(struct tlbi_tracker *tlbi, pud_t *pud, unsigned lo
             continue;
         /* TODO: Huge page splitting not supported yet... */
         DCHECK(!pud_huge(*pud));
-        pmd_protect_range(tlbi, pmd_offset(pud, start), start, next_start, new_prots);
+        pmd_protect_range(mm, tlb, pmd_offset(pud, start), start, next_start, new_prots);
     }
 }
 
-static void p4d_protect_range(struct tlbi_tracker *tlbi, p4d_t *p4d, unsigned long start,
-                              unsigned long end, int new_prots)
+static void p4d_protect_range(struct mm_address_space *mm, struct tlb_batch *tlb, p4d_t *p4d,
+                              unsigned long start, unsigned long end, int new_prots)
 {
     unsigned long next_start;
     for (; start < end; p4d++, start = next_start)
@@ -872,12 +1105,12 @@ static void p4d_protect_range(struct tlbi_tracker *tlbi, p4d_t *p4d, unsigned lo
 
         /* TODO: Huge page splitting not supported yet... */
         DCHECK(!p4d_huge(*p4d));
-        pud_protect_range(tlbi, pud_offset(p4d, start), start, next_start, new_prots);
+        pud_protect_range(mm, tlb, pud_offset(p4d, start), start, next_start, new_prots);
     }
 }
 
-static void pgd_protect_range(struct tlbi_tracker *tlbi, pgd_t *pgd, unsigned long start,
-                              unsigned long end, int new_prots)
+static void pgd_protect_range(struct mm_address_space *mm, struct tlb_batch *tlb, pgd_t *pgd,
+                              unsigned long start, unsigned long end, int new_prots)
 {
     unsigned long next_start;
     for (; start < end; pgd++, start = next_start)
@@ -885,27 +1118,41 @@ static void pgd_protect_range(struct tlbi_tracker *tlbi, pgd_t *pgd, unsigned lo
         next_start = min(pgd_addr_end(start), end);
         if (pgd_none(*pgd))
             continue;
-        p4d_protect_range(tlbi, p4d_offset(pgd, start), start, next_start, new_prots);
+        p4d_protect_range(mm, tlb, p4d_offset(pgd, start), start, next_start, new_prots);
     }
 }
 
-void vm_do_mmu_mprotect(struct mm_address_space *mm, void *address, size_t nr_pgs, int old_prots,
-                        int new_prots)
+/**
+ * @brief Change the protection of a range, adding the TLB invalidations to a batch
+ *
+ * @param tlb TLB batch (for the target address space)
+ * @param address Start of the range
+ * @param nr_pgs Number of pages
+ * @param old_prots Old VM_* protection flags
+ * @param new_prots New VM_* protection flags
+ */
+void vm_do_mmu_mprotect_batch(struct tlb_batch *tlb, void *address, size_t nr_pgs, int old_prots,
+                              int new_prots)
 {
+    struct mm_address_space *mm = tlb->mm;
     unsigned long start = (unsigned long) address;
     unsigned long end = start + (nr_pgs << PAGE_SHIFT);
-    struct tlbi_tracker tlbi;
-    tlbi_tracker_init(&tlbi);
 
     spin_lock(&mm->page_table_lock);
-    pgd_protect_range(&tlbi, pgd_offset(mm, start), start, end, new_prots);
+    pgd_protect_range(mm, tlb, pgd_offset(mm, start), start, end, new_prots);
     spin_unlock(&mm->page_table_lock);
+}
 
-    if (tlbi_active(&tlbi))
-        tlbi_end_batch(&tlbi);
+void vm_do_mmu_mprotect(struct mm_address_space *mm, void *address, size_t nr_pgs, int old_prots,
+                        int new_prots)
+{
+    struct tlb_batch tlb;
+    tlb_batch_init(&tlb, mm);
+    vm_do_mmu_mprotect_batch(&tlb, address, nr_pgs, old_prots, new_prots);
+    tlb_batch_finish(&tlb);
 }
 
-static int pte_fork_range(struct tlbi_tracker *tlbi, pte_t *pte, pte_t *old_pte,
+static int pte_fork_range(struct tlb_batch *tlb, pte_t *pte, pte_t *old_pte,
                           unsigned long start, unsigned long end, struct mm_address_space *mm,
                           struct vm_area_struct *old_vma)
 {
@@ -922,7 +1169,26 @@ static int pte_fork_range(struct tlbi_tracker *tlbi, pte_t *pte, pte_t *old_pte,
             continue;
         if (!pte_present(old))
         {
-            __swap_inc_map(pte_to_swp_entry(old));
+            swp_entry_t entry = pte_to_swp_entry(old);
+            if (swp_is_migration(entry))
+            {
+                struct page *page = migration_entry_to_page(entry);
+                /* Migration puts file pages back by walking the mapping's VMAs, in no particular
+                 * order, so it could miss our copy. Just let the child fault them back in. */
+                if (!page_flag_set(page, PAGE_FLAG_ANON))
+                    continue;
+
+                page_add_mapcount(page);
+                increment_vm_stat(mm, resident_set_size, PAGE_SIZE);
+                if (swp_migration_write(entry) && vma_private(old_vma))
+                {
+                    /* Both copies need to CoW once they're mapped again */
+                    old = __pte(make_migration_entry(page, false).swp);
+                    set_pte(old_pte, old);
+                }
+            }
+            else
+                __swap_inc_map(entry);
             set_pte(pte, old);
             continue;
         }
@@ -935,7 +1201,7 @@ static int pte_fork_range(struct tlbi_tracker *tlbi, pte_t *pte, pte_t *old_pte,
             /* We must CoW MAP_PRIVATE */
             set_pte(old_pte, pte_wrprotect(old));
             set_pte(pte, *old_pte);
-            tlbi_update_page_prots(tlbi, start, old, *pte);
+            tlbi_update_page_prots(tlb, start, old, *pte);
         }
         else
         {
@@ -949,7 +1215,53 @@ static int pte_fork_range(struct tlbi_tracker *tlbi, pte_t *pte, pte_t *old_pte,
     return 0;
 }
 
-static int pmd_fork_range(struct tlbi_tracker *tlbi, pmd_t *pmd, pmd_t *old_pmd,
+/**
+ * @brief Fork a huge pmd
+ *
+ * @return 0 if copied, 1 if the old pmd is no longer huge (and the PTEs should be copied instead),
+ * negative error codes
+ */
+static int huge_pmd_fork(struct tlb_batch *tlb, pmd_t *pmd, pmd_t *old_pmd, unsigned long start,
+                         unsigned long end, struct mm_address_space *mm,
+                         struct vm_area_struct *old_vma)
+{
+    struct mm_address_space *old_mm = old_vma->vm_mm;
+    int err = 0;
+    pmd_t old;
+
+    /* Take the old page table lock, as rmap may be trying to split it under us */
+    spin_lock(&old_mm->page_table_lock);
+    old = *old_pmd;
+    if (!pmd_huge(old))
+    {
+        err = 1;
+        goto out;
+    }
+
+    if (!huge_pmd_covered(start, end))
+    {
+        /* The huge page straddles VMAs (e.g after madvise or mprotect). Split it. */
+        err = __split_huge_pmd(old_mm, old_pmd, start) ?: 1;
+        goto out;
+    }
+
+    huge_pmd_add_mapcount(phys_to_page(pmd_addr(old)));
+
+    if (!pmd_protnone(old) && vma_private(old_vma))
+    {
+        /* We must CoW MAP_PRIVATE */
+        set_pmd(old_pmd, pmd_wrprotect(old));
+        tlb_batch_remove_page(tlb, start, NULL);
+    }
+
+    set_pmd(pmd, *old_pmd);
+    increment_vm_stat(mm, resident_set_size, PMD_SIZE);
+out:
+    spin_unlock(&old_mm->page_table_lock);
+    return err;
+}
+
+static int pmd_fork_range(struct tlb_batch *tlb, pmd_t *pmd, pmd_t *old_pmd,
                           unsigned long start, unsigned long end, struct mm_address_space *mm,
                           struct vm_area_struct *old_vma)
 {
@@ -959,14 +1271,22 @@ static int pmd_fork_range(struct tlbi_tracker *tlbi, pmd_t *pmd, pmd_t *old_pmd,
         next_start = min(pmd_addr_end(start), end);
         if (pmd_none(*old_pmd))
             continue;
+
+        if (pmd_huge(*old_pmd))
+        {
+            int err = huge_pmd_fork(tlb, pmd, old_pmd, start, next_start, mm, old_vma);
+            if (err < 0)
+                return err;
+            if (err == 0)
+                continue;
+        }
+
         pte_t *pte = pte_get_or_alloc(pmd, start, mm);
         if (!pte)
             return -ENOMEM;
 
-        /* TODO: Huge page splitting not supported yet... */
-        DCHECK(!pmd_huge(*pmd));
         int err =
-            pte_fork_range(tlbi, pte, pte_offset(old_pmd, start), start, next_start, mm, old_vma);
+            pte_fork_range(tlb, pte, pte_offset(old_pmd, start), start, next_start, mm, old_vma);
         if (err < 0)
             return err;
     }
@@ -974,7 +1294,7 @@ static int pmd_fork_range(struct tlbi_tracker *tlbi, pmd_t *pmd, pmd_t *old_pmd,
     return 0;
 }
 
-static int pud_fork_range(struct tlbi_tracker *tlbi, pud_t *pud, pud_t *old_pud,
+static int pud_fork_range(struct tlb_batch *tlb, pud_t *pud, pud_t *old_pud,
                           unsigned long start, unsigned long end, struct mm_address_space *mm,
                           struct vm_area_struct *old_vma)
 {
@@ -990,7 +1310,7 @@ static int pud_fork_range(struct tlbi_tracker *tlbi, pud_t *pud, pud_t *old_pud,
         /* TODO: Huge page splitting not supported yet... */
         DCHECK(!pud_huge(*pud));
         int err =
-            pmd_fork_range(tlbi, pmd, pmd_offset(old_pud, start), start, next_start, mm, old_vma);
+            pmd_fork_range(tlb, pmd, pmd_offset(old_pud, start), start, next_start, mm, old_vma);
         if (err < 0)
             return err;
     }
@@ -998,7 +1318,7 @@ static int pud_fork_range(struct tlbi_tracker *tlbi, pud_t *pud, pud_t *old_pud,
     return 0;
 }
 
-static int p4d_fork_range(struct tlbi_tracker *tlbi, p4d_t *p4d, p4d_t *old_p4d,
+static int p4d_fork_range(struct tlb_batch *tlb, p4d_t *p4d, p4d_t *old_p4d,
                           unsigned long start, unsigned long end, struct mm_address_space *mm,
                           struct vm_area_struct *old_vma)
 {
@@ -1015,7 +1335,7 @@ static int p4d_fork_range(struct tlbi_tracker *tlbi, p4d_t *p4d, p4d_t *old_p4d,
         /* TODO: Huge page splitting not supported yet... */
         DCHECK(!p4d_huge(*p4d));
         int err =
-            pud_fork_range(tlbi, pud, pud_offset(old_p4d, start), start, next_start, mm, old_vma);
+            pud_fork_range(tlb, pud, pud_offset(old_p4d, start), start, next_start, mm, old_vma);
         if (err < 0)
             return -ENOMEM;
     }
@@ -1023,7 +1343,7 @@ static int p4d_fork_range(struct tlbi_tracker *tlbi, p4d_t *p4d, p4d_t *old_p4d,
     return 0;
 }
 
-static int pgd_fork_range(struct tlbi_tracker *tlbi, pgd_t *pgd, pgd_t *old_pgd,
+static int pgd_fork_range(struct tlb_batch *tlb, pgd_t *pgd, pgd_t *old_pgd,
                           unsigned long start, unsigned long end, struct mm_address_space *mm,
                           struct vm_area_struct *old_vma)
 {
@@ -1038,7 +1358,7 @@ static int pgd_fork_range(struct tlbi_tracker *tlbi, pgd_t *pgd, pgd_t *old_pgd,
             return -ENOMEM;
 
         int err =
-            p4d_fork_range(tlbi, p4d, p4d_offset(old_pgd, start), start, next_start, mm, old_vma);
+            p4d_fork_range(tlb, p4d, p4d_offset(old_pgd, start), start, next_start, mm, old_vma);
         if (err < 0)
             return err;
     }
@@ -1058,30 +1378,50 @@ int mmu_fork_tables(struct vm_area_struct *old_vma, struct mm_address_space *mm)
     unsigned long start = old_vma->vm_start;
     unsigned long end = old_vma->vm_end;
     int err;
-    struct tlbi_tracker tlbi;
-    tlbi_tracker_init(&tlbi);
+    struct tlb_batch tlb;
+    /* The CoW write-protection happens in the old address space */
+    tlb_batch_init(&tlb, old_vma->vm_mm);
 
     /* Note: We can't take the page table spinlock here (hold time is too long, too many memory
      * allocations may happen). We'll rely on holding the mm lock exclusively. Page table lifetime
      * atm is a bit iffy, needs some solid rethinking. */
-    err = pgd_fork_range(&tlbi, pgd_offset(mm, start), pgd_offset(old_vma->vm_mm, start), start,
+    err = pgd_fork_range(&tlb, pgd_offset(mm, start), pgd_offset(old_vma->vm_mm, start), start,
                          end, mm, old_vma);
 
-    if (tlbi_active(&tlbi))
-        tlbi_end_batch(&tlbi);
+    tlb_batch_finish(&tlb);
     return err;
 }
 
-int try_to_unmap_one(struct page *page, struct vm_area_struct *vma,
-                     unsigned long addr) NO_THREAD_SAFETY_ANALYSIS
+/**
+ * @brief Unmap a page from a VMA
+ * The TLB invalidation is added to the batch, and the page must not be freed or written back until
+ * it is flushed.
+ *
+ * @param page Page
+ * @param vma VMA that maps the page
+ * @param addr Address of the page in the VMA
+ * @param tlb TLB batch (switched to the VMA's address space)
+ * @return 0
+ */
+int try_to_unmap_one(struct page *page, struct vm_area_struct *vma, unsigned long addr,
+                     struct tlb_batch *tlb) NO_THREAD_SAFETY_ANALYSIS
 {
     struct mm_address_space *mm = vma->vm_mm;
     pte_t *pte, oldpte;
-    struct tlbi_tracker tlbi;
-    tlbi_tracker_init(&tlbi);
 
+    tlb_batch_switch_mm(tlb, mm);
     spin_lock(&mm->page_table_lock);
 
+    pmd_t *pmd = pmd_get_from_addr(mm, addr);
+    if (pmd && pmd_huge(*pmd))
+    {
+        /* Split the THP's mapping so we can unmap (and reclaim) this page on its own */
+        if (pmd_addr(*pmd) + (addr & (PMD_SIZE - 1)) != (unsigned long) page_to_phys(page))
+            goto out;
+        if (__split_huge_pmd(mm, pmd, addr) < 0)
+            goto out;
+    }
+
     pte = pte_get_from_addr(vma->vm_mm, addr);
     if (!pte || (!pte_present(*pte) && !pte_protnone(*pte)))
         goto out;
@@ -1096,7 +1436,7 @@ int try_to_unmap_one(struct page *page, struct vm_area_struct *vma,
 
     DCHECK(!pte_special(oldpte));
     /* Ref the page. This makes sure it _doesnt_ go away after the sub_mapcount. We need this so the
-     * page isn't freed before the tlbi. */
+     * page isn't freed before the TLB flush. */
     page_ref(page);
     page_sub_mapcount(page);
 
@@ -1110,36 +1450,136 @@ int try_to_unmap_one(struct page *page, struct vm_area_struct *vma,
     }
     else
         set_pte(pte, __pte(0));
-    if (pte_present(oldpte) || pte_protnone(oldpte))
+    if (!pte_protnone(oldpte))
+        tlb_batch_remove_page(tlb, addr, page);
+    else
     {
-        if (!pte_protnone(oldpte))
-            tlbi_remove_page(&tlbi, addr, page);
-        decrement_vm_stat(mm, resident_set_size, PAGE_SIZE);
+        /* PROT_NONE ptes don't live in the TLB, just drop the ref along with the batch */
+        tlb_batch_defer_free(tlb, page);
     }
+    decrement_vm_stat(mm, resident_set_size, PAGE_SIZE);
 
 out:
     spin_unlock(&mm->page_table_lock);
-
-    if (tlbi_active(&tlbi))
-        tlbi_end_batch(&tlbi);
-
     return 0;
 }
 
-pte_t pte_get(struct mm_address_space *mm, unsigned long addr)
+/**
+ * @brief Replace the pte that maps a page with a migration entry
+ * The page stays mapped as far as mapcount and RSS are concerned, until remove_migration_pte puts
+ * it (or its replacement) back. Faults on the entry wait for the page lock.
+ *
+ * @param page Locked page
+ * @param vma VMA that maps the page
+ * @param addr Address of the page in the VMA
+ * @param tlb TLB batch (switched to the VMA's address space)
+ * @return 1 if a migration entry was installed, else 0
+ */
+int try_to_migrate_one(struct page *page, struct vm_area_struct *vma, unsigned long addr,
+                       struct tlb_batch *tlb) NO_THREAD_SAFETY_ANALYSIS
 {
+    struct mm_address_space *mm = vma->vm_mm;
+    swp_entry_t entry;
+    pte_t *pte, oldpte;
+    pmd_t *pmd;
+    int ret = 0;
+
+    tlb_batch_switch_mm(tlb, mm);
     spin_lock(&mm->page_table_lock);
-    /* pte_mknone? */
-    pte_t ret = __pte(0);
-    pte_t *pte = pte_get_from_addr(mm, addr);
 
-    if (pte)
-        ret = *pte;
-    spin_unlock(&mm->page_table_lock);
-    return ret;
-}
+    /* We don't migrate THPs, so a huge pmd can't be mapping this page */
+    pmd = pmd_get_from_addr(mm, addr);
+    if (!pmd || pmd_huge(*pmd))
+        goto out;
 
-pte_t *ptep_get_locked(struct mm_address_space *mm, unsigned long addr, struct spinlock **lock)
+    pte = pte_get_from_addr(mm, addr);
+    if (!pte || !pte_present(*pte))
+        goto out;
+
+    oldpte = *pte;
+    if (pte_special(oldpte) || pte_addr(oldpte) != (unsigned long) page_to_phys(page))
+        goto out;
+
+    /* The entry can't hold the dirty bit, so move it to the page. Anon pages without a swap slot
+     * are always mapped back dirty. */
+    if (pte_dirty(oldpte) && page_vmobj(page))
+        filemap_mark_dirty(page, page_pgoff(page));
+
+    entry = make_migration_entry(page, pte_write(oldpte));
+    set_pte(pte, __pte(entry.swp));
+    if (!pte_protnone(oldpte))
+        tlb_batch_add_range(tlb, addr, addr + PAGE_SIZE);
+    ret = 1;
+out:
+    spin_unlock(&mm->page_table_lock);
+    return ret;
+}
+
+/**
+ * @brief Replace a migration entry with a pte that maps the new page
+ *
+ * @param old Page the migration entry points to
+ * @param newpage Page to map (may be old, if migration failed)
+ * @param vma VMA that maps the page
+ * @param addr Address of the page in the VMA
+ * @return 1 if the entry was replaced, else 0
+ */
+int remove_migration_pte(struct page *old, struct page *newpage, struct vm_area_struct *vma,
+                         unsigned long addr)
+{
+    struct mm_address_space *mm = vma->vm_mm;
+    u64 phys = (u64) page_to_phys(newpage);
+    unsigned long vm_flags = vma->vm_flags;
+    swp_entry_t entry;
+    pte_t *pte, newpte;
+    pmd_t *pmd;
+    int ret = 0;
+
+    spin_lock(&mm->page_table_lock);
+
+    pmd = pmd_get_from_addr(mm, addr);
+    if (!pmd || pmd_huge(*pmd))
+        goto out;
+
+    pte = pte_get_from_addr(mm, addr);
+    if (!pte || pte_none(*pte) || pte_present(*pte))
+        goto out;
+
+    entry = pte_to_swp_entry(*pte);
+    if (!swp_is_migration(entry) || migration_entry_to_page(entry) != old)
+        goto out;
+
+    if (!swp_migration_write(entry))
+        vm_flags &= ~VM_WRITE;
+    newpte = pte_mkpte(phys, calc_pgprot(phys, vm_flags));
+    if (!page_vmobj(newpage))
+        pte_val(newpte) |= _PAGE_DIRTY;
+
+    if (newpage != old)
+        page_add_mapcount(newpage);
+    set_pte(pte, newpte);
+    if (newpage != old)
+        page_sub_mapcount(old);
+    ret = 1;
+out:
+    spin_unlock(&mm->page_table_lock);
+    return ret;
+}
+
+pte_t pte_get(struct mm_address_space *mm, unsigned long addr)
+{
+    spin_lock(&mm->page_table_lock);
+    /* pte_mknone? */
+    pte_t ret = __pte(0);
+    pte_t *pte = pte_get_from_addr(mm, addr);
+
+    if (pte)
+        ret = *pte;
+    spin_unlock(&mm->page_table_lock);
+    return ret;
+}
+
+pte_t *ptep_get_locked(struct mm_address_space *mm, unsigned long addr, struct spinlock **lock)
 {
     spin_lock(&mm->page_table_lock);
     /* pte_mknone? */
@@ -1177,9 +1617,14 @@ int pgtable_prealloc(struct mm_address_space *mm, unsigned long virt)
     if (unlikely(!pmd))
         goto oom;
 
+    /* Someone raced with us and mapped a THP. ptep_get_locked will tell the caller. */
+    if (pmd_huge(*pmd))
+        goto out;
+
     pte = pte_get_or_alloc(pmd, virt, mm);
     if (unlikely(!pte))
         goto oom;
+out:
     spin_unlock(&mm->page_table_lock);
     return 0;
 oom:
@@ -1187,6 +1632,274 @@ oom:
     return -ENOMEM;
 }
 
+struct swap_pte_walk
+{
+    unsigned int type;
+    struct swap_pte *ptes;
+    unsigned int nr;
+    unsigned int max;
+};
+
+static bool pte_gather_swap(struct swap_pte_walk *walk, pte_t *pte, unsigned long start,
+                            unsigned long end, unsigned long *next)
+{
+    for (; start < end; pte++, start += PAGE_SIZE)
+    {
+        swp_entry_t swp;
+        if (pte_none(*pte) || pte_present(*pte) || pte_protnone(*pte))
+            continue;
+
+        swp = pte_to_swp_entry(*pte);
+        if (SWP_TYPE(swp) != walk->type)
+            continue;
+
+        if (walk->nr == walk->max)
+        {
+            *next = start;
+            return false;
+        }
+
+        walk->ptes[walk->nr].addr = start;
+        walk->ptes[walk->nr++].pte = *pte;
+    }
+
+    return true;
+}
+
+static bool pmd_gather_swap(struct swap_pte_walk *walk, pmd_t *pmd, unsigned long start,
+                            unsigned long end, unsigned long *next)
+{
+    unsigned long next_start;
+    for (; start < end; pmd++, start = next_start)
+    {
+        next_start = min(pmd_addr_end(start), end);
+        /* Huge pmds are never swapped out */
+        if (pmd_none(*pmd) || pmd_huge(*pmd))
+            continue;
+        if (!pte_gather_swap(walk, pte_offset(pmd, start), start, next_start, next))
+            return false;
+    }
+
+    return true;
+}
+
+static bool pud_gather_swap(struct swap_pte_walk *walk, pud_t *pud, unsigned long start,
+                            unsigned long end, unsigned long *next)
+{
+    unsigned long next_start;
+    for (; start < end; pud++, start = next_start)
+    {
+        next_start = min(pud_addr_end(start), end);
+        if (pud_none(*pud) || pud_huge(*pud))
+            continue;
+        if (!pmd_gather_swap(walk, pmd_offset(pud, start), start, next_start, next))
+            return false;
+    }
+
+    return true;
+}
+
+static bool p4d_gather_swap(struct swap_pte_walk *walk, p4d_t *p4d, unsigned long start,
+                            unsigned long end, unsigned long *next)
+{
+    unsigned long next_start;
+    for (; start < end; p4d++, start = next_start)
+    {
+        next_start = min(p4d_addr_end(start), end);
+        if (p4d_none(*p4d) || p4d_huge(*p4d))
+            continue;
+        if (!pud_gather_swap(walk, pud_offset(p4d, start), start, next_start, next))
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Gather the swap ptes (of a given swap area) in a range
+ *
+ * @param mm Address space
+ * @param start Start of the range
+ * @param end End of the range
+ * @param type Swap area index
+ * @param ptes Array of swap ptes to fill
+ * @param nr Pointer to the number of ptes found (filled in)
+ * @param max Size of the ptes array
+ * @return Address to resume the walk at, or @a end if the whole range was walked
+ */
+unsigned long vm_gather_swap_ptes(struct mm_address_space *mm, unsigned long start,
+                                  unsigned long end, unsigned int type, struct swap_pte *ptes,
+                                  unsigned int *nr, unsigned int max)
+{
+    struct swap_pte_walk walk = {.type = type, .ptes = ptes, .nr = 0, .max = max};
+    unsigned long next = end, next_start;
+    pgd_t *pgd;
+
+    spin_lock(&mm->page_table_lock);
+    pgd = pgd_offset(mm, start);
+    for (; start < end; pgd++, start = next_start)
+    {
+        next_start = min(pgd_addr_end(start), end);
+        if (pgd_none(*pgd))
+            continue;
+        if (!p4d_gather_swap(&walk, p4d_offset(pgd, start), start, next_start, &next))
+            break;
+    }
+
+    spin_unlock(&mm->page_table_lock);
+    *nr = walk.nr;
+    return next;
+}
+
+struct young_walk
+{
+    struct page **pages;
+    unsigned int nr;
+    unsigned int max;
+};
+
+static bool young_walk_add(struct young_walk *walk, unsigned long phys)
+{
+    struct page *page = phys_to_page_mayfail(phys);
+    if (!page)
+        return true;
+    page = compound_head(page);
+    /* Pages mapped to userspace without a reference (e.g the vdso's) aren't on the LRU anyway */
+    if (!page_try_get(page))
+        return true;
+    walk->pages[walk->nr++] = page;
+    return walk->nr < walk->max;
+}
+
+static bool pte_gather_young(struct young_walk *walk, pte_t *pte, unsigned long start,
+                             unsigned long end, unsigned long *next)
+{
+    for (; start < end; pte++, start += PAGE_SIZE)
+    {
+        pte_t old = *pte;
+        do
+        {
+            if (!pte_present(old) || !pte_accessed(old))
+                break;
+        } while (!pte_cmpxchg(pte, &old, pte_mkyoung(old)));
+
+        if (!pte_present(old) || !pte_accessed(old))
+            continue;
+
+        /* See mmu_get_clear_referenced, no TLB flush needed */
+        if (!young_walk_add(walk, pte_addr(old)))
+        {
+            *next = start + PAGE_SIZE;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool pmd_gather_young(struct young_walk *walk, pmd_t *pmd, unsigned long start,
+                             unsigned long end, unsigned long *next)
+{
+    unsigned long next_start;
+    for (; start < end; pmd++, start = next_start)
+    {
+        next_start = min(pmd_addr_end(start), end);
+        if (pmd_none(*pmd))
+            continue;
+
+        if (pmd_huge(*pmd))
+        {
+            pmd_t old = *pmd;
+            do
+            {
+                if (!pmd_accessed(old))
+                    break;
+            } while (!pmd_cmpxchg(pmd, &old, pmd_mkyoung(old)));
+
+            if (pmd_accessed(old) && !young_walk_add(walk, pmd_addr(old)))
+            {
+                *next = next_start;
+                return false;
+            }
+
+            continue;
+        }
+
+        if (!pte_gather_young(walk, pte_offset(pmd, start), start, next_start, next))
+            return false;
+    }
+
+    return true;
+}
+
+static bool pud_gather_young(struct young_walk *walk, pud_t *pud, unsigned long start,
+                             unsigned long end, unsigned long *next)
+{
+    unsigned long next_start;
+    for (; start < end; pud++, start = next_start)
+    {
+        next_start = min(pud_addr_end(start), end);
+        if (pud_none(*pud) || pud_huge(*pud))
+            continue;
+        if (!pmd_gather_young(walk, pmd_offset(pud, start), start, next_start, next))
+            return false;
+    }
+
+    return true;
+}
+
+static bool p4d_gather_young(struct young_walk *walk, p4d_t *p4d, unsigned long start,
+                             unsigned long end, unsigned long *next)
+{
+    unsigned long next_start;
+    for (; start < end; p4d++, start = next_start)
+    {
+        next_start = min(p4d_addr_end(start), end);
+        if (p4d_none(*p4d) || p4d_huge(*p4d))
+            continue;
+        if (!pud_gather_young(walk, pud_offset(p4d, start), start, next_start, next))
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Clear the accessed bits in a range, and gather the pages that had them set
+ * Every page returned holds a reference, that the caller must drop.
+ *
+ * @param mm Address space
+ * @param start Start of the range
+ * @param end End of the range
+ * @param pages Array of pages to fill
+ * @param nr Pointer to the number of pages found (filled in)
+ * @param max Size of the pages array
+ * @return Address to resume the walk at, or @a end if the whole range was walked
+ */
+unsigned long vm_gather_young_pages(struct mm_address_space *mm, unsigned long start,
+                                    unsigned long end, struct page **pages, unsigned int *nr,
+                                    unsigned int max)
+{
+    struct young_walk walk = {.pages = pages, .nr = 0, .max = max};
+    unsigned long next = end, next_start;
+    pgd_t *pgd;
+
+    spin_lock(&mm->page_table_lock);
+    pgd = pgd_offset(mm, start);
+    for (; start < end; pgd++, start = next_start)
+    {
+        next_start = min(pgd_addr_end(start), end);
+        if (pgd_none(*pgd))
+            continue;
+        if (!p4d_gather_young(&walk, p4d_offset(pgd, start), start, next_start, &next))
+            break;
+    }
+
+    spin_unlock(&mm->page_table_lock);
+    *nr = walk.nr;
+    return next;
+}
+
 static bool wp_may_reuse_old(struct page *page)
 {
     /* Check if there are circumstances to use the old page as the new dirtied page. Basically, we
@@ -1234,7 +1947,7 @@ int do_wp_page(struct vm_pf_context *context)
     pte_t *ptep;
     u64 phys;
     struct spinlock *lock = NULL;
-    struct tlbi_tracker tlbi;
+    struct tlb_batch tlb;
     struct anon_vma *anon = anon_vma_prepare(context->entry);
     if (!anon)
         return -ENOMEM;
@@ -1251,7 +1964,8 @@ int do_wp_page(struct vm_pf_context *context)
 
     spin_unlock(lock);
 
-    new_page = alloc_page(GFP_KERNEL | (was_zeropage ? 0 : PAGE_ALLOC_NO_ZERO));
+    new_page = alloc_page_vma(GFP_KERNEL | (was_zeropage ? 0 : PAGE_ALLOC_NO_ZERO), context->entry,
+                              context->vpage);
     if (!new_page)
         return -ENOMEM;
 
@@ -1264,7 +1978,7 @@ int do_wp_page(struct vm_pf_context *context)
     page_set_anon(new_page);
     page_add_lru(new_page);
 
-    tlbi_tracker_init(&tlbi);
+    tlb_batch_init(&tlb, context->entry->vm_mm);
 
     spin_lock(lock);
     if (ptep->pte != context->oldpte.pte)
@@ -1277,7 +1991,7 @@ int do_wp_page(struct vm_pf_context *context)
 
     if (!was_zeropage)
     {
-        /* Ref the page, so it doesn't go away before the tlbi */
+        /* Ref the page, so it doesn't go away before the TLB flush */
         page_ref(oldp);
         page_sub_mapcount(oldp);
     }
@@ -1285,11 +1999,399 @@ int do_wp_page(struct vm_pf_context *context)
     phys = (u64) page_to_phys(new_page);
     page_add_mapcount(new_page);
     set_pte(ptep, pte_mkpte(phys, calc_pgprot(phys, context->entry->vm_flags)));
-    tlbi_remove_page(&tlbi, context->vpage, !was_zeropage ? oldp : NULL);
+    tlb_batch_remove_page(&tlb, context->vpage, !was_zeropage ? oldp : NULL);
     page_unref(new_page);
 out:
-    if (tlbi_active(&tlbi))
-        tlbi_end_batch(&tlbi);
+    tlb_batch_finish(&tlb);
     spin_unlock(lock);
     return 0;
 }
+
+static bool thp_may_reuse(struct page *page)
+{
+    /* Every subpage needs to be exclusively ours. Page tables are locked. */
+    for (unsigned long i = 0; i < THP_NR_PAGES; i++)
+    {
+        if (page[i].ref > 1 || page_mapcount(&page[i]) > 1 || page_test_swap(&page[i]))
+            return false;
+    }
+
+    return true;
+}
+
+static void thp_copy(struct page *dst, struct page *src)
+{
+    memcpy(PAGE_TO_VIRT(dst), PAGE_TO_VIRT(src), PMD_SIZE);
+}
+
+/**
+ * @brief Read the pmd that maps addr
+ *
+ * @param mm Address space
+ * @param addr Address
+ * @return The pmd, or an empty pmd if there's no pmd table
+ */
+static pmd_t pmd_peek(struct mm_address_space *mm, unsigned long addr)
+{
+    pmd_t *pmd;
+    pmd_t val = __pmd(0);
+
+    /* Page tables may go away under us if a neighbouring VMA gets unmapped, so this can't be done
+     * locklessly. */
+    spin_lock(&mm->page_table_lock);
+    pmd = pmd_get_from_addr(mm, addr);
+    if (pmd)
+        val = *pmd;
+    spin_unlock(&mm->page_table_lock);
+    return val;
+}
+
+/**
+ * @brief Check if the pmd still matches what we peeked (with the page table lock held)
+ *
+ * @param mm Address space
+ * @param addr Address
+ * @param oldpmd The peeked pmd
+ * @return The pmd pointer if the pmd didn't change, else NULL
+ */
+static pmd_t *pmd_same_locked(struct mm_address_space *mm, unsigned long addr, pmd_t oldpmd)
+{
+    pmd_t *pmd = pmd_get_from_addr(mm, addr);
+    if (!pmd || pmd_val(*pmd) != pmd_val(oldpmd))
+        return NULL;
+    return pmd;
+}
+
+static int do_huge_pmd_wp_page(struct vm_pf_context *context, pmd_t oldpmd)
+{
+    struct vm_area_struct *vma = context->entry;
+    struct mm_address_space *mm = vma->vm_mm;
+    unsigned long haddr = context->vpage & -PMD_SIZE;
+    struct page *oldp = phys_to_page(pmd_addr(oldpmd));
+    struct page *new_page;
+    struct anon_vma *anon;
+    pmd_t *pmd;
+    u64 phys;
+
+    spin_lock(&mm->page_table_lock);
+    pmd = pmd_same_locked(mm, haddr, oldpmd);
+    if (!pmd)
+        goto out;
+
+    if (thp_may_reuse(oldp))
+    {
+        set_pmd(pmd, pmd_mkwrite(oldpmd));
+        spin_unlock(&mm->page_table_lock);
+        tlbi_upgrade_pte_prots(mm, haddr);
+        return 0;
+    }
+
+    spin_unlock(&mm->page_table_lock);
+
+    /* If the THP straddles VMAs, we can't map a new one over both */
+    if (haddr < vma->vm_start || haddr + PMD_SIZE > vma->vm_end)
+        goto split;
+
+    anon = anon_vma_prepare(vma);
+    if (!anon)
+        return -ENOMEM;
+
+    new_page = thp_alloc_anon(vma, anon, haddr);
+    if (!new_page)
+        goto split;
+    thp_copy(new_page, oldp);
+
+    spin_lock(&mm->page_table_lock);
+    pmd = pmd_same_locked(mm, haddr, oldpmd);
+    if (!pmd)
+    {
+        spin_unlock(&mm->page_table_lock);
+        thp_put_pages(new_page);
+        return 0;
+    }
+
+    phys = (u64) page_to_phys(new_page);
+    for (unsigned long i = 0; i < THP_NR_PAGES; i++)
+        page_add_mapcount(new_page + i);
+    set_pmd(pmd, pmd_mkhuge(phys, calc_pgprot(phys, vma->vm_flags)));
+    /* The old subpages can only go away after the flush */
+    mmu_invalidate_range(haddr, 1, mm);
+    for (unsigned long i = 0; i < THP_NR_PAGES; i++)
+        page_sub_mapcount(oldp + i);
+    spin_unlock(&mm->page_table_lock);
+    thp_put_pages(new_page);
+    return 0;
+split:
+    /* No memory for a new THP, CoW just this page. Split the pmd and retry the fault. */
+    spin_lock(&mm->page_table_lock);
+    pmd = pmd_same_locked(mm, haddr, oldpmd);
+    if (pmd && __split_huge_pmd(mm, pmd, haddr) < 0)
+    {
+        spin_unlock(&mm->page_table_lock);
+        return -ENOMEM;
+    }
+out:
+    spin_unlock(&mm->page_table_lock);
+    return 0;
+}
+
+static int do_huge_anon_page(struct vm_pf_context *context)
+{
+    struct vm_area_struct *vma = context->entry;
+    struct mm_address_space *mm = vma->vm_mm;
+    unsigned long haddr = context->vpage & -PMD_SIZE;
+    struct anon_vma *anon;
+    struct page *page;
+    pgd_t *pgd;
+    p4d_t *p4d;
+    pud_t *pud;
+    pmd_t *pmd;
+    u64 phys;
+
+    anon = anon_vma_prepare(vma);
+    if (!anon)
+        return -ENOMEM;
+
+    page = thp_alloc_anon(vma, anon, haddr);
+    if (!page)
+        return VM_FAULT_FALLBACK;
+
+    spin_lock(&mm->page_table_lock);
+
+    pgd = pgd_offset(mm, haddr);
+    p4d = p4d_get_or_alloc(pgd, haddr, mm);
+    if (unlikely(!p4d))
+        goto oom;
+
+    pud = pud_get_or_alloc(p4d, haddr, mm);
+    if (unlikely(!pud))
+        goto oom;
+
+    pmd = pmd_get_or_alloc(pud, haddr, mm);
+    if (unlikely(!pmd))
+        goto oom;
+
+    /* Raced with someone else, retry the fault */
+    if (!pmd_none(*pmd))
+        goto out;
+
+    phys = (u64) page_to_phys(page);
+    for (unsigned long i = 0; i < THP_NR_PAGES; i++)
+        page_add_mapcount(page + i);
+    set_pmd(pmd, pmd_mkhuge(phys, calc_pgprot(phys, context->page_rwx)));
+    increment_vm_stat(mm, resident_set_size, PMD_SIZE);
+out:
+    spin_unlock(&mm->page_table_lock);
+    /* The mapcount holds the only reference we need for anon pages... */
+    thp_put_pages(page);
+    return 0;
+oom:
+    spin_unlock(&mm->page_table_lock);
+    thp_put_pages(page);
+    return -ENOMEM;
+}
+
+int do_huge_pmd_fault(struct vm_pf_context *context)
+{
+    struct vm_area_struct *vma = context->entry;
+    struct fault_info *info = context->info;
+    pmd_t oldpmd;
+
+    /* Peek at the pmd. Everything gets rechecked under the page table lock later. */
+    oldpmd = pmd_peek(vma->vm_mm, context->vpage);
+
+    if (pmd_huge(oldpmd))
+    {
+        if (info->write && !pmd_write(oldpmd) && vma_private(vma))
+            return do_huge_pmd_wp_page(context, oldpmd);
+
+        /* Spurious (or raced with a pmd change), invalidate the TLB _locally_ and retry */
+        tlbi_handle_spurious_fault_pte(vma->vm_mm, context->vpage);
+        return 0;
+    }
+
+    if (!pmd_none(oldpmd) || !thp_vma_allowed(vma, context->vpage))
+        return VM_FAULT_FALLBACK;
+
+    return do_huge_anon_page(context);
+}
+
+struct page *follow_huge_pmd(struct vm_area_struct *vma, unsigned long addr, unsigned int flags)
+{
+    struct mm_address_space *mm = vma->vm_mm;
+    struct page *page = NULL;
+    pmd_t *pmd;
+    pmd_t val;
+
+    spin_lock(&mm->page_table_lock);
+    pmd = pmd_get_from_addr(mm, addr);
+    if (!pmd || !pmd_huge(*pmd))
+        goto out;
+    val = *pmd;
+
+    /* coredumps want protnone pages - so pass them with no problem */
+    if (pmd_protnone(val) && (flags & GPP_READ) && !(flags & GPP_DUMP))
+        goto out;
+    if (flags & GPP_WRITE && !pmd_write(val))
+        goto out;
+
+    page = phys_to_page(pmd_addr(val) + (addr & (PMD_SIZE - 1) & -PAGE_SIZE));
+    page_ref(page);
+out:
+    spin_unlock(&mm->page_table_lock);
+    return page;
+}
+
+static int hugetlb_wp(struct vm_pf_context *context, pmd_t oldpmd)
+{
+    struct vm_area_struct *vma = context->entry;
+    struct mm_address_space *mm = vma->vm_mm;
+    unsigned long haddr = context->vpage & -PMD_SIZE;
+    struct page *oldp = phys_to_page(pmd_addr(oldpmd));
+    struct page *new_page;
+    pmd_t *pmd;
+    u64 phys;
+
+    spin_lock(&mm->page_table_lock);
+    pmd = pmd_same_locked(mm, haddr, oldpmd);
+    if (!pmd)
+        goto out;
+
+    /* A private page that only we map (and no one else holds) can simply be made writable */
+    if (!oldp->owner && page_mapcount(oldp) == 1 && READ_ONCE(oldp->ref) == 1)
+    {
+        set_pmd(pmd, pmd_mkwrite(oldpmd));
+        spin_unlock(&mm->page_table_lock);
+        tlbi_upgrade_pte_prots(mm, haddr);
+        return 0;
+    }
+
+    page_ref(oldp);
+    spin_unlock(&mm->page_table_lock);
+
+    new_page = hugetlb_alloc_page();
+    if (!new_page)
+    {
+        page_unref(oldp);
+        context->info->signal = VM_SIGBUS;
+        return -ENOMEM;
+    }
+
+    memcpy(PAGE_TO_VIRT(new_page), PAGE_TO_VIRT(oldp), HUGETLB_SIZE);
+
+    spin_lock(&mm->page_table_lock);
+    pmd = pmd_same_locked(mm, haddr, oldpmd);
+    if (pmd)
+    {
+        phys = (u64) page_to_phys(new_page);
+        huge_pmd_add_mapcount(new_page);
+        set_pmd(pmd, pmd_mkhuge(phys, calc_pgprot(phys, vma->vm_flags)));
+        /* The old page can only go away after the flush */
+        mmu_invalidate_range(haddr, 1, mm);
+        huge_pmd_sub_mapcount(oldp);
+    }
+
+    spin_unlock(&mm->page_table_lock);
+    page_unref(new_page);
+    page_unref(oldp);
+    return 0;
+out:
+    spin_unlock(&mm->page_table_lock);
+    return 0;
+}
+
+int do_hugetlb_fault(struct vm_pf_context *context)
+{
+    struct vm_area_struct *vma = context->entry;
+    struct mm_address_space *mm = vma->vm_mm;
+    struct fault_info *info = context->info;
+    unsigned long haddr = context->vpage & -PMD_SIZE;
+    struct vm_object *vmo = vma->vm_obj;
+    int vm_flags = context->page_rwx;
+    struct tlb_batch tlb;
+    struct page *page;
+    int err = 0;
+    pgd_t *pgd;
+    p4d_t *p4d;
+    pud_t *pud;
+    pmd_t *pmd;
+    pmd_t oldpmd;
+    u64 phys;
+
+    oldpmd = pmd_peek(mm, context->vpage);
+
+    if (pmd_huge(oldpmd))
+    {
+        if (info->write && !pmd_write(oldpmd) && vma_private(vma))
+            return hugetlb_wp(context, oldpmd);
+
+        tlbi_handle_spurious_fault_pte(mm, context->vpage);
+        return 0;
+    }
+
+    /* Hold off truncation until the page is mapped */
+    rw_lock_read(&vmo->truncate_lock);
+    page = hugetlb_fault_page(vma, haddr, info->write, &vm_flags);
+    if (IS_ERR(page))
+    {
+        err = PTR_ERR(page);
+        goto out;
+    }
+
+    tlb_batch_init(&tlb, mm);
+    spin_lock(&mm->page_table_lock);
+
+    pgd = pgd_offset(mm, haddr);
+    p4d = p4d_get_or_alloc(pgd, haddr, mm);
+    if (unlikely(!p4d))
+        goto oom;
+
+    pud = pud_get_or_alloc(p4d, haddr, mm);
+    if (unlikely(!pud))
+        goto oom;
+
+    pmd = pmd_get_or_alloc(pud, haddr, mm);
+    if (unlikely(!pmd))
+        goto oom;
+
+    if (pmd_huge(*pmd))
+    {
+        /* Raced with someone else, retry the fault */
+        goto out_unlock;
+    }
+
+    if (!pmd_none(*pmd))
+    {
+        /* An empty page table may have been left behind by an old mapping. Get rid of it. */
+        pte_t *pte = (pte_t *) __tovirt(pmd_addr(*pmd));
+        for (int i = 0; i < PTRS_PER_PTE; i++)
+        {
+            if (WARN_ON(!pte_none(pte[i])))
+            {
+                err = -EFAULT;
+                goto out_unlock;
+            }
+        }
+
+        set_pmd(pmd, __pmd(0));
+        tlbi_remove_pte(mm, &tlb, pte, haddr);
+        tlb_batch_finish(&tlb);
+    }
+
+    phys = (u64) page_to_phys(page);
+    huge_pmd_add_mapcount(page);
+    set_pmd(pmd, pmd_mkhuge(phys, calc_pgprot(phys, vm_flags)));
+    increment_vm_stat(mm, resident_set_size, PMD_SIZE);
+out_unlock:
+    spin_unlock(&mm->page_table_lock);
+    page_unref(page);
+out:
+    rw_unlock_read(&vmo->truncate_lock);
+    /* Out of range, or out of huge pages. Either way, SIGBUS. */
+    if (err)
+        info->signal = VM_SIGBUS;
+    return err;
+oom:
+    err = -ENOMEM;
+    goto out_unlock;
+}
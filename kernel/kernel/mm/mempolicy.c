@@ -0,0 +1,374 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <errno.h>
+
+#include <onyx/irq.h>
+#include <onyx/mm/alloc_profile.h>
+#include <onyx/mm/hugetlb.h>
+#include <onyx/mm/mempolicy.h>
+#include <onyx/page.h>
+#include <onyx/process.h>
+#include <onyx/scheduler.h>
+#include <onyx/vm.h>
+
+#include "vma_internal.h"
+
+/* Interleave index for thread policies, which just go round-robin */
+#define NO_INTERLEAVE_INDEX (-1UL)
+
+#define BITS_PER_LONG (sizeof(unsigned long) * 8)
+/* Same as Linux, don't let userspace make us loop forever over a huge mask */
+#define MAX_USER_NODEMASK_BITS (PAGE_SIZE * 8)
+
+static int mempolicy_first_node(nodemask_t nodes)
+{
+    return __builtin_ctzl(nodes);
+}
+
+static int mempolicy_nth_node(nodemask_t nodes, unsigned long n)
+{
+    n %= __builtin_popcountl(nodes);
+    while (n--)
+        nodes &= nodes - 1;
+    return mempolicy_first_node(nodes);
+}
+
+static int mempolicy_next_interleave(const struct mempolicy *pol)
+{
+    for (int i = 1; i <= MAX_NUMNODES; i++)
+    {
+        int nid = (pol->il_prev + i) % MAX_NUMNODES;
+        if (nid >= 0 && pol->nodes & NODE_MASK(nid))
+            return nid;
+    }
+
+    return mempolicy_first_node(pol->nodes);
+}
+
+static struct page *alloc_pages_pol(unsigned int order, unsigned long gfp, struct mempolicy *pol,
+                                    unsigned long ilx, unsigned long ip)
+{
+    int nid;
+
+    switch (pol->mode)
+    {
+        case MPOL_PREFERRED:
+            return __alloc_pages_caller(order, gfp, mempolicy_first_node(pol->nodes), ~0UL, ip);
+        case MPOL_BIND:
+            /* Prefer the local node if it's one of ours */
+            nid = numa_node_id();
+            if (!(pol->nodes & NODE_MASK(nid)))
+                nid = mempolicy_first_node(pol->nodes);
+            return __alloc_pages_caller(order, gfp, nid, pol->nodes, ip);
+        case MPOL_INTERLEAVE:
+            if (ilx == NO_INTERLEAVE_INDEX)
+            {
+                nid = mempolicy_next_interleave(pol);
+                pol->il_prev = nid;
+            }
+            else
+                nid = mempolicy_nth_node(pol->nodes, ilx);
+            return __alloc_pages_caller(order, gfp, nid, ~0UL, ip);
+        default:
+            return __alloc_pages_caller(order, gfp, NUMA_NO_NODE, ~0UL, ip);
+    }
+}
+
+static struct mempolicy *current_mempolicy(void)
+{
+    struct thread *curr = get_current_thread();
+
+    /* Interrupts don't run on behalf of whoever they interrupted */
+    if (!curr || is_in_interrupt() || mempolicy_is_default(&curr->mempolicy))
+        return NULL;
+    return &curr->mempolicy;
+}
+
+struct page *alloc_pages_current(unsigned int order, unsigned long gfp, unsigned long ip)
+{
+    struct mempolicy *pol = current_mempolicy();
+
+    if (!pol || gfp & __GFP_THISNODE)
+        return __alloc_pages_caller(order, gfp, NUMA_NO_NODE, ~0UL, ip);
+    return alloc_pages_pol(order, gfp, pol, NO_INTERLEAVE_INDEX, ip);
+}
+
+struct page *alloc_pages_vma(unsigned int order, unsigned long gfp, struct vm_area_struct *vma,
+                             unsigned long addr)
+{
+    struct mempolicy *pol = &vma->vm_policy;
+    unsigned long ilx;
+
+    if (numa_single_node())
+        return __alloc_pages_caller(order, gfp, 0, ~0UL, _RET_IP_);
+
+    if (mempolicy_is_default(pol))
+        pol = current_mempolicy();
+    if (!pol)
+        return __alloc_pages_caller(order, gfp, NUMA_NO_NODE, ~0UL, _RET_IP_);
+
+    /* Interleave by offset into the mapping, so the layout doesn't depend on the fault order */
+    ilx = (addr - vma->vm_start + vma->vm_offset) >> (PAGE_SHIFT + order);
+    return alloc_pages_pol(order, gfp, pol, ilx, _RET_IP_);
+}
+
+static int get_user_nodemask(nodemask_t *mask, const unsigned long *unodes, unsigned long maxnode)
+{
+    unsigned long nlongs, word;
+
+    *mask = 0;
+    /* Like Linux, maxnode is off by one */
+    if (maxnode)
+        maxnode--;
+    if (!unodes || !maxnode)
+        return 0;
+    if (maxnode > MAX_USER_NODEMASK_BITS)
+        return -EINVAL;
+
+    nlongs = (maxnode + BITS_PER_LONG - 1) / BITS_PER_LONG;
+    for (unsigned long i = 0; i < nlongs; i++)
+    {
+        if (copy_from_user(&word, unodes + i, sizeof(word)) < 0)
+            return -EFAULT;
+        if (i == nlongs - 1 && maxnode % BITS_PER_LONG)
+            word &= (1UL << (maxnode % BITS_PER_LONG)) - 1;
+
+        if (i == 0)
+            *mask = word;
+        else if (word)
+            return -EINVAL;
+    }
+
+#if MAX_NUMNODES < 64
+    if (*mask >> MAX_NUMNODES)
+        return -EINVAL;
+#endif
+    return 0;
+}
+
+static int put_user_nodemask(unsigned long *unodes, unsigned long maxnode, nodemask_t mask)
+{
+    unsigned long nlongs, word;
+
+    if (!unodes)
+        return 0;
+    if (maxnode)
+        maxnode--;
+    if (maxnode < nr_numa_nodes || maxnode > MAX_USER_NODEMASK_BITS)
+        return -EINVAL;
+
+    nlongs = (maxnode + BITS_PER_LONG - 1) / BITS_PER_LONG;
+    for (unsigned long i = 0; i < nlongs; i++)
+    {
+        word = i == 0 ? mask : 0;
+        if (copy_to_user(unodes + i, &word, sizeof(word)) < 0)
+            return -EFAULT;
+    }
+
+    return 0;
+}
+
+static int mempolicy_new(struct mempolicy *pol, int mode, nodemask_t nodes)
+{
+    nodemask_t online = nodes & numa_nodes_online;
+
+    switch (mode)
+    {
+        case MPOL_DEFAULT:
+        case MPOL_LOCAL:
+            if (nodes)
+                return -EINVAL;
+            break;
+        case MPOL_PREFERRED:
+            /* An empty preferred set means "local" */
+            if (!nodes)
+                mode = MPOL_LOCAL;
+            else if (!online)
+                return -EINVAL;
+            break;
+        case MPOL_BIND:
+        case MPOL_INTERLEAVE:
+            if (!online)
+                return -EINVAL;
+            break;
+        default:
+            /* Note: No mode flags (MPOL_F_STATIC_NODES, etc) yet */
+            return -EINVAL;
+    }
+
+    pol->mode = mode;
+    pol->nodes = online;
+    pol->il_prev = -1;
+    return 0;
+}
+
+int sys_set_mempolicy(int mode, const unsigned long *nodemask, unsigned long maxnode)
+{
+    struct mempolicy pol;
+    nodemask_t nodes;
+    int err;
+
+    err = get_user_nodemask(&nodes, nodemask, maxnode);
+    if (err)
+        return err;
+    err = mempolicy_new(&pol, mode, nodes);
+    if (err)
+        return err;
+
+    /* Only we look at our own policy, so no locking needed */
+    get_current_thread()->mempolicy = pol;
+    return 0;
+}
+
+static int get_mempolicy_addr_node(void *addr)
+{
+    struct page *page;
+    int nid;
+
+    /* Like Linux, fault the page in if needed */
+    if (!(get_phys_pages(addr, GPP_READ | GPP_USER, &page, 1) & GPP_ACCESS_OK))
+        return -EFAULT;
+    nid = page_to_nid(page);
+    page_unref(page);
+    return nid;
+}
+
+int sys_get_mempolicy(int *umode, unsigned long *nodemask, unsigned long maxnode, void *addr,
+                      unsigned long flags)
+{
+    struct mm_address_space *mm = get_current_address_space();
+    struct mempolicy pol = get_current_thread()->mempolicy;
+    struct vm_area_struct *vma;
+    int mode, err;
+
+    if (flags & ~(MPOL_F_NODE | MPOL_F_ADDR | MPOL_F_MEMS_ALLOWED))
+        return -EINVAL;
+
+    if (flags & MPOL_F_MEMS_ALLOWED)
+    {
+        if (flags & (MPOL_F_NODE | MPOL_F_ADDR))
+            return -EINVAL;
+        mode = MPOL_DEFAULT;
+        if (umode && copy_to_user(umode, &mode, sizeof(mode)) < 0)
+            return -EFAULT;
+        return put_user_nodemask(nodemask, maxnode, numa_nodes_online);
+    }
+
+    if (flags & MPOL_F_ADDR)
+    {
+        rw_lock_read(&mm->vm_lock);
+        vma = vm_search(mm, addr, 1);
+        if (!vma)
+        {
+            rw_unlock_read(&mm->vm_lock);
+            return -EFAULT;
+        }
+
+        pol = vma->vm_policy;
+        rw_unlock_read(&mm->vm_lock);
+    }
+    else if (addr)
+        return -EINVAL;
+
+    mode = pol.mode;
+    if (flags & MPOL_F_NODE)
+    {
+        if (flags & MPOL_F_ADDR)
+        {
+            mode = get_mempolicy_addr_node(addr);
+            if (mode < 0)
+                return mode;
+        }
+        else if (pol.mode == MPOL_INTERLEAVE)
+            mode = mempolicy_next_interleave(&pol);
+        else
+            return -EINVAL;
+    }
+
+    if (umode && copy_to_user(umode, &mode, sizeof(mode)) < 0)
+        return -EFAULT;
+
+    err = put_user_nodemask(nodemask, maxnode, pol.mode == MPOL_LOCAL ? 0 : pol.nodes);
+    return err;
+}
+
+static int mbind_walk(struct mm_address_space *mm, unsigned long start, unsigned long len,
+                      const struct mempolicy *pol)
+{
+    unsigned long limit = start + len;
+    unsigned long last_vma_end = start;
+    int ret = -EFAULT;
+    struct vm_area_struct *vma;
+    VMA_ITERATOR(vmi, mm, start, limit);
+
+    mas_for_each(&vmi.mas, vma, vmi.end)
+    {
+        if (vma->vm_start >= limit)
+            break;
+
+        /* Unlike madvise, holes are an error (and so is a hole at the start) */
+        if (vma->vm_start > last_vma_end)
+            return -EFAULT;
+
+        unsigned long vstart = max(vma->vm_start, start);
+        unsigned long vend = min(limit, vma->vm_end);
+        last_vma_end = vma->vm_end;
+        ret = 0;
+
+        if (mempolicy_equal(&vma->vm_policy, pol))
+            continue;
+
+        /* hugetlb mappings can't be split in the middle of a huge page */
+        if (vma_is_hugetlb(vma) && !hugetlb_range_ok(vma, vstart, vend))
+            return -EINVAL;
+
+        vma = vma_prepare_modify(&vmi, vma, vstart, vend);
+        if (!vma)
+            return -ENOMEM;
+        vma->vm_policy = *pol;
+    }
+
+    if (!ret && last_vma_end < limit)
+        ret = -EFAULT;
+    return ret;
+}
+
+int sys_mbind(void *addr, unsigned long len, int mode, const unsigned long *nodemask,
+              unsigned long maxnode, unsigned int flags)
+{
+    struct mm_address_space *mm = get_current_address_space();
+    unsigned long start = (unsigned long) addr;
+    struct mempolicy pol;
+    nodemask_t nodes;
+    int err;
+
+    /* No page migration yet, so we can't move (or check) pages that are already there. The policy
+     * only applies to pages faulted in from now on. */
+    if (flags)
+        return -EINVAL;
+    if (start & (PAGE_SIZE - 1))
+        return -EINVAL;
+
+    len = ALIGN_TO(len, PAGE_SIZE);
+    if (start + len < start)
+        return -EINVAL;
+    if (!len)
+        return 0;
+
+    err = get_user_nodemask(&nodes, nodemask, maxnode);
+    if (err)
+        return err;
+    err = mempolicy_new(&pol, mode, nodes);
+    if (err)
+        return err;
+
+    mmap_write_lock(mm);
+    err = mbind_walk(mm, start, len, &pol);
+    mmap_write_unlock(mm);
+    return err;
+}
@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <onyx/mm/alloc_profile.h>
+#include <onyx/mm/migrate.h>
+#include <onyx/mm/page_lru.h>
+#include <onyx/mm/tlb.h>
+#include <onyx/mm/vm_object.h>
+#include <onyx/page.h>
+#include <onyx/pgtable.h>
+#include <onyx/rmap.h>
+#include <onyx/swap.h>
+#include <onyx/utils.h>
+#include <onyx/vm.h>
+#include <onyx/vm_fault.h>
+
+#define MIGRATE_BATCH 32
+
+/* Flags that describe the page's contents and identity, and that the new page inherits. The rest
+ * are either state owned by whoever is operating on the page (LOCKED, WAITERS, LRU, RECLAIM) or
+ * can't be set on a page we migrate. The LRU generation is copied separately, as it might have to
+ * be translated to another LRU's. */
+#define MIGRATE_FLAGS_MASK                                                                \
+    (PAGE_FLAG_DIRTY | PAGE_FLAG_ANON | PAGE_FLAG_UPTODATE | PAGE_FLAG_READAHEAD |        \
+     PAGE_FLAG_REFERENCED | PAGE_FLAG_ACTIVE | PAGE_FLAG_SWAP)
+
+struct migrate_item
+{
+    struct page *page;
+    unsigned int nr_unmapped;
+};
+
+int migration_entry_wait(struct vm_pf_context *context) NO_THREAD_SAFETY_ANALYSIS
+{
+    struct vm_area_struct *vma = context->entry;
+    struct spinlock *lock;
+    struct page *page;
+    pte_t *ptep;
+
+    ptep = ptep_get_locked(vma->vm_mm, context->vpage, &lock);
+    if (!ptep)
+        return 0;
+
+    if (ptep->pte != context->oldpte.pte)
+    {
+        /* Migration already finished, just retry */
+        spin_unlock(lock);
+        return 0;
+    }
+
+    /* The migration entry holds a mapcount (and thus a reference) on the old page. Grab our own
+     * reference under the page table lock, so the page can't go away while we wait on it. */
+    page = migration_entry_to_page(pte_to_swp_entry(*ptep));
+    page_ref(page);
+    spin_unlock(lock);
+
+    /* The page is locked for the duration of the migration */
+    lock_page(page);
+    unlock_page(page);
+    page_unref(page);
+    return 0;
+}
+
+static bool page_migratable(struct page *page)
+{
+    struct vm_object *obj;
+
+    if (page_flag_set(page, PAGE_FLAG_BUFFER | PAGE_FLAG_WRITEBACK | PAGE_FLAG_PINNED |
+                                PAGE_FLAG_HUGETLB | PAGE_FLAG_HEAD | PAGE_FLAG_TAIL))
+        return false;
+
+    /* Truncated from the page cache, or an anon page that is still being set up */
+    if (!page->owner)
+        return false;
+
+    if (page_flag_set(page, PAGE_FLAG_ANON))
+        return true;
+
+    /* Page cache pages. Filesystems that keep private state in the page (or do their own page
+     * freeing and accounting) aren't supported. */
+    obj = page->owner;
+    return !page->priv && !obj->ops->free_page;
+}
+
+static void migrate_copy_state(struct page *page, struct page *newpage)
+{
+    /* newpage is not visible to anyone yet, so we can set its fields non-atomically */
+    newpage->flags = (page->flags & MIGRATE_FLAGS_MASK) | PAGE_FLAG_LOCKED;
+    /* Keep the page in its multi-gen LRU generation, instead of demoting it to the oldest one */
+    page_lru_copy_gen(page, newpage);
+    newpage->owner = page->owner;
+    newpage->pageoff = page->pageoff;
+    newpage->priv = page->priv;
+}
+
+static void migrate_reset_state(struct page *newpage)
+{
+    newpage->flags = PAGE_FLAG_LOCKED;
+    newpage->owner = NULL;
+    newpage->pageoff = 0;
+    newpage->priv = 0;
+}
+
+/**
+ * @brief Move an unmapped (migration entries only) page's contents to newpage
+ *
+ * @param page Old page, locked and isolated
+ * @param newpage New page, locked
+ * @return True if moved, false if the page is busy
+ */
+static bool migrate_move_page(struct page *page, struct page *newpage)
+{
+    struct vm_object *obj = page_vmobj(page);
+    unsigned int expected_refs;
+
+    migrate_copy_state(page, newpage);
+
+    if (obj)
+    {
+        if (!vm_obj_replace_page(obj, page, newpage))
+        {
+            migrate_reset_state(newpage);
+            return false;
+        }
+
+        /* The page cache reference moves to the new page */
+        page_ref(newpage);
+        page_unref(page);
+        if (!page_flag_set(page, PAGE_FLAG_ANON))
+        {
+            inc_page_stat(newpage, NR_FILE);
+            dec_page_stat(page, NR_FILE);
+        }
+
+        if (page_flag_set(page, PAGE_FLAG_DIRTY))
+        {
+            inc_page_stat(newpage, NR_DIRTY);
+            dec_page_stat(page, NR_DIRTY);
+        }
+    }
+    else
+    {
+        /* Anonymous, not in the swap cache. With no ptes left, no one can get a new reference
+         * to the page, so the isolation reference (and the mapcount's) must be the only ones. */
+        expected_refs = 1 + (page_mapcount(page) > 0);
+        if (__atomic_load_n(&page->ref, __ATOMIC_RELAXED) != expected_refs)
+        {
+            migrate_reset_state(newpage);
+            return false;
+        }
+
+        copy_page_to_page(page_to_phys(newpage), page_to_phys(page));
+    }
+
+    if (page_flag_set(page, PAGE_FLAG_ANON))
+        inc_page_stat(newpage, NR_ANON);
+
+    /* The old page is no longer in the swap cache (newpage took its slot). ANON stays set, so
+     * free_page accounts it properly. */
+    page_clear_swap(page);
+    page_clear_dirty(page);
+#ifdef CONFIG_ALLOC_PROFILING
+    /* newpage carries on the original allocation, so it keeps being accounted to its call site.
+     * The old page gets newpage's tag, so freeing it unaccounts whoever allocated newpage. */
+    alloc_tag_t tag = newpage->alloc_tag;
+    newpage->alloc_tag = page->alloc_tag;
+    page->alloc_tag = tag;
+#endif
+    return true;
+}
+
+static bool migrate_one(struct migrate_item *item, migrate_new_page_t get_new,
+                        migrate_free_page_t put_new, void *ctx) NO_THREAD_SAFETY_ANALYSIS
+{
+    struct page *page = item->page;
+    struct page *newpage;
+
+    /* A pte we did not see was added (e.g by fork) while we were unmapping */
+    if (page_mapcount(page) != item->nr_unmapped)
+        goto restore;
+
+    newpage = get_new(page, ctx);
+    if (!newpage)
+        goto restore;
+
+    CHECK(try_lock_page(newpage));
+    if (!migrate_move_page(page, newpage))
+    {
+        unlock_page(newpage);
+        put_new(newpage, ctx);
+        goto restore;
+    }
+
+    if (item->nr_unmapped)
+        rmap_remove_migration_ptes(page, newpage);
+    WARN_ON_ONCE(page_mapcount(page) != 0);
+
+    unlock_page(newpage);
+    unlock_page(page);
+
+    /* Our get_new reference becomes the new page's isolation reference */
+    page_putback_lru(newpage);
+    page_unref(newpage);
+    return true;
+restore:
+    if (item->nr_unmapped)
+        rmap_remove_migration_ptes(page, page);
+    unlock_page(page);
+    return false;
+}
+
+static unsigned long migrate_batch(struct list_head *pages, struct list_head *failed,
+                                   migrate_new_page_t get_new, migrate_free_page_t put_new,
+                                   void *ctx) NO_THREAD_SAFETY_ANALYSIS
+{
+    struct migrate_item items[MIGRATE_BATCH];
+    unsigned long migrated = 0;
+    struct tlb_batch tlb;
+    unsigned int nr = 0;
+
+    tlb_batch_init(&tlb, NULL);
+
+    /* Unmap a batch of pages first, so we only need to shoot down TLBs once */
+    list_for_every_safe (pages)
+    {
+        struct page *page = container_of(l, struct page, lru_node);
+        if (nr == MIGRATE_BATCH)
+            break;
+
+        list_remove(&page->lru_node);
+        if (!try_lock_page(page))
+        {
+            list_add_tail(&page->lru_node, failed);
+            continue;
+        }
+
+        if (!page_migratable(page))
+        {
+            unlock_page(page);
+            list_add_tail(&page->lru_node, failed);
+            continue;
+        }
+
+        items[nr].page = page;
+        items[nr].nr_unmapped = page_mapcount(page) ? rmap_try_to_migrate(page, &tlb) : 0;
+        nr++;
+    }
+
+    tlb_batch_finish(&tlb);
+
+    for (unsigned int i = 0; i < nr; i++)
+    {
+        struct page *page = items[i].page;
+        if (!migrate_one(&items[i], get_new, put_new, ctx))
+        {
+            list_add_tail(&page->lru_node, failed);
+            continue;
+        }
+
+        /* Drop the isolation reference. This frees the page. */
+        page_unref(page);
+        migrated++;
+    }
+
+    return migrated;
+}
+
+unsigned long migrate_pages(struct list_head *pages, migrate_new_page_t get_new,
+                            migrate_free_page_t put_new, void *ctx)
+{
+    DEFINE_LIST(failed);
+    unsigned long migrated = 0;
+
+    while (!list_is_empty(pages))
+        migrated += migrate_batch(pages, &failed, get_new, put_new, ctx);
+
+    list_splice_tail(&failed, pages);
+    return migrated;
+}
+
+void putback_lru_pages(struct list_head *pages)
+{
+    list_for_every_safe (pages)
+    {
+        struct page *page = container_of(l, struct page, lru_node);
+        list_remove(&page->lru_node);
+        page_putback_lru(page);
+        page_unref(page);
+    }
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <errno.h>
+#include <stdio.h>
+
+#include <onyx/mm/numa.h>
+
+struct numa_memblk
+{
+    unsigned long start;
+    unsigned long end;
+    int nid;
+};
+
+unsigned int nr_numa_nodes = 1;
+nodemask_t numa_nodes_online = NODE_MASK(0);
+int numa_cpu_node[CONFIG_SMP_NR_CPUS];
+
+static struct numa_memblk numa_memblks[MAX_NUMA_MEMBLKS];
+static unsigned int nr_numa_memblks;
+/* 0 means "not described by the firmware" */
+static unsigned char numa_distance[MAX_NUMNODES][MAX_NUMNODES];
+
+int numa_add_memblk(int nid, unsigned long start, unsigned long end)
+{
+    unsigned int i;
+
+    if (nid < 0 || nid >= MAX_NUMNODES || start >= end)
+        return -EINVAL;
+    if (nr_numa_memblks == MAX_NUMA_MEMBLKS)
+        return -ENOSPC;
+
+    for (i = 0; i < nr_numa_memblks; i++)
+    {
+        struct numa_memblk *blk = &numa_memblks[i];
+        if (start < blk->end && blk->start < end)
+        {
+            pr_err("numa: Memory range [%016lx, %016lx] (node %d) overlaps with node %d\n", start,
+                   end - 1, nid, blk->nid);
+            return -EINVAL;
+        }
+    }
+
+    /* Keep them sorted, so numa_memblk_end can find the next range boundary */
+    for (i = nr_numa_memblks; i > 0 && numa_memblks[i - 1].start > start; i--)
+        numa_memblks[i] = numa_memblks[i - 1];
+    numa_memblks[i].start = start;
+    numa_memblks[i].end = end;
+    numa_memblks[i].nid = nid;
+    nr_numa_memblks++;
+    return 0;
+}
+
+void numa_set_distance(int from, int to, unsigned int distance)
+{
+    if (from < 0 || from >= MAX_NUMNODES || to < 0 || to >= MAX_NUMNODES)
+        return;
+    if (distance > 255 || (from == to && distance != LOCAL_DISTANCE) ||
+        (from != to && distance <= LOCAL_DISTANCE))
+    {
+        pr_warn("numa: Ignoring bogus distance %u between nodes %d and %d\n", distance, from, to);
+        return;
+    }
+
+    numa_distance[from][to] = distance;
+}
+
+unsigned int node_distance(int from, int to)
+{
+    if (from == to)
+        return LOCAL_DISTANCE;
+    if (numa_distance[from][to])
+        return numa_distance[from][to];
+    return REMOTE_DISTANCE;
+}
+
+void numa_set_node_online(int nid)
+{
+    if (nid < 0 || nid >= MAX_NUMNODES || numa_nodes_online & NODE_MASK(nid))
+        return;
+    numa_nodes_online |= NODE_MASK(nid);
+    nr_numa_nodes = __builtin_popcountl(numa_nodes_online);
+}
+
+void numa_set_cpu_node(unsigned int cpu, int nid)
+{
+    if (cpu >= CONFIG_SMP_NR_CPUS || !node_online(nid))
+        return;
+    numa_cpu_node[cpu] = nid;
+}
+
+int phys_to_nid(unsigned long phys)
+{
+    if (numa_single_node())
+        return 0;
+
+    for (unsigned int i = 0; i < nr_numa_memblks; i++)
+    {
+        if (phys >= numa_memblks[i].start && phys < numa_memblks[i].end)
+            return numa_memblks[i].nid;
+    }
+
+    return 0;
+}
+
+unsigned long numa_memblk_end(unsigned long phys)
+{
+    if (numa_single_node())
+        return ~0UL;
+
+    for (unsigned int i = 0; i < nr_numa_memblks; i++)
+    {
+        if (phys < numa_memblks[i].start)
+        {
+            /* In a hole between two ranges. It belongs to node 0 up to the next range. */
+            return numa_memblks[i].start;
+        }
+
+        if (phys < numa_memblks[i].end)
+            return numa_memblks[i].end;
+    }
+
+    return ~0UL;
+}
+
+static void numa_reset(void)
+{
+    nr_numa_memblks = 0;
+    nr_numa_nodes = 1;
+    numa_nodes_online = NODE_MASK(0);
+    for (unsigned int i = 0; i < CONFIG_SMP_NR_CPUS; i++)
+        numa_cpu_node[i] = 0;
+}
+
+void numa_init(void)
+{
+    int err = -ENOENT;
+
+#ifdef CONFIG_ACPI
+    err = acpi_numa_init();
+#endif
+
+    if (err < 0 || numa_single_node() || !nr_numa_memblks)
+    {
+        numa_reset();
+        return;
+    }
+
+    pr_info("numa: %u nodes\n", nr_numa_nodes);
+    for (unsigned int i = 0; i < nr_numa_memblks; i++)
+    {
+        pr_info("numa: node %d: [%016lx, %016lx]\n", numa_memblks[i].nid, numa_memblks[i].start,
+                numa_memblks[i].end - 1);
+    }
+}
@@ -22,7 +22,6 @@
 
 /* struct page array a-la linux kernel */
 struct page *page_map = NULL;
-static size_t num_pages = 0;
 static unsigned long maxpfn = 0;
 unsigned long base_pfn = 0;
 
@@ -33,8 +32,6 @@ struct page *page_add_page(void *paddr)
     assert(page != NULL);
     memset(page, 0, sizeof(struct page));
 
-    ++num_pages;
-
     return page;
 }
 
@@ -193,6 +190,8 @@ int page_wait_bit(struct page *p, unsigned int bit, bool interruptible) NO_THREA
 {
     int st = 0;
     const int state = interruptible ? THREAD_INTERRUPTIBLE : THREAD_UNINTERRUPTIBLE;
+    /* Compound pages keep their flags in the head, so that's what we wait on */
+    p = compound_head(p);
     const auto hash = fnv_hash(&p, sizeof(page *));
     const auto index = hash & PAGE_WQ_MASK;
 
@@ -261,6 +260,7 @@ void page_wake_bit(struct page *p, unsigned int bit)
     // unlock_page, slow path (PAGE_FLAG_WAITERS).
     // Lets figure out what wait queue everyone is on, and try to wake em up
     // TODO: There's a funny idea here: Implement lock handoff from us to a waiter.
+    p = compound_head(p);
     const auto hash = fnv_hash(&p, sizeof(page *));
     const auto index = hash & PAGE_WQ_MASK;
 
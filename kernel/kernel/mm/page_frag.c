@@ -9,24 +9,40 @@
 
 #include <onyx/page_frag.h>
 
+/* Try to back frags with 32KiB compound pages. This cuts down on page allocations, and lets
+ * frags be larger than a page. */
+#define PAGE_FRAG_CACHE_ORDER 3
+
 static int page_frag_refill(struct page_frag_info *pfi, unsigned int len, gfp_t gfp)
 {
     unsigned int order = pages2order(vm_size_to_pages(len));
+    struct page *page = NULL;
 
-    if (WARN_ON_ONCE(order > 0))
+    if (WARN_ON_ONCE(order > PAGE_FRAG_CACHE_ORDER))
     {
-        /* TODO: We're missing GFP_COMP support, and without it the refcounting gets all screwed
-         * up. So reject order > 0 allocations. */
         pr_warn("%s: Asked for %u bytes, which we can't deliver\n", __func__, len);
         return -ENOMEM;
     }
 
     if (pfi->page)
         page_unref(pfi->page);
+    pfi->page = NULL;
 
-    pfi->page = alloc_pages(order, gfp);
-    if (!pfi->page)
+    /* The large allocation is opportunistic, don't bother reclaiming for it */
+    if (order < PAGE_FRAG_CACHE_ORDER)
+    {
+        page = alloc_pages(PAGE_FRAG_CACHE_ORDER, (gfp & ~__GFP_MAY_RECLAIM) | __GFP_NOWAIT |
+                                                      __GFP_NOWARN | __GFP_COMP);
+        if (page)
+            order = PAGE_FRAG_CACHE_ORDER;
+    }
+
+    if (!page)
+        page = alloc_pages(order, gfp | __GFP_COMP);
+    if (!page)
         return -ENOMEM;
+
+    pfi->page = page;
     pfi->offset = 0;
     pfi->len = 1UL << (order + PAGE_SHIFT);
     return 0;
@@ -41,13 +57,14 @@ int page_frag_alloc(struct page_frag_info *pfi, unsigned int len, gfp_t gfp, str
             return -ENOMEM;
     }
 
+    /* Hand out the subpage the frag starts at. References on it go to the compound head. */
     page_ref(pfi->page);
-    frag->page = pfi->page;
+    frag->page = pfi->page + (pfi->offset >> PAGE_SHIFT);
     frag->len = len;
-    frag->offset = pfi->offset;
+    frag->offset = pfi->offset & (PAGE_SIZE - 1);
     pfi->offset += len;
 
-    if (pfi->offset == len)
+    if (pfi->offset == pfi->len)
     {
         /* Release our ref if someone ate the whole thing. */
         page_unref(pfi->page);
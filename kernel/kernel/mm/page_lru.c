@@ -5,55 +5,276 @@
  *
  * SPDX-License-Identifier: GPL-2.0-only
  */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <onyx/mm/numa.h>
 #include <onyx/mm/page_lru.h>
+#include <onyx/mm/page_node.h>
+#include <onyx/mm_address_space.h>
+#include <onyx/mutex.h>
 #include <onyx/page.h>
+#include <onyx/rwlock.h>
+#include <onyx/sysfs.h>
+#include <onyx/user.h>
+#include <onyx/vm.h>
+
+/* Pages gathered per page table walk, they get moved to the youngest generation in one go */
+#define LRU_GEN_AGE_BATCH  64
+/* Pages looked at per page isolated, so a generation full of referenced pages doesn't hog the
+ * lock */
+#define LRU_GEN_SCAN_RATIO 4
+
+/* Serializes aging and switching LRU modes */
+static DECLARE_MUTEX(lru_gen_lock);
+/* Mode every LRU is in (or switching to), protected by lru_gen_lock */
+static bool lru_gen_enabled;
 
 static inline int page_to_state(struct page *page)
 {
     return page_flag_set(page, PAGE_FLAG_ANON) ? LRU_ANON_OFF : 0;
 }
 
+static inline int page_gen_type(struct page *page)
+{
+    return page_flag_set(page, PAGE_FLAG_ANON) ? LRU_GEN_ANON : LRU_GEN_FILE;
+}
+
+static inline int lru_gen_from_seq(unsigned long seq)
+{
+    return seq % LRU_GEN_NR;
+}
+
+/* Returns the page's generation, or -1 if it isn't in one */
+static inline int page_lru_gen(struct page *page)
+{
+    return (int) ((READ_ONCE(page->flags) & PAGE_FLAG_GEN_MASK) >> PAGE_FLAG_GEN_SHIFT) - 1;
+}
+
+static void page_set_gen(struct page *page, int gen)
+{
+    unsigned long old = READ_ONCE(page->flags), new;
+    do
+    {
+        new = (old & ~PAGE_FLAG_GEN_MASK) | ((unsigned long) (gen + 1) << PAGE_FLAG_GEN_SHIFT);
+    } while (!__atomic_compare_exchange_n(&page->flags, &old, new, false, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+}
+
+static bool lru_gen_is_live(struct page_lru *lru, int type, int gen)
+{
+    /* gen is alive if some sequence number in [min_seq, max_seq] maps to it */
+    unsigned long min_seq = lru->gen.min_seq[type];
+    unsigned long dist = (gen - lru_gen_from_seq(min_seq) + LRU_GEN_NR) % LRU_GEN_NR;
+    return dist <= lru->gen.max_seq - min_seq;
+}
+
+static void lru_gen_add(struct page_lru *lru, struct page *page, int gen, bool head)
+{
+    int type = page_gen_type(page);
+
+    page_set_gen(page, gen);
+    lru->gen.nr_pages[gen][type] += compound_nr(page);
+    if (head)
+        list_add(&page->lru_node, &lru->gen.lists[gen][type]);
+    else
+        list_add_tail(&page->lru_node, &lru->gen.lists[gen][type]);
+    inc_page_stat(page, NR_INACTIVE_FILE + page_to_state(page));
+}
+
+/* Take a page off whatever list it's on. Isolated pages remember their generation. */
+static void __page_lru_del(struct page_lru *lru, struct page *page)
+{
+    int gen = page_lru_gen(page);
+
+    list_remove(&page->lru_node);
+    if (gen >= 0)
+    {
+        lru->gen.nr_pages[gen][page_gen_type(page)] -= compound_nr(page);
+        dec_page_stat(page, NR_INACTIVE_FILE + page_to_state(page));
+    }
+    else if (page_flag_set(page, PAGE_FLAG_ACTIVE))
+        dec_page_stat(page, NR_ACTIVE_FILE + page_to_state(page));
+    else
+        dec_page_stat(page, NR_INACTIVE_FILE + page_to_state(page));
+}
+
+/* Put a page on the list it belongs to. Active pages go to the youngest generation, and pages that
+ * aren't in a (live) generation to the oldest one. */
+static void __page_lru_link(struct page_lru *lru, struct page *page)
+{
+    int state = page_to_state(page);
+    int list;
+
+    if (lru->gen_enabled)
+    {
+        int type = page_gen_type(page);
+        int gen = page_lru_gen(page);
+
+        if (page_test_clear_active(page))
+            gen = lru_gen_from_seq(lru->gen.max_seq);
+        else if (gen < 0 || !lru_gen_is_live(lru, type, gen))
+            gen = lru_gen_from_seq(lru->gen.min_seq[type]);
+        lru_gen_add(lru, page, gen, false);
+        return;
+    }
+
+    if (page_lru_gen(page) >= 0)
+        page_set_gen(page, -1);
+    list = page_flag_set(page, PAGE_FLAG_ACTIVE) ? LRU_ACTIVE_BASE : LRU_INACTIVE_BASE;
+    list_add_tail(&page->lru_node, &lru->lru_lists[list + state]);
+    inc_page_stat(page, NR_INACTIVE_FILE + list + state);
+}
+
 void page_add_lru(struct page *page)
 {
     DCHECK(!page_flag_set(page, PAGE_FLAG_LRU));
     struct page_lru *lru = page_to_page_lru(page);
-    inc_page_stat(page, NR_INACTIVE_FILE + page_to_state(page));
     spin_lock(&lru->lock);
-    list_add_tail(&page->lru_node, &lru->lru_lists[LRU_INACTIVE_BASE + page_to_state(page)]);
+    /* New pages are inactive, unless workingset_refault activated them */
+    __page_lru_link(lru, page);
     page_test_set_flag(page, PAGE_FLAG_LRU);
     spin_unlock(&lru->lock);
 }
 
+void page_add_lru_batch(struct page **pages, unsigned int nr)
+{
+    struct page_lru *lru = NULL;
+
+    /* Batches usually come from a single zone, so this takes the lock once */
+    for (unsigned int i = 0; i < nr; i++)
+    {
+        struct page *page = pages[i];
+        if (!page)
+            continue;
+        DCHECK(!page_flag_set(page, PAGE_FLAG_LRU));
+
+        if (page_to_page_lru(page) != lru)
+        {
+            if (lru)
+                spin_unlock(&lru->lock);
+            lru = page_to_page_lru(page);
+            spin_lock(&lru->lock);
+        }
+
+        __page_lru_link(lru, page);
+        page_test_set_flag(page, PAGE_FLAG_LRU);
+    }
+
+    if (lru)
+        spin_unlock(&lru->lock);
+}
+
 void page_remove_lru(struct page *page)
 {
     DCHECK(page_flag_set(page, PAGE_FLAG_LRU));
     struct page_lru *lru = page_to_page_lru(page);
     spin_lock(&lru->lock);
-    list_remove(&page->lru_node);
-    if (page_flag_set(page, PAGE_FLAG_ACTIVE))
-        dec_page_stat(page, NR_ACTIVE_FILE + page_to_state(page));
-    else
-        dec_page_stat(page, NR_INACTIVE_FILE + page_to_state(page));
+    __page_lru_del(lru, page);
     __atomic_and_fetch(&page->flags, ~PAGE_FLAG_LRU, __ATOMIC_RELEASE);
     spin_unlock(&lru->lock);
 }
 
+bool page_isolate_lru(struct page *page)
+{
+    struct page_lru *lru = page_to_page_lru(page);
+    bool isolated = false;
+
+    spin_lock(&lru->lock);
+    /* The LRU doesn't hold a reference, so the page may be getting freed (and is waiting on our
+     * lock to get off the LRU) */
+    if (page_flag_set(page, PAGE_FLAG_LRU) && page_try_get(page))
+    {
+        __page_lru_del(lru, page);
+        page_clear_lru(page);
+        isolated = true;
+    }
+
+    spin_unlock(&lru->lock);
+    return isolated;
+}
+
+void page_putback_lru(struct page *page)
+{
+    DCHECK(!page_flag_set(page, PAGE_FLAG_LRU));
+    struct page_lru *lru = page_to_page_lru(page);
+
+    spin_lock(&lru->lock);
+    __page_lru_link(lru, page);
+    page_set_lru(page);
+    spin_unlock(&lru->lock);
+}
+
+void page_lru_copy_gen(struct page *page, struct page *newpage)
+{
+    struct page_lru *lru = page_to_page_lru(page);
+    struct page_lru *newlru = page_to_page_lru(newpage);
+    unsigned long max_seq, min_seq, age;
+    int gen = page_lru_gen(page);
+
+    if (gen < 0)
+        return;
+
+    if (lru == newlru)
+    {
+        page_set_gen(newpage, gen);
+        return;
+    }
+
+    /* Generation numbers are per-LRU, so carry the page's age (distance from the youngest
+     * generation) over instead. These reads are racy, but an off-by-one generation is harmless. */
+    max_seq = READ_ONCE(lru->gen.max_seq);
+    age = (lru_gen_from_seq(max_seq) - gen + LRU_GEN_NR) % LRU_GEN_NR;
+
+    max_seq = READ_ONCE(newlru->gen.max_seq);
+    min_seq = READ_ONCE(newlru->gen.min_seq[page_gen_type(newpage)]);
+    page_set_gen(newpage, lru_gen_from_seq(max_seq - min_seq >= age ? max_seq - age : min_seq));
+}
+
+void __page_lru_putback(struct page_lru *lru, struct page *page, bool activate)
+{
+    if (activate)
+    {
+        page_set_active(page);
+        page_clear_referenced(page);
+        __atomic_add_fetch(&lru->nonresident_age, compound_nr(page), __ATOMIC_RELAXED);
+    }
+    else if (lru->gen_enabled)
+    {
+        /* Rotated pages go back to the oldest generation */
+        page_set_gen(page, -1);
+    }
+
+    __page_lru_link(lru, page);
+    page_set_lru(page);
+}
+
 static void page_activate(struct page *page)
 {
     struct page_lru *lru = page_to_page_lru(page);
+    bool active;
     spin_lock(&lru->lock);
 
+    /* Reclaim (or compaction) might've isolated it in the meanwhile */
+    if (!page_flag_set(page, PAGE_FLAG_LRU))
+        goto out;
+
     /* Setting ACTIVE is protected by the page_lru lock, so we shouldn't race here... */
-    if (!page_flag_set(page, PAGE_FLAG_ACTIVE))
+    if (lru->gen_enabled)
+        active = page_lru_gen(page) == lru_gen_from_seq(lru->gen.max_seq);
+    else
+        active = page_flag_set(page, PAGE_FLAG_ACTIVE);
+
+    if (!active)
     {
-        list_remove(&page->lru_node);
+        __page_lru_del(lru, page);
         page_set_flag(page, PAGE_FLAG_ACTIVE);
-        dec_page_stat(page, NR_INACTIVE_FILE + page_to_state(page));
-        inc_page_stat(page, NR_ACTIVE_FILE + page_to_state(page));
         __atomic_and_fetch(&page->flags, ~PAGE_FLAG_REFERENCED, __ATOMIC_RELEASE);
-        list_add_tail(&page->lru_node, &lru->lru_lists[LRU_ACTIVE_BASE + +page_to_state(page)]);
+        __atomic_add_fetch(&lru->nonresident_age, compound_nr(page), __ATOMIC_RELAXED);
+        __page_lru_link(lru, page);
     }
 
+out:
     spin_unlock(&lru->lock);
 }
 
@@ -62,7 +283,8 @@ void page_promote_referenced(struct page *page)
     /* Promote a page in the page LRUs. We go from (considering Active, Referenced) (0,0) -> (0, 1)
      * -> (1, 0) -> (1, 1). In reality we could interpret this as a generation counter. Some slight
      * imprecision is tolerated, so we can skip all sorts of awful locking or cmpxchg stuff we would
-     * need to pull off. */
+     * need to pull off. Large folios are on the LRU by their head. */
+    page = compound_head(page);
     if (!page_flag_set(page, PAGE_FLAG_REFERENCED))
     {
         /* go from unref'd, inactive to ref'd, inactive */
@@ -79,6 +301,7 @@ void page_promote_referenced(struct page *page)
 
 void page_lru_demote_reclaim(struct page *page)
 {
+    page = compound_head(page);
     struct page_lru *lru = page_to_page_lru(page);
 
     if (page_flag_set(page, PAGE_FLAG_DIRTY) || page_locked(page))
@@ -89,18 +312,308 @@ void page_lru_demote_reclaim(struct page *page)
 
     spin_lock(&lru->lock);
 
-    /* We _know_ we were in the lru. So remove ourselves and add ourselves to the head. Our page
-     * reference makes sure the page wasn't reused. */
-    list_remove(&page->lru_node);
-    list_add(&page->lru_node, &lru->lru_lists[LRU_INACTIVE_BASE + page_to_state(page)]);
+    /* We _know_ we were in the lru. So remove ourselves and add ourselves to the head (of the
+     * oldest generation, for the multi-gen LRU). Our page reference makes sure the page wasn't
+     * reused. */
+    __page_lru_del(lru, page);
+    page_clear_active(page);
+    if (lru->gen_enabled)
+        lru_gen_add(lru, page, lru_gen_from_seq(lru->gen.min_seq[page_gen_type(page)]), true);
+    else
+    {
+        list_add(&page->lru_node, &lru->lru_lists[LRU_INACTIVE_BASE + page_to_state(page)]);
+        inc_page_stat(page, NR_INACTIVE_FILE + page_to_state(page));
+    }
+
     page_set_lru(page);
+    spin_unlock(&lru->lock);
+}
 
-    if (page_test_active(page))
+unsigned long lru_gen_isolate(struct page_lru *lru, int type, struct list_head *page_list,
+                              unsigned long nr)
+{
+    struct lru_gen *lrugen = &lru->gen;
+    unsigned long scanned = 0, max_scan = nr * LRU_GEN_SCAN_RATIO;
+
+    while (nr > 0 && scanned < max_scan)
     {
-        dec_page_stat(page, NR_ACTIVE_FILE + page_to_state(page));
-        inc_page_stat(page, NR_INACTIVE_FILE + page_to_state(page));
+        unsigned long min_seq = lrugen->min_seq[type];
+        int gen = lru_gen_from_seq(min_seq);
+        int next_gen = lru_gen_from_seq(min_seq + 1);
+
+        /* The youngest generations can only be evicted after aging */
+        if (lrugen->max_seq - min_seq + 1 <= LRU_GEN_MIN)
+            break;
+
+        if (list_is_empty(&lrugen->lists[gen][type]))
+        {
+            DCHECK(lrugen->nr_pages[gen][type] == 0);
+            lrugen->min_seq[type]++;
+            continue;
+        }
+
+        list_for_every_safe (&lrugen->lists[gen][type])
+        {
+            struct page *page = container_of(l, struct page, lru_node);
+            unsigned long nr_pages = compound_nr(page);
+            scanned += nr_pages;
+
+            if (page_flag_set(page, PAGE_FLAG_REFERENCED))
+            {
+                /* Accessed through read/write (or found young by reclaim) since it got here. Give
+                 * it another generation. */
+                page_clear_referenced(page);
+                __page_lru_del(lru, page);
+                lru_gen_add(lru, page, next_gen, false);
+            }
+            else
+            {
+                page_ref(page);
+                DCHECK(page->ref > 1);
+                __page_lru_del(lru, page);
+                page_clear_lru(page);
+                list_add_tail(&page->lru_node, page_list);
+                nr -= min(nr, nr_pages);
+            }
+
+            if (!nr || scanned >= max_scan)
+                break;
+        }
     }
 
-    page_clear_active(page);
+    return scanned;
+}
+
+bool lru_gen_needs_aging(struct page_lru *lru, int type)
+{
+    unsigned long min_seq = READ_ONCE(lru->gen.min_seq[type]);
+    unsigned long max_seq = READ_ONCE(lru->gen.max_seq);
+    unsigned long nr = 0;
+
+    if (!READ_ONCE(lru->gen_enabled) || max_seq - min_seq + 1 > LRU_GEN_MIN)
+        return false;
+
+    /* No point in aging if there's nothing to evict */
+    for (unsigned long seq = min_seq; seq <= max_seq; seq++)
+        nr += READ_ONCE(lru->gen.nr_pages[lru_gen_from_seq(seq)][type]);
+    return nr > 0;
+}
+
+static void lru_gen_fold_oldest(struct page_lru *lru, int type)
+{
+    /* Out of generations: fold the oldest generation into the next one. Its pages go to the head,
+     * as they are still older than the rest. */
+    struct lru_gen *lrugen = &lru->gen;
+    int old = lru_gen_from_seq(lrugen->min_seq[type]);
+    int next = lru_gen_from_seq(lrugen->min_seq[type] + 1);
+
+    list_for_every (&lrugen->lists[old][type])
+        page_set_gen(container_of(l, struct page, lru_node), next);
+    list_splice(&lrugen->lists[old][type], &lrugen->lists[next][type]);
+    INIT_LIST_HEAD(&lrugen->lists[old][type]);
+    lrugen->nr_pages[next][type] += lrugen->nr_pages[old][type];
+    lrugen->nr_pages[old][type] = 0;
+    lrugen->min_seq[type]++;
+}
+
+static void lru_gen_inc_max_seq(struct page_lru *lru)
+{
+    struct lru_gen *lrugen = &lru->gen;
+
+    spin_lock(&lru->lock);
+    if (!lru->gen_enabled)
+        goto out;
+
+    for (int type = 0; type < LRU_GEN_TYPES; type++)
+    {
+        if (lrugen->max_seq - lrugen->min_seq[type] + 1 == LRU_GEN_NR)
+            lru_gen_fold_oldest(lru, type);
+    }
+
+    lrugen->max_seq++;
+out:
     spin_unlock(&lru->lock);
 }
+
+static unsigned long lru_gen_promote(struct page **pages, unsigned int nr)
+{
+    struct page_lru *lru = NULL;
+    unsigned long promoted = 0;
+
+    for (unsigned int i = 0; i < nr; i++)
+    {
+        struct page *page = pages[i];
+        struct page_lru *plru = page_to_page_lru(page);
+        int youngest;
+
+        if (plru != lru)
+        {
+            if (lru)
+                spin_unlock(&lru->lock);
+            lru = plru;
+            spin_lock(&lru->lock);
+        }
+
+        /* Not ours to move if it was isolated (or never on the LRU, e.g hugetlb pages) */
+        if (!lru->gen_enabled || !page_flag_set(page, PAGE_FLAG_LRU))
+            continue;
+
+        youngest = lru_gen_from_seq(lru->gen.max_seq);
+        if (page_lru_gen(page) == youngest)
+            continue;
+
+        __page_lru_del(lru, page);
+        page_clear_referenced(page);
+        lru_gen_add(lru, page, youngest, false);
+        promoted++;
+    }
+
+    if (lru)
+        spin_unlock(&lru->lock);
+
+    /* The LRU lock *is not held*, these might free the page */
+    for (unsigned int i = 0; i < nr; i++)
+        page_unref(pages[i]);
+    return promoted;
+}
+
+static unsigned long lru_gen_age_mm(struct mm_address_space *mm, struct page **pages)
+{
+    struct vm_area_struct *vma;
+    unsigned long index = 0, aged = 0;
+
+    /* We might be in direct reclaim, with this address space's vm_lock held for writing. Don't
+     * wait for it. */
+    if (rw_lock_tryread(&mm->vm_lock) < 0)
+        return 0;
+
+    mt_for_each (&mm->region_tree, vma, index, -1UL)
+    {
+        unsigned long addr = vma->vm_start;
+        unsigned int nr;
+
+        if (vma_is_pfnmap(vma))
+            continue;
+
+        while (addr < vma->vm_end)
+        {
+            addr = vm_gather_young_pages(mm, addr, vma->vm_end, pages, &nr, LRU_GEN_AGE_BATCH);
+            aged += lru_gen_promote(pages, nr);
+        }
+    }
+
+    rw_unlock_read(&mm->vm_lock);
+    return aged;
+}
+
+unsigned long lru_gen_age(struct page_lru *lru, bool anon)
+{
+    struct page *pages[LRU_GEN_AGE_BATCH];
+    struct mm_address_space *mm = NULL;
+    struct page_zone *zone;
+    unsigned long aged = 0;
+    int nid;
+
+    mutex_lock(&lru_gen_lock);
+    /* Someone else might've aged the LRUs while we waited for the lock */
+    if (!lru_gen_needs_aging(lru, LRU_GEN_FILE) &&
+        !(anon && lru_gen_needs_aging(lru, LRU_GEN_ANON)))
+        goto out;
+
+    /* Pages are found through page tables, which don't care about zones. Age every LRU. */
+    for_each_online_node(nid)
+    {
+        for_zones_in_node(page_node_of(nid), zone)
+            lru_gen_inc_max_seq(&zone->zone_lru);
+    }
+
+    while ((mm = mm_list_next(mm)))
+        aged += lru_gen_age_mm(mm, pages);
+out:
+    mutex_unlock(&lru_gen_lock);
+    return aged;
+}
+
+static void lru_gen_convert(struct page_lru *lru, bool enable)
+{
+    struct lru_gen *lrugen = &lru->gen;
+
+    spin_lock(&lru->lock);
+    if (lru->gen_enabled == enable)
+        goto out;
+
+    /* Note that we don't touch PAGE_FLAG_LRU, see page_lru_demote_reclaim */
+    lru->gen_enabled = enable;
+    if (enable)
+    {
+        /* Active pages go to the youngest generation, inactive pages to the oldest one */
+        for (int i = 0; i < NR_LRU_LISTS; i++)
+        {
+            list_for_every_safe (&lru->lru_lists[i])
+            {
+                struct page *page = container_of(l, struct page, lru_node);
+                __page_lru_del(lru, page);
+                __page_lru_link(lru, page);
+            }
+        }
+
+        goto out;
+    }
+
+    for (int type = 0; type < LRU_GEN_TYPES; type++)
+    {
+        /* The youngest generation goes to the active list, the rest to the inactive one */
+        for (unsigned long seq = lrugen->min_seq[type]; seq <= lrugen->max_seq; seq++)
+        {
+            list_for_every_safe (&lrugen->lists[lru_gen_from_seq(seq)][type])
+            {
+                struct page *page = container_of(l, struct page, lru_node);
+                __page_lru_del(lru, page);
+                if (seq == lrugen->max_seq)
+                    page_set_active(page);
+                __page_lru_link(lru, page);
+            }
+        }
+
+        lrugen->min_seq[type] = lrugen->max_seq - LRU_GEN_MIN + 1;
+    }
+
+out:
+    spin_unlock(&lru->lock);
+}
+
+void lru_gen_set_enabled(bool enabled)
+{
+    struct page_zone *zone;
+    int nid;
+
+    mutex_lock(&lru_gen_lock);
+    WRITE_ONCE(lru_gen_enabled, enabled);
+    for_each_online_node(nid)
+    {
+        for_zones_in_node(page_node_of(nid), zone)
+            lru_gen_convert(&zone->zone_lru, enabled);
+    }
+
+    mutex_unlock(&lru_gen_lock);
+}
+
+ssize_t lru_gen_enabled_sysfs_read(void *buffer, size_t size, off_t off)
+{
+    char buf[8];
+    size_t len = snprintf(buf, sizeof(buf), "%d\n", READ_ONCE(lru_gen_enabled));
+    return sysfs_read_buf(buf, len, buffer, size, off);
+}
+
+ssize_t lru_gen_enabled_sysfs_write(void *buffer, size_t size, off_t off)
+{
+    unsigned long val;
+    int err = sysfs_parse_ulong(buffer, size, &val);
+    if (err < 0)
+        return err;
+    if (val > 1)
+        return -EINVAL;
+
+    lru_gen_set_enabled(val);
+    return size;
+}
@@ -16,13 +16,21 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <onyx/clock.h>
 #include <onyx/copy.h>
+#include <onyx/cpu.h>
 #include <onyx/init.h>
+#include <onyx/mm/alloc_profile.h>
+#include <onyx/mm/compaction.h>
+#include <onyx/mm/hugetlb.h>
 #include <onyx/mm/kasan.h>
+#include <onyx/mm/mempolicy.h>
+#include <onyx/mm/numa.h>
 #include <onyx/mm/page_lru.h>
 #include <onyx/mm/page_node.h>
 #include <onyx/mm/page_zone.h>
 #include <onyx/mm/reclaim.h>
+#include <onyx/mm/zero_pool.h>
 #include <onyx/modules.h>
 #include <onyx/page.h>
 #include <onyx/pagecache.h>
@@ -87,44 +95,51 @@ static struct pagedaemon_data
     unsigned long reclaim_seq;
     unsigned long request_seq;
     thread_t *paged_thread;
-} paged_data;
+} paged_data[MAX_NUMNODES];
 
-static unsigned long wake_up_pagedaemon(int order, int attempt = -1)
+/* One pagedaemon per NUMA node, each reclaiming its own node's zones */
+static unsigned long wake_up_pagedaemon(int nid, int order, int attempt = -1)
 {
-    if (paged_data.order < order)
-        __atomic_store_n(&paged_data.order, order, __ATOMIC_RELAXED);
-    if (paged_data.attempt < attempt)
-        __atomic_store_n(&paged_data.attempt, attempt, __ATOMIC_RELAXED);
-    unsigned long our_seq = __atomic_add_fetch(&paged_data.request_seq, 1, __ATOMIC_RELEASE);
-    wait_queue_wake_all(&paged_data.paged_queue);
+    struct pagedaemon_data *pd = &paged_data[nid];
+    if (pd->order < order)
+        __atomic_store_n(&pd->order, order, __ATOMIC_RELAXED);
+    if (pd->attempt < attempt)
+        __atomic_store_n(&pd->attempt, attempt, __ATOMIC_RELAXED);
+    unsigned long our_seq = __atomic_add_fetch(&pd->request_seq, 1, __ATOMIC_RELEASE);
+    wait_queue_wake_all(&pd->paged_queue);
     return our_seq;
 }
 
-static bool page_has_low_memory();
+static bool page_has_low_memory(struct page_node *node);
 
 #define PAGEDAEMON_THROTTLE_MS 5000
 
-static void pagedaemon(void * /*arg*/)
+static void pagedaemon(void *arg)
 {
     /* This thread is responsible for asynchronous reclamation of memory in low memory conditions.
      * It is woken up when a zone reaches the low watermark, and sleeps after every zone reached the
      * high watermark.
      */
+    int nid = (int) (unsigned long) arg;
+    struct pagedaemon_data *pd = &paged_data[nid];
+    struct page_node *node = page_node_of(nid);
+
     for (;;)
     {
-        wait_for_event(&paged_data.paged_queue, paged_data.request_seq > paged_data.reclaim_seq);
+        wait_for_event(&pd->paged_queue, pd->request_seq > pd->reclaim_seq);
 
         int i = 0;
-        if (!page_has_low_memory())
+        if (!page_has_low_memory(node))
             goto wake;
         /* Attempt to do reclaim a handful of times */
         for (i = 0; i < 4; i++)
         {
             struct reclaim_data data;
-            data.attempt = paged_data.attempt + i;
-            data.failed_order = paged_data.order;
+            data.attempt = pd->attempt + i;
+            data.failed_order = pd->order;
             data.gfp_flags = GFP_KERNEL;
             data.mode = RECLAIM_MODE_PAGEDAEMON;
+            data.node = node;
             int st = page_do_reclaim(&data);
 
             if (st == 0)
@@ -132,9 +147,9 @@ static void pagedaemon(void * /*arg*/)
         }
 
     wake:
-        __atomic_store_n(&paged_data.reclaim_seq, paged_data.request_seq, __ATOMIC_RELEASE);
+        __atomic_store_n(&pd->reclaim_seq, pd->request_seq, __ATOMIC_RELEASE);
         /* Wake up anyone that may potentially be waiting for us */
-        wait_queue_wake_all(&paged_data.paged_waiters_queue);
+        wait_queue_wake_all(&pd->paged_waiters_queue);
 
         if (i == 4)
         {
@@ -144,13 +159,15 @@ static void pagedaemon(void * /*arg*/)
     }
 }
 
-static void do_direct_reclaim(int order, int attempt, unsigned int gfp_flags)
+static void do_direct_reclaim(int order, int attempt, unsigned int gfp_flags,
+                              struct page_node *node)
 {
     struct reclaim_data data;
     data.attempt = attempt;
     data.failed_order = order;
     data.gfp_flags = gfp_flags;
     data.mode = RECLAIM_MODE_DIRECT;
+    data.node = node;
     pr_info("pagealloc: Doing direct reclaim: order %d, attempt %d, gfp_flags %x\n", order, attempt,
             gfp_flags);
     page_do_reclaim(&data);
@@ -226,7 +243,7 @@ out:
         zone->total_pages - zone->used_pages <= zone->low_watermark)
     {
         /* Memory is getting low in this zone, preemptively wake up pagedaemon */
-        wake_up_pagedaemon(0);
+        wake_up_pagedaemon(zone->node, 0);
     }
 
     return pages;
@@ -316,7 +333,7 @@ struct page *page_zone_alloc(struct page_zone *zone, unsigned int gfp_flags, uns
     return page_zone_alloc_core(zone, gfp_flags, order);
 }
 
-static bool page_zone_may_alloc(struct page_zone *zone, gfp_t gfp, unsigned int order)
+bool page_zone_may_alloc(struct page_zone *zone, gfp_t gfp, unsigned int order)
 {
     bool may = false;
     unsigned long flags = spin_lock_irqsave(&zone->lock);
@@ -352,18 +369,21 @@ out:
 
 static void page_zone_add(unsigned long start, unsigned int order, struct page_zone *zone)
 {
-    scoped_lock g{zone->lock};
-
     auto nr_pages = pow2(order);
+
+    /* Nobody can see these pages yet, so initialize them outside the lock. This may run with
+     * interrupts enabled, in parallel with other CPUs (see deferred page init). */
     for (unsigned long i = 0; i < nr_pages; i++)
     {
         // Initalize all struct pages
         page_add_page((void *) (start + (i << PAGE_SHIFT)));
     }
 
-    zone->total_pages += nr_pages;
     struct page *headpage = phys_to_page(start);
     page_make_buddy(headpage, order);
+
+    scoped_lock<spinlock, true> g{zone->lock};
+    zone->total_pages += nr_pages;
     list_add_tail(&headpage->page_allocator_node.list_node, &zone->pages[order]);
 }
 
@@ -413,7 +433,7 @@ __always_inline struct page *get_buddy(struct page *page, unsigned int order, pa
     // Check if we can indeed merge with a buddy. if so
     // 1) the buddy is not past maxpfn (phys_to_page_mayfail)
     // 2) the buddy is free and the same order as us
-    // 3) the buddy is in the same zone
+    // 3) the buddy is in the same zone (and NUMA node)
 
     struct page *p = phys_to_page_mayfail(addr2);
     if (!p) [[unlikely]]
@@ -422,6 +442,8 @@ __always_inline struct page *get_buddy(struct page *page, unsigned int order, pa
         return nullptr;
     if (addr2 < zone->start || addr2 > zone->end)
         return nullptr;
+    if (!numa_single_node() && phys_to_nid(addr2) != zone->node)
+        return nullptr;
     return p;
 }
 
@@ -481,6 +503,27 @@ static void page_zone_drain_pcpu_local(page_zone *zone)
     queue->nr_queue_reclaims++;
 }
 
+unsigned long page_zone_free_pages_order(struct page_zone *zone, unsigned int order)
+{
+    unsigned long nr = 0;
+    scoped_lock<spinlock, true> g{zone->lock};
+
+    for (unsigned int i = order; i < PAGEALLOC_NR_ORDERS; i++)
+    {
+        list_for_every (&zone->pages[i])
+            nr += pow2(i);
+    }
+
+    return nr;
+}
+
+void page_zone_drain_pcpu(struct page_zone *zone)
+{
+    auto flags = irq_save_and_disable();
+    page_zone_drain_pcpu_local(zone);
+    irq_restore(flags);
+}
+
 void page_zone_free(page_zone *zone, struct page *page, unsigned int order)
 {
     if (order == 0) [[likely]]
@@ -507,7 +550,7 @@ void page_zone_free(page_zone *zone, struct page *page, unsigned int order)
 
 static bool page_is_initialized = false;
 
-page_node main_node;
+page_node page_nodes[MAX_NUMNODES];
 
 struct page_zone *page_node::pick_zone(unsigned long page)
 {
@@ -516,12 +559,17 @@ struct page_zone *page_node::pick_zone(unsigned long page)
     return &zones[ZONE_NORMAL];
 }
 
+int page_to_nid(struct page *page)
+{
+    return phys_to_nid((unsigned long) page_to_phys(page));
+}
+
 struct page_lru *page_to_page_lru(struct page *page)
 {
-    return &main_node.pick_zone((unsigned long) page_to_phys(page))->zone_lru;
+    return &page_nodes[page_to_nid(page)].pick_zone((unsigned long) page_to_phys(page))->zone_lru;
 }
 
-void page_node::add_region(uintptr_t base, size_t size)
+void page_node::add_region(uintptr_t base, size_t size, bool verbose)
 {
     if (size <= PAGE_SIZE)
         return;
@@ -531,7 +579,9 @@ void page_node::add_region(uintptr_t base, size_t size)
 
     size &= -PAGE_SIZE;
 
-    printf("pagealloc: Adding region %lx, %016lx\n", base, base + size - 1);
+    if (verbose)
+        printf("pagealloc: Adding region %lx, %016lx (node %d)\n", base, base + size - 1, nid);
+    __atomic_add_fetch(&total_pages, size >> PAGE_SHIFT, __ATOMIC_RELAXED);
 
     while (size)
     {
@@ -539,34 +589,227 @@ void page_node::add_region(uintptr_t base, size_t size)
         struct page_zone *zone = pick_zone(base);
 
         unsigned long start = base;
-        unsigned long end = cul::clamp(start + size, zone->end) + 1;
+        unsigned long end = cul::clamp(start + size - 1, zone->end) + 1;
         unsigned long nr_pages = (end - start) >> PAGE_SHIFT;
-        printf("pagealloc: Adding [%016lx, %016lx] to zone %s\n", start, end - 1, zone->name);
+        if (verbose)
+            printf("pagealloc: Adding [%016lx, %016lx] to zone %s\n", start, end - 1, zone->name);
 #ifdef CONFIG_KASAN
-        kasan_set_state((unsigned long *) PHYS_TO_VIRT(base), size, 1);
+        kasan_set_state((unsigned long *) PHYS_TO_VIRT(start), end - start, 1);
 #endif
         page_zone_add_region(start, nr_pages, zone);
         nr_global_pages.add_fetch(nr_pages, mem_order::release);
-        start = end;
+        base = end;
         size -= nr_pages << PAGE_SHIFT;
     }
 }
 
+/*
+ * Deferred struct page initialization. Initializing every struct page takes a long time on large
+ * machines, and page_init runs on the boot CPU, way before SMP is up. So page_init only sets up
+ * the first PAGE_EAGER_INIT_SIZE bytes of every node, and page_deferred_init initializes the rest
+ * on every CPU once they're up, one section at a time. If the allocator runs dry in the meantime,
+ * it initializes sections itself (see page_deferred_grow).
+ *
+ * Deferred ranges are always made of whole sections, so the buddy allocator never looks at
+ * a struct page that hasn't been initialized yet (buddies never cross a section).
+ */
+#define PAGE_SECTION_SHIFT       27
+#define PAGE_SECTION_SIZE        (1UL << PAGE_SECTION_SHIFT)
+#define PAGE_EAGER_INIT_SIZE     (256UL << 20)
+#define PAGE_DEFERRED_MAX_RANGES 128
+
+static_assert(PAGEALLOC_NR_ORDERS - 1 + PAGE_SHIFT <= PAGE_SECTION_SHIFT,
+              "max order blocks can't be larger than a section");
+
+struct page_deferred_range
+{
+    unsigned long start;
+    unsigned long end;
+    int nid;
+};
+
+static constinit struct
+{
+    struct page_deferred_range ranges[PAGE_DEFERRED_MAX_RANGES]{};
+    unsigned int nr_ranges{};
+    /* Sections cover [base, base + (nr_sections << PAGE_SECTION_SHIFT)) */
+    unsigned long base{};
+    unsigned long nr_sections{};
+    unsigned long next_section{};
+    unsigned long sections_done{};
+    unsigned long nr_pages{};
+    struct wait_queue wq;
+} deferred;
+
+static unsigned long eager_init_left[MAX_NUMNODES];
+
+static void page_add_node_region(int nid, unsigned long base, size_t size)
+{
+    unsigned long end = base + size;
+    /* Only whole sections are deferred, the head and tail are initialized right away */
+    unsigned long dstart = ALIGN_TO(base + cul::min(size, eager_init_left[nid]), PAGE_SECTION_SIZE);
+    unsigned long dend = end & -PAGE_SECTION_SIZE;
+
+    if (dstart >= dend || deferred.nr_ranges == PAGE_DEFERRED_MAX_RANGES)
+    {
+        eager_init_left[nid] -= cul::min(size, eager_init_left[nid]);
+        page_nodes[nid].add_region(base, size);
+        return;
+    }
+
+    eager_init_left[nid] = 0;
+    if (dstart > base)
+        page_nodes[nid].add_region(base, dstart - base);
+    if (end > dend)
+        page_nodes[nid].add_region(dend, end - dend);
+
+    printf("pagealloc: Deferring [%016lx, %016lx] (node %d)\n", dstart, dend - 1, nid);
+    deferred.ranges[deferred.nr_ranges++] = {dstart, dend, nid};
+    deferred.nr_pages += (dend - dstart) >> PAGE_SHIFT;
+}
+
+/**
+ * @brief Hand a physical memory region to the page allocator, splitting it between NUMA nodes
+ *
+ * @param base Start of the region
+ * @param size Size of the region
+ */
+static void page_add_region(unsigned long base, size_t size)
+{
+    while (size)
+    {
+        unsigned long end = numa_memblk_end(base);
+        size_t len = end - base < size ? end - base : size;
+        page_add_node_region(phys_to_nid(base), base, len);
+        base += len;
+        size -= len;
+    }
+}
+
+static void page_deferred_setup()
+{
+    unsigned long start = ~0UL, end = 0;
+
+    if (!deferred.nr_ranges)
+        return;
+
+    for (unsigned int i = 0; i < deferred.nr_ranges; i++)
+    {
+        start = cul::min(start, deferred.ranges[i].start);
+        end = cul::max(end, deferred.ranges[i].end);
+    }
+
+    deferred.base = start;
+    deferred.nr_sections = (end - start) >> PAGE_SECTION_SHIFT;
+    printf("pagealloc: Initialized %lu pages at boot, deferred %lu\n",
+           nr_global_pages.load(mem_order::relaxed), deferred.nr_pages);
+}
+
+/**
+ * @brief Claim the next deferred section and initialize its struct pages
+ *
+ * @param added Mask of nodes that got memory
+ * @return False if there was nothing left to claim, else true
+ */
+static bool page_deferred_init_section(nodemask_t *added)
+{
+    unsigned long sec, start;
+
+    if (__atomic_load_n(&deferred.next_section, __ATOMIC_RELAXED) >= deferred.nr_sections)
+        return false;
+    sec = __atomic_fetch_add(&deferred.next_section, 1, __ATOMIC_RELAXED);
+    if (sec >= deferred.nr_sections)
+        return false;
+
+    start = deferred.base + (sec << PAGE_SECTION_SHIFT);
+    for (unsigned int i = 0; i < deferred.nr_ranges; i++)
+    {
+        struct page_deferred_range *range = &deferred.ranges[i];
+        /* Sections belong to a single range (or none, if it's a hole) */
+        if (start < range->start || start >= range->end)
+            continue;
+        page_nodes[range->nid].add_region(start, PAGE_SECTION_SIZE, false);
+        *added |= NODE_MASK(range->nid);
+        break;
+    }
+
+    if (__atomic_add_fetch(&deferred.sections_done, 1, __ATOMIC_RELEASE) == deferred.nr_sections)
+        wait_queue_wake_all(&deferred.wq);
+    return true;
+}
+
+/**
+ * @brief Initialize deferred sections until one of the allowed nodes gets more memory
+ * Called by the allocator when it runs out of memory before page_deferred_init is done.
+ *
+ * @param allowed Nodes we want memory for
+ * @return True if we added memory to an allowed node, false if there's nothing left to add
+ */
+static bool page_deferred_grow(nodemask_t allowed)
+{
+    nodemask_t added = 0;
+
+    while (!(added & allowed))
+    {
+        if (!page_deferred_init_section(&added))
+            return false;
+    }
+
+    return true;
+}
+
+static void page_deferred_worker(void *arg)
+{
+    nodemask_t added = 0;
+    while (page_deferred_init_section(&added))
+        ;
+}
+
+void page_node::build_fallback()
+{
+    nr_fallback = 0;
+    for (int i = 0; i < (int) nr_numa_nodes; i++)
+    {
+        /* Insertion sort by distance. We're always the closest. */
+        unsigned int j = nr_fallback++;
+        for (; j > 0 && node_distance(nid, fallback[j - 1]) > node_distance(nid, i); j--)
+            fallback[j] = fallback[j - 1];
+        fallback[j] = i;
+    }
+}
+
 template <typename Callable>
 bool for_every_node(Callable c)
 {
-    return c(main_node);
+    for (unsigned int i = 0; i < nr_numa_nodes; i++)
+    {
+        if (!c(page_nodes[i]))
+            return false;
+    }
+
+    return true;
 }
 
-static bool page_has_low_memory()
+static bool page_has_low_memory(struct page_node *node)
 {
     bool result = false;
-    for_every_node([&](page_node &node) -> bool {
-        return node.for_every_zone([&](page_zone *zone) -> bool {
-            unsigned long freep = zone->total_pages - zone->used_pages;
-            result = result ? true : freep < zone->low_watermark;
-            return !result; /* if we found a low mem zone, break the iteration */
-        });
+    node->for_every_zone([&](page_zone *zone) -> bool {
+        unsigned long freep = zone->total_pages - zone->used_pages;
+        result = result ? true : freep < zone->low_watermark;
+        return !result; /* if we found a low mem zone, break the iteration */
+    });
+    return result;
+}
+
+static unsigned long node_pages_under_high_watermark(page_node &node)
+{
+    unsigned long result = 0;
+    node.for_every_zone([&](page_zone *zone) -> bool {
+        unsigned long freep = zone->total_pages - zone->used_pages;
+
+        if (freep <= zone->low_watermark)
+            result += zone->high_watermark - freep;
+        return true;
     });
     return result;
 }
@@ -580,13 +823,8 @@ unsigned long pages_under_high_watermark()
 {
     unsigned long result = 0;
     for_every_node([&](page_node &node) -> bool {
-        return node.for_every_zone([&](page_zone *zone) -> bool {
-            unsigned long freep = zone->total_pages - zone->used_pages;
-
-            if (freep <= zone->low_watermark)
-                result += zone->high_watermark - freep;
-            return false;
-        });
+        result += node_pages_under_high_watermark(node);
+        return true;
     });
     return result;
 }
@@ -615,7 +853,14 @@ static void page_set_watermarks()
 
 void page_init(size_t memory_size, unsigned long maxpfn)
 {
-    main_node.init();
+    numa_init();
+    for (unsigned int i = 0; i < nr_numa_nodes; i++)
+        page_nodes[i].init(i);
+    for (unsigned int i = 0; i < nr_numa_nodes; i++)
+    {
+        page_nodes[i].build_fallback();
+        eager_init_left[i] = PAGE_EAGER_INIT_SIZE;
+    }
 
     printf("page: Memory size: %lu\n", memory_size);
     page_memory_size = memory_size;
@@ -637,9 +882,11 @@ void page_init(size_t memory_size, unsigned long maxpfn)
         /* page_add_region can't return an error value since it halts
          * on failure
          */
-        main_node.add_region(start, size);
+        page_add_region(start, size);
     });
 
+    page_deferred_setup();
+
     min_free_kbytes =
         cul::max(min_free_kbytes, page_memory_size / 1024 / 60 /* 1.6% of the whole memory */);
 
@@ -648,6 +895,46 @@ void page_init(size_t memory_size, unsigned long maxpfn)
     page_is_initialized = true;
 }
 
+/**
+ * @brief Initialize the struct pages page_init left behind, using every CPU
+ * Runs as soon as we can create threads, and waits for every section to be done, so the rest of
+ * the kernel (and userspace) sees all of memory.
+ */
+static void page_deferred_init()
+{
+    unsigned int cpu = get_cpu_nr();
+    unsigned int nr_threads = 1;
+    hrtime_t start;
+
+    if (!deferred.nr_sections)
+        return;
+
+    start = clocksource_get_time();
+    for (unsigned int i = 0; i < get_nr_cpus(); i++)
+    {
+        if (i == cpu)
+            continue;
+        /* If we can't create a thread, we'll just do more of the work ourselves */
+        struct thread *t = sched_create_thread(page_deferred_worker, THREAD_KERNEL, nullptr);
+        if (!t)
+            continue;
+        sched_start_thread_for_cpu(t, i);
+        nr_threads++;
+    }
+
+    page_deferred_worker(nullptr);
+    wait_for_event(&deferred.wq, __atomic_load_n(&deferred.sections_done, __ATOMIC_ACQUIRE) ==
+                                     deferred.nr_sections);
+
+    pr_info("pagealloc: Initialized %lu deferred pages on %u threads in %lu ms\n",
+            deferred.nr_pages, nr_threads, (clocksource_get_time() - start) / NS_PER_MS);
+
+    /* Watermarks were set with a fraction of the memory, redo them */
+    page_set_watermarks();
+}
+
+INIT_LEVEL_CORE_AFTER_SCHED_ENTRY(page_deferred_init);
+
 size_t page_get_used_pages()
 {
     unsigned long used_pages = 0;
@@ -758,11 +1045,18 @@ static void debug_page(const char *message, struct page *page)
 void free_page(struct page *p)
 {
     assert(p != NULL);
+    p = compound_head(p);
     PAGE_CHECK(p->ref != 0, p);
 
     if (__page_unref(p) == 0)
     {
-        main_node.free_page(p);
+        if (unlikely(p->flags & PAGE_FLAG_HUGETLB))
+        {
+            hugetlb_free_page(p);
+            return;
+        }
+
+        page_nodes[page_to_nid(p)].free_page(p);
         // printf("free pages %p, %p\n", page_to_phys(p), __builtin_return_address(0));
     }
 #if 0
@@ -773,14 +1067,21 @@ void free_page(struct page *p)
 #endif
 }
 
-struct page *page_node::allocate_pages(size_t nr_pgs, unsigned long flags)
+static struct page *alloc_pages_ip(unsigned int order, unsigned long flags, unsigned long ip)
+{
+    if (!numa_single_node())
+        return alloc_pages_current(order, flags, ip);
+    return __alloc_pages_caller(order, flags, 0, ~0UL, ip);
+}
+
+static struct page *allocate_pages(size_t nr_pgs, unsigned long flags, unsigned long ip)
 {
     struct page *plist = NULL;
     struct page *ptail = NULL;
 
     for (size_t i = 0; i < nr_pgs; i++)
     {
-        struct page *p = alloc_order(0, flags);
+        struct page *p = alloc_pages_ip(0, flags, ip);
 
         if (!p)
         {
@@ -839,19 +1140,206 @@ __always_inline void prepare_pages_after_alloc(struct page *page, unsigned int o
     }
 }
 
+unsigned long page_zone_isolate_free(struct page_zone *zone, unsigned long start_pfn,
+                                     unsigned long end_pfn, unsigned int max_order,
+                                     struct list_head *list, unsigned long nr)
+{
+    unsigned long isolated = 0;
+    scoped_lock<spinlock, true> g{zone->lock};
+
+    for (unsigned long pfn = start_pfn; pfn < end_pfn && isolated < nr;)
+    {
+        struct page *page = phys_to_page(pfn_to_paddr(pfn));
+        if (!page_is_buddy(page))
+        {
+            pfn++;
+            continue;
+        }
+
+        unsigned long order = page->priv;
+        unsigned long nr_pages = pow2(order);
+        /* Leave the large blocks alone, those are what the caller is trying to create */
+        if (order >= max_order || pfn + nr_pages > end_pfn)
+        {
+            pfn += nr_pages;
+            continue;
+        }
+
+        /* Don't eat into the reserves */
+        if (zone->total_pages - zone->used_pages < zone->low_watermark + nr_pages)
+            break;
+
+        page_debuddy(page);
+        list_remove(&page->page_allocator_node.list_node);
+        zone->used_pages += nr_pages;
+
+        for (unsigned long i = 0; i < nr_pages; i++)
+        {
+            prepare_pages_after_alloc(page + i, 0, PAGE_ALLOC_NO_ZERO);
+            list_add_tail(&page[i].lru_node, list);
+        }
+
+        isolated += nr_pages;
+        pfn += nr_pages;
+    }
+
+    return isolated;
+}
+
+static void prep_compound_page(struct page *page, unsigned int order)
+{
+    page->flags |= PAGE_FLAG_HEAD;
+    page->next_un.next_allocation = nullptr;
+
+    for (unsigned long i = 1; i < pow2(order); i++)
+    {
+        struct page *tail = page + i;
+        /* Tails don't hold references, the head does */
+        __atomic_store_n(&tail->ref, 0, __ATOMIC_RELAXED);
+        tail->flags = PAGE_FLAG_TAIL;
+        tail->compound.head = page;
+    }
+
+    page[1].compound.order = order;
+}
+
+struct page *page_node::alloc_order(unsigned int order, unsigned long flags)
+{
+    int zone = ZONE_NORMAL;
+
+    if (flags & PAGE_ALLOC_4GB_LIMIT)
+        zone = ZONE_DMA32;
+
+    while (zone >= 0)
+    {
+        struct page *page = page_zone_alloc(&zones[zone], flags, order);
+        if (page)
+            return page;
+        zone--;
+    }
+
+    return nullptr;
+}
+
+static struct page *alloc_pages_fallback(page_node *node, unsigned int order, unsigned long flags,
+                                         nodemask_t allowed)
+{
+    if (flags & __GFP_THISNODE)
+        return node->alloc_order(order, flags);
+
+    for (unsigned int i = 0; i < node->nr_fallback; i++)
+    {
+        int nid = node->fallback[i];
+        if (!(allowed & NODE_MASK(nid)))
+            continue;
+
+        struct page *page = page_nodes[nid].alloc_order(order, flags);
+        if (page)
+            return page;
+    }
+
+    return nullptr;
+}
+
+/**
+ * @brief Wake up the pagedaemons of every node we may allocate from
+ *
+ * @return Request sequence number of the closest node's pagedaemon, which is the one we wait for
+ */
+static unsigned long wake_up_pagedaemons(page_node *node, unsigned int order, unsigned int attempt,
+                                         unsigned long flags, nodemask_t allowed, int *wait_nid)
+{
+    unsigned long seq = 0;
+
+    *wait_nid = NUMA_NO_NODE;
+    for (unsigned int i = 0; i < node->nr_fallback; i++)
+    {
+        int nid = node->fallback[i];
+        if (flags & __GFP_THISNODE ? nid != node->nid : !(allowed & NODE_MASK(nid)))
+            continue;
+
+        unsigned long nid_seq = wake_up_pagedaemon(nid, order, attempt);
+        if (*wait_nid == NUMA_NO_NODE)
+        {
+            *wait_nid = nid;
+            seq = nid_seq;
+        }
+    }
+
+    return seq;
+}
+
 #define PAGE_ALLOC_MAX_RECLAIM_ATTEMPT 5
 void stack_trace();
 
-struct page *page_node::alloc_order(unsigned int order, unsigned long flags)
+/**
+ * @brief Account a fresh allocation to its call site
+ * Compound pages are freed as a whole, so only the head gets tagged. Every page of a regular
+ * high-order allocation can be freed on its own, so they all carry the tag.
+ *
+ * @param page First page
+ * @param order Order of the allocation
+ * @param flags GFP flags
+ * @param ip Call site
+ */
+static void page_alloc_prof_account(struct page *page, unsigned int order, unsigned long flags,
+                                    unsigned long ip)
+{
+#ifdef CONFIG_ALLOC_PROFILING
+    /* Uninstrumented pages (e.g the zero pool's) get tagged by whoever ends up with them */
+    if (flags & __GFP_NO_INSTRUMENT)
+        return;
+
+    alloc_tag_t tag = alloc_prof_account(ALLOC_PROF_PAGES, ip, PAGE_SIZE << order, pow2(order));
+
+    if (flags & __GFP_COMP && order > 0)
+    {
+        page->alloc_tag = tag;
+        return;
+    }
+
+    for (unsigned long i = 0; i < pow2(order); i++)
+        page[i].alloc_tag = tag;
+#endif
+}
+
+struct page *__alloc_pages_caller(unsigned int order, unsigned long flags, int nid,
+                                  nodemask_t allowed, unsigned long ip)
 {
     struct page *page = nullptr;
     unsigned int attempt = 0;
+    bool drained_zero_pool = false;
+    int compacted = -1;
+    page_node *node;
+
+    if (WARN_ON(order > PAGEALLOC_NR_ORDERS))
+        return NULL;
 
     if (flags & __GFP_MAY_RECLAIM && !(flags & (__GFP_NOWAIT | __GFP_ATOMIC)))
     {
         MAY_SLEEP();
     }
 
+    if (!node_online(nid))
+        nid = numa_node_id();
+    node = &page_nodes[nid];
+    allowed &= numa_nodes_online;
+    if (!allowed)
+        allowed = numa_nodes_online;
+
+    /* Take pre-zeroed pages from the preferred node's pool, if we're allowed to use that node */
+    if (order == 0 && page_should_zero(flags) && !(flags & PAGE_ALLOC_4GB_LIMIT) &&
+        (flags & __GFP_THISNODE || allowed & NODE_MASK(node->nid)))
+    {
+        /* Try to get a pre-zeroed page first, and skip the memset */
+        page = zero_pool_alloc(node->nid);
+        if (page)
+        {
+            flags |= PAGE_ALLOC_NO_ZERO;
+            goto out;
+        }
+    }
+
     for (;;)
     {
         if (attempt == PAGE_ALLOC_MAX_RECLAIM_ATTEMPT)
@@ -860,31 +1348,53 @@ struct page *page_node::alloc_order(unsigned int order, unsigned long flags)
             goto failure;
         }
 
-        int zone = ZONE_NORMAL;
+        page = alloc_pages_fallback(node, order, flags, allowed);
+        if (likely(page))
+            break;
 
-        if (flags & PAGE_ALLOC_4GB_LIMIT)
-            zone = ZONE_DMA32;
+        /* Initializing struct pages is cheaper than reclaim, and only happens early in boot */
+        if (page_deferred_grow(flags & __GFP_THISNODE ? NODE_MASK(node->nid) : allowed))
+            continue;
 
-        while (zone >= 0)
+        /* Pre-zeroed pages are the cheapest thing to give back */
+        if (!drained_zero_pool)
         {
-            page = page_zone_alloc(&zones[zone], flags, order);
-
-            if (page)
-                goto out;
-            zone--;
+            drained_zero_pool = true;
+            if (zero_pool_drain())
+                continue;
         }
 
-        if (likely(page))
-            break;
+        /* Higher-order allocations may be failing because of fragmentation, and not because we're
+         * low on memory. Compaction is cheaper than reclaim for those, so try it first (and after
+         * every reclaim round, which may have freed enough to compact). */
+        if (order > 0 && flags & __GFP_DIRECT_RECLAIM && !(flags & (__GFP_NOWAIT | __GFP_ATOMIC)) &&
+            compacted != (int) attempt)
+        {
+            compacted = attempt;
+            if (compact_for_order(order, flags, node->nid, allowed))
+                continue;
+        }
 
         if (flags & __GFP_DIRECT_RECLAIM)
-            do_direct_reclaim(order, attempt, flags);
+        {
+            /* Only target a single node if that's all we can allocate from */
+            bool one_node = flags & __GFP_THISNODE || __builtin_popcountl(allowed) == 1;
+            page_node *target = nullptr;
+            if (one_node)
+                target = flags & __GFP_THISNODE ? node : &page_nodes[__builtin_ctzl(allowed)];
+            do_direct_reclaim(order, attempt, flags, target);
+        }
         else if (flags & __GFP_WAKE_PAGEDAEMON)
         {
-            unsigned long cur_seq = wake_up_pagedaemon(order, attempt);
+            int wait_nid;
+            if (order > 0)
+                kcompactd_wake(order);
+            unsigned long cur_seq =
+                wake_up_pagedaemons(node, order, attempt, flags, allowed, &wait_nid);
             if (!(flags & (__GFP_ATOMIC | __GFP_NOWAIT)))
             {
-                wait_for_event(&paged_data.paged_waiters_queue, cur_seq < paged_data.reclaim_seq);
+                struct pagedaemon_data *pd = &paged_data[wait_nid];
+                wait_for_event(&pd->paged_waiters_queue, cur_seq < pd->reclaim_seq);
             }
             else
                 goto failure; /* Since __GFP_ATOMIC cannot wait here, we simply fail. */
@@ -900,31 +1410,37 @@ struct page *page_node::alloc_order(unsigned int order, unsigned long flags)
 
 out:
     prepare_pages_after_alloc(page, order, flags);
+    if (flags & __GFP_COMP && order > 0)
+        prep_compound_page(page, order);
+    page_alloc_prof_account(page, order, flags, ip);
 
     return page;
 failure:
     if (!(flags & __GFP_NOWARN))
     {
-        pr_warn("pagealloc: Failed allocation of order %u, gfp_flags %lx, on:\n", order, flags);
+        pr_warn("pagealloc: Failed allocation of order %u, gfp_flags %lx, node %d, on:\n", order,
+                flags, nid);
         stack_trace();
     }
 
     return nullptr;
 }
 
-struct page *alloc_pages(unsigned int order, unsigned long flags)
+struct page *__alloc_pages_nodemask(unsigned int order, unsigned long flags, int nid,
+                                    nodemask_t allowed)
 {
-    auto &node = main_node;
-    if (WARN_ON(order > PAGEALLOC_NR_ORDERS))
-        return NULL;
+    return __alloc_pages_caller(order, flags, nid, allowed, _RET_IP_);
+}
 
-    return node.alloc_order(order, flags);
+struct page *alloc_pages(unsigned int order, unsigned long flags)
+{
+    return alloc_pages_ip(order, flags, _RET_IP_);
 }
 
 void __reclaim_page(struct page *new_page)
 {
     nr_global_pages.add_fetch(1, mem_order::release);
-    auto &node = main_node;
+    auto &node = page_nodes[page_to_nid(new_page)];
     node.add_region((unsigned long) page_to_phys(new_page), PAGE_SIZE);
 }
 
@@ -942,8 +1458,29 @@ void page_node::free_page(struct page *p)
     if (page_flag_set(p, PAGE_FLAG_ANON))
         dec_page_stat(p, NR_ANON);
 
+    unsigned int order = 0;
+    if (page_flag_set(p, PAGE_FLAG_HEAD))
+    {
+        order = compound_order(p);
+        for (unsigned long i = 1; i < pow2(order); i++)
+        {
+            struct page *tail = p + i;
+            CHECK_PAGE(tail->flags & PAGE_FLAG_TAIL && tail->compound.head == p, tail);
+            tail->flags = 0;
+            tail->next_un.next_allocation = nullptr;
+            page_reset_mapcount(tail);
+        }
+
+        p[1].compound.order = 0;
+    }
+
+#ifdef CONFIG_ALLOC_PROFILING
+    alloc_prof_unaccount(p->alloc_tag, PAGE_SIZE << order, pow2(order));
+    p->alloc_tag = ALLOC_TAG_NONE;
+#endif
+
 #ifdef CONFIG_KASAN
-    kasan_set_state((unsigned long *) PAGE_TO_VIRT(p), PAGE_SIZE, 1);
+    kasan_set_state((unsigned long *) PAGE_TO_VIRT(p), PAGE_SIZE << order, 1);
 #endif
 
     /* Reset the page */
@@ -958,8 +1495,7 @@ void page_node::free_page(struct page *p)
     // list_add(&p->page_allocator_node.list_node, &page_list);
 
     struct page_zone *z = pick_zone((unsigned long) page_to_phys(p));
-    // XXX Free higher order stuff directly
-    page_zone_free(z, p, 0);
+    page_zone_free(z, p, order);
 }
 
 /**
@@ -971,7 +1507,7 @@ void page_node::free_page(struct page *p)
  */
 struct page *alloc_page_list(size_t nr_pages, unsigned int gfp_flags)
 {
-    return main_node.allocate_pages(nr_pages, gfp_flags);
+    return allocate_pages(nr_pages, gfp_flags, _RET_IP_);
 }
 
 /**
@@ -1006,32 +1542,40 @@ void page_drain_pcpu()
 
 static void setup_pagedaemon()
 {
-    paged_data.paged_thread = sched_create_thread(pagedaemon, THREAD_KERNEL, nullptr);
-    CHECK(paged_data.paged_thread != nullptr);
-    paged_data.paged_thread->priority = SCHED_PRIO_VERY_HIGH - 2;
-    sched_start_thread(paged_data.paged_thread);
+    for (unsigned long nid = 0; nid < nr_numa_nodes; nid++)
+    {
+        struct pagedaemon_data *pd = &paged_data[nid];
+        pd->paged_thread = sched_create_thread(pagedaemon, THREAD_KERNEL, (void *) nid);
+        CHECK(pd->paged_thread != nullptr);
+        pd->paged_thread->priority = SCHED_PRIO_VERY_HIGH - 2;
+        sched_start_thread(pd->paged_thread);
+    }
 }
 
 INIT_LEVEL_CORE_AFTER_SCHED_ENTRY(setup_pagedaemon);
 
 static struct page_zone *page_to_zone(struct page *page)
 {
-    return main_node.pick_zone((unsigned long) page_to_phys(page));
+    return page_nodes[page_to_nid(page)].pick_zone((unsigned long) page_to_phys(page));
 }
 
 void inc_page_stat(struct page *page, enum page_stat stat)
 {
     struct page_zone *zone = page_to_zone(page);
+    /* Compound pages are accounted as a whole, through their head */
+    unsigned long nr = compound_nr(page);
     sched_disable_preempt();
-    zone->pcpu[get_cpu_nr()].pagestats[stat]++;
+    zone->pcpu[get_cpu_nr()].pagestats[stat] += nr;
     sched_enable_preempt();
 }
 
 void dec_page_stat(struct page *page, enum page_stat stat)
 {
     struct page_zone *zone = page_to_zone(page);
+    /* Compound pages are accounted as a whole, through their head */
+    unsigned long nr = compound_nr(page);
     sched_disable_preempt();
-    zone->pcpu[get_cpu_nr()].pagestats[stat]--;
+    zone->pcpu[get_cpu_nr()].pagestats[stat] -= nr;
     sched_enable_preempt();
 }
 
@@ -1058,32 +1602,42 @@ void page_accumulate_stats(unsigned long pages[PAGE_STATS_MAX])
 /**
  * @brief Calculate a free page target (for reclaim)
  *
+ * @param node Node we're reclaiming from, or NULL for every node
  * @param gfp GFP used for the failed allocation/reclaim
  * @param order Order allocation that failed
  * @return Free page target. If 0, probably shouldn't reclaim.
  */
-unsigned long page_reclaim_target(gfp_t gfp, unsigned int order)
+unsigned long page_reclaim_target(struct page_node *node, gfp_t gfp, unsigned int order)
 {
     bool may = false;
-    unsigned long free_target = pages_under_high_watermark();
+    unsigned long free_target, total;
+
+    free_target = node ? node_pages_under_high_watermark(*node) : pages_under_high_watermark();
     if (free_target > 0)
         return free_target;
 
     /* Everything is over the high watermark. Check if we indeed can accomplish this allocation.
      * This does a slight emulation of alloc_page logic paths.
      */
-    int zone = ZONE_NORMAL;
+    for_every_node([&](page_node &n) -> bool {
+        if (node && node != &n)
+            return true;
 
-    if (gfp & PAGE_ALLOC_4GB_LIMIT)
-        zone = ZONE_DMA32;
+        int zone = ZONE_NORMAL;
 
-    while (zone >= 0)
-    {
-        may = page_zone_may_alloc(&main_node.zones[zone], gfp, order);
-        if (may)
-            break;
-        zone--;
-    }
+        if (gfp & PAGE_ALLOC_4GB_LIMIT)
+            zone = ZONE_DMA32;
+
+        while (zone >= 0)
+        {
+            may = page_zone_may_alloc(&n.zones[zone], gfp, order);
+            if (may)
+                break;
+            zone--;
+        }
+
+        return !may;
+    });
 
     if (may)
         return 0;
@@ -1092,6 +1646,7 @@ unsigned long page_reclaim_target(gfp_t gfp, unsigned int order)
      * as a fixed % of total pages, scaled by order (capped to 3). We heuristically pick 1.5% of
      * total pages.
      */
-    free_target = (nr_global_pages / 66) * cul::max(order, 3U);
+    total = node ? node->total_pages : nr_global_pages.load(mem_order::acquire);
+    free_target = (total / 66) * cul::max(order, 3U);
     return free_target;
 }
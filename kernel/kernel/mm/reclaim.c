@@ -7,22 +7,36 @@
  */
 #include <stdio.h>
 
+#include <onyx/clock.h>
 #include <onyx/filemap.h>
 #include <onyx/mm/kasan.h>
 #include <onyx/mm/page_node.h>
 #include <onyx/mm/reclaim.h>
 #include <onyx/mm/shrinker.h>
 #include <onyx/mm/slab.h>
+#include <onyx/mm/tlb.h>
 #include <onyx/mm/vm_object.h>
 #include <onyx/page.h>
 #include <onyx/rmap.h>
 #include <onyx/rwlock.h>
 #include <onyx/swap.h>
+#include <onyx/sysfs.h>
+#include <onyx/user.h>
 #include <onyx/vfs.h>
 
 static struct list_head shrinker_list = LIST_HEAD_INIT(shrinker_list);
 static struct rwlock shrinker_list_lock;
 
+static struct
+{
+    unsigned long scanned;
+    unsigned long reclaimed;
+    /* Time spent in shrink_zone, aging included */
+    unsigned long ns;
+    unsigned long aging_passes;
+    unsigned long aged;
+} reclaim_stats;
+
 void shrinker_register(struct shrinker *shr)
 {
     rw_lock_write(&shrinker_list_lock);
@@ -94,7 +108,9 @@ enum lru_result
 {
     LRU_SHRINK,
     LRU_ROTATE,
-    LRU_ACTIVATE
+    LRU_ACTIVATE,
+    /* Unmapped and still locked, waiting for the TLB flush */
+    LRU_UNMAPPED
 };
 
 #ifdef __clang__
@@ -217,20 +233,28 @@ static enum pageout_result pageout(struct reclaim_data *data, struct page *page,
     return PAGE_WRITTEN;
 }
 
-static enum lru_result shrink_page(struct reclaim_data *data,
-                                   struct page *page) NO_THREAD_SAFETY_ANALYSIS
+/**
+ * @brief First half of page reclaim: look at the page's references, and unmap it
+ * The TLB invalidations are batched over the whole page list. If we return LRU_UNMAPPED, the page
+ * is left locked, and it must not be written back or freed until the batch is flushed.
+ */
+static enum lru_result shrink_page_unmap(struct reclaim_data *data, struct page *page,
+                                         struct tlb_batch *tlb) NO_THREAD_SAFETY_ANALYSIS
 {
     if (!try_lock_page(page))
         return LRU_ROTATE;
 
     if (page_test_swap(page) && !page->owner)
     {
+        /* Read in (or read ahead) but never faulted in. Nothing maps it, so just drop it from the
+         * swap cache. */
+        if (!page_mapcount(page))
+            return LRU_UNMAPPED;
         /* Huh. Incomplete swapcache page? Skip. */
         goto rotate;
     }
 
     DCHECK_PAGE(page->owner, page);
-    struct vm_object *obj;
     unsigned int vm_flags = 0;
 
     long refs = rmap_get_page_references(page, &vm_flags);
@@ -268,13 +292,23 @@ static enum lru_result shrink_page(struct reclaim_data *data,
             goto rotate;
     }
 
-    /* Set RECLAIM. If we have to bail the reclaim (because e.g it is dirty), certain code points
-     * will know to demote the page back to INACTIVE head, so we look at it again (hopefully
-     * clean). */
+    rmap_try_to_unmap(page, tlb);
+    return LRU_UNMAPPED;
+rotate:
+    unlock_page(page);
+    return LRU_ROTATE;
+}
 
-    rmap_try_to_unmap(page);
+/**
+ * @brief Second half of page reclaim: write the page back, or free it
+ * Called with the page locked and unmapped (and the TLB flushed).
+ */
+static enum lru_result shrink_unmapped_page(struct reclaim_data *data,
+                                            struct page *page) NO_THREAD_SAFETY_ANALYSIS
+{
+    struct vm_object *obj;
 
-    if (page_mapcount(page) > 0)
+    if (page_mapped(page))
     {
         /* We failed to unmap it all :( Rotate the page */
         goto rotate;
@@ -283,6 +317,9 @@ static enum lru_result shrink_page(struct reclaim_data *data,
     if (page_flag_set(page, PAGE_FLAG_ANON))
         WARN_ON(!page_test_swap(page));
 
+    /* Set RECLAIM. If we have to bail the reclaim (because e.g it is dirty), certain code points
+     * will know to demote the page back to INACTIVE head, so we look at it again (hopefully
+     * clean). */
     page_set_reclaim(page);
 
     obj = page_vmobj(page);
@@ -325,7 +362,7 @@ static enum lru_result shrink_page(struct reclaim_data *data,
     /* This should be a stable reference. TODO: What if truncation? What if the inode goes away
      * after the unlock? */
     // pr_info("removing page %p\n", page);
-    if (!vm_obj_remove_page(obj, page))
+    if (!vm_obj_remove_page(obj, page, true))
     {
         /* If we failed to remove the page, it's busy */
         unlock_page(page);
@@ -379,9 +416,10 @@ static void shrink_active_list(struct page_node *node, enum lru_state lru_list,
     unsigned long to_move = target_inactive - pagestats[NR_INACTIVE_FILE + inactive];
     list_for_every_safe (&lru->lru_lists[lru_list])
     {
-        if (to_move-- == 0)
-            break;
         struct page *page = container_of(l, struct page, lru_node);
+        if (to_move == 0)
+            break;
+        to_move -= min(to_move, compound_nr(page));
         /* Referenced? rotate it back to the list's tail. If we're really desperate for inactive
          * pages, we'll be able to fetch again, no problem. */
         if (page_flag_set(page, PAGE_FLAG_REFERENCED))
@@ -406,13 +444,16 @@ static inline int page_to_state(struct page *page)
     return page_flag_set(page, PAGE_FLAG_ANON) ? LRU_ANON_OFF : 0;
 }
 
-static void isolate_pages(struct page_lru *lru, enum lru_state list, struct list_head *page_list,
-                          unsigned long nr_pages)
+static unsigned long isolate_pages(struct page_lru *lru, enum lru_state list,
+                                   struct list_head *page_list, unsigned long nr_pages)
 {
     DEFINE_LIST(rotate_list);
+    unsigned long scanned = 0;
     list_for_every_safe (&lru->lru_lists[list])
     {
         struct page *page = container_of(l, struct page, lru_node);
+        unsigned long nr = compound_nr(page);
+        scanned += nr;
         if (page_flag_set(page, PAGE_FLAG_REFERENCED))
         {
             /* Rotate it (dont even attempt to isolate the page) */
@@ -429,11 +470,13 @@ static void isolate_pages(struct page_lru *lru, enum lru_state list, struct list
         list_remove(&page->lru_node);
         dec_page_stat(page, NR_INACTIVE_FILE + page_to_state(page));
         list_add_tail(&page->lru_node, page_list);
-        if (--nr_pages == 0)
+        nr_pages -= min(nr_pages, nr);
+        if (nr_pages == 0)
             break;
     }
 
     list_splice(&rotate_list, &lru->lru_lists[list]);
+    return scanned;
 }
 
 struct pagebatch
@@ -462,21 +505,46 @@ static unsigned long shrink_page_list(struct reclaim_data *data, struct page_lru
     DEFINE_LIST(rotate_list);
     DEFINE_LIST(activate_list);
     struct pagebatch free_batch;
+    struct tlb_batch tlb;
     unsigned long freedp = 0;
 
     free_batch.nr = 0;
+    tlb_batch_init(&tlb, NULL);
+
+    /* Unmap every page we can first, so pages from the same mm share TLB shootdowns. Pages that
+     * were unmapped stay in page_list. */
     list_for_every_safe (page_list)
     {
         struct page *page = container_of(l, struct page, lru_node);
         DCHECK_PAGE(!page_flag_set(page, PAGE_FLAG_LRU), page);
-        enum lru_result res = shrink_page(data, page);
+        enum lru_result res = shrink_page_unmap(data, page, &tlb);
+        if (res == LRU_ROTATE)
+        {
+            list_remove(&page->lru_node);
+            list_add_tail(&page->lru_node, &rotate_list);
+        }
+        else if (res == LRU_ACTIVATE)
+        {
+            list_remove(&page->lru_node);
+            list_add_tail(&page->lru_node, &activate_list);
+        }
+    }
+
+    tlb_batch_finish(&tlb);
+
+    list_for_every_safe (page_list)
+    {
+        struct page *page = container_of(l, struct page, lru_node);
+        /* The page is gone if we shrink it, so grab its size now */
+        unsigned long nr = compound_nr(page);
+        enum lru_result res = shrink_unmapped_page(data, page);
         if (res == LRU_ROTATE)
         {
             list_remove(&page->lru_node);
             list_add_tail(&page->lru_node, &rotate_list);
         }
         else if (res == LRU_SHRINK)
-            freedp++;
+            freedp += nr;
         else if (res == LRU_ACTIVATE)
         {
             list_remove(&page->lru_node);
@@ -492,9 +560,7 @@ static unsigned long shrink_page_list(struct reclaim_data *data, struct page_lru
     {
         struct page *page = container_of(l, struct page, lru_node);
         list_remove(&page->lru_node);
-        list_add_tail(&page->lru_node, &lru->lru_lists[LRU_INACTIVE_FILE + page_to_state(page)]);
-        page_set_lru(page);
-        inc_page_stat(page, NR_INACTIVE_FILE + page_to_state(page));
+        __page_lru_putback(lru, page, false);
         if (page_batch_add(&free_batch, page))
         {
             spin_unlock(&lru->lock);
@@ -507,10 +573,7 @@ static unsigned long shrink_page_list(struct reclaim_data *data, struct page_lru
     {
         struct page *page = container_of(l, struct page, lru_node);
         list_remove(&page->lru_node);
-        page_set_flag(page, PAGE_FLAG_ACTIVE);
-        inc_page_stat(page, NR_ACTIVE_FILE + page_to_state(page));
-        page_clear_referenced(page);
-        list_add_tail(&page->lru_node, &lru->lru_lists[LRU_ACTIVE_FILE + page_to_state(page)]);
+        __page_lru_putback(lru, page, true);
         if (page_batch_add(&free_batch, page))
         {
             spin_unlock(&lru->lock);
@@ -529,14 +592,24 @@ static unsigned long isolate_and_shrink(struct reclaim_data *data, enum lru_stat
                                         struct page_lru *lru, unsigned long nr)
 {
     DEFINE_LIST(isolate_list);
+    unsigned long scanned, freed;
     if (!nr)
         return 0;
 
     spin_lock(&lru->lock);
-    isolate_pages(lru, lru_list, &isolate_list, nr);
+    /* The LRU might've switched modes since shrink_zone looked */
+    if (lru->gen_enabled)
+        scanned = lru_gen_isolate(lru, lru_list == LRU_INACTIVE_ANON ? LRU_GEN_ANON : LRU_GEN_FILE,
+                                  &isolate_list, nr);
+    else
+        scanned = isolate_pages(lru, lru_list, &isolate_list, nr);
     spin_unlock(&lru->lock);
 
-    return shrink_page_list(data, lru, &isolate_list);
+    __atomic_add_fetch(&reclaim_stats.scanned, scanned, __ATOMIC_RELAXED);
+
+    freed = shrink_page_list(data, lru, &isolate_list);
+    __atomic_add_fetch(&reclaim_stats.reclaimed, freed, __ATOMIC_RELAXED);
+    return freed;
 }
 
 static void calculate_scan(unsigned long stats[PAGE_STATS_MAX])
@@ -552,19 +625,39 @@ static void calculate_scan(unsigned long stats[PAGE_STATS_MAX])
 
 #define SWAP_CLUSTER_MAX 64UL
 
+static void lru_gen_maybe_age(struct page_lru *lru)
+{
+    bool anon = swap_is_available();
+    unsigned long aged;
+
+    if (!lru_gen_needs_aging(lru, LRU_GEN_FILE) &&
+        !(anon && lru_gen_needs_aging(lru, LRU_GEN_ANON)))
+        return;
+
+    aged = lru_gen_age(lru, anon);
+    __atomic_add_fetch(&reclaim_stats.aging_passes, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&reclaim_stats.aged, aged, __ATOMIC_RELAXED);
+}
+
 static void shrink_zone(struct reclaim_data *data, struct page_node *node, struct page_zone *zone,
                         long target_freep)
 {
     unsigned long stats[PAGE_STATS_MAX];
+    hrtime_t start = clocksource_get_time();
     page_accumulate_stats(stats);
     struct page_lru *lru = &zone->zone_lru;
 
-    unsigned long min_inactive = inactive_file_min(stats);
-    unsigned long min_inactive_anon = inactive_anon_min(stats);
-    if (stats[NR_INACTIVE_FILE] < min_inactive)
-        shrink_active_list(node, LRU_ACTIVE_FILE, zone, stats, min_inactive);
-    if (stats[NR_INACTIVE_ANON] < min_inactive_anon)
-        shrink_active_list(node, LRU_ACTIVE_ANON, zone, stats, min_inactive_anon);
+    /* The multi-gen LRU doesn't have active lists to balance. Every page is accounted as
+     * inactive. */
+    if (!READ_ONCE(lru->gen_enabled))
+    {
+        unsigned long min_inactive = inactive_file_min(stats);
+        unsigned long min_inactive_anon = inactive_anon_min(stats);
+        if (stats[NR_INACTIVE_FILE] < min_inactive)
+            shrink_active_list(node, LRU_ACTIVE_FILE, zone, stats, min_inactive);
+        if (stats[NR_INACTIVE_ANON] < min_inactive_anon)
+            shrink_active_list(node, LRU_ACTIVE_ANON, zone, stats, min_inactive_anon);
+    }
 
     page_accumulate_stats(stats);
     calculate_scan(stats);
@@ -576,6 +669,9 @@ static void shrink_zone(struct reclaim_data *data, struct page_node *node, struc
         if (!nr_file && !nr_anon)
             break;
 
+        if (READ_ONCE(lru->gen_enabled))
+            lru_gen_maybe_age(lru);
+
         stats[NR_INACTIVE_FILE] -= nr_file;
         stats[NR_INACTIVE_ANON] -= nr_anon;
 
@@ -587,6 +683,8 @@ static void shrink_zone(struct reclaim_data *data, struct page_node *node, struc
         target_freep -= freed;
     }
 
+    __atomic_add_fetch(&reclaim_stats.ns, clocksource_get_time() - start, __ATOMIC_RELAXED);
+
 #ifdef DEBUG_SHRINK_ZONE
     pr_warn("shrink_zone: Zone %s freed %lu pages (out of %lu)\n", zone->name, freed, target_freep);
     pr_warn("shrink_zone: inactive %lu active %lu\n", stats[NR_INACTIVE_FILE],
@@ -633,14 +731,22 @@ int page_do_reclaim(struct reclaim_data *data)
     int max_tries = data->attempt > 0 ? 5 : 3;
     int nr_tries = 0;
 
-    while ((free_target = page_reclaim_target(data->gfp_flags, data->failed_order)) > 0)
+    while ((free_target = page_reclaim_target(data->node, data->gfp_flags, data->failed_order)) >
+           0)
     {
         if (nr_tries == max_tries)
             return -1;
         /* Lets scale according to our desperation */
         if (nr_tries > 0)
             free_target *= nr_tries;
-        shrink_page_zones(data, &main_node);
+        if (data->node)
+            shrink_page_zones(data, data->node);
+        else
+        {
+            int nid;
+            for_each_online_node(nid)
+                shrink_page_zones(data, page_node_of(nid));
+        }
         shrink_objects(data, free_target);
 #ifdef CONFIG_KASAN
         /* KASAN is likely to have a lot of objects under its wing, so flush it. */
@@ -657,6 +763,22 @@ int page_do_reclaim(struct reclaim_data *data)
     return 0;
 }
 
+ssize_t reclaim_stat_sysfs_read(void *buffer, size_t size, off_t off)
+{
+    char buf[256];
+    unsigned long scanned = READ_ONCE(reclaim_stats.scanned);
+    unsigned long reclaimed = READ_ONCE(reclaim_stats.reclaimed);
+    unsigned long ns = READ_ONCE(reclaim_stats.ns);
+    size_t len;
+
+    len = snprintf(buf, sizeof(buf),
+                   "scanned %lu\nreclaimed %lu\nreclaim_ns %lu\nns_per_reclaimed %lu\n"
+                   "aging_passes %lu\naged %lu\n",
+                   scanned, reclaimed, ns, reclaimed ? ns / reclaimed : 0,
+                   READ_ONCE(reclaim_stats.aging_passes), READ_ONCE(reclaim_stats.aged));
+    return sysfs_read_buf(buf, len, buffer, size, off);
+}
+
 #ifdef CONFIG_SHRINKER_TEST
 
 int nr_shrunk = 0;
@@ -179,19 +179,26 @@ static int rmap_walk_file(struct rmap_walk_info *info, struct page *page)
 {
     struct vm_object *obj = page->owner;
     spin_lock(&obj->mapping_lock);
-    size_t offset = page->pageoff;
+    /* Large folios get walked subpage by subpage */
+    size_t first = page->pageoff, last = first + compound_nr(page) - 1;
     struct vm_area_struct *vma;
     int st = 0;
 
-    for_intervals_in_range(&obj->mappings, vma, struct vm_area_struct, vm_objhead, offset, offset)
+    for_intervals_in_range(&obj->mappings, vma, struct vm_area_struct, vm_objhead, first, last)
     {
-        vm_obj_assert_interval_tree(offset, vma);
-        st = info->walk_one(vma, page, (vma->vm_start + (offset << PAGE_SHIFT) - vma->vm_offset),
-                            info->context);
-        if (st)
-            break;
+        size_t end = min(last, vma->vm_objhead.end);
+        for (size_t offset = max(first, vma->vm_objhead.start); offset <= end; offset++)
+        {
+            vm_obj_assert_interval_tree(offset, vma);
+            st = info->walk_one(vma, page + (offset - first),
+                                (vma->vm_start + (offset << PAGE_SHIFT) - vma->vm_offset),
+                                info->context);
+            if (st)
+                goto out;
+        }
     }
 
+out:
     spin_unlock(&obj->mapping_lock);
     return st;
 }
@@ -240,13 +247,56 @@ long rmap_get_page_references(struct page *page, unsigned int *vm_flags)
 static int rmap_try_to_unmap_one(struct vm_area_struct *vma, struct page *page, unsigned long addr,
                                  void *ctx)
 {
-    return try_to_unmap_one(page, vma, addr);
+    return try_to_unmap_one(page, vma, addr, ctx);
 }
 
-int rmap_try_to_unmap(struct page *page)
+int rmap_try_to_unmap(struct page *page, struct tlb_batch *tlb)
 {
     struct rmap_walk_info info;
     info.walk_one = rmap_try_to_unmap_one;
-    info.context = NULL;
+    info.context = tlb;
     return rmap_walk(&info, page);
 }
+
+struct migrate_walk
+{
+    struct tlb_batch *tlb;
+    struct page *newpage;
+    unsigned int nr;
+};
+
+static int rmap_try_to_migrate_one(struct vm_area_struct *vma, struct page *page,
+                                   unsigned long addr, void *ctx)
+{
+    struct migrate_walk *walk = ctx;
+    walk->nr += try_to_migrate_one(page, vma, addr, walk->tlb);
+    return 0;
+}
+
+unsigned int rmap_try_to_migrate(struct page *page, struct tlb_batch *tlb)
+{
+    struct migrate_walk walk = {.tlb = tlb};
+    struct rmap_walk_info info;
+    info.walk_one = rmap_try_to_migrate_one;
+    info.context = &walk;
+    rmap_walk(&info, page);
+    return walk.nr;
+}
+
+static int rmap_remove_migration_pte(struct vm_area_struct *vma, struct page *page,
+                                     unsigned long addr, void *ctx)
+{
+    struct migrate_walk *walk = ctx;
+    walk->nr += remove_migration_pte(page, walk->newpage, vma, addr);
+    return 0;
+}
+
+unsigned int rmap_remove_migration_ptes(struct page *old, struct page *newpage)
+{
+    struct migrate_walk walk = {.newpage = newpage};
+    struct rmap_walk_info info;
+    info.walk_one = rmap_remove_migration_pte;
+    info.context = &walk;
+    rmap_walk(&info, old);
+    return walk.nr;
+}
@@ -8,8 +8,10 @@
 
 #include <stdio.h>
 
+#include <onyx/cmdline.h>
 #include <onyx/cpu.h>
 #include <onyx/list.h>
+#include <onyx/mm/alloc_profile.h>
 #include <onyx/mm/slab.h>
 #include <onyx/modules.h>
 #include <onyx/page.h>
@@ -97,6 +99,53 @@ struct kasan_slab_obj_info
  */
 static void kmem_cache_free_slab(struct slab *slab);
 
+static bool slab_nomerge;
+
+static int slab_nomerge_param(const char *s)
+{
+    slab_nomerge = true;
+    return 1;
+}
+kernel_param("slab_nomerge", slab_nomerge_param);
+
+static bool kmem_cache_mergeable(struct slab_cache *c)
+{
+    /* Caches with ctors or TYPESAFE_BY_RCU care about what's in their free objects */
+    return !slab_nomerge && !c->ctor && !(c->flags & (KMEM_CACHE_NOMERGE | SLAB_TYPESAFE_BY_RCU));
+}
+
+/**
+ * @brief Find an existing cache that a new cache can be merged into
+ * Both caches must have the exact same object layout and flags.
+ *
+ * @param c New cache, fully set up
+ * @return Cache to use instead, or NULL
+ */
+static struct slab_cache *kmem_cache_find_merge(struct slab_cache *c) REQUIRES(cache_list_lock)
+{
+    list_for_every (&cache_list)
+    {
+        struct slab_cache *s = container_of(l, struct slab_cache, cache_list_node);
+        if (!kmem_cache_mergeable(s))
+            continue;
+
+        if (s->objsize != c->objsize || s->alignment != c->alignment ||
+            s->redzone != c->redzone || s->bufctl_off != c->bufctl_off)
+            continue;
+
+        if ((s->flags ^ c->flags) & ~KMEM_CACHE_PANIC)
+            continue;
+#ifdef CONFIG_KASAN
+        /* KASAN unpoisons actual_objsize bytes, so these must match too */
+        if (s->actual_objsize != c->actual_objsize)
+            continue;
+#endif
+        return s;
+    }
+
+    return NULL;
+}
+
 /**
  * @brief Create a slab cache
  *
@@ -182,7 +231,22 @@ struct slab_cache *kmem_cache_create(const char *name, size_t size, size_t align
     else
         c->mag_limit = SLAB_CACHE_PERCPU_MAGAZINE_SIZE;
 
+    c->refcount = 1;
+
     mutex_lock(&cache_list_lock);
+    if (kmem_cache_mergeable(c))
+    {
+        struct slab_cache *old = kmem_cache_find_merge(c);
+        if (old)
+        {
+            /* Share the existing cache. This saves us the per-cache slabs and magazines. */
+            old->refcount++;
+            mutex_unlock(&cache_list_lock);
+            slab_cache_free(c);
+            return old;
+        }
+    }
+
     list_add_tail(&c->cache_list_node, &cache_list);
     mutex_unlock(&cache_list_lock);
     return c;
@@ -200,6 +264,27 @@ ALWAYS_INLINE static inline struct bufctl *kmem_bufctl_from_ptr(struct slab_cach
     return ptr + cache->bufctl_off;
 }
 
+#ifdef CONFIG_ALLOC_PROFILING
+/* Each object's allocation tag lives in an array at the end of the slab, right before the struct
+ * slab. */
+#define KMEM_OBJ_TAG_SIZE sizeof(alloc_tag_t)
+
+static inline alloc_tag_t *kmem_slab_tags(struct slab *slab)
+{
+    return (alloc_tag_t *) slab - slab->nobjects;
+}
+
+static inline alloc_tag_t *kmem_obj_tag(struct slab *slab, void *ptr)
+{
+    struct slab_cache *cache = slab->cache;
+    unsigned long start = (unsigned long) slab + sizeof(struct slab) - slab->size;
+    unsigned long off = (unsigned long) ptr - cache->redzone / 2 - start;
+    return &kmem_slab_tags(slab)[off / (cache->objsize + cache->redzone)];
+}
+#else
+#define KMEM_OBJ_TAG_SIZE 0
+#endif
+
 #ifdef SLAB_DEBUG_COUNTS
 /* Kept here and not in list.h, because this is a horrible pattern that should not be used for
  * !DEBUG */
@@ -525,7 +610,7 @@ NO_ASAN static struct slab *kmem_cache_create_slab(struct slab_cache *cache, uns
     // TODO: Colouring? But geist said that maybe it's not necessary these days
 
     const size_t useful_size = slab_size - sizeof(struct slab);
-    const size_t nr_objects = useful_size / (cache->objsize + cache->redzone);
+    const size_t nr_objects = useful_size / (cache->objsize + cache->redzone + KMEM_OBJ_TAG_SIZE);
 
     struct bufctl *first = NULL;
     struct bufctl *last = NULL;
@@ -574,6 +659,9 @@ NO_ASAN static struct slab *kmem_cache_create_slab(struct slab_cache *cache, uns
         slab->start = start;
 
     slab->size = slab_size;
+#ifdef CONFIG_ALLOC_PROFILING
+    memset(kmem_slab_tags(slab), 0, nr_objects * sizeof(alloc_tag_t));
+#endif
 
     if (!no_add)
     {
@@ -870,41 +958,65 @@ __always_inline void kmem_cache_post_alloc_kasan(struct slab_cache *cache, unsig
 {
 }
 #endif
+
+__always_inline void kmem_prof_alloc(struct slab_cache *cache, void *object, unsigned int type,
+                                     unsigned long ip)
+{
+#ifdef CONFIG_ALLOC_PROFILING
+    *kmem_obj_tag(kmem_pointer_to_slab(object), object) =
+        alloc_prof_account(type, ip, cache->objsize, 1);
+#endif
+}
+
+__always_inline void kmem_prof_free(struct slab *slab, void *ptr)
+{
+#ifdef CONFIG_ALLOC_PROFILING
+    alloc_tag_t *tag = kmem_obj_tag(slab, ptr);
+    alloc_prof_unaccount(*tag, slab->cache->objsize, 1);
+    *tag = ALLOC_TAG_NONE;
+#endif
+}
+
 /**
  * @brief Called after a successful allocation for post-alloc handling
  *
  * @param cache SLAB cache
  * @param flags Allocation flags
  * @param object Object that was allocated
+ * @param type ALLOC_PROF_* type of the allocation
+ * @param ip Call site, for allocation profiling
  */
 __always_inline void kmem_cache_post_alloc(struct slab_cache *cache, unsigned int flags,
-                                           void *object)
+                                           void *object, unsigned int type, unsigned long ip)
 {
     kmem_cache_post_alloc_kasan(cache, flags, object);
+    kmem_prof_alloc(cache, object, type, ip);
 }
 
 __always_inline void kmem_cache_post_alloc_bulk(struct slab_cache *cache, unsigned int flags,
-                                                void **objects, size_t nr)
+                                                void **objects, size_t nr, unsigned long ip)
 {
     for (size_t i = 0; i < nr; i++)
-        kmem_cache_post_alloc(cache, flags, objects[i]);
+        kmem_cache_post_alloc(cache, flags, objects[i], ALLOC_PROF_SLAB, ip);
 }
 
 /**
- * @brief Allocate an object from the slab
- * This function call be called in nopreempt/softirq context.
+ * @brief Allocate an object from the slab, on behalf of a caller
  *
  * @param cache Slab cache
  * @param flags Allocation flags
+ * @param type ALLOC_PROF_* type of the allocation
+ * @param ip Call site, for allocation profiling
  * @return Allocated object, or NULL in OOM situations.
  */
-void *kmem_cache_alloc(struct slab_cache *cache, unsigned int flags)
+static void *__kmem_cache_alloc(struct slab_cache *cache, unsigned int flags, unsigned int type,
+                                unsigned long ip)
 {
     if (unlikely(cache->flags & KMEM_CACHE_NOPCPU))
     {
         void *ret = kmem_cache_alloc_nopcpu(cache, flags);
         if (ret)
-            kmem_cache_post_alloc(cache, flags, ret);
+            kmem_cache_post_alloc(cache, flags, ret, type, ip);
         return ret;
     }
 
@@ -938,13 +1050,26 @@ void *kmem_cache_alloc(struct slab_cache *cache, unsigned int flags)
     __atomic_store_n(&pcpu->touched, 0, __ATOMIC_RELEASE);
     sched_enable_preempt();
 
-    kmem_cache_post_alloc(cache, flags, ret);
+    kmem_cache_post_alloc(cache, flags, ret, type, ip);
 
     return ret;
 }
 
-int kmem_cache_alloc_bulk_nopcpu(struct slab_cache *cache, unsigned int gfp_flags, size_t nr,
-                                 void **res)
+/**
+ * @brief Allocate an object from the slab
+ * This function call be called in nopreempt/softirq context.
+ *
+ * @param cache Slab cache
+ * @param flags Allocation flags
+ * @return Allocated object, or NULL in OOM situations.
+ */
+void *kmem_cache_alloc(struct slab_cache *cache, unsigned int flags)
+{
+    return __kmem_cache_alloc(cache, flags, ALLOC_PROF_SLAB, _RET_IP_);
+}
+
+static int kmem_cache_alloc_bulk_nopcpu(struct slab_cache *cache, unsigned int gfp_flags,
+                                        size_t nr, void **res, unsigned long ip)
 {
     size_t i;
 
@@ -956,7 +1081,7 @@ int kmem_cache_alloc_bulk_nopcpu(struct slab_cache *cache, unsigned int gfp_flag
         res[i] = ptr;
     }
 
-    kmem_cache_post_alloc_bulk(cache, gfp_flags, res, nr);
+    kmem_cache_post_alloc_bulk(cache, gfp_flags, res, nr, ip);
     return nr;
 out_nomem:
     kmem_cache_free_bulk(cache, i, res);
@@ -980,7 +1105,7 @@ size_t kmem_cache_alloc_bulk(struct slab_cache *cache, unsigned int gfp_flags, s
     size_t ret = nr;
 
     if (unlikely(cache->flags & KMEM_CACHE_NOPCPU))
-        return kmem_cache_alloc_bulk_nopcpu(cache, gfp_flags, nr, res);
+        return kmem_cache_alloc_bulk_nopcpu(cache, gfp_flags, nr, res, _RET_IP_);
 
     while (nr)
     {
@@ -1017,7 +1142,7 @@ size_t kmem_cache_alloc_bulk(struct slab_cache *cache, unsigned int gfp_flags, s
         sched_enable_preempt();
     }
 
-    kmem_cache_post_alloc_bulk(cache, gfp_flags, res, ret);
+    kmem_cache_post_alloc_bulk(cache, gfp_flags, res, ret, _RET_IP_);
     return ret;
 enomem:
     kmem_cache_free_bulk(cache, i, res);
@@ -1202,6 +1327,7 @@ void kfree(void *ptr)
     struct slab *slab = kmem_pointer_to_slab(ptr);
     struct slab_cache *cache = slab->cache;
 
+    kmem_prof_free(slab, ptr);
 #ifdef CONFIG_KASAN
     kasan_kfree(ptr, cache, cache->objsize);
     return;
@@ -1225,6 +1351,9 @@ void kmem_cache_free(struct slab_cache *cache, void *ptr)
     if (unlikely(!ptr))
         return;
 
+#ifdef CONFIG_ALLOC_PROFILING
+    kmem_prof_free(kmem_pointer_to_slab(ptr), ptr);
+#endif
 #ifdef CONFIG_KASAN
     kasan_kfree(ptr, cache, cache->objsize);
     return;
@@ -1255,6 +1384,14 @@ void kmem_cache_free_bulk(struct slab_cache *cache, size_t size, void **ptrs)
 {
     size_t i = 0;
 
+#ifdef CONFIG_ALLOC_PROFILING
+    for (size_t j = 0; j < size; j++)
+    {
+        if (ptrs[j])
+            kmem_prof_free(kmem_pointer_to_slab(ptrs[j]), ptrs[j]);
+    }
+#endif
+
     if (unlikely(cache->flags & KMEM_CACHE_NOPCPU))
     {
         kmem_cache_free_bulk_nopcpu(cache, size, ptrs);
@@ -1531,6 +1668,13 @@ void kmem_cache_destroy(struct slab_cache *cache)
 #endif
 
     mutex_lock(&cache_list_lock);
+    if (--cache->refcount > 0)
+    {
+        /* Merged cache, someone else is still using it */
+        mutex_unlock(&cache_list_lock);
+        return;
+    }
+
     kmem_cache_shrink(cache, ULONG_MAX);
 
     if (cache->npartialslabs || cache->nfullslabs)
@@ -1543,23 +1687,68 @@ void kmem_cache_destroy(struct slab_cache *cache)
     slab_cache_free(cache);
 }
 
-#define KMALLOC_NR_CACHES 22
+/* kmalloc size classes are the powers of two from 16 bytes, plus a class halfway (1.5x) between
+ * every pair of powers of two from 64 up. Power-of-two classes alone waste up to 50% of every
+ * object (a 65-byte object would get 128 bytes); intermediate classes bring that down to 33%.
+ * Classes: 16, 32, 64, 96, 128, 192, 256, 384, ..., 16M, 24M, 32M.
+ */
+#define KMALLOC_MIN_SHIFT 4
+#define KMALLOC_MAX_SHIFT 25
+#define KMALLOC_NR_CACHES (3 + 2 * (KMALLOC_MAX_SHIFT - 6))
+/* Sizes up to KMALLOC_LOOKUP_MAX get their class from a table, in KMALLOC_LOOKUP_STEP steps */
+#define KMALLOC_LOOKUP_STEP  8
+#define KMALLOC_LOOKUP_MAX   512
+#define KMALLOC_VMALLOC_SIZE (1UL << 20)
 
 char kmalloc_cache_names[KMALLOC_NR_CACHES][20];
 struct slab_cache *kmalloc_caches[KMALLOC_NR_CACHES];
+static u8 kmalloc_size_index[KMALLOC_LOOKUP_MAX / KMALLOC_LOOKUP_STEP + 1];
+
+/* Index of the class for 2^shift (shift >= 6 has intermediate classes below it) */
+static inline int kmalloc_pow2_index(unsigned int shift)
+{
+    if (shift <= 6)
+        return shift - KMALLOC_MIN_SHIFT;
+    return 2 + 2 * (shift - 6);
+}
+
+static inline size_t kmalloc_index_size(int index)
+{
+    if (index < 3)
+        return 1UL << (KMALLOC_MIN_SHIFT + index);
+    /* Even indices are powers of two, odd ones are 1.5x the power of two below them */
+    if (index & 1)
+    {
+        size_t pow2 = 1UL << (6 + (index - 3) / 2);
+        return pow2 + pow2 / 2;
+    }
+
+    return 1UL << (6 + (index - 2) / 2);
+}
+
+static inline int __kmalloc_index(size_t size)
+{
+    if (size <= (1UL << KMALLOC_MIN_SHIFT))
+        return 0;
+
+    /* 2^shift < size <= 2^(shift + 1) */
+    unsigned int shift = ilog2(size - 1);
+    if (shift >= 6 && size <= (3UL << (shift - 1)))
+        return kmalloc_pow2_index(shift) + 1;
+    return kmalloc_pow2_index(shift + 1);
+}
 
 void kmalloc_init()
 {
     for (size_t i = 0; i < KMALLOC_NR_CACHES; i++)
     {
-        // We start at 16 bytes
-        size_t size = 1UL << (4 + i);
+        size_t size = kmalloc_index_size(i);
         unsigned int flags = 0;
 #if 1
         // TODO: Toggling VMALLOC only for larger sizes is not working well...
         // at least for will-it-scale/page_fault1, it results in major performance regressions.
         // Is this a TLB issue? Maybe?
-        if (i >= 16)
+        if (size >= KMALLOC_VMALLOC_SIZE)
             flags |= KMEM_CACHE_VMALLOC;
 #endif
         snprintf(kmalloc_cache_names[i], 20, "kmalloc-%zu", size);
@@ -1567,37 +1756,41 @@ void kmalloc_init()
         if (!kmalloc_caches[i])
             panic("Early out of memory\n");
     }
+
+    for (size_t i = 0; i < sizeof(kmalloc_size_index); i++)
+        kmalloc_size_index[i] = __kmalloc_index(i * KMALLOC_LOOKUP_STEP);
 }
 
-static inline int size_to_order(size_t size)
+static inline int kmalloc_index(size_t size)
 {
-    if (unlikely(size < 2))
-        return 0;
-
-    size_t order = ilog2(size - 1) + 1;
-    if (unlikely(order < 4))
-        order = 4;
-    order -= 4;
+    if (likely(size <= KMALLOC_LOOKUP_MAX))
+        return kmalloc_size_index[(size + KMALLOC_LOOKUP_STEP - 1) / KMALLOC_LOOKUP_STEP];
 
-    if (unlikely(order >= KMALLOC_NR_CACHES))
+    if (unlikely(size > (1UL << KMALLOC_MAX_SHIFT)))
         return -1;
-    return (int) order;
+    return __kmalloc_index(size);
 }
 
-void *kmalloc(size_t size, int flags)
+size_t kmalloc_size_roundup(size_t size)
 {
-    int order = size_to_order(size);
+    int index = kmalloc_index(size);
+    return index < 0 ? 0 : kmalloc_caches[index]->objsize;
+}
 
-    if (order < 0)
+static void *__kmalloc(size_t size, int flags, unsigned long ip)
+{
+    int index = kmalloc_index(size);
+
+    if (index < 0)
         return NULL;
 
-    void *ret = kmem_cache_alloc(kmalloc_caches[order], flags);
+    void *ret = __kmem_cache_alloc(kmalloc_caches[index], flags, ALLOC_PROF_KMALLOC, ip);
 
     if (ret)
     {
         // If KASAN is on, poison the remainder (objsize - alloc_size) of the allocation.
 #ifdef CONFIG_KASAN
-        size_t cacheobjsize = kmalloc_caches[order]->objsize;
+        size_t cacheobjsize = kmalloc_caches[index]->objsize;
         if (size - cacheobjsize)
             asan_poison_shadow((unsigned long) ret + size, cacheobjsize - size, KASAN_REDZONE);
 #endif
@@ -1606,9 +1799,14 @@ void *kmalloc(size_t size, int flags)
     return ret;
 }
 
+void *kmalloc(size_t size, int flags)
+{
+    return __kmalloc(size, flags, _RET_IP_);
+}
+
 void *malloc(size_t size)
 {
-    return kmalloc(size, GFP_ATOMIC);
+    return __kmalloc(size, GFP_ATOMIC, _RET_IP_);
 }
 
 void free(void *ptr)
@@ -1623,7 +1821,7 @@ void *kcalloc(size_t nr, size_t size, int flags)
 
     const size_t len = nr * size;
 
-    void *ptr = kmalloc(len, flags);
+    void *ptr = __kmalloc(len, flags, _RET_IP_);
     if (unlikely(!ptr))
         return NULL;
 
@@ -1636,10 +1834,10 @@ void *calloc(size_t nr, size_t size)
     return kcalloc(nr, size, GFP_ATOMIC);
 }
 
-void *krealloc(void *ptr, size_t size, int flags)
+static void *__krealloc(void *ptr, size_t size, int flags, unsigned long ip)
 {
     if (!ptr)
-        return kmalloc(size, flags);
+        return __kmalloc(size, flags, ip);
 
     struct slab *old_slab = kmem_pointer_to_slab(ptr);
 
@@ -1655,7 +1853,7 @@ void *krealloc(void *ptr, size_t size, int flags)
         return ptr;
     }
 
-    void *newbuf = kmalloc(size, flags);
+    void *newbuf = __kmalloc(size, flags, ip);
     if (!newbuf)
         return NULL;
     __memcpy(newbuf, ptr, old_slab->cache->objsize);
@@ -1663,9 +1861,14 @@ void *krealloc(void *ptr, size_t size, int flags)
     return newbuf;
 }
 
+void *krealloc(void *ptr, size_t size, int flags)
+{
+    return __krealloc(ptr, size, flags, _RET_IP_);
+}
+
 void *realloc(void *ptr, size_t size)
 {
-    return krealloc(ptr, size, GFP_ATOMIC);
+    return __krealloc(ptr, size, GFP_ATOMIC, _RET_IP_);
 }
 
 int posix_memalign(void **pptr, size_t align, size_t len)
@@ -1678,7 +1881,7 @@ void *kreallocarray(void *ptr, size_t m, size_t n, int flags)
 {
     if (array_overflows(m, n))
         return NULL;
-    return krealloc(ptr, n * m, flags);
+    return __krealloc(ptr, n * m, flags, _RET_IP_);
 }
 
 void kvfree(void *ptr)
@@ -1689,14 +1892,19 @@ void kvfree(void *ptr)
         kfree(ptr);
 }
 
-void *kvmalloc(size_t size, unsigned int flags)
+static void *__kvmalloc(size_t size, unsigned int flags, unsigned long ip)
 {
     void *ptr;
 
-    ptr = kmalloc(size, __GFP_NOWARN | flags);
+    ptr = __kmalloc(size, __GFP_NOWARN | flags, ip);
     if (likely(ptr))
         return ptr;
-    return vmalloc(vm_size_to_pages(size), VM_TYPE_REGULAR, VM_WRITE | VM_READ, flags);
+    return __vmalloc(vm_size_to_pages(size), VM_TYPE_REGULAR, VM_WRITE | VM_READ, flags, ip);
+}
+
+void *kvmalloc(size_t size, unsigned int flags)
+{
+    return __kvmalloc(size, flags, _RET_IP_);
 }
 
 void *kvcalloc(size_t nr, size_t size, unsigned int flags)
@@ -1705,7 +1913,7 @@ void *kvcalloc(size_t nr, size_t size, unsigned int flags)
     if (array_overflows(nr, size))
         return NULL;
 
-    ptr = kvmalloc(nr * size, flags);
+    ptr = __kvmalloc(nr * size, flags, _RET_IP_);
     if (likely(ptr) && !is_vmalloc_addr(ptr))
         memset(ptr, 0, nr * size);
     return ptr;
@@ -1880,6 +2088,7 @@ static void print_slabinfo_header(struct seq_file *m)
     seq_puts(m, "# name            <active_objs> <num_objs> <objsize> <objperslab> <pagesperslab>");
     seq_puts(m, " : tunables <limit> <batchcount> <sharedfactor>");
     seq_puts(m, " : slabdata <active_slabs> <num_slabs> <sharedavail>");
+    seq_puts(m, " : waste <waste_bytes>");
     seq_putc(m, '\n');
 }
 
@@ -1889,6 +2098,8 @@ struct slabinfo
     unsigned int objects_per_slab;
     int cache_order;
     unsigned int limit, batchcount, shared;
+    /* Memory lost to padding, redzones and unused space at the end of slabs */
+    unsigned long waste;
 };
 
 static void get_slabinfo(struct slab_cache *s, struct slabinfo *si)
@@ -1908,8 +2119,10 @@ static void get_slabinfo(struct slab_cache *s, struct slabinfo *si)
     si->num_slabs = si->active_slabs + s->nfreeslabs;
     si->batchcount = s->mag_limit / 2;
     si->cache_order = order;
-    si->objects_per_slab = slab_size / (s->objsize + s->redzone);
+    si->objects_per_slab = slab_size / (s->objsize + s->redzone + KMEM_OBJ_TAG_SIZE);
     si->num_objs = si->num_slabs * si->objects_per_slab;
+    si->waste = si->num_slabs * (slab_size - si->objects_per_slab * (s->objsize + s->redzone)) +
+                si->active_objs * (s->objsize + s->redzone - s->actual_objsize);
 }
 
 static void print_slabinfo(struct seq_file *m, struct slab_cache *s)
@@ -1922,6 +2135,7 @@ static void print_slabinfo(struct seq_file *m, struct slab_cache *s)
     seq_printf(m, " : tunables %4u %4u %4u", sinfo.limit, sinfo.batchcount, sinfo.shared);
     seq_printf(m, " : slabdata %6lu %6lu %6lu", sinfo.active_slabs, sinfo.num_slabs,
                sinfo.shared_avail);
+    seq_printf(m, " : waste %8lu", sinfo.waste);
     seq_putc(m, '\n');
 }
 
@@ -7,19 +7,32 @@
  */
 #define pr_fmt(fmt) "swap: " fmt
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <onyx/bio.h>
 #include <onyx/buffer.h>
 #include <onyx/cpu.h>
+#include <onyx/cred.h>
 #include <onyx/err.h>
 #include <onyx/file.h>
 #include <onyx/filemap.h>
+#include <onyx/init.h>
 #include <onyx/maple_tree.h>
+#include <onyx/mm/migrate.h>
 #include <onyx/mm/page_lru.h>
 #include <onyx/mm/slab.h>
+#include <onyx/mm/workingset.h>
+#include <onyx/mm/zswap.h>
+#include <onyx/mutex.h>
 #include <onyx/namei.h>
 #include <onyx/pgtable.h>
+#include <onyx/proc.h>
 #include <onyx/rcupdate.h>
+#include <onyx/scheduler.h>
+#include <onyx/seq_file.h>
+#include <onyx/signal.h>
+#include <onyx/swap.h>
+#include <onyx/sysfs.h>
 #include <onyx/user.h>
 #include <onyx/vfs.h>
 #include <onyx/vm_fault.h>
@@ -44,11 +57,29 @@ struct swap_extent
     u64 length;
 };
 
+/* Swap slots are handed out in clusters of SWAP_CLUSTER_SIZE contiguous slots. Each CPU allocates
+ * from its own cluster until it runs out, so pages reclaimed together (usually neighbours) end up
+ * next to each other on disk, and can be read back in a single IO. */
+#define SWAP_CLUSTER_SIZE 64UL
+#define SWAP_CLUSTER_NONE ((unsigned int) -1)
+
+struct swap_cluster
+{
+    /* Slots that can't be allocated (used, or past the end of the swap area) */
+    u16 count;
+    /* Set while a CPU is allocating from this cluster */
+    u16 owned;
+    /* Next cluster in the block group's free list */
+    unsigned int next;
+};
+
 struct swap_block_group
 {
     u8 *start, *end;
     unsigned long nr_free;
-    int smallest_bit_free;
+    /* Completely free clusters not owned by any CPU, linked through swap_cluster::next */
+    unsigned int free_head;
+    unsigned int nr_free_clusters;
     struct spinlock lock;
 };
 
@@ -75,15 +106,57 @@ struct swap_area
     unsigned long nr_block_groups;
 
     u8 *swap_map;
+    struct swap_cluster *clusters;
+    unsigned long nr_clusters;
     struct vm_object *swap_space;
+
+    /* Cleared when swapoff starts, no new slots get allocated from the area after that */
+    bool writeok;
+    /* Unique across swapons, tells an area apart from older ones that used the same index */
+    unsigned long gen;
+};
+
+/* Areas slots get allocated from (writeok), highest priority first. Rebuilt under swapon_mutex,
+ * and published with RCU. */
+struct swap_avail
+{
+    unsigned int nr;
+    int areas[MAX_SWAP_AREAS];
+    int prio[MAX_SWAP_AREAS];
 };
 
+static struct swap_avail swap_avail_bufs[2];
+static struct swap_avail *swap_avail = &swap_avail_bufs[0];
+
+/* Serializes swapon and swapoff, and protects swap_avail's rebuilding */
+static DECLARE_MUTEX(swapon_mutex);
+/* Priority given to the last area swapped on without SWAP_FLAG_PREFER */
+static int least_priority;
+static unsigned long swap_area_gen;
+/* Round-robin counter, for spreading clusters over areas with the same priority */
+static unsigned int swap_rr;
+
+struct swap_pcpu_cluster
+{
+    /* Area and cluster this CPU is allocating from. Only valid if active. */
+    int area;
+    bool active;
+    unsigned long gen;
+    unsigned long cluster;
+    /* Next (swap_off relative) offset to look at */
+    unsigned long next;
+};
+
+/* Protected by disabling preemption */
+static struct swap_pcpu_cluster swap_pcpu_clusters[CONFIG_SMP_NR_CPUS];
+
 static inline struct blockdev *blkdev_get_dev(struct file *f)
 {
     return (struct blockdev *) f->f_ino->i_helper;
 }
 
 unsigned int bdev_sector_size(struct blockdev *bdev);
+unsigned long bdev_max_sgls(struct blockdev *bdev);
 
 #define SWAP_COUNTER_BATCH 32
 
@@ -139,8 +212,6 @@ bool swap_is_available(void)
     return READ_ONCE(swap_usage.counter) < total_swap;
 }
 
-#define MAX_SWAP_AREAS 16
-
 struct spinlock swap_areas_lock;
 static struct swap_area *swap_areas[MAX_SWAP_AREAS];
 struct vm_object *swap_spaces[MAX_SWAP_AREAS];
@@ -203,13 +274,14 @@ out:
 }
 
 /**
- * @brief Destroy a partially constructed swap area
+ * @brief Destroy a swap area that isn't installed (anymore)
  *
  * @param sa Swap area
  */
-static void swap_area_destroy_early(struct swap_area *sa)
+static void swap_area_destroy(struct swap_area *sa)
 {
-    /* No need to use RCU for any of this stuff here, we haven't exposed this swap area yet */
+    /* No need to use RCU for any of this stuff here, the area isn't exposed anymore (or wasn't
+     * yet) */
     unsigned long index = 0;
     struct swap_extent *se;
     mt_for_each (&sa->extents_tree, se, index, -1UL)
@@ -219,8 +291,12 @@ static void swap_area_destroy_early(struct swap_area *sa)
 
     if (sa->block_groups)
         vfree(sa->block_groups);
+    if (sa->clusters)
+        vfree(sa->clusters);
     if (sa->swap_map)
         vfree(sa->swap_map);
+    if (sa->swap_space)
+        vmo_unref(sa->swap_space);
 
     if (sa->file)
         fd_put(sa->file);
@@ -254,49 +330,166 @@ static int swap_setup_map(struct swap_area *sa)
         return -ENOMEM;
     }
 
+    /* Clusters never straddle block groups (MAX_BLOCK_GROUP_SIZE is a multiple of the cluster
+     * size), so a cluster is protected by its block group's lock. */
+    sa->nr_clusters = sa->nr_pages / SWAP_CLUSTER_SIZE;
+    if (sa->nr_pages % SWAP_CLUSTER_SIZE)
+        sa->nr_clusters++;
+
+    sa->clusters = vmalloc(vm_size_to_pages(sa->nr_clusters * sizeof(struct swap_cluster)),
+                           VM_TYPE_REGULAR, VM_WRITE | VM_READ, GFP_KERNEL);
+    if (!sa->clusters)
+    {
+        pr_err("Failed to allocate an %lukB sized array of swap_clusters\n",
+               sa->nr_clusters * sizeof(struct swap_cluster) / 1024);
+        return -ENOMEM;
+    }
+
     for (unsigned long i = 0, start = 0; i < sa->nr_block_groups;
          i++, start += MAX_BLOCK_GROUP_SIZE)
     {
         struct swap_block_group *bg = &sa->block_groups[i];
         unsigned long size = min(sa->nr_pages - start, MAX_BLOCK_GROUP_SIZE);
+        unsigned long first = start / SWAP_CLUSTER_SIZE;
+        unsigned long last = (start + size - 1) / SWAP_CLUSTER_SIZE;
         bg->start = sa->swap_map + start;
         bg->end = bg->start + size;
         bg->nr_free = size;
-        bg->smallest_bit_free = 0;
+        bg->free_head = SWAP_CLUSTER_NONE;
+        bg->nr_free_clusters = 0;
         spinlock_init(&bg->lock);
+
+        /* Push them in reverse, so we start allocating from the lowest offset. The last cluster
+         * might be cut short by the end of the swap area, account the missing slots as used. */
+        for (unsigned long j = last + 1; j-- > first;)
+        {
+            struct swap_cluster *c = &sa->clusters[j];
+            unsigned long valid = min(sa->nr_pages - j * SWAP_CLUSTER_SIZE, SWAP_CLUSTER_SIZE);
+            c->count = SWAP_CLUSTER_SIZE - valid;
+            c->owned = 0;
+            c->next = SWAP_CLUSTER_NONE;
+            if (c->count)
+                continue;
+            c->next = bg->free_head;
+            bg->free_head = j;
+            bg->nr_free_clusters++;
+        }
     }
 
     return 0;
 }
 
+/**
+ * @brief Rebuild (and publish) the list of areas we allocate from
+ * Called with swapon_mutex held.
+ */
+static void swap_avail_rebuild(void)
+{
+    struct swap_avail *avail =
+        swap_avail == &swap_avail_bufs[0] ? &swap_avail_bufs[1] : &swap_avail_bufs[0];
+
+    avail->nr = 0;
+    for (int i = 0; i < MAX_SWAP_AREAS; i++)
+    {
+        struct swap_area *sa = swap_areas[i];
+        unsigned int j;
+        if (!sa || !sa->writeok)
+            continue;
+
+        /* Insertion sort, highest priority first. Equal priorities stay in index order. */
+        for (j = avail->nr; j > 0 && avail->prio[j - 1] < sa->prio; j--)
+        {
+            avail->areas[j] = avail->areas[j - 1];
+            avail->prio[j] = avail->prio[j - 1];
+        }
+
+        avail->areas[j] = i;
+        avail->prio[j] = sa->prio;
+        avail->nr++;
+    }
+
+    rcu_assign_pointer(swap_avail, avail);
+    /* Wait for everyone to stop looking at the old copy, so the next rebuild can reuse it. This
+     * also means no one can allocate from an area that was just taken out of the list. */
+    synchronize_rcu();
+}
+
+/**
+ * @brief Get a reference to a swap area, so it doesn't go away under us
+ *
+ * @param type Swap area index
+ * @return The swap area, or NULL if it doesn't exist (anymore)
+ */
+static struct swap_area *swap_area_get(unsigned int type)
+{
+    struct swap_area *sa;
+
+    rcu_read_lock();
+    sa = rcu_dereference(swap_areas[type]);
+    if (sa)
+        __atomic_add_fetch(&sa->refs, 1, __ATOMIC_ACQUIRE);
+    rcu_read_unlock();
+    return sa;
+}
+
+static void swap_area_put(struct swap_area *sa)
+{
+    __atomic_sub_fetch(&sa->refs, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Count a swap area's used slots
+ *
+ * @param sa Swap area
+ * @return Number of used slots (including slots only held by the swap cache)
+ */
+static unsigned long swap_area_used(struct swap_area *sa)
+{
+    unsigned long nr_free = 0;
+
+    /* Take the locks, so whoever freed the last slot is done with the block group once we
+     * return 0 */
+    for (unsigned long i = 0; i < sa->nr_block_groups; i++)
+    {
+        struct swap_block_group *bg = &sa->block_groups[i];
+        spin_lock(&bg->lock);
+        nr_free += bg->nr_free;
+        spin_unlock(&bg->lock);
+    }
+
+    return sa->nr_pages - nr_free;
+}
+
 static int swap_install(struct swap_area *sa)
 {
-    int err = 1;
+    int err = -ESRCH;
     spin_lock(&swap_areas_lock);
 
     for (int i = 0; i < MAX_SWAP_AREAS; i++)
     {
         if (!swap_areas[i])
         {
-            swap_areas[i] = sa;
+            sa->writeok = true;
+            sa->gen = ++swap_area_gen;
+            rcu_assign_pointer(swap_areas[i], sa);
             swap_spaces[i] = sa->swap_space;
             __atomic_add_fetch(&total_swap, sa->nr_pages, __ATOMIC_RELAXED);
-            err = 0;
+            err = i;
             break;
         }
     }
 
     spin_unlock(&swap_areas_lock);
 
-    if (err)
+    if (err < 0)
         pr_err("Failed to install swap area: limit reached\n");
-    return err ? -ESRCH : 0;
+    return err;
 }
 
 static int do_swapon(struct file *swapfile, int flags)
 {
     int err = -ENOMEM, prio;
-    unsigned long nr_pages;
+    unsigned long nr_pages, nr_slots;
     struct swap_area *swp = kmalloc(sizeof(*swp), GFP_KERNEL);
     if (!swp)
     {
@@ -308,6 +501,7 @@ static int do_swapon(struct file *swapfile, int flags)
     swp->refs = 1;
     swp->file = swapfile;
     swp->flags = flags;
+    swp->prio = (flags & SWAP_FLAG_PRIO_MASK) >> SWAP_FLAG_PRIO_SHIFT;
     swp->bdev = blkdev_get_dev(swapfile);
     swp->extents_tree = (struct maple_tree) MTREE_INIT(swp->extents_tree, MT_FLAGS_USE_RCU);
 
@@ -341,24 +535,60 @@ static int do_swapon(struct file *swapfile, int flags)
     /* Read it before installing, since we lose the swap_area's ownership */
     prio = swp->prio;
     nr_pages = swp->nr_pages;
+    nr_slots = swp->nr_pages + swp->swap_off;
+
+    mutex_lock(&swapon_mutex);
+    if (!(flags & SWAP_FLAG_PREFER))
+        swp->prio = prio = --least_priority;
 
     err = swap_install(swp);
     if (err < 0)
+    {
+        mutex_unlock(&swapon_mutex);
         goto out_err;
+    }
+
+    /* Set zswap up before we start allocating from the area */
+    zswap_swapon(err, nr_slots);
+    swap_avail_rebuild();
+    mutex_unlock(&swapon_mutex);
 
     pr_info("Installed swap area with %lukB, priority %d\n", nr_pages * PAGE_SIZE / 1024, prio);
     return 0;
 out_err:
-    swap_area_destroy_early(swp);
+    swap_area_destroy(swp);
     return err;
 }
 
-#define VALID_SWAPON_FLAGS 0
+/**
+ * @brief Give back an automatically assigned priority
+ * Areas below it move up one, so the next swapon without SWAP_FLAG_PREFER gets the priority right
+ * below the lowest one in use. Called with the swapon_mutex held.
+ *
+ * @param prio Priority of the area that went away
+ */
+static void swap_release_priority(int prio)
+{
+    for (int i = 0; i < MAX_SWAP_AREAS; i++)
+    {
+        struct swap_area *sa = swap_areas[i];
+        if (sa && !(sa->flags & SWAP_FLAG_PREFER) && sa->prio < prio)
+            sa->prio++;
+    }
+
+    least_priority++;
+    swap_avail_rebuild();
+}
+
+#define VALID_SWAPON_FLAGS (SWAP_FLAG_PREFER | SWAP_FLAG_PRIO_MASK)
 
 int sys_swapon(const char *upath, int flags)
 {
     int err = 0;
 
+    if (!is_root_user())
+        return -EPERM;
+
     if (flags & ~VALID_SWAPON_FLAGS)
         return -EINVAL;
 
@@ -384,26 +614,182 @@ int sys_swapon(const char *upath, int flags)
         goto err;
     }
 
-    return do_swapon(file, flags);
+    err = do_swapon(file, flags);
 err:
     free((void *) path);
     return err;
 }
 
-int sys_swapoff(const char *upath)
+#define SWAP_MAX_USAGE     0x7f
+#define SWAP_MAP_SWAPCACHE 0x80
+
+static void swap_cluster_push(struct swap_area *sa, struct swap_block_group *bg, unsigned long idx)
 {
-    return -ENOSYS;
+    sa->clusters[idx].next = bg->free_head;
+    bg->free_head = idx;
+    bg->nr_free_clusters++;
 }
 
-#define SWAP_MAX_USAGE     0x7f
-#define SWAP_MAP_SWAPCACHE 0x80
+static unsigned long swap_cluster_pop(struct swap_area *sa, struct swap_block_group *bg)
+{
+    unsigned long idx = bg->free_head;
+    struct swap_cluster *c = &sa->clusters[idx];
+    DCHECK(c->count == 0 && !c->owned);
+    bg->free_head = c->next;
+    bg->nr_free_clusters--;
+    c->next = SWAP_CLUSTER_NONE;
+    c->owned = 1;
+    return idx;
+}
+
+/**
+ * @brief Allocate a slot to a page
+ * Called with the slot's block group lock held.
+ *
+ * @param sa Swap area
+ * @param area Swap area index
+ * @param bg Block group
+ * @param eff_off Slot's offset (relative to swap_off)
+ * @param page Page
+ */
+static void swap_take_slot(struct swap_area *sa, int area, struct swap_block_group *bg,
+                           unsigned long eff_off, struct page *page)
+{
+    WARN_ON(bg->nr_free == 0);
+    sa->swap_map[eff_off] = SWAP_MAP_SWAPCACHE;
+    sa->clusters[eff_off / SWAP_CLUSTER_SIZE].count++;
+    bg->nr_free--;
+    page->priv = SWP_ENTRY((unsigned long) area, eff_off + sa->swap_off).swp;
+    WARN_ON(page_test_swap(page));
+    page_set_swap(page);
+    __swap_add_counter(1);
+}
+
+/**
+ * @brief Free a slot whose swap map count (and swap cache bit) dropped to 0
+ * Called with the slot's block group lock held.
+ *
+ * @param sa Swap area
+ * @param bg Block group
+ * @param eff_off Slot's offset (relative to swap_off)
+ * @param swp Swap entry
+ */
+static void swap_free_slot(struct swap_area *sa, struct swap_block_group *bg,
+                           unsigned long eff_off, swp_entry_t swp)
+{
+    unsigned long idx = eff_off / SWAP_CLUSTER_SIZE;
+    struct swap_cluster *c = &sa->clusters[idx];
+
+    /* Drop the compressed copy while we still hold the lock, so we don't race with the slot being
+     * reused. */
+    zswap_invalidate(swp);
+    sa->swap_map[eff_off] = 0;
+    bg->nr_free++;
+    __swap_add_counter(-1);
+
+    DCHECK(c->count > 0);
+    /* Owned clusters go back to the free list when their CPU lets go of them */
+    if (--c->count == 0 && !c->owned)
+        swap_cluster_push(sa, bg, idx);
+}
+
+/**
+ * @brief Allocate a slot from this CPU's cluster
+ * If the cluster is exhausted, the CPU lets go of it.
+ *
+ * @param pc Per-cpu cluster (must be active)
+ * @param page Page
+ * @return 0 on success, -ENOSPC if the cluster has no free slots left
+ */
+static int swap_alloc_pcpu(struct swap_pcpu_cluster *pc, struct page *page)
+{
+    struct swap_area *sa = rcu_dereference(swap_areas[pc->area]);
+    unsigned long start = pc->cluster * SWAP_CLUSTER_SIZE;
+    unsigned long end;
+    struct swap_block_group *bg;
+    struct swap_cluster *c;
+    int err = 0;
+
+    /* The area was swapped off since we got the cluster (and maybe replaced by another one) */
+    if (!sa || sa->gen != pc->gen)
+    {
+        pc->active = false;
+        return -ENOSPC;
+    }
+
+    end = min(start + SWAP_CLUSTER_SIZE, (unsigned long) sa->nr_pages);
+    bg = &sa->block_groups[start / MAX_BLOCK_GROUP_SIZE];
+    c = &sa->clusters[pc->cluster];
+
+    spin_lock(&bg->lock);
+    /* Slots behind the cursor might have been freed meanwhile. Leave them to the slow path, so
+     * allocations stay sequential. If the area is being swapped off, just let go of the cluster. */
+    if (!READ_ONCE(sa->writeok))
+        pc->next = end;
+
+    for (; pc->next < end; pc->next++)
+    {
+        if (!sa->swap_map[pc->next])
+        {
+            swap_take_slot(sa, pc->area, bg, pc->next++, page);
+            goto out;
+        }
+    }
+
+    err = -ENOSPC;
+    c->owned = 0;
+    if (c->count == 0)
+        swap_cluster_push(sa, bg, pc->cluster);
+    pc->active = false;
+out:
+    spin_unlock(&bg->lock);
+    return err;
+}
+
+/**
+ * @brief Grab a free cluster for this CPU
+ *
+ * @param pc Per-cpu cluster (must not be active)
+ * @param sa Swap area
+ * @param area Swap area index
+ * @return True if we got one, else false
+ */
+static bool swap_alloc_cluster(struct swap_pcpu_cluster *pc, struct swap_area *sa, int area)
+{
+    /* Spread CPUs over the block groups, so they don't fight over the same lock */
+    unsigned long first = get_cpu_nr() % sa->nr_block_groups;
+    for (unsigned long j = 0; j < sa->nr_block_groups; j++)
+    {
+        unsigned long bgno = (first + j) % sa->nr_block_groups;
+        struct swap_block_group *bg = &sa->block_groups[bgno];
+        if (!READ_ONCE(bg->nr_free_clusters))
+            continue;
+
+        spin_lock(&bg->lock);
+        if (bg->nr_free_clusters)
+        {
+            pc->area = area;
+            pc->gen = sa->gen;
+            pc->cluster = swap_cluster_pop(sa, bg);
+            pc->next = pc->cluster * SWAP_CLUSTER_SIZE;
+            pc->active = true;
+        }
+
+        spin_unlock(&bg->lock);
+        if (pc->active)
+            return true;
+    }
+
+    return false;
+}
 
 static int swap_alloc_from_block_group(struct swap_area *sa, int area, struct swap_block_group *bg,
                                        unsigned long bgno, struct page *page)
 {
-    u8 *map;
+    unsigned long first = (bgno * MAX_BLOCK_GROUP_SIZE) / SWAP_CLUSTER_SIZE;
+    unsigned long last = (bgno * MAX_BLOCK_GROUP_SIZE + (bg->end - bg->start) - 1) /
+                         SWAP_CLUSTER_SIZE;
     int err = -ENOSPC;
-    unsigned long offset;
     spin_lock(&bg->lock);
     /* Recheck bg->nr_free under the lock. We've checked it out of the lock using READ_ONCE before,
      * thus it's unlikely we're here unless we were reading stale data.
@@ -411,24 +797,25 @@ static int swap_alloc_from_block_group(struct swap_area *sa, int area, struct sw
     if (unlikely(bg->nr_free == 0))
         goto out;
 
-    map = bg->start;
-    while (map != bg->end)
+    /* Only look at partially used clusters. Free clusters (count == 0) are either on the free
+     * list, or being allocated from by some CPU. */
+    for (unsigned long i = first; i <= last; i++)
     {
-        if (!*map)
+        struct swap_cluster *c = &sa->clusters[i];
+        unsigned long start = i * SWAP_CLUSTER_SIZE;
+        unsigned long end = min(start + SWAP_CLUSTER_SIZE, (unsigned long) sa->nr_pages);
+        if (c->count == 0 || c->count == SWAP_CLUSTER_SIZE)
+            continue;
+
+        for (unsigned long off = start; off < end; off++)
         {
-            WARN_ON(bg->nr_free == 0);
-            *map = SWAP_MAP_SWAPCACHE;
-            offset = (bgno * MAX_BLOCK_GROUP_SIZE) + map - bg->start + sa->swap_off;
-            page->priv = SWP_ENTRY((unsigned long) area, offset).swp;
-            WARN_ON(page_test_swap(page));
-            page_set_swap(page);
-            err = 0;
-            bg->nr_free--;
-            __swap_add_counter(1);
-            break;
+            if (!sa->swap_map[off])
+            {
+                swap_take_slot(sa, area, bg, off, page);
+                err = 0;
+                goto out;
+            }
         }
-
-        map++;
     }
 
 out:
@@ -452,22 +839,72 @@ static int swap_alloc_from_area(struct swap_area *swap, int area, struct page *p
     return err;
 }
 
+/**
+ * @brief Allocate a slot from a group of areas with the same priority
+ * The areas take turns handing out clusters, so swap IO gets striped over them.
+ *
+ * @param pc Per-cpu cluster (must not be active)
+ * @param areas Swap area indices
+ * @param nr Number of areas
+ * @param page Page
+ * @return 0 on success, -ENOSPC if the areas are full
+ */
+static int swap_alloc_from_group(struct swap_pcpu_cluster *pc, const int *areas, unsigned int nr,
+                                 struct page *page)
+{
+    unsigned int first = nr > 1 ? __atomic_fetch_add(&swap_rr, 1, __ATOMIC_RELAXED) % nr : 0;
+
+    for (unsigned int i = 0; i < nr; i++)
+    {
+        int area = areas[(first + i) % nr];
+        struct swap_area *sa = rcu_dereference(swap_areas[area]);
+        if (sa && swap_alloc_cluster(pc, sa, area) && !swap_alloc_pcpu(pc, page))
+            return 0;
+    }
+
+    /* No free clusters left. Look for free slots in partially used clusters. */
+    for (unsigned int i = 0; i < nr; i++)
+    {
+        int area = areas[(first + i) % nr];
+        struct swap_area *sa = rcu_dereference(swap_areas[area]);
+        if (sa && !swap_alloc_from_area(sa, area, page))
+            return 0;
+    }
+
+    return -ENOSPC;
+}
+
 static int swap_allocate(struct page *page)
 {
     int err = -ENOSPC;
-    struct swap_area *sa;
+    struct swap_pcpu_cluster *pc;
+    struct swap_avail *avail;
+    unsigned int i, j;
     rcu_read_lock();
-    for (unsigned int i = 0; i < MAX_SWAP_AREAS; i++)
+    sched_disable_preempt();
+
+    /* Fast path: the next slot in our cluster */
+    pc = &swap_pcpu_clusters[get_cpu_nr()];
+    if (pc->active && !swap_alloc_pcpu(pc, page))
     {
-        sa = swap_areas[i];
-        if (!sa)
-            continue;
-        err = swap_alloc_from_area(sa, i, page);
+        err = 0;
+        goto out;
+    }
+
+    /* Higher priority areas get filled up first */
+    avail = rcu_dereference(swap_avail);
+    for (i = 0; i < avail->nr; i = j)
+    {
+        for (j = i + 1; j < avail->nr && avail->prio[j] == avail->prio[i]; j++)
+            ;
+        err = swap_alloc_from_group(pc, avail->areas + i, j - i, page);
         if (!err)
             break;
     }
-    rcu_read_unlock();
 
+out:
+    sched_enable_preempt();
+    rcu_read_unlock();
     return err;
 }
 
@@ -491,6 +928,8 @@ bool swap_put(swp_entry_t entry)
     {
         (*map)--;
         count--;
+        if (!*map)
+            swap_free_slot(sa, bg, eff_off, entry);
     }
 
     spin_unlock(&bg->lock);
@@ -515,13 +954,14 @@ static void swap_final_put(swp_entry_t swp)
 
     map = bg->start + (eff_off % MAX_BLOCK_GROUP_SIZE);
     count = *map & ~SWAP_MAP_SWAPCACHE;
-    if (WARN_ON_ONCE(count > 0))
+    /* Removing the page from the swap cache usually frees the slot already */
+    if (*map == 0 || WARN_ON_ONCE(count > 0))
     {
         spin_unlock(&bg->lock);
         return;
     }
 
-    *map = 0;
+    swap_free_slot(sa, bg, eff_off, swp);
     spin_unlock(&bg->lock);
 }
 
@@ -554,10 +994,42 @@ void swap_unset_swapcache(swp_entry_t swp)
 
     map = bg->start + (eff_off % MAX_BLOCK_GROUP_SIZE);
     count = *map & ~SWAP_MAP_SWAPCACHE;
+    if (WARN_ON_ONCE(!(*map & SWAP_MAP_SWAPCACHE)))
+        goto out;
+
     if (count == 0)
-        __swap_add_counter(-1);
-    *map = count;
+        swap_free_slot(sa, bg, eff_off, swp);
+    else
+        *map = count;
+out:
+    spin_unlock(&bg->lock);
+}
+
+/**
+ * @brief Mark a slot as being in the swap cache, before adding a page for it
+ *
+ * @param swp Swap entry
+ * @return 0 on success, -ENOENT if the slot is free, -EEXIST if it's already in the swap cache
+ */
+static int swapcache_prepare(swp_entry_t swp)
+{
+    struct swap_area *sa = swap_areas[SWP_TYPE(swp)];
+    unsigned long eff_off = SWP_OFFSET(swp) - sa->swap_off;
+    struct swap_block_group *bg = &sa->block_groups[eff_off / MAX_BLOCK_GROUP_SIZE];
+    int err = 0;
+    u8 *map;
+
+    spin_lock(&bg->lock);
+
+    map = bg->start + (eff_off % MAX_BLOCK_GROUP_SIZE);
+    if (*map == 0)
+        err = -ENOENT;
+    else if (*map & SWAP_MAP_SWAPCACHE)
+        err = -EEXIST;
+    else
+        *map |= SWAP_MAP_SWAPCACHE;
     spin_unlock(&bg->lock);
+    return err;
 }
 
 void __swap_inc_map(swp_entry_t entry)
@@ -633,7 +1105,7 @@ int swap_add(struct page *page)
     err = swap_add_to_swapcache(page);
     if (err)
     {
-        swap_put_page(page);
+        swap_unset_swapcache(swpval_to_swp_entry(page->priv));
         page_clear_swap(page);
         return err;
     }
@@ -672,7 +1144,16 @@ static ssize_t swap_writepage(struct vm_object *vm_obj, struct page *page, size_
 {
     int err;
     struct swap_area *sa = vm_obj->priv;
-    struct bio_req *bio = bio_alloc(GFP_NOIO, 1);
+    struct bio_req *bio;
+
+    /* Keep the page compressed in memory if we can, and only do IO if zswap can't take it */
+    if (!zswap_store(page))
+    {
+        unlock_page(page);
+        return PAGE_SIZE;
+    }
+
+    bio = bio_alloc(GFP_NOIO, 1);
     if (!bio)
     {
         err = -ENOMEM;
@@ -703,35 +1184,6 @@ err_unlock:
     return err;
 }
 
-static int swap_readpage(struct vm_object *obj, swp_entry_t swp, struct page *page) REQUIRES(page)
-    RELEASE(page)
-{
-    int err;
-    struct swap_area *sa = obj->priv;
-    struct bio_req *bio = bio_alloc(GFP_NOIO, 1);
-    if (!bio)
-    {
-        err = -ENOMEM;
-        goto err_unlock;
-    }
-
-    bio->sector_number = SWP_OFFSET(swp) * (PAGE_SIZE / bdev_sector_size(sa->bdev));
-    bio_push_pages(bio, page, 0, PAGE_SIZE);
-    bio->flags = BIO_REQ_READ_OP;
-
-    err = bio_submit_req_wait(sa->bdev, bio);
-    bio_put(bio);
-    if (err < 0)
-        goto err_unlock;
-
-    page_set_uptodate(page);
-    unlock_page(page);
-    return 0;
-err_unlock:
-    unlock_page(page);
-    return err;
-}
-
 static struct page *swap_cache_find(struct vm_object *obj, swp_entry_t swp)
 {
     struct page *p;
@@ -741,10 +1193,21 @@ static struct page *swap_cache_find(struct vm_object *obj, swp_entry_t swp)
     return p;
 }
 
-static struct page *swap_read_from_storage(swp_entry_t swp, struct vm_object *obj, bool *created)
+/**
+ * @brief Add a new page to the swap cache, for reading a slot in
+ *
+ * @param swp Swap entry
+ * @param obj Swap space
+ * @return The new page (locked, !UPTODATE, with a reference for the caller), or an ERR_PTR
+ * (-EEXIST if the slot is already in the swap cache, -ENOENT if it was freed)
+ */
+static struct page *swap_cache_add_new(swp_entry_t swp,
+                                       struct vm_object *obj) NO_THREAD_SAFETY_ANALYSIS
 {
     struct page *page, *page2;
+    unsigned long shadow;
     int err;
+
     page = alloc_page(PAGE_ALLOC_NO_ZERO | GFP_KERNEL);
     if (!page)
         return ERR_PTR(-ENOMEM);
@@ -755,44 +1218,408 @@ static struct page *swap_read_from_storage(swp_entry_t swp, struct vm_object *ob
     page_set_swap(page);
     page->priv = swp.swp;
 
-    page2 = vmo_add_page_safe(SWP_OFFSET(swp) << PAGE_SHIFT, page, obj);
+    /* Set the swap cache bit first. Whoever sets it gets to add the page. */
+    err = swapcache_prepare(swp);
+    if (err)
+        goto err;
+
+    page2 = vmo_add_page_shadow(SWP_OFFSET(swp) << PAGE_SHIFT, page, obj, &shadow);
     if (page2 != page)
     {
-        unlock_page(page);
-        page_clear_swap(page);
-        if (!page2)
-            page_unref(page);
-        page_unref(page);
-        if (!page2)
-            return ERR_PTR(-ENOMEM);
-        return page2;
+        err = -ENOMEM;
+        if (page2)
+        {
+            /* Can't happen, the swap cache bit says whether the slot has a page. Keep the bit set
+             * for the page that is there. vmo_add_page_safe dropped one of our references. */
+            WARN_ON(1);
+            page_unref(page2);
+            page_ref(page);
+            err = -EEXIST;
+        }
+        else
+            swap_unset_swapcache(swp);
+        goto err;
     }
 
-    *created = true;
     page_set_anon(page);
+    workingset_refault(page, shadow);
     page_add_lru(page);
-
-    /* page locked. Read it in. */
-    err = swap_readpage(obj, swp, page);
-    if (err < 0)
-        return ERR_PTR(err);
-    /* page unlocked */
     return page;
+err:
+    unlock_page(page);
+    page_clear_swap(page);
+    page_unref(page);
+    page_unref(page);
+    return ERR_PTR(err);
 }
 
-static void swap_cache_remove(struct vm_object *obj, struct page *page)
+/* Swap-in readahead: on a swap cache miss, read in the slots around the faulting one as well.
+ * Neighbours are either the ptes around the faulting address (vma readahead, the default), or the
+ * slots around the faulting slot (which, thanks to clustered allocation, were probably swapped out
+ * together). The window adapts to how many of the pages we read ahead end up getting used. */
+#define SWAP_RA_MAX_ORDER 5
+#define SWAP_RA_MAX_PAGES (1U << SWAP_RA_MAX_ORDER)
+
+/* log2 of the maximum readahead window */
+static unsigned int page_cluster = 3;
+static bool swap_vma_readahead = true;
+
+static struct
 {
-    DCHECK_PAGE(page_test_swap(page), page);
-    DCHECK_PAGE(page_locked(page), page);
-    swp_entry_t entry = swpval_to_swp_entry(page->priv);
+    /* Readahead pages that got faulted in, since the last window calculation */
+    unsigned int hits;
+    unsigned int window;
+    /* Last fault position (virtual page number or swap offset) */
+    unsigned long prev;
+} swap_ra;
+
+static struct
+{
+    unsigned long ra_pages;
+    unsigned long ra_hits;
+    unsigned long read_ios;
+    unsigned long read_pages;
+} swap_ra_stats;
+
+struct swap_ra_batch
+{
+    unsigned int nr;
+    /* Pages we need to read from the swap device */
+    struct page *pages[SWAP_RA_MAX_PAGES];
+};
+
+/**
+ * @brief Calculate the readahead window for a swap-in
+ *
+ * @param pos Fault position (virtual page number, or swap offset)
+ * @return Number of pages to read
+ */
+static unsigned int swap_ra_window(unsigned long pos)
+{
+    unsigned int max_pages = 1U << READ_ONCE(page_cluster);
+    unsigned int hits = __atomic_exchange_n(&swap_ra.hits, 0, __ATOMIC_RELAXED);
+    unsigned long prev = __atomic_exchange_n(&swap_ra.prev, pos, __ATOMIC_RELAXED);
+    unsigned int last = READ_ONCE(swap_ra.window);
+    unsigned int pages = hits + 2;
+
+    if (pages == 2)
+    {
+        /* Nothing we read ahead got used. Only keep reading ahead if the faults look sequential. */
+        if (pos != prev + 1 && pos != prev - 1)
+            pages = 1;
+    }
+    else
+        pages = 1U << pages2order(pages);
+
+    /* Don't shrink the window too fast, one unlucky fault shouldn't kill readahead */
+    if (pages < last / 2)
+        pages = last / 2;
+    if (pages > max_pages)
+        pages = max_pages;
+    if (!pages)
+        pages = 1;
+
+    WRITE_ONCE(swap_ra.window, pages);
+    return pages;
+}
+
+static void swap_ra_hit(void)
+{
+    __atomic_add_fetch(&swap_ra.hits, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&swap_ra_stats.ra_hits, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Gather the swap entries around the faulting address
+ * Looks at the ptes in the (aligned) window, inside the vma and the faulting pte's page table.
+ *
+ * @param ctx Fault context
+ * @param window Window, in pages
+ * @param entries Array of entries to fill (window - 1 long)
+ * @return Number of entries found
+ */
+static unsigned int swap_ra_gather_vma(struct vm_pf_context *ctx, unsigned int window,
+                                       swp_entry_t *entries)
+{
+    struct vm_area_struct *vma = ctx->entry;
+    unsigned long bytes = (unsigned long) window << PAGE_SHIFT;
+    unsigned long pmd = ctx->vpage & -PMD_SIZE;
+    unsigned long start, end;
+    struct spinlock *lock;
+    unsigned int nr = 0;
+    pte_t *ptep;
+
+    /* Stay inside the VMA and the page table the faulting pte lives in */
+    start = max(max(ctx->vpage & -bytes, vma->vm_start), pmd);
+    end = min(min((ctx->vpage & -bytes) + bytes, vma->vm_end), pmd + PMD_SIZE);
+
+    ptep = ptep_get_locked(vma->vm_mm, ctx->vpage, &lock);
+    if (!ptep)
+        return 0;
+
+    for (unsigned long addr = start; addr < end; addr += PAGE_SIZE)
+    {
+        long delta = (long) (addr - ctx->vpage) >> PAGE_SHIFT;
+        pte_t pte = ptep[delta];
+        swp_entry_t swp;
+
+        if (addr == ctx->vpage || pte_none(pte) || pte_present(pte) || pte_protnone(pte))
+            continue;
+
+        swp = pte_to_swp_entry(pte);
+        if (swp_is_migration(swp))
+            continue;
+        entries[nr++] = swp;
+    }
+
+    spin_unlock(lock);
+    return nr;
+}
+
+/**
+ * @brief Gather the swap slots around the faulting slot
+ *
+ * @param swp Faulting swap entry
+ * @param window Window, in pages
+ * @param entries Array of entries to fill (window - 1 long)
+ * @return Number of entries found
+ */
+static unsigned int swap_ra_gather_cluster(swp_entry_t swp, unsigned int window,
+                                           swp_entry_t *entries)
+{
+    struct swap_area *sa = swap_areas[SWP_TYPE(swp)];
+    unsigned long off = SWP_OFFSET(swp);
+    unsigned long start, end;
+    unsigned int nr = 0;
+
+    start = max(off & -(unsigned long) window, (unsigned long) sa->swap_off);
+    end = min((off & -(unsigned long) window) + window,
+              (unsigned long) (sa->swap_off + sa->nr_pages));
+
+    /* Free slots get filtered out by swapcache_prepare */
+    for (unsigned long i = start; i < end; i++)
+    {
+        if (i != off)
+            entries[nr++] = SWP_ENTRY(SWP_TYPE(swp), i);
+    }
+
+    return nr;
+}
+
+/**
+ * @brief Fill a new swap cache page from zswap, or queue it for IO
+ *
+ * @param page Page (locked)
+ * @param swp Swap entry
+ * @param batch IO batch
+ * @return True if the page was queued, false if we're done with it (and it's unlocked)
+ */
+static bool swap_ra_read(struct page *page, swp_entry_t swp,
+                         struct swap_ra_batch *batch) NO_THREAD_SAFETY_ANALYSIS
+{
+    int err = zswap_load(page, swp);
+    if (err == -ENOENT)
+    {
+        batch->pages[batch->nr++] = page;
+        return true;
+    }
+
+    if (!err)
+        page_set_uptodate(page);
+    unlock_page(page);
+    return false;
+}
+
+static void swap_readpages_end(struct bio_req *bio) NO_THREAD_SAFETY_ANALYSIS
+{
+    bool uptodate = (bio->flags & BIO_STATUS_MASK) == BIO_REQ_DONE;
+    for (size_t i = 0; i < bio->nr_vecs; i++)
+    {
+        struct page *page = bio->vec[i].page;
+        if (uptodate)
+            page_set_uptodate(page);
+        unlock_page(page);
+    }
+}
+
+/**
+ * @brief Read contiguous slots from a swap area
+ *
+ * @param sa Swap area
+ * @param pages Pages (locked), in slot order
+ * @param nr Number of pages
+ */
+static void swap_read_run(struct swap_area *sa, struct page **pages,
+                          unsigned int nr) NO_THREAD_SAFETY_ANALYSIS
+{
+    swp_entry_t swp = swpval_to_swp_entry(pages[0]->priv);
+    struct bio_req *bio;
+    int err = -ENOMEM;
+
+    bio = bio_alloc(GFP_NOIO, nr);
+    if (!bio)
+        goto err;
+
+    bio->sector_number = SWP_OFFSET(swp) * (PAGE_SIZE / bdev_sector_size(sa->bdev));
+    for (unsigned int i = 0; i < nr; i++)
+        bio_push_pages(bio, pages[i], 0, PAGE_SIZE);
+    bio->flags = BIO_REQ_READ_OP;
+    bio->b_end_io = swap_readpages_end;
+
+    err = bio_submit_request(sa->bdev, bio);
+    bio_put(bio);
+    if (err < 0)
+        goto err;
+
+    __atomic_add_fetch(&swap_ra_stats.read_ios, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&swap_ra_stats.read_pages, nr, __ATOMIC_RELAXED);
+    return;
+err:
+    /* Leave them !UPTODATE, do_swap_page will SIGBUS */
+    pr_err("Error reading %u pages at %016lx: %d\n", nr, swp.swp, err);
+    for (unsigned int i = 0; i < nr; i++)
+        unlock_page(pages[i]);
+}
+
+static int swap_ra_page_cmp(const void *a, const void *b)
+{
+    swp_entry_t e0 = swpval_to_swp_entry((*(struct page *const *) a)->priv);
+    swp_entry_t e1 = swpval_to_swp_entry((*(struct page *const *) b)->priv);
+
+    if (SWP_TYPE(e0) != SWP_TYPE(e1))
+        return SWP_TYPE(e0) < SWP_TYPE(e1) ? -1 : 1;
+    if (SWP_OFFSET(e0) != SWP_OFFSET(e1))
+        return SWP_OFFSET(e0) < SWP_OFFSET(e1) ? -1 : 1;
+    return 0;
+}
+
+/**
+ * @brief Submit the batch's IO, in runs of contiguous slots
+ *
+ * @param batch IO batch
+ */
+static void swap_ra_submit(struct swap_ra_batch *batch)
+{
+    unsigned int i, j;
+
+    qsort(batch->pages, batch->nr, sizeof(struct page *), swap_ra_page_cmp);
+
+    for (i = 0; i < batch->nr; i = j)
+    {
+        swp_entry_t first = swpval_to_swp_entry(batch->pages[i]->priv);
+        struct swap_area *sa = swap_areas[SWP_TYPE(first)];
+        unsigned long max_vecs = bdev_max_sgls(sa->bdev);
+
+        for (j = i + 1; j < batch->nr && j - i < max_vecs; j++)
+        {
+            swp_entry_t swp = swpval_to_swp_entry(batch->pages[j]->priv);
+            if (SWP_TYPE(swp) != SWP_TYPE(first) || SWP_OFFSET(swp) != SWP_OFFSET(first) + (j - i))
+                break;
+        }
+
+        swap_read_run(sa, batch->pages + i, j - i);
+    }
+}
+
+/**
+ * @brief Read a swapped out page in, along with its neighbours
+ *
+ * @param ctx Fault context
+ * @param swp Swap entry
+ * @param obj Swap space
+ * @return The page (with a reference, possibly locked under IO), or an ERR_PTR (see
+ * swap_cache_add_new)
+ */
+static struct page *swap_readahead(struct vm_pf_context *ctx, swp_entry_t swp,
+                                   struct vm_object *obj)
+{
+    swp_entry_t entries[SWAP_RA_MAX_PAGES];
+    struct swap_ra_batch batch;
+    bool vma_ra = READ_ONCE(swap_vma_readahead);
+    unsigned int window, nr = 0;
+    struct page *page;
+
+    window = swap_ra_window(vma_ra ? ctx->vpage >> PAGE_SHIFT : SWP_OFFSET(swp));
+
+    page = swap_cache_add_new(swp, obj);
+    if (IS_ERR(page))
+        return page;
+
+    batch.nr = 0;
+    swap_ra_read(page, swp, &batch);
+
+    if (window > 1)
+        nr = vma_ra ? swap_ra_gather_vma(ctx, window, entries)
+                    : swap_ra_gather_cluster(swp, window, entries);
+
+    for (unsigned int i = 0; i < nr; i++)
+    {
+        struct swap_area *ra_sa = swap_area_get(SWP_TYPE(entries[i]));
+        struct page *ra_page;
+        if (!ra_sa)
+            continue;
+
+        /* Already in the swap cache, or freed under us. Once the page is in the swap cache, the
+         * area can't go away until we're done with it. */
+        ra_page = swap_cache_add_new(entries[i], ra_sa->swap_space);
+        swap_area_put(ra_sa);
+        if (IS_ERR(ra_page))
+            continue;
+
+        page_set_flag(ra_page, PAGE_FLAG_READAHEAD);
+        __atomic_add_fetch(&swap_ra_stats.ra_pages, 1, __ATOMIC_RELAXED);
+        /* The swap cache keeps the page alive, IO or not */
+        if (!swap_ra_read(ra_page, entries[i], &batch))
+            page_unref(ra_page);
+    }
+
+    swap_ra_submit(&batch);
+    for (unsigned int i = 0; i < batch.nr; i++)
+    {
+        if (batch.pages[i] != page)
+            page_unref(batch.pages[i]);
+    }
+
+    return page;
+}
+
+static void swap_cache_remove(struct vm_object *obj, struct page *page)
+{
+    DCHECK_PAGE(page_test_swap(page), page);
+    DCHECK_PAGE(page_locked(page), page);
+    swp_entry_t entry = swpval_to_swp_entry(page->priv);
 
     /* We can only get here if refcount = 2 (ours and the swap cache's). As such would imply from
      * swap_map's ref == 0. If we fail to remove, someone holds a reference to it (probably
      * reclaim?). as such don't clear swap nor put final. */
-    if (!vm_obj_remove_page(obj, page))
+    if (!vm_obj_remove_page(obj, page, false))
         return;
     page_clear_swap(page);
+    /* The page's contents only live in memory now, reclaim needs to write them out again */
+    page_set_dirty(page);
     swap_final_put(entry);
+    /* Drop the swap cache's reference */
+    page_unref(page);
+}
+
+/**
+ * @brief Check if the faulting pte is still what we looked at
+ *
+ * @param context Fault context
+ * @return True if the pte didn't change, else false
+ */
+static bool swap_pte_same(struct vm_pf_context *context)
+{
+    struct spinlock *lock;
+    pte_t *ptep;
+    bool same;
+
+    ptep = ptep_get_locked(context->entry->vm_mm, context->vpage, &lock);
+    if (!ptep)
+        return false;
+    same = ptep->pte == context->oldpte.pte;
+    spin_unlock(lock);
+    return same;
 }
 
 static int do_protnone(swp_entry_t swp, struct vm_pf_context *context)
@@ -822,28 +1649,49 @@ int do_swap_page(struct vm_pf_context *context) NO_THREAD_SAFETY_ANALYSIS
 {
     struct vm_area_struct *vma = context->entry;
     swp_entry_t swp = pte_to_swp_entry(context->oldpte);
-    struct vm_object *obj = swap_spaces[SWP_TYPE(swp)];
+    struct swap_area *sa;
+    struct vm_object *obj;
     struct page *page;
-    bool created_page = false;
     int err;
 
     if (pte_protnone(context->oldpte))
         return do_protnone(swp, context);
 
-    if (WARN_ON_ONCE(!obj))
+    if (swp_is_migration(swp))
+        return migration_entry_wait(context);
+
+    /* Hold a reference to the area, so swapoff can't free it under us */
+    sa = swap_area_get(SWP_TYPE(swp));
+    if (!sa)
     {
+        /* Swapped off under us, the pte must have changed. Retry the fault. */
+        if (!swap_pte_same(context))
+            return 0;
+        WARN_ON_ONCE(1);
         pr_err("Bad swap entry %016lx\n", swp.swp);
         return -EINVAL;
     }
 
+    obj = sa->swap_space;
+retry:
     page = swap_cache_find(obj, swp);
     if (!page)
     {
-        page = swap_read_from_storage(swp, obj, &created_page);
+        page = swap_readahead(context, swp, obj);
         if (IS_ERR(page))
         {
             err = PTR_ERR(page);
-            goto err;
+            /* Someone beat us to it, look it up again. They set the swap cache bit before adding
+             * the page, so give them a chance to finish instead of spinning on the lookup. */
+            if (err == -EEXIST)
+            {
+                sched_yield();
+                goto retry;
+            }
+            /* The slot was freed, so the pte changed under us. Retry the fault. */
+            if (err == -ENOENT)
+                err = 0;
+            goto out;
         }
     }
     /* The page lock is essential here and protects against many funny scenarios. For instance,
@@ -854,18 +1702,29 @@ int do_swap_page(struct vm_pf_context *context) NO_THREAD_SAFETY_ANALYSIS
      * reclaim holding the page lock. */
 
     lock_page(page);
-    if (created_page)
+    /* Taken out of the swap cache while we waited for the lock, or the pte was swapped in by
+     * someone else (another fault, or swapoff). Retry the fault. */
+    if (!page_test_swap(page) || page->priv != swp.swp || !swap_pte_same(context))
+    {
+        err = 0;
+        goto out_unlock;
+    }
+
+    /* Pages we read in (or read ahead) don't have an anon_vma yet */
+    if (!page->owner)
     {
-        page_set_anon(page);
         page->pageoff = context->vpage;
         page->owner = (struct vm_object *) vma->anon_vma;
         WARN_ON(!vma->anon_vma);
     }
 
+    if (page_test_clear_flag(page, PAGE_FLAG_READAHEAD))
+        swap_ra_hit();
+
     if (!page_test_uptodate(page))
     {
         err = -EIO;
-        goto err_unlock;
+        goto out_unlock;
     }
 
     if (swap_put_page(page))
@@ -874,17 +1733,480 @@ int do_swap_page(struct vm_pf_context *context) NO_THREAD_SAFETY_ANALYSIS
                      context->page_rwx & ~VM_READ, vma))
     {
         err = -ENOMEM;
-        goto err_unlock;
+        goto out_unlock;
     }
 
+    err = VM_FAULT_MAJOR;
+out_unlock:
     unlock_page(page);
     page_unref(page);
-    return VM_FAULT_MAJOR;
-err_unlock:
+out:
+    swap_area_put(sa);
+    if (err < 0)
+    {
+        pr_err("Error swapping in entry %016lx (%04lx:%016lx): %d\n", swp.swp, SWP_TYPE(swp),
+               SWP_OFFSET(swp), err);
+        context->info->signal = err == -EIO ? SIGBUS : SIGSEGV;
+    }
+
+    return err;
+}
+
+/* swapoff brings every page in the swap area back into memory. It walks every address space's
+ * page tables looking for swap ptes that point into the area, reads the pages in (in batches, so
+ * IO gets merged) and maps them back. Then it takes whatever is left out of the swap cache. It
+ * keeps doing so until the area has no used slots left, since faults, fork and reclaim can race
+ * with us. New slots don't get allocated from the area once swapoff starts. */
+#define SWAP_UNUSE_BATCH 32
+
+/**
+ * @brief Read in the pages for a batch of swap ptes
+ *
+ * @param sa Swap area
+ * @param ptes Swap ptes
+ * @param nr Number of ptes
+ */
+static void swap_unuse_readahead(struct swap_area *sa, struct swap_pte *ptes, unsigned int nr)
+{
+    struct swap_ra_batch batch;
+
+    batch.nr = 0;
+    for (unsigned int i = 0; i < nr; i++)
+    {
+        swp_entry_t swp = pte_to_swp_entry(ptes[i].pte);
+        struct page *page;
+
+        /* Already in the swap cache, or freed under us */
+        page = swap_cache_add_new(swp, sa->swap_space);
+        if (IS_ERR(page))
+            continue;
+
+        /* The swap cache keeps the page alive, IO or not */
+        if (!swap_ra_read(page, swp, &batch))
+            page_unref(page);
+    }
+
+    swap_ra_submit(&batch);
+    for (unsigned int i = 0; i < batch.nr; i++)
+        page_unref(batch.pages[i]);
+}
+
+/**
+ * @brief Map a swap pte's page back in
+ *
+ * @param vma VMA the pte belongs to
+ * @param spte Swap pte
+ * @param sa Swap area
+ * @return 0 on success (or if the pte changed under us), negative error codes
+ */
+static int swap_unuse_pte(struct vm_area_struct *vma, struct swap_pte *spte,
+                          struct swap_area *sa) NO_THREAD_SAFETY_ANALYSIS
+{
+    swp_entry_t swp = pte_to_swp_entry(spte->pte);
+    struct mm_address_space *mm = vma->vm_mm;
+    struct vm_object *obj = sa->swap_space;
+    struct swap_ra_batch batch;
+    struct spinlock *lock;
+    struct page *page;
+    unsigned long phys;
+    pte_t *ptep;
+    int err = 0;
+
+retry:
+    page = swap_cache_find(obj, swp);
+    if (!page)
+    {
+        page = swap_cache_add_new(swp, obj);
+        if (IS_ERR(page))
+        {
+            err = PTR_ERR(page);
+            /* Being added to the swap cache by someone else, wait for them */
+            if (err == -EEXIST)
+            {
+                sched_yield();
+                goto retry;
+            }
+            /* The slot was freed, so the pte changed */
+            return err == -ENOENT ? 0 : err;
+        }
+
+        batch.nr = 0;
+        if (swap_ra_read(page, swp, &batch))
+            swap_ra_submit(&batch);
+    }
+
+    lock_page(page);
+    if (!page_test_swap(page) || page->priv != swp.swp)
+        goto out;
+
+    if (!page_test_uptodate(page))
+    {
+        pr_err("Error reading entry %016lx in\n", swp.swp);
+        err = -EIO;
+        goto out;
+    }
+
+    if (!page->owner)
+    {
+        page->pageoff = spte->addr;
+        page->owner = (struct vm_object *) vma->anon_vma;
+        WARN_ON(!vma->anon_vma);
+    }
+
+    ptep = ptep_get_locked(mm, spte->addr, &lock);
+    if (!ptep)
+        goto out;
+    if (ptep->pte != spte->pte.pte)
+    {
+        spin_unlock(lock);
+        goto out;
+    }
+
+    /* Map it read-only, like do_swap_page. A write fault will reuse it (or COW it). */
+    phys = (unsigned long) page_to_phys(page);
+    page_add_mapcount(page);
+    set_pte(ptep, pte_mkpte(phys, calc_pgprot(phys, vma->vm_flags & ~VM_WRITE)));
+    increment_vm_stat(mm, resident_set_size, PAGE_SIZE);
+    spin_unlock(lock);
+
+    if (swap_put_page(page))
+        swap_cache_remove(obj, page);
+out:
     unlock_page(page);
-err:
-    pr_err("Error swapping in entry %016lx (%04lx:%016lx): %d\n", swp.swp, SWP_TYPE(swp),
-           SWP_OFFSET(swp), err);
-    context->info->signal = err == -EIO ? SIGBUS : SIGSEGV;
+    page_unref(page);
+    return err;
+}
+
+/**
+ * @brief Bring in every page of an address space that lives in a swap area
+ *
+ * @param mm Address space
+ * @param sa Swap area
+ * @param type Swap area index
+ * @return 0 on success, negative error codes
+ */
+static int swap_unuse_mm(struct mm_address_space *mm, struct swap_area *sa, unsigned int type)
+{
+    struct swap_pte ptes[SWAP_UNUSE_BATCH];
+    struct vm_area_struct *vma;
+    unsigned long index = 0;
+    int err = 0;
+
+    rw_lock_read(&mm->vm_lock);
+    mt_for_each (&mm->region_tree, vma, index, -1UL)
+    {
+        unsigned long addr = vma->vm_start;
+        unsigned int nr;
+
+        while (addr < vma->vm_end)
+        {
+            addr = vm_gather_swap_ptes(mm, addr, vma->vm_end, type, ptes, &nr, SWAP_UNUSE_BATCH);
+            swap_unuse_readahead(sa, ptes, nr);
+            for (unsigned int i = 0; i < nr; i++)
+            {
+                err = swap_unuse_pte(vma, &ptes[i], sa);
+                if (err)
+                    goto out;
+            }
+
+            if (signal_is_pending())
+            {
+                err = -EINTR;
+                goto out;
+            }
+        }
+    }
+
+out:
+    rw_unlock_read(&mm->vm_lock);
+    return err;
+}
+
+/**
+ * @brief Take the pages only the swap cache is holding slots for out of it
+ *
+ * @param sa Swap area
+ * @param type Swap area index
+ * @return 0 on success, negative error codes
+ */
+static int swap_unuse_swapcache(struct swap_area *sa, unsigned int type) NO_THREAD_SAFETY_ANALYSIS
+{
+    for (unsigned long off = 0; off < sa->nr_pages; off++)
+    {
+        swp_entry_t swp = SWP_ENTRY((unsigned long) type, off + sa->swap_off);
+        struct page *page;
+
+        if (READ_ONCE(sa->swap_map[off]) != SWAP_MAP_SWAPCACHE)
+            continue;
+
+        page = swap_cache_find(sa->swap_space, swp);
+        if (!page)
+            continue;
+
+        lock_page(page);
+        page_wait_writeback(page);
+        if (page_test_swap(page) && page->priv == swp.swp &&
+            swap_get_map(swp) == SWAP_MAP_SWAPCACHE)
+            swap_cache_remove(sa->swap_space, page);
+        unlock_page(page);
+        page_unref(page);
+
+        if (signal_is_pending())
+            return -EINTR;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Empty a swap area
+ *
+ * @param sa Swap area (no longer allocated from)
+ * @param type Swap area index
+ * @return 0 on success, negative error codes
+ */
+static int swap_drain(struct swap_area *sa, unsigned int type)
+{
+    struct mm_address_space *mm = NULL;
+    int err;
+
+    while (swap_area_used(sa))
+    {
+        while ((mm = mm_list_next(mm)))
+        {
+            err = swap_unuse_mm(mm, sa, type);
+            if (err)
+            {
+                mmput(mm);
+                return err;
+            }
+        }
+
+        err = swap_unuse_swapcache(sa, type);
+        if (err)
+            return err;
+        /* Whatever is left is busy (under reclaim, being faulted in, etc). Try again. */
+        sched_yield();
+    }
+
+    return 0;
+}
+
+int sys_swapoff(const char *upath)
+{
+    struct swap_area *sa = NULL;
+    unsigned long nr_pages;
+    struct blockdev *bdev;
+    struct file *file;
+    int err, type;
+
+    if (!is_root_user())
+        return -EPERM;
+
+    const char *path = strcpy_from_user(upath);
+    if (!path)
+        return -ENOMEM;
+
+    /* The area holds the device open with O_EXCL, so we can only open it read-only */
+    file = c_vfs_open(AT_FDCWD, path, O_RDONLY, 0);
+    free((void *) path);
+    if (IS_ERR(file))
+        return PTR_ERR(file);
+
+    bdev = S_ISBLK(file->f_ino->i_mode) ? blkdev_get_dev(file) : NULL;
+    fd_put(file);
+    if (!bdev)
+        return -EINVAL;
+
+    mutex_lock(&swapon_mutex);
+    for (type = 0; type < MAX_SWAP_AREAS; type++)
+    {
+        sa = swap_areas[type];
+        if (sa && sa->bdev == bdev)
+            break;
+    }
+
+    err = -EINVAL;
+    if (type == MAX_SWAP_AREAS)
+        goto out;
+
+    /* Stop allocating from the area. Once swap_avail_rebuild returns, no one can be allocating
+     * from it anymore. */
+    nr_pages = sa->nr_pages;
+    WRITE_ONCE(sa->writeok, false);
+    swap_avail_rebuild();
+    __atomic_sub_fetch(&total_swap, nr_pages, __ATOMIC_RELAXED);
+
+    err = swap_drain(sa, type);
+    if (err)
+    {
+        WRITE_ONCE(sa->writeok, true);
+        swap_avail_rebuild();
+        __atomic_add_fetch(&total_swap, nr_pages, __ATOMIC_RELAXED);
+        goto out;
+    }
+
+    spin_lock(&swap_areas_lock);
+    rcu_assign_pointer(swap_areas[type], NULL);
+    swap_spaces[type] = NULL;
+    spin_unlock(&swap_areas_lock);
+
+    if (!(sa->flags & SWAP_FLAG_PREFER))
+        swap_release_priority(sa->prio);
+
+    /* Wait for lookups that might've seen the area, and for faults that are still holding it
+     * (with a stale swap pte). They'll find nothing there. */
+    synchronize_rcu();
+    while (__atomic_load_n(&sa->refs, __ATOMIC_ACQUIRE) != 1)
+        sched_yield();
+
+    zswap_swapoff(type);
+    swap_area_destroy(sa);
+    pr_info("Removed swap area with %lukB\n", nr_pages * PAGE_SIZE / 1024);
+out:
+    mutex_unlock(&swapon_mutex);
     return err;
 }
+
+static struct swap_area *swaps_seek(off_t pos)
+{
+    for (int i = 0; i < MAX_SWAP_AREAS; i++)
+    {
+        if (swap_areas[i] && pos-- == 0)
+            return swap_areas[i];
+    }
+
+    return NULL;
+}
+
+static void *swaps_start(struct seq_file *m, off_t *pos)
+{
+    mutex_lock(&swapon_mutex);
+    if (*pos == 0)
+        return SEQ_START_TOKEN;
+    return swaps_seek(*pos - 1);
+}
+
+static void *swaps_next(struct seq_file *m, void *v, off_t *pos)
+{
+    (*pos)++;
+    return swaps_seek(*pos - 1);
+}
+
+static void swaps_stop(struct seq_file *m, void *v)
+{
+    mutex_unlock(&swapon_mutex);
+}
+
+static int swaps_show(struct seq_file *m, void *v)
+{
+    struct swap_area *sa = v;
+    size_t start = m->count, len;
+    int err;
+
+    if (v == SEQ_START_TOKEN)
+    {
+        seq_puts(m, "Filename                                Type            Size            "
+                    "Used            Priority\n");
+        return 0;
+    }
+
+    err = seq_d_path_under_root(m, &sa->file->f_path, NULL);
+    if (err)
+        return err;
+
+    /* Line the columns up with the header */
+    len = m->count - start;
+    seq_printf(m, "%*s%-16s%-16lu%-16lu%d\n", len < 40 ? (int) (40 - len) : 1, "", "partition",
+               sa->nr_pages * (PAGE_SIZE / 1024), swap_area_used(sa) * (PAGE_SIZE / 1024),
+               sa->prio);
+    return 0;
+}
+
+static const struct seq_operations swaps_seq_ops = {
+    .start = swaps_start,
+    .next = swaps_next,
+    .show = swaps_show,
+    .stop = swaps_stop,
+};
+
+static int swaps_open(struct file *filp)
+{
+    return seq_open(filp, &swaps_seq_ops);
+}
+
+static const struct proc_file_ops swaps_proc_ops = {
+    .open = swaps_open,
+    .release = seq_release,
+    .read_iter = seq_read_iter,
+};
+
+static __init void swap_init_procfs(void)
+{
+    procfs_add_entry("swaps", 0444, NULL, &swaps_proc_ops);
+}
+
+ssize_t page_cluster_sysfs_read(void *buffer, size_t size, off_t off)
+{
+    char buf[32];
+    size_t len = snprintf(buf, sizeof(buf), "%u\n", READ_ONCE(page_cluster));
+    return sysfs_read_buf(buf, len, buffer, size, off);
+}
+
+ssize_t page_cluster_sysfs_write(void *buffer, size_t size, off_t off)
+{
+    unsigned long val;
+    int err = sysfs_parse_ulong(buffer, size, &val);
+    if (err < 0)
+        return err;
+
+    /* 0 disables readahead */
+    if (val > SWAP_RA_MAX_ORDER)
+        return -EINVAL;
+    WRITE_ONCE(page_cluster, (unsigned int) val);
+    return size;
+}
+
+ssize_t swap_vma_readahead_sysfs_read(void *buffer, size_t size, off_t off)
+{
+    char buf[32];
+    size_t len = snprintf(buf, sizeof(buf), "%d\n", READ_ONCE(swap_vma_readahead));
+    return sysfs_read_buf(buf, len, buffer, size, off);
+}
+
+ssize_t swap_vma_readahead_sysfs_write(void *buffer, size_t size, off_t off)
+{
+    unsigned long val;
+    int err = sysfs_parse_ulong(buffer, size, &val);
+    if (err < 0)
+        return err;
+
+    if (val > 1)
+        return -EINVAL;
+    WRITE_ONCE(swap_vma_readahead, val);
+    return size;
+}
+
+ssize_t swap_ra_stat_sysfs_read(void *buffer, size_t size, off_t off)
+{
+    char buf[256];
+    unsigned long ra_pages = READ_ONCE(swap_ra_stats.ra_pages);
+    unsigned long ra_hits = READ_ONCE(swap_ra_stats.ra_hits);
+    unsigned long read_ios = READ_ONCE(swap_ra_stats.read_ios);
+    unsigned long read_pages = READ_ONCE(swap_ra_stats.read_pages);
+    /* In hundredths */
+    unsigned long hit_rate = 0, pages_per_io = 0;
+
+    if (ra_pages)
+        hit_rate = ra_hits * 10000 / ra_pages;
+    if (read_ios)
+        pages_per_io = read_pages * 100 / read_ios;
+
+    size_t len = snprintf(buf, sizeof(buf),
+                          "window %u\nra_pages %lu\nra_hits %lu\nhit_rate %lu.%02lu%%\n"
+                          "read_ios %lu\nread_pages %lu\npages_per_io %lu.%02lu\n",
+                          READ_ONCE(swap_ra.window), ra_pages, ra_hits, hit_rate / 100,
+                          hit_rate % 100, read_ios, read_pages, pages_per_io / 100,
+                          pages_per_io % 100);
+    return sysfs_read_buf(buf, len, buffer, size, off);
+}
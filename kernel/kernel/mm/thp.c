@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include <onyx/cmdline.h>
+#include <onyx/mm/page_lru.h>
+#include <onyx/mm/thp.h>
+#include <onyx/page.h>
+#include <onyx/pgtable.h>
+#include <onyx/rmap.h>
+#include <onyx/sysfs.h>
+#include <onyx/user.h>
+#include <onyx/vm.h>
+
+/* THPs are opportunistic. Don't go into direct reclaim for them, just fall back to 4KiB pages. */
+#define GFP_THP (GFP_NOWAIT | __GFP_NOWARN)
+
+static enum thp_policy thp_policy = THP_ALWAYS;
+
+static const char *thp_policy_names[] = {
+    [THP_NEVER] = "never",
+    [THP_MADVISE] = "madvise",
+    [THP_ALWAYS] = "always",
+};
+
+bool thp_vma_allowed(struct vm_area_struct *vma, unsigned long addr)
+{
+#ifndef ARCH_HAS_THP
+    return false;
+#else
+    unsigned long haddr = addr & -PMD_SIZE;
+
+    /* Only private anonymous memory for now */
+    if (vma->vm_ops != &anon_vmops || vma->vm_file || vma_shared(vma))
+        return false;
+    if (vma->vm_flags & (VM_NOHUGEPAGE | VM_PFNMAP) || !(vma->vm_flags & VM_USER))
+        return false;
+    if (haddr < vma->vm_start || haddr + PMD_SIZE > vma->vm_end)
+        return false;
+
+    switch (READ_ONCE(thp_policy))
+    {
+        case THP_ALWAYS:
+            return true;
+        case THP_MADVISE:
+            return vma->vm_flags & VM_HUGEPAGE;
+        default:
+            return false;
+    }
+#endif
+}
+
+struct page *thp_alloc_anon(struct vm_area_struct *vma, struct anon_vma *anon,
+                            unsigned long haddr)
+{
+    struct page *page = alloc_pages_vma(THP_ORDER, GFP_THP, vma, haddr);
+    if (!page)
+        return NULL;
+
+    for (unsigned long i = 0; i < THP_NR_PAGES; i++)
+    {
+        struct page *p = page + i;
+        page_set_anon(p);
+        p->owner = (struct vm_object *) anon;
+        p->pageoff = haddr + (i << PAGE_SHIFT);
+        page_add_lru(p);
+        page_set_dirty(p);
+    }
+
+    return page;
+}
+
+void thp_put_pages(struct page *page)
+{
+    for (unsigned long i = 0; i < THP_NR_PAGES; i++)
+        page_unref(page + i);
+}
+
+static int thp_param(const char *s)
+{
+    for (unsigned int i = 0; i < sizeof(thp_policy_names) / sizeof(thp_policy_names[0]); i++)
+    {
+        if (!strcmp(s, thp_policy_names[i]))
+        {
+            thp_policy = i;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+kernel_param("transparent_hugepage", thp_param);
+
+ssize_t thp_sysfs_read(void *buffer, size_t size, off_t off)
+{
+    /* Same format as Linux: "always [madvise] never" */
+    char buf[32];
+    enum thp_policy policy = READ_ONCE(thp_policy);
+    size_t len = 0;
+
+    for (int i = THP_ALWAYS; i >= THP_NEVER; i--)
+    {
+        const char *fmt = (int) policy == i ? "[%s]%s" : "%s%s";
+        len += snprintf(buf + len, sizeof(buf) - len, fmt, thp_policy_names[i],
+                        i == THP_NEVER ? "\n" : " ");
+    }
+
+    return sysfs_read_buf(buf, len, buffer, size, off);
+}
+
+ssize_t thp_sysfs_write(void *buffer, size_t size, off_t off)
+{
+    char buf[16];
+    ssize_t st = sysfs_copy_str(buf, sizeof(buf), buffer, size);
+    if (st < 0)
+        return st;
+
+    if (!thp_param(buf))
+        return -EINVAL;
+    return size;
+}
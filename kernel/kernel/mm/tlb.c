@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <onyx/mm/tlb.h>
+#include <onyx/mm_address_space.h>
+#include <onyx/page.h>
+#include <onyx/vm.h>
+
+/* An overflow page holds this many deferred pages */
+#define TLB_BATCH_OVERFLOW_PAGES (PAGE_SIZE / sizeof(struct page *))
+
+void tlb_batch_init(struct tlb_batch *batch, struct mm_address_space *mm)
+{
+    batch->mm = mm;
+    batch->flags = 0;
+    batch->nr_ranges = 0;
+    batch->nr_pages = 0;
+    batch->pages = batch->local_pages;
+    batch->nr_deferred = 0;
+    batch->max_deferred = TLB_BATCH_NR_PAGES;
+    batch->overflow = NULL;
+}
+
+void tlb_batch_flush(struct tlb_batch *batch)
+{
+    if (batch->nr_pages)
+        mmu_invalidate_ranges(batch->mm, batch->ranges, batch->nr_ranges, batch->flags);
+
+    for (unsigned int i = 0; i < batch->nr_deferred; i++)
+        page_unref(batch->pages[i]);
+
+    batch->nr_deferred = 0;
+    batch->nr_ranges = 0;
+    batch->nr_pages = 0;
+    batch->flags &= TLB_BATCH_OWNS_MM;
+}
+
+void tlb_batch_finish(struct tlb_batch *batch)
+{
+    if (tlb_batch_pending(batch))
+        tlb_batch_flush(batch);
+
+    if (batch->overflow)
+    {
+        free_page(batch->overflow);
+        batch->overflow = NULL;
+        batch->pages = batch->local_pages;
+        batch->max_deferred = TLB_BATCH_NR_PAGES;
+    }
+
+    if (batch->flags & TLB_BATCH_OWNS_MM)
+    {
+        mmdrop(batch->mm);
+        batch->flags &= ~TLB_BATCH_OWNS_MM;
+    }
+
+    batch->mm = NULL;
+}
+
+void tlb_batch_switch_mm(struct tlb_batch *batch, struct mm_address_space *mm)
+{
+    if (batch->mm == mm)
+        return;
+
+    if (tlb_batch_pending(batch))
+        tlb_batch_flush(batch);
+
+    if (batch->flags & TLB_BATCH_OWNS_MM)
+        mmdrop(batch->mm);
+
+    mmgrab(mm);
+    batch->mm = mm;
+    batch->flags |= TLB_BATCH_OWNS_MM;
+}
+
+void tlb_batch_add_range(struct tlb_batch *batch, unsigned long start, unsigned long end)
+{
+    struct tlb_range *range;
+
+    batch->nr_pages += (end - start) >> PAGE_SHIFT;
+    if (batch->nr_pages >= TLB_BATCH_FULL_FLUSH_PAGES)
+        batch->flags |= TLB_BATCH_FLUSH_ALL;
+
+    /* Unmaps (and mprotects) tend to go upwards, so try to extend the last range first */
+    for (unsigned int i = batch->nr_ranges; i-- > 0;)
+    {
+        range = &batch->ranges[i];
+        if (start <= range->end && range->start <= end)
+        {
+            if (start < range->start)
+                range->start = start;
+            if (end > range->end)
+                range->end = end;
+            return;
+        }
+    }
+
+    if (batch->nr_ranges == TLB_BATCH_NR_RANGES)
+    {
+        /* Too scattered to flush range by range. Stretch the last range over this one, so the
+         * ranges still cover everything (for architectures that can't flush it all). */
+        range = &batch->ranges[batch->nr_ranges - 1];
+        if (start < range->start)
+            range->start = start;
+        if (end > range->end)
+            range->end = end;
+        batch->flags |= TLB_BATCH_FLUSH_ALL;
+        return;
+    }
+
+    range = &batch->ranges[batch->nr_ranges++];
+    range->start = start;
+    range->end = end;
+}
+
+bool tlb_batch_covers(struct tlb_batch *batch, unsigned long start, unsigned long end)
+{
+    if (batch->flags & TLB_BATCH_FLUSH_ALL)
+        return true;
+
+    for (unsigned int i = 0; i < batch->nr_ranges; i++)
+    {
+        if (start <= batch->ranges[i].end && batch->ranges[i].start <= end)
+            return true;
+    }
+
+    return false;
+}
+
+static bool tlb_batch_grow(struct tlb_batch *batch)
+{
+    struct page **pages;
+
+    if (batch->overflow)
+        return false;
+
+    /* Best effort, we might be in reclaim or under the page table lock. We'll just flush more
+     * often if there's no memory. */
+    batch->overflow = alloc_page(PAGE_ALLOC_NO_ZERO | __GFP_NOWAIT | __GFP_NOWARN);
+    if (!batch->overflow)
+        return false;
+
+    pages = PAGE_TO_VIRT(batch->overflow);
+    for (unsigned int i = 0; i < batch->nr_deferred; i++)
+        pages[i] = batch->pages[i];
+    batch->pages = pages;
+    batch->max_deferred = TLB_BATCH_OVERFLOW_PAGES;
+    return true;
+}
+
+void tlb_batch_defer_free(struct tlb_batch *batch, struct page *page)
+{
+    if (batch->nr_deferred == batch->max_deferred && !tlb_batch_grow(batch))
+    {
+        /* The page's range is already in the batch, so this flush covers it */
+        tlb_batch_flush(batch);
+    }
+
+    batch->pages[batch->nr_deferred++] = page;
+}
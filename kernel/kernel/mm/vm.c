@@ -23,10 +23,20 @@
 #include <onyx/filemap.h>
 // #include <onyx/gen/trace_vm.h>
 #include <onyx/log.h>
+#include <onyx/mm/asid.h>
+#include <onyx/mm/compaction.h>
+#include <onyx/mm/hugetlb.h>
 #include <onyx/mm/kasan.h>
+#include <onyx/mm/page_lru.h>
+#include <onyx/mm/reclaim.h>
 #include <onyx/mm/shmem.h>
 #include <onyx/mm/slab.h>
+#include <onyx/mm/thp.h>
+#include <onyx/mm/tlb.h>
 #include <onyx/mm/vm_object.h>
+#include <onyx/mm/workingset.h>
+#include <onyx/mm/zero_pool.h>
+#include <onyx/mm/zswap.h>
 #include <onyx/page.h>
 #include <onyx/pagecache.h>
 #include <onyx/paging.h>
@@ -112,6 +122,10 @@ struct mm_address_space kernel_address_space = {
     .mm_users = REFCOUNT_INIT(2),
 };
 
+/* Every user address space, protected by mm_list_lock */
+static DEFINE_LIST(mm_list);
+static struct spinlock mm_list_lock;
+
 static struct page *vm_zero_page = NULL;
 static struct slab_cache *vm_area_struct_cache = NULL;
 
@@ -120,9 +134,17 @@ static inline struct vm_area_struct *vma_alloc(void)
     return kmem_cache_alloc(vm_area_struct_cache, GFP_KERNEL);
 }
 
+static void vma_free_rcu(struct rcu_head *head)
+{
+    struct vm_area_struct *vma = container_of(head, struct vm_area_struct, vm_rcu);
+    memset_explicit(vma, 0xfd, sizeof(struct vm_area_struct));
+    kmem_cache_free(vm_area_struct_cache, (void *) vma);
+}
+
 static inline void vma_free(struct vm_area_struct *region)
 {
-    kmem_cache_free(vm_area_struct_cache, (void *) region);
+    /* Page faults may still be looking at the VMA (see vma_lock_under_rcu) */
+    call_rcu(&region->vm_rcu, vma_free_rcu);
 }
 
 #ifdef CONFIG_DEBUG_MM_MMAP
@@ -198,24 +220,27 @@ bool vm_insert_region(struct mm_address_space *as, struct vm_area_struct *region
 
 static unsigned long vm_get_base_address(uint64_t flags, uint32_t type);
 
-static int vm_alloc_address(struct vma_iterator *vmi, u64 flags, size_t size, int type)
-    REQUIRES(vmi->mm->vm_lock)
+static int vm_alloc_address(struct vma_iterator *vmi, u64 flags, size_t size, int type,
+                            unsigned long align) REQUIRES(vmi->mm->vm_lock)
 {
     struct mm_address_space *mm = vmi->mm;
     unsigned long min = vm_get_base_address(flags, type);
 
     if (min < mm->start)
         min = mm->start;
-    if (mas_empty_area(&vmi->mas, min, mm->end, size) != 0)
+    /* Look for a gap big enough to hold an aligned range */
+    if (mas_empty_area(&vmi->mas, min, mm->end, size + align - PAGE_SIZE) != 0)
         return -ENOMEM;
 
-    unsigned long new_base = vmi->mas.index;
+    unsigned long new_base = ALIGN_TO(vmi->mas.index, align);
     CHECK((new_base & (PAGE_SIZE - 1)) == 0);
     if (!arch_vm_validate_mmap_region(new_base, size, flags))
         return -ENOMEM;
 
-    vmi->index = vmi->mas.index;
-    vmi->end = vmi->mas.last;
+    vmi->index = new_base;
+    vmi->end = new_base + size - 1;
+    if (align > PAGE_SIZE)
+        mas_set_range(&vmi->mas, vmi->index, vmi->end);
     return 0;
 }
 
@@ -345,8 +370,6 @@ static void vma_destroy(struct vm_area_struct *region)
     if (region->anon_vma)
         anon_vma_unlink(region->anon_vma, region);
 
-    memset_explicit(region, 0xfd, sizeof(struct vm_area_struct));
-
     vma_free(region);
 }
 
@@ -419,6 +442,7 @@ static bool fork_vm_area_struct(struct vm_area_struct *region, struct mm_address
         return false;
 
     memcpy(new_region, region, sizeof(*region));
+    vma_init_lock(new_region);
     /* TODO: mtree dup */
 
 #if DEBUG_FORK_VM
@@ -426,6 +450,13 @@ static bool fork_vm_area_struct(struct vm_area_struct *region, struct mm_address
            region->base + (region->pages << PAGE_SHIFT) - 1, region->rwx);
 #endif
 
+    if (region->vm_flags & VM_WIPEONFORK)
+    {
+        /* The child gets a fresh, zero-filled mapping. Don't share the anon_vma (the child
+         * allocates its own on fault) and don't copy the page tables. */
+        new_region->anon_vma = NULL;
+    }
+
     res = vm_insert_region(mm, new_region);
 
     assert(res == true);
@@ -455,6 +486,9 @@ static bool fork_vm_area_struct(struct vm_area_struct *region, struct mm_address
 
     new_region->vm_mm = mm;
 
+    if (region->vm_flags & VM_WIPEONFORK)
+        return true;
+
     if (mmu_fork_tables(region, mm) < 0)
         return false;
 #ifdef CONFIG_DEBUG_ADDRESS_SPACE_ACCT
@@ -542,6 +576,7 @@ int vm_fork_address_space(struct mm_address_space *addr_space) EXCLUDES(addr_spa
     addr_space->arg_start = current_mm->arg_start;
     addr_space->arg_end = current_mm->arg_end;
     memcpy(addr_space->saved_auxv, current_mm->saved_auxv, sizeof(current_mm->saved_auxv));
+    addr_space->membarrier_state = READ_ONCE(current_mm->membarrier_state);
 
 #ifdef CONFIG_DEBUG_ADDRESS_SPACE_ACCT
     mmu_verify_address_space_accounting(addr_space);
@@ -568,7 +603,7 @@ void vm_change_perms(void *range, size_t pages, int perms) NO_THREAD_SAFETY_ANAL
     DCHECK(!kernel);
 
     as = &kernel_address_space;
-    rw_lock_write(&as->vm_lock);
+    mmap_write_lock(as);
 
     for (size_t i = 0; i < pages; i++)
     {
@@ -578,7 +613,7 @@ void vm_change_perms(void *range, size_t pages, int perms) NO_THREAD_SAFETY_ANAL
     }
 
     vm_invalidate_range((unsigned long) range, pages);
-    rw_unlock_write(&as->vm_lock);
+    mmap_write_unlock(as);
 }
 
 static bool vma_can_merge_into(struct vm_area_struct *vma, size_t size, int vm_flags,
@@ -593,7 +628,9 @@ static bool vma_can_merge_into(struct vm_area_struct *vma, size_t size, int vm_f
             return false;
     }
 
-    return vma->vm_flags == vm_flags && vma->vm_file == file;
+    /* New mappings don't have a memory policy */
+    return vma->vm_flags == vm_flags && vma->vm_file == file &&
+           mempolicy_is_default(&vma->vm_policy);
 }
 
 static void vma_post_adjust(struct vm_area_struct *vma)
@@ -668,6 +705,8 @@ static struct vm_area_struct *vma_merge_around(struct vma_iterator *vmi, unsigne
         /* We can merge with prev *and* next. The whole range (prev->vm_start to next->vm_end) will
          * be covered by a single VMA */
         DCHECK(prev->vm_end == vmi->index && next->vm_start == vmi->end + 1);
+        vma_start_write(prev);
+        vma_start_write(next);
         mas_set_range(&vmi->mas, prev->vm_start, next->vm_end - 1);
         if (mas_store_gfp(&vmi->mas, prev, GFP_KERNEL) != 0)
             return NULL;
@@ -682,6 +721,7 @@ static struct vm_area_struct *vma_merge_around(struct vma_iterator *vmi, unsigne
 
         anon_vma_merge(prev, next);
         vma_post_adjust(prev);
+        vma_mark_detached(next, true);
         vma_free(next);
         ret = prev;
     }
@@ -689,6 +729,7 @@ static struct vm_area_struct *vma_merge_around(struct vma_iterator *vmi, unsigne
     {
         /* Merging with prev, quite simple, just nudge vm_end */
         DCHECK(prev->vm_end == vmi->index);
+        vma_start_write(prev);
         mas_set_range(&vmi->mas, prev->vm_start, vmi->end);
         if (mas_store_gfp(&vmi->mas, prev, GFP_KERNEL) != 0)
             return NULL;
@@ -701,6 +742,7 @@ static struct vm_area_struct *vma_merge_around(struct vma_iterator *vmi, unsigne
     {
         /* Merging with next, nudge vm_start and vm_offset if required */
         DCHECK(next->vm_start == vmi->end + 1);
+        vma_start_write(next);
         mas_set_range(&vmi->mas, vmi->index, next->vm_end - 1);
         if (mas_store_gfp(&vmi->mas, next, GFP_KERNEL) != 0)
             return NULL;
@@ -738,6 +780,9 @@ static struct vm_area_struct *vma_create(struct vma_iterator *vmi, unsigned int
     vma->vm_end = vmi->end + 1;
     vma->vm_flags = vm_flags;
     vma->vm_mm = vmi->mm;
+    /* Keep page faults out until we're done setting it up */
+    vma_init_lock(vma);
+    vma->vm_lock_seq = vmi->mm->mm_lock_seq;
 
     err = mas_store_gfp(&vmi->mas, vma, GFP_KERNEL);
     if (err)
@@ -785,12 +830,36 @@ unmap_vma:
     if (file)
         fd_put(file);
     CHECK(mas_erase(&vmi->mas) == vma);
+    vma_mark_detached(vma, true);
 free_vma:
     vma_free(vma);
 out_error:
     return ERR_PTR(err);
 }
 
+/**
+ * @brief Check if modifying a range would split a hugetlb mapping in the middle of a huge page
+ *
+ * @param mm Address space
+ * @param start Start of the range
+ * @param end End of the range
+ * @return True if so (and the operation must fail with EINVAL)
+ */
+static bool vm_range_splits_hugetlb(struct mm_address_space *mm, unsigned long start,
+                                    unsigned long end) REQUIRES_SHARED(mm->vm_lock)
+{
+    struct vm_area_struct *vma;
+    unsigned long index = start;
+
+    mt_for_each(&mm->region_tree, vma, index, end - 1)
+    {
+        if (vma_is_hugetlb(vma) && !hugetlb_range_ok(vma, start, end))
+            return true;
+    }
+
+    return false;
+}
+
 /**
  * @brief Creates a new user-space mapping.
  * Note: This is mmap(2)'s backend and therefore, most semantics are shared
@@ -808,7 +877,9 @@ void *vm_mmap(void *addr, size_t length, int prot, int flags, struct file *file,
 {
     struct vm_area_struct *vma = NULL;
     unsigned long virt = (unsigned long) addr;
+    unsigned long align = PAGE_SIZE;
     u64 extra_flags = 0;
+    bool hugetlb;
 
     struct mm_address_space *mm = get_current_address_space();
 
@@ -816,6 +887,22 @@ void *vm_mmap(void *addr, size_t length, int prot, int flags, struct file *file,
     if (off & (PAGE_SIZE - 1))
         return ERR_PTR(-EINVAL);
 
+    if (file && !(flags & MAP_ANONYMOUS))
+        hugetlb = inode_is_hugetlbfs(file->f_ino);
+    else
+        hugetlb = flags & MAP_HUGETLB;
+
+    if (hugetlb)
+    {
+        /* hugetlb mappings are made out of whole huge pages */
+        if (off & (HUGETLB_SIZE - 1) || (flags & MAP_FIXED && virt & (HUGETLB_SIZE - 1)))
+            return ERR_PTR(-EINVAL);
+        if (length > arch_low_half_max)
+            return ERR_PTR(-ENOMEM);
+        length = ALIGN_TO(length, HUGETLB_SIZE);
+        align = HUGETLB_SIZE;
+    }
+
     /* Calculate the pages needed for the overall size */
     size_t pages = vm_size_to_pages(length);
 
@@ -827,15 +914,17 @@ void *vm_mmap(void *addr, size_t length, int prot, int flags, struct file *file,
 
     if (flags & MAP_SHARED)
         vm_prot |= VM_SHARED;
+    if (hugetlb)
+        vm_prot |= VM_HUGETLB;
 
     /* Sanitize the address and length */
     const unsigned long aligned_len = pages << PAGE_SHIFT;
 
-    rw_lock_write(&mm->vm_lock);
+    mmap_write_lock(mm);
     if (aligned_len > arch_low_half_max)
         goto enomem;
 
-    if (is_higher_half(addr) || virt & (PAGE_SIZE - 1) || virt > arch_low_half_max - aligned_len ||
+    if (is_higher_half(addr) || virt & (align - 1) || virt > arch_low_half_max - aligned_len ||
         virt + aligned_len < arch_low_half_min)
     {
         if (flags & MAP_FIXED)
@@ -854,11 +943,20 @@ void *vm_mmap(void *addr, size_t length, int prot, int flags, struct file *file,
     if (virt)
     {
         if (flags & MAP_FIXED)
+        {
+            if (vm_range_splits_hugetlb(mm, virt, virt + aligned_len))
+            {
+                virt = -EINVAL;
+                goto out_vmi;
+            }
+
             __vm_munmap(mm, addr, pages << PAGE_SHIFT);
+        }
     }
     else
     {
-        if (vm_alloc_address(&vmi, VM_ADDRESS_USER | extra_flags, aligned_len, VM_TYPE_REGULAR) < 0)
+        if (vm_alloc_address(&vmi, VM_ADDRESS_USER | extra_flags, aligned_len, VM_TYPE_REGULAR,
+                             align) < 0)
             goto enomem;
         virt = vmi.index;
     }
@@ -866,12 +964,15 @@ void *vm_mmap(void *addr, size_t length, int prot, int flags, struct file *file,
     if (!vm_test_vs_rlimit(mm, vmi.end - vmi.index + 1))
         goto enomem;
 
-    vma = vma_merge_around(&vmi, vm_prot, file, off);
-    if (vma)
-        goto out_vmi;
+    if (!hugetlb)
+    {
+        vma = vma_merge_around(&vmi, vm_prot, file, off);
+        if (vma)
+            goto out_vmi;
 
-    /* vma_merge_around may touch around the vmi, reset the state */
-    mas_set_range(&vmi.mas, vmi.index, vmi.end);
+        /* vma_merge_around may touch around the vmi, reset the state */
+        mas_set_range(&vmi.mas, vmi.index, vmi.end);
+    }
 
     if (flags & MAP_ANONYMOUS)
         file = NULL;
@@ -884,7 +985,7 @@ out_vmi:
     vmi_destroy(&vmi);
 out:
     validate_mm_tree(mm);
-    rw_unlock_write(&mm->vm_lock);
+    mmap_write_unlock(mm);
     return (void *) virt;
 enomem:
     virt = -ENOMEM;
@@ -976,6 +1077,7 @@ static void vm_copy_region(const struct vm_area_struct *source, struct vm_area_s
         vmo_ref(dest->vm_obj);
     dest->anon_vma = source->anon_vma;
     dest->vm_ops = source->vm_ops;
+    dest->vm_policy = source->vm_policy;
 }
 
 static void vma_pre_adjust(struct vm_area_struct *vma)
@@ -1018,6 +1120,8 @@ static struct vm_area_struct *vm_split_region(struct mm_address_space *as,
     if (!newr)
         return NULL;
 
+    vma_start_write(vma);
+
     /* Reset the mas range to the new sub-region */
     __mas_set_range(&vmi->mas, below ? vma->vm_start : addr, (below ? addr : vma->vm_end) - 1);
     if (mas_preallocate(&vmi->mas, newr, GFP_KERNEL) == -ENOMEM)
@@ -1028,6 +1132,8 @@ static struct vm_area_struct *vm_split_region(struct mm_address_space *as,
 
     memset(newr, 0, sizeof(*newr));
     vm_copy_region(vma, newr);
+    vma_init_lock(newr);
+    newr->vm_lock_seq = as->mm_lock_seq;
 
     DCHECK(vma->vm_end > addr);
 
@@ -1061,7 +1167,8 @@ static void vm_mprotect_handle_prot(struct vm_area_struct *region, int *pprot)
     int prot = *pprot;
     bool marking_write = (prot & VM_WRITE) && !(region->vm_flags & VM_WRITE);
 
-    region->vm_flags = prot;
+    /* Keep the non-protection flags (VM_SHARED, VM_HUGEPAGE, etc) */
+    region->vm_flags = (region->vm_flags & ~(VM_READ | VM_WRITE | VM_EXEC | VM_USER)) | prot;
 
     if (marking_write && (vm_mapping_is_cow(region) || vm_mapping_requires_write_protect(region)))
     {
@@ -1074,19 +1181,30 @@ static void vm_mprotect_handle_prot(struct vm_area_struct *region, int *pprot)
 
 #if !defined(CONFIG_X86) && !defined(CONFIG_RISCV)
 /* TODO: Remove once all architectures have been moved to the new shared page table code */
-void vm_do_mmu_mprotect(struct mm_address_space *as, void *address, size_t nr_pgs, int old_prots,
-                        int new_prots)
+void vm_do_mmu_mprotect_batch(struct tlb_batch *tlb, void *address, size_t nr_pgs, int old_prots,
+                              int new_prots)
 {
-    void *addr = address;
+    unsigned long start = (unsigned long) address;
 
     for (size_t i = 0; i < nr_pgs; i++)
-    {
-        vm_mmu_mprotect_page(as, address, old_prots, new_prots);
+        vm_mmu_mprotect_page(tlb->mm, (void *) (start + (i << PAGE_SHIFT)), old_prots, new_prots);
 
-        address = (void *) ((unsigned long) address + PAGE_SIZE);
-    }
+    tlb_batch_add_range(tlb, start, start + (nr_pgs << PAGE_SHIFT));
+}
+
+void vm_do_mmu_mprotect(struct mm_address_space *as, void *address, size_t nr_pgs, int old_prots,
+                        int new_prots)
+{
+    struct tlb_batch tlb;
+    tlb_batch_init(&tlb, as);
+    vm_do_mmu_mprotect_batch(&tlb, address, nr_pgs, old_prots, new_prots);
+    tlb_batch_finish(&tlb);
+}
 
-    vm_invalidate_range((unsigned long) addr, nr_pgs);
+int vm_map_huge_pmd_kernel(unsigned long virt, unsigned long phys, int prot)
+{
+    /* vmalloc falls back to regular pages */
+    return -EOPNOTSUPP;
 }
 #endif
 
@@ -1094,6 +1212,7 @@ struct vm_area_struct *vma_prepare_modify(struct vma_iterator *vmi, struct vm_ar
                                           unsigned long start, unsigned long end)
     REQUIRES(vmi->mm->vm_lock)
 {
+    vma_start_write(vma);
     if (start > vma->vm_start)
     {
         vma = vm_split_region(vmi->mm, vma, start, false, vmi);
@@ -1122,9 +1241,11 @@ int vm_mprotect(struct mm_address_space *as, void *__addr, size_t size, int prot
     int err = -ENOMEM;
     unsigned long addr = (unsigned long) __addr;
     unsigned long limit = addr + size;
+    struct tlb_batch tlb;
     VMA_ITERATOR(vmi, as, addr, limit);
 
-    rw_lock_write(&as->vm_lock);
+    tlb_batch_init(&tlb, as);
+    mmap_write_lock(as);
 
     /* Note: vm_munmap has some vma detaching logic for the simple fact that POSIX does not
      * allow for a partial unmap in case of an error. Whereas this is not the case for mprotect.
@@ -1134,6 +1255,12 @@ int vm_mprotect(struct mm_address_space *as, void *__addr, size_t size, int prot
     if (!vma)
         goto out;
 
+    if (vm_range_splits_hugetlb(as, addr, limit))
+    {
+        err = -EINVAL;
+        goto out;
+    }
+
     mas_for_each(&vmi.mas, vma, vmi.end)
     {
         if (vma->vm_start >= limit)
@@ -1161,8 +1288,8 @@ int vm_mprotect(struct mm_address_space *as, void *__addr, size_t size, int prot
         int old_prots = vma->vm_flags;
         int new_prots = prot;
         vm_mprotect_handle_prot(vma, &new_prots);
-        vm_do_mmu_mprotect(as, (void *) vma->vm_start, (vma->vm_end - vma->vm_start) >> PAGE_SHIFT,
-                           old_prots, new_prots);
+        vm_do_mmu_mprotect_batch(&tlb, (void *) vma->vm_start,
+                                 (vma->vm_end - vma->vm_start) >> PAGE_SHIFT, old_prots, new_prots);
         if (vma->vm_end == limit)
             break;
     }
@@ -1170,9 +1297,10 @@ int vm_mprotect(struct mm_address_space *as, void *__addr, size_t size, int prot
     err = 0;
 
 out:
+    tlb_batch_finish(&tlb);
     vmi_destroy(&vmi);
     validate_mm_tree(as);
-    rw_unlock_write(&as->vm_lock);
+    mmap_write_unlock(as);
     return err;
 }
 
@@ -1222,7 +1350,7 @@ uint64_t sys_brk(void *newbrk)
     unsigned long ret;
     struct mm_address_space *as = get_current_address_space();
 
-    rw_lock_write(&as->vm_lock);
+    mmap_write_lock(as);
 
     if (newbrk == NULL)
     {
@@ -1252,7 +1380,7 @@ uint64_t sys_brk(void *newbrk)
 
     ret = (unsigned long) as->brk;
 out:
-    rw_unlock_write(&as->vm_lock);
+    mmap_write_unlock(as);
     return ret;
 }
 
@@ -1399,13 +1527,30 @@ static int __vm_handle_pf(struct vm_area_struct *entry, struct fault_info *info)
 #endif
     const u8 fault_write = info->write;
     struct vm_pf_context context;
+    int st;
     context.entry = entry;
     context.info = info;
     context.vpage = info->fault_address & -PAGE_SIZE;
     context.page = NULL;
     context.page_rwx = entry->vm_flags;
+
+    /* hugetlb mappings are only ever mapped by huge pmds */
+    if (vma_is_hugetlb(entry))
+        return do_hugetlb_fault(&context);
+
+    if (entry->vm_mm != &kernel_address_space)
+    {
+        st = do_huge_pmd_fault(&context);
+        if (st != VM_FAULT_FALLBACK)
+            return st;
+    }
+
     context.oldpte = pte_get(entry->vm_mm, context.vpage);
-    context.mapping_info = get_mapping_info((void *) context.vpage);
+    /* Page tables can be freed by a concurrent munmap of a neighbouring VMA, don't walk them
+     * locklessly */
+    spin_lock(&entry->vm_mm->page_table_lock);
+    context.mapping_info = __get_mapping_info((void *) context.vpage, entry->vm_mm);
+    spin_unlock(&entry->vm_mm->page_table_lock);
 
     if (!pte_none(context.oldpte) && (!pte_present(context.oldpte) || pte_protnone(context.oldpte)))
         return do_swap_page(&context);
@@ -1429,6 +1574,68 @@ static int __vm_handle_pf(struct vm_area_struct *entry, struct fault_info *info)
     return 0;
 }
 
+/**
+ * @brief Look up and read-lock the VMA at addr, without taking the mm's vm_lock
+ *
+ * @param mm Address space
+ * @param addr Address
+ * @return Read-locked VMA, or NULL if there's no VMA, or it's being modified (and we should take
+ * the slow path)
+ */
+static struct vm_area_struct *vma_lock_under_rcu(struct mm_address_space *mm, unsigned long addr)
+{
+    MA_STATE(mas, &mm->region_tree, addr, addr);
+    struct vm_area_struct *vma;
+
+    rcu_read_lock();
+    vma = (struct vm_area_struct *) mas_walk(&mas);
+    if (!vma || !vma_start_read(mm, vma))
+        goto out_none;
+
+    /* The VMA may have been changed or taken out of the tree before we locked it */
+    if (READ_ONCE(vma->vm_detached) || addr < vma->vm_start || addr >= vma->vm_end)
+    {
+        vma_end_read(vma);
+        goto out_none;
+    }
+
+    rcu_read_unlock();
+    return vma;
+out_none:
+    rcu_read_unlock();
+    return NULL;
+}
+
+static int vm_fault_vma(struct vm_area_struct *entry, struct fault_info *info)
+{
+    struct mm_address_space *as = entry->vm_mm;
+    int ret;
+
+    info->error_info = VM_BAD_PERMISSIONS;
+
+    if (info->write && !(entry->vm_flags & VM_WRITE))
+        return -1;
+    if (info->exec && !(entry->vm_flags & VM_EXEC))
+        return -1;
+    if (info->user && !(entry->vm_flags & VM_USER))
+        return -1;
+    if (info->read && !(entry->vm_flags & VM_READ))
+        return -1;
+
+    info->error_info = 0;
+    __sync_add_and_fetch(&as->page_faults, 1);
+    ret = __vm_handle_pf(entry, info);
+    if (ret >= 0)
+    {
+        if (ret & VM_FAULT_MAJOR)
+            current->majflt++;
+        else
+            current->minflt++;
+    }
+
+    return ret;
+}
+
 /**
  * @brief Handles a page fault.
  *
@@ -1440,6 +1647,8 @@ int vm_handle_page_fault(struct fault_info *info)
     bool use_kernel_as = !info->user && is_higher_half((void *) info->fault_address);
     struct mm_address_space *as =
         use_kernel_as ? &kernel_address_space : get_current_address_space();
+    struct vm_area_struct *entry;
+    int ret;
 
     if (get_current_thread()->pagefault_disabled)
     {
@@ -1459,9 +1668,22 @@ int vm_handle_page_fault(struct fault_info *info)
         return -1;
     }
 
+    if (as != &kernel_address_space)
+    {
+        /* Fast path: Handle the fault under the VMA's lock. This keeps us from contending with
+         * mmap/munmap/mprotect on other parts of the address space. */
+        entry = vma_lock_under_rcu(as, info->fault_address);
+        if (entry)
+        {
+            ret = vm_fault_vma(entry, info);
+            vma_end_read(entry);
+            return ret;
+        }
+    }
+
     rw_lock_read(&as->vm_lock);
 
-    struct vm_area_struct *entry = vm_find_region(as, (void *) info->fault_address);
+    entry = vm_find_region(as, (void *) info->fault_address);
     if (!entry)
     {
         struct thread *ct = get_current_thread();
@@ -1484,42 +1706,17 @@ int vm_handle_page_fault(struct fault_info *info)
         }
 
         info->signal = VM_SIGSEGV;
-        goto err;
-    }
-
-    info->error_info = VM_BAD_PERMISSIONS;
-
-    if (info->write && !(entry->vm_flags & VM_WRITE))
-        goto err;
-    if (info->exec && !(entry->vm_flags & VM_EXEC))
-        goto err;
-    if (info->user && !(entry->vm_flags & VM_USER))
-        goto err;
-    if (info->read && !(entry->vm_flags & VM_READ))
-        goto err;
-
-    info->error_info = 0;
-    __sync_add_and_fetch(&as->page_faults, 1);
-    int ret = __vm_handle_pf(entry, info);
-    if (ret >= 0)
-    {
-        if (ret & VM_FAULT_MAJOR)
-            current->majflt++;
-        else
-            current->minflt++;
+        rw_unlock_read(&as->vm_lock);
+        return -1;
     }
 
+    ret = vm_fault_vma(entry, info);
     rw_unlock_read(&as->vm_lock);
     return ret;
-err:
-    rw_unlock_read(&as->vm_lock);
-    return -1;
 }
 
 static void vm_destroy_area(struct vm_area_struct *region)
 {
-    vm_mmu_unmap(region->vm_mm, (void *) region->vm_start, vma_pages(region), region);
-
     decrement_vm_stat(region->vm_mm, virtual_memory_size, region->vm_end - region->vm_start);
 
     if (vma_shared(region))
@@ -1536,10 +1733,19 @@ static void vm_destroy_area(struct vm_area_struct *region)
 void vm_destroy_addr_space(struct mm_address_space *mm)
 {
     /* First, iterate through the maple tree and free/unmap stuff */
-    rw_lock_write(&mm->vm_lock);
+    mmap_write_lock(mm);
 
     struct vm_area_struct *entry;
+    struct tlb_batch tlb;
     unsigned long index = 0;
+
+    /* Unmap everything under a single batch, and only tear down the VMAs once the TLB is clean */
+    tlb_batch_init(&tlb, mm);
+    mt_for_each (&mm->region_tree, entry, index, -1UL)
+        vm_mmu_unmap_batch(&tlb, (void *) entry->vm_start, vma_pages(entry), entry);
+    tlb_batch_finish(&tlb);
+
+    index = 0;
     mt_for_each (&mm->region_tree, entry, index, -1UL)
         vm_destroy_area(entry);
 
@@ -1554,7 +1760,7 @@ void vm_destroy_addr_space(struct mm_address_space *mm)
 
     assert(mm->page_tables_size == PAGE_SIZE);
 
-    rw_unlock_write(&mm->vm_lock);
+    mmap_write_unlock(mm);
 }
 
 /**
@@ -1717,6 +1923,26 @@ static struct sysfs_object vm_obj;
 static struct sysfs_object aslr_control;
 static struct sysfs_object kmaps;
 static struct sysfs_object evict_obj;
+static struct sysfs_object thp_obj;
+static struct sysfs_object nr_hugepages_obj;
+static struct sysfs_object free_hugepages_obj;
+static struct sysfs_object fault_around_bytes_obj;
+static struct sysfs_object fault_around_mapped_obj;
+static struct sysfs_object zero_pool_high_obj;
+static struct sysfs_object zero_pool_stat_obj;
+static struct sysfs_object compact_memory_obj;
+static struct sysfs_object compact_stat_obj;
+static struct sysfs_object compaction_proactiveness_obj;
+static struct sysfs_object page_cluster_obj;
+static struct sysfs_object swap_vma_readahead_obj;
+static struct sysfs_object swap_ra_stat_obj;
+static struct sysfs_object lru_gen_enabled_obj;
+static struct sysfs_object reclaim_stat_obj;
+static struct sysfs_object workingset_stat_obj;
+#ifdef CONFIG_ZSWAP
+static struct sysfs_object zswap_max_pool_percent_obj;
+static struct sysfs_object zswap_stat_obj;
+#endif
 
 /**
  * @brief Initialises sysfs nodes for the vm subsystem.
@@ -1742,6 +1968,91 @@ void vm_sysfs_init(void)
     evict_obj.write = evict_write;
     evict_obj.perms = 0644 | S_IFREG;
 
+    assert(sysfs_init_and_add("transparent_hugepage", &thp_obj, &vm_obj) == 0);
+    thp_obj.read = thp_sysfs_read;
+    thp_obj.write = thp_sysfs_write;
+    thp_obj.perms = 0644 | S_IFREG;
+
+    assert(sysfs_init_and_add("nr_hugepages", &nr_hugepages_obj, &vm_obj) == 0);
+    nr_hugepages_obj.read = hugetlb_nr_sysfs_read;
+    nr_hugepages_obj.write = hugetlb_nr_sysfs_write;
+    nr_hugepages_obj.perms = 0644 | S_IFREG;
+
+    assert(sysfs_init_and_add("free_hugepages", &free_hugepages_obj, &vm_obj) == 0);
+    free_hugepages_obj.read = hugetlb_free_sysfs_read;
+    free_hugepages_obj.perms = 0444 | S_IFREG;
+
+    assert(sysfs_init_and_add("fault_around_bytes", &fault_around_bytes_obj, &vm_obj) == 0);
+    fault_around_bytes_obj.read = fault_around_bytes_sysfs_read;
+    fault_around_bytes_obj.write = fault_around_bytes_sysfs_write;
+    fault_around_bytes_obj.perms = 0644 | S_IFREG;
+
+    assert(sysfs_init_and_add("fault_around_mapped", &fault_around_mapped_obj, &vm_obj) == 0);
+    fault_around_mapped_obj.read = fault_around_mapped_sysfs_read;
+    fault_around_mapped_obj.perms = 0444 | S_IFREG;
+
+    assert(sysfs_init_and_add("zero_pool_high", &zero_pool_high_obj, &vm_obj) == 0);
+    zero_pool_high_obj.read = zero_pool_high_sysfs_read;
+    zero_pool_high_obj.write = zero_pool_high_sysfs_write;
+    zero_pool_high_obj.perms = 0644 | S_IFREG;
+
+    assert(sysfs_init_and_add("zero_pool_stat", &zero_pool_stat_obj, &vm_obj) == 0);
+    zero_pool_stat_obj.read = zero_pool_stat_sysfs_read;
+    zero_pool_stat_obj.perms = 0444 | S_IFREG;
+
+    assert(sysfs_init_and_add("compact_memory", &compact_memory_obj, &vm_obj) == 0);
+    compact_memory_obj.write = compact_memory_sysfs_write;
+    compact_memory_obj.perms = 0200 | S_IFREG;
+
+    assert(sysfs_init_and_add("compact_stat", &compact_stat_obj, &vm_obj) == 0);
+    compact_stat_obj.read = compact_stat_sysfs_read;
+    compact_stat_obj.perms = 0444 | S_IFREG;
+
+    assert(sysfs_init_and_add("compaction_proactiveness", &compaction_proactiveness_obj,
+                              &vm_obj) == 0);
+    compaction_proactiveness_obj.read = compaction_proactiveness_sysfs_read;
+    compaction_proactiveness_obj.write = compaction_proactiveness_sysfs_write;
+    compaction_proactiveness_obj.perms = 0644 | S_IFREG;
+
+    assert(sysfs_init_and_add("page_cluster", &page_cluster_obj, &vm_obj) == 0);
+    page_cluster_obj.read = page_cluster_sysfs_read;
+    page_cluster_obj.write = page_cluster_sysfs_write;
+    page_cluster_obj.perms = 0644 | S_IFREG;
+
+    assert(sysfs_init_and_add("swap_vma_readahead", &swap_vma_readahead_obj, &vm_obj) == 0);
+    swap_vma_readahead_obj.read = swap_vma_readahead_sysfs_read;
+    swap_vma_readahead_obj.write = swap_vma_readahead_sysfs_write;
+    swap_vma_readahead_obj.perms = 0644 | S_IFREG;
+
+    assert(sysfs_init_and_add("swap_ra_stat", &swap_ra_stat_obj, &vm_obj) == 0);
+    swap_ra_stat_obj.read = swap_ra_stat_sysfs_read;
+    swap_ra_stat_obj.perms = 0444 | S_IFREG;
+
+    assert(sysfs_init_and_add("lru_gen_enabled", &lru_gen_enabled_obj, &vm_obj) == 0);
+    lru_gen_enabled_obj.read = lru_gen_enabled_sysfs_read;
+    lru_gen_enabled_obj.write = lru_gen_enabled_sysfs_write;
+    lru_gen_enabled_obj.perms = 0644 | S_IFREG;
+
+    assert(sysfs_init_and_add("reclaim_stat", &reclaim_stat_obj, &vm_obj) == 0);
+    reclaim_stat_obj.read = reclaim_stat_sysfs_read;
+    reclaim_stat_obj.perms = 0444 | S_IFREG;
+
+    assert(sysfs_init_and_add("workingset_stat", &workingset_stat_obj, &vm_obj) == 0);
+    workingset_stat_obj.read = workingset_stat_sysfs_read;
+    workingset_stat_obj.perms = 0444 | S_IFREG;
+
+#ifdef CONFIG_ZSWAP
+    assert(sysfs_init_and_add("zswap_max_pool_percent", &zswap_max_pool_percent_obj, &vm_obj) ==
+           0);
+    zswap_max_pool_percent_obj.read = zswap_max_pool_percent_sysfs_read;
+    zswap_max_pool_percent_obj.write = zswap_max_pool_percent_sysfs_write;
+    zswap_max_pool_percent_obj.perms = 0644 | S_IFREG;
+
+    assert(sysfs_init_and_add("zswap_stat", &zswap_stat_obj, &vm_obj) == 0);
+    zswap_stat_obj.read = zswap_stat_sysfs_read;
+    zswap_stat_obj.perms = 0444 | S_IFREG;
+#endif
+
     sysfs_add(&vm_obj, NULL);
 }
 
@@ -1858,6 +2169,9 @@ int vma_setup_backing(struct vm_area_struct *region, size_t pages, bool is_file_
 {
     bool is_shared = vma_shared(region);
 
+    if (vma_is_hugetlb(region))
+        return hugetlb_setup_vma(region);
+
     if (!is_file_backed && is_shared)
     {
         region->vm_file = anon_get_shmem(pages << PAGE_SHIFT);
@@ -1936,7 +2250,8 @@ int vm_create_address_space(struct mm_address_space *mm)
 
     // assert(mm->active_mask.is_empty() == true);
 
-    rwlock_init(&mm->vm_lock);
+    /* Note: vm_lock was already initialized by mm_create, and the mm is already visible on the mm
+     * list, so don't touch it. */
     return 0;
 }
 
@@ -1972,8 +2287,10 @@ void *vm_get_fallback_pgd()
 void vm_remove_region(struct mm_address_space *as, struct vm_area_struct *region)
     REQUIRES(as->vm_lock)
 {
+    vma_start_write(region);
     void *ret = mtree_erase(&as->region_tree, region->vm_start);
     CHECK(ret == region);
+    vma_mark_detached(region, true);
 }
 
 int __vm_munmap(struct mm_address_space *as, void *__addr, size_t size) REQUIRES(as->vm_lock)
@@ -1981,11 +2298,15 @@ int __vm_munmap(struct mm_address_space *as, void *__addr, size_t size) REQUIRES
     unsigned long addr = (unsigned long) __addr & -PAGE_SIZE;
     unsigned long limit = ALIGN_TO(((unsigned long) __addr) + size, PAGE_SIZE);
     struct list_head list = LIST_HEAD_INIT(list);
+    struct tlb_batch tlb;
 
     struct vm_area_struct *vma = vm_search(as, (void *) addr, PAGE_SIZE);
     if (!vma)
         return -EINVAL;
 
+    if (vm_range_splits_hugetlb(as, addr, limit))
+        return -EINVAL;
+
     /* Gather munmap regions into our local list. No permanent changes are done in this loop,
      * while regions are live *except unlinking from the BST*.
      */
@@ -2003,11 +2324,21 @@ int __vm_munmap(struct mm_address_space *as, void *__addr, size_t size) REQUIRES
         DCHECK(vma->vm_start >= addr && vma->vm_end <= limit);
         DCHECK(vmi.mas.index == vma->vm_start && vmi.mas.last == vma->vm_end - 1);
         CHECK(mas_erase(&vmi.mas) == vma);
+        vma_mark_detached(vma, true);
         list_add_tail(&vma->vm_detached_node, &list);
         if (limit == vma->vm_end)
             break;
     }
 
+    /* Batch the TLB invalidations for every VMA, and only then destroy them */
+    tlb_batch_init(&tlb, as);
+    list_for_every (&list)
+    {
+        vma = container_of(l, struct vm_area_struct, vm_detached_node);
+        vm_mmu_unmap_batch(&tlb, (void *) vma->vm_start, vma_pages(vma), vma);
+    }
+    tlb_batch_finish(&tlb);
+
     list_for_every_safe (&list)
     {
         vma = container_of(l, struct vm_area_struct, vm_detached_node);
@@ -2015,7 +2346,6 @@ int __vm_munmap(struct mm_address_space *as, void *__addr, size_t size) REQUIRES
         bool is_shared = vma_shared(vma);
         unsigned long sz = vma->vm_end - vma->vm_start;
 
-        vm_mmu_unmap(as, (void *) vma->vm_start, vma_pages(vma), vma);
         list_remove(&vma->vm_detached_node);
         vma_destroy(vma);
 
@@ -2034,6 +2364,7 @@ restore:
         vma = container_of(l, struct vm_area_struct, vm_detached_node);
         list_remove(&vma->vm_detached_node);
         vm_insert_region(as, vma);
+        vma_mark_detached(vma, false);
     }
 
     vmi_destroy(&vmi);
@@ -2059,9 +2390,9 @@ int vm_munmap(struct mm_address_space *as, void *__addr, size_t size)
     if (addr & (PAGE_SIZE - 1))
         return -EINVAL;
 
-    rw_lock_write(&as->vm_lock);
+    mmap_write_lock(as);
     int err = __vm_munmap(as, __addr, size);
-    rw_unlock_write(&as->vm_lock);
+    mmap_write_unlock(as);
     return err;
 }
 
@@ -2109,6 +2440,7 @@ static int __vm_expand_mapping(struct vm_area_struct *region, size_t new_size)
     if (!vm_test_vs_rlimit(region->vm_mm, new_size))
         return -ENOMEM;
 
+    vma_start_write(region);
     region->vm_end += diff;
     increment_vm_stat(region->vm_mm, virtual_memory_size, diff);
     if (vma_shared(region))
@@ -2369,7 +2701,13 @@ static int __get_phys_pages(struct vm_area_struct *region, unsigned long addr, u
         /* TODO: Walking this properly (and this logic being a callback) would be better */
         pte = ptep_get_locked(region->vm_mm, addr, &lock);
         if (!pte)
-            goto fault_in;
+        {
+            page = follow_huge_pmd(region, addr, flags);
+            if (!page)
+                goto fault_in;
+            pages[i] = page;
+            continue;
+        }
 
         page = page_from_pte(pte, region, flags, lock);
         if (IS_ERR(page))
@@ -2568,11 +2906,43 @@ static inline void mm_init(struct mm_address_space *mm)
     mm->mm_count = REFCOUNT_INIT(1);
     mm->mm_users = REFCOUNT_INIT(1);
     rwlock_init(&mm->vm_lock);
-    mm->region_tree = (struct maple_tree) MTREE_INIT(mm->region_tree,
-                                                     MT_FLAGS_ALLOC_RANGE | MT_FLAGS_LOCK_EXTERN);
+    /* RCU mode lets page faults walk the tree without the vm_lock */
+    mm->region_tree = (struct maple_tree) MTREE_INIT(
+        mm->region_tree, MT_FLAGS_ALLOC_RANGE | MT_FLAGS_LOCK_EXTERN | MT_FLAGS_USE_RCU);
     spin_lock_init(&mm->page_table_lock);
 }
 
+static void mm_list_add(struct mm_address_space *mm)
+{
+    spin_lock(&mm_list_lock);
+    list_add_tail(&mm->mm_list_node, &mm_list);
+    spin_unlock(&mm_list_lock);
+}
+
+struct mm_address_space *mm_list_next(struct mm_address_space *prev)
+{
+    struct mm_address_space *mm = prev;
+    struct list_head *head = &mm_list;
+
+    spin_lock(&mm_list_lock);
+    /* prev's mm_users reference keeps it on the list */
+    if (!mm)
+        mm = list_entry(head, struct mm_address_space, mm_list_node);
+
+    list_for_each_entry_continue (mm, head, mm_list_node)
+    {
+        /* Skip address spaces that are on their way out */
+        if (refcount_inc_not_zero(&mm->mm_users))
+            break;
+    }
+
+    spin_unlock(&mm_list_lock);
+
+    if (prev)
+        mmput(prev);
+    return list_entry_is_head(mm, head, mm_list_node) ? NULL : mm;
+}
+
 /**
  * @brief Creates a new standalone address space
  *
@@ -2592,6 +2962,7 @@ struct mm_address_space *mm_create(void)
         return ERR_PTR(-ENOMEM);
     }
 
+    mm_list_add(mm);
     return mm;
 }
 
@@ -2614,6 +2985,7 @@ struct mm_address_space *mm_fork(void)
         return ERR_PTR(st);
     }
 
+    mm_list_add(mm);
     return mm;
 }
 
@@ -2625,10 +2997,14 @@ struct mm_address_space *mm_fork(void)
  */
 void vm_load_aspace(struct mm_address_space *aspace, unsigned int cpu)
 {
-    vm_load_arch_mmu(&aspace->arch_mmu);
     if (unlikely(cpu == -1U))
         cpu = get_cpu_nr();
+    /* Become visible to shootdowns *before* loading the mm (and looking at its TLB generation).
+     * Either the shootdown sees us in the mask and IPIs us, or we see its new generation. */
     cpumask_set_atomic(&aspace->active_mask, cpu);
+    asid_leave_lazy();
+    smp_mb();
+    vm_load_arch_mmu(&aspace->arch_mmu);
 }
 
 /**
@@ -2665,6 +3041,9 @@ void __mmput(struct mm_address_space *mm)
 {
     /* mm has no users, clear out the address space and put the implicit ref. The pgd is not freed
      * and the kernel page tables will be unharmed. */
+    spin_lock(&mm_list_lock);
+    list_remove(&mm->mm_list_node);
+    spin_unlock(&mm_list_lock);
     vm_destroy_addr_space(mm);
     mmdrop(mm);
 }
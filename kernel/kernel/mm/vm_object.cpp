@@ -7,12 +7,15 @@
  */
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/mman.h>
 
 #include <onyx/file.h>
 #include <onyx/ioctx.h>
 #include <onyx/mm/page_lru.h>
+#include <onyx/mm/tlb.h>
 #include <onyx/mm/vm_object.h>
+#include <onyx/mm/workingset.h>
 #include <onyx/page.h>
 #include <onyx/panic.h>
 #include <onyx/scoped_lock.h>
@@ -84,6 +87,16 @@ vm_object *vmo_create_phys(size_t size)
     return vmo;
 }
 
+/* Remove and return the shadow entry at @a idx, if any. Called with the page_lock held. */
+static unsigned long vm_obj_take_shadow(struct vm_object *obj, unsigned long idx)
+{
+    auto sh = obj->vm_shadows.get(idx);
+    if (!sh.has_value())
+        return 0;
+    obj->vm_shadows.store(idx, 0);
+    return sh.value();
+}
+
 /**
  * @brief Insert a page into the vmo
  *
@@ -91,7 +104,8 @@ vm_object *vmo_create_phys(size_t size)
  * @param page struct page to insert
  * @return 0 on success, negative error codes (ENOMEM)
  */
-struct page *vm_object::insert_page_unlocked(unsigned long off, struct page *page)
+struct page *vm_object::insert_page_unlocked(unsigned long off, struct page *page,
+                                              unsigned long *shadow)
 {
     auto ex = vm_pages.get(off >> PAGE_SHIFT);
     if (ex.has_value())
@@ -105,6 +119,11 @@ struct page *vm_object::insert_page_unlocked(unsigned long off, struct page *pag
     if (int st0 = vm_pages.store(off >> PAGE_SHIFT, (unsigned long) page); st0 < 0)
         return nullptr;
 
+    /* The slot is occupied again, the previous page's shadow entry goes away */
+    unsigned long sh = vm_obj_take_shadow(this, off >> PAGE_SHIFT);
+    if (shadow)
+        *shadow = sh;
+
     return page;
 }
 
@@ -193,6 +212,82 @@ struct page *vmo_add_page_safe(size_t off, struct page *p, vm_object *vmo)
     return vmo->insert_page_unlocked(off, p);
 }
 
+struct page *vmo_add_page_shadow(size_t off, struct page *p, vm_object *vmo,
+                                 unsigned long *shadow)
+{
+    scoped_lock g{vmo->page_lock};
+    *shadow = 0;
+    return vmo->insert_page_unlocked(off, p, shadow);
+}
+
+unsigned long vmo_add_pages_shadow(struct vm_object *vmo, unsigned long pgoff,
+                                   struct page **pages, unsigned int nr, unsigned long *shadows)
+{
+    unsigned long inserted = 0;
+    DCHECK(nr <= sizeof(unsigned long) * 8);
+
+    scoped_lock g{vmo->page_lock};
+    for (unsigned int i = 0; i < nr; i++)
+    {
+        struct page *page = pages[i];
+        if (!page)
+            continue;
+
+        /* Large folios go in whole, or not at all */
+        unsigned long folio_nr = compound_nr(page), j;
+        DCHECK(i + folio_nr <= nr);
+        for (j = 0; j < folio_nr; j++)
+        {
+            if (vmo->vm_pages.get(pgoff + i + j).has_value())
+                break;
+        }
+
+        if (j != folio_nr)
+            continue;
+
+        for (j = 0; j < folio_nr; j++)
+        {
+            if (vmo->vm_pages.store(pgoff + i + j, (unsigned long) (page + j)) < 0)
+                break;
+        }
+
+        if (j != folio_nr)
+        {
+            while (j-- > 0)
+                vmo->vm_pages.store(pgoff + i + j, 0);
+            break;
+        }
+
+        for (j = 0; j < folio_nr; j++)
+            shadows[i + j] = vm_obj_take_shadow(vmo, pgoff + i + j);
+        inserted |= 1UL << i;
+        i += folio_nr - 1;
+    }
+
+    return inserted;
+}
+
+unsigned int vmo_get_range(struct vm_object *vmo, unsigned long pgoff, unsigned int nr,
+                           struct page **pages)
+{
+    unsigned int found = 0;
+    memset(pages, 0, nr * sizeof(struct page *));
+
+    scoped_lock g{vmo->page_lock};
+    radix_tree::cursor cursor = radix_tree::cursor::from_range(&vmo->vm_pages, pgoff,
+                                                               pgoff + nr - 1);
+    while (!cursor.is_end())
+    {
+        struct page *page = (struct page *) cursor.get();
+        pages[cursor.current_idx() - pgoff] = page;
+        page_ref(page);
+        found++;
+        cursor.advance();
+    }
+
+    return found;
+}
+
 /**
  * @brief Releases the vmo, and destroys it if it was the last reference.
  *
@@ -210,6 +305,7 @@ bool vmo_unref(vm_object *vmo)
     return false;
 }
 
+/* Grab the pages in [start, end]. Large folios are returned once, by their head. */
 static int vm_obj_get_pages(struct vm_object *obj, unsigned long start, unsigned long end,
                             struct page **batch, int batchlen)
 {
@@ -219,37 +315,67 @@ static int vm_obj_get_pages(struct vm_object *obj, unsigned long start, unsigned
 
     while (!cursor.is_end())
     {
+        struct page *page = compound_head((struct page *) cursor.get());
+        cursor.advance();
+        if (batchidx > 0 && batch[batchidx - 1] == page)
+            continue;
         if (!batchlen--)
             break;
-        struct page *page = (struct page *) cursor.get();
         batch[batchidx++] = page;
         page_ref(page);
-        cursor.advance();
     }
 
     return batchidx;
 }
 
-static void vm_obj_truncate_out(struct vm_object *obj, struct page *const *batch, int batchlen)
+static bool vm_obj_folio_in_range(struct page *page, unsigned long start, unsigned long end)
+{
+    return page->pageoff >= start && page->pageoff + compound_nr(page) - 1 <= end;
+}
+
+static void vm_obj_truncate_out(struct vm_object *obj, struct page *const *batch, int batchlen,
+                                unsigned long start, unsigned long end)
 {
     spin_lock(&obj->page_lock);
     for (int i = 0; i < batchlen; i++)
     {
         struct page *pg = batch[i];
-        /* Not sure if we're doing the correct exclusion between truncation... */
-        CHECK(pg->owner == obj);
-        int st = obj->vm_pages.store(pg->pageoff, 0);
-        CHECK(st == 0);
-        /* Once we release this lock, other people trying to get a stable reference to this page
-         * will re-check owner under the page lock. If it observes a pg->owner == original_vmobj,
-         * it'll keep going without realizing this page is being/was truncated. So we need to
-         * WRITE_ONCE pg->owner here. */
-        WRITE_ONCE(pg->owner, nullptr);
+        /* Folios that straddle the range stay in, see vmo_purge_pages */
+        if (!vm_obj_folio_in_range(pg, start, end))
+            continue;
+
+        for (unsigned long j = 0; j < compound_nr(pg); j++)
+        {
+            /* Not sure if we're doing the correct exclusion between truncation... */
+            CHECK(pg[j].owner == obj);
+            int st = obj->vm_pages.store(pg[j].pageoff, 0);
+            CHECK(st == 0);
+            /* Once we release this lock, other people trying to get a stable reference to this
+             * page will re-check owner under the page lock. If it observes a pg->owner ==
+             * original_vmobj, it'll keep going without realizing this page is being/was
+             * truncated. So we need to WRITE_ONCE pg->owner here. */
+            WRITE_ONCE(pg[j].owner, nullptr);
+        }
     }
 
     spin_unlock(&obj->page_lock);
 }
 
+static void vm_obj_clear_shadows(struct vm_object *obj, unsigned long start, unsigned long end)
+{
+    scoped_lock g{obj->page_lock};
+    radix_tree::cursor cursor = radix_tree::cursor::from_range(&obj->vm_shadows, start, end);
+
+    while (!cursor.is_end())
+    {
+        cursor.store(0);
+        cursor.advance();
+    }
+}
+
+static void vm_obj_truncate_page(struct vm_object *obj, struct page *page, size_t offset,
+                                 size_t len);
+
 #define VMOBJ_TRUNCATE_BATCH_SIZE 16
 static int vmo_purge_pages(unsigned long start, unsigned long end,
                            struct vm_object *vmo) NO_THREAD_SAFETY_ANALYSIS
@@ -261,10 +387,15 @@ static int vmo_purge_pages(unsigned long start, unsigned long end,
     start >>= PAGE_SHIFT;
     end >>= PAGE_SHIFT;
     end -= 1;
+
+    const unsigned long hole_start = start;
+
+    /* Pages in the hole that were evicted don't get to refault anymore */
+    vm_obj_clear_shadows(vmo, start, end);
     while ((found = vm_obj_get_pages(vmo, start, end, pagebatch, VMOBJ_TRUNCATE_BATCH_SIZE)) > 0)
     {
         /* Start the next iteration from the following page */
-        start = pagebatch[found - 1]->pageoff + 1;
+        start = pagebatch[found - 1]->pageoff + compound_nr(pagebatch[found - 1]);
 
         /* Lock all the pages (in a batch), then wait for writeback etc, then truncate them from the
          * page cache, then unlock. This requires minimal locking. Locking the page prevents races
@@ -276,14 +407,30 @@ static int vmo_purge_pages(unsigned long start, unsigned long end,
             page_wait_writeback(pagebatch[i]);
         }
 
-        vm_obj_truncate_out(vmo, pagebatch, found);
+        vm_obj_truncate_out(vmo, pagebatch, found, hole_start, end);
 
         for (int i = 0; i < found; i++)
         {
+            struct page *old_p = pagebatch[i];
+            unsigned long nr = compound_nr(old_p);
+
+            if (!vm_obj_folio_in_range(old_p, hole_start, end))
+            {
+                /* A large folio that straddles an end of the hole can't be removed. Unmap and zero
+                 * the part inside the hole instead. */
+                unsigned long first = cul::max(hole_start, old_p->pageoff);
+                unsigned long last = cul::min(end, old_p->pageoff + nr - 1);
+                vmo->unmap_pages(first << PAGE_SHIFT, last - first + 1);
+                vm_obj_truncate_page(vmo, old_p + (first - old_p->pageoff), 0,
+                                     (last - first + 1) << PAGE_SHIFT);
+                unlock_page(old_p);
+                page_unref(old_p);
+                continue;
+            }
+
             /* Page has been truncated from the page cache, no writeback is ongoing, now unlock
              * and free. */
-            struct page *old_p = pagebatch[i];
-            vmo->unmap_page(old_p->pageoff << PAGE_SHIFT);
+            vmo->unmap_pages(old_p->pageoff << PAGE_SHIFT, nr);
             unlock_page(old_p);
             /* Unref it twice, once for the vm_obj_get_pages, and another for the page cache
              * reference */
@@ -316,28 +463,50 @@ static inline void vm_obj_assert_interval_tree(size_t pgoff, struct vm_area_stru
  * @param offset Offset of the page
  */
 void vm_object::unmap_page(size_t offset)
+{
+    unmap_pages(offset, 1);
+}
+
+/**
+ * @brief Unmaps a range of pages from every mapping
+ *
+ * @param offset Offset of the first page
+ * @param nr Number of pages
+ */
+void vm_object::unmap_pages(size_t offset, unsigned long nr)
 {
     scoped_lock g{mapping_lock};
     struct vm_area_struct *vma;
-    offset >>= PAGE_SHIFT;
-    for_intervals_in_range(&mappings, vma, struct vm_area_struct, vm_objhead, offset, offset)
+    const unsigned long first = offset >> PAGE_SHIFT, last = first + nr - 1;
+    for_intervals_in_range(&mappings, vma, struct vm_area_struct, vm_objhead, first, last)
     {
-        vm_obj_assert_interval_tree(offset, vma);
-        vm_mmu_unmap(vma->vm_mm, (void *) (vma->vm_start + (offset << PAGE_SHIFT) - vma->vm_offset),
-                     1, vma);
+        unsigned long start = cul::max(first, vma->vm_objhead.start);
+        unsigned long end = cul::min(last, vma->vm_objhead.end);
+        vm_obj_assert_interval_tree(start, vma);
+        vm_mmu_unmap(vma->vm_mm, (void *) (vma->vm_start + (start << PAGE_SHIFT) - vma->vm_offset),
+                     end - start + 1, vma);
     }
 }
 
 void vm_obj_try_to_unmap(struct vm_object *obj, struct page *page)
 {
     scoped_lock g{obj->mapping_lock};
-    size_t offset = page->pageoff;
+    size_t first = page->pageoff, last = first + compound_nr(page) - 1;
     struct vm_area_struct *vma;
-    for_intervals_in_range(&obj->mappings, vma, struct vm_area_struct, vm_objhead, offset, offset)
+    struct tlb_batch tlb;
+    tlb_batch_init(&tlb, nullptr);
+    for_intervals_in_range(&obj->mappings, vma, struct vm_area_struct, vm_objhead, first, last)
     {
-        vm_obj_assert_interval_tree(offset, vma);
-        try_to_unmap_one(page, vma, (vma->vm_start + (offset << PAGE_SHIFT) - vma->vm_offset));
+        unsigned long end = cul::min(last, vma->vm_objhead.end);
+        for (size_t offset = cul::max(first, vma->vm_objhead.start); offset <= end; offset++)
+        {
+            vm_obj_assert_interval_tree(offset, vma);
+            try_to_unmap_one(page + (offset - first), vma,
+                             (vma->vm_start + (offset << PAGE_SHIFT) - vma->vm_offset), &tlb);
+        }
     }
+
+    tlb_batch_finish(&tlb);
 }
 
 /**
@@ -436,11 +605,14 @@ int vmo_punch_range(vm_object *vmo, unsigned long start, unsigned long length)
     return vmo_purge_pages(start, start + length, vmo);
 }
 
+/* Truncate [offset, offset + len) of a page. The range may span the following subpages of a
+ * large folio, and the backer gets offsets relative to the folio's head. */
 static void vm_obj_truncate_page(struct vm_object *obj, struct page *page, size_t offset,
                                  size_t len)
 {
+    struct page *head = compound_head(page);
     if (obj->ops->truncate_partial)
-        obj->ops->truncate_partial(obj, page, offset, len);
+        obj->ops->truncate_partial(obj, head, ((page - head) << PAGE_SHIFT) + offset, len);
     /* Zero out the truncated bit */
     u8 *start = (u8 *) PAGE_TO_VIRT(page) + offset;
     memset(start, 0, len);
@@ -485,6 +657,9 @@ static void vm_obj_truncate_up(struct vm_object *obj, size_t new_size)
  */
 int vmo_truncate(vm_object *vmo, unsigned long size, unsigned long flags)
 {
+    if (vmo->ops && vmo->ops->truncate)
+        return vmo->ops->truncate(vmo, size);
+
     scoped_lock g{vmo->page_lock};
 
     if (size < vmo->size)
@@ -548,15 +723,23 @@ void vm_obj_clean_page(struct vm_object *obj, struct page *page)
 {
     scoped_lock g{obj->mapping_lock};
     struct vm_area_struct *vma;
-    unsigned long offset = page->pageoff;
-    for_intervals_in_range(&obj->mappings, vma, struct vm_area_struct, vm_objhead, offset, offset)
+    /* Large folios get cleaned as a whole */
+    page = compound_head(page);
+    unsigned long first = page->pageoff, last = first + compound_nr(page) - 1;
+    for_intervals_in_range(&obj->mappings, vma, struct vm_area_struct, vm_objhead, first, last)
     {
-        vm_obj_assert_interval_tree(offset, vma);
-        vm_wp_page(vma->vm_mm, (void *) (vma->vm_start + (offset << PAGE_SHIFT) - vma->vm_offset));
+        unsigned long end = cul::min(last, vma->vm_objhead.end);
+        for (unsigned long offset = cul::max(first, vma->vm_objhead.start); offset <= end;
+             offset++)
+        {
+            vm_obj_assert_interval_tree(offset, vma);
+            vm_wp_page(vma->vm_mm,
+                       (void *) (vma->vm_start + (offset << PAGE_SHIFT) - vma->vm_offset));
+        }
     }
 }
 
-bool vm_obj_remove_page(struct vm_object *obj, struct page *page)
+bool vm_obj_remove_page(struct vm_object *obj, struct page *page, bool evict)
 {
     bool ret = false;
     DCHECK_PAGE(page_locked(page), page);
@@ -568,11 +751,24 @@ bool vm_obj_remove_page(struct vm_object *obj, struct page *page)
      * We take into account the mapcount, because virtual references can be punted off.
      */
 
-    unsigned int expected_refs = 2 + (page_mapcount(page) > 0);
+    unsigned long nr = compound_nr(page), shadow = 0;
+    /* Each mapped subpage of a large folio holds a reference */
+    unsigned int expected_refs = 2;
+    for (unsigned long i = 0; i < nr; i++)
+        expected_refs += page_mapcount(page + i) > 0;
     if (__atomic_load_n(&page->ref, __ATOMIC_RELAXED) > expected_refs)
         goto out;
 
-    obj->vm_pages.store(page_pgoff(page), 0);
+    if (evict)
+        shadow = workingset_eviction(page);
+    for (unsigned long i = 0; i < nr; i++)
+    {
+        obj->vm_pages.store(page_pgoff(page) + i, 0);
+        /* Failing to store the shadow entry just means we won't detect the refault */
+        if (evict)
+            obj->vm_shadows.store(page_pgoff(page) + i, shadow);
+    }
+
     if (page_test_swap(page))
         swap_unset_swapcache(swpval_to_swp_entry(page->priv));
     /* We do not need to reset owner here, because we're the only reference */
@@ -582,21 +778,59 @@ out:
     return ret;
 }
 
+/**
+ * @brief Replace a page in the page cache with a copy
+ * Checks that no one but the caller, the page cache and the page's mappings hold references to
+ * @a page, then copies its contents over to @a newpage and installs @a newpage in its slot.
+ *
+ * @param obj The page's vm object
+ * @param page Page to replace (locked, unmapped)
+ * @param newpage Replacement page (locked, state already set up by the caller)
+ * @return True if replaced, false if the page had extra references
+ */
+bool vm_obj_replace_page(struct vm_object *obj, struct page *page, struct page *newpage)
+{
+    bool ret = false;
+    DCHECK_PAGE(page_locked(page), page);
+    DCHECK_PAGE(page_vmobj(page) == obj, page);
+
+    spin_lock(&obj->page_lock);
+    /* Same logic as vm_obj_remove_page: references can't go up under the page_lock. We copy under
+     * the lock too, so any writer that held a reference is guaranteed to be done with the page. */
+    unsigned int expected_refs = 2 + (page_mapcount(page) > 0);
+    if (__atomic_load_n(&page->ref, __ATOMIC_RELAXED) != expected_refs)
+        goto out;
+
+    copy_page_to_page(page_to_phys(newpage), page_to_phys(page));
+    obj->vm_pages.store(page_pgoff(page), (rt_entry_t) newpage);
+    ret = true;
+out:
+    spin_unlock(&obj->page_lock);
+    return ret;
+}
+
 long vm_obj_get_page_references(struct vm_object *obj, struct page *page, unsigned int *vm_flags)
 {
     scoped_lock g{obj->mapping_lock};
     struct vm_area_struct *vma;
-    unsigned long offset = page->pageoff;
+    unsigned long first = page->pageoff, last = first + compound_nr(page) - 1;
     long refs = 0;
 
     if (vm_flags)
         *vm_flags = 0;
 
-    for_intervals_in_range(&obj->mappings, vma, struct vm_area_struct, vm_objhead, offset, offset)
+    for_intervals_in_range(&obj->mappings, vma, struct vm_area_struct, vm_objhead, first, last)
     {
-        vm_obj_assert_interval_tree(offset, vma);
-        refs += mmu_get_clear_referenced(
-            vma->vm_mm, (void *) (vma->vm_start + (offset << PAGE_SHIFT) - vma->vm_offset), page);
+        unsigned long end = cul::min(last, vma->vm_objhead.end);
+        for (unsigned long offset = cul::max(first, vma->vm_objhead.start); offset <= end;
+             offset++)
+        {
+            vm_obj_assert_interval_tree(offset, vma);
+            refs += mmu_get_clear_referenced(
+                vma->vm_mm, (void *) (vma->vm_start + (offset << PAGE_SHIFT) - vma->vm_offset),
+                page + (offset - first));
+        }
+
         if (vm_flags)
             *vm_flags |= vma->vm_flags;
     }
@@ -6,7 +6,20 @@
  * SPDX-License-Identifier: GPL-2.0-only
  */
 
+#include <string.h>
+
 #include <onyx/kunit.h>
+#include <onyx/mm/alloc_profile.h>
+#include <onyx/mm/numa.h>
+#include <onyx/mm/slab.h>
+#include <onyx/mm/tlb.h>
+#include <onyx/mm/vm_object.h>
+#include <onyx/mm/zero_pool.h>
+#include <onyx/mm/zswap.h>
+#include <onyx/page.h>
+#include <onyx/paging.h>
+#include <onyx/pgtable.h>
+#include <onyx/swap.h>
 #include <onyx/vm.h>
 
 // Internal vm.cpp interfaces
@@ -76,3 +89,395 @@ TEST(mmap, test_48_57_bit)
 
 #endif
 #endif
+
+TEST(page, compound_refcount)
+{
+    struct page *page = alloc_pages(2, GFP_KERNEL | __GFP_COMP);
+    ASSERT_NONNULL(page);
+
+    EXPECT_TRUE(page_flag_set(page, PAGE_FLAG_HEAD));
+    EXPECT_EQ(compound_order(page), 2U);
+    for (int i = 1; i < 4; i++)
+    {
+        EXPECT_TRUE(page[i].flags & PAGE_FLAG_TAIL);
+        EXPECT_EQ(compound_head(&page[i]), page);
+    }
+
+    /* References on tail pages go to the head */
+    page_ref(&page[3]);
+    EXPECT_EQ(page->ref, 2U);
+    page_unref(&page[1]);
+    EXPECT_EQ(page->ref, 1U);
+    page_unref(page);
+}
+
+TEST(page, zero_pool_pages_are_zeroed)
+{
+    /* Dirty a page and give it back, then make sure whatever the pool zeroes for us is clean */
+    int nid = numa_node_id();
+    struct page *page = alloc_pages_node(nid, 0, GFP_KERNEL | PAGE_ALLOC_NO_ZERO | __GFP_THISNODE);
+    ASSERT_NONNULL(page);
+    memset(PAGE_TO_VIRT(page), 0xaa, PAGE_SIZE);
+    page_unref(page);
+
+    zero_pool_drain();
+    ASSERT_GT(zero_pool_fill(nid, 8), 0UL);
+
+    for (int i = 0; i < 8; i++)
+    {
+        struct page *p = zero_pool_alloc(nid);
+        if (!p)
+            break;
+        const unsigned long *ptr = (const unsigned long *) PAGE_TO_VIRT(p);
+        bool zero = true;
+        for (unsigned long j = 0; j < PAGE_SIZE / sizeof(unsigned long); j++)
+            zero = zero && ptr[j] == 0;
+        EXPECT_TRUE(zero);
+        page_unref(p);
+    }
+}
+
+TEST(page, zeroed_allocations_come_from_the_zero_pool)
+{
+    const unsigned long poison = 0x5a5a5a5a5a5a5a5aUL;
+    struct zero_pool_stats before, after;
+    int nid = numa_node_id();
+
+    zero_pool_drain();
+    ASSERT_GT(zero_pool_fill(nid, 8), 0UL);
+
+    /* Scribble over the page at the head of the pool. If the allocation below hands it back with
+     * the scribble intact, it came from the pool and the allocator didn't zero it again. */
+    struct page *head = zero_pool_peek(nid);
+    ASSERT_NONNULL(head);
+    unsigned long *ptr = (unsigned long *) PAGE_TO_VIRT(head);
+    zero_pool_get_stats(nid, &before);
+    ptr[0] = poison;
+
+    struct page *page = alloc_pages_node(nid, 0, GFP_KERNEL | __GFP_THISNODE);
+    zero_pool_get_stats(nid, &after);
+
+    EXPECT_EQ(head, page);
+    EXPECT_EQ(poison, ptr[0]);
+    EXPECT_GT(after.hits, before.hits);
+
+    /* Someone else may have gotten the scribbled page, but don't leave it in the pool */
+    if (page != head)
+        zero_pool_drain();
+    if (page)
+        page_unref(page);
+}
+
+TEST(numa, alloc_pages_node_is_node_local)
+{
+    int nid;
+
+    EXPECT_EQ(node_distance(0, 0), (unsigned int) LOCAL_DISTANCE);
+
+    for_each_online_node(nid)
+    {
+        struct page *page = alloc_pages_node(nid, 0, GFP_KERNEL | __GFP_THISNODE);
+        /* A node may be out of memory, but we must never get pages from somewhere else */
+        if (!page)
+            continue;
+        EXPECT_EQ(page_to_nid(page), nid);
+        page_unref(page);
+    }
+}
+
+TEST(tlb_batch, merges_ranges_and_degrades_to_full_flush)
+{
+    struct tlb_batch tlb;
+    /* Any kernel address will do, flushing it is harmless */
+    unsigned long base = (unsigned long) &tlb & -PAGE_SIZE;
+
+    tlb_batch_init(&tlb, &kernel_address_space);
+    EXPECT_FALSE(tlb_batch_pending(&tlb));
+
+    /* Adjacent pages share a range */
+    tlb_batch_remove_page(&tlb, base, nullptr);
+    tlb_batch_remove_page(&tlb, base + PAGE_SIZE, nullptr);
+    EXPECT_EQ(tlb.nr_ranges, 1U);
+    EXPECT_TRUE(tlb_batch_covers(&tlb, base + PAGE_SIZE, base + 2 * PAGE_SIZE));
+    EXPECT_FALSE(tlb_batch_covers(&tlb, base + 4 * PAGE_SIZE, base + 5 * PAGE_SIZE));
+
+    /* Scattered pages don't */
+    for (unsigned long i = 1; i < TLB_BATCH_NR_RANGES; i++)
+        tlb_batch_remove_page(&tlb, base + i * 4 * PAGE_SIZE, nullptr);
+    EXPECT_EQ(tlb.nr_ranges, (unsigned int) TLB_BATCH_NR_RANGES);
+    EXPECT_FALSE(tlb.flags & TLB_BATCH_FLUSH_ALL);
+
+    /* One more range than we can track means we flush everything */
+    tlb_batch_remove_page(&tlb, base + TLB_BATCH_NR_RANGES * 4 * PAGE_SIZE, nullptr);
+    EXPECT_TRUE(tlb.flags & TLB_BATCH_FLUSH_ALL);
+
+    tlb_batch_flush(&tlb);
+    EXPECT_FALSE(tlb_batch_pending(&tlb));
+    EXPECT_FALSE(tlb.flags & TLB_BATCH_FLUSH_ALL);
+
+    /* And so does a large enough range */
+    tlb_batch_add_range(&tlb, base, base + TLB_BATCH_FULL_FLUSH_PAGES * PAGE_SIZE);
+    EXPECT_TRUE(tlb.flags & TLB_BATCH_FLUSH_ALL);
+    tlb_batch_finish(&tlb);
+}
+
+TEST(vmalloc, huge_mappings)
+{
+    /* One huge page plus a regular one, to test the fallback for the tail */
+    const size_t pages = (PMD_SIZE >> PAGE_SHIFT) + 1;
+    char *ptr = (char *) vmalloc(pages, VM_TYPE_REGULAR, VM_READ | VM_WRITE | VM_HUGEPAGE,
+                                 GFP_KERNEL);
+    ASSERT_NONNULL(ptr);
+
+    unsigned long info = get_mapping_info(ptr);
+    EXPECT_TRUE(info & PAGE_PRESENT);
+    /* Getting a huge page is best effort, but it must be a proper one if we got it */
+    if (info & PAGE_HUGE)
+    {
+        EXPECT_EQ((unsigned long) ptr & (PMD_SIZE - 1), 0UL);
+        EXPECT_EQ(MAPPING_INFO_PADDR(get_mapping_info(ptr + PMD_SIZE - PAGE_SIZE)),
+                  MAPPING_INFO_PADDR(info) + PMD_SIZE - PAGE_SIZE);
+    }
+
+    EXPECT_FALSE(get_mapping_info(ptr + PMD_SIZE) & PAGE_HUGE);
+    memset(ptr, 0xaa, pages << PAGE_SHIFT);
+    vfree(ptr);
+}
+
+TEST(migrate, migration_entry_round_trip)
+{
+    struct page *page = alloc_page(GFP_KERNEL);
+    ASSERT_NONNULL(page);
+
+    for (int write = 0; write < 2; write++)
+    {
+        swp_entry_t entry = make_migration_entry(page, write);
+        EXPECT_TRUE(swp_is_migration(entry));
+        EXPECT_EQ(swp_migration_write(entry), (bool) write);
+        EXPECT_EQ(migration_entry_to_page(entry), page);
+
+        /* It must look like a swap pte to the fault path */
+        pte_t pte = __pte(entry.swp);
+        EXPECT_FALSE(pte_present(pte));
+        EXPECT_FALSE(pte_none(pte));
+        EXPECT_TRUE(SWP_TYPE(entry) >= MAX_SWAP_AREAS);
+    }
+
+    free_page(page);
+}
+
+TEST(slab, kmalloc_intermediate_size_classes)
+{
+    /* 65 bytes land in kmalloc-96, so growing up to 96 bytes happens in place */
+    void *ptr = kmalloc(65, GFP_KERNEL);
+    ASSERT_NONNULL(ptr);
+    void *ptr2 = krealloc(ptr, 96, GFP_KERNEL);
+    EXPECT_EQ(ptr, ptr2);
+
+    /* ... and 97 bytes don't fit */
+    void *ptr3 = krealloc(ptr2, 97, GFP_KERNEL);
+    ASSERT_NONNULL(ptr3);
+    EXPECT_NE(ptr2, ptr3);
+    kfree(ptr3);
+}
+
+TEST(slab, kmalloc_classes_waste_less_than_half)
+{
+    /* Sizes at and around every class boundary from 64 bytes up */
+    for (unsigned int shift = 6; shift < 25; shift++)
+    {
+        const size_t sizes[] = {(1UL << shift) + 1, 3UL << (shift - 1), (3UL << (shift - 1)) + 1,
+                                1UL << (shift + 1)};
+        for (size_t size : sizes)
+        {
+            size_t objsize = kmalloc_size_roundup(size);
+            EXPECT_LE(size, objsize);
+            EXPECT_LT(objsize, size + size / 2);
+        }
+    }
+
+    EXPECT_EQ(kmalloc_size_roundup(65), 96UL);
+    EXPECT_EQ(kmalloc_size_roundup(129), 192UL);
+    EXPECT_EQ(kmalloc_size_roundup(2049), 3072UL);
+}
+
+TEST(slab, compatible_caches_are_merged)
+{
+    struct slab_cache *a = kmem_cache_create("merge-test-a", 200, 0, 0, NULL);
+    struct slab_cache *b = kmem_cache_create("merge-test-b", 200, 0, 0, NULL);
+    struct slab_cache *c = kmem_cache_create("merge-test-c", 200, 0, KMEM_CACHE_NOMERGE, NULL);
+    ASSERT_NONNULL(a);
+    ASSERT_NONNULL(b);
+    ASSERT_NONNULL(c);
+    EXPECT_EQ(a, b);
+    EXPECT_NE(a, c);
+
+    /* The merged cache stays alive until its last user destroys it */
+    void *obj = kmem_cache_alloc(a, GFP_KERNEL);
+    ASSERT_NONNULL(obj);
+    kmem_cache_destroy(b);
+    kmem_cache_free(a, obj);
+    kmem_cache_destroy(a);
+    kmem_cache_destroy(c);
+}
+
+static struct page *workingset_test_insert(struct vm_object *vmo, unsigned long *shadow)
+{
+    struct page *page = alloc_page(GFP_KERNEL);
+    if (!page)
+        return nullptr;
+    page->owner = vmo;
+    page->pageoff = 0;
+    /* The page cache takes over our allocation reference, grab one for ourselves */
+    CHECK(vmo_add_page_shadow(0, page, vmo, shadow) == page);
+    page_ref(page);
+    return page;
+}
+
+static bool workingset_test_remove(struct vm_object *vmo, struct page *page, bool evict)
+{
+    lock_page(page);
+    bool removed = vm_obj_remove_page(vmo, page, evict);
+    page->owner = nullptr;
+    unlock_page(page);
+    page_unref(page);
+    page_unref(page);
+    return removed;
+}
+
+TEST(workingset, evicted_pages_leave_shadow_entries)
+{
+    struct vm_object *vmo = vmo_create(PAGE_SIZE, nullptr);
+    unsigned long shadow;
+    ASSERT_NONNULL(vmo);
+
+    struct page *page = workingset_test_insert(vmo, &shadow);
+    ASSERT_NONNULL(page);
+    EXPECT_EQ(shadow, 0UL);
+    EXPECT_TRUE(workingset_test_remove(vmo, page, true));
+
+    /* The refault sees the shadow entry, and consumes it */
+    page = workingset_test_insert(vmo, &shadow);
+    ASSERT_NONNULL(page);
+    EXPECT_NE(shadow, 0UL);
+    EXPECT_TRUE(workingset_test_remove(vmo, page, false));
+
+    /* Removals that aren't evictions (e.g swap cache drops) leave nothing behind */
+    page = workingset_test_insert(vmo, &shadow);
+    ASSERT_NONNULL(page);
+    EXPECT_EQ(shadow, 0UL);
+    EXPECT_TRUE(workingset_test_remove(vmo, page, false));
+
+    vmo_unref(vmo);
+}
+
+TEST(vm_object, large_folios_are_cached_whole)
+{
+    struct vm_object *vmo = vmo_create(4 * PAGE_SIZE, nullptr);
+    ASSERT_NONNULL(vmo);
+    vmo->flags |= VMO_FLAG_LARGE_FOLIOS;
+
+    struct page *folio = alloc_pages(2, GFP_KERNEL | __GFP_COMP);
+    ASSERT_NONNULL(folio);
+    for (unsigned long i = 0; i < 4; i++)
+    {
+        folio[i].owner = vmo;
+        folio[i].pageoff = i;
+    }
+
+    struct page *pages[4] = {folio, nullptr, nullptr, nullptr};
+    unsigned long shadows[4];
+    EXPECT_EQ(vmo_add_pages_shadow(vmo, 0, pages, 4, shadows), 1UL);
+    page_ref(folio);
+
+    /* Every index holds its subpage */
+    EXPECT_EQ(vmo_get_range(vmo, 0, 4, pages), 4U);
+    for (unsigned long i = 0; i < 4; i++)
+    {
+        EXPECT_EQ(pages[i], &folio[i]);
+        page_unref(pages[i]);
+    }
+
+    /* The lock (like every other bit of folio state) lives in the head */
+    lock_page(&folio[1]);
+    EXPECT_TRUE(page_locked(folio));
+    EXPECT_TRUE(vm_obj_remove_page(vmo, folio, false));
+    EXPECT_EQ(vmo_get_range(vmo, 0, 4, pages), 0U);
+    for (unsigned long i = 0; i < 4; i++)
+        folio[i].owner = nullptr;
+    unlock_page(&folio[1]);
+    page_unref(folio);
+    page_unref(folio);
+
+    vmo_unref(vmo);
+}
+
+#ifdef CONFIG_ALLOC_PROFILING
+TEST(alloc_profile, pages_are_tagged_by_call_site)
+{
+    struct page *pages[2];
+    for (int i = 0; i < 2; i++)
+    {
+        pages[i] = alloc_page(GFP_KERNEL);
+        ASSERT_NONNULL(pages[i]);
+    }
+
+    struct page *other = alloc_page(GFP_KERNEL);
+    ASSERT_NONNULL(other);
+
+    EXPECT_NE(pages[0]->alloc_tag, ALLOC_TAG_NONE);
+    EXPECT_EQ(pages[0]->alloc_tag, pages[1]->alloc_tag);
+    EXPECT_NE(pages[0]->alloc_tag, other->alloc_tag);
+
+    free_page(pages[0]);
+    free_page(pages[1]);
+    free_page(other);
+}
+#endif
+
+#ifdef CONFIG_ZSWAP
+TEST(zswap, store_load_round_trip)
+{
+    /* Use the last swap area slot, which the test machine never swaps on */
+    const unsigned int type = MAX_SWAP_AREAS - 1;
+    struct page *page = alloc_page(GFP_KERNEL);
+    ASSERT_NONNULL(page);
+    ASSERT_TRUE(try_lock_page(page));
+    zswap_swapon(type, 16);
+
+    u8 *ptr = (u8 *) PAGE_TO_VIRT(page);
+    for (unsigned int i = 0; i < PAGE_SIZE; i++)
+        ptr[i] = i % 61;
+
+    page->priv = SWP_ENTRY((unsigned long) type, 3).swp;
+    EXPECT_EQ(zswap_store(page), 0);
+    memset(ptr, 0xff, PAGE_SIZE);
+    EXPECT_EQ(zswap_load(page, SWP_ENTRY((unsigned long) type, 3)), 0);
+    for (unsigned int i = 0; i < PAGE_SIZE; i++)
+    {
+        if (ptr[i] != i % 61)
+        {
+            EXPECT_EQ(ptr[i], i % 61);
+            break;
+        }
+    }
+
+    /* Freed slots lose their copy */
+    zswap_invalidate(SWP_ENTRY((unsigned long) type, 3));
+    EXPECT_EQ(zswap_load(page, SWP_ENTRY((unsigned long) type, 3)), -ENOENT);
+
+    /* Same-filled pages don't need the compressor */
+    memset(ptr, 0xff, PAGE_SIZE);
+    page->priv = SWP_ENTRY((unsigned long) type, 4).swp;
+    EXPECT_EQ(zswap_store(page), 0);
+    memset(ptr, 0, PAGE_SIZE);
+    EXPECT_EQ(zswap_load(page, SWP_ENTRY((unsigned long) type, 4)), 0);
+    EXPECT_EQ(ptr[PAGE_SIZE - 1], 0xff);
+    zswap_invalidate(SWP_ENTRY((unsigned long) type, 4));
+    zswap_swapoff(type);
+
+    page->priv = 0;
+    unlock_page(page);
+    free_page(page);
+}
+#endif
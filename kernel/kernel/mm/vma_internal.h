@@ -31,4 +31,5 @@ static inline void vmi_destroy(struct vma_iterator *vmi)
 
 struct vm_area_struct *vma_prepare_modify(struct vma_iterator *vmi, struct vm_area_struct *vma,
                                           unsigned long start, unsigned long end);
+struct vm_area_struct *vm_search(struct mm_address_space *mm, void *addr, size_t length);
 #endif
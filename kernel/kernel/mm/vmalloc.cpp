@@ -8,19 +8,54 @@
 
 #include <lib/binary_search_tree.h>
 
+#include <onyx/atomic.h>
+#include <onyx/bitmap.h>
+#include <onyx/cmdline.h>
+#include <onyx/init.h>
+#include <onyx/list.h>
+#include <onyx/mm/alloc_profile.h>
 #include <onyx/mm/kasan.h>
+#include <onyx/mm/slab.h>
+#include <onyx/mm/tlb.h>
+#include <onyx/page.h>
+#include <onyx/percpu.h>
+#include <onyx/pgtable.h>
 #include <onyx/spinlock.h>
 #include <onyx/vm.h>
 
 #include <onyx/mm/pool.hpp>
 #include <onyx/utility.hpp>
 
+/*
+ * vfree doesn't flush the TLB. Freed ranges are unmapped, but their virtual addresses stay
+ * reserved (lazy) until enough of them pile up (VMALLOC_LAZY_MAX_PAGES), and then get purged: a
+ * single TLB flush for all of them, after which the addresses can be reused.
+ *
+ * Small allocations (up to VMAP_BLOCK_MAX_PAGES, e.g kernel stacks) don't touch the tree at all.
+ * Each CPU carves them out of its own vmap block, a VMAP_BLOCK_PAGES chunk of a dedicated area at
+ * the start of vmalloc space. Addresses in a block are never reused: once a block is full it's
+ * retired, and it's released (with the lazy ranges) when every allocation in it has been freed.
+ */
+
+/* Lazily freed pages we tolerate before flushing (32MiB) */
+#define VMALLOC_LAZY_MAX_PAGES (0x2000000UL >> PAGE_SHIFT)
+
+#define VMAP_BLOCK_PAGES     64
+#define VMAP_BLOCK_SIZE      (VMAP_BLOCK_PAGES << PAGE_SHIFT)
+#define VMAP_BLOCK_MAX_PAGES 16
+#define VMAP_BLOCK_AREA_SIZE (1UL << 30)
+#define VMAP_NR_BLOCKS       (VMAP_BLOCK_AREA_SIZE / VMAP_BLOCK_SIZE)
+
 struct vmalloc_tree
 {
     struct bst_root root;
     struct spinlock lock;
     unsigned long start;
     unsigned long length;
+    /* Freed regions and released vmap blocks waiting for a TLB flush */
+    struct list_head lazy_regions;
+    struct list_head lazy_blocks;
+    unsigned long lazy_pages;
 } vmalloc_tree;
 
 struct vmalloc_region
@@ -29,9 +64,54 @@ struct vmalloc_region
     size_t pages;
     struct bst_node tree_node;
     int perms;
+    bool lazy;
+    alloc_tag_t tag;
     page *backing_pgs;
+    struct list_head lazy_node;
 };
 
+struct vmap_block_alloc
+{
+    struct page *backing_pgs;
+    /* Total number of pages, including guard pages (0 if free) */
+    unsigned short pages;
+    /* Offset of the returned pointer into the allocation, in pages */
+    unsigned short alloc_off;
+    alloc_tag_t tag;
+};
+
+struct vmap_block
+{
+    struct spinlock lock;
+    unsigned long addr;
+    unsigned int index;
+    /* Bump pointer, in pages */
+    unsigned int free_off;
+    /* Pages that were allocated and freed again */
+    unsigned int nr_dirty;
+    bool retired;
+    struct list_head lazy_node;
+    /* Indexed by the page offset of the pointer we handed out */
+    struct vmap_block_alloc allocs[VMAP_BLOCK_PAGES];
+};
+
+struct vmap_block_queue
+{
+    struct spinlock lock;
+    struct vmap_block *current;
+};
+
+static PER_CPU_VAR(struct vmap_block_queue vmap_block_queue);
+
+static struct vmap_blocks
+{
+    struct spinlock lock;
+    unsigned long start;
+    bool enabled;
+    Bitmap<VMAP_NR_BLOCKS, true> bitmap;
+    struct vmap_block *blocks[VMAP_NR_BLOCKS];
+} vmap_blocks;
+
 /* Adapted from vm.cpp */
 
 /**
@@ -41,13 +121,15 @@ struct vmalloc_region
  * @param as Address space
  * @param min Minimum address
  * @param size Size of the region
+ * @param align Alignment of the base
  * @return New base
  */
-static unsigned long vmalloc_allocate_base(struct vmalloc_tree *as, unsigned long min, size_t size)
+static unsigned long vmalloc_allocate_base(struct vmalloc_tree *as, unsigned long min, size_t size,
+                                           unsigned long align)
 {
     MUST_HOLD_LOCK(&as->lock);
 
-    min = cul::max(min, as->start);
+    min = ALIGN_TO(cul::max(min, as->start), align);
 
     struct a : bst_node
     {
@@ -93,7 +175,7 @@ static unsigned long vmalloc_allocate_base(struct vmalloc_tree *as, unsigned lon
 #if DEBUG_VM_1
     printk("Tiniest node: %016lx\n", f->addr);
 #endif
-    if (f->addr - min >= size)
+    if (f->addr >= min && f->addr - min >= size)
     {
 #if DEBUG_VM_2
         printk("gap [%016lx - %016lx]\n", min, f->addr);
@@ -104,7 +186,7 @@ static unsigned long vmalloc_allocate_base(struct vmalloc_tree *as, unsigned lon
     while (node)
     {
         f = container_of(node, vmalloc_region, tree_node);
-        last_end = f->addr + (f->pages << PAGE_SHIFT);
+        last_end = ALIGN_TO(f->addr + (f->pages << PAGE_SHIFT), align);
 
         node = bst_next(&as->root, node);
         if (!node)
@@ -112,7 +194,7 @@ static unsigned long vmalloc_allocate_base(struct vmalloc_tree *as, unsigned lon
 
         struct vmalloc_region *vm = container_of(node, vmalloc_region, tree_node);
 
-        if (vm->addr - last_end >= size && min <= vm->addr)
+        if (vm->addr >= last_end && vm->addr - last_end >= size && min <= vm->addr)
             break;
     }
 
@@ -165,163 +247,555 @@ static struct vmalloc_region *vmalloc_insert_region(struct vmalloc_tree *tree,
 }
 
 /**
- * @brief Allocates a range of virtual memory for kernel purposes.
- * This memory is all prefaulted and cannot be demand paged nor paged out.
+ * @brief Find a vmalloc region in the tree
  *
- * @param pages The number of pages.
- * @param type The type of allocation.
- * @param perms The permissions on the allocation.
- * @param gfp_flags GFP flags
- * @return A pointer to the new allocation, or NULL with errno set on failure.
+ * @param ptr Pointer to memory
+ * @return Corresponding vmalloc_region, or nullptr
  */
-void *vmalloc(size_t pages, int type, int perms, unsigned int gfp_flags)
+static struct vmalloc_region *vfind(void *ptr)
 {
-    unsigned long alloc_off = 0, guard_pages = 0;
-    auto pgs = alloc_page_list(pages, gfp_flags);
-    if (!pgs)
-        return errno = ENOMEM, nullptr;
+    struct vmalloc_region fake;
+    fake.addr = (unsigned long) ptr;
+    fake.pages = 1;
+    bst_node_initialize(&fake.tree_node);
+
+    auto node =
+        bst_search(&vmalloc_tree.root, &fake.tree_node,
+                   [](struct bst_node *lhs_, struct bst_node *rhs_) -> int {
+                       auto lhs = container_of(lhs_, vmalloc_region, tree_node);
+                       auto rhs = container_of(rhs_, vmalloc_region, tree_node);
 
+                       if (check_for_overlap(lhs->addr, lhs->addr + (lhs->pages << PAGE_SHIFT) - 1,
+                                             rhs->addr, rhs->addr + (rhs->pages << PAGE_SHIFT) - 1))
+                           return 0;
+                       else if (rhs->addr > lhs->addr)
+                           return 1;
+                       else
+                           return -1;
+                   });
+    return !node ? nullptr : container_of(node, vmalloc_region, tree_node);
+}
+
+static void vmalloc_purge_lazy();
+
+/**
+ * @brief Allocate a range of the vmalloc tree
+ *
+ * @param pages Number of pages
+ * @param align Alignment of the range
+ * @param perms Permissions
+ * @param pgs Backing pages, if any
+ * @param gfp_flags GFP flags
+ * @param tag Allocation profiling tag
+ * @return Start of the range, or 0
+ */
+static unsigned long vmalloc_tree_alloc(size_t pages, unsigned long align, int perms,
+                                        struct page *pgs, unsigned int gfp_flags, alloc_tag_t tag)
+{
+    bool purged = false;
+    unsigned long start;
     auto reg = pool.allocate(gfp_flags);
     if (!reg)
-    {
-        free_page_list(pgs);
-        return errno = ENOMEM, nullptr;
-    }
+        return 0;
 
-    /* Add guard pages on both sides of the stack */
-    if (type == VM_TYPE_STACK)
+    spin_lock(&vmalloc_tree.lock);
+    for (;;)
     {
-        guard_pages = 2;
-        alloc_off = PAGE_SIZE;
-    }
+        start = vmalloc_allocate_base(&vmalloc_tree, 0, pages << PAGE_SHIFT, align);
+        if (start + (pages << PAGE_SHIFT) <= vmalloc_tree.start + vmalloc_tree.length)
+            break;
 
-    scoped_lock g{vmalloc_tree.lock};
-    auto start = vmalloc_allocate_base(&vmalloc_tree, 0, (pages + guard_pages) << PAGE_SHIFT);
+        if (purged)
+        {
+            spin_unlock(&vmalloc_tree.lock);
+            pool.free(reg);
+            return 0;
+        }
 
-    if (start + ((pages + guard_pages) << PAGE_SHIFT) > vmalloc_tree.start + vmalloc_tree.length)
-    {
-        free_page_list(pgs);
-        pool.free(reg);
-        return errno = ENOMEM, nullptr;
+        /* Lazily freed regions might be hogging the space we need */
+        spin_unlock(&vmalloc_tree.lock);
+        vmalloc_purge_lazy();
+        purged = true;
+        spin_lock(&vmalloc_tree.lock);
     }
 
-    auto vmal_reg = vmalloc_insert_region(&vmalloc_tree, reg, start, pages + guard_pages, perms,
-                                          gfp_flags | PAGE_ALLOC_NO_SANITIZER_SHADOW);
-    if (!vmal_reg)
-    {
-        free_page_list(pgs);
-        pool.free(reg);
-        return errno = ENOMEM, nullptr;
-    }
+    vmalloc_insert_region(&vmalloc_tree, reg, start, pages, perms,
+                          gfp_flags | PAGE_ALLOC_NO_SANITIZER_SHADOW);
+    reg->lazy = false;
+    reg->backing_pgs = pgs;
+    reg->tag = tag;
+    spin_unlock(&vmalloc_tree.lock);
+    return start;
+}
 
-    auto delvmr = [vmal_reg]() {
-        bst_delete(&vmalloc_tree.root, &vmal_reg->tree_node);
-        pool.free(vmal_reg);
-    };
+static struct vmap_block *vmap_block_new(unsigned int gfp_flags)
+{
+    unsigned long idx;
+    bool found, purged = false;
 
-#ifdef CONFIG_KASAN
-    if (kasan_alloc_shadow(vmal_reg->addr, (pages + guard_pages) << PAGE_SHIFT, true) < 0)
+    struct vmap_block *vb = (struct vmap_block *) kmalloc(sizeof(*vb), gfp_flags);
+    if (!vb)
+        return nullptr;
+
+    for (;;)
     {
-        delvmr();
-        free_page_list(pgs);
-        return errno = ENOMEM, nullptr;
+        spin_lock(&vmap_blocks.lock);
+        found = vmap_blocks.bitmap.find_free_bit(&idx);
+        spin_unlock(&vmap_blocks.lock);
+
+        if (found || purged)
+            break;
+        /* Retired blocks might be waiting for a flush */
+        vmalloc_purge_lazy();
+        purged = true;
     }
-    if (guard_pages)
+
+    if (!found)
     {
-        asan_poison_shadow(vmal_reg->addr, PAGE_SIZE, KASAN_LEFT_REDZONE);
-        asan_poison_shadow(vmal_reg->addr + (vmal_reg->pages << PAGE_SHIFT) - PAGE_SIZE, PAGE_SIZE,
-                           KASAN_REDZONE);
+        kfree(vb);
+        return nullptr;
     }
-#endif
 
-    page *it = pgs;
-    for (size_t i = 0; i < pages; i++, it = it->next_un.next_allocation)
+    spinlock_init(&vb->lock);
+    vb->addr = vmap_blocks.start + idx * VMAP_BLOCK_SIZE;
+    vb->index = idx;
+    vb->free_off = 0;
+    vb->nr_dirty = 0;
+    vb->retired = false;
+    INIT_LIST_HEAD(&vb->lazy_node);
+    for (auto &alloc : vb->allocs)
+        alloc.pages = 0;
+    WRITE_ONCE(vmap_blocks.blocks[idx], vb);
+    return vb;
+}
+
+static void vmalloc_lazy_add_block(struct vmap_block *vb)
+{
+    bool purge;
+
+    spin_lock(&vmalloc_tree.lock);
+    list_add_tail(&vb->lazy_node, &vmalloc_tree.lazy_blocks);
+    vmalloc_tree.lazy_pages += VMAP_BLOCK_PAGES;
+    purge = vmalloc_tree.lazy_pages > VMALLOC_LAZY_MAX_PAGES;
+    spin_unlock(&vmalloc_tree.lock);
+
+    if (purge)
+        vmalloc_purge_lazy();
+}
+
+static void vmap_block_retire(struct vmap_block *vb)
+{
+    bool release;
+
+    spin_lock(&vb->lock);
+    vb->retired = true;
+    release = vb->nr_dirty == vb->free_off;
+    spin_unlock(&vb->lock);
+
+    if (release)
+        vmalloc_lazy_add_block(vb);
+}
+
+static void vmap_block_release(struct vmap_block *vb)
+{
+    WRITE_ONCE(vmap_blocks.blocks[vb->index], nullptr);
+    spin_lock(&vmap_blocks.lock);
+    vmap_blocks.bitmap.free_bit(vb->index);
+    spin_unlock(&vmap_blocks.lock);
+    kfree(vb);
+}
+
+/**
+ * @brief Allocate a range from this CPU's vmap block
+ *
+ * @param pages Number of pages (including guard pages)
+ * @param alloc_off Offset of the pointer we'll hand out, in pages
+ * @param pgs Backing pages
+ * @param gfp_flags GFP flags
+ * @param tag Allocation profiling tag
+ * @return Start of the range, or 0
+ */
+static unsigned long vmap_block_alloc(unsigned int pages, unsigned int alloc_off,
+                                      struct page *pgs, unsigned int gfp_flags, alloc_tag_t tag)
+{
+    struct vmap_block_queue *vbq = get_per_cpu_ptr(vmap_block_queue);
+    struct vmap_block *vb, *old;
+    unsigned long addr;
+
+    if (!READ_ONCE(vmap_blocks.enabled))
+        return 0;
+
+    for (;;)
     {
-        bool success =
-            vm_map_page(&kernel_address_space, vmal_reg->addr + alloc_off + (i << PAGE_SHIFT),
-                        (uint64_t) page_to_phys(it), vmal_reg->perms, nullptr) != nullptr;
-        if (!success)
+        spin_lock(&vbq->lock);
+        vb = vbq->current;
+        if (vb)
         {
-            free_page_list(pgs);
-            vm_mmu_unmap(&kernel_address_space, (void *) vmal_reg->addr, i, nullptr);
-            delvmr();
-            return errno = ENOMEM, nullptr;
+            spin_lock(&vb->lock);
+            if (vb->free_off + pages <= VMAP_BLOCK_PAGES)
+            {
+                struct vmap_block_alloc *alloc = &vb->allocs[vb->free_off + alloc_off];
+                alloc->backing_pgs = pgs;
+                alloc->pages = pages;
+                alloc->alloc_off = alloc_off;
+                alloc->tag = tag;
+                addr = vb->addr + (vb->free_off << PAGE_SHIFT);
+                vb->free_off += pages;
+                spin_unlock(&vb->lock);
+                spin_unlock(&vbq->lock);
+                return addr;
+            }
+
+            spin_unlock(&vb->lock);
         }
 
-        *(char *) (vmal_reg->addr + alloc_off + (i << PAGE_SHIFT)) = 0;
+        spin_unlock(&vbq->lock);
+
+        /* Out of space, install a fresh block. We can't allocate under the lock. */
+        vb = vmap_block_new(gfp_flags);
+        if (!vb)
+            return 0;
+
+        spin_lock(&vbq->lock);
+        old = vbq->current;
+        vbq->current = vb;
+        spin_unlock(&vbq->lock);
+
+        if (old)
+            vmap_block_retire(old);
     }
+}
+
+static struct vmap_block *vmap_block_lookup(unsigned long addr)
+{
+    if (addr < vmap_blocks.start || addr >= vmap_blocks.start + VMAP_BLOCK_AREA_SIZE)
+        return nullptr;
+    return READ_ONCE(vmap_blocks.blocks[(addr - vmap_blocks.start) / VMAP_BLOCK_SIZE]);
+}
+
+#define VFREE_MMIO      (1 << 0)
+/* The KASAN shadow was never set up */
+#define VFREE_NO_SHADOW (1 << 1)
 
-    vmal_reg->backing_pgs = pgs;
+static void vmalloc_unaccount(alloc_tag_t tag, size_t pages, unsigned long alloc_off)
+{
+    /* Guard pages (if any) surround the allocation, and alloc_off skips the first one */
+    alloc_prof_unaccount(tag, (pages - 2 * alloc_off) << PAGE_SHIFT, 1);
+}
+
+static void vmap_block_free(struct vmap_block *vb, void *ptr, unsigned int flags)
+{
+    unsigned int off = ((unsigned long) ptr - vb->addr) >> PAGE_SHIFT;
+    struct vmap_block_alloc alloc;
+    unsigned long start;
+    bool release;
 
-    return (void *) (vmal_reg->addr + alloc_off);
+    spin_lock(&vb->lock);
+    alloc = vb->allocs[off];
+    if (!alloc.pages)
+        panic("vfree: Bad pointer %p not mapped\n", ptr);
+    vb->allocs[off].pages = 0;
+    start = (unsigned long) ptr - (alloc.alloc_off << PAGE_SHIFT);
+
+#ifdef CONFIG_KASAN
+    if (!(flags & VFREE_NO_SHADOW))
+        asan_poison_shadow(start, alloc.pages << PAGE_SHIFT, KASAN_FREED);
+#endif
+    /* Unmap under the lock, so the block can't be released (and reused) before we're done */
+    vm_mmu_unmap_noflush((void *) start, alloc.pages);
+    vb->nr_dirty += alloc.pages;
+    release = vb->retired && vb->nr_dirty == vb->free_off;
+    spin_unlock(&vb->lock);
+
+    if (alloc.backing_pgs)
+        free_page_list(alloc.backing_pgs);
+    vmalloc_unaccount(alloc.tag, alloc.pages, alloc.alloc_off);
+
+    if (release)
+        vmalloc_lazy_add_block(vb);
 }
 
 /**
- * @brief Find a vmalloc region in the tree
- *
- * @param ptr Pointer to memory
- * @return Corresponding vmalloc_region, or nullptr
+ * @brief Flush the TLB for every lazily freed range, and release them
  */
-static struct vmalloc_region *vfind(void *ptr)
+static void vmalloc_purge_lazy()
 {
-    struct vmalloc_region fake;
-    fake.addr = (unsigned long) ptr;
-    fake.pages = 1;
-    bst_node_initialize(&fake.tree_node);
+    DEFINE_LIST(regions);
+    DEFINE_LIST(blocks);
+    struct tlb_batch tlb;
+
+    spin_lock(&vmalloc_tree.lock);
+    list_move(&regions, &vmalloc_tree.lazy_regions);
+    list_move(&blocks, &vmalloc_tree.lazy_blocks);
+    vmalloc_tree.lazy_pages = 0;
+    spin_unlock(&vmalloc_tree.lock);
+
+    if (list_is_empty(&regions) && list_is_empty(&blocks))
+        return;
+
+    /* One shootdown for everything */
+    tlb_batch_init(&tlb, &kernel_address_space);
+    list_for_every (&regions)
+    {
+        auto reg = container_of(l, vmalloc_region, lazy_node);
+        tlb_batch_add_range(&tlb, reg->addr, reg->addr + (reg->pages << PAGE_SHIFT));
+    }
 
-    auto node =
-        bst_search(&vmalloc_tree.root, &fake.tree_node,
-                   [](struct bst_node *lhs_, struct bst_node *rhs_) -> int {
-                       auto lhs = container_of(lhs_, vmalloc_region, tree_node);
-                       auto rhs = container_of(rhs_, vmalloc_region, tree_node);
+    list_for_every (&blocks)
+    {
+        auto vb = container_of(l, vmap_block, lazy_node);
+        tlb_batch_add_range(&tlb, vb->addr, vb->addr + VMAP_BLOCK_SIZE);
+    }
+    tlb_batch_finish(&tlb);
 
-                       if (check_for_overlap(lhs->addr, lhs->addr + (lhs->pages << PAGE_SHIFT) - 1,
-                                             rhs->addr, rhs->addr + (rhs->pages << PAGE_SHIFT) - 1))
-                           return 0;
-                       else if (rhs->addr > lhs->addr)
-                           return 1;
-                       else
-                           return -1;
-                   });
-    return !node ? nullptr : container_of(node, vmalloc_region, tree_node);
+    spin_lock(&vmalloc_tree.lock);
+    list_for_every_safe (&regions)
+    {
+        auto reg = container_of(l, vmalloc_region, lazy_node);
+        bst_delete(&vmalloc_tree.root, &reg->tree_node);
+        pool.free(reg);
+    }
+    spin_unlock(&vmalloc_tree.lock);
+
+    list_for_every_safe (&blocks)
+        vmap_block_release(container_of(l, vmap_block, lazy_node));
 }
 
 /**
  * @brief Frees a region of memory previously allocated by vmalloc or mmiomap.
  *
  * @param ptr A pointer to the allocation.
- * @param pages The number of pages it consists in.
- * @param is_mmiounmap Skip certain checks
+ * @param flags VFREE_* flags
  */
-static void __vfree(void *ptr, bool is_mmiounmap)
+static void __vfree(void *ptr, unsigned int flags)
 {
-    scoped_lock g{vmalloc_tree.lock};
+    struct vmalloc_region *reg;
+    struct vmap_block *vb;
+    bool purge;
+
     if ((unsigned long) ptr & (PAGE_SIZE - 1))
         panic("vfree: Pointer %p not page aligned\n", ptr);
 
+    vb = vmap_block_lookup((unsigned long) ptr);
+    if (vb)
+    {
+        vmap_block_free(vb, ptr, flags);
+        return;
+    }
+
     // We do a bunch of sanity checks
-    auto reg = vfind(ptr);
-    if (!reg)
+    spin_lock(&vmalloc_tree.lock);
+    reg = vfind(ptr);
+    if (!reg || reg->lazy)
     {
         panic("vfree: Bad pointer %p not mapped\n", ptr);
     }
 
+    /* The range stays reserved in the tree until it's purged */
+    reg->lazy = true;
+    spin_unlock(&vmalloc_tree.lock);
+
 #ifdef CONFIG_KASAN
     // Re-poison the shadow as free
-    asan_poison_shadow((unsigned long) reg->addr, reg->pages << PAGE_SHIFT, KASAN_FREED);
+    if (!(flags & VFREE_NO_SHADOW))
+        asan_poison_shadow((unsigned long) reg->addr, reg->pages << PAGE_SHIFT, KASAN_FREED);
 #endif
 
-    // First, free the pages, then unmap the memory, then finally unlink it
-    if (!is_mmiounmap && reg->backing_pgs)
+    // First, unmap the memory (the TLB gets flushed later), then free the pages
+    vm_mmu_unmap_noflush((void *) reg->addr, reg->pages);
+
+    if (!(flags & VFREE_MMIO) && reg->backing_pgs)
         free_page_list(reg->backing_pgs);
+    vmalloc_unaccount(reg->tag, reg->pages, ((unsigned long) ptr - reg->addr) >> PAGE_SHIFT);
+
+    spin_lock(&vmalloc_tree.lock);
+    list_add_tail(&reg->lazy_node, &vmalloc_tree.lazy_regions);
+    vmalloc_tree.lazy_pages += reg->pages;
+    purge = vmalloc_tree.lazy_pages > VMALLOC_LAZY_MAX_PAGES;
+    spin_unlock(&vmalloc_tree.lock);
+
+    if (purge)
+        vmalloc_purge_lazy();
+}
+
+#define VMALLOC_HUGE_ORDER    (PMD_SHIFT - PAGE_SHIFT)
+#define VMALLOC_HUGE_NR_PAGES (1UL << VMALLOC_HUGE_ORDER)
+/* Allocations this big get huge pages even if they didn't ask for them */
+#define VMALLOC_HUGE_AUTO_PAGES (2 * VMALLOC_HUGE_NR_PAGES)
+
+static bool vmalloc_huge_auto = true;
+
+static int nohugevmalloc_param(const char *s)
+{
+    vmalloc_huge_auto = false;
+    return 1;
+}
+kernel_param("nohugevmalloc", nohugevmalloc_param);
+
+static bool vmalloc_want_huge(size_t pages, int type, int perms)
+{
+    /* Stacks have guard pages, and modules change permissions page by page */
+    if (type == VM_TYPE_STACK || type == VM_TYPE_MODULE || perms & VM_NOHUGEPAGE)
+        return false;
+    if (pages < VMALLOC_HUGE_NR_PAGES)
+        return false;
+    return perms & VM_HUGEPAGE || (vmalloc_huge_auto && pages >= VMALLOC_HUGE_AUTO_PAGES);
+}
+
+/**
+ * @brief Allocate the backing pages for a huge vmalloc allocation
+ * We get as many PMD sized chunks as we can, and regular pages for the rest. The chunks aren't
+ * compound pages, so this is still a regular page list (that free_page_list and vmalloc_to_pages
+ * users can walk page by page).
+ *
+ * @param pages Number of pages
+ * @param gfp_flags GFP flags
+ * @param nr_huge Set to the number of chunks we got (they come first in the list)
+ * @return List of pages, or nullptr
+ */
+static struct page *vmalloc_alloc_huge_pages(size_t pages, unsigned int gfp_flags, size_t *nr_huge)
+{
+    struct page *head = nullptr, *tail = nullptr, *rest;
+    /* Don't try too hard, regular pages work just as well */
+    unsigned int huge_gfp = (gfp_flags & ~__GFP_DIRECT_RECLAIM) | __GFP_NOWARN;
+    size_t i;
+
+    for (i = 0; i + VMALLOC_HUGE_NR_PAGES <= pages; i += VMALLOC_HUGE_NR_PAGES)
+    {
+        struct page *chunk = alloc_pages(VMALLOC_HUGE_ORDER, huge_gfp);
+        if (!chunk)
+            break;
+
+        if (tail)
+            tail->next_un.next_allocation = chunk;
+        else
+            head = chunk;
+        tail = chunk + VMALLOC_HUGE_NR_PAGES - 1;
+    }
+
+    *nr_huge = i / VMALLOC_HUGE_NR_PAGES;
+    if (i == pages)
+        return head;
+
+    rest = alloc_page_list(pages - i, gfp_flags);
+    if (!rest)
+    {
+        if (head)
+            free_page_list(head);
+        return nullptr;
+    }
+
+    if (tail)
+        tail->next_un.next_allocation = rest;
+    else
+        head = rest;
+    return head;
+}
+
+/**
+ * @brief Allocates a range of virtual memory for kernel purposes.
+ * This memory is all prefaulted and cannot be demand paged nor paged out.
+ * Large allocations are mapped with huge pages when possible, see vmalloc_want_huge.
+ *
+ * @param pages The number of pages.
+ * @param type The type of allocation.
+ * @param perms The permissions on the allocation. VM_HUGEPAGE asks for huge pages (for
+ * allocations that would otherwise be too small to get them automatically), VM_NOHUGEPAGE
+ * disables them.
+ * @param gfp_flags GFP flags
+ * @param ip Call site, for allocation profiling
+ * @return A pointer to the new allocation, or NULL with errno set on failure.
+ */
+void *__vmalloc(size_t pages, int type, int perms, unsigned int gfp_flags, unsigned long ip)
+{
+    unsigned long alloc_off = 0, guard_pages = 0, start = 0, align = PAGE_SIZE;
+    size_t nr_huge = 0;
+    struct page *pgs;
+    alloc_tag_t tag;
+
+    if (vmalloc_want_huge(pages, type, perms))
+        pgs = vmalloc_alloc_huge_pages(pages, gfp_flags, &nr_huge);
+    else
+        pgs = alloc_page_list(pages, gfp_flags);
+    if (!pgs)
+        return errno = ENOMEM, nullptr;
+
+    perms &= ~(VM_HUGEPAGE | VM_NOHUGEPAGE);
+    if (nr_huge)
+        align = PMD_SIZE;
+
+    /* Add guard pages on both sides of the stack */
+    if (type == VM_TYPE_STACK)
+    {
+        guard_pages = 2;
+        alloc_off = PAGE_SIZE;
+    }
+
+    /* From here on, __vfree unaccounts the allocation */
+    tag = alloc_prof_account(ALLOC_PROF_VMALLOC, ip, pages << PAGE_SHIFT, 1);
+
+    if (pages + guard_pages <= VMAP_BLOCK_MAX_PAGES)
+        start =
+            vmap_block_alloc(pages + guard_pages, alloc_off >> PAGE_SHIFT, pgs, gfp_flags, tag);
+    if (!start)
+        start = vmalloc_tree_alloc(pages + guard_pages, align, perms, pgs, gfp_flags, tag);
+    if (!start)
+    {
+        alloc_prof_unaccount(tag, pages << PAGE_SHIFT, 1);
+        free_page_list(pgs);
+        return errno = ENOMEM, nullptr;
+    }
+
+    void *ptr = (void *) (start + alloc_off);
+
+#ifdef CONFIG_KASAN
+    if (kasan_alloc_shadow(start, (pages + guard_pages) << PAGE_SHIFT, true) < 0)
+    {
+        __vfree(ptr, VFREE_NO_SHADOW);
+        return errno = ENOMEM, nullptr;
+    }
+    if (guard_pages)
+    {
+        asan_poison_shadow(start, PAGE_SIZE, KASAN_LEFT_REDZONE);
+        asan_poison_shadow(start + ((pages + guard_pages) << PAGE_SHIFT) - PAGE_SIZE, PAGE_SIZE,
+                           KASAN_REDZONE);
+    }
+#endif
+
+    page *it = pgs;
+    for (size_t i = 0; i < pages;)
+    {
+        unsigned long addr = start + alloc_off + (i << PAGE_SHIFT);
+
+        /* If the architecture can't do it (or an old page table is in the way), just fall back
+         * to regular pages. */
+        if (i < nr_huge * VMALLOC_HUGE_NR_PAGES &&
+            !vm_map_huge_pmd_kernel(addr, (unsigned long) page_to_phys(it), perms))
+        {
+            it = (it + VMALLOC_HUGE_NR_PAGES - 1)->next_un.next_allocation;
+            i += VMALLOC_HUGE_NR_PAGES;
+            continue;
+        }
 
-    vm_mmu_unmap(&kernel_address_space, (void *) reg->addr, reg->pages, nullptr);
+        bool success = vm_map_page(&kernel_address_space, addr, (uint64_t) page_to_phys(it), perms,
+                                   nullptr) != nullptr;
+        if (!success)
+        {
+            __vfree(ptr, 0);
+            return errno = ENOMEM, nullptr;
+        }
 
-    // Remove the node from the tree
-    bst_delete(&vmalloc_tree.root, &reg->tree_node);
+        *(char *) addr = 0;
+        it = it->next_un.next_allocation;
+        i++;
+    }
 
-    // and delete it
-    pool.free(reg);
+    return ptr;
+}
+
+void *vmalloc(size_t pages, int type, int perms, unsigned int gfp_flags)
+{
+    return __vmalloc(pages, type, perms, gfp_flags, _RET_IP_);
 }
 
 /**
@@ -332,7 +806,7 @@ static void __vfree(void *ptr, bool is_mmiounmap)
  */
 void vfree(void *ptr)
 {
-    return __vfree(ptr, false);
+    return __vfree(ptr, 0);
 }
 
 /**
@@ -347,47 +821,26 @@ void vfree(void *ptr)
 void *mmiomap(void *phys, size_t size, size_t flags)
 {
     size_t pages = vm_size_to_pages(size);
-    auto reg = pool.allocate(GFP_KERNEL);
-    if (!reg)
+    unsigned long start =
+        vmalloc_tree_alloc(pages, PAGE_SIZE, flags, nullptr, GFP_KERNEL, ALLOC_TAG_NONE);
+    if (!start)
         return errno = ENOMEM, nullptr;
 
-    scoped_lock g{vmalloc_tree.lock};
-    auto start = vmalloc_allocate_base(&vmalloc_tree, 0, pages << PAGE_SHIFT);
-
-    if (start + (pages << PAGE_SHIFT) > vmalloc_tree.start + vmalloc_tree.length)
-    {
-        pool.free(reg);
-        return errno = ENOMEM, nullptr;
-    }
-
-    auto vmal_reg = vmalloc_insert_region(&vmalloc_tree, reg, start, pages, flags,
-                                          GFP_KERNEL | PAGE_ALLOC_NO_SANITIZER_SHADOW);
-    if (!vmal_reg)
-    {
-        pool.free(reg);
-        return errno = ENOMEM, nullptr;
-    }
-
-    auto delvmr = [vmal_reg]() {
-        bst_delete(&vmalloc_tree.root, &vmal_reg->tree_node);
-        pool.free(vmal_reg);
-    };
-
 #ifdef CONFIG_KASAN
-    if (kasan_alloc_shadow(vmal_reg->addr, pages << PAGE_SHIFT, true) < 0)
+    if (kasan_alloc_shadow(start, pages << PAGE_SHIFT, true) < 0)
     {
-        delvmr();
+        __vfree((void *) start, VFREE_MMIO | VFREE_NO_SHADOW);
         return errno = ENOMEM, nullptr;
     }
 #endif
     unsigned long u = ((unsigned long) phys) & ~(PAGE_SIZE - 1);
     unsigned long p_off = ((unsigned long) phys) & (PAGE_SIZE - 1);
 
-    void *p = map_pages_to_vaddr((void *) vmal_reg->addr, (void *) u, size, flags | VM_NOFLUSH);
+    void *p = map_pages_to_vaddr((void *) start, (void *) u, size, flags | VM_NOFLUSH);
     if (!p)
     {
         printf("map_pages_to_vaddr: Could not map pages\n");
-        delvmr();
+        __vfree((void *) start, VFREE_MMIO);
         return errno = ENOMEM, nullptr;
     }
 
@@ -402,7 +855,7 @@ void *mmiomap(void *phys, size_t size, size_t flags)
  */
 void mmiounmap(void *virt, size_t size)
 {
-    __vfree(virt, true);
+    __vfree(virt, VFREE_MMIO);
 }
 
 /**
@@ -414,11 +867,24 @@ void mmiounmap(void *virt, size_t size)
 void vmalloc_init(unsigned long start, unsigned long length)
 {
     bst_root_initialize(&vmalloc_tree.root);
-    vmalloc_tree.start = start;
-    vmalloc_tree.length = length;
+    /* vmap blocks get the start of the region, the tree gets the rest */
+    vmap_blocks.start = start;
+    spinlock_init(&vmap_blocks.lock);
+    vmalloc_tree.start = start + VMAP_BLOCK_AREA_SIZE;
+    vmalloc_tree.length = length - VMAP_BLOCK_AREA_SIZE;
     spinlock_init(&vmalloc_tree.lock);
+    INIT_LIST_HEAD(&vmalloc_tree.lazy_regions);
+    INIT_LIST_HEAD(&vmalloc_tree.lazy_blocks);
 }
 
+static void vmap_blocks_init()
+{
+    /* Per-cpu data is only usable from now on */
+    WRITE_ONCE(vmap_blocks.enabled, true);
+}
+
+INIT_LEVEL_EARLY_CORE_KERNEL_ENTRY(vmap_blocks_init);
+
 /**
  * @brief Get the backing pages behind a vmalloc region
  *
@@ -427,9 +893,20 @@ void vmalloc_init(unsigned long start, unsigned long length)
  */
 struct page *vmalloc_to_pages(void *ptr)
 {
+    unsigned long addr = (unsigned long) ptr & -PAGE_SIZE;
+    struct vmap_block *vb = vmap_block_lookup(addr);
+    if (vb)
+    {
+        scoped_lock g{vb->lock};
+        auto &alloc = vb->allocs[(addr - vb->addr) >> PAGE_SHIFT];
+        if (!alloc.pages)
+            panic("vfree: Bad pointer %p not mapped\n", ptr);
+        return alloc.backing_pgs;
+    }
+
     scoped_lock g{vmalloc_tree.lock};
     auto reg = vfind(ptr);
-    if (!reg)
+    if (!reg || reg->lazy)
         panic("vfree: Bad pointer %p not mapped\n", ptr);
 
     return reg->backing_pgs;
@@ -438,5 +915,5 @@ struct page *vmalloc_to_pages(void *ptr)
 bool is_vmalloc_addr(void *ptr)
 {
     unsigned long addr = (unsigned long) ptr;
-    return addr >= vmalloc_tree.start && addr < vmalloc_tree.start + vmalloc_tree.length;
+    return addr >= vmap_blocks.start && addr < vmalloc_tree.start + vmalloc_tree.length;
 }
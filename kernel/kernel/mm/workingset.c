@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <stdio.h>
+
+#include <onyx/cpu.h>
+#include <onyx/mm/numa.h>
+#include <onyx/mm/page_lru.h>
+#include <onyx/mm/page_node.h>
+#include <onyx/mm/page_zone.h>
+#include <onyx/mm/workingset.h>
+#include <onyx/page.h>
+#include <onyx/swap.h>
+#include <onyx/sysfs.h>
+#include <onyx/user.h>
+
+/* Shadow entry layout: | age | node | zone | 1 |. The low bit keeps the entry from ever being 0. */
+#define WORKINGSET_ZONE_BITS 1
+#define WORKINGSET_NODE_BITS 6
+#define WORKINGSET_NODE_SHIFT (1 + WORKINGSET_ZONE_BITS)
+#define WORKINGSET_AGE_SHIFT  (WORKINGSET_NODE_SHIFT + WORKINGSET_NODE_BITS)
+#define WORKINGSET_AGE_MASK   (-1UL >> WORKINGSET_AGE_SHIFT)
+
+#if NR_ZONES > (1 << WORKINGSET_ZONE_BITS) || MAX_NUMNODES > (1 << WORKINGSET_NODE_BITS)
+#error "Shadow entries don't have enough bits for every node and zone"
+#endif
+
+static struct
+{
+    unsigned long evictions;
+    unsigned long refaults;
+    unsigned long activations;
+} workingset_stats;
+
+static inline struct page_zone *lru_to_zone(struct page_lru *lru)
+{
+    return container_of(lru, struct page_zone, zone_lru);
+}
+
+unsigned long workingset_eviction(struct page *page)
+{
+    struct page_lru *lru = page_to_page_lru(page);
+    unsigned long nid = page_to_nid(page);
+    unsigned long zone = lru_to_zone(lru) - page_node_of(nid)->zones;
+    /* Ages (and workingset sizes) are in pages, large folios age the LRU by their size */
+    unsigned long nr = compound_nr(page);
+    unsigned long age = __atomic_fetch_add(&lru->nonresident_age, nr, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(&workingset_stats.evictions, nr, __ATOMIC_RELAXED);
+    return (age << WORKINGSET_AGE_SHIFT) | (nid << WORKINGSET_NODE_SHIFT) | (zone << 1) | 1;
+}
+
+static unsigned long zone_page_stat(struct page_zone *zone, enum page_stat stat)
+{
+    long val = 0;
+    for (unsigned int cpu = 0; cpu < get_nr_cpus(); cpu++)
+        val += READ_ONCE(zone->pcpu[cpu].pagestats[stat]);
+    /* Per-cpu counters can go negative for a bit */
+    return val > 0 ? val : 0;
+}
+
+static unsigned long lru_gen_workingset(struct page_lru *lru, int type)
+{
+    /* Everything but the oldest generation. Lockless, a rough number is good enough. */
+    unsigned long max_seq = READ_ONCE(lru->gen.max_seq);
+    unsigned long nr = 0;
+
+    for (unsigned long seq = READ_ONCE(lru->gen.min_seq[type]) + 1; seq <= max_seq; seq++)
+        nr += READ_ONCE(lru->gen.nr_pages[seq % LRU_GEN_NR][type]);
+    return nr;
+}
+
+static unsigned long workingset_size(struct page_lru *lru)
+{
+    /* Anon pages only compete with the page cache if they can be swapped out */
+    bool anon = swap_is_available();
+    struct page_zone *zone;
+    unsigned long nr;
+
+    if (READ_ONCE(lru->gen_enabled))
+    {
+        nr = lru_gen_workingset(lru, LRU_GEN_FILE);
+        if (anon)
+            nr += lru_gen_workingset(lru, LRU_GEN_ANON);
+        return nr;
+    }
+
+    zone = lru_to_zone(lru);
+    nr = zone_page_stat(zone, NR_ACTIVE_FILE);
+    if (anon)
+        nr += zone_page_stat(zone, NR_ACTIVE_ANON);
+    return nr;
+}
+
+void workingset_refault(struct page *page, unsigned long shadow)
+{
+    unsigned long eviction, distance, nid, zone;
+    struct page_lru *lru;
+
+    if (!shadow)
+        return;
+
+    zone = (shadow >> 1) & ((1UL << WORKINGSET_ZONE_BITS) - 1);
+    nid = (shadow >> WORKINGSET_NODE_SHIFT) & ((1UL << WORKINGSET_NODE_BITS) - 1);
+    eviction = shadow >> WORKINGSET_AGE_SHIFT;
+    if (zone >= NR_ZONES || !node_online(nid))
+        return;
+
+    /* Measure the distance on the LRU the page was evicted from, it might be coming back to
+     * another one */
+    lru = &page_node_of(nid)->zones[zone].zone_lru;
+    distance = (READ_ONCE(lru->nonresident_age) - eviction) & WORKINGSET_AGE_MASK;
+    __atomic_add_fetch(&workingset_stats.refaults, 1, __ATOMIC_RELAXED);
+
+    if (distance > workingset_size(lru))
+        return;
+
+    /* page_add_lru puts ACTIVE pages on the active list (or in the youngest generation) */
+    page_set_active(page);
+    __atomic_add_fetch(&lru->nonresident_age, compound_nr(page), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&workingset_stats.activations, compound_nr(page), __ATOMIC_RELAXED);
+}
+
+ssize_t workingset_stat_sysfs_read(void *buffer, size_t size, off_t off)
+{
+    char buf[128];
+    size_t len;
+
+    len = snprintf(buf, sizeof(buf), "evictions %lu\nrefaults %lu\nactivations %lu\n",
+                   READ_ONCE(workingset_stats.evictions), READ_ONCE(workingset_stats.refaults),
+                   READ_ONCE(workingset_stats.activations));
+    return sysfs_read_buf(buf, len, buffer, size, off);
+}
@@ -0,0 +1,342 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <onyx/cmdline.h>
+#include <onyx/copy.h>
+#include <onyx/init.h>
+#include <onyx/list.h>
+#include <onyx/mm/numa.h>
+#include <onyx/mm/zero_pool.h>
+#include <onyx/page.h>
+#include <onyx/scheduler.h>
+#include <onyx/spinlock.h>
+#include <onyx/sysfs.h>
+#include <onyx/user.h>
+#include <onyx/wait_queue.h>
+
+#include <uapi/memstat.h>
+
+#define ZERO_POOL_BATCH   32
+#define ZERO_POOL_MIN     64
+#define ZERO_POOL_MAX     4096
+/* Back off for a while if we couldn't get memory without hurting the rest of the system */
+#define ZERO_POOL_BACKOFF 1000
+
+/* One pool per node, so an allocation gets a page from the node it asked for */
+struct zero_pool
+{
+    struct spinlock lock;
+    struct list_head pages;
+    unsigned long nr_pages;
+    /* Stats */
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long zeroed;
+    unsigned long drained;
+};
+
+static struct zero_pool zero_pools[MAX_NUMNODES];
+
+/* Every node's pool gets refilled up to high once it goes below low. high == 0 disables the
+ * pools. */
+static unsigned long zero_pool_low;
+static unsigned long zero_pool_high;
+static bool zero_pool_refilling;
+static struct wait_queue zero_pool_wq;
+static thread_t *zero_pool_thread;
+
+/* -1 means "pick a default based on the memory size" */
+static long zero_pool_boot_high = -1;
+
+static void zero_pool_wake(void)
+{
+    if (!READ_ONCE(zero_pool_refilling) && zero_pool_thread)
+    {
+        WRITE_ONCE(zero_pool_refilling, true);
+        wait_queue_wake_all(&zero_pool_wq);
+    }
+}
+
+struct page *zero_pool_alloc(int nid)
+{
+    struct zero_pool *pool = &zero_pools[nid];
+    struct page *page = nullptr;
+    unsigned long flags;
+
+    if (!READ_ONCE(pool->nr_pages))
+    {
+        if (READ_ONCE(zero_pool_high))
+        {
+            __atomic_add_fetch(&pool->misses, 1, __ATOMIC_RELAXED);
+            zero_pool_wake();
+        }
+        return nullptr;
+    }
+
+    flags = spin_lock_irqsave(&pool->lock);
+    if (!list_is_empty(&pool->pages))
+    {
+        page = container_of(list_first_element(&pool->pages), struct page,
+                            page_allocator_node.list_node);
+        list_remove(&page->page_allocator_node.list_node);
+        pool->nr_pages--;
+        pool->hits++;
+    }
+    else
+        pool->misses++;
+
+    bool wake = pool->nr_pages < READ_ONCE(zero_pool_low);
+    spin_unlock_irqrestore(&pool->lock, flags);
+
+    if (wake)
+        zero_pool_wake();
+    return page;
+}
+
+static unsigned long zero_pool_drain_node(struct zero_pool *pool)
+{
+    DEFINE_LIST(pages)
+    unsigned long nr, flags;
+
+    if (!READ_ONCE(pool->nr_pages))
+        return 0;
+
+    flags = spin_lock_irqsave(&pool->lock);
+    list_move(&pages, &pool->pages);
+    nr = pool->nr_pages;
+    pool->nr_pages = 0;
+    pool->drained += nr;
+    spin_unlock_irqrestore(&pool->lock, flags);
+
+    list_for_every_safe (&pages)
+    {
+        struct page *page = container_of(l, struct page, page_allocator_node.list_node);
+        page->page_allocator_node.list_node.next = nullptr;
+        page->page_allocator_node.list_node.prev = nullptr;
+        free_page(page);
+    }
+
+    return nr;
+}
+
+unsigned long zero_pool_drain(void)
+{
+    unsigned long nr = 0;
+    int nid;
+
+    for_each_online_node(nid)
+        nr += zero_pool_drain_node(&zero_pools[nid]);
+    return nr;
+}
+
+static bool zero_pool_should_fill(struct zero_pool *pool)
+{
+    /* Don't take memory away from the system if it's already under pressure */
+    return READ_ONCE(pool->nr_pages) < READ_ONCE(zero_pool_high) &&
+           pages_under_high_watermark() == 0;
+}
+
+unsigned long zero_pool_fill(int nid, unsigned long nr)
+{
+    struct zero_pool *pool = &zero_pools[nid];
+    struct page *batch[ZERO_POOL_BATCH];
+    unsigned long added = 0;
+
+    while (added < nr && zero_pool_should_fill(pool))
+    {
+        unsigned int i, batch_nr = 0;
+        unsigned long flags;
+
+        for (i = 0; i < ZERO_POOL_BATCH && added + batch_nr < nr; i++)
+        {
+            /* No reclaim, no reserves. The pool is only worth it if memory is plentiful. */
+            struct page *page =
+                alloc_pages_node(nid, 0,
+                                 PAGE_ALLOC_NO_ZERO | __GFP_THISNODE | __GFP_NOWAIT |
+                                     __GFP_NOWARN | __GFP_NO_INSTRUMENT);
+            if (!page)
+                break;
+            set_non_temporal(PAGE_TO_VIRT(page), 0, PAGE_SIZE);
+            batch[batch_nr++] = page;
+        }
+
+        if (!batch_nr)
+            break;
+
+        flags = spin_lock_irqsave(&pool->lock);
+        for (i = 0; i < batch_nr; i++)
+            list_add_tail(&batch[i]->page_allocator_node.list_node, &pool->pages);
+        pool->nr_pages += batch_nr;
+        pool->zeroed += batch_nr;
+        spin_unlock_irqrestore(&pool->lock, flags);
+        added += batch_nr;
+
+        if (batch_nr < ZERO_POOL_BATCH)
+            break;
+    }
+
+    return added;
+}
+
+static void zero_pool_thread_fn(void *arg)
+{
+    for (;;)
+    {
+        wait_for_event(&zero_pool_wq, READ_ONCE(zero_pool_refilling));
+
+        unsigned long high = READ_ONCE(zero_pool_high);
+        bool backoff = false;
+        int nid;
+
+        for_each_online_node(nid)
+        {
+            unsigned long nr = READ_ONCE(zero_pools[nid].nr_pages);
+            unsigned long want = high > nr ? high - nr : 0;
+
+            if (want && zero_pool_fill(nid, want) < want)
+                backoff = true;
+        }
+
+        /* Either memory is getting tight or the pool shrunk under us. Don't spin. */
+        if (backoff)
+            sched_sleep_ms(ZERO_POOL_BACKOFF);
+
+        WRITE_ONCE(zero_pool_refilling, false);
+    }
+}
+
+static void zero_pool_set_high(unsigned long high)
+{
+    int nid;
+
+    WRITE_ONCE(zero_pool_high, high);
+    WRITE_ONCE(zero_pool_low, high / 2);
+    for_each_online_node(nid)
+    {
+        if (READ_ONCE(zero_pools[nid].nr_pages) > high)
+            zero_pool_drain_node(&zero_pools[nid]);
+    }
+
+    zero_pool_wake();
+}
+
+void zero_pool_get_stats(int nid, struct zero_pool_stats *st)
+{
+    struct zero_pool *pool = &zero_pools[nid];
+
+    st->nr_pages = READ_ONCE(pool->nr_pages);
+    st->hits = READ_ONCE(pool->hits);
+    st->misses = READ_ONCE(pool->misses);
+    st->zeroed = READ_ONCE(pool->zeroed);
+    st->drained = READ_ONCE(pool->drained);
+}
+
+struct page *zero_pool_peek(int nid)
+{
+    struct zero_pool *pool = &zero_pools[nid];
+    struct page *page = nullptr;
+    unsigned long flags;
+
+    flags = spin_lock_irqsave(&pool->lock);
+    if (!list_is_empty(&pool->pages))
+        page = container_of(list_first_element(&pool->pages), struct page,
+                            page_allocator_node.list_node);
+    spin_unlock_irqrestore(&pool->lock, flags);
+    return page;
+}
+
+static int zero_pool_param(const char *s)
+{
+    char *end;
+    unsigned long nr = strtoul(s, &end, 0);
+    if (*end != '\0')
+        return 0;
+    zero_pool_boot_high = nr;
+    return 1;
+}
+kernel_param("zero_pool_pages", zero_pool_param);
+
+static void zero_pool_init(void)
+{
+    struct memstat st;
+    unsigned long high;
+    int nid;
+
+    for (nid = 0; nid < MAX_NUMNODES; nid++)
+    {
+        spinlock_init(&zero_pools[nid].lock);
+        INIT_LIST_HEAD(&zero_pools[nid].pages);
+    }
+
+    init_wait_queue_head(&zero_pool_wq);
+
+    if (zero_pool_boot_high < 0)
+    {
+        /* 0.2% of memory (2MiB for 1GiB), capped to 16MiB, split between the nodes */
+        page_get_stats(&st);
+        high = st.total_pages / 512 / nr_numa_nodes;
+        high = high < ZERO_POOL_MIN ? ZERO_POOL_MIN : high;
+        high = high > ZERO_POOL_MAX ? ZERO_POOL_MAX : high;
+    }
+    else
+        high = zero_pool_boot_high;
+
+    zero_pool_thread = sched_create_thread(zero_pool_thread_fn, THREAD_KERNEL, nullptr);
+    CHECK(zero_pool_thread != nullptr);
+    /* We only want to run when there's nothing better to do */
+    zero_pool_thread->priority = SCHED_PRIO_VERY_LOW;
+    sched_start_thread(zero_pool_thread);
+
+    zero_pool_set_high(high);
+}
+
+INIT_LEVEL_CORE_AFTER_SCHED_ENTRY(zero_pool_init);
+
+ssize_t zero_pool_high_sysfs_read(void *buffer, size_t size, off_t off)
+{
+    return sysfs_read_ulong(READ_ONCE(zero_pool_high), buffer, size, off);
+}
+
+ssize_t zero_pool_high_sysfs_write(void *buffer, size_t size, off_t off)
+{
+    unsigned long nr;
+    int err = sysfs_parse_ulong(buffer, size, &nr);
+    if (err < 0)
+        return err;
+
+    zero_pool_set_high(nr);
+    return size;
+}
+
+ssize_t zero_pool_stat_sysfs_read(void *buffer, size_t size, off_t off)
+{
+    struct zero_pool_stats total = {}, st;
+    char buf[256];
+    int nid;
+
+    for_each_online_node(nid)
+    {
+        zero_pool_get_stats(nid, &st);
+        total.nr_pages += st.nr_pages;
+        total.hits += st.hits;
+        total.misses += st.misses;
+        total.zeroed += st.zeroed;
+        total.drained += st.drained;
+    }
+
+    /* low and high are per node */
+    size_t len = snprintf(buf, sizeof(buf),
+                          "pages %lu\nlow %lu\nhigh %lu\nhits %lu\nmisses %lu\nzeroed %lu\n"
+                          "drained %lu\n",
+                          total.nr_pages, READ_ONCE(zero_pool_low), READ_ONCE(zero_pool_high),
+                          total.hits, total.misses, total.zeroed, total.drained);
+    return sysfs_read_buf(buf, len, buffer, size, off);
+}
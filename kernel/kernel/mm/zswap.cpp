@@ -0,0 +1,517 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#define pr_fmt(fmt) "zswap: " fmt
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onyx/compression.h>
+#include <onyx/cpu.h>
+#include <onyx/init.h>
+#include <onyx/mm/slab.h>
+#include <onyx/mm/zswap.h>
+#include <onyx/mutex.h>
+#include <onyx/page.h>
+#include <onyx/percpu.h>
+#include <onyx/rcupdate.h>
+#include <onyx/ref.h>
+#include <onyx/swap.h>
+#include <onyx/sysfs.h>
+#include <onyx/user.h>
+#include <onyx/vm.h>
+
+#include <uapi/memstat.h>
+
+#define ZSWAP_COMPRESSOR "zstd"
+
+/* Pool objects come in ZSWAP_CLASS_SIZE increments. Pages that don't compress to at least 3/4 of
+ * their size aren't worth keeping in memory, and go straight to the swap device. */
+#define ZSWAP_CLASS_SIZE     (PAGE_SIZE / 16)
+#define ZSWAP_MAX_SIZE       (PAGE_SIZE * 3 / 4)
+#define ZSWAP_NR_POOL_CACHES (ZSWAP_MAX_SIZE / ZSWAP_CLASS_SIZE)
+
+struct zswap_entry
+{
+    refcount_t refs;
+    /* Compressed length, or 0 if the page is filled with value */
+    unsigned int length;
+    union {
+        void *data;
+        unsigned long value;
+    };
+    struct rcu_head rcu_head;
+};
+
+struct zswap_area
+{
+    /* Compressed copies, indexed by swap offset. Published once the area is set up. */
+    struct zswap_entry **entries;
+    unsigned long nr_slots;
+};
+
+struct zswap_pcpu
+{
+    /* Protects the context and buffer. Preemption stays enabled, so we may migrate while holding
+     * it, which is fine. */
+    struct mutex lock;
+    compression::context *ctx;
+    u8 *buffer;
+};
+
+static struct zswap_area zswap_areas[MAX_SWAP_AREAS];
+static struct slab_cache *zswap_entry_cache;
+static struct slab_cache *zswap_pool_caches[ZSWAP_NR_POOL_CACHES];
+static char zswap_pool_names[ZSWAP_NR_POOL_CACHES][16];
+static PER_CPU_VAR(struct zswap_pcpu zswap_pcpu);
+static unsigned long zswap_total_pages;
+static unsigned int zswap_max_pool_percent = 20;
+
+static struct zswap_stats
+{
+    unsigned long stored_pages;
+    unsigned long same_filled_pages;
+    /* Pool memory in use, and the compressed data it holds */
+    unsigned long pool_bytes;
+    unsigned long compressed_bytes;
+    unsigned long load_hits;
+    unsigned long load_misses;
+    unsigned long reject_poor_compression;
+    unsigned long reject_pool_full;
+    unsigned long reject_alloc_fail;
+} zswap_stats;
+
+#define zswap_stat_add(stat, val) __atomic_add_fetch(&zswap_stats.stat, (val), __ATOMIC_RELAXED)
+#define zswap_stat_sub(stat, val) __atomic_sub_fetch(&zswap_stats.stat, (val), __ATOMIC_RELAXED)
+
+static inline unsigned int zswap_class(size_t length)
+{
+    return (length - 1) / ZSWAP_CLASS_SIZE;
+}
+
+static inline size_t zswap_class_size(unsigned int cls)
+{
+    return (cls + 1) * ZSWAP_CLASS_SIZE;
+}
+
+static struct zswap_entry **zswap_slot(swp_entry_t swp)
+{
+    struct zswap_area *area = &zswap_areas[SWP_TYPE(swp)];
+    struct zswap_entry **entries = __atomic_load_n(&area->entries, __ATOMIC_ACQUIRE);
+
+    if (!entries || SWP_OFFSET(swp) >= area->nr_slots)
+        return nullptr;
+    return &entries[SWP_OFFSET(swp)];
+}
+
+static void zswap_entry_free_rcu(struct rcu_head *head)
+{
+    kmem_cache_free(zswap_entry_cache, container_of(head, struct zswap_entry, rcu_head));
+}
+
+static void zswap_entry_put(struct zswap_entry *entry)
+{
+    if (!refcount_dec_and_test(&entry->refs))
+        return;
+
+    if (entry->length)
+    {
+        unsigned int cls = zswap_class(entry->length);
+        kmem_cache_free(zswap_pool_caches[cls], entry->data);
+        zswap_stat_sub(pool_bytes, zswap_class_size(cls));
+        zswap_stat_sub(compressed_bytes, entry->length);
+    }
+    else
+        zswap_stat_sub(same_filled_pages, 1);
+
+    zswap_stat_sub(stored_pages, 1);
+    /* zswap_load may still be looking at the entry, under RCU */
+    call_rcu(&entry->rcu_head, zswap_entry_free_rcu);
+}
+
+static bool zswap_same_filled(const unsigned long *ptr, unsigned long *value)
+{
+    for (unsigned long i = 1; i < PAGE_SIZE / sizeof(unsigned long); i++)
+    {
+        if (ptr[i] != ptr[0])
+            return false;
+    }
+
+    *value = ptr[0];
+    return true;
+}
+
+static bool zswap_pool_full(void)
+{
+    unsigned long limit = zswap_total_pages * READ_ONCE(zswap_max_pool_percent) / 100;
+    return READ_ONCE(zswap_stats.pool_bytes) >= limit << PAGE_SHIFT;
+}
+
+static int zswap_compress(struct page *page, struct zswap_entry *entry)
+{
+    struct zswap_pcpu *pcpu;
+    unsigned int cls;
+    void *data;
+    int err = 0;
+
+    if (zswap_pool_full())
+    {
+        zswap_stat_add(reject_pool_full, 1);
+        return -ENOSPC;
+    }
+
+    pcpu = get_per_cpu_ptr(zswap_pcpu);
+    mutex_lock(&pcpu->lock);
+    if (!pcpu->ctx)
+    {
+        err = -ENODEV;
+        goto out;
+    }
+
+    {
+        auto ex = pcpu->ctx->compress(
+            pcpu->buffer, ZSWAP_MAX_SIZE,
+            cul::slice<unsigned char>{(unsigned char *) PAGE_TO_VIRT(page), PAGE_SIZE});
+        if (ex.has_error())
+        {
+            err = ex.error();
+            if (err == -ENOSPC)
+                zswap_stat_add(reject_poor_compression, 1);
+            goto out;
+        }
+
+        entry->length = ex.value();
+    }
+
+    /* We're called from reclaim, so don't try to reclaim memory for the pool */
+    cls = zswap_class(entry->length);
+    data = kmem_cache_alloc(zswap_pool_caches[cls], GFP_NOWAIT);
+    if (!data)
+    {
+        zswap_stat_add(reject_alloc_fail, 1);
+        err = -ENOMEM;
+        goto out;
+    }
+
+    memcpy(data, pcpu->buffer, entry->length);
+    entry->data = data;
+    zswap_stat_add(pool_bytes, zswap_class_size(cls));
+    zswap_stat_add(compressed_bytes, entry->length);
+out:
+    mutex_unlock(&pcpu->lock);
+    return err;
+}
+
+/**
+ * @brief Store a swap cache page in zswap
+ *
+ * @param page Page to store (locked, in the swap cache)
+ * @return 0 on success (the page need not be written out), negative error codes
+ */
+int zswap_store(struct page *page)
+{
+    swp_entry_t swp = swpval_to_swp_entry(page->priv);
+    struct zswap_entry **slot = zswap_slot(swp);
+    struct zswap_entry *entry;
+    int err;
+
+    DCHECK_PAGE(page_locked(page), page);
+    if (!slot)
+        return -ENODEV;
+
+    /* The slot may hold an older copy of the page, if it was dirtied after being swapped in. Drop
+     * it first, so loads can't find stale contents if we fail to store this one. Stores to a slot
+     * are serialized by the swap cache page's lock. */
+    entry = __atomic_exchange_n(slot, nullptr, __ATOMIC_ACQ_REL);
+    if (entry)
+        zswap_entry_put(entry);
+
+    if (!READ_ONCE(zswap_max_pool_percent))
+        return -ENODEV;
+
+    entry = (struct zswap_entry *) kmem_cache_alloc(zswap_entry_cache, GFP_NOWAIT);
+    if (!entry)
+    {
+        zswap_stat_add(reject_alloc_fail, 1);
+        return -ENOMEM;
+    }
+
+    entry->refs = REFCOUNT_INIT(1);
+    if (zswap_same_filled((const unsigned long *) PAGE_TO_VIRT(page), &entry->value))
+    {
+        entry->length = 0;
+        zswap_stat_add(same_filled_pages, 1);
+    }
+    else
+    {
+        err = zswap_compress(page, entry);
+        if (err < 0)
+        {
+            kmem_cache_free(zswap_entry_cache, entry);
+            return err;
+        }
+    }
+
+    zswap_stat_add(stored_pages, 1);
+    __atomic_store_n(slot, entry, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int zswap_decompress(struct zswap_entry *entry, struct page *page)
+{
+    struct zswap_pcpu *pcpu = get_per_cpu_ptr(zswap_pcpu);
+    int err = 0;
+
+    mutex_lock(&pcpu->lock);
+    auto ex = pcpu->ctx->decompress(PAGE_TO_VIRT(page), PAGE_SIZE,
+                                    cul::slice<unsigned char>{(unsigned char *) entry->data,
+                                                              entry->length});
+    if (ex.has_error())
+        err = ex.error();
+    else if (ex.value() != PAGE_SIZE)
+        err = -EIO;
+    mutex_unlock(&pcpu->lock);
+    return err;
+}
+
+/**
+ * @brief Load a page from zswap
+ *
+ * @param page Page to fill (locked)
+ * @param swp Swap entry to load
+ * @return 0 if the page was filled in, -ENOENT if zswap doesn't have it, negative error codes
+ */
+int zswap_load(struct page *page, swp_entry_t swp)
+{
+    struct zswap_entry **slot = zswap_slot(swp);
+    struct zswap_entry *entry;
+    int err = 0;
+
+    if (!slot)
+        return -ENOENT;
+
+    rcu_read_lock();
+    entry = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (entry && !refcount_inc_not_zero(&entry->refs))
+        entry = nullptr;
+    rcu_read_unlock();
+
+    if (!entry)
+    {
+        zswap_stat_add(load_misses, 1);
+        return -ENOENT;
+    }
+
+    if (entry->length)
+        err = zswap_decompress(entry, page);
+    else
+    {
+        unsigned long *ptr = (unsigned long *) PAGE_TO_VIRT(page);
+        for (unsigned long i = 0; i < PAGE_SIZE / sizeof(unsigned long); i++)
+            ptr[i] = entry->value;
+    }
+
+    if (err < 0)
+        pr_err("Failed to decompress swap entry %016lx: %d\n", swp.swp, err);
+    else
+        zswap_stat_add(load_hits, 1);
+    zswap_entry_put(entry);
+    return err;
+}
+
+/**
+ * @brief Drop a swap slot's compressed copy
+ * Called when the slot is freed. Does not sleep.
+ *
+ * @param swp Swap entry
+ */
+void zswap_invalidate(swp_entry_t swp)
+{
+    struct zswap_entry **slot = zswap_slot(swp);
+    struct zswap_entry *entry;
+
+    if (!slot)
+        return;
+    entry = __atomic_exchange_n(slot, nullptr, __ATOMIC_ACQ_REL);
+    if (entry)
+        zswap_entry_put(entry);
+}
+
+/**
+ * @brief Set up zswap for a new swap area
+ *
+ * @param type Swap area index
+ * @param nr_slots Number of slots (including the header) in the swap area
+ */
+void zswap_swapon(unsigned int type, unsigned long nr_slots)
+{
+    struct zswap_area *area = &zswap_areas[type];
+    struct zswap_entry **entries;
+
+    if (!zswap_entry_cache)
+        return;
+
+    /* Until this is published, pages swapped out to the area just go to the device */
+    entries = (struct zswap_entry **) vmalloc(
+        vm_size_to_pages(nr_slots * sizeof(struct zswap_entry *)), VM_TYPE_REGULAR,
+        VM_READ | VM_WRITE, GFP_KERNEL);
+    if (!entries)
+    {
+        pr_warn("Failed to allocate the slot map for swap area %u, not using zswap for it\n",
+                type);
+        return;
+    }
+
+    area->nr_slots = nr_slots;
+    __atomic_store_n(&area->entries, entries, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Tear down zswap for a swap area that is going away
+ * Called once every slot in the area has been freed, and no one can look at the area anymore.
+ *
+ * @param type Swap area index
+ */
+void zswap_swapoff(unsigned int type)
+{
+    struct zswap_area *area = &zswap_areas[type];
+    struct zswap_entry **entries;
+
+    entries = __atomic_exchange_n(&area->entries, nullptr, __ATOMIC_ACQ_REL);
+    if (!entries)
+        return;
+
+    /* Freeing the slots should have dropped every entry already */
+    for (unsigned long i = 0; i < area->nr_slots; i++)
+    {
+        if (WARN_ON_ONCE(entries[i]))
+            zswap_entry_put(entries[i]);
+    }
+
+    area->nr_slots = 0;
+    vfree(entries);
+}
+
+static int zswap_pcpu_init(struct zswap_pcpu *pcpu, compression::module *mod)
+{
+    mutex_init(&pcpu->lock);
+    pcpu->buffer = (u8 *) kmalloc(ZSWAP_MAX_SIZE, GFP_KERNEL);
+    if (!pcpu->buffer)
+        return -ENOMEM;
+
+    auto ex = mod->create_context(PAGE_SIZE);
+    if (ex.has_error())
+    {
+        kfree(pcpu->buffer);
+        pcpu->buffer = nullptr;
+        return ex.error();
+    }
+
+    pcpu->ctx = ex.value().release();
+    return 0;
+}
+
+static void zswap_pcpu_destroy(struct zswap_pcpu *pcpu)
+{
+    delete pcpu->ctx;
+    kfree(pcpu->buffer);
+    pcpu->ctx = nullptr;
+    pcpu->buffer = nullptr;
+}
+
+static void zswap_init(void)
+{
+    compression::module *mod = compression::find_module(ZSWAP_COMPRESSOR);
+    struct memstat st;
+    int err;
+
+    if (!mod)
+    {
+        pr_warn("Compressor %s not found, zswap disabled\n", ZSWAP_COMPRESSOR);
+        return;
+    }
+
+    for (unsigned int cpu = 0; cpu < get_nr_cpus(); cpu++)
+    {
+        err = zswap_pcpu_init(other_cpu_get_ptr(zswap_pcpu, cpu), mod);
+        if (err < 0)
+        {
+            pr_err("Failed to set up %s contexts: %d, zswap disabled\n", ZSWAP_COMPRESSOR, err);
+            while (cpu-- > 0)
+                zswap_pcpu_destroy(other_cpu_get_ptr(zswap_pcpu, cpu));
+            return;
+        }
+    }
+
+    for (unsigned int i = 0; i < ZSWAP_NR_POOL_CACHES; i++)
+    {
+        snprintf(zswap_pool_names[i], sizeof(zswap_pool_names[i]), "zswap-%zu",
+                 zswap_class_size(i));
+        zswap_pool_caches[i] =
+            kmem_cache_create(zswap_pool_names[i], zswap_class_size(i), 0, 0, nullptr);
+        CHECK(zswap_pool_caches[i] != nullptr);
+    }
+
+    page_get_stats(&st);
+    zswap_total_pages = st.total_pages;
+
+    /* Entries are freed through call_rcu, so we don't need TYPESAFE_BY_RCU */
+    zswap_entry_cache = kmem_cache_create("zswap_entry", sizeof(struct zswap_entry), 0,
+                                          KMEM_CACHE_PANIC, nullptr);
+}
+
+INIT_LEVEL_CORE_AFTER_SCHED_ENTRY(zswap_init);
+
+ssize_t zswap_max_pool_percent_sysfs_read(void *buffer, size_t size, off_t off)
+{
+    char buf[32];
+    size_t len = snprintf(buf, sizeof(buf), "%u\n", READ_ONCE(zswap_max_pool_percent));
+    return sysfs_read_buf(buf, len, buffer, size, off);
+}
+
+ssize_t zswap_max_pool_percent_sysfs_write(void *buffer, size_t size, off_t off)
+{
+    unsigned long val;
+    int err = sysfs_parse_ulong(buffer, size, &val);
+    if (err < 0)
+        return err;
+    if (val > 100)
+        return -EINVAL;
+
+    /* Shrinking the limit doesn't evict anything, it just stops new stores until we're under it */
+    WRITE_ONCE(zswap_max_pool_percent, (unsigned int) val);
+    return size;
+}
+
+ssize_t zswap_stat_sysfs_read(void *buffer, size_t size, off_t off)
+{
+    char buf[512];
+    unsigned long stored = READ_ONCE(zswap_stats.stored_pages);
+    unsigned long same_filled = READ_ONCE(zswap_stats.same_filled_pages);
+    unsigned long compressed = READ_ONCE(zswap_stats.compressed_bytes);
+    unsigned long hits = READ_ONCE(zswap_stats.load_hits);
+    unsigned long misses = READ_ONCE(zswap_stats.load_misses);
+    /* Ratios are in hundredths. Same-filled pages don't count towards the compression ratio. */
+    unsigned long ratio = 0, hit_rate = 0;
+
+    if (compressed && stored > same_filled)
+        ratio = (stored - same_filled) * PAGE_SIZE * 100 / compressed;
+    if (hits + misses)
+        hit_rate = hits * 10000 / (hits + misses);
+
+    size_t len = snprintf(
+        buf, sizeof(buf),
+        "stored_pages %lu\nsame_filled_pages %lu\npool_bytes %lu\ncompressed_bytes %lu\n"
+        "compression_ratio %lu.%02lu\nload_hits %lu\nload_misses %lu\nhit_rate %lu.%02lu%%\n"
+        "reject_poor_compression %lu\nreject_pool_full %lu\nreject_alloc_fail %lu\n",
+        stored, same_filled, READ_ONCE(zswap_stats.pool_bytes), compressed, ratio / 100,
+        ratio % 100, hits, misses, hit_rate / 100, hit_rate % 100,
+        READ_ONCE(zswap_stats.reject_poor_compression), READ_ONCE(zswap_stats.reject_pool_full),
+        READ_ONCE(zswap_stats.reject_alloc_fail));
+    return sysfs_read_buf(buf, len, buffer, size, off);
+}
@@ -13,151 +13,279 @@
 
 #include <onyx/clock.h>
 #include <onyx/compiler.h>
+#include <onyx/crypt/chacha20.h>
+#include <onyx/crypt/sha256.h>
 #include <onyx/dev.h>
+#include <onyx/irq.h>
+#include <onyx/percpu.h>
 #include <onyx/process.h>
 #include <onyx/random.h>
+#include <onyx/spinlock.h>
 #include <onyx/timer.h>
+#include <onyx/vdso.h>
 
 #include <drivers/rtc.h>
 #include <uapi/errno.h>
+#include <uapi/random.h>
 
-const size_t max_entropy = PAGE_SIZE * 4;
-static char entropy_buffer[PAGE_SIZE * 4] = {};
-struct mutex entropy_lock;
-static size_t current_entropy = 0;
+/*
+ * Design: Everything fed through add_entropy() gets hashed into a small input pool. A base CRNG
+ * key is extracted from the pool (plus fresh platform randomness) every CRNG_RESEED_INTERVAL.
+ * Each CPU derives its own ChaCha20 key from the base key whenever the base generation changes,
+ * and generates output with fast key erasure: the first half of every first block replaces the
+ * per-cpu key, so compromising a CPU's state does not reveal previous output. Bulk output is then
+ * generated from a ChaCha20 state on the stack, with no locks held.
+ */
+
+#define CRNG_RESEED_INTERVAL (60 * NS_PER_SEC)
+
+static struct spinlock input_pool_lock;
+static u8 input_pool[SHA256_DIGEST_SIZE];
+
+static struct
+{
+    u8 key[CHACHA20_KEY_SIZE];
+    /* 0 means not seeded yet */
+    unsigned long generation;
+    hrtime_t birth;
+    struct spinlock lock;
+} base_crng;
+
+struct crng
+{
+    u8 key[CHACHA20_KEY_SIZE];
+    unsigned long generation;
+};
+
+static PER_CPU_VAR(struct crng crngs);
 
 void add_entropy(void *ent, size_t size)
 {
-    scoped_mutex g{entropy_lock};
-    if (current_entropy == max_entropy || current_entropy + size > max_entropy)
-    {
-    }
-    else
-    {
-        memcpy(&entropy_buffer[current_entropy], ent, size);
-        current_entropy += size;
-    }
+    struct sha256_state md;
+
+    sha256_init(&md);
+    unsigned long flags = spin_lock_irqsave(&input_pool_lock);
+    sha256_process(&md, input_pool, sizeof(input_pool));
+    sha256_process(&md, (const unsigned char *) ent, size);
+    sha256_done(&md, input_pool);
+    spin_unlock_irqrestore(&input_pool_lock, flags);
+    explicit_bzero(&md, sizeof(md));
 }
 
-void entropy_refill()
+/**
+ * @brief Generate a block from key, then overwrite key with the first half of it
+ * Leaves the ChaCha20 state (which still has the old key) in state, ready for bulk output.
+ *
+ * @param key Key to use and erase
+ * @param state ChaCha20 state
+ * @param out Output buffer for the second half of the block
+ * @param len Length of out, up to CHACHA20_BLOCK_SIZE - CHACHA20_KEY_SIZE
+ */
+static void crng_fast_key_erasure(u8 *key, u32 state[CHACHA20_STATE_WORDS], u8 *out, size_t len)
 {
-    unsigned int *buf = (unsigned int *) entropy_buffer;
-    size_t nr_refills = max_entropy / sizeof(unsigned int);
-    for (size_t i = 0; i < nr_refills; i++)
-    {
-        *buf++ =
-            clock_get_posix_time() << 28 | ((entropy::platform::get_hwrandom() << 20) ^ rand());
-    }
+    u8 first_block[CHACHA20_BLOCK_SIZE];
+
+    DCHECK(len <= CHACHA20_BLOCK_SIZE - CHACHA20_KEY_SIZE);
+    chacha20_init(state, key, 0);
+    chacha20_block(state, first_block);
 
-    current_entropy = max_entropy;
+    memcpy(key, first_block, CHACHA20_KEY_SIZE);
+    memcpy(out, first_block + CHACHA20_KEY_SIZE, len);
+    explicit_bzero(first_block, sizeof(first_block));
 }
 
-extern "C" void get_entropy(char *buf, size_t s)
+static void crng_reseed()
 {
-    scoped_mutex g{entropy_lock};
-
-    for (size_t i = 0; i < s; i++)
+    struct sha256_state md;
+    u32 state[CHACHA20_STATE_WORDS];
+    u8 seed[SHA256_DIGEST_SIZE];
+    u8 key[CHACHA20_KEY_SIZE];
+
+    /* Extract a seed from the input pool and fresh platform randomness, then use it to derive
+     * both the next pool and the new base key, so neither can be computed from the other. */
+    sha256_init(&md);
+    unsigned long flags = spin_lock_irqsave(&input_pool_lock);
+    sha256_process(&md, input_pool, sizeof(input_pool));
+    for (int i = 0; i < 4; i++)
     {
-        if (current_entropy == 0)
-            entropy_refill();
-        *buf++ = entropy_buffer[0];
-        current_entropy--;
-        memmove(entropy_buffer, &entropy_buffer[1], current_entropy);
+        unsigned long hw = entropy::platform::get_hwrandom();
+        sha256_process(&md, (const unsigned char *) &hw, sizeof(hw));
     }
+
+    hrtime_t now = clocksource_get_time();
+    sha256_process(&md, (const unsigned char *) &now, sizeof(now));
+    sha256_done(&md, seed);
+    crng_fast_key_erasure(seed, state, key, sizeof(key));
+    memcpy(input_pool, seed, sizeof(input_pool));
+    spin_unlock_irqrestore(&input_pool_lock, flags);
+
+    flags = spin_lock_irqsave(&base_crng.lock);
+    memcpy(base_crng.key, key, sizeof(key));
+    /* Skip 0, that's reserved for "unseeded" (and for fresh per-cpu crngs) */
+    if (++base_crng.generation == 0)
+        base_crng.generation = 1;
+    WRITE_ONCE(base_crng.birth, now);
+    unsigned long generation = base_crng.generation;
+    spin_unlock_irqrestore(&base_crng.lock, flags);
+
+    /* Tell vgetrandom users to rekey */
+    vdso_update_rng_generation(generation);
+
+    explicit_bzero(&md, sizeof(md));
+    explicit_bzero(state, sizeof(state));
+    explicit_bzero(seed, sizeof(seed));
+    explicit_bzero(key, sizeof(key));
 }
 
-size_t ent_read(size_t off, size_t count, void *buffer, struct file *node)
+unsigned long crng_get_generation()
 {
-    get_entropy((char *) buffer, count);
-    return count;
+    return READ_ONCE(base_crng.generation);
 }
 
-void initialize_entropy(void)
+static bool crng_needs_reseed()
 {
-    entropy::platform::init_random();
-    /* Use get_posix_time as entropy, together with the platform's seed */
-    uint64_t p = get_posix_time_early();
-    add_entropy(&p, sizeof(uint64_t));
-    auto seed = entropy::platform::get_seed();
-    add_entropy(&seed, sizeof(uint64_t));
-    srand((unsigned int) (seed | ~p));
-    for (size_t i = current_entropy; i < max_entropy; i += sizeof(int))
-    {
-        int r = rand();
-        add_entropy(&r, sizeof(int));
-    }
+    if (READ_ONCE(base_crng.generation) == 0)
+        return true;
+    return clocksource_get_time() - READ_ONCE(base_crng.birth) > CRNG_RESEED_INTERVAL;
 }
 
-size_t random_get_entropy(size_t size, void *buffer)
+/**
+ * @brief Set up a ChaCha20 state for output, from this CPU's crng
+ *
+ * @param state State to fill
+ * @param out Buffer that gets the first len bytes of output
+ * @param len Length, up to CHACHA20_BLOCK_SIZE - CHACHA20_KEY_SIZE
+ */
+static void crng_make_state(u32 state[CHACHA20_STATE_WORDS], u8 *out, size_t len)
 {
-    unsigned char *buf = (unsigned char *) buffer;
-    size_t to_read = size;
-    while (to_read)
-    {
-        if (signal_is_pending())
-            return -ERESTARTSYS;
-
-        if (current_entropy)
-        {
-            size_t r = current_entropy > to_read ? to_read : current_entropy;
+    if (unlikely(crng_needs_reseed()))
+        crng_reseed();
 
-            if (copy_to_user(buf, entropy_buffer, r) < 0)
-                return -EFAULT;
+    /* Disable irqs, as we can be called from interrupt context (e.g networking) */
+    unsigned long flags = irq_save_and_disable();
+    struct crng *crng = get_per_cpu_ptr(crngs);
 
-            buf += r;
-            to_read -= r;
-        }
+    if (unlikely(crng->generation != READ_ONCE(base_crng.generation)))
+    {
+        spin_lock(&base_crng.lock);
+        crng_fast_key_erasure(base_crng.key, state, crng->key, sizeof(crng->key));
+        crng->generation = base_crng.generation;
+        spin_unlock(&base_crng.lock);
     }
-    return size;
+
+    crng_fast_key_erasure(crng->key, state, out, len);
+    irq_restore(flags);
 }
 
-size_t urandom_get_entropy(size_t size, void *buffer)
+/**
+ * @brief Fill a kernel buffer with random bytes
+ *
+ * @param buf Buffer
+ * @param len Length of the buffer
+ */
+void get_random_bytes(void *buf, size_t len)
 {
-    unsigned char *buf = (unsigned char *) buffer;
-    size_t to_read = size;
-    while (to_read)
-    {
-        if (signal_is_pending())
-            return -ERESTARTSYS;
-        if (current_entropy)
-        {
-            size_t r = current_entropy > to_read ? to_read : current_entropy;
+    u32 state[CHACHA20_STATE_WORDS];
+    u8 block[CHACHA20_BLOCK_SIZE];
+    u8 *ptr = (u8 *) buf;
+    size_t first = cul::min(len, (size_t) (CHACHA20_BLOCK_SIZE - CHACHA20_KEY_SIZE));
 
-            if (copy_to_user(buf, entropy_buffer, r) < 0)
-                return -EFAULT;
+    crng_make_state(state, ptr, first);
+    ptr += first;
+    len -= first;
 
-            buf += r;
-            to_read -= r;
-        }
-        else
-        {
-            entropy_refill();
-        }
+    while (len >= CHACHA20_BLOCK_SIZE)
+    {
+        chacha20_block(state, ptr);
+        ptr += CHACHA20_BLOCK_SIZE;
+        len -= CHACHA20_BLOCK_SIZE;
     }
-    return size;
+
+    if (len)
+    {
+        chacha20_block(state, block);
+        memcpy(ptr, block, len);
+        explicit_bzero(block, sizeof(block));
+    }
+
+    explicit_bzero(state, sizeof(state));
 }
 
-size_t get_entropy_from_pool(int pool, size_t size, void *buffer)
+extern "C" void get_entropy(char *buf, size_t s)
 {
-    assert(pool == ENTROPY_POOL_RANDOM || pool == ENTROPY_POOL_URANDOM);
-    size_t ret = (size_t) -EINVAL;
+    get_random_bytes(buf, s);
+}
+
+/**
+ * @brief Fill a user buffer with random bytes
+ *
+ * @param ubuf User buffer
+ * @param len Length of the buffer
+ * @return Number of bytes copied, or negative error code
+ */
+static ssize_t get_random_bytes_user(void *ubuf, size_t len)
+{
+    u32 state[CHACHA20_STATE_WORDS];
+    u8 block[CHACHA20_BLOCK_SIZE];
+    u8 *ptr = (u8 *) ubuf;
+    ssize_t copied = 0;
+
+    if (len == 0)
+        return 0;
 
-    scoped_mutex g{entropy_lock};
+    crng_make_state(state, nullptr, 0);
 
-    switch (pool)
+    while (len)
     {
-        case ENTROPY_POOL_RANDOM: {
-            ret = random_get_entropy(size, buffer);
+        size_t to_copy = cul::min(len, (size_t) CHACHA20_BLOCK_SIZE);
+
+        /* Check for signals every page's worth of output. Large reads can get interrupted, in
+         * which case we return what we have. */
+        if (copied && !(copied & (PAGE_SIZE - 1)) && signal_is_pending())
             break;
-        }
 
-        case ENTROPY_POOL_URANDOM: {
-            ret = urandom_get_entropy(size, buffer);
+        chacha20_block(state, block);
+        if (copy_to_user(ptr, block, to_copy) < 0)
+        {
+            if (!copied)
+                copied = -EFAULT;
             break;
         }
+
+        ptr += to_copy;
+        len -= to_copy;
+        copied += to_copy;
     }
 
-    return ret;
+    explicit_bzero(block, sizeof(block));
+    explicit_bzero(state, sizeof(state));
+    return copied;
+}
+
+size_t ent_read(size_t off, size_t count, void *buffer, struct file *node)
+{
+    get_random_bytes(buffer, count);
+    return count;
+}
+
+void initialize_entropy(void)
+{
+    entropy::platform::init_random();
+    /* Use get_posix_time as entropy, together with the platform's seed */
+    uint64_t p = get_posix_time_early();
+    add_entropy(&p, sizeof(uint64_t));
+    auto seed = entropy::platform::get_seed();
+    add_entropy(&seed, sizeof(uint64_t));
+    srand((unsigned int) (seed | ~p));
+
+    crng_reseed();
+}
+
+size_t get_entropy_from_pool(int pool, size_t size, void *buffer)
+{
+    assert(pool == ENTROPY_POOL_RANDOM || pool == ENTROPY_POOL_URANDOM);
+    /* Both pools are served by the CRNG. /dev/random no longer blocks. */
+    return get_random_bytes_user(buffer, size);
 }
 
 size_t random_read(size_t offset, size_t sizeofreading, void *buffer, struct file *f)
@@ -219,12 +347,14 @@ void entropy_init_dev()
 
 unsigned int get_random_int()
 {
-    auto num = entropy::platform::get_hwrandom();
-
-    return (unsigned int) num ^ (num >> 32);
+    unsigned int num;
+    get_random_bytes(&num, sizeof(num));
+    return num;
 }
 
 int sys_getrandom(void *buf, size_t buflen, unsigned int flags)
 {
-    return (int) get_entropy_from_pool(ENTROPY_POOL_URANDOM, buflen, buf);
+    if (flags & ~(GRND_NONBLOCK | GRND_RANDOM | GRND_INSECURE))
+        return -EINVAL;
+    return (int) get_random_bytes_user(buf, buflen);
 }
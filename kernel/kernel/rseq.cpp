@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <errno.h>
+#include <stddef.h>
+
+#include <onyx/registers.h>
+#include <onyx/rseq.h>
+#include <onyx/scheduler.h>
+#include <onyx/signal.h>
+#include <onyx/smp.h>
+#include <onyx/vm.h>
+
+#include <uapi/clone.h>
+#include <uapi/rseq.h>
+
+/**
+ * @brief Abort the critical section we interrupted, if any
+ *
+ * @param thread Current thread
+ * @param regs User registers
+ * @return 0 on success, negative error codes (the caller SIGSEGVs)
+ */
+static int rseq_ip_fixup(struct thread *thread, struct registers *regs)
+{
+    struct rseq *rseq = thread->rseq;
+    struct rseq_cs cs;
+    unsigned long ip = instruction_pointer(regs);
+    u64 ucs;
+    u32 sig;
+
+    if (copy_from_user(&ucs, &rseq->rseq_cs, sizeof(ucs)) < 0)
+        return -EFAULT;
+
+    if (!ucs)
+        return 0;
+
+    if (copy_from_user(&cs, (void *) ucs, sizeof(cs)) < 0)
+        return -EFAULT;
+
+    if (cs.version != 0 || cs.start_ip >= VM_USER_ADDR_LIMIT ||
+        cs.start_ip + cs.post_commit_offset < cs.start_ip ||
+        cs.start_ip + cs.post_commit_offset > VM_USER_ADDR_LIMIT ||
+        cs.abort_ip >= VM_USER_ADDR_LIMIT)
+        return -EINVAL;
+
+    /* The abort handler can't be inside the critical section itself */
+    if (cs.abort_ip - cs.start_ip < cs.post_commit_offset)
+        return -EINVAL;
+
+    /* Userspace leaves rseq_cs set after the commit, so clear it lazily here. We always need to
+     * clear it, since we're either outside the critical section or aborting out of it. */
+    u64 zero = 0;
+    if (copy_to_user(&rseq->rseq_cs, &zero, sizeof(zero)) < 0)
+        return -EFAULT;
+
+    if (ip - cs.start_ip >= cs.post_commit_offset)
+        return 0;
+
+    /* The abort handler must be preceded by the signature the thread registered with. This stops
+     * attackers from redirecting execution to arbitrary code. */
+    if (copy_from_user(&sig, (void *) (cs.abort_ip - sizeof(u32)), sizeof(sig)) < 0)
+        return -EFAULT;
+
+    if (sig != thread->rseq_sig)
+        return -EPERM;
+
+    instruction_pointer_set(regs, cs.abort_ip);
+    return 0;
+}
+
+static int rseq_update_cpu_id(struct thread *thread)
+{
+    struct rseq *rseq = thread->rseq;
+    u32 cpu = get_cpu_nr();
+
+    if (copy_to_user(&rseq->cpu_id_start, &cpu, sizeof(cpu)) < 0)
+        return -EFAULT;
+    if (copy_to_user(&rseq->cpu_id, &cpu, sizeof(cpu)) < 0)
+        return -EFAULT;
+    return 0;
+}
+
+void rseq_handle_notify_resume(struct registers *regs)
+{
+    struct thread *thread = get_current_thread();
+
+    if (in_kernel_space_regs(regs))
+        return;
+
+    /* We may get preempted (and thus re-notified) while touching user memory. Loop until things
+     * settle down, so we never return to userspace with a stale cpu_id. */
+    while (rseq_notify_pending(thread))
+    {
+        __atomic_and_fetch(&thread->flags, ~THREAD_RSEQ_NOTIFY, __ATOMIC_RELAXED);
+
+        if (!thread->rseq)
+            return;
+
+        if (rseq_ip_fixup(thread, regs) < 0 || rseq_update_cpu_id(thread) < 0)
+        {
+            force_sigsegv(SIGSEGV);
+            return;
+        }
+    }
+}
+
+void rseq_fork(struct thread *child, struct thread *parent, unsigned long clone_flags)
+{
+    if (clone_flags & CLONE_VM)
+    {
+        child->rseq = nullptr;
+        child->rseq_len = 0;
+        child->rseq_sig = 0;
+        return;
+    }
+
+    child->rseq = parent->rseq;
+    child->rseq_len = parent->rseq_len;
+    child->rseq_sig = parent->rseq_sig;
+    rseq_set_notify_resume(child);
+}
+
+void rseq_execve(struct thread *thread)
+{
+    thread->rseq = nullptr;
+    thread->rseq_len = 0;
+    thread->rseq_sig = 0;
+    __atomic_and_fetch(&thread->flags, ~THREAD_RSEQ_NOTIFY, __ATOMIC_RELAXED);
+}
+
+static int rseq_unregister(struct thread *thread, struct rseq *rseq, u32 rseq_len, u32 sig)
+{
+    u32 cpu_id = RSEQ_CPU_ID_UNINITIALIZED;
+
+    if (thread->rseq != rseq || thread->rseq_len != rseq_len)
+        return -EINVAL;
+    if (thread->rseq_sig != sig)
+        return -EPERM;
+
+    if (copy_to_user(&rseq->cpu_id, &cpu_id, sizeof(cpu_id)) < 0)
+        return -EFAULT;
+
+    rseq_execve(thread);
+    return 0;
+}
+
+int sys_rseq(struct rseq *rseq, u32 rseq_len, int flags, u32 sig)
+{
+    struct thread *thread = get_current_thread();
+
+    if (flags & RSEQ_FLAG_UNREGISTER)
+    {
+        if (flags & ~RSEQ_FLAG_UNREGISTER)
+            return -EINVAL;
+        return rseq_unregister(thread, rseq, rseq_len, sig);
+    }
+
+    if (flags)
+        return -EINVAL;
+
+    if (thread->rseq)
+    {
+        /* Re-registration of the same area is -EBUSY, as long as the signature matches */
+        if (thread->rseq != rseq || thread->rseq_len != rseq_len)
+            return -EINVAL;
+        if (thread->rseq_sig != sig)
+            return -EPERM;
+        return -EBUSY;
+    }
+
+    if (rseq_len < RSEQ_ORIG_SIZE || (unsigned long) rseq & (alignof(struct rseq) - 1))
+        return -EINVAL;
+
+    if ((unsigned long) rseq >= VM_USER_ADDR_LIMIT ||
+        (unsigned long) rseq + rseq_len > VM_USER_ADDR_LIMIT)
+        return -EFAULT;
+
+    thread->rseq = rseq;
+    thread->rseq_len = rseq_len;
+    thread->rseq_sig = sig;
+
+    /* Fill in cpu_id on our way out */
+    rseq_set_notify_resume(thread);
+    return 0;
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <errno.h>
+
+#include <onyx/atomic.h>
+#include <onyx/cpumask.h>
+#include <onyx/mm_address_space.h>
+#include <onyx/process.h>
+#include <onyx/smp.h>
+
+#include <uapi/membarrier.h>
+
+#define MEMBARRIER_SUPPORTED_CMDS \
+    (MEMBARRIER_CMD_PRIVATE_EXPEDITED | MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED)
+
+static void membarrier_ipi(void *ctx)
+{
+    /* Any CPU that takes this IPI while running our mm is now ordered with respect to the
+     * caller. The interrupt itself is serializing, but be explicit about it. */
+    smp_mb();
+}
+
+/**
+ * @brief Issue a memory barrier on every CPU currently running threads of the current mm
+ * Only the CPUs in the mm's active_mask get IPI'd. CPUs that are not in the mask either do not
+ * run our threads, or will switch to them through vm_load_aspace, which sets the active_mask
+ * using an atomic RMW (a full barrier) before returning to userspace.
+ *
+ * @return 0 on success, negative error codes
+ */
+static int membarrier_private_expedited()
+{
+    struct mm_address_space *mm = get_current_address_space();
+
+    if (!(READ_ONCE(mm->membarrier_state) & MEMBARRIER_STATE_PRIVATE_EXPEDITED))
+        return -EPERM;
+
+    /* Order the caller's previous memory accesses with our read of the active_mask */
+    smp_mb();
+
+    if (smp::get_online_cpus() > 1)
+    {
+        cpumask mask;
+        memcpy(&mask, &mm->active_mask, sizeof(mask));
+        mask.remove_cpu(get_cpu_nr());
+        /* sync_call waits for every target CPU to run the callback */
+        if (!mask.is_empty())
+            smp::sync_call(membarrier_ipi, nullptr, mask);
+    }
+
+    /* ...and order the IPIs with the caller's subsequent memory accesses. */
+    smp_mb();
+    return 0;
+}
+
+static int membarrier_register_private_expedited()
+{
+    struct mm_address_space *mm = get_current_address_space();
+    __atomic_or_fetch(&mm->membarrier_state, MEMBARRIER_STATE_PRIVATE_EXPEDITED, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int sys_membarrier(int cmd, unsigned int flags, int cpu_id)
+{
+    if (flags != 0)
+        return -EINVAL;
+
+    switch (cmd)
+    {
+        case MEMBARRIER_CMD_QUERY:
+            return MEMBARRIER_SUPPORTED_CMDS;
+        case MEMBARRIER_CMD_PRIVATE_EXPEDITED:
+            return membarrier_private_expedited();
+        case MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED:
+            return membarrier_register_private_expedited();
+        default:
+            return -EINVAL;
+    }
+}
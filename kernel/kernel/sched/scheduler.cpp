@@ -27,12 +27,15 @@
 #include <onyx/gen/trace_sched.h>
 #include <onyx/irq.h>
 #include <onyx/kcov.h>
+#include <onyx/mm/asid.h>
 #include <onyx/mm/kasan.h>
+#include <onyx/mm/numa.h>
 #include <onyx/panic.h>
 #include <onyx/percpu.h>
 #include <onyx/perf_probe.h>
 #include <onyx/process.h>
 #include <onyx/rcupdate.h>
+#include <onyx/rseq.h>
 #include <onyx/rwlock.h>
 #include <onyx/semaphore.h>
 #include <onyx/softirq.h>
@@ -419,6 +422,10 @@ void sched_load_thread(struct thread *prev, thread *thread, unsigned int cpu)
 
     errno = thread->errno_val;
 
+    /* We may have preempted (or migrated) a restartable sequence, let it know */
+    if (thread != prev)
+        rseq_set_notify_resume(thread);
+
     native::arch_load_thread(thread, cpu);
 
     if (thread->owner)
@@ -436,7 +443,9 @@ void sched_load_thread(struct thread *prev, thread *thread, unsigned int cpu)
     }
     else
     {
-        /* Skip switching mm's by keeping this one active */
+        /* Skip switching mm's by keeping this one active. We won't touch user memory, so
+         * shootdowns can leave us alone until we switch back to a user thread. */
+        asid_enter_lazy();
         if (thread != prev)
         {
             CHECK(thread->active_mm == NULL);
@@ -1350,3 +1359,16 @@ int sys_sched_getaffinity(pid_t pid, size_t cpusetsize, void *cpu_set)
 
     return 0;
 }
+
+int sys_getcpu(unsigned int *ucpu, unsigned int *unode, void *tcache)
+{
+    /* The result may be stale by the time we return, that's inherent to getcpu */
+    unsigned int cpu = get_cpu_nr();
+    unsigned int node = cpu_to_node(cpu);
+
+    if (ucpu && copy_to_user(ucpu, &cpu, sizeof(cpu)) < 0)
+        return -EFAULT;
+    if (unode && copy_to_user(unode, &node, sizeof(node)) < 0)
+        return -EFAULT;
+    return 0;
+}
@@ -17,6 +17,7 @@
 #include <onyx/date.h>
 #include <onyx/kunit.h>
 #include <onyx/process.h>
+#include <onyx/seqcount.h>
 #include <onyx/timer.h>
 #include <onyx/vdso.h>
 #include <onyx/vm.h>
@@ -27,6 +28,12 @@ struct clocksource *main_clock;
 #define NR_CLOCKS CLOCK_TAI
 static struct clock_time clocks[NR_CLOCKS];
 
+/* CLOCK_*_COARSE resolution. The coarse clocks are sampled this often, and never read the
+ * clocksource on the read side. */
+#define CLOCK_COARSE_TICK_NS (4 * NS_PER_MS)
+static seqcount_t coarse_seq;
+static struct clockevent coarse_tick_ev;
+
 void register_wallclock_source(struct wallclock_source *clk)
 {
     assert(clk->get_posix_time != NULL);
@@ -65,6 +72,33 @@ static void sample_wallclock()
     time_set(CLOCK_REALTIME, &ts);
 }
 
+static void clock_coarse_tick(struct clockevent *ev)
+{
+    struct timespec realtime, monotonic;
+
+    clock_gettime_kernel(CLOCK_REALTIME, &realtime);
+    clock_gettime_kernel(CLOCK_MONOTONIC, &monotonic);
+
+    write_seqcount_begin(&coarse_seq);
+    clocks[CLOCK_REALTIME_COARSE].time = realtime;
+    clocks[CLOCK_MONOTONIC_COARSE].time = monotonic;
+    write_seqcount_end(&coarse_seq);
+
+    vdso_update_coarse_time(&realtime, &monotonic);
+    ev->deadline = clocksource_get_time() + CLOCK_COARSE_TICK_NS;
+}
+
+static void clock_coarse_init()
+{
+    if (coarse_tick_ev.callback)
+        return;
+
+    coarse_tick_ev.callback = clock_coarse_tick;
+    coarse_tick_ev.flags = CLOCKEVENT_FLAG_ATOMIC | CLOCKEVENT_FLAG_PULSE;
+    clock_coarse_tick(&coarse_tick_ev);
+    timer_queue_clockevent(&coarse_tick_ev);
+}
+
 void register_clock_source(struct clocksource *clk)
 {
     if (main_clock)
@@ -94,6 +128,7 @@ void register_clock_source(struct clocksource *clk)
     if (main_clock == clk)
     {
         sample_wallclock();
+        clock_coarse_init();
     }
 }
 
@@ -155,6 +190,17 @@ int clock_gettime_kernel(clockid_t clk_id, struct timespec *tp)
             break;
         }
 
+        case CLOCK_REALTIME_COARSE:
+        case CLOCK_MONOTONIC_COARSE: {
+            unsigned int seq;
+            do
+            {
+                seq = read_seqcount_begin(&coarse_seq);
+                *tp = clk->time;
+            } while (read_seqcount_retry(&coarse_seq, seq));
+            break;
+        }
+
         case CLOCK_PROCESS_CPUTIME_ID: {
             struct process *p = get_current_process();
             hrtime_t utime, stime;
@@ -244,13 +290,16 @@ extern "C" int sys_clock_settime(clockid_t clk_id, struct timespec *utp)
 
 extern "C" int sys_clock_getres(clockid_t clk_id, struct timespec *utp)
 {
-    /* XXX this is not super correct, and doesn't work with future work on COARSE timers */
+    /* XXX this is not super correct */
     struct timespec tp = {.tv_sec = 0, .tv_nsec = 1};
 
     /* Filter out bad clocks */
     if (clk_id >= NR_CLOCKS || clk_id < 0)
         return -EINVAL;
 
+    if (clk_id == CLOCK_REALTIME_COARSE || clk_id == CLOCK_MONOTONIC_COARSE)
+        tp.tv_nsec = CLOCK_COARSE_TICK_NS;
+
     if (copy_to_user(utp, &tp, sizeof(tp)) < 0)
         return -EFAULT;
     return 0;
@@ -20,11 +20,13 @@
 #include <onyx/log.h>
 #include <onyx/mm/vm_object.h>
 #include <onyx/panic.h>
+#include <onyx/random.h>
 #include <onyx/vdso.h>
 #include <onyx/vfs.h>
 #include <onyx/vm.h>
 
 #ifdef __x86_64__
+#include <onyx/cpu.h>
 #include <onyx/x86/tsc.h>
 #endif
 
@@ -49,6 +51,8 @@ private:
     bool vdso_setup;
     clock_time *clock_monotonic;
     clock_time *clock_realtime;
+    vdso_coarse_time *coarse_time{nullptr};
+    vdso_rng_data *rng_data{nullptr};
     unsigned long vdso_base;
     Elf64_Sym *vdso_symtab{nullptr};
     size_t nr_sym{0};
@@ -122,6 +126,8 @@ public:
     }
 
     int update_time(clockid_t id, struct clock_time *time);
+    void update_coarse_time(const struct timespec *realtime, const struct timespec *monotonic);
+    void update_rng_generation(unsigned long generation);
 
     void *map();
 };
@@ -170,17 +176,30 @@ __attribute__((no_sanitize_undefined)) bool vdso::init()
     auto time = lookup_symbol<vdso_time *>("__time");
     /* Configure the vdso with tsc stuff */
     tsc_setup_vdso(time);
+
+    if (x86_has_cap(X86_FEATURE_RDPID))
+        time->getcpu_mode = VDSO_GETCPU_RDPID;
+    else if (x86_has_cap(X86_FEATURE_RDTSCP))
+        time->getcpu_mode = VDSO_GETCPU_RDTSCP;
+    else
+        time->getcpu_mode = VDSO_GETCPU_SYSCALL;
 #endif
 
     clock_monotonic = lookup_symbol<clock_time *>("clock_monotonic");
     clock_realtime = lookup_symbol<clock_time *>("clock_realtime");
-
-    /* Update the vdso for the first time */
-    main_vdso.update_time(CLOCK_MONOTONIC, get_raw_clock_time(CLOCK_MONOTONIC));
-    main_vdso.update_time(CLOCK_REALTIME, get_raw_clock_time(CLOCK_REALTIME));
+    coarse_time = lookup_symbol<vdso_coarse_time *>("__coarse_time");
+    rng_data = lookup_symbol<vdso_rng_data *>("__rng_data");
 
     vdso_setup = true;
 
+    /* Update the vdso for the first time. CLOCK_MONOTONIC is anchored at the current clocksource
+     * time, so the vdso agrees with clock_gettime(2). */
+    struct clock_time mono;
+    hrtime_to_timespec(clocksource_get_time(), &mono.time);
+    main_vdso.update_time(CLOCK_MONOTONIC, &mono);
+    main_vdso.update_time(CLOCK_REALTIME, get_raw_clock_time(CLOCK_REALTIME));
+    update_rng_generation(crng_get_generation());
+
     return true;
 }
 
@@ -226,6 +245,39 @@ int vdso::update_time(clockid_t id, struct clock_time *time)
     return 0;
 }
 
+void vdso::update_coarse_time(const struct timespec *realtime, const struct timespec *monotonic)
+{
+    if (!vdso_setup || !coarse_time)
+        return;
+
+    /* Userspace can't spin on a lock, so publish the pair under a seqcount. Readers retry if they
+     * see an odd or changed count. */
+    WRITE_ONCE(coarse_time->seq, coarse_time->seq + 1);
+    smp_wmb();
+    coarse_time->realtime = *realtime;
+    coarse_time->monotonic = *monotonic;
+    __atomic_store_n(&coarse_time->seq, coarse_time->seq + 1, __ATOMIC_RELEASE);
+}
+
+void vdso::update_rng_generation(unsigned long generation)
+{
+    if (!vdso_setup || !rng_data || !generation)
+        return;
+
+    WRITE_ONCE(rng_data->generation, generation);
+    WRITE_ONCE(rng_data->is_ready, true);
+}
+
+void vdso_update_coarse_time(const struct timespec *realtime, const struct timespec *monotonic)
+{
+    main_vdso.update_coarse_time(realtime, monotonic);
+}
+
+void vdso_update_rng_generation(unsigned long generation)
+{
+    main_vdso.update_rng_generation(generation);
+}
+
 int vdso_update_time(clockid_t id, clock_time *time)
 {
     return main_vdso.update_time(id, time);
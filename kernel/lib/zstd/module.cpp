@@ -11,8 +11,12 @@
 
 #include <onyx/compiler.h>
 #include <onyx/compression.h>
+#include <onyx/page.h>
 #include <onyx/panic.h>
+#include <onyx/vm.h>
 
+/* For the static (preallocated) contexts */
+#define ZSTD_STATIC_LINKING_ONLY
 #include "zstd/lib/zstd.h"
 #include "zstd/lib/zstd_errors.h"
 
@@ -62,6 +66,83 @@ public:
     }
 };
 
+/* Contexts are used for small buffers (e.g swap pages), where speed matters more than the ratio */
+#define ZSTD_CONTEXT_LEVEL 1
+
+class zstd_context : public compression::context
+{
+    void* cworkspace{nullptr};
+    void* dworkspace{nullptr};
+    ZSTD_CCtx* cctx{nullptr};
+    ZSTD_DCtx* dctx{nullptr};
+
+    static void* alloc_workspace(size_t size)
+    {
+        return vmalloc(vm_size_to_pages(size), VM_TYPE_REGULAR, VM_READ | VM_WRITE, GFP_KERNEL);
+    }
+
+public:
+    ~zstd_context() override
+    {
+        if (cworkspace)
+            vfree(cworkspace);
+        if (dworkspace)
+            vfree(dworkspace);
+    }
+
+    bool init(size_t max_src_size)
+    {
+        /* Size the compression workspace for the parameters zstd picks for max_src_size buffers.
+         * Smaller buffers get smaller windows and tables, so they always fit. */
+        auto cparams = ZSTD_getCParams(ZSTD_CONTEXT_LEVEL, max_src_size, 0);
+        auto csize = ZSTD_estimateCCtxSize_usingCParams(cparams);
+        auto dsize = ZSTD_estimateDCtxSize();
+
+        cworkspace = alloc_workspace(csize);
+        dworkspace = alloc_workspace(dsize);
+        if (!cworkspace || !dworkspace)
+            return false;
+
+        cctx = ZSTD_initStaticCCtx(cworkspace, csize);
+        dctx = ZSTD_initStaticDCtx(dworkspace, dsize);
+        if (!cctx || !dctx)
+            return false;
+
+        return !ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+                                                    ZSTD_CONTEXT_LEVEL));
+    }
+
+    expected<size_t, int> compress(void* dst, size_t dst_capacity,
+                                   cul::slice<unsigned char> src) final
+    {
+        auto size = ZSTD_compress2(cctx, dst, dst_capacity, src.data(), src.size_bytes());
+        if (ZSTD_isError(size))
+        {
+            if (ZSTD_getErrorCode(size) == ZSTD_error_dstSize_tooSmall)
+                return unexpected<int>{-ENOSPC};
+            printk("zstd: Error compressing buffer: %s\n", ZSTD_getErrorName(size));
+            return unexpected<int>{-EINVAL};
+        }
+
+        return size;
+    }
+
+    expected<size_t, int> decompress(void* dst, size_t dst_capacity,
+                                     cul::slice<unsigned char> src) final
+    {
+        auto size = ZSTD_decompressDCtx(dctx, dst, dst_capacity, src.data(), src.size_bytes());
+        if (ZSTD_isError(size))
+        {
+            if (ZSTD_getErrorCode(size) == ZSTD_error_dstSize_tooSmall)
+                return unexpected<int>{-ENOSPC};
+            printk("zstd: Error decompressing buffer: %s\n", ZSTD_getErrorName(size));
+            return unexpected<int>{-EINVAL};
+        }
+
+        return size;
+    }
+};
+
 class zstd_module : public compression::module
 {
 public:
@@ -114,6 +195,16 @@ public:
             return unexpected<int>{-ENOMEM};
         return str.cast<compression::decompression_stream>();
     }
+
+    expected<unique_ptr<compression::context>, int> create_context(size_t max_src_size) override
+    {
+        auto ctx = make_unique<zstd_context>();
+        if (!ctx)
+            return unexpected<int>{-ENOMEM};
+        if (!ctx->init(max_src_size))
+            return unexpected<int>{-ENOMEM};
+        return ctx.cast<compression::context>();
+    }
 };
 
 zstd_module zstd{};
@@ -17,6 +17,7 @@ void show_help(int flag)
     int ret = flag == '?';
 
     printf("Usage:\n   swapon [options] [SWAPFILE]\nOptions:\n"
+           "   -p/--priority PRIO        set the swap area's priority (0 - 32767)\n"
            "   -h/--help                 print help and exit\n"
            "   -v/--version              print version and exit\n");
     exit(ret);
@@ -30,6 +31,7 @@ void show_version()
 
 const struct option long_options[] = {
     {"help", 0, NULL, 'h'},
+    {"priority", 1, NULL, 'p'},
     {"version", 0, NULL, 'v'},
     {},
 };
@@ -37,9 +39,12 @@ const struct option long_options[] = {
 int main(int argc, char **argv)
 {
     int indexptr = 0;
+    int flags = 0;
+    char *end;
+    long prio;
     char flag;
 
-    while ((flag = getopt_long(argc, argv, "vh", long_options, &indexptr)) != -1)
+    while ((flag = getopt_long(argc, argv, "vhp:", long_options, &indexptr)) != -1)
     {
         switch (flag)
         {
@@ -50,13 +55,19 @@ int main(int argc, char **argv)
             case 'v':
                 show_version();
                 break;
+            case 'p':
+                prio = strtol(optarg, &end, 0);
+                if (*end || prio < 0 || prio > SWAP_FLAG_PRIO_MASK)
+                    errx(1, "invalid priority %s", optarg);
+                flags = SWAP_FLAG_PREFER | ((prio << SWAP_FLAG_PRIO_SHIFT) & SWAP_FLAG_PRIO_MASK);
+                break;
         }
     }
 
     if (optind == argc)
         show_help('?');
 
-    if (swapon(argv[optind], 0) < 0)
+    if (swapon(argv[optind], flags) < 0)
         err(1, "swapon");
     return 0;
 }
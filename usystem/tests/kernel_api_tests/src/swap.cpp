@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/swap.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <gtest/gtest.h>
+#include <uapi/swap.h>
+
+TEST(Swap, SwaponSwapoffRequireRoot)
+{
+    pid_t pid = fork();
+    ASSERT_NE(pid, -1);
+
+    if (pid == 0)
+    {
+        if (getuid() == 0 && setuid(65534) < 0)
+            _exit(2);
+
+        /* The permission check comes before anything else, so the path doesn't matter */
+        bool ok = swapon("/dev/null", 0) < 0 && errno == EPERM;
+        ok = ok && swapoff("/dev/null") < 0 && errno == EPERM;
+        _exit(ok ? 0 : 1);
+    }
+
+    int wstatus;
+    ASSERT_EQ(waitpid(pid, &wstatus, 0), pid);
+    ASSERT_TRUE(WIFEXITED(wstatus));
+    EXPECT_EQ(WEXITSTATUS(wstatus), 0);
+}
+
+/* Priority of the swap area at path, from /proc/swaps. Returns false if it isn't swapped on. */
+static bool swap_prio(const std::string &path, int *prio)
+{
+    char line[512];
+    char name[256];
+    bool found = false;
+    FILE *f = fopen("/proc/swaps", "r");
+    if (!f)
+        return false;
+
+    /* Skip the header */
+    if (!fgets(line, sizeof(line), f))
+        goto out;
+
+    while (fgets(line, sizeof(line), f))
+    {
+        if (sscanf(line, "%255s %*s %*s %*s %d", name, prio) == 2 && path == name)
+        {
+            found = true;
+            break;
+        }
+    }
+
+out:
+    fclose(f);
+    return found;
+}
+
+static void mkswap(const std::string &path)
+{
+    struct swap_super super = {};
+    unsigned long long size;
+    int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    ASSERT_NE(fd, -1);
+    ASSERT_EQ(ioctl(fd, BLKGETSIZE64, &size), 0);
+
+    super.swp_magic = SWAP_MAGIC;
+    super.swp_version = SWAP_VERSION_CURRENT;
+    super.swp_pagesize = sysconf(_SC_PAGESIZE);
+    super.swp_nr_pages = size / super.swp_pagesize;
+    ASSERT_EQ(pwrite(fd, &super, sizeof(super), 0), (ssize_t) sizeof(super));
+    close(fd);
+}
+
+TEST(Swap, PrioritiesAndSwapoff)
+{
+    /* Needs two spare block devices (given by absolute path), which get overwritten */
+    const char *devs = getenv("ONYX_SWAP_TEST_DEVS");
+    if (getuid() != 0 || !devs || !strchr(devs, ','))
+        GTEST_SKIP() << "set ONYX_SWAP_TEST_DEVS=<dev>,<dev> to spare block devices";
+
+    std::string a{devs, strchr(devs, ',')};
+    std::string b{strchr(devs, ',') + 1};
+    int prio_a, prio_b, prio;
+
+    mkswap(a);
+    mkswap(b);
+
+    /* Areas without SWAP_FLAG_PREFER get decreasing, negative priorities */
+    ASSERT_EQ(swapon(a.c_str(), 0), 0);
+    ASSERT_EQ(swapon(b.c_str(), 0), 0);
+    ASSERT_TRUE(swap_prio(a, &prio_a));
+    ASSERT_TRUE(swap_prio(b, &prio_b));
+    EXPECT_LT(prio_a, 0);
+    EXPECT_LT(prio_b, prio_a);
+
+    /* Taking the lowest area off gives its priority back */
+    ASSERT_EQ(swapoff(b.c_str()), 0);
+    EXPECT_FALSE(swap_prio(b, &prio));
+    ASSERT_EQ(swapon(b.c_str(), 0), 0);
+    ASSERT_TRUE(swap_prio(b, &prio));
+    EXPECT_EQ(prio, prio_b);
+
+    /* Areas below a removed one move up */
+    ASSERT_EQ(swapoff(a.c_str()), 0);
+    ASSERT_TRUE(swap_prio(b, &prio));
+    EXPECT_EQ(prio, prio_a);
+
+    /* Explicit priorities are kept as-is */
+    ASSERT_EQ(swapon(a.c_str(), SWAP_FLAG_PREFER | (10 << SWAP_FLAG_PRIO_SHIFT)), 0);
+    ASSERT_TRUE(swap_prio(a, &prio));
+    EXPECT_EQ(prio, 10);
+
+    ASSERT_EQ(swapoff(a.c_str()), 0);
+    ASSERT_EQ(swapoff(b.c_str()), 0);
+
+    /* Not a swap area (anymore) */
+    EXPECT_EQ(swapoff(a.c_str()), -1);
+    EXPECT_EQ(errno, EINVAL);
+}
@@ -12,10 +12,14 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/syscall.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include <cstdio>
 #include <cstring>
+#include <atomic>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <gtest/gtest.h>
@@ -812,3 +816,209 @@ TEST(Vm, SubpageInodeSizeStraddling)
 
     munmap(ptr, page_size);
 }
+
+/* Map a 2MiB aligned, 2MiB long anon region. Returns nullptr on failure. */
+static unsigned char* thp_map_aligned()
+{
+    const size_t huge_size = 0x200000;
+    void* ptr = mmap(nullptr, huge_size * 2, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (ptr == MAP_FAILED)
+        return nullptr;
+
+    unsigned long start = ((unsigned long) ptr + huge_size - 1) & -huge_size;
+    /* Trim the excess on both sides */
+    if (start != (unsigned long) ptr)
+        munmap(ptr, start - (unsigned long) ptr);
+    munmap((void*) (start + huge_size), (unsigned long) ptr + huge_size - start);
+    madvise((void*) start, huge_size, MADV_HUGEPAGE);
+    return (unsigned char*) start;
+}
+
+TEST(Vm, ThpSplitKeepsData)
+{
+    const size_t huge_size = 0x200000;
+    unsigned char* ptr = thp_map_aligned();
+    ASSERT_NE(ptr, nullptr);
+
+    for (size_t i = 0; i < huge_size; i += page_size)
+        ptr[i] = (unsigned char) (i / page_size);
+
+    uint64_t pmp;
+    ASSERT_NE(mpagemap(ptr, page_size, &pmp), -1);
+    if (!(pmp & PAGE_HUGE))
+    {
+        munmap(ptr, huge_size);
+        GTEST_SKIP() << "THP not available";
+    }
+
+    /* Both of these need to split the huge pmd */
+    ASSERT_EQ(mprotect(ptr + page_size, page_size, PROT_READ), 0);
+    ASSERT_EQ(munmap(ptr + page_size * 2, page_size), 0);
+
+    ASSERT_NE(mpagemap(ptr, page_size, &pmp), -1);
+    EXPECT_FALSE(pmp & PAGE_HUGE);
+    ASSERT_NE(mpagemap(ptr + page_size, page_size, &pmp), -1);
+    EXPECT_EQ(pmp & (PAGE_PRESENT | PAGE_WRITABLE), PAGE_PRESENT);
+
+    for (size_t i = 0; i < huge_size; i += page_size)
+    {
+        if (i == page_size * 2)
+            continue;
+        EXPECT_EQ(ptr[i], (unsigned char) (i / page_size));
+    }
+
+    munmap(ptr, huge_size);
+}
+
+TEST(Vm, ThpForkCow)
+{
+    const size_t huge_size = 0x200000;
+    unsigned char* ptr = thp_map_aligned();
+    ASSERT_NE(ptr, nullptr);
+
+    memset(ptr, 0xaa, huge_size);
+
+    pid_t pid = fork();
+    ASSERT_NE(pid, -1);
+
+    if (pid == 0)
+    {
+        /* CoW the whole thing in the child, and check the parent's copy did not change */
+        int bad = 0;
+        for (size_t i = 0; i < huge_size; i += page_size)
+        {
+            if (ptr[i] != 0xaa)
+                bad = 1;
+            ptr[i] = 0x55;
+        }
+        _exit(bad);
+    }
+
+    int wstatus;
+    ASSERT_EQ(waitpid(pid, &wstatus, 0), pid);
+    ASSERT_TRUE(WIFEXITED(wstatus));
+    EXPECT_EQ(WEXITSTATUS(wstatus), 0);
+
+    for (size_t i = 0; i < huge_size; i += page_size)
+        EXPECT_EQ(ptr[i], 0xaa);
+
+    munmap(ptr, huge_size);
+}
+
+static unsigned long hugetlb_free_pages()
+{
+    unsigned long nr = 0;
+    FILE* f = fopen("/sys/vm/free_hugepages", "r");
+    if (!f)
+        return 0;
+    if (fscanf(f, "%lu", &nr) != 1)
+        nr = 0;
+    fclose(f);
+    return nr;
+}
+
+TEST(Vm, MmapHugetlbWorks)
+{
+    const size_t huge_size = 0x200000;
+    if (hugetlb_free_pages() < 2)
+        GTEST_SKIP() << "hugetlb pool is empty";
+
+    unsigned char* ptr = (unsigned char*) mmap(nullptr, huge_size * 2, PROT_READ | PROT_WRITE,
+                                               MAP_ANON | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+    ASSERT_NE((void*) ptr, MAP_FAILED);
+    EXPECT_EQ((unsigned long) ptr & (huge_size - 1), 0UL);
+
+    memset(ptr, 0xaa, huge_size * 2);
+
+    uint64_t pmp;
+    ASSERT_NE(mpagemap(ptr, page_size, &pmp), -1);
+    EXPECT_TRUE(pmp & PAGE_HUGE);
+
+    /* hugetlb mappings can't be split in the middle of a huge page */
+    EXPECT_EQ(munmap(ptr + page_size, page_size), -1);
+    EXPECT_EQ(errno, EINVAL);
+    EXPECT_EQ(mprotect(ptr, page_size, PROT_READ), -1);
+    EXPECT_EQ(errno, EINVAL);
+
+    ASSERT_EQ(munmap(ptr + huge_size, huge_size), 0);
+    EXPECT_EQ(ptr[0], 0xaa);
+    ASSERT_EQ(munmap(ptr, huge_size), 0);
+}
+
+TEST(Vm, FaultsRaceWithMmapMunmap)
+{
+    /* Page faults on one mapping must not be confused by another thread mmap'ing and munmap'ing
+     * right next to it. */
+    const size_t len = 0x400000;
+    std::atomic<bool> stop{false};
+    unsigned char* ptr = (unsigned char*) mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                                               MAP_ANON | MAP_PRIVATE, -1, 0);
+    ASSERT_NE((void*) ptr, MAP_FAILED);
+
+    std::thread t{[&]() {
+        while (!stop.load(std::memory_order_relaxed))
+        {
+            void* p = mmap(nullptr, page_size * 16, PROT_READ | PROT_WRITE,
+                           MAP_ANON | MAP_PRIVATE, -1, 0);
+            if (p == MAP_FAILED)
+                continue;
+            ((volatile unsigned char*) p)[0] = 1;
+            mprotect(p, page_size, PROT_READ);
+            munmap(p, page_size * 16);
+        }
+    }};
+
+    for (int round = 0; round < 4; round++)
+    {
+        for (size_t i = 0; i < len; i += page_size)
+            ptr[i] = (unsigned char) (i / page_size + round);
+        for (size_t i = 0; i < len; i += page_size)
+            EXPECT_EQ(ptr[i], (unsigned char) (i / page_size + round));
+        madvise(ptr, len, MADV_DONTNEED);
+    }
+
+    stop.store(true);
+    t.join();
+    munmap(ptr, len);
+}
+
+TEST(Vm, FileFaultAround)
+{
+    const size_t len = page_size * 16;
+    onx::unique_fd fd = open("/bin/kernel_api_tests", O_RDONLY);
+    ASSERT_TRUE(fd.valid());
+
+    /* Get the pages into the page cache first */
+    std::vector<char> buf(len);
+    ASSERT_EQ(pread(fd.get(), buf.data(), len, 0), (ssize_t) len);
+
+    /* 16 pages, naturally aligned (the window is) */
+    unsigned char* area = (unsigned char*) mmap(nullptr, len * 2, PROT_NONE,
+                                                MAP_ANON | MAP_PRIVATE, -1, 0);
+    ASSERT_NE((void*) area, MAP_FAILED);
+    unsigned char* ptr = (unsigned char*) (((unsigned long) area + len - 1) & -len);
+    ASSERT_NE(mmap(ptr, len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd.get(), 0), MAP_FAILED);
+
+    EXPECT_EQ(ptr[0], (unsigned char) buf[0]);
+
+    /* With fault-around, the neighbouring (cached) pages got mapped by the first fault. Pages
+     * marked for readahead are skipped, so don't expect all of them. */
+    size_t mapped = 0;
+    for (size_t i = page_size; i < len; i += page_size)
+    {
+        uint64_t pmp;
+        ASSERT_NE(mpagemap(ptr + i, page_size, &pmp), -1);
+        if (pmp & PAGE_PRESENT)
+        {
+            EXPECT_FALSE(pmp & PAGE_WRITABLE);
+            mapped++;
+        }
+    }
+
+    EXPECT_GT(mapped, 0UL);
+
+    for (size_t i = 0; i < len; i += page_size)
+        EXPECT_EQ(ptr[i], (unsigned char) buf[i]);
+
+    munmap(area, len * 2);
+}
@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 2025 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/* mm-stress: Compare page reclaim between the classic active/inactive LRU and the multi-gen LRU.
+ * A small, hot file is re-read in between chunks of a large streaming read. A good reclaim policy
+ * keeps the hot file resident while the stream goes by, and doesn't burn too much CPU doing so.
+ * For each LRU mode, we report how much of the hot file survived (through mincore), how long the
+ * hot re-reads took, and the kernel's reclaim and working-set counters.
+ */
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LRU_GEN_ENABLED "/sys/vm/lru_gen_enabled"
+#define RECLAIM_STAT    "/sys/vm/reclaim_stat"
+#define WORKINGSET_STAT "/sys/vm/workingset_stat"
+
+#define IO_SIZE   (1024 * 1024)
+#define MAX_STATS 8
+
+struct stat_file
+{
+    int nr;
+    char names[MAX_STATS][32];
+    unsigned long values[MAX_STATS];
+};
+
+struct run_result
+{
+    unsigned long hot_ns;
+    unsigned long resident;
+    unsigned long samples;
+    struct stat_file reclaim;
+    struct stat_file workingset;
+};
+
+static char *iobuf;
+static long pagesz;
+
+static unsigned long clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void read_stats(const char *path, struct stat_file *sf)
+{
+    FILE *f = fopen(path, "r");
+    sf->nr = 0;
+    if (!f)
+        return;
+
+    while (sf->nr < MAX_STATS &&
+           fscanf(f, "%31s %lu", sf->names[sf->nr], &sf->values[sf->nr]) == 2)
+        sf->nr++;
+    fclose(f);
+}
+
+static unsigned long *stat_lookup(struct stat_file *sf, const char *name)
+{
+    for (int i = 0; i < sf->nr; i++)
+        if (!strcmp(sf->names[i], name))
+            return &sf->values[i];
+    return NULL;
+}
+
+static void stats_delta(struct stat_file *after, const struct stat_file *before)
+{
+    unsigned long *ratio, *ns, *reclaimed;
+
+    for (int i = 0; i < after->nr && i < before->nr; i++)
+        after->values[i] -= before->values[i];
+
+    /* Ratios don't subtract, recompute the reclaim cost for this run */
+    ratio = stat_lookup(after, "ns_per_reclaimed");
+    ns = stat_lookup(after, "reclaim_ns");
+    reclaimed = stat_lookup(after, "reclaimed");
+    if (ratio && ns && reclaimed)
+        *ratio = *reclaimed ? *ns / *reclaimed : 0;
+}
+
+static bool lru_gen_set(int enabled)
+{
+    int fd = open(LRU_GEN_ENABLED, O_WRONLY);
+    if (fd < 0)
+        return false;
+    bool ok = write(fd, enabled ? "1" : "0", 1) == 1;
+    close(fd);
+    return ok;
+}
+
+static int lru_gen_get(void)
+{
+    char c = '0';
+    int fd = open(LRU_GEN_ENABLED, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (read(fd, &c, 1) != 1)
+        c = '0';
+    close(fd);
+    return c == '1';
+}
+
+static int create_file(const char *dir, const char *name, size_t size)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        err(1, "open %s", path);
+
+    for (size_t off = 0; off < size; off += IO_SIZE)
+    {
+        size_t len = size - off < IO_SIZE ? size - off : IO_SIZE;
+        memset(iobuf, (int) (off / IO_SIZE), len);
+        if (pwrite(fd, iobuf, len, off) != (ssize_t) len)
+            err(1, "pwrite %s", path);
+    }
+
+    if (fsync(fd) < 0)
+        err(1, "fsync %s", path);
+    /* Don't leave the files behind, the fds keep them alive */
+    unlink(path);
+    return fd;
+}
+
+static void read_range(int fd, size_t off, size_t len)
+{
+    while (len > 0)
+    {
+        size_t chunk = len < IO_SIZE ? len : IO_SIZE;
+        ssize_t st = pread(fd, iobuf, chunk, off);
+        if (st < 0)
+            err(1, "pread");
+        if (st == 0)
+            break;
+        off += st;
+        len -= st;
+    }
+}
+
+static unsigned long count_resident(void *map, size_t size, unsigned char *vec)
+{
+    unsigned long nr = 0;
+    size_t pages = (size + pagesz - 1) / pagesz;
+
+    if (mincore(map, size, vec) < 0)
+        err(1, "mincore");
+    for (size_t i = 0; i < pages; i++)
+        nr += vec[i] & 1;
+    return nr;
+}
+
+static void run(int hotfd, size_t hotsize, int streamfd, size_t streamsize, int rounds,
+                struct run_result *res)
+{
+    struct stat_file reclaim, workingset;
+    size_t chunk = streamsize / rounds;
+    unsigned char *vec;
+    void *map;
+
+    map = mmap(NULL, hotsize, PROT_READ, MAP_SHARED, hotfd, 0);
+    if (map == MAP_FAILED)
+        err(1, "mmap");
+    vec = malloc((hotsize + pagesz - 1) / pagesz);
+    if (!vec)
+        err(1, "malloc");
+
+    memset(res, 0, sizeof(*res));
+    /* Warm the hot file up, and touch it twice so it's considered active */
+    read_range(hotfd, 0, hotsize);
+    read_range(hotfd, 0, hotsize);
+
+    read_stats(RECLAIM_STAT, &reclaim);
+    read_stats(WORKINGSET_STAT, &workingset);
+
+    for (int i = 0; i < rounds; i++)
+    {
+        read_range(streamfd, i * chunk, chunk);
+
+        /* Sample residency before the re-read pulls the hot file back in */
+        res->resident += count_resident(map, hotsize, vec);
+        res->samples += (hotsize + pagesz - 1) / pagesz;
+
+        unsigned long start = clock_ns();
+        read_range(hotfd, 0, hotsize);
+        res->hot_ns += clock_ns() - start;
+    }
+
+    read_stats(RECLAIM_STAT, &res->reclaim);
+    read_stats(WORKINGSET_STAT, &res->workingset);
+    stats_delta(&res->reclaim, &reclaim);
+    stats_delta(&res->workingset, &workingset);
+
+    munmap(map, hotsize);
+    free(vec);
+}
+
+static void print_stats(const char *prefix, const struct stat_file *sf)
+{
+    for (int i = 0; i < sf->nr; i++)
+        printf("  %s.%s: %lu\n", prefix, sf->names[i], sf->values[i]);
+}
+
+static void print_result(const char *mode, const struct run_result *res, int rounds)
+{
+    printf("%s:\n", mode);
+    printf("  hot set hit rate: %.2f%%\n",
+           res->samples ? res->resident * 100.0 / res->samples : 0.0);
+    printf("  hot re-read: %lu us/round\n", res->hot_ns / rounds / 1000);
+    print_stats("reclaim", &res->reclaim);
+    print_stats("workingset", &res->workingset);
+}
+
+static void usage(void)
+{
+    printf("Usage: mm-stress [OPTIONS] [directory]\n"
+           "Re-reads a hot file in between chunks of a large streaming read, once with the\n"
+           "classic LRU and once with the multi-gen LRU. The stream should be larger than RAM.\n"
+           "  -H, --hot SIZE_MB      size of the hot file (default 64)\n"
+           "  -s, --stream SIZE_MB   size of the streaming file (default 1024)\n"
+           "  -r, --rounds N         number of stream chunks (default 16)\n"
+           "  -h, --help             print this help message\n");
+}
+
+static const struct option options[] = {
+    {"hot", required_argument, NULL, 'H'},
+    {"stream", required_argument, NULL, 's'},
+    {"rounds", required_argument, NULL, 'r'},
+    {"help", no_argument, NULL, 'h'},
+    {},
+};
+
+int main(int argc, char **argv)
+{
+    size_t hotsize = 64UL << 20, streamsize = 1024UL << 20;
+    struct run_result results[2];
+    const char *dir = ".";
+    int rounds = 16;
+    int opt, orig;
+
+    while ((opt = getopt_long(argc, argv, "H:s:r:h", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'H':
+                hotsize = strtoul(optarg, NULL, 0) << 20;
+                break;
+            case 's':
+                streamsize = strtoul(optarg, NULL, 0) << 20;
+                break;
+            case 'r':
+                rounds = atoi(optarg);
+                break;
+            case 'h':
+                usage();
+                return 0;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if (optind < argc)
+        dir = argv[optind];
+    if (!hotsize || !streamsize || rounds <= 0)
+        errx(1, "sizes and rounds must be positive");
+
+    orig = lru_gen_get();
+    if (orig < 0)
+        errx(1, "%s: not supported by this kernel", LRU_GEN_ENABLED);
+
+    pagesz = sysconf(_SC_PAGESIZE);
+    iobuf = malloc(IO_SIZE);
+    if (!iobuf)
+        err(1, "malloc");
+
+    printf("mm-stress: hot %zu MiB, stream %zu MiB, %d rounds\n", hotsize >> 20, streamsize >> 20,
+           rounds);
+    int streamfd = create_file(dir, "mm-stress.stream", streamsize);
+
+    for (int mode = 0; mode < 2; mode++)
+    {
+        if (!lru_gen_set(mode))
+            err(1, "%s", LRU_GEN_ENABLED);
+        /* Start each mode off with a fresh hot file, so none of its history carries over */
+        int hotfd = create_file(dir, "mm-stress.hot", hotsize);
+        run(hotfd, hotsize, streamfd, streamsize, rounds, &results[mode]);
+        close(hotfd);
+    }
+
+    lru_gen_set(orig);
+    close(streamfd);
+
+    print_result("classic LRU", &results[0], rounds);
+    print_result("multi-gen LRU", &results[1], rounds);
+    return 0;
+}
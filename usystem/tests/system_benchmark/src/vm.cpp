@@ -40,3 +40,73 @@ static void write_fault_bench(benchmark::State& state)
 }
 
 BENCHMARK(write_fault_bench);
+
+#define HUGE_SIZE 0x200000UL
+
+struct huge_region
+{
+    void* map;
+    unsigned char* start;
+    size_t len;
+
+    huge_region(size_t len, int advice) : len{len}
+    {
+        map = mmap(nullptr, len + HUGE_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE,
+                   -1, 0);
+        assert(map != MAP_FAILED);
+        start = (unsigned char*) (((unsigned long) map + HUGE_SIZE - 1) & -HUGE_SIZE);
+        madvise(start, len, advice);
+    }
+
+    ~huge_region()
+    {
+        munmap(map, len + HUGE_SIZE);
+    }
+};
+
+/* Fault in a 2MiB aligned region page by page, with or without THPs */
+static void huge_fault_bench(benchmark::State& state)
+{
+    const size_t len = HUGE_SIZE * state.range(0);
+    const int advice = state.range(1) ? MADV_HUGEPAGE : MADV_NOHUGEPAGE;
+    for (auto _ : state)
+    {
+        huge_region region{len, advice};
+        for (size_t i = 0; i < len; i += 4096)
+            ((volatile unsigned char*) region.start)[i] = 1;
+        benchmark::ClobberMemory();
+    }
+
+    state.SetBytesProcessed(state.iterations() * len);
+}
+
+BENCHMARK(huge_fault_bench)->ArgsProduct({{1, 16}, {0, 1}})->ArgNames({"2MiB", "thp"});
+
+/* Random accesses over a large region, which mostly measures TLB reach */
+static void tlb_random_access_bench(benchmark::State& state)
+{
+    const size_t len = HUGE_SIZE * 128;
+    const int advice = state.range(0) ? MADV_HUGEPAGE : MADV_NOHUGEPAGE;
+    huge_region region{len, advice};
+    unsigned char* ptr = region.start;
+    unsigned long x = 88172645463325252UL;
+
+    for (size_t i = 0; i < len; i += 4096)
+        ptr[i] = 1;
+
+    for (auto _ : state)
+    {
+        for (int i = 0; i < 4096; i++)
+        {
+            /* xorshift64 */
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            benchmark::DoNotOptimize(((volatile unsigned char*) ptr)[x % len]);
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * 4096);
+}
+
+BENCHMARK(tlb_random_access_bench)->Arg(0)->Arg(1)->ArgName("thp");